@@ -0,0 +1,470 @@
+// duct_bench: ping-pong latency and one-way streaming throughput across transports, message sizes,
+// pipe / thread counts and wrapper stacks, in one process (both ends of every pipe).
+//
+//   duct_bench                       full sweep, table on stdout
+//   duct_bench --json > run.json     same, as a JSON array of cases
+//   duct_bench --quick               short runs, for a smoke test
+//   duct_bench --transports tcp,shm --sizes 16,65536 --pipes 1,4 --threads 2 --wrappers qos --seconds 2
+//
+// Allocations are every operator new in the process (both ends, library and bench) per message;
+// syscalls and copies come from the pipes' own instrumentation (MetricsOptions), both ends summed.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "duct/duct.h"
+#include "duct/logging.h"
+#include "duct/message.h"
+#include "duct/message_pool.h"
+
+#if defined(_WIN32)
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+namespace {
+
+std::atomic<std::uint64_t> g_allocations{0};
+
+}  // namespace
+
+void* operator new(std::size_t n) {
+  g_allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void* p = std::malloc(n == 0 ? 1 : n)) return p;
+  throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+enum class Mode { kPingPong, kStream };
+enum class Wrapper { kNone, kQos, kReconnect };
+
+const char* mode_name(Mode m) { return m == Mode::kPingPong ? "pingpong" : "stream"; }
+
+const char* wrapper_name(Wrapper w) {
+  switch (w) {
+    case Wrapper::kNone:
+      return "none";
+    case Wrapper::kQos:
+      return "qos";
+    case Wrapper::kReconnect:
+      return "reconnect";
+  }
+  return "?";
+}
+
+struct Config {
+  std::vector<std::string> transports{"inproc", "tcp", "uds", "shm", "pipe"};
+  std::vector<std::size_t> sizes{16, 256, 4096, 65536, 1 << 20};
+  std::vector<std::size_t> pipes{1, 4};
+  std::size_t threads = 1;  // senders per pipe (stream)
+  std::vector<Wrapper> wrappers{Wrapper::kNone, Wrapper::kQos, Wrapper::kReconnect};
+  std::vector<Mode> modes{Mode::kPingPong, Mode::kStream};
+  std::chrono::milliseconds duration{1000};
+  bool json = false;
+};
+
+struct Case {
+  Mode mode;
+  std::string transport;
+  std::size_t size;
+  std::size_t pipes;
+  std::size_t threads;
+  Wrapper wrapper;
+};
+
+struct Outcome {
+  std::string error;  // the case did not run
+  std::uint64_t messages = 0;
+  double seconds = 0;
+  duct::HistogramSnapshot rtt;  // pingpong, microseconds
+  double allocations = 0;       // per message
+  double syscalls = 0;
+  double copies = 0;
+};
+
+std::string address_for(const std::string& transport, int n) {
+  const std::string name = "duct_bench_" + std::to_string(getpid()) + "_" + std::to_string(n);
+  if (transport == "inproc") return "inproc://" + name;
+  if (transport == "tcp") return "tcp://127.0.0.1:0";
+  if (transport == "uds") return "uds:///tmp/" + name + ".sock";
+  if (transport == "shm") return "shm://" + name;
+  if (transport == "pipe") return "pipe://" + name;
+  return transport + "://";
+}
+
+double counter(const std::string& name) { return duct::MetricRegistry::instance().get_counter(name)->value(); }
+
+// Both ends of `pipes` connections through one listener; dialed pipes carry `wrapper`.
+struct Connections {
+  std::unique_ptr<duct::Listener> listener;
+  std::vector<std::unique_ptr<duct::Pipe>> dialed;
+  std::vector<std::unique_ptr<duct::Pipe>> accepted;
+};
+
+duct::Result<Connections> connect(const Case& c, const std::string& prefix, int n) {
+  Connections out;
+  duct::ListenOptions lopt;
+  lopt.metrics.enabled = true;
+  lopt.metrics.prefix = prefix + ".rx";
+  auto lis = duct::listen(address_for(c.transport, n), lopt);
+  if (!lis.ok()) return lis.status();
+  out.listener = std::move(lis.value());
+  auto addr = out.listener->local_address();
+  if (!addr.ok()) return addr.status();
+
+  duct::DialOptions dopt;
+  dopt.timeout = std::chrono::seconds(5);
+  dopt.metrics.enabled = true;
+  dopt.metrics.prefix = prefix + ".tx";
+  if (c.wrapper == Wrapper::kNone) dopt.qos.snd_hwm_bytes = 0;
+  // close() then writes out what is still queued, so a stream run loses nothing at the end.
+  dopt.qos.linger = std::chrono::seconds(10);
+  if (c.wrapper == Wrapper::kReconnect) dopt.reconnect.enabled = true;
+  for (std::size_t i = 0; i < c.pipes; ++i) {
+    duct::Result<std::unique_ptr<duct::Pipe>> accepted = duct::Status::closed("not accepted");
+    std::thread t([&] { accepted = out.listener->accept(); });
+    auto dialed = duct::dial(addr.value(), dopt);
+    t.join();
+    if (!dialed.ok()) return dialed.status();
+    if (!accepted.ok()) return accepted.status();
+    out.dialed.push_back(std::move(dialed.value()));
+    out.accepted.push_back(std::move(accepted.value()));
+  }
+  return out;
+}
+
+void close_all(Connections& conns) {
+  for (auto& p : conns.dialed) p->close();
+  for (auto& p : conns.accepted) p->close();
+  conns.listener->close();
+}
+
+duct::Message payload(std::size_t size) {
+  duct::Message m = duct::Message::allocate(size);
+  std::memset(m.data(), 0x5a, size);
+  return m;
+}
+
+// Each pipe: the dialing side sends and waits for the echo, one message in flight.
+void run_pingpong(Connections& conns, const Case& c, const Config& cfg, Outcome* out) {
+  std::atomic<bool> stop{false};
+  std::atomic<std::uint64_t> total{0};
+  std::vector<duct::HistogramSnapshot> rtts(c.pipes);
+  std::vector<std::string> errors(c.pipes);
+  std::vector<std::thread> threads;
+  duct::RecvOptions ropt;
+  ropt.timeout = std::chrono::seconds(5);
+  for (std::size_t i = 0; i < c.pipes; ++i) {
+    threads.emplace_back([&, i] {
+      duct::Pipe& p = *conns.accepted[i];
+      for (;;) {
+        auto m = p.recv(ropt);
+        if (!m.ok() || stop.load(std::memory_order_relaxed)) return;
+        if (!p.send(m.value(), {}).ok()) return;
+      }
+    });
+    threads.emplace_back([&, i] {
+      duct::Pipe& p = *conns.dialed[i];
+      duct::Histogram rtt("rtt_us");
+      const duct::Message m = payload(c.size);
+      const auto end = Clock::now() + cfg.duration;
+      std::uint64_t n = 0;
+      while (Clock::now() < end) {
+        const auto start = Clock::now();
+        auto st = p.send(m, {});
+        if (!st.ok()) {
+          errors[i] = st.status().message();
+          break;
+        }
+        auto r = p.recv(ropt);
+        if (!r.ok()) {
+          errors[i] = r.status().message();
+          break;
+        }
+        rtt.observe(std::chrono::duration<double, std::micro>(Clock::now() - start).count());
+        ++n;
+      }
+      rtts[i] = rtt.snapshot();
+      total.fetch_add(n, std::memory_order_relaxed);
+    });
+  }
+  // Dialing threads first (odd indices), then release the echo threads.
+  for (std::size_t i = 1; i < threads.size(); i += 2) threads[i].join();
+  stop = true;
+  for (auto& p : conns.dialed) (void)p->send(duct::Message::from_string("x"), {});
+  for (std::size_t i = 0; i < threads.size(); i += 2) threads[i].join();
+
+  for (const auto& e : errors) {
+    if (!e.empty()) out->error = e;
+  }
+  out->rtt = rtts[0];
+  for (std::size_t i = 1; i < rtts.size(); ++i) out->rtt.merge(rtts[i]);
+  out->messages = total.load() * 2;  // each round trip is two messages
+  out->seconds = std::chrono::duration<double>(cfg.duration).count();
+}
+
+// Each pipe: `threads` senders on the dialing side stream for the duration; the accepting side
+// counts until everything sent has arrived.
+void run_stream(Connections& conns, const Case& c, const Config& cfg, Outcome* out) {
+  std::atomic<std::uint64_t> sent{0};
+  std::atomic<std::uint64_t> received{0};
+  std::atomic<bool> senders_done{false};
+  std::vector<std::thread> senders;
+  std::vector<std::thread> receivers;
+  // A raw pipe is not safe to send on from several threads; the wrappers queue under their own lock.
+  std::vector<std::mutex> locks(c.pipes);
+  const bool serialize = c.wrapper == Wrapper::kNone && c.threads > 1;
+  std::string error;
+  std::atomic<bool> failed{false};
+  const auto start = Clock::now();
+  const auto end = start + cfg.duration;
+  for (std::size_t i = 0; i < c.pipes; ++i) {
+    for (std::size_t t = 0; t < c.threads; ++t) {
+      senders.emplace_back([&, i] {
+        const duct::Message m = payload(c.size);
+        std::uint64_t n = 0;
+        while (Clock::now() < end) {
+          // A batch keeps the clock check off the per-message path.
+          for (int k = 0; k < 16; ++k, ++n) {
+            std::unique_lock<std::mutex> lock(locks[i], std::defer_lock);
+            if (serialize) lock.lock();
+            if (!conns.dialed[i]->send(m, {}).ok()) {
+              failed = true;
+              sent.fetch_add(n, std::memory_order_relaxed);
+              return;
+            }
+          }
+        }
+        sent.fetch_add(n, std::memory_order_relaxed);
+      });
+    }
+    receivers.emplace_back([&, i] {
+      duct::Message batch[64];
+      duct::RecvOptions ropt;
+      ropt.timeout = std::chrono::milliseconds(100);
+      int idle = 0;
+      while (idle < 50) {
+        if (senders_done && received.load() >= sent.load()) return;
+        auto n = conns.accepted[i]->recv_batch(batch, ropt);
+        if (!n.ok()) {
+          if (n.status().code() != duct::StatusCode::kTimeout) return;
+          if (senders_done) ++idle;
+          continue;
+        }
+        received.fetch_add(n.value(), std::memory_order_relaxed);
+      }
+    });
+  }
+  for (auto& t : senders) t.join();
+  // Closing lingers until a queueing wrapper has written everything; a raw pipe's recv() has no
+  // timeout, so receivers learn the stream ended from kClosed once they have drained it.
+  for (auto& p : conns.dialed) p->close();
+  senders_done = true;
+  for (auto& t : receivers) t.join();
+  out->seconds = std::chrono::duration<double>(Clock::now() - start).count();
+  out->messages = received.load();
+  if (failed) error = "send failed";
+  if (received.load() < sent.load()) error = "lost " + std::to_string(sent.load() - received.load()) + " messages";
+  out->error = error;
+}
+
+Outcome run_case(const Case& c, const Config& cfg, int n) {
+  Outcome out;
+  const std::string prefix = "bench." + std::to_string(n);
+  auto conns = connect(c, prefix, n);
+  if (!conns.ok()) {
+    out.error = conns.status().message();
+    return out;
+  }
+  const std::uint64_t allocations = g_allocations.load();
+  if (c.mode == Mode::kPingPong) {
+    run_pingpong(conns.value(), c, cfg, &out);
+  } else {
+    run_stream(conns.value(), c, cfg, &out);
+  }
+  const double used = static_cast<double>(g_allocations.load() - allocations);
+  close_all(conns.value());
+  if (out.messages != 0) {
+    const double msgs = static_cast<double>(out.messages);
+    out.allocations = used / msgs;
+    double syscalls = 0;
+    double copies = 0;
+    for (const char* side : {".tx", ".rx"}) {
+      syscalls += counter(prefix + side + ".write_syscalls") + counter(prefix + side + ".read_syscalls");
+      copies += counter(prefix + side + ".copies");
+    }
+    out.syscalls = syscalls / msgs;
+    out.copies = copies / msgs;
+  }
+  return out;
+}
+
+std::vector<std::string> split(const std::string& s) {
+  std::vector<std::string> out;
+  std::stringstream in(s);
+  std::string part;
+  while (std::getline(in, part, ',')) {
+    if (!part.empty()) out.push_back(part);
+  }
+  return out;
+}
+
+std::vector<std::size_t> split_sizes(const std::string& s) {
+  std::vector<std::size_t> out;
+  for (const auto& part : split(s)) out.push_back(static_cast<std::size_t>(std::stoull(part)));
+  return out;
+}
+
+int usage(const char* argv0) {
+  std::fprintf(stderr,
+               "usage: %s [--json] [--quick] [--seconds S] [--transports inproc,tcp,uds,shm,pipe]\n"
+               "          [--sizes 16,...,1048576] [--pipes 1,4] [--threads N]\n"
+               "          [--wrappers none,qos,reconnect] [--modes pingpong,stream]\n",
+               argv0);
+  return 2;
+}
+
+bool parse(int argc, char** argv, Config* cfg) {
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    auto value = [&]() -> std::string { return i + 1 < argc ? argv[++i] : ""; };
+    if (arg == "--json") {
+      cfg->json = true;
+    } else if (arg == "--quick") {
+      cfg->duration = std::chrono::milliseconds(100);
+      cfg->sizes = {16, 4096, 1 << 20};
+      cfg->pipes = {1};
+    } else if (arg == "--seconds") {
+      cfg->duration = std::chrono::milliseconds(static_cast<std::int64_t>(std::stod(value()) * 1000));
+    } else if (arg == "--transports") {
+      cfg->transports = split(value());
+    } else if (arg == "--sizes") {
+      cfg->sizes = split_sizes(value());
+    } else if (arg == "--pipes") {
+      cfg->pipes = split_sizes(value());
+    } else if (arg == "--threads") {
+      cfg->threads = std::max<std::size_t>(1, std::stoull(value()));
+    } else if (arg == "--wrappers") {
+      cfg->wrappers.clear();
+      for (const auto& w : split(value())) {
+        if (w == "none") cfg->wrappers.push_back(Wrapper::kNone);
+        else if (w == "qos") cfg->wrappers.push_back(Wrapper::kQos);
+        else if (w == "reconnect") cfg->wrappers.push_back(Wrapper::kReconnect);
+        else return false;
+      }
+    } else if (arg == "--modes") {
+      cfg->modes.clear();
+      for (const auto& m : split(value())) {
+        if (m == "pingpong") cfg->modes.push_back(Mode::kPingPong);
+        else if (m == "stream") cfg->modes.push_back(Mode::kStream);
+        else return false;
+      }
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+void print_json(const Case& c, const Outcome& o, bool first) {
+  std::printf("%s\n  {\"mode\": \"%s\", \"transport\": \"%s\", \"size\": %zu, \"pipes\": %zu, \"threads\": %zu, "
+              "\"wrapper\": \"%s\"",
+              first ? "" : ",", mode_name(c.mode), c.transport.c_str(), c.size, c.pipes, c.threads,
+              wrapper_name(c.wrapper));
+  if (!o.error.empty()) {
+    std::string escaped;
+    for (char ch : o.error) {
+      if (ch == '"' || ch == '\\') escaped += '\\';
+      escaped += ch;
+    }
+    std::printf(", \"error\": \"%s\"", escaped.c_str());
+  }
+  if (o.messages != 0) {
+    const double rate = static_cast<double>(o.messages) / o.seconds;
+    std::printf(", \"messages\": %llu, \"seconds\": %.3f, \"msgs_per_sec\": %.0f, \"mb_per_sec\": %.2f",
+                static_cast<unsigned long long>(o.messages), o.seconds, rate,
+                rate * static_cast<double>(c.size) / (1024.0 * 1024.0));
+    if (c.mode == Mode::kPingPong) {
+      std::printf(", \"rtt_us\": {\"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}", o.rtt.percentile(0.5),
+                  o.rtt.percentile(0.99), o.rtt.percentile(0.999), o.rtt.max());
+    }
+    std::printf(", \"allocs_per_msg\": %.3f, \"syscalls_per_msg\": %.3f, \"copies_per_msg\": %.3f", o.allocations,
+                o.syscalls, o.copies);
+  }
+  std::printf("}");
+}
+
+void print_row(const Case& c, const Outcome& o) {
+  std::printf("%-8s %-5s %8zu %5zu %7zu %-9s ", mode_name(c.mode), c.transport.c_str(), c.size, c.pipes, c.threads,
+              wrapper_name(c.wrapper));
+  if (o.messages == 0) {
+    std::printf("skipped: %s\n", o.error.c_str());
+    return;
+  }
+  const double rate = static_cast<double>(o.messages) / o.seconds;
+  if (c.mode == Mode::kPingPong) {
+    std::printf("p50 %8.1fus p99 %8.1fus p999 %8.1fus", o.rtt.percentile(0.5), o.rtt.percentile(0.99),
+                o.rtt.percentile(0.999));
+  } else {
+    std::printf("%10.0f msg/s %9.1f MB/s          ", rate, rate * static_cast<double>(c.size) / (1024.0 * 1024.0));
+  }
+  std::printf("  alloc %6.2f  sys %6.2f  copy %5.2f", o.allocations, o.syscalls, o.copies);
+  if (!o.error.empty()) std::printf("  (%s)", o.error.c_str());
+  std::printf("\n");
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Config cfg;
+  if (!parse(argc, argv, &cfg)) return usage(argv[0]);
+
+  if (cfg.json) {
+    std::printf("[");
+  } else {
+    std::printf("%-8s %-5s %8s %5s %7s %-9s result (allocs, syscalls and copies per message)\n", "mode", "via",
+                "size", "pipes", "threads", "wrapper");
+  }
+  int n = 0;
+  bool first = true;
+  for (Mode mode : cfg.modes) {
+    for (const auto& transport : cfg.transports) {
+      for (std::size_t size : cfg.sizes) {
+        for (std::size_t pipes : cfg.pipes) {
+          for (Wrapper wrapper : cfg.wrappers) {
+            const Case c{mode, transport, size, pipes, mode == Mode::kStream ? cfg.threads : 1, wrapper};
+            const Outcome o = run_case(c, cfg, n++);
+            if (cfg.json) {
+              print_json(c, o, first);
+              first = false;
+            } else {
+              print_row(c, o);
+            }
+            std::fflush(stdout);
+          }
+        }
+      }
+    }
+  }
+  if (cfg.json) std::printf("\n]\n");
+  return 0;
+}
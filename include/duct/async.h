@@ -11,6 +11,8 @@
 #include <vector>
 
 #include "duct/duct.h"
+#include "duct/reactor.h"
+#include "duct/server.h"
 
 namespace duct::async {
 
@@ -123,11 +125,11 @@ inline void async_recv(std::shared_ptr<Pipe> pipe, Callback<Message> callback) {
 // ==============================================================================
 
 /**
- * @brief 简单的事件循环，用于管理多个 Pipe 的 I/O
+ * @brief 事件循环，基于 duct::Reactor（epoll/kqueue/WSAPoll）只为就绪的管道分发回调
  */
 class EventLoop {
  public:
-  EventLoop() = default;
+  EventLoop() : reactor_(Reactor::create().value_or_throw()) {}
   ~EventLoop() { stop(); }
 
   // 禁止拷贝
@@ -137,50 +139,23 @@ class EventLoop {
   /**
    * @brief 添加一个管道到事件循环
    * @param pipe 要管理的管道
-   * @param on_message 收到消息时的回调
-   * @param on_error 发生错误时的回调（可选）
+   * @param on_message 收到消息时的回调（在事件循环线程上执行）
+   * @param on_error 发生错误时的回调（可选；对端正常关闭不算错误，管道随后被移除）
    */
   void add_pipe(std::shared_ptr<Pipe> pipe,
                 MessageCallback on_message,
                 ErrorCallback on_error = nullptr) {
-    std::lock_guard<std::mutex> lock(mutex_);
-    pipes_.push_back({std::move(pipe), std::move(on_message), std::move(on_error)});
-    cv_.notify_one();
+    auto filtered = [on_error](const Status& st) {
+      if (on_error && st.code() != StatusCode::kClosed) on_error(st);
+    };
+    auto added = reactor_->add(std::move(pipe), std::move(on_message), filtered);
+    if (!added.ok()) filtered(added.status());
   }
 
   /**
-   * @brief 启动事件循环（阻塞调用）
+   * @brief 启动事件循环（阻塞调用，直到 stop()）
    */
-  void run() {
-    std::unique_lock<std::mutex> lock(mutex_);
-    while (running_) {
-      // 处理所有管道
-      bool has_activity = false;
-      for (auto& entry : pipes_) {
-        // 尝试接收消息（非阻塞）
-        // 注意：当前实现使用轮询，实际应用中应该使用更高效的机制
-        // 如 epoll/kqueue/IOCP 等
-        auto msg = entry.pipe->recv({.timeout = std::chrono::milliseconds(100)});
-        if (msg.ok()) {
-          has_activity = true;
-          if (entry.on_message) {
-            entry.on_message(msg.value());
-          }
-        } else if (msg.status().code() != StatusCode::kTimeout &&
-                   msg.status().code() != StatusCode::kClosed) {
-          // 发生错误
-          if (entry.on_error) {
-            entry.on_error(msg.status());
-          }
-        }
-      }
-
-      // 如果没有活动，等待新管道添加或停止信号
-      if (!has_activity) {
-        cv_.wait_for(lock, std::chrono::milliseconds(100));
-      }
-    }
-  }
+  void run() { reactor_->run().throw_if_error(); }
 
   /**
    * @brief 在后台线程运行事件循环
@@ -188,8 +163,7 @@ class EventLoop {
   void runInBackground() {
     std::lock_guard<std::mutex> lock(mutex_);
     if (!thread_.joinable()) {
-      running_ = true;
-      thread_ = std::thread([this]() { this->run(); });
+      thread_ = std::thread([this]() { (void)reactor_->run(); });
     }
   }
 
@@ -197,26 +171,20 @@ class EventLoop {
    * @brief 停止事件循环
    */
   void stop() {
+    reactor_->stop();
     std::lock_guard<std::mutex> lock(mutex_);
-    running_ = false;
-    cv_.notify_all();
     if (thread_.joinable()) {
       thread_.join();
     }
   }
 
- private:
-  struct PipeEntry {
-    std::shared_ptr<Pipe> pipe;
-    MessageCallback on_message;
-    ErrorCallback on_error;
-  };
+  // 已注册的管道数量
+  std::size_t size() const { return reactor_->size(); }
 
-  std::vector<PipeEntry> pipes_;
+ private:
+  std::unique_ptr<Reactor> reactor_;
   std::thread thread_;
   std::mutex mutex_;
-  std::condition_variable cv_;
-  bool running_ = true;
 };
 
 // ==============================================================================
@@ -303,54 +271,21 @@ class Channel {
 };
 
 // ==============================================================================
-// 便捷函数：在单独的线程中运行服务器
+// 便捷函数：在后台运行服务器
 // ==============================================================================
 
 /**
- * @brief 在后台线程运行 echo 服务器
+ * @brief 在后台运行 echo 服务器（duct::Server：固定数量的 Reactor 分片线程，而非每连接一个线程）
  * @param address 监听地址
+ * @param opt 分片数、SO_REUSEPORT 等服务器选项
  * @return 可以用于停止服务器的函数
  */
-inline std::function<void()> run_echo_serverInBackground(const std::string& address) {
-  struct ServerState {
-    std::thread thread;
-    std::shared_ptr<Listener> listener;
-    std::atomic<bool> running{true};
-  };
-
-  auto state = std::make_shared<ServerState>();
-
-  state->listener = std::shared_ptr<Listener>(listen(address).value_or_throw().release());
-
-  state->thread = std::thread([state]() {
-    while (state->running) {
-      auto pipe_result = state->listener->accept();
-      if (!pipe_result.ok()) {
-        break;
-      }
-
-      auto pipe = std::shared_ptr<Pipe>(pipe_result.value().release());
-
-      // 为每个连接创建一个处理线程
-      std::thread([pipe]() {
-        while (true) {
-          auto msg = pipe->recv({});
-          if (!msg.ok()) {
-            break;
-          }
-          pipe->send(msg.value(), {});
-        }
-      }).detach();
-    }
-  });
-
-  return [state]() {
-    state->running = false;
-    state->listener->close();
-    if (state->thread.joinable()) {
-      state->thread.join();
-    }
-  };
+inline std::function<void()> run_echo_serverInBackground(const std::string& address,
+                                                         const ServerOptions& opt = {}) {
+  Server::Handlers handlers;
+  handlers.on_message = [](const std::shared_ptr<Pipe>& pipe, const Message& msg) { (void)pipe->send(msg, {}); };
+  auto server = std::shared_ptr<Server>(Server::start(address, std::move(handlers), opt).value_or_throw().release());
+  return [server]() { server->stop(); };
 }
 
 }  // namespace duct::async
@@ -151,6 +151,13 @@ inline DialBuilder uds(std::string_view path) {
   return DialBuilder("uds://" + std::string(path));
 }
 
+/**
+ * @brief 创建一个用于进程内连接的构建器
+ */
+inline DialBuilder inproc(std::string_view name) {
+  return DialBuilder("inproc://" + std::string(name));
+}
+
 /**
  * @brief 创建一个用于 TCP 监听的构建器
  */
@@ -172,6 +179,13 @@ inline ListenBuilder listen_uds(std::string_view path) {
   return ListenBuilder("uds://" + std::string(path));
 }
 
+/**
+ * @brief 创建一个用于进程内监听的构建器
+ */
+inline ListenBuilder listen_inproc(std::string_view name) {
+  return ListenBuilder("inproc://" + std::string(name));
+}
+
 /**
  * @brief 简单连接（使用默认选项）
  * @note convenience 命名空间中的函数返回裸指针，使用 raii 命名空间获取 RAII 包装版本
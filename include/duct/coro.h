@@ -0,0 +1,290 @@
+#pragma once
+
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <optional>
+#include <stop_token>
+#include <string>
+#include <utility>
+
+#include "duct/duct.h"
+#include "duct/message.h"
+#include "duct/reactor.h"
+#include "duct/reqrep.h"
+#include "duct/status.h"
+
+namespace duct {
+
+// C++20 coroutines on a Reactor: a handler is a Task that co_awaits pipe operations, and every
+// suspension resumes on the reactor's loop thread (its executor), so one loop thread runs any
+// number of concurrent handlers without a thread per operation.
+//
+//   Task<void> handle(std::shared_ptr<AsyncPipe> p) {
+//     for (;;) {
+//       auto m = co_await p->recv();
+//       if (!m.ok()) co_return;
+//       (void)co_await p->send(m.value());
+//     }
+//   }
+//   spawn(reactor, handle(AsyncPipe::open(reactor, pipe).value()));
+
+template <class T = void>
+class Task;
+
+namespace detail {
+
+struct TaskPromiseBase {
+  std::coroutine_handle<> continuation;
+  std::exception_ptr error;
+
+  std::suspend_always initial_suspend() noexcept { return {}; }
+
+  // Symmetric transfer: finishing jumps straight to the awaiting coroutine, without growing the stack.
+  struct FinalAwaiter {
+    bool await_ready() noexcept { return false; }
+    template <class P>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+      auto next = h.promise().continuation;
+      return next ? next : std::noop_coroutine();
+    }
+    void await_resume() noexcept {}
+  };
+  FinalAwaiter final_suspend() noexcept { return {}; }
+
+  void unhandled_exception() noexcept { error = std::current_exception(); }
+};
+
+template <class T>
+struct TaskPromise : TaskPromiseBase {
+  std::optional<T> value;
+
+  Task<T> get_return_object() noexcept;
+  template <class U>
+  void return_value(U&& v) {
+    value.emplace(std::forward<U>(v));
+  }
+  T take() {
+    if (error) std::rethrow_exception(error);
+    return std::move(*value);
+  }
+};
+
+template <>
+struct TaskPromise<void> : TaskPromiseBase {
+  Task<void> get_return_object() noexcept;
+  void return_void() noexcept {}
+  void take() {
+    if (error) std::rethrow_exception(error);
+  }
+};
+
+}  // namespace detail
+
+// A lazily started coroutine producing a T. It runs when co_awaited (or spawned), on the thread
+// doing so, and hands its result (or exception) back to the awaiter. Move-only; one awaiter.
+template <class T>
+class [[nodiscard]] Task {
+ public:
+  using promise_type = detail::TaskPromise<T>;
+
+  Task() = default;
+  explicit Task(std::coroutine_handle<promise_type> h) noexcept : h_(h) {}
+  Task(Task&& other) noexcept : h_(std::exchange(other.h_, {})) {}
+  Task& operator=(Task&& other) noexcept {
+    if (this != &other) {
+      if (h_) h_.destroy();
+      h_ = std::exchange(other.h_, {});
+    }
+    return *this;
+  }
+  Task(const Task&) = delete;
+  Task& operator=(const Task&) = delete;
+  ~Task() {
+    if (h_) h_.destroy();
+  }
+
+  bool await_ready() const noexcept { return !h_ || h_.done(); }
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+    h_.promise().continuation = awaiting;
+    return h_;
+  }
+  T await_resume() { return h_.promise().take(); }
+
+ private:
+  std::coroutine_handle<promise_type> h_;
+};
+
+namespace detail {
+
+template <class T>
+Task<T> TaskPromise<T>::get_return_object() noexcept {
+  return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+
+inline Task<void> TaskPromise<void>::get_return_object() noexcept {
+  return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
+
+// Owns a spawned task: starts eagerly and frees itself when the task finishes.
+struct Detached {
+  struct promise_type {
+    Detached get_return_object() noexcept { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() noexcept {}
+    void unhandled_exception() noexcept { std::terminate(); }
+  };
+};
+
+inline Detached run_detached(Task<void> task) { co_await task; }
+
+}  // namespace detail
+
+// Run `task` on `reactor`'s loop thread, which must be running (Reactor::run()). Nothing waits for
+// it; an exception escaping it terminates the process.
+inline void spawn(Reactor& reactor, Task<void> task) {
+  auto t = std::make_shared<Task<void>>(std::move(task));
+  reactor.post([t]() { detail::run_detached(std::move(*t)); });
+}
+
+namespace detail {
+struct AsyncPipeState;  // src/coro.cc
+}  // namespace detail
+
+// A pipe registered with a Reactor for co_await. Messages arrive through the reactor and are handed
+// to waiting recv()s in order (buffered while none waits); waiters resume on the loop thread.
+// recv() and send() may be awaited from any coroutine, but resumption always happens on the loop.
+class AsyncPipe {
+ public:
+  class RecvAwaitable;
+  class SendAwaitable;
+
+  static Result<std::shared_ptr<AsyncPipe>> open(Reactor& reactor, std::shared_ptr<Pipe> pipe);
+  ~AsyncPipe();
+
+  AsyncPipe(const AsyncPipe&) = delete;
+  AsyncPipe& operator=(const AsyncPipe&) = delete;
+
+  // The next message. opt.timeout (0 = none) ends the wait with kTimeout, and a stop request on
+  // `stop` with kCancelled; either leaves the pipe usable. After the pipe fails or the peer closes
+  // it, buffered messages are still returned, then the failure (kClosed).
+  RecvAwaitable recv(const RecvOptions& opt = {}, std::stop_token stop = {});
+
+  // Send without suspending: the result is the pipe's send(). A default dial()ed pipe only queues
+  // (its QosPipe writes in the background), so this does not hold up the loop; on a raw stream
+  // pipe it writes to the socket, and with an io_uring or IOCP reactor the loop does.
+  SendAwaitable send(Message msg, const SendOptions& opt = {});
+
+  // Unregister and close the pipe; pending recv()s finish with kClosed.
+  void close();
+
+  Pipe& pipe();
+
+  class RecvAwaitable {
+   public:
+    bool await_ready();
+    bool await_suspend(std::coroutine_handle<> h);
+    Result<Message> await_resume() { return std::move(result_); }
+
+   private:
+    friend class AsyncPipe;
+    friend struct detail::AsyncPipeState;
+    RecvAwaitable(std::shared_ptr<detail::AsyncPipeState> state, const RecvOptions& opt, std::stop_token stop)
+        : state_(std::move(state)), opt_(opt), stop_(std::move(stop)) {}
+
+    struct RequestStop {
+      std::shared_ptr<detail::AsyncPipeState> state;
+      std::uint64_t ticket;
+      void operator()() const noexcept;
+    };
+
+    std::shared_ptr<detail::AsyncPipeState> state_;
+    RecvOptions opt_;
+    std::stop_token stop_;
+    std::optional<std::stop_callback<RequestStop>> on_stop_;
+    Result<Message> result_{Status::closed("not received")};
+  };
+
+  class SendAwaitable {
+   public:
+    bool await_ready() noexcept { return true; }
+    void await_suspend(std::coroutine_handle<>) noexcept {}
+    Result<void> await_resume() { return std::move(result_); }
+
+   private:
+    friend class AsyncPipe;
+    explicit SendAwaitable(Result<void> result) : result_(std::move(result)) {}
+    Result<void> result_;
+  };
+
+ private:
+  explicit AsyncPipe(std::shared_ptr<detail::AsyncPipeState> state);
+
+  std::shared_ptr<detail::AsyncPipeState> state_;
+};
+
+// co_await sleep_for(reactor, d): resume on the loop thread after `d` (Reactor::post_after).
+class SleepAwaitable {
+ public:
+  SleepAwaitable(Reactor& reactor, std::chrono::milliseconds delay) : reactor_(reactor), delay_(delay) {}
+  bool await_ready() const noexcept { return delay_.count() <= 0; }
+  void await_suspend(std::coroutine_handle<> h) {
+    reactor_.post_after(delay_, [h]() { h.resume(); });
+  }
+  void await_resume() const noexcept {}
+
+ private:
+  Reactor& reactor_;
+  std::chrono::milliseconds delay_;
+};
+
+inline SleepAwaitable sleep_for(Reactor& reactor, std::chrono::milliseconds delay) { return {reactor, delay}; }
+
+// co_await dial_async(reactor, address): dial() on the library's shared worker pool (connect still
+// blocks), resuming on the loop thread with the result. opt.timeout bounds the connect.
+class DialAwaitable {
+ public:
+  DialAwaitable(Reactor& reactor, std::string address, const DialOptions& opt)
+      : reactor_(reactor), address_(std::move(address)), opt_(opt) {}
+  bool await_ready() const noexcept { return false; }
+  void await_suspend(std::coroutine_handle<> h);
+  Result<std::unique_ptr<Pipe>> await_resume() { return std::move(result_); }
+
+ private:
+  Reactor& reactor_;
+  std::string address_;
+  DialOptions opt_;
+  Result<std::unique_ptr<Pipe>> result_{Status::closed("not dialed")};
+};
+
+inline DialAwaitable dial_async(Reactor& reactor, std::string address, const DialOptions& opt = {}) {
+  return DialAwaitable(reactor, std::move(address), opt);
+}
+
+// co_await request_async(reactor, requester, msg): Requester::call, resuming on the loop thread
+// with the reply (or its failure). Any number may be outstanding on one requester.
+class RequestAwaitable {
+ public:
+  RequestAwaitable(Reactor& reactor, Requester& requester, Message request, const RequestOptions& opt)
+      : reactor_(reactor), requester_(requester), request_(std::move(request)), opt_(opt) {}
+  bool await_ready() const noexcept { return false; }
+  void await_suspend(std::coroutine_handle<> h);
+  Result<Message> await_resume() { return std::move(result_); }
+
+ private:
+  Reactor& reactor_;
+  Requester& requester_;
+  Message request_;
+  RequestOptions opt_;
+  Result<Message> result_{Status::closed("not requested")};
+};
+
+inline RequestAwaitable request_async(Reactor& reactor, Requester& requester, Message request,
+                                      const RequestOptions& opt = {}) {
+  return RequestAwaitable(reactor, requester, std::move(request), opt);
+}
+
+}  // namespace duct
@@ -5,7 +5,9 @@
 #include <cstdint>
 #include <functional>
 #include <memory>
+#include <span>
 #include <string>
+#include <vector>
 
 #include "duct/address.h"
 #include "duct/message.h"
@@ -41,6 +43,11 @@ struct ReconnectPolicy {
   // Heartbeat/keepalive interval. For tcp:// this maps to OS TCP keepalive settings.
   // Zero means disabled.
   std::chrono::milliseconds heartbeat_interval{5'000};
+
+  // While disconnected, send() queues up to this many bytes instead of waiting for the connection;
+  // they are written in order, before anything newer, once it is back. A send that does not fit
+  // waits as usual. Zero means every send waits. Dropped on close() or after max_attempts.
+  std::size_t buffer_bytes = 0;
 };
 
 enum class ConnectionState {
@@ -53,6 +60,62 @@ enum class ConnectionState {
 
 using ConnectionCallback = std::function<void(ConnectionState, const std::string& reason)>;
 
+// Token bucket limits applied by QosPipe::send(); a zero rate leaves that dimension unlimited, a
+// zero burst allows one second's worth at once.
+struct RateLimit {
+  std::uint64_t bytes_per_sec = 0;
+  std::uint64_t burst_bytes = 0;
+  std::uint64_t msgs_per_sec = 0;
+  std::uint64_t burst_msgs = 0;
+
+  bool enabled() const { return bytes_per_sec != 0 || msgs_per_sec != 0; }
+};
+
+struct ChannelRateLimit {
+  std::uint16_t channel = 0;
+  RateLimit limit;
+};
+
+struct ChannelWeight {
+  std::uint16_t channel = 0;
+  std::uint32_t weight = 1;
+};
+
+// Write coalescing in QosPipe (auto-cork): instead of writing as soon as a send is queued, the
+// writer waits until min_bytes are queued, the oldest queued message has waited max_delay, or
+// Pipe::flush() is called, whichever comes first, and then writes everything queued. Sockets keep
+// TCP_NODELAY, so the kernel adds no Nagle delay of its own. The wait holds one of the shared
+// workers, so budgets are meant to be short (microseconds to a millisecond or two). A zero
+// max_delay turns it off.
+struct FlushPolicy {
+  std::size_t min_bytes = 16 * 1024;
+  std::chrono::microseconds max_delay{0};
+};
+
+// At-least-once delivery (QosOptions::reliability = kAtLeastOnce, set on both ends). Messages carry
+// sequence numbers and stay buffered until the peer acknowledges them. Acks are cumulative and ride
+// on reverse traffic, or go out on their own once ack_delay passes or ack_every messages are
+// waiting, optionally with a SACK bitmap. A session outlives its connection: with
+// ReconnectPolicy::enabled the two ends resume from what each has received, and the receiver drops
+// duplicates. Upper layers should still be idempotent.
+struct AtLeastOnceOptions {
+  // Messages sent but not yet acknowledged; send() waits (up to its timeout) while this many are out.
+  // It also bounds what the receiving side reads ahead of recv().
+  std::size_t window_msgs = 4096;
+  std::chrono::milliseconds ack_delay{5};
+  std::size_t ack_every = 256;
+  // Acks also report up to 64 messages received past a gap, so only the gap is sent again.
+  bool sack = true;
+  // An unacknowledged message is sent again after rto, doubling per attempt (up to 64x). The pipe
+  // fails after max_retransmits attempts for one message; 0 means no limit.
+  std::chrono::milliseconds rto{1'000};
+  int max_retransmits = 0;
+  // Bound on each (re)connection's handshake.
+  std::chrono::milliseconds handshake_timeout{5'000};
+  // Accepting side: how long a session whose connection dropped waits for its dialer to resume it.
+  std::chrono::milliseconds resume_timeout{30'000};
+};
+
 struct QosOptions {
   // Bytes are more stable than msg-count when payload sizes vary.
   std::size_t snd_hwm_bytes = 4 * 1024 * 1024;
@@ -62,30 +125,162 @@ struct QosOptions {
   // Per-message TTL; zero means disabled.
   std::chrono::milliseconds ttl{0};
 
-  // Close linger/drain time for queued outbound messages; zero means best-effort immediate close.
+  // How long close() waits for queued outbound messages to be written (new sends fail meanwhile);
+  // zero means best-effort immediate close.
   std::chrono::milliseconds linger{0};
 
   Reliability reliability = Reliability::kAtMostOnce;
+  AtLeastOnceOptions at_least_once;  // kAtLeastOnce only
+
+  // Send scheduling across channels (SendOptions::channel): deficit round robin over the channels
+  // with queued messages, each writing up to weight * channel_quantum_bytes per turn, so a large
+  // transfer on one channel cannot hold back the others. Channels not listed have weight 1.
+  std::size_t channel_quantum_bytes = 64 * 1024;
+  std::vector<ChannelWeight> channel_weights;
+
+  // Rate limits for the whole pipe and for single channels; a send needs tokens from both. Running
+  // out is handled by `backpressure` like reaching the HWM: kBlock waits for the refill (up to the
+  // send timeout; it fails at once if the wait would exceed it), kFailFast fails, and kDropNew and
+  // kDropOld drop the new message (nothing queued is ever charged again, so dropping it would not
+  // make room). Disabled limits cost nothing.
+  RateLimit rate;
+  std::vector<ChannelRateLimit> channel_rates;
+
+  FlushPolicy flush;
 };
 
 struct SendOptions {
   // If non-zero, send will time out (where supported).
   std::chrono::milliseconds timeout{0};
-  // Reserved for future: priority/channel_id.
+  // Logical channel the frames are sent on; the receiver sees it as Message::channel(). Order is
+  // kept within a channel; a QosPipe may reorder across channels (see QosOptions).
+  std::uint16_t channel = 0;
+  // Partial sends, which QosPipe uses to interleave a large message with other channels: `more`
+  // means the last message of this send continues in the next send on the same channel, and
+  // `continued` that the first one continues the previous send. The peer receives one message.
+  bool more = false;
+  bool continued = false;
+  // Set by QosPipe on a sampled message (MetricsOptions::trace_every), which already starts with
+  // its wire::TraceHeader: the frames carry FrameFlags::kTraced.
+  bool traced = false;
 };
 
 struct RecvOptions {
   std::chrono::milliseconds timeout{0};
 };
 
+// OS object a reactor can wait on for readability: a socket or fd on POSIX, a SOCKET on Windows.
+using PollHandle = std::intptr_t;
+constexpr PollHandle kInvalidPollHandle = -1;
+
+namespace detail {
+class StreamEndpoint;  // src/stream_endpoint.h
+}  // namespace detail
+
 class Pipe {
  public:
   virtual ~Pipe() = default;
   virtual Result<void> send(const Message& msg, const SendOptions& opt) = 0;
   virtual Result<Message> recv(const RecvOptions& opt) = 0;
+
+  // Send `msgs` in order and return how many were sent. An error on the first message is returned as
+  // a Status; a later one ends the batch early with a short count (and resurfaces on the next call).
+  // Transports override this to amortize syscalls and wakeups; the default sends one at a time.
+  virtual Result<std::size_t> send_batch(std::span<const Message> msgs, const SendOptions& opt) {
+    std::size_t n = 0;
+    for (const Message& m : msgs) {
+      auto st = send(m, opt);
+      if (!st.ok()) {
+        if (n == 0) return st.status();
+        break;
+      }
+      ++n;
+    }
+    return n;
+  }
+
+  // Wait (per opt.timeout) for at least one message, then fill `out` with as many as are ready
+  // without waiting again. Returns the count. The default receives a single message.
+  virtual Result<std::size_t> recv_batch(std::span<Message> out, const RecvOptions& opt) {
+    if (out.empty()) return std::size_t{0};
+    auto m = recv(opt);
+    if (!m.ok()) return m.status();
+    out[0] = std::move(m.value());
+    return std::size_t{1};
+  }
+
+  // Readiness integration (see duct/reactor.h). poll_handle() becomes readable when
+  // try_recv_batch() may make progress; pipes without one (kInvalidPollHandle) are polled instead.
+  // Callers drain once after registering and whenever the handle fires, until a short count: some
+  // handles (shm://) are edge-triggered and only re-arm on that short count.
+  virtual PollHandle poll_handle() const { return kInvalidPollHandle; }
+
+  // Non-blocking receive: fill `out` with messages available right now and return the count
+  // (possibly 0). A count below out.size() means nothing else is buffered inside the pipe, so the
+  // caller may go back to waiting on poll_handle().
+  virtual Result<std::size_t> try_recv_batch(std::span<Message> out) {
+    (void)out;
+    return Status::not_supported("try_recv_batch not supported");
+  }
+
+  // Internal: byte-stream pipes (tcp://, uds://) return the hook that lets a completion engine
+  // (Reactor with io_uring) perform their socket I/O. Wrappers forward it.
+  virtual detail::StreamEndpoint* stream_endpoint() { return nullptr; }
+
+  // In-place send: a `size`-byte span in the outgoing buffer; commit(len) sends its first `len`
+  // bytes. One reservation at a time, not interleaved with other sends.
+  virtual Result<std::span<std::uint8_t>> reserve(std::size_t size, const SendOptions& opt) {
+    (void)size;
+    (void)opt;
+    return Status::not_supported("reserve not supported");
+  }
+  virtual Result<void> commit(std::size_t len, const SendOptions& opt) {
+    (void)len;
+    (void)opt;
+    return Status::not_supported("commit not supported");
+  }
+
+  // Write out what is held back for coalescing (QosOptions::flush) without waiting out its delay;
+  // does not wait for the write itself. Pipes that write straight away have nothing to do.
+  virtual Result<void> flush() { return {}; }
+
   virtual void close() = 0;
 };
 
+namespace detail {
+// Pipe::reserve()/commit() for pipes with no outgoing buffer to lend: the span is a pooled
+// Message that commit() sends through the pipe.
+class StagedSend {
+ public:
+  StagedSend() = default;
+  StagedSend(const StagedSend&) = delete;
+  StagedSend& operator=(const StagedSend&) = delete;
+
+  std::span<std::uint8_t> reserve(std::size_t size) {
+    staged_ = Message::allocate(size);
+    staging_ = true;
+    return staged_.view();
+  }
+  Result<void> commit(Pipe& pipe, std::size_t len, const SendOptions& opt) {
+    if (!staging_) return Status::invalid_argument("commit without reserve");
+    if (len > staged_.size()) return Status::invalid_argument("commit exceeds reservation");
+    staging_ = false;
+    staged_.resize(len);
+    Message m = std::move(staged_);
+    return pipe.send(m, opt);
+  }
+  // A reservation made some other way replaces this one.
+  void cancel() {
+    staged_ = Message();
+    staging_ = false;
+  }
+
+ private:
+  Message staged_;
+  bool staging_ = false;
+};
+}  // namespace detail
+
 class Listener {
  public:
   virtual ~Listener() = default;
@@ -95,24 +290,219 @@ class Listener {
   virtual Result<std::string> local_address() const {
     return Status::not_supported("local_address not supported");
   }
+
+  // Readiness integration: poll_handle() becomes readable while connections are pending, and
+  // try_accept() takes one without blocking (null when none is). Not concurrently with accept().
+  virtual PollHandle poll_handle() const { return kInvalidPollHandle; }
+  virtual Result<std::unique_ptr<Pipe>> try_accept() { return Status::not_supported("try_accept not supported"); }
+
   virtual void close() = 0;
 };
 
+enum class ShmRingLayout {
+  // Ring of small descriptors pointing into a size-classed payload slab (default).
+  kSlab = 0,
+  // Length-prefixed records packed back-to-back in one byte ring. In-flight capacity is bounded by
+  // bytes instead of message count, which suits bursts of tiny messages.
+  kByteRing,
+};
+
+enum class ShmBroadcastRole {
+  kNone = 0,    // point-to-point pipes (default)
+  kPublish,     // the one writer of a broadcast bus: send-only
+  kSubscribe,   // a reader of it: receive-only
+};
+
+// What a subscriber does when the publisher laps it (overwrites messages it has not read yet).
+enum class ShmLapPolicy {
+  // The pipe fails (kIoError) and stays failed; a reconnecting dial resubscribes at the newest
+  // message.
+  kDrop = 0,
+  // Skip to the oldest message still in the ring, reporting how many were lost to on_lapped.
+  kSkip,
+};
+
+// Fan-out over one shared ring: both ends dial("shm://name") — the bus is its own namespace,
+// separate from listen("shm://name") — the publisher creating it and any number of subscribers,
+// in any local process, following it with cursors of their own. A send is copied into the ring
+// once whatever the number of subscribers, and the publisher never waits for them: a subscriber
+// that falls a whole ring behind is lapped (ShmLapPolicy). Each subscriber copies messages out
+// (they may be overwritten), starts at the next message published, and receives kClosed once the
+// publisher has closed and it has read the rest. There is no poll handle: a Reactor polls
+// subscribers. Not on Windows (kNotSupported).
+struct ShmBroadcastOptions {
+  ShmBroadcastRole role = ShmBroadcastRole::kNone;
+  // Publisher: ring size, a power of two; a message may take up to a quarter of it.
+  std::size_t ring_bytes = 4 * 1024 * 1024;
+  // Subscriber.
+  ShmLapPolicy on_lap = ShmLapPolicy::kDrop;
+  // Subscriber, kSkip: called with the number of messages skipped, on the thread reading the pipe.
+  std::function<void(std::uint64_t lost)> on_lapped;
+};
+
+struct ShmOptions {
+  // Chosen by the dialing side, which creates the segment; the listener follows it.
+  ShmRingLayout layout = ShmRingLayout::kSlab;
+
+  // dial() only: publish to or subscribe to a broadcast bus instead of connecting to a listener.
+  ShmBroadcastOptions broadcast{};
+
+  // Receive without copying: messages larger than Message::kInlineCapacity point straight into the
+  // shared segment, and their space is returned to the sender only when the last reference drops.
+  // Holding on to received messages therefore throttles the sender. Leased bytes are read-only.
+  // Each side picks this for its own receive direction.
+  bool zero_copy_recv = false;
+
+  // Connection setup. By default each dial creates the connection's segment itself. A dialer with
+  // from_listener_pool instead has the listener hand it one at accept(), so dial() waits for the
+  // accept (within DialOptions::timeout). The listener keeps pool_segments of its own `layout`
+  // created and pre-faulted, refilled in the background once half are gone, and makes one on the
+  // spot when none fits.
+  // These segments have no name (they travel as descriptors, so a crash leaves nothing behind) and
+  // go back to the listener's pool once both ends have closed: a reused segment only gets its ring
+  // metadata rewritten, payload areas keep old bytes that are never read. POSIX only.
+  bool from_listener_pool = false;  // dial()
+  std::size_t pool_segments = 0;    // listen()
+  // Fault this side's mapping in when it is made (MAP_POPULATE) rather than page by page on first
+  // use; pooled segments are always pre-faulted by the listener. Linux only.
+  bool populate = false;
+  // Back the segments this side creates with huge pages, to cut TLB misses on the rings: hugetlb
+  // pages for pooled segments when the system has some reserved, otherwise transparent huge pages
+  // (madvise; tmpfs honours it when shmem_enabled allows). Best effort; Linux only.
+  bool huge_pages = false;
+};
+
+struct UdsOptions {
+  // Linux: messages of at least this many bytes are copied into a sealed memfd that is passed over
+  // the socket (SCM_RIGHTS) instead of being written through it; the receiver maps the file
+  // read-only as the message, so multi-MB payloads skip both socket-buffer copies. 0 = off; no
+  // effect elsewhere. Any uds:// pipe of this version takes such messages, but not while an
+  // io_uring Reactor drives it, so set this on both ends: a pipe with it set stays on the
+  // Reactor's readiness path.
+  std::size_t memfd_threshold = 0;
+};
+
+// Messages larger than one frame (64 KB) are fragmented on send and put back together on receive.
+// These bound what a pipe holds while doing that; messages that would break a bound are dropped.
+struct FragmentOptions {
+  // Bytes held by incomplete messages, across all channels of the pipe.
+  std::size_t reassembly_max_bytes = 64 * 1024 * 1024;
+  // An incomplete message whose next fragment takes longer than this to arrive.
+  std::chrono::milliseconds reassembly_timeout{30'000};
+};
+
+enum class Compression : std::uint8_t {
+  kNone = 0,
+  kLz4,
+  kZstd,
+};
+
+// Whether this build has `codec` (CMake finds the LZ4 / zstd libraries when they are installed).
+bool compression_supported(Compression codec);
+
+// Payload compression on stream pipes (tcp://, uds://). Each frame is compressed on its own, where
+// frames are written: the QosPipe send worker when the pipe has one (the default), otherwise the
+// sending thread. Frames below min_bytes, and frames that would not shrink, go out raw; the rest
+// are marked FrameFlags::kCompressed and name their codec, so the receiver needs no setting of its
+// own beyond the dictionary. Each end's hello lists the codecs it decompresses and names its
+// dictionary, and a side only compresses toward a peer whose hello has the codec (and, for zstd,
+// the same dictionary); until that hello arrives, and toward peers without it, frames go out raw.
+// A dialer therefore sends raw until the accepting side's first frame, which carries its hello.
+struct CompressionOptions {
+  // Codec for what this end sends; kNone sends everything raw.
+  Compression codec = Compression::kNone;
+  std::size_t min_bytes = 128;
+  // zstd: the compression level; LZ4: the acceleration. 0 picks the codec's default.
+  int level = 0;
+  // zstd only: a dictionary (trained with `zstd --train` / ZDICT, or raw sample bytes), for small
+  // repetitive messages. Used in both directions, so both ends must hold the same one.
+  std::shared_ptr<const std::vector<std::uint8_t>> dictionary;
+};
+
+// Per-pipe instrumentation, published through MetricRegistry (duct/logging.h) as
+// "<prefix>.<name>": counters send_msgs, send_bytes, recv_msgs, recv_bytes, hwm_block,
+// hwm_drop_new, hwm_drop_old, hwm_fail_fast, rate_limited, ttl_drops, reconnects, downtime_ms,
+// write_syscalls, read_syscalls, copies (payloads copied in user space); gauges send_queue_msgs,
+// send_queue_bytes; histogram send_latency_us (queued until written). Pipes dialed or accepted
+// with the same prefix add up into the same metrics, so give a pipe a prefix of its own to watch
+// it alone. Recording is a few relaxed atomic adds per message.
+//
+// Sampled tracing breaks the latency of one message in trace_every down by stage, without tracing
+// the rest: the sending QosPipe puts a 24-byte header in front of it, and the receiving end records
+// histograms trace_admit_us, trace_queue_us, trace_transit_us and trace_recv_queue_us (the stages
+// of TraceSample) under its own prefix. The receiving end needs metrics enabled to record them (any
+// transport of this version strips the header), and tcp:// and uds:// peers need this version.
+struct TraceSample {
+  std::uint64_t id = 0;                  // unique per sending pipe
+  std::chrono::microseconds admit{0};    // in the sender's send() before being queued
+  std::chrono::microseconds queue{0};    // in the sender's QosPipe queue
+  std::chrono::microseconds transit{0};  // handed to the sender's transport until read here (wall clocks)
+  std::chrono::microseconds recv_queue{0};  // in this end's QosPipe receive queue (rcv_hwm_bytes)
+};
+
+struct MetricsOptions {
+  bool enabled = false;
+  std::string prefix = "duct.pipe";
+  // Dialed pipes: trace one sent message in this many; 0 = none.
+  std::uint32_t trace_every = 0;
+  // Receiving end: called with every trace received, on the thread reading the pipe, to log the
+  // slow ones by id; it should not block or use the pipe. Optional.
+  std::function<void(const TraceSample&)> on_trace;
+};
+
+// dial() also takes a comma-separated list of equivalent endpoints ("tcp://a:9000,tcp://b:9000").
+// Each (re)connect races them: attempts start race_delay apart, or at once when the ones running
+// have all failed, the first to connect is used and the rest are closed. A reconnect starts with
+// the endpoint after the one it lost, so failing over does not wait out a dead host's timeout.
 struct DialOptions {
   // Dial timeout for a single connection attempt. For reconnect-enabled dials, a timeout of 0 uses
-  // an internal default so the reconnect worker remains stoppable via close().
+  // an internal default so an attempt in progress cannot hold up close() indefinitely.
   std::chrono::milliseconds timeout{0};
+  // Endpoint lists: head start of each attempt over the next.
+  std::chrono::milliseconds race_delay{50};
   QosOptions qos{};
   ReconnectPolicy reconnect{};
   ConnectionCallback on_state_change{};
+  FragmentOptions fragments{};
+  // tcp:// and uds://: after a one-time hello, frame headers shrink from 16 bytes to 1-6 (a varint
+  // length with the fragment bits, and the channel unless it is 0). Listeners of this version answer
+  // it and switch their direction too; older ones reject the connection, so enable it once the
+  // accepting side has been upgraded.
+  bool compact_frames = false;
+  // tcp:// and uds:// only. A codec turns compact_frames on: we compress once the listener's hello
+  // says it can decompress.
+  CompressionOptions compression{};
+  // shm:// only.
+  ShmOptions shm{};
+  // uds:// only.
+  UdsOptions uds{};
+  MetricsOptions metrics{};
 };
 
 struct ListenOptions {
   QosOptions qos{};
   int backlog = 128;
+  // tcp:// only: SO_REUSEPORT, so several listeners can bind the same address and the kernel
+  // spreads incoming connections over them (Linux balances them; kNotSupported where the option
+  // does not exist).
+  bool reuse_port = false;
+  // Applies to accepted pipes.
+  FragmentOptions fragments{};
+  // tcp:// and uds://: answer a dialer's compact-framing hello (DialOptions::compact_frames) with our
+  // own, so both directions use compact headers. Off: only the dialer's direction does. Dialers
+  // that do not ask keep v1 headers either way.
+  bool compact_frames = true;
+  // tcp:// and uds:// only; applies to accepted pipes.
+  CompressionOptions compression{};
+  // shm:// only; applies to accepted pipes (the layout is always the dialer's).
+  ShmOptions shm{};
+  // uds:// only; applies to accepted pipes.
+  UdsOptions uds{};
+  // Applies to accepted pipes.
+  MetricsOptions metrics{};
 };
 
-// Minimal entry points (pattern layer comes later).
+// Minimal entry points. Request/reply on top of a pipe is in duct/reqrep.h.
 Result<std::unique_ptr<Listener>> listen(const std::string& address, const ListenOptions& opt = {});
 Result<std::unique_ptr<Pipe>> dial(const std::string& address, const DialOptions& opt = {});
 
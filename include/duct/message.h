@@ -1,7 +1,11 @@
 #pragma once
 
 #include <cstddef>
+#include <algorithm>
+#include <atomic>
 #include <cstdint>
+#include <cstring>
+#include <functional>
 #include <memory>
 #include <string>
 #include <string_view>
@@ -10,9 +14,51 @@
 
 namespace duct {
 
+namespace detail {
+
+// Refcounted storage behind a Message. Pooled blocks carry their bytes right after this header;
+// `release` runs when the last reference drops and hands the block back to its owner.
+struct MessageBlock {
+  std::atomic<std::uint32_t> refs{1};
+  std::uint32_t size_class = 0;
+  std::size_t capacity = 0;
+  std::uint8_t* bytes = nullptr;
+  void (*release)(MessageBlock*) = nullptr;
+  MessageBlock* next = nullptr;  // free-list link while cached by the pool
+};
+
+}  // namespace detail
+
 class Message {
  public:
+  // Payloads up to this size live inside the Message object itself: no allocation, and copies
+  // duplicate the bytes instead of sharing them.
+  static constexpr size_t kInlineCapacity = 40;
+  // Largest size a message can have (frames are limited to far less).
+  static constexpr size_t kMaxSize = 0xffffffffu;
+
+  // Frees adopted memory once the last Message referencing it is gone.
+  using Deleter = std::function<void(void* data)>;
+
   Message() = default;
+  Message(const Message& other) noexcept { copy_from(other); }
+  Message(Message&& other) noexcept { move_from(other); }
+  Message& operator=(const Message& other) noexcept {
+    if (this != &other) {
+      other.retain();
+      reset();
+      copy_from_retained(other);
+    }
+    return *this;
+  }
+  Message& operator=(Message&& other) noexcept {
+    if (this != &other) {
+      reset();
+      move_from(other);
+    }
+    return *this;
+  }
+  ~Message() { reset(); }
 
   // 从字节创建消息
   static Message from_bytes(const void* data, size_t size);
@@ -24,14 +70,79 @@ class Message {
   // 创建空的预分配消息
   static Message with_capacity(size_t capacity);
 
+  // 分配 size 字节（内容未初始化），通过 data() 填充；小消息内联，其余来自消息池
+  // `size` (<= kMaxSize) bytes, contents uninitialized; fill them through data(). Small sizes are
+  // stored inline, larger ones come from the MessagePool.
+  static Message allocate(size_t size);
+
+  // 接管外部内存（arena 块、mmap 区域、序列化缓冲区等），不复制；最后一个引用释放时调用 deleter
+  // Wrap memory the caller already owns without copying. `deleter` (may be empty for memory that
+  // outlives every Message) runs once the last Message sharing it is destroyed, on that thread.
+  static Message adopt(void* data, size_t size, Deleter deleter);
+
+  // 由存储提供方（传输层出借的缓冲区）使用：接管调用方持有的一个 block 引用
+  // For storage providers (e.g. transports lending out buffers they manage): view [data, data + size)
+  // inside `block`, taking over one reference the caller already holds. block->release runs when
+  // the last Message drops it.
+  static Message from_block(detail::MessageBlock* block, std::uint8_t* data, size_t size) {
+    Message m;
+    m.block_ = block;
+    m.data_ = data;
+    m.size_ = static_cast<std::uint32_t>(size);
+    return m;
+  }
+
   // 基本访问
   const std::uint8_t* data() const { return data_; }
   std::uint8_t* data() { return data_; }
   size_t size() const { return size_; }
   bool empty() const { return size_ == 0; }
 
-  // 获取所有权的共享存储
-  const std::shared_ptr<std::vector<std::uint8_t>>& backing() const { return backing_; }
+  // 消息到达时所在的通道（SendOptions::channel）；本地创建的消息为 0
+  // Channel the message arrived on (the sender's SendOptions::channel); 0 for messages built locally.
+  // Copies and slices keep it.
+  std::uint16_t channel() const { return channel_; }
+  void set_channel(std::uint16_t channel) { channel_ = channel; }
+
+  // 采样追踪的消息（MetricsOptions::trace_every）：追踪头位于 data() 之前的存储中
+  // A sampled message (MetricsOptions::trace_every): the transport stripped its wire::TraceHeader,
+  // which stays in the storage right before data() for the instrumentation to read. Copies keep
+  // it; slices from a later offset drop it.
+  bool traced() const { return traced_; }
+  void set_traced(bool traced) { traced_ = traced; }
+
+  // 从 data() 起可用的字节数；resize() 可在此范围内调整 size()
+  // Bytes usable from data() onwards; resize() can move size() anywhere within it.
+  size_t capacity() const {
+    if (block_) return static_cast<size_t>(block_->bytes + block_->capacity - data_);
+    if (is_inline()) return static_cast<size_t>(inline_ + kInlineCapacity - data_);
+    return 0;
+  }
+  // Returns false (and changes nothing) if `n` exceeds capacity(). Growing exposes uninitialized
+  // bytes; on shared storage only this message's view changes.
+  bool resize(size_t n) {
+    if (n > capacity()) return false;
+    size_ = static_cast<std::uint32_t>(n);
+    return true;
+  }
+
+  // 共享同一存储的子视图（不复制）；越界部分会被截断
+  // A view of [offset, offset + size) sharing this message's storage; clamped to the message.
+  // Slices of inline messages are inline copies.
+  Message slice(size_t offset, size_t size) const {
+    Message m(*this);
+    offset = std::min<size_t>(offset, size_);
+    m.data_ += offset;
+    m.size_ = static_cast<std::uint32_t>(std::min<size_t>(size, size_ - offset));
+    m.traced_ = traced_ && offset == 0;
+    return m;
+  }
+
+  // 是否与另一条消息共享底层存储（内联消息从不共享）
+  bool shares_storage_with(const Message& other) const { return block_ != nullptr && block_ == other.block_; }
+
+  // 引用同一存储的消息数量（空消息和内联消息为 0）
+  long use_count() const { return block_ ? static_cast<long>(block_->refs.load(std::memory_order_acquire)) : 0; }
 
   // 视图访问
   std::span<const std::uint8_t> view() const { return std::span(data_, size_); }
@@ -44,7 +155,7 @@ class Message {
 
   // 复制数据到目标缓冲区
   size_t copy_to(void* dest, size_t max_size) const {
-    size_t copy_size = std::min(size_, max_size);
+    size_t copy_size = std::min<size_t>(size_, max_size);
     if (copy_size > 0) {
       std::memcpy(dest, data_, copy_size);
     }
@@ -62,10 +173,57 @@ class Message {
   bool operator!=(const Message& other) const { return !equals(other); }
 
  private:
-  std::shared_ptr<std::vector<std::uint8_t>> backing_;
+  bool is_inline() const { return block_ == nullptr && data_ != nullptr; }
+
+  void retain() const {
+    if (block_) block_->refs.fetch_add(1, std::memory_order_relaxed);
+  }
+  void reset() {
+    if (block_ && block_->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) block_->release(block_);
+    block_ = nullptr;
+    data_ = nullptr;
+    size_ = 0;
+    channel_ = 0;
+    traced_ = false;
+  }
+
+  // Take `other`'s view, whose block reference (if any) has already been counted for us.
+  void copy_from_retained(const Message& other) {
+    block_ = other.block_;
+    size_ = other.size_;
+    channel_ = other.channel_;
+    traced_ = other.traced_;
+    if (other.is_inline()) {
+      const size_t offset = static_cast<size_t>(other.data_ - other.inline_);
+      std::memcpy(inline_, other.inline_, offset + size_);
+      data_ = inline_ + offset;
+    } else {
+      data_ = other.data_;
+    }
+  }
+  void copy_from(const Message& other) {
+    other.retain();
+    copy_from_retained(other);
+  }
+  void move_from(Message& other) {
+    copy_from_retained(other);
+    other.block_ = nullptr;
+    other.data_ = nullptr;
+    other.size_ = 0;
+    other.channel_ = 0;
+    other.traced_ = false;
+  }
+
+  // Invariant: block_ set => data_ points into the block; block_ null and data_ set => data_ points
+  // into inline_; both null => empty.
+  detail::MessageBlock* block_ = nullptr;
   std::uint8_t* data_ = nullptr;
-  size_t size_ = 0;
+  std::uint32_t size_ = 0;
+  std::uint16_t channel_ = 0;
+  bool traced_ = false;
+  alignas(8) std::uint8_t inline_[kInlineCapacity];
 };
 
-}  // namespace duct
+static_assert(sizeof(Message) == 64, "Message should stay one cache line");
 
+}  // namespace duct
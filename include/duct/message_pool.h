@@ -0,0 +1,59 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+#include "duct/message.h"
+
+namespace duct {
+
+// Process-wide recycler for Message storage. Requests are rounded up to power-of-two size classes;
+// when the last Message referencing a block drops, the block goes back to a per-thread cache
+// (spilling to a shared list when the cache is full) instead of the heap, so steady-state traffic
+// allocates nothing. Blocks may be released on a different thread than the one that allocated them.
+// The shared lists hold at most shared_limit() blocks per class; a burst beyond that goes back to
+// the heap as it is released.
+class MessagePool {
+ public:
+  // Classes run from 64 bytes to 1MB (large enough for transport receive buffers); bigger requests
+  // come straight from the heap and are freed on release.
+  static constexpr std::size_t kMinClassShift = 6;
+  static constexpr std::size_t kMaxClassShift = 20;
+  static constexpr std::size_t kClassCount = kMaxClassShift - kMinClassShift + 1;
+  static constexpr std::uint32_t kUnpooled = 0xffffffffu;
+
+  struct Stats {
+    std::uint64_t heap_allocations = 0;  // blocks obtained from operator new (pooled or not)
+    std::size_t shared_cached_blocks = 0;  // blocks parked on the shared lists (not per-thread caches)
+    std::uint64_t heap_frees = 0;  // pooled blocks freed for being over shared_limit() (or by trim())
+  };
+
+  static MessagePool& global();
+
+  // A block with at least `size` usable bytes (uninitialized) and one reference.
+  detail::MessageBlock* acquire(std::size_t size);
+
+  Stats stats() const;
+
+  // Free every block on the shared lists. Per-thread caches are flushed there when threads exit.
+  void trim();
+
+  static constexpr std::uint32_t size_class(std::size_t size) {
+    std::size_t shift = kMinClassShift;
+    while (shift <= kMaxClassShift && (std::size_t{1} << shift) < size) ++shift;
+    return shift > kMaxClassShift ? kUnpooled : static_cast<std::uint32_t>(shift - kMinClassShift);
+  }
+  static constexpr std::size_t class_size(std::uint32_t cls) { return std::size_t{1} << (cls + kMinClassShift); }
+  // High-water mark of a class's shared list: about 4MB worth of blocks, but always a few.
+  static constexpr std::size_t shared_limit(std::uint32_t cls) {
+    return std::max(std::size_t{4}, (std::size_t{4} << 20) / class_size(cls));
+  }
+
+ private:
+  MessagePool() = default;
+  MessagePool(const MessagePool&) = delete;
+  MessagePool& operator=(const MessagePool&) = delete;
+};
+
+}  // namespace duct
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "duct/duct.h"
+#include "duct/message.h"
+#include "duct/status.h"
+
+namespace duct {
+
+namespace detail {
+class MuxCore;  // src/mux.cc
+}  // namespace detail
+
+struct MuxOptions {
+  // Bytes of one stream's messages this side buffers ahead of recv(); announced to the peer, whose
+  // sends on the stream wait (per SendOptions::timeout) once they are that far ahead. A message
+  // may overshoot the window, so one larger than it still goes through.
+  std::size_t stream_window_bytes = 256 * 1024;
+  // Streams the peer may have open at once; its open()s beyond this are refused (closed at once).
+  std::size_t max_streams = 4096;
+  // Streams opened by the peer and not accept()ed yet; beyond this they are refused too.
+  std::size_t accept_backlog = 128;
+};
+
+// Which end of the connection a session runs on; the two ends number their streams apart.
+enum class MuxRole : std::uint8_t { kDialer, kAcceptor };
+
+// Many independent logical pipes over one connection (typically a tcp:// pipe), so a link between
+// two processes needs one socket however many services talk over it. Streams are opened with
+// open() on either end and arrive at the other end's accept(); each has a flow-control window of
+// its own, so a stream whose reader falls behind holds up only its own sender. Messages of a
+// stream travel on a channel of the connection (channel 0 carries the control frames that open
+// and close streams and grant window), so a QosPipe underneath schedules streams like channels.
+//
+// One background thread reads the connection; streams have none. Stream pipes have no channels
+// of their own (SendOptions::channel must be 0). Closing a stream closes both of its directions;
+// the peer receives what was already sent, then kClosed. Losing the connection fails every stream:
+// run a session over a plain connection, not a reconnecting one.
+class MuxSession {
+ public:
+  struct Stats {
+    std::size_t streams = 0;            // open now (or closing)
+    std::uint64_t opened = 0;           // by open()
+    std::uint64_t accepted = 0;         // by accept()
+    std::uint64_t refused = 0;          // peer streams over max_streams / accept_backlog
+    std::uint64_t window_updates = 0;   // window grants sent
+    std::uint64_t window_waits = 0;     // sends that waited for window
+  };
+
+  MuxSession(std::unique_ptr<Pipe> conn, MuxRole role, const MuxOptions& opt = {});
+  ~MuxSession();
+
+  MuxSession(const MuxSession&) = delete;
+  MuxSession& operator=(const MuxSession&) = delete;
+
+  // A new stream. The peer learns of it with the first frame, so it can be sent on at once.
+  Result<std::unique_ptr<Pipe>> open();
+  // The next stream the peer opened; waits per opt.timeout.
+  Result<std::unique_ptr<Pipe>> accept(const RecvOptions& opt = {});
+  // Close the connection; every stream fails with kClosed.
+  void close();
+
+  Stats stats() const;
+
+ private:
+  std::shared_ptr<detail::MuxCore> core_;
+};
+
+}  // namespace duct
@@ -10,6 +10,17 @@ namespace duct {
 
 constexpr std::uint32_t kProtocolMagic = 0x44554354;  // 'D''U''C''T'
 constexpr std::uint16_t kProtocolVersion = 1;
+// Stream transports (tcp://, uds://): a hello with this version in a v1-layout header switches its
+// direction of the connection to compact frame headers (see wire::FrameEncoder).
+constexpr std::uint16_t kProtocolVersionCompact = 2;
+
+// What a peer announces in its hello: the features it can receive.
+enum class Capability : std::uint32_t {
+  kCompactFrames = 1u << 0,
+  // kCompressed payloads in these codecs (CompressionOptions) decompress on this side.
+  kLz4 = 1u << 1,
+  kZstd = 1u << 2,
+};
 
 enum class Scheme : std::uint8_t {
   kUnknown = 0,
@@ -17,16 +28,31 @@ enum class Scheme : std::uint8_t {
   kUds = 2,
   kShm = 3,
   kPipe = 4,
+  kInproc = 5,
 };
 
 enum class FrameFlags : std::uint32_t {
   kNone = 0,
 
-  // Reliability (planned)
-  kReliable = 1u << 0,  // at-least-once enabled for this pipe
+  // Reserved. ReliablePipe (duct/reliable_pipe.h) carries its seq/ack header in the payload and
+  // works over any transport, so frames do not mark it.
+  kReliable = 1u << 0,
+
+  // Fragmentation: a message bigger than one frame goes out as a run of frames on one channel,
+  // possibly interleaved with frames of other channels.
+  kFrag = 1u << 4,      // more frames of this message follow
+  kFragCont = 1u << 5,  // continues a message begun by an earlier frame
+
+  // The payload is compressed (CompressionOptions): codec byte, varint raw length, codec output.
+  kCompressed = 1u << 6,
+
+  // A sampled message: its payload starts with a wire::TraceHeader (MetricsOptions::trace_every),
+  // which the receiving transport strips.
+  kTraced = 1u << 7,
 
-  // Fragmentation (planned)
-  kFrag = 1u << 4,
+  // uds://: the payload is the 8-byte big-endian size of a sealed memfd passed with SCM_RIGHTS
+  // alongside the frame (UdsOptions::memfd_threshold); the message is that file's contents.
+  kFdPayload = 1u << 8,
 };
 
 inline constexpr FrameFlags operator|(FrameFlags a, FrameFlags b) {
@@ -37,5 +63,17 @@ inline constexpr std::uint32_t to_u32(FrameFlags f) {
   return static_cast<std::uint32_t>(f);
 }
 
+// The top 16 bits of a frame's flags carry its channel (SendOptions::channel). Channel 0, the
+// default, leaves them clear, so frames look exactly as they did before channels existed.
+constexpr std::uint32_t kFrameChannelShift = 16;
+
+inline constexpr std::uint32_t channel_flags(std::uint16_t channel) {
+  return static_cast<std::uint32_t>(channel) << kFrameChannelShift;
+}
+
+inline constexpr std::uint16_t frame_channel(std::uint32_t flags) {
+  return static_cast<std::uint16_t>(flags >> kFrameChannelShift);
+}
+
 }  // namespace duct
 
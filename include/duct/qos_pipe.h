@@ -7,49 +7,173 @@
 #include <memory>
 #include <mutex>
 #include <thread>
+#include <unordered_map>
+#include <vector>
 
 #include "duct/duct.h"
 #include "duct/message.h"
+#include "duct/rate_limiter.h"
 #include "duct/status.h"
 
 namespace duct {
 
-// Internal queue entry with timestamp for TTL
-struct QueuedMessage {
-  Message message;
-  std::chrono::steady_clock::time_point timestamp;
-
-  QueuedMessage(const Message& msg)
-    : message(msg), timestamp(std::chrono::steady_clock::now()) {}
-};
+namespace detail {
+struct PipeInstruments;  // src/instrument.h
+}  // namespace detail
 
+// Queues sends and writes them in the background, as jobs on the library's shared worker pool: a
+// pipe with nothing queued holds no thread. A job moves queued messages out under the lock and
+// writes them with underlying send_batch() calls outside it, so producers only contend for an
+// enqueue; bytes count against snd_hwm_bytes until written, and producers blocked on the HWM are
+// woken when the total drops below it. A busy pipe gives its worker back every few turns.
+//
+// With a flush policy (QosOptions::flush), a drain holds small amounts back for up to its delay so
+// they go out together.
+//
+// With a TTL, a shared timer also drops queued messages as they expire, so they stop counting
+// against the HWM even while writes are stalled. With a linger time, close() first waits up to that
+// long for the queue to drain. Without one, what is still queued is dropped, but a write already
+// under way gets to finish first.
+//
+// Each SendOptions::channel has its own queue, served by deficit round robin
+// (QosOptions::channel_quantum_bytes, channel_weights): a drain takes one channel's turn at a
+// time and writes it with one send_batch(), so a message queued on an idle channel waits for at
+// most one turn of each busy channel rather than for everything queued ahead of it. A message larger
+// than its channel's quantum is written a quantum's worth per turn, as fragments (SendOptions::more
+// / continued), so it does not hold the link while it goes out; a sampled one (trace_every) is
+// not cut up, and waits for the credit to cover it.
+//
+// Rate limits (QosOptions::rate, channel_rates) are token buckets charged by send() on the
+// caller's thread, before the message is queued.
+//
+// With rcv_hwm_bytes set, the first recv()/recv_batch() starts a receive thread that reads ahead
+// into a queue of up to rcv_hwm_bytes, so the kernel buffer keeps draining while the application
+// is busy; recv, recv_batch and try_recv_batch then serve from that queue and drop messages older
+// than the TTL. A pipe driven by a Reactor (poll_handle + try_recv_batch only) never starts it.
+//
+// With `metrics` (dial() passes them when MetricsOptions::enabled), the queue depth, backpressure
+// outcomes, TTL drops, syscalls and enqueue-to-write latency are recorded as well; with
+// MetricsOptions::trace_every, sampled messages go out on their own with a wire::TraceHeader, and
+// traced messages read ahead are recorded with their time in the receive queue.
 class QosPipe : public Pipe {
  public:
-  QosPipe(std::unique_ptr<Pipe> underlying, const QosOptions& qos);
+  QosPipe(std::unique_ptr<Pipe> underlying, const QosOptions& qos,
+          std::shared_ptr<detail::PipeInstruments> metrics = nullptr);
   ~QosPipe() override;
 
   Result<void> send(const Message& msg, const SendOptions& opt) override;
+  // Queues the run under one lock acquisition (one message at a time with rate limits).
+  Result<std::size_t> send_batch(std::span<const Message> msgs, const SendOptions& opt) override;
   Result<Message> recv(const RecvOptions& opt) override;
+  Result<std::size_t> recv_batch(std::span<Message> out, const RecvOptions& opt) override;
+  PollHandle poll_handle() const override;
+  Result<std::size_t> try_recv_batch(std::span<Message> out) override;
+  detail::StreamEndpoint* stream_endpoint() override;
+  // Staged, then queued like send().
+  Result<std::span<std::uint8_t>> reserve(std::size_t size, const SendOptions& opt) override;
+  Result<void> commit(std::size_t len, const SendOptions& opt) override;
+  Result<void> flush() override;
   void close() override;
 
  private:
-  // Background thread for processing send queue
-  void send_worker();
-  bool can_send_message(const QueuedMessage& queued_msg) const;
+  struct Pending {
+    Message message;
+    std::chrono::steady_clock::time_point enqueued;  // send: queued; receive: read ahead
+    std::chrono::steady_clock::time_point traced_since{};  // sampled for tracing: send() called
+  };
+
+  // One channel's send queue and its deficit round robin state.
+  struct Channel {
+    std::deque<Pending> queue;
+    std::size_t quantum = 0;  // bytes credited per turn: weight * channel_quantum_bytes
+    std::size_t deficit = 0;  // credit left; an emptied channel starts over at zero
+    std::size_t sent = 0;     // bytes of queue.front() already written as fragments
+  };
+
+  // Queue `msg` subject to the HWM and backpressure policy, starting a drain job if none is
+  // scheduled; false when it was dropped. `lock` holds send_mutex_ (released while blocked).
+  Result<bool> enqueue(std::unique_lock<std::mutex>& lock, const Message& msg, const SendOptions& opt,
+                       std::chrono::steady_clock::time_point traced_since = {});
+  // Now if the next message sent is to be traced (MetricsOptions::trace_every), else zero.
+  std::chrono::steady_clock::time_point sample();
+  // Take the pipe's and the channel's tokens for `msg`, waiting or giving up per the backpressure
+  // policy; false when the message is to be dropped.
+  Result<bool> take_tokens(const Message& msg, const SendOptions& opt);
+  void return_tokens(const Message& msg, std::uint16_t channel);
+
+  // Write queued turns; drain_scheduled_ is set.
+  void drain();
+  // Per QosOptions::flush, wait for more to queue before the next turn; send_mutex_ held.
+  void coalesce(std::unique_lock<std::mutex>& lock);
+  // Drop expired queued messages and re-arm the TTL timer; ttl_scheduled_ is set.
+  void expire_queued();
+  // send_mutex_ held.
+  Channel& channel(std::uint16_t id);
+  // Move the next turn's messages (or pieces of them) into draining_ and return how to send them:
+  // their channel, and more / continued when the turn ends / starts inside a message; send_mutex_
+  // held and active_ not empty.
+  SendOptions take_turn();
+  // Whether a failed drain write is tried again: a transport timeout, while the pipe runs (close()
+  // stops it at once, or when its linger time is up).
+  bool retry_write(const Status& st) const;
+  // Write `msgs` fully (send_batch may stop short), releasing their bytes as they go out.
+  Result<void> write_all(std::span<const Message> msgs, SendOptions opt);
+  // Write the turn in draining_, sampled messages on their own behind a trace header.
+  Result<void> write_turn(const SendOptions& opt);
+  // Bytes left the queue or the wire; wakes blocked producers once below snd_hwm_bytes.
+  void release_bytes(std::size_t n);
+  // Move the shared queue gauges by how much this pipe's queue changed since; send_mutex_ held.
+  void report_queue();
+
+  void recv_worker();
+  // Starts the receive thread on first use; false when there is no receive queue (rcv_hwm_bytes 0).
+  bool use_recv_queue();
+  // Move up to out.size() live messages from the receive queue; rcv_mutex_ held.
+  std::size_t pop_received(std::span<Message> out);
 
   std::unique_ptr<Pipe> underlying_;
   QosOptions qos_;
+  std::shared_ptr<detail::PipeInstruments> metrics_;
+
+  // Fixed after construction; the buckets themselves are lock-free.
+  bool rate_limited_ = false;
+  RateLimiter pipe_rate_;
+  std::unordered_map<std::uint16_t, RateLimiter> channel_rates_;
 
-  // Send queue management
-  std::deque<QueuedMessage> send_queue_;
   std::mutex send_mutex_;
-  std::condition_variable send_cv_;
-  std::thread send_thread_;
+  std::condition_variable space_cv_;  // producers: below the HWM, or stopping
+  std::unordered_map<std::uint16_t, Channel> channels_;
+  std::deque<std::uint16_t> active_;  // channels with queued messages, in round robin order
+  std::size_t send_bytes_ = 0;        // queued plus being written by a drain
+  Status failure_;              // underlying write failure; later sends return it
   std::atomic<bool> running_{false};
+  bool closing_ = false;         // lingering in close(): no new sends
+  bool drain_scheduled_ = false;  // a drain job is queued or running
+  bool ttl_scheduled_ = false;    // the TTL timer is pending or its job running
+  std::uint64_t ttl_timer_ = 0;
+  std::condition_variable idle_cv_;  // close() / destructor: drain or TTL job finished
+  std::condition_variable flush_cv_;  // coalescing drain: min_bytes queued, flush(), or stopping
+  bool flush_now_ = false;            // write without coalescing until the queue is next empty
+  std::size_t reported_msgs_ = 0;     // this pipe's share of the queue gauges
+  std::size_t reported_bytes_ = 0;
+  std::atomic<std::uint64_t> trace_seq_{0};  // messages considered for sampling
+  std::uint64_t trace_salt_ = 0;              // high bits of this pipe's trace ids
+  std::uint64_t traces_sent_ = 0;            // drain only
+
+  // Drain-only scratch, reused across jobs.
+  std::deque<Pending> draining_;
+  std::vector<Message> batch_;
+
+  std::mutex rcv_mutex_;
+  std::condition_variable rcv_cv_;        // consumers: something arrived, failed, or closing
+  std::condition_variable rcv_space_cv_;  // receive thread: below rcv_hwm_bytes, or closing
+  std::deque<Pending> rcv_queue_;
+  std::size_t rcv_bytes_ = 0;
+  Status rcv_failure_;  // reported once the queue is empty
+  std::atomic<bool> rcv_started_{false};
+  std::thread recv_thread_;
 
-  // Current queue sizes
-  std::atomic<size_t> send_bytes_{0};
-  std::atomic<size_t> send_count_{0};
+  detail::StagedSend staged_;
 };
 
 }  // namespace duct
\ No newline at end of file
@@ -1,8 +1,11 @@
 #pragma once
 
+#include <atomic>
 #include <chrono>
 #include <condition_variable>
+#include <cstdint>
 #include <deque>
+#include <memory>
 #include <mutex>
 #include <optional>
 
@@ -54,7 +57,8 @@ class MessageQueue {
   // Check if closed.
   bool is_closed() const;
 
-  // Purge expired messages (TTL). Returns number of purged messages.
+  // Purge expired messages (TTL) from the front, where they all are. Returns number of purged
+  // messages.
   std::size_t purge_expired();
 
  private:
@@ -76,4 +80,82 @@ class MessageQueue {
   std::chrono::milliseconds ttl_;
 };
 
+enum class QueueProducers {
+  kSingle = 0,  // one pushing thread (SPSC)
+  kMulti,       // any number of pushing threads (MPSC)
+};
+
+// Bounded lock-free variant of MessageQueue: a ring of `capacity` slots (rounded up to a power of
+// two) with per-slot sequence numbers, so push and pop never take a lock. Same byte HWM and
+// BackpressurePolicy semantics; a full ring counts as being at the HWM. One consumer thread calls
+// pop/try_pop/purge_expired. Blocked callers spin briefly, then park; the other side only touches
+// the parking lock when someone is parked, so an uncontended push/pop is a few atomics.
+//
+// A message is admitted while the queued bytes plus its size stay within hwm_bytes (0 = no limit),
+// and always into an empty queue, so an oversized message cannot wedge a blocking producer.
+class RingMessageQueue {
+ public:
+  RingMessageQueue(std::size_t capacity, std::size_t hwm_bytes, BackpressurePolicy policy,
+                   std::chrono::milliseconds ttl, QueueProducers producers = QueueProducers::kMulti);
+  ~RingMessageQueue();
+
+  RingMessageQueue(const RingMessageQueue&) = delete;
+  RingMessageQueue& operator=(const RingMessageQueue&) = delete;
+
+  // As MessageQueue::push. kDropOld discards from the front on the pushing thread.
+  Result<void> push(const Message& msg, std::chrono::milliseconds timeout = std::chrono::milliseconds{0});
+  Result<Message> pop(std::chrono::milliseconds timeout = std::chrono::milliseconds{0});
+  std::optional<Message> try_pop();
+
+  // Snapshots; exact only while no one pushes or pops.
+  std::size_t size_bytes() const;
+  std::size_t size_msgs() const;
+  bool at_hwm() const;
+  std::size_t capacity() const { return mask_ + 1; }
+
+  void close();
+  bool is_closed() const;
+
+  // Drops expired messages from the front. With one TTL for all messages, deadlines run in queue
+  // order, so that is every expired message up to races with concurrent producers.
+  std::size_t purge_expired();
+
+ private:
+  struct Cell;
+  // Parking spot for one side; waiters register in `parked` before sleeping so notify() can skip
+  // the lock when it is zero.
+  struct Waiters {
+    std::atomic<std::uint32_t> parked{0};
+    std::mutex mu;
+    std::condition_variable cv;
+  };
+
+  bool try_reserve_bytes(std::size_t n);
+  bool can_admit(std::size_t n) const;
+  bool try_enqueue(QueuedMessage& qm);
+  // With `expired_by`, only takes the front message if it expired before that time.
+  bool try_dequeue(QueuedMessage* out, const std::chrono::steady_clock::time_point* expired_by = nullptr);
+  bool expired(const QueuedMessage& qm, std::chrono::steady_clock::time_point now) const;
+  template <class Ready>
+  bool await(Waiters& w, std::chrono::milliseconds timeout, Ready&& ready);
+  static void notify(Waiters& w);
+
+  std::unique_ptr<Cell[]> cells_;
+  std::size_t mask_;
+  bool multi_producer_;
+  bool multi_consumer_;  // kDropOld: producers pop too
+
+  alignas(64) std::atomic<std::size_t> tail_{0};  // next slot to fill
+  alignas(64) std::atomic<std::size_t> head_{0};  // next slot to drain
+  alignas(64) std::atomic<std::size_t> total_bytes_{0};
+  std::atomic<bool> closed_{false};
+
+  Waiters not_empty_;
+  Waiters not_full_;
+
+  std::size_t hwm_bytes_;
+  BackpressurePolicy policy_;
+  std::chrono::milliseconds ttl_;
+};
+
 }  // namespace duct
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+#include "duct/duct.h"
+
+namespace duct {
+
+// Token bucket kept as a single atomic "theoretical arrival time" (GCRA): taking tokens pushes it
+// forward by cost / rate, and refill is simply the clock catching up, so there is no timer thread
+// and no lock. The bucket starts full. A cost larger than the burst is let through whenever the
+// bucket is full, and the debt it runs up delays what comes after it.
+class TokenBucket {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  // Zero rate: unlimited. Zero burst: one second's worth of tokens.
+  TokenBucket(std::uint64_t rate_per_sec, std::uint64_t burst);
+
+  TokenBucket(const TokenBucket&) = delete;
+  TokenBucket& operator=(const TokenBucket&) = delete;
+
+  bool unlimited() const { return ns_per_token_ == 0; }
+
+  // Take `cost` tokens. Returns zero if they were taken, otherwise how long until they will be
+  // available (and nothing is taken).
+  std::chrono::nanoseconds try_acquire(std::uint64_t cost, Clock::time_point now = Clock::now());
+
+  // Give back tokens taken for something that was not sent after all.
+  void refund(std::uint64_t cost);
+
+ private:
+  std::int64_t cost_ns(std::uint64_t cost) const;
+
+  double ns_per_token_ = 0;
+  std::int64_t tolerance_ns_ = 0;  // how far ahead of now the arrival time may run: the burst
+  std::atomic<std::int64_t> tat_ns_{0};
+};
+
+// The byte and message buckets of one RateLimit, taken together.
+class RateLimiter {
+ public:
+  explicit RateLimiter(const RateLimit& limit);
+
+  bool unlimited() const { return bytes_.unlimited() && msgs_.unlimited(); }
+
+  // One message of `bytes`: zero if admitted by both buckets, otherwise the wait before retrying
+  // (and nothing is taken).
+  std::chrono::nanoseconds try_acquire(std::size_t bytes, TokenBucket::Clock::time_point now);
+  void refund(std::size_t bytes);
+
+ private:
+  TokenBucket bytes_;
+  TokenBucket msgs_;
+};
+
+}  // namespace duct
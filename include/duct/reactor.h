@@ -0,0 +1,103 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+#include "duct/duct.h"
+
+namespace duct {
+
+enum class ReactorBackend : std::uint8_t {
+  kReadiness = 0,  // epoll / kqueue / WSAPoll
+  kIoUring = 1,
+  kIocp = 2,
+};
+
+struct ReactorOptions {
+  // Linux: drive tcp:// and uds:// pipes through io_uring (multishot receives into pooled buffers,
+  // sends batched into the loop's single submission). Falls back to the readiness backend when the
+  // build or the running kernel lacks it; backend() tells which one is in use.
+  bool io_uring = false;
+  // With io_uring: a kernel thread polls the submission ring, so a busy loop makes no syscalls to
+  // submit. Costs a CPU while active; ignored where the kernel does not allow it.
+  bool sqpoll = false;
+  // Windows: drive tcp:// and pipe:// (named pipe) pipes through an I/O completion port (one
+  // overlapped receive posted per pipe, gathered overlapped sends). Other pipes are checked every
+  // iteration, as pipes without a poll handle are. Falls back to WSAPoll if the port cannot be made.
+  bool iocp = false;
+  // With io_uring or IOCP: per-pipe bytes queued for the kernel before send() waits (per its timeout).
+  std::size_t send_hwm_bytes = 4 * 1024 * 1024;
+};
+
+// Readiness-driven dispatcher for many pipes on one thread: epoll on Linux, kqueue on macOS/BSD,
+// WSAPoll on Windows. An idle pipe costs nothing; once its poll_handle() turns readable the reactor
+// drains it with try_recv_batch() and runs its callbacks on the thread driving the loop. Pipes
+// without a poll handle are checked every iteration instead, which caps the wait at kPollInterval
+// while any are registered.
+//
+// With ReactorOptions::io_uring (or iocp) the reactor performs the socket I/O of stream pipes itself. While
+// registered, such a pipe only receives through the reactor (recv() is kNotSupported), and its
+// sends are queued to the loop and written when it next runs, so keep the loop running while
+// sending; a send from a callback goes out at the end of that iteration.
+class Reactor {
+ public:
+  using Id = std::uint64_t;
+  using TimerId = std::uint64_t;
+  using MessageHandler = std::function<void(const Message&)>;
+  using ErrorHandler = std::function<void(const Status&)>;
+
+  static constexpr std::chrono::milliseconds kPollInterval{1};
+
+  static Result<std::unique_ptr<Reactor>> create(const ReactorOptions& opt = {});
+  ~Reactor();
+
+  Reactor(const Reactor&) = delete;
+  Reactor& operator=(const Reactor&) = delete;
+
+  // Register `pipe` (kNotSupported if it has no try_recv_batch). on_message runs for every received
+  // message; on_error runs once when the pipe fails or the peer closes it (kClosed), after which the
+  // pipe is dropped. Safe from any thread, including from inside callbacks.
+  Result<Id> add(std::shared_ptr<Pipe> pipe, MessageHandler on_message, ErrorHandler on_error = nullptr);
+
+  // Unregister. Remove a pipe before closing it, so the poller never watches a reused descriptor.
+  // A callback already running on the loop thread finishes, but no further ones start. With io_uring
+  // or IOCP a stream pipe returns to its own I/O once the loop has flushed what it queued.
+  void remove(Id id);
+
+  // One iteration: wait at most `max_wait` (0 = do not wait) for readiness, then dispatch. Returns
+  // the number of messages delivered. Only one thread may drive the loop at a time.
+  Result<std::size_t> run_once(std::chrono::milliseconds max_wait);
+
+  // Run `task` on the loop thread at the start of its next iteration, in posting order. Safe from
+  // any thread; tasks still queued when the reactor is destroyed are dropped without running.
+  void post(std::function<void()> task);
+
+  // Run `task` on the loop thread once `delay` has passed (at the start of an iteration, after
+  // posted tasks), which caps the loop's wait while timers are pending. Thread-safe.
+  TimerId post_after(std::chrono::milliseconds delay, std::function<void()> task);
+  // Drop a timer that has not started; false if it already ran, is running, or was cancelled.
+  bool cancel(TimerId id);
+
+  // Dispatch until stop() is called.
+  Result<void> run();
+
+  // Make run() return, now and on later calls. Thread-safe.
+  void stop();
+
+  std::size_t size() const;
+
+  ReactorBackend backend() const;
+
+ private:
+  struct State;
+  explicit Reactor(std::unique_ptr<State> state);
+
+  Result<std::size_t> iterate(int timeout_ms);
+
+  std::unique_ptr<State> state_;
+};
+
+}  // namespace duct
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+#include "duct/duct.h"
+#include "duct/message.h"
+#include "duct/status.h"
+
+namespace duct {
+
+namespace detail {
+class ReliableCore;  // src/reliable_pipe.cc
+}  // namespace detail
+
+// At-least-once delivery over another pipe (see AtLeastOnceOptions). Every message is sent with a
+// sequence number and kept until the peer acknowledges it; a background thread reads the pipe
+// underneath (acks, and data ahead of recv() up to the window), another one sends coalesced acks
+// and retransmits what timed out. The receiver delivers in sequence order and drops duplicates.
+//
+// Each connection starts with a handshake in which both ends say what they have received, so when
+// a reconnecting pipe underneath dials again (its dial step calls handshake()), each side resends
+// exactly what the other is missing. dial() and listen() set this up for kAtLeastOnce.
+class ReliablePipe : public Pipe {
+ public:
+  struct Stats {
+    std::uint64_t acks_sent = 0;    // ack-only frames; piggybacked acks are free
+    std::uint64_t retransmits = 0;
+    std::uint64_t duplicates = 0;   // received again and dropped
+    std::size_t inflight = 0;       // sent, not yet acknowledged
+  };
+
+  // Dialing side. Nothing is written until start(); messages sent before that wait in the window.
+  explicit ReliablePipe(const AtLeastOnceOptions& opt);
+  ~ReliablePipe() override;
+
+  // Introduce this session on a newly connected pipe, before any other traffic on it: on the first
+  // connection before start(), and on every reconnection from the reconnecting pipe's dial step.
+  Result<void> handshake(Pipe& fresh);
+  // Run over `inner`, whose connection(s) handshake() has been called on.
+  void start(std::unique_ptr<Pipe> inner);
+
+  Result<void> send(const Message& msg, const SendOptions& opt) override;
+  Result<Message> recv(const RecvOptions& opt) override;
+  Result<std::size_t> recv_batch(std::span<Message> out, const RecvOptions& opt) override;
+  // Staged, then sent like send().
+  Result<std::span<std::uint8_t>> reserve(std::size_t size, const SendOptions& opt) override;
+  Result<void> commit(std::size_t len, const SendOptions& opt) override;
+  void close() override;
+
+  Stats stats() const;
+
+ private:
+  friend class ReliableListener;
+  explicit ReliablePipe(std::shared_ptr<detail::ReliableCore> core);
+
+  std::shared_ptr<detail::ReliableCore> core_;
+  detail::StagedSend staged_;
+};
+
+// Accepting side of ReliablePipe. accept() returns one pipe per dialer session. From the first
+// accept() on, a background thread accepts connections and each one's handshake runs on a thread
+// of its own (at most kMaxHandshakes at once); a dialer that reconnects is handed back to its
+// existing pipe there, without waiting for accept().
+class ReliableListener : public Listener {
+ public:
+  static constexpr std::size_t kMaxHandshakes = 64;
+
+  ReliableListener(std::unique_ptr<Listener> inner, const AtLeastOnceOptions& opt);
+  ~ReliableListener() override;
+
+  Result<std::unique_ptr<Pipe>> accept() override;
+  Result<std::string> local_address() const override;
+  void close() override;
+
+ private:
+  void accept_loop();
+  void introduce(std::unique_ptr<Pipe> p);
+  // The new session `p` starts, or null (not a reliable dialer, or a reconnect of a known one).
+  std::unique_ptr<Pipe> handshake(std::unique_ptr<Pipe> p);
+
+  std::unique_ptr<Listener> inner_;
+  AtLeastOnceOptions opt_;
+  std::mutex mu_;
+  std::condition_variable ready_cv_;  // accept(): a session, a failure or close; close(): handshakes done
+  std::unordered_map<std::uint64_t, std::weak_ptr<detail::ReliableCore>> sessions_;
+  std::deque<std::unique_ptr<Pipe>> ready_;  // new sessions for accept()
+  Status accept_failure_;
+  std::size_t handshakes_ = 0;
+  bool accepting_ = false;
+  bool closed_ = false;
+  std::atomic<bool> closing_{false};
+  std::thread acceptor_;
+};
+
+}  // namespace duct
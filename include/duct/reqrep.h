@@ -0,0 +1,111 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <memory>
+
+#include "duct/duct.h"
+#include "duct/message.h"
+#include "duct/status.h"
+
+namespace duct {
+
+namespace detail {
+class RequesterCore;  // src/reqrep.cc
+class ResponderCore;  // src/reqrep.cc
+}  // namespace detail
+
+// Request/reply over one connection, pipelined: every request carries a correlation id, so any
+// number of them may be outstanding at once and replies complete them in whatever order the
+// responder finishes. A Requester sits on the dialing end and a Responder on the accepting one;
+// both own their pipe and read it on one background thread.
+//
+// Each message starts with a small header (kind, correlation id, and the request's remaining
+// deadline or the reply's status), so the body is copied once on the way out; it arrives as a
+// slice of the received message. Both ends must use this layer.
+
+struct RequestOptions {
+  // Deadline for the reply; 0 = none. It is sent along, so the responder skips requests that
+  // have already timed out by the time a worker gets to them.
+  std::chrono::milliseconds timeout{0};
+  // Channel the request goes out on (SendOptions::channel); its reply comes back on the same one.
+  std::uint16_t channel = 0;
+};
+
+class Requester {
+ public:
+  struct Stats {
+    std::size_t in_flight = 0;     // awaiting a reply now
+    std::uint64_t sent = 0;        // requests written
+    std::uint64_t replied = 0;     // completed by a reply (successful or not)
+    std::uint64_t timed_out = 0;   // completed by their deadline
+    std::uint64_t unmatched = 0;   // replies to nothing outstanding (timed out already)
+  };
+
+  // Runs once per request with the reply, or the error status the responder's handler returned,
+  // or kTimeout / the pipe's failure. It runs on the reader thread (replies), a shared worker
+  // (deadlines), or inside call() (the request could not be sent), so it should not block.
+  using Callback = std::function<void(Result<Message>)>;
+
+  explicit Requester(std::unique_ptr<Pipe> conn);
+  ~Requester();
+
+  Requester(const Requester&) = delete;
+  Requester& operator=(const Requester&) = delete;
+
+  // Send `request`; `done` receives the outcome. Safe to call from any number of threads.
+  void call(const Message& request, Callback done, const RequestOptions& opt = {});
+  std::future<Result<Message>> call(const Message& request, const RequestOptions& opt = {});
+
+  // Close the connection; every outstanding request completes with kClosed.
+  void close();
+
+  Stats stats() const;
+
+ private:
+  std::shared_ptr<detail::RequesterCore> core_;
+};
+
+struct ResponderOptions {
+  // Handler calls running at once; beyond this the reader stops reading, so the requester's
+  // sends back up behind the connection.
+  std::size_t max_in_flight = 64;
+  // Threads this Responder runs its handlers on (at most max_in_flight). Its own, not the library's
+  // shared workers, so handlers may block without stalling the background work of other pipes.
+  std::size_t threads = 4;
+};
+
+class Responder {
+ public:
+  struct Stats {
+    std::size_t in_flight = 0;     // handler calls running or queued now
+    std::uint64_t requests = 0;    // received
+    std::uint64_t replied = 0;     // replies written
+    std::uint64_t failed = 0;      // of which carried the handler's error
+    std::uint64_t expired = 0;     // skipped: past their deadline before a worker got to them
+  };
+
+  // The reply to `request`, or an error status the requester receives instead (code and message).
+  // Runs on the Responder's ResponderOptions::threads; up to max_in_flight requests are queued or
+  // running at once.
+  using Handler = std::function<Result<Message>(const Message& request)>;
+
+  Responder(std::unique_ptr<Pipe> conn, Handler handler, const ResponderOptions& opt = {});
+  ~Responder();
+
+  Responder(const Responder&) = delete;
+  Responder& operator=(const Responder&) = delete;
+
+  // Stop reading, wait for running handlers to reply, then close the connection.
+  void close();
+
+  Stats stats() const;
+
+ private:
+  std::shared_ptr<detail::ResponderCore> core_;
+};
+
+}  // namespace duct
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
+
+#include "duct/duct.h"
+#include "duct/message.h"
+#include "duct/reactor.h"
+#include "duct/status.h"
+
+namespace duct {
+
+struct ServerOptions {
+  // Reactor threads ("shards"); 0 = one per hardware thread.
+  std::size_t shards = 0;
+  // Linux: pin shard i to CPU i (modulo the CPU count); ignored elsewhere.
+  bool pin_shards = false;
+  // tcp:// only: every shard listens on the address with SO_REUSEPORT and the kernel spreads the
+  // connections over them (kNotSupported where the option does not exist). Otherwise one listener,
+  // driven by shard 0, hands accepted pipes to the shards round-robin.
+  bool reuse_port = false;
+  // For the listener(s); reuse_port is set from the field above.
+  ListenOptions listen{};
+  ReactorOptions reactor{};
+};
+
+// Serves many connections on a fixed set of reactor threads instead of a thread per connection.
+// Each accepted pipe belongs to one shard for its whole life: its handlers run on that shard's
+// thread, one at a time, so per-connection state needs no locking (and per-shard state can be
+// indexed by current_shard()). Handlers must not block for long, since they hold up every pipe of
+// their shard; sends from them are fine.
+//
+// Listeners with a poll handle (tcp://) are accepted from inside a reactor. Others (shm://, or an
+// at-least-once listener) fall back to a blocking acceptor thread that hands pipes round-robin.
+class Server {
+ public:
+  struct Handlers {
+    // A pipe was accepted and registered with its shard.
+    std::function<void(const std::shared_ptr<Pipe>&)> on_open;
+    std::function<void(const std::shared_ptr<Pipe>&, const Message&)> on_message;
+    // The pipe failed, the peer closed it (kClosed), or the server is stopping (kClosed); it has
+    // been unregistered and is closed after this returns. Runs once per on_open.
+    std::function<void(const std::shared_ptr<Pipe>&, const Status&)> on_close;
+  };
+
+  // Listen on `address` and start the shards.
+  static Result<std::unique_ptr<Server>> start(const std::string& address, Handlers handlers,
+                                               const ServerOptions& opt = {});
+  ~Server();
+
+  Server(const Server&) = delete;
+  Server& operator=(const Server&) = delete;
+
+  // Stop accepting, close every connection (on_close runs on its shard) and join the shards.
+  // Idempotent; not from a handler.
+  void stop();
+
+  // The effective listening address (resolves port 0).
+  const std::string& address() const;
+  std::size_t shard_count() const;
+  // Connections open on `shard` right now.
+  std::size_t connections(std::size_t shard) const;
+
+  // Index of the shard whose thread is calling, or kNoShard off the shard threads.
+  static constexpr std::size_t kNoShard = static_cast<std::size_t>(-1);
+  static std::size_t current_shard();
+
+ private:
+  struct Impl;
+  explicit Server(std::unique_ptr<Impl> impl);
+
+  std::unique_ptr<Impl> impl_;
+};
+
+}  // namespace duct
@@ -1,8 +1,12 @@
 #pragma once
 
+#include <atomic>
+#include <concepts>
+#include <cstddef>
 #include <exception>
 #include <string>
 #include <string_view>
+#include <type_traits>
 #include <utility>
 
 namespace duct {
@@ -15,6 +19,7 @@ enum class StatusCode {
   kTimeout,
   kClosed,
   kProtocolError,
+  kCancelled,
 };
 
 /**
@@ -29,6 +34,7 @@ constexpr std::string_view to_string(StatusCode code) {
     case StatusCode::kTimeout:        return "Timeout";
     case StatusCode::kClosed:         return "Closed";
     case StatusCode::kProtocolError:  return "Protocol error";
+    case StatusCode::kCancelled:      return "Cancelled";
     default:                          return "Unknown";
   }
 }
@@ -56,34 +62,99 @@ class Exception : public std::exception {
   std::string full_message_;
 };
 
+// A Status message that is a string literal (or a static constexpr char array): kept by reference,
+// up to its first NUL. consteval, so a buffer that could go away or change does not compile here;
+// writable arrays and std::string go to the copying overloads instead.
+struct StatusLiteral {
+  template <std::size_t N>
+  consteval StatusLiteral(const char (&literal)[N]) : text(literal, std::char_traits<char>::length(literal)) {}
+  std::string_view text;
+};
+
+namespace detail {
+// Messages Status copies: anything a std::string can be made from, except const char arrays
+// (literals), which are StatusLiteral.
+template <class S>
+concept DynamicStatusMessage =
+    std::convertible_to<S, std::string> &&
+    !(std::is_array_v<std::remove_reference_t<S>> && std::is_const_v<std::remove_reference_t<S>>);
+}  // namespace detail
+
 /**
  * @brief 状态类，用于表示操作结果（非异常方式）
+ *
+ * A string literal message is kept by reference, so errors that pollers see all the time
+ * (timeouts, closed) neither allocate nor copy; only messages built at runtime (errno text, names)
+ * are stored in a std::string.
  */
 class Status {
  public:
   Status() : code_(StatusCode::kOk) {}
-  Status(StatusCode code, std::string message) : code_(code), message_(std::move(message)) {}
+  Status(StatusCode code, StatusLiteral message) : code_(code), literal_(message.text) {}
+  template <detail::DynamicStatusMessage S>
+  Status(StatusCode code, S&& message) : code_(code), dynamic_(std::forward<S>(message)) {}
+
+  Status(const Status& other) : code_(other.code_), literal_(other.literal_), dynamic_(other.dynamic_) {}
+  Status(Status&& other) noexcept
+      : code_(other.code_), literal_(other.literal_), dynamic_(std::move(other.dynamic_)) {}
+  Status& operator=(const Status& other) {
+    if (this != &other) assign(other.code_, other.literal_, std::string(other.dynamic_));
+    return *this;
+  }
+  Status& operator=(Status&& other) noexcept {
+    if (this != &other) assign(other.code_, other.literal_, std::move(other.dynamic_));
+    return *this;
+  }
+  ~Status() { delete spelled_.load(std::memory_order_relaxed); }
 
   static Status Ok() { return Status(); }
-  static Status invalid_argument(std::string m) { return Status(StatusCode::kInvalidArgument, std::move(m)); }
-  static Status not_supported(std::string m) { return Status(StatusCode::kNotSupported, std::move(m)); }
-  static Status io_error(std::string m) { return Status(StatusCode::kIoError, std::move(m)); }
-  static Status timeout(std::string m) { return Status(StatusCode::kTimeout, std::move(m)); }
-  static Status closed(std::string m) { return Status(StatusCode::kClosed, std::move(m)); }
-  static Status protocol_error(std::string m) { return Status(StatusCode::kProtocolError, std::move(m)); }
+  static Status invalid_argument(StatusLiteral m) { return Status(StatusCode::kInvalidArgument, m); }
+  static Status not_supported(StatusLiteral m) { return Status(StatusCode::kNotSupported, m); }
+  static Status io_error(StatusLiteral m) { return Status(StatusCode::kIoError, m); }
+  static Status timeout(StatusLiteral m) { return Status(StatusCode::kTimeout, m); }
+  static Status closed(StatusLiteral m) { return Status(StatusCode::kClosed, m); }
+  static Status protocol_error(StatusLiteral m) { return Status(StatusCode::kProtocolError, m); }
+  static Status cancelled(StatusLiteral m) { return Status(StatusCode::kCancelled, m); }
+
+  template <detail::DynamicStatusMessage S>
+  static Status invalid_argument(S&& m) { return Status(StatusCode::kInvalidArgument, std::forward<S>(m)); }
+  template <detail::DynamicStatusMessage S>
+  static Status not_supported(S&& m) { return Status(StatusCode::kNotSupported, std::forward<S>(m)); }
+  template <detail::DynamicStatusMessage S>
+  static Status io_error(S&& m) { return Status(StatusCode::kIoError, std::forward<S>(m)); }
+  template <detail::DynamicStatusMessage S>
+  static Status timeout(S&& m) { return Status(StatusCode::kTimeout, std::forward<S>(m)); }
+  template <detail::DynamicStatusMessage S>
+  static Status closed(S&& m) { return Status(StatusCode::kClosed, std::forward<S>(m)); }
+  template <detail::DynamicStatusMessage S>
+  static Status protocol_error(S&& m) { return Status(StatusCode::kProtocolError, std::forward<S>(m)); }
+  template <detail::DynamicStatusMessage S>
+  static Status cancelled(S&& m) { return Status(StatusCode::kCancelled, std::forward<S>(m)); }
 
   bool ok() const { return code_ == StatusCode::kOk; }
   explicit operator bool() const { return ok(); }
 
   StatusCode code() const { return code_; }
-  const std::string& message() const { return message_; }
+  // A literal message is copied into a std::string the first time it is asked for here (once per
+  // Status, from any thread); message_view() reads it without that copy. Both are valid as long as
+  // this Status is left alone.
+  const std::string& message() const {
+    if (!literal_.data()) return dynamic_;
+    const std::string* s = spelled_.load(std::memory_order_acquire);
+    if (s) return *s;
+    auto* made = new std::string(literal_);
+    if (spelled_.compare_exchange_strong(s, made, std::memory_order_acq_rel)) return *made;
+    delete made;
+    return *s;
+  }
+  std::string_view message_view() const noexcept { return literal_.data() ? literal_ : std::string_view(dynamic_); }
 
   /**
    * @brief 获取完整的错误消息（包含状态码名称）
    */
   std::string to_string() const {
     if (ok()) return "Ok";
-    return "[" + std::string(duct::to_string(code_)) + "] " + message_;
+    return "[" + std::string(duct::to_string(code_)) + "] " + std::string(message_view());
   }
 
   /**
@@ -97,12 +168,21 @@ class Status {
   }
 
  private:
+  void assign(StatusCode code, std::string_view literal, std::string dynamic) {
+    code_ = code;
+    literal_ = literal;
+    dynamic_ = std::move(dynamic);
+    delete spelled_.exchange(nullptr, std::memory_order_relaxed);
+  }
+
   StatusCode code_;
-  std::string message_;
+  std::string_view literal_;  // set for string literals; dynamic_ is then empty
+  std::string dynamic_;
+  mutable std::atomic<const std::string*> spelled_{nullptr};  // message() of a literal, once asked
 };
 
 inline Exception::Exception(const Status& status)
-    : Exception(status.code(), status.message()) {}
+    : Exception(status.code(), std::string(status.message_view())) {}
 
 template <class T>
 class Result {
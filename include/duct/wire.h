@@ -1,11 +1,25 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cstddef>
 #include <cstdint>
+#include <deque>
+#include <span>
+#include <unordered_map>
+#include <vector>
 
+#include "duct/duct.h"
 #include "duct/message.h"
+#include "duct/protocol.h"
 #include "duct/status.h"
 
+namespace duct::detail {
+class FrameCompressor;    // src/compression.h
+class FrameDecompressor;  // src/compression.h
+}  // namespace duct::detail
+
 namespace duct::wire {
 
 constexpr std::size_t kHeaderLen = 16;
@@ -34,9 +48,311 @@ struct FrameHeader {
 void encode_header(const FrameHeader& h, std::uint8_t out[kHeaderLen]);
 Result<FrameHeader> decode_header(const std::uint8_t in[kHeaderLen]);
 
-// Socket I/O functions (cross-platform)
-Result<void> write_frame(SocketHandle fd, const Message& msg, std::uint32_t flags = 0);
+// LEB128 varints of up to kMaxVarintLen bytes (21 bits), as used by compact headers.
+constexpr std::size_t kMaxVarintLen = 3;
+std::size_t put_varint(std::uint32_t v, std::uint8_t* out);
+// Returns the varint's length, or 0 if `avail` bytes do not hold all of it yet.
+Result<std::size_t> get_varint(const std::uint8_t* in, std::size_t avail, std::uint32_t* v);
+
+// Compact frame header, once a hello has switched the direction over (see FrameEncoder): a LEB128
+// varint of (payload_len << 4 | kCompressed << 3 | has_channel << 2 | kFragCont << 1 | kFrag), then
+// the channel as a varint unless it is 0. Two bytes for a typical small message on channel 0. It
+// carries the channel, fragment and compression bits of `flags`, which are all the bits in use,
+// and kTraced as bit 16 of the channel varint (has_channel set even on channel 0).
+constexpr std::size_t kMaxCompactHeaderLen = 2 * kMaxVarintLen;
+std::size_t encode_compact_header(std::size_t payload_len, std::uint32_t flags, std::uint8_t out[kMaxCompactHeaderLen]);
+// Returns the header's length, or 0 if `avail` bytes do not hold all of it yet.
+Result<std::size_t> decode_compact_header(const std::uint8_t* in, std::size_t avail, FrameHeader* out);
+
+// A hello is a v1-layout header with version kProtocolVersionCompact whose payload starts with the
+// sender's Capability bits and the id of its compression dictionary (big-endian u32s, the id 0 for
+// none); later versions may append to it. A hello of the bits alone names no dictionary.
+constexpr std::size_t kHelloLen = kHeaderLen + 8;
+constexpr std::size_t kMaxHelloPayload = 256;
+constexpr std::uint32_t kCapabilities = static_cast<std::uint32_t>(Capability::kCompactFrames);
+
+// Which side of a stream connection asks for compact headers.
+enum class CompactFraming : std::uint8_t {
+  kOff,       // v1 headers only
+  kInitiate,  // dialing side: hello before the first frame
+  kAnswer,    // accepting side: hello once the peer's has arrived
+};
+
+// Sending half of a stream connection's framing. Every connection starts with v1 headers; a side
+// that switches sends its hello ahead of the next frame and uses compact headers from then on. Each
+// direction switches on its own, so a peer that never sends a hello (an older version) keeps
+// seeing, and sending, v1 frames. on_peer_hello() is the receiving side's hook; everything else
+// belongs to the connection's (single) sender.
+class FrameEncoder {
+ public:
+  void configure(CompactFraming mode) {
+    answer_ = mode == CompactFraming::kAnswer;
+    state_.store(mode == CompactFraming::kInitiate ? kHelloDue : kV1, std::memory_order_relaxed);
+  }
+
+  // What our hello advertises besides kCapabilities: the codecs this side decompresses and the id
+  // of its dictionary (set before the connection is used).
+  void advertise(std::uint32_t codecs, std::uint32_t dictionary_id) {
+    codecs_ = codecs;
+    dictionary_id_ = dictionary_id;
+  }
+
+  // The peer's hello arrived (FrameReader) with its capabilities and dictionary id.
+  void on_peer_hello(std::uint32_t caps, std::uint32_t dictionary_id) {
+    peer_.store(static_cast<std::uint64_t>(dictionary_id) << 32 | caps, std::memory_order_release);
+    std::uint8_t v1 = kV1;
+    if (answer_) state_.compare_exchange_strong(v1, kHelloDue, std::memory_order_release, std::memory_order_relaxed);
+  }
+
+  // If a hello is due, write it to `out` and switch to compact headers: the caller sends it first.
+  bool take_hello(std::uint8_t out[kHelloLen]);
+
+  // Header of the next frame, v1 or compact; returns its length (at most kHeaderLen).
+  std::size_t encode(std::size_t payload_len, std::uint32_t flags, std::uint8_t out[kHeaderLen]) const;
+
+  // Compress frame payloads with `c` (owned by the caller) into `codec` (a Capability bit) from
+  // now on, but only once the peer's hello says it can decompress them: it lists the codec and,
+  // if the codec `uses_dictionary`, names the same dictionary as ours.
+  void set_compressor(detail::FrameCompressor* c, std::uint32_t codec, bool uses_dictionary) {
+    compressor_ = c;
+    codec_ = codec;
+    uses_dictionary_ = uses_dictionary;
+  }
+  // The payload to send in place of `payload` (and add kCompressed to its frame's flags), or an
+  // empty message to send it as it is.
+  Message compress(std::span<const std::uint8_t> payload) const;
+
+ private:
+  enum : std::uint8_t { kV1, kHelloDue, kCompact };
+  std::atomic<std::uint8_t> state_{kV1};
+  bool answer_ = false;
+  std::uint32_t codecs_ = 0;
+  std::uint32_t dictionary_id_ = 0;
+  // The peer's dictionary id and capabilities (high and low half); 0 until its hello, which always
+  // carries kCompactFrames.
+  std::atomic<std::uint64_t> peer_{0};
+  detail::FrameCompressor* compressor_ = nullptr;
+  std::uint32_t codec_ = 0;
+  bool uses_dictionary_ = false;
+};
+
+constexpr std::uint32_t kFragmentFlags = to_u32(FrameFlags::kFrag) | to_u32(FrameFlags::kFragCont);
+
+inline bool is_fragment(std::uint32_t flags) { return (flags & kFragmentFlags) != 0; }
+
+// Flags for the frames of a send: its channel, plus kFrag / kFragCont for opt.more / opt.continued,
+// which for_each_frame() moves to the last frame of the last message / first frame of the first.
+inline std::uint32_t send_flags(const SendOptions& opt) {
+  std::uint32_t flags = channel_flags(opt.channel);
+  if (opt.more) flags |= to_u32(FrameFlags::kFrag);
+  if (opt.continued) flags |= to_u32(FrameFlags::kFragCont);
+  if (opt.traced) flags |= to_u32(FrameFlags::kTraced);
+  return flags;
+}
+
+// Sampled latency tracing: what the sender knows about a message, in front of its payload on
+// kTraced frames (big-endian). Durations are the sender's own; sent_at_ns is its wall clock, so
+// transit across hosts is as good as their clock sync.
+struct TraceHeader {
+  std::uint64_t id = 0;          // unique per sending pipe
+  std::uint64_t sent_at_ns = 0;  // system_clock when handed to the transport
+  std::uint32_t admit_us = 0;    // inside send() before being queued (rate limit, HWM)
+  std::uint32_t queue_us = 0;    // queued until handed to the transport
+};
+constexpr std::size_t kTraceHeaderLen = 24;
+
+// A copy of `m` behind `h`, to send with SendOptions::traced.
+Message add_trace(const Message& m, const TraceHeader& h);
+// The header of a traced() message.
+TraceHeader trace_header(const Message& m);
+
+// Fill in a received message's metadata from its (last) frame's flags: the channel, and for a
+// kTraced frame the header is stripped, leaving the message traced().
+inline void set_frame_meta(Message& m, std::uint32_t flags) {
+  if ((flags & to_u32(FrameFlags::kTraced)) != 0 && m.size() >= kTraceHeaderLen) {
+    m = m.slice(kTraceHeaderLen, m.size() - kTraceHeaderLen);
+    m.set_traced(true);
+  }
+  m.set_channel(frame_channel(flags));
+}
+
+// Whether message `m` (first / last of its send) goes out as one ordinary frame.
+inline bool is_whole_frame(const Message& m, bool first, bool last, std::uint32_t flags,
+                           std::size_t max_payload = kMaxFramePayload) {
+  return m.size() <= max_payload && !(first && (flags & to_u32(FrameFlags::kFragCont)) != 0) &&
+         !(last && (flags & to_u32(FrameFlags::kFrag)) != 0);
+}
+
+// Cut message `m` into frames of at most `max_payload` bytes and call f(offset, len, frame_flags)
+// for each in order. A message that needs more than one frame gets kFrag on every frame but its
+// last and kFragCont on every frame but its first; `flags` comes from send_flags().
+template <class F>
+void for_each_frame(const Message& m, bool first, bool last, std::uint32_t flags, F&& f,
+                    std::size_t max_payload = kMaxFramePayload) {
+  const std::uint32_t base = flags & ~kFragmentFlags;
+  const bool more = last && (flags & to_u32(FrameFlags::kFrag)) != 0;
+  const bool continued = first && (flags & to_u32(FrameFlags::kFragCont)) != 0;
+  std::size_t off = 0;
+  do {
+    const std::size_t len = std::min(max_payload, m.size() - off);
+    std::uint32_t frame_flags = base;
+    if (off != 0 || continued) frame_flags |= to_u32(FrameFlags::kFragCont);
+    if (off + len < m.size() || more) frame_flags |= to_u32(FrameFlags::kFrag);
+    f(off, len, frame_flags);
+    off += len;
+  } while (off < m.size());
+}
+
+// Puts fragment runs back together, per channel, within FragmentOptions. An incomplete message is
+// dropped when it would go over reassembly_max_bytes, when its next fragment is late, or when a
+// frame that does not continue it arrives on its channel; fragments continuing nothing are dropped.
+class Reassembler {
+ public:
+  explicit Reassembler(const FragmentOptions& opt = {}) : opt_(opt) {}
+
+  void set_options(const FragmentOptions& opt) { opt_ = opt; }
+
+  // A whole (non-fragment) frame arrived on `channel`.
+  void on_whole(std::uint16_t channel) {
+    if (!partials_.empty()) abandon(channel);
+  }
+
+  // A fragment frame. Its payload is copied, so the caller may release it. Returns true with
+  // `*out` set when it completes a message.
+  bool add_fragment(std::span<const std::uint8_t> payload, std::uint16_t channel, std::uint32_t flags, Message* out);
+
+  // Bytes held by incomplete messages.
+  std::size_t buffered_bytes() const { return bytes_; }
+
+ private:
+  struct Partial {
+    std::vector<std::uint8_t> bytes;
+    std::chrono::steady_clock::time_point last;  // when the latest fragment arrived
+  };
+
+  void abandon(std::uint16_t channel);
+  void drop_stale(std::chrono::steady_clock::time_point now);
+
+  FragmentOptions opt_;
+  std::unordered_map<std::uint16_t, Partial> partials_;
+  std::size_t bytes_ = 0;
+};
+
+// I/O work the calling thread has done, for instrumentation: sample it around a piece of I/O.
+// Syscalls are socket and notification ones (sendmsg / WSASend, recv, shm wakeup writes and reads);
+// copies are payloads copied in user space (into or out of a shm ring, out of a receive buffer
+// into an inline message, compressed or decompressed, reassembled), one per frame or message.
+struct IoCounts {
+  std::uint64_t writes = 0;
+  std::uint64_t reads = 0;
+  std::uint64_t copies = 0;
+};
+
+inline IoCounts& thread_io() {
+  thread_local IoCounts counts;
+  return counts;
+}
+
+// Socket I/O functions (cross-platform). `flags` (see send_flags()) go into every frame's header;
+// messages larger than kMaxFramePayload are written as fragment runs. Received messages report
+// the channel bits as Message::channel(). Headers come from `enc` when given (a due hello goes out
+// first), v1 otherwise.
+Result<void> write_frame(SocketHandle fd, const Message& msg, std::uint32_t flags = 0, FrameEncoder* enc = nullptr);
+// Write several frames with gathered writes (writev-style, up to 64 frames per syscall). Returns
+// the number of frames written; a failure after the first chunk ends early with a short count.
+Result<std::size_t> write_frames(SocketHandle fd, std::span<const Message> msgs, std::uint32_t flags = 0,
+                                 FrameEncoder* enc = nullptr);
+// Send a frame whose payload already sits right after kHeaderLen bytes reserved at `buf`: the header
+// is encoded in place, right-aligned against the payload, and the frame goes out in one write.
+Result<void> write_prefixed_frame(SocketHandle fd, std::uint8_t* buf, std::size_t payload_len, std::uint32_t flags = 0,
+                                  FrameEncoder* enc = nullptr);
+// uds://: copy `msg` into a sealed memfd and send a kFdPayload frame with the descriptor attached
+// (SCM_RIGHTS), so the payload itself never crosses the socket. One message, never fragmented;
+// kNotSupported where there is no memfd_create() (everywhere but Linux).
+Result<void> write_fd_frame(SocketHandle fd, const Message& msg, std::uint32_t flags = 0, FrameEncoder* enc = nullptr);
+// Exactly one v1 frame, whatever its flags: no reassembly.
 Result<Message> read_frame(SocketHandle fd);
 
+// Per-connection buffered frame reader. One recv() pulls as much as the socket has into a pooled
+// receive buffer, several frames are parsed out of it, and each payload is returned as a Message
+// slice of that buffer (no per-frame allocation or copy). Fragments are reassembled (copied out
+// as they arrive) and only whole messages are returned. Outstanding messages keep their buffer
+// alive; the reader switches to a fresh one instead of overwriting bytes they still reference.
+// Not thread-safe: one reader per connection, used by the receiving thread.
+class FrameReader {
+ public:
+  // Must hold at least one maximal frame.
+  static constexpr std::size_t kDefaultCapacity = 256 * 1024;
+
+  explicit FrameReader(std::size_t capacity = kDefaultCapacity);
+  ~FrameReader();
+
+  FrameReader(const FrameReader&) = delete;
+  FrameReader& operator=(const FrameReader&) = delete;
+
+  void set_fragment_options(const FragmentOptions& opt) { reassembler_.set_options(opt); }
+  // Tell `enc` (the connection's sending side) when the peer's hello arrives, so it can answer.
+  void set_encoder(FrameEncoder* enc) { encoder_ = enc; }
+  // Decompress kCompressed frames with `d` (owned by the caller); without one they are an error.
+  void set_decompressor(detail::FrameDecompressor* d) { decompressor_ = d; }
+
+  // uds://: receive with recvmsg() and keep descriptors passed alongside the stream, for the
+  // kFdPayload frames they belong to (mapped read-only as the message). POSIX only.
+  void set_descriptor_passing(bool on) { pass_fds_ = on; }
+
+  // Capability bits and dictionary id from the peer's hello; 0 until one arrives (and for older
+  // peers).
+  std::uint32_t peer_capabilities() const { return peer_caps_; }
+  std::uint32_t peer_dictionary_id() const { return peer_dictionary_id_; }
+
+  // Return the next frame, blocking in recv() only when no complete frame is buffered.
+  Result<Message> read(SocketHandle fd);
+
+  // Pop a message that is already fully buffered without any I/O. Returns false if none is.
+  Result<bool> try_pop(Message* out);
+
+  // One recv() that does not block: take whatever the socket holds right now. Returns false if it
+  // had nothing. EOF is kClosed.
+  Result<bool> fill_nonblocking(SocketHandle fd);
+
+  // Take bytes someone else received (a completion engine). With nothing pending the chunk itself
+  // becomes the buffer, so frames inside it are sliced out without a copy; otherwise a prefix is
+  // copied in. Returns how much was taken: less than chunk.size() only when the buffer is full of
+  // complete frames, which must be popped before the rest fits.
+  Result<std::size_t> append(const Message& chunk);
+
+ private:
+  // The frame at begin_, as far as it is buffered.
+  struct Pending {
+    std::size_t header = 0;  // header bytes; 0 while the header itself is incomplete
+    FrameHeader h;
+    bool hello = false;
+  };
+  Result<Pending> peek() const;
+  // The message of a kFdPayload frame: the oldest passed descriptor, mapped.
+  Result<Message> take_passed(const std::uint8_t* payload, std::size_t len);
+  // Drop every queued descriptor and fail once the peer has passed more than frames explain.
+  Result<void> check_passed();
+  // Make room to receive the rest of the frame at begin_.
+  Result<void> prepare_fill();
+  // Make sure [begin_, begin_ + need) can be filled without running past the buffer.
+  void make_room(std::size_t need);
+
+  std::size_t capacity_;
+  // Whole receive buffer: our own capacity_-sized pool block, or an adopted chunk. Frames are
+  // slices of it; buf_.size() is how far it may be filled.
+  Message buf_;
+  std::size_t begin_ = 0;  // first unparsed byte
+  std::size_t end_ = 0;    // one past the last received byte
+  Reassembler reassembler_;
+  bool compact_ = false;  // the peer's hello has arrived; compact headers follow it
+  std::uint32_t peer_caps_ = 0;
+  std::uint32_t peer_dictionary_id_ = 0;
+  FrameEncoder* encoder_ = nullptr;
+  detail::FrameDecompressor* decompressor_ = nullptr;
+  bool pass_fds_ = false;
+  std::deque<int> fds_;  // passed descriptors not yet claimed by their frame, in arrival order
+};
+
 }  // namespace duct::wire
 
@@ -37,6 +37,7 @@ Result<Address> Address::parse(std::string s) {
     else if (a.scheme_text == "uds") a.scheme = Scheme::kUds;
     else if (a.scheme_text == "shm") a.scheme = Scheme::kShm;
     else if (a.scheme_text == "pipe") a.scheme = Scheme::kPipe;
+    else if (a.scheme_text == "inproc") a.scheme = Scheme::kInproc;
     else a.scheme = Scheme::kUnknown;
   }
 
@@ -57,7 +58,7 @@ Result<Address> Address::parse(std::string s) {
     return a;
   }
 
-  if (a.scheme == Scheme::kShm || a.scheme == Scheme::kPipe) {
+  if (a.scheme == Scheme::kShm || a.scheme == Scheme::kPipe || a.scheme == Scheme::kInproc) {
     if (sv.empty()) {
       return Status::invalid_argument(a.scheme_text + " address must be non-empty name");
     }
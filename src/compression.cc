@@ -0,0 +1,218 @@
+#include "compression.h"
+
+#include <string>
+
+#include "duct/wire.h"
+
+#if defined(DUCT_HAVE_LZ4)
+#include <lz4.h>
+#endif
+#if defined(DUCT_HAVE_ZSTD)
+#include <zstd.h>
+#endif
+
+namespace duct {
+
+bool compression_supported(Compression codec) {
+  switch (codec) {
+    case Compression::kNone:
+      return true;
+    case Compression::kLz4:
+#if defined(DUCT_HAVE_LZ4)
+      return true;
+#else
+      return false;
+#endif
+    case Compression::kZstd:
+#if defined(DUCT_HAVE_ZSTD)
+      return true;
+#else
+      return false;
+#endif
+  }
+  return false;
+}
+
+namespace detail {
+
+namespace {
+
+// Codec byte and raw length ahead of the codec's output.
+constexpr std::size_t kMaxPrefixLen = 1 + wire::kMaxVarintLen;
+
+Status bad_frame(std::string why) { return Status::protocol_error("compressed frame: " + std::move(why)); }
+
+}  // namespace
+
+std::uint32_t decodable_codecs() {
+  std::uint32_t caps = 0;
+  for (auto codec : {Compression::kLz4, Compression::kZstd}) {
+    if (compression_supported(codec)) caps |= codec_capability(codec);
+  }
+  return caps;
+}
+
+std::uint32_t codec_capability(Compression codec) {
+  switch (codec) {
+    case Compression::kNone:
+      return 0;
+    case Compression::kLz4:
+      return static_cast<std::uint32_t>(Capability::kLz4);
+    case Compression::kZstd:
+      return static_cast<std::uint32_t>(Capability::kZstd);
+  }
+  return 0;
+}
+
+// FNV-1a; only equality matters, and a mismatch merely leaves frames raw.
+std::uint32_t dictionary_id(const CompressionOptions& opt) {
+  if (!opt.dictionary || opt.dictionary->empty()) return 0;
+  std::uint32_t h = 2166136261u;
+  for (std::uint8_t b : *opt.dictionary) {
+    h ^= b;
+    h *= 16777619u;
+  }
+  return h == 0 ? 1 : h;
+}
+
+struct FrameCompressor::Codec {
+#if defined(DUCT_HAVE_ZSTD)
+  ZSTD_CCtx* cctx = nullptr;
+  ZSTD_CDict* cdict = nullptr;
+
+  ~Codec() {
+    ZSTD_freeCCtx(cctx);
+    ZSTD_freeCDict(cdict);
+  }
+#endif
+
+  // Compress `in` into at most `room` bytes at `out`; returns the length, 0 if it did not fit.
+  std::size_t compress(const CompressionOptions& opt, std::span<const std::uint8_t> in, std::uint8_t* out,
+                       std::size_t room) {
+    switch (opt.codec) {
+#if defined(DUCT_HAVE_LZ4)
+      case Compression::kLz4: {
+        const int r = LZ4_compress_fast(reinterpret_cast<const char*>(in.data()), reinterpret_cast<char*>(out),
+                                        static_cast<int>(in.size()), static_cast<int>(room),
+                                        opt.level > 0 ? opt.level : 1);
+        return r > 0 ? static_cast<std::size_t>(r) : 0;
+      }
+#endif
+#if defined(DUCT_HAVE_ZSTD)
+      case Compression::kZstd: {
+        const std::size_t r = ZSTD_compress2(cctx, out, room, in.data(), in.size());
+        return ZSTD_isError(r) ? 0 : r;
+      }
+#endif
+      default:
+        (void)in;
+        (void)out;
+        (void)room;
+        return 0;
+    }
+  }
+};
+
+FrameCompressor::FrameCompressor(const CompressionOptions& opt) : opt_(opt) {
+  if (!compression_supported(opt_.codec) || opt_.codec == Compression::kNone) return;
+  codec_ = std::make_unique<Codec>();
+#if defined(DUCT_HAVE_ZSTD)
+  if (opt_.codec == Compression::kZstd) {
+    codec_->cctx = ZSTD_createCCtx();
+    // The prefix already has the raw length.
+    (void)ZSTD_CCtx_setParameter(codec_->cctx, ZSTD_c_contentSizeFlag, 0);
+    (void)ZSTD_CCtx_setParameter(codec_->cctx, ZSTD_c_compressionLevel, opt_.level);
+    if (opt_.dictionary && !opt_.dictionary->empty()) {
+      codec_->cdict = ZSTD_createCDict(opt_.dictionary->data(), opt_.dictionary->size(), opt_.level);
+      (void)ZSTD_CCtx_refCDict(codec_->cctx, codec_->cdict);
+    }
+  }
+#endif
+}
+
+FrameCompressor::~FrameCompressor() = default;
+
+Message FrameCompressor::compress(std::span<const std::uint8_t> payload) {
+  if (!codec_ || payload.size() <= kMaxPrefixLen || payload.size() < opt_.min_bytes) return Message();
+  // Output no smaller than the payload goes out raw, so the payload's size is all the room needed.
+  Message out = Message::allocate(payload.size());
+  out.data()[0] = static_cast<std::uint8_t>(opt_.codec);
+  const std::size_t prefix = 1 + wire::put_varint(static_cast<std::uint32_t>(payload.size()), out.data() + 1);
+  const std::size_t n = codec_->compress(opt_, payload, out.data() + prefix, out.size() - prefix - 1);
+  if (n == 0) return Message();
+  out.resize(prefix + n);
+  return out;
+}
+
+struct FrameDecompressor::Codec {
+#if defined(DUCT_HAVE_ZSTD)
+  ZSTD_DCtx* dctx = nullptr;
+  ZSTD_DDict* ddict = nullptr;
+
+  ~Codec() {
+    ZSTD_freeDCtx(dctx);
+    ZSTD_freeDDict(ddict);
+  }
+#endif
+
+  // Decompress `in` (from `codec`) into exactly `raw_len` bytes at `out`.
+  Result<void> decompress(const CompressionOptions& opt, Compression codec, std::span<const std::uint8_t> in,
+                          std::uint8_t* out, std::size_t raw_len) {
+    switch (codec) {
+#if defined(DUCT_HAVE_LZ4)
+      case Compression::kLz4: {
+        const int r = LZ4_decompress_safe(reinterpret_cast<const char*>(in.data()), reinterpret_cast<char*>(out),
+                                          static_cast<int>(in.size()), static_cast<int>(raw_len));
+        if (r != static_cast<int>(raw_len)) return bad_frame("lz4 data is corrupt");
+        return {};
+      }
+#endif
+#if defined(DUCT_HAVE_ZSTD)
+      case Compression::kZstd: {
+        if (dctx == nullptr) {
+          dctx = ZSTD_createDCtx();
+          if (opt.dictionary && !opt.dictionary->empty()) {
+            ddict = ZSTD_createDDict(opt.dictionary->data(), opt.dictionary->size());
+            (void)ZSTD_DCtx_refDDict(dctx, ddict);
+          }
+        }
+        const std::size_t r = ZSTD_decompressDCtx(dctx, out, raw_len, in.data(), in.size());
+        if (ZSTD_isError(r)) return bad_frame(std::string("zstd: ") + ZSTD_getErrorName(r));
+        if (r != raw_len) return bad_frame("zstd: wrong length");
+        return {};
+      }
+#endif
+      default:
+        (void)opt;
+        (void)in;
+        (void)out;
+        (void)raw_len;
+        return Status::not_supported("compressed frame: codec " + std::to_string(static_cast<int>(codec)) +
+                                     " not built in");
+    }
+  }
+};
+
+FrameDecompressor::FrameDecompressor(const CompressionOptions& opt) : opt_(opt) {}
+
+FrameDecompressor::~FrameDecompressor() = default;
+
+Result<Message> FrameDecompressor::decompress(std::span<const std::uint8_t> payload) {
+  if (payload.empty()) return bad_frame("empty");
+  std::uint32_t raw_len = 0;
+  auto n = wire::get_varint(payload.data() + 1, payload.size() - 1, &raw_len);
+  if (!n.ok() || n.value() == 0 || raw_len == 0 || raw_len > wire::kMaxFramePayload) {
+    return bad_frame("bad length");
+  }
+  // Contexts are made on first use: most pipes never receive a compressed frame.
+  if (!codec_) codec_ = std::make_unique<Codec>();
+  Message out = Message::allocate(raw_len);
+  auto st = codec_->decompress(opt_, static_cast<Compression>(payload[0]), payload.subspan(1 + n.value()), out.data(),
+                               raw_len);
+  if (!st.ok()) return st.status();
+  return out;
+}
+
+}  // namespace detail
+
+}  // namespace duct
@@ -0,0 +1,67 @@
+#pragma once
+
+// Frame payload compression for stream pipes (CompressionOptions). A compressed payload is
+//   codec (1 byte, Compression) | raw length (LEB128 varint) | codec output
+// and carries FrameFlags::kCompressed. Frames are compressed one by one, each on its own, so any
+// frame (a fragment included) can be decompressed as soon as it arrives. LZ4 and zstd are only
+// available when CMake found them (DUCT_HAVE_LZ4, DUCT_HAVE_ZSTD).
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <vector>
+
+#include "duct/duct.h"
+#include "duct/message.h"
+#include "duct/status.h"
+
+namespace duct::detail {
+
+// Capability bits of the codecs this build decompresses, for hellos.
+std::uint32_t decodable_codecs();
+// The Capability bit of `codec` (0 for kNone).
+std::uint32_t codec_capability(Compression codec);
+// What hellos call opt.dictionary: a hash of its bytes, never 0; 0 without one.
+std::uint32_t dictionary_id(const CompressionOptions& opt);
+
+// Sending side. Keeps the codec's context between frames; one sender at a time.
+class FrameCompressor {
+ public:
+  explicit FrameCompressor(const CompressionOptions& opt);
+  ~FrameCompressor();
+
+  FrameCompressor(const FrameCompressor&) = delete;
+  FrameCompressor& operator=(const FrameCompressor&) = delete;
+
+  // The compressed form of `payload`, or an empty message when it goes out raw: below
+  // min_bytes, no smaller compressed, or the codec is not built in.
+  Message compress(std::span<const std::uint8_t> payload);
+
+ private:
+  struct Codec;
+
+  CompressionOptions opt_;
+  std::unique_ptr<Codec> codec_;
+};
+
+// Receiving side. One receiver at a time.
+class FrameDecompressor {
+ public:
+  explicit FrameDecompressor(const CompressionOptions& opt);
+  ~FrameDecompressor();
+
+  FrameDecompressor(const FrameDecompressor&) = delete;
+  FrameDecompressor& operator=(const FrameDecompressor&) = delete;
+
+  // Decompress a kCompressed payload (at most kMaxFramePayload bytes once decompressed).
+  Result<Message> decompress(std::span<const std::uint8_t> payload);
+
+ private:
+  struct Codec;
+
+  CompressionOptions opt_;
+  std::unique_ptr<Codec> codec_;
+};
+
+}  // namespace duct::detail
@@ -0,0 +1,193 @@
+#include "duct/coro.h"
+
+#include <deque>
+#include <mutex>
+
+#include "scheduler.h"
+
+namespace duct {
+namespace detail {
+
+struct AsyncPipeState {
+  struct Waiter {
+    std::uint64_t ticket = 0;
+    std::coroutine_handle<> h;
+    AsyncPipe::RecvAwaitable* awaitable = nullptr;
+    Reactor::TimerId timer = 0;
+  };
+
+  Reactor* reactor = nullptr;
+  std::shared_ptr<Pipe> pipe;
+  Reactor::Id id = 0;
+
+  std::mutex mu;
+  std::deque<Message> inbox;     // arrived while no recv() waited
+  std::deque<Waiter> waiters;    // in arrival order
+  Status failure;                // set once the pipe failed or was closed
+  bool closed = false;
+  std::uint64_t next_ticket = 1;
+
+  // Loop thread.
+  void on_message(const Message& m) {
+    std::unique_lock<std::mutex> lock(mu);
+    if (waiters.empty()) {
+      inbox.push_back(m);
+      return;
+    }
+    Waiter w = waiters.front();
+    waiters.pop_front();
+    w.awaitable->result_ = m;
+    lock.unlock();
+    resume(w);
+  }
+
+  // Loop thread: the reactor already dropped the pipe.
+  void on_error(const Status& st) {
+    std::deque<Waiter> failed;
+    {
+      std::lock_guard<std::mutex> lock(mu);
+      if (failure.ok()) failure = st;
+      failed.swap(waiters);
+      for (Waiter& w : failed) w.awaitable->result_ = failure;
+    }
+    for (Waiter& w : failed) resume(w);
+  }
+
+  // Loop thread: end the wait of `ticket` (timed out or cancelled), unless it ended already.
+  void finish(std::uint64_t ticket, Status st) {
+    std::unique_lock<std::mutex> lock(mu);
+    for (auto it = waiters.begin(); it != waiters.end(); ++it) {
+      if (it->ticket != ticket) continue;
+      Waiter w = *it;
+      waiters.erase(it);
+      w.awaitable->result_ = std::move(st);
+      lock.unlock();
+      resume(w);
+      return;
+    }
+  }
+
+  void resume(const Waiter& w) {
+    if (w.timer != 0) reactor->cancel(w.timer);
+    w.h.resume();
+  }
+};
+
+}  // namespace detail
+
+Result<std::shared_ptr<AsyncPipe>> AsyncPipe::open(Reactor& reactor, std::shared_ptr<Pipe> pipe) {
+  if (!pipe) return Status::invalid_argument("null pipe");
+  auto state = std::make_shared<detail::AsyncPipeState>();
+  state->reactor = &reactor;
+  state->pipe = pipe;
+  // The registration keeps the state alive until close() (or the pipe's failure) drops it.
+  auto id = reactor.add(
+      std::move(pipe), [state](const Message& m) { state->on_message(m); },
+      [state](const Status& st) { state->on_error(st); });
+  if (!id.ok()) return id.status();
+  state->id = id.value();
+  return std::shared_ptr<AsyncPipe>(new AsyncPipe(std::move(state)));
+}
+
+AsyncPipe::AsyncPipe(std::shared_ptr<detail::AsyncPipeState> state) : state_(std::move(state)) {}
+
+AsyncPipe::~AsyncPipe() { close(); }
+
+AsyncPipe::RecvAwaitable AsyncPipe::recv(const RecvOptions& opt, std::stop_token stop) {
+  return RecvAwaitable(state_, opt, std::move(stop));
+}
+
+AsyncPipe::SendAwaitable AsyncPipe::send(Message msg, const SendOptions& opt) {
+  return SendAwaitable(state_->pipe->send(msg, opt));
+}
+
+void AsyncPipe::close() {
+  detail::AsyncPipeState& s = *state_;
+  std::deque<detail::AsyncPipeState::Waiter> pending;
+  {
+    std::lock_guard<std::mutex> lock(s.mu);
+    if (s.closed) return;
+    s.closed = true;
+    if (s.failure.ok()) s.failure = Status::closed("pipe closed");
+    pending.swap(s.waiters);
+    for (auto& w : pending) w.awaitable->result_ = s.failure;
+  }
+  s.reactor->remove(s.id);
+  s.pipe->close();
+  // Resumed from the loop, not from inside whoever is closing.
+  for (auto& w : pending) {
+    s.reactor->post([state = state_, w]() { state->resume(w); });
+  }
+}
+
+Pipe& AsyncPipe::pipe() { return *state_->pipe; }
+
+bool AsyncPipe::RecvAwaitable::await_ready() {
+  std::lock_guard<std::mutex> lock(state_->mu);
+  if (!state_->inbox.empty()) {
+    result_ = std::move(state_->inbox.front());
+    state_->inbox.pop_front();
+    return true;
+  }
+  if (!state_->failure.ok()) {
+    result_ = state_->failure;
+    return true;
+  }
+  if (stop_.stop_requested()) {
+    result_ = Status::cancelled("recv cancelled");
+    return true;
+  }
+  return false;
+}
+
+bool AsyncPipe::RecvAwaitable::await_suspend(std::coroutine_handle<> h) {
+  detail::AsyncPipeState& s = *state_;
+  std::lock_guard<std::mutex> lock(s.mu);
+  // A message may have arrived since await_ready().
+  if (!s.inbox.empty()) {
+    result_ = std::move(s.inbox.front());
+    s.inbox.pop_front();
+    return false;
+  }
+  if (!s.failure.ok()) {
+    result_ = s.failure;
+    return false;
+  }
+  detail::AsyncPipeState::Waiter w;
+  w.ticket = s.next_ticket++;
+  w.h = h;
+  w.awaitable = this;
+  // Both end the wait through the ticket on the loop thread, so whichever comes second finds
+  // nothing to do. The loop cannot resume us before the lock is released.
+  if (opt_.timeout.count() > 0) {
+    w.timer = s.reactor->post_after(opt_.timeout, [state = state_, ticket = w.ticket]() {
+      state->finish(ticket, Status::timeout("recv timed out"));
+    });
+  }
+  s.waiters.push_back(w);
+  if (stop_.stop_possible()) on_stop_.emplace(stop_, RequestStop{state_, w.ticket});
+  return true;
+}
+
+void AsyncPipe::RecvAwaitable::RequestStop::operator()() const noexcept {
+  state->reactor->post([st = state, t = ticket]() { st->finish(t, Status::cancelled("recv cancelled")); });
+}
+
+void DialAwaitable::await_suspend(std::coroutine_handle<> h) {
+  detail::Scheduler::instance().submit([this, h]() {
+    result_ = dial(address_, opt_);
+    reactor_.post([h]() { h.resume(); });
+  });
+}
+
+void RequestAwaitable::await_suspend(std::coroutine_handle<> h) {
+  requester_.call(
+      request_,
+      [this, h](Result<Message> r) {
+        result_ = std::move(r);
+        reactor_.post([h]() { h.resume(); });
+      },
+      opt_);
+}
+
+}  // namespace duct
@@ -1,8 +1,17 @@
 #include "duct/duct.h"
 
+#include <chrono>
 #include <memory>
+#include <string_view>
+#include <utility>
+#include <vector>
 
 #include "duct/qos_pipe.h"
+#include "duct/reliable_pipe.h"
+#include "endpoint_race.h"
+#include "instrument.h"
+#include "reconnect_pipe.h"
+#include "state_callback_pipe.h"
 
 namespace duct {
 
@@ -10,6 +19,14 @@ namespace duct {
 Result<std::unique_ptr<Listener>> tcp_listen(const TcpAddress& addr, const ListenOptions& opt);
 Result<std::unique_ptr<Pipe>> tcp_dial(const TcpAddress& addr, const DialOptions& opt);
 
+// Implemented in uds_transport.cc (kNotSupported on Windows).
+Result<std::unique_ptr<Listener>> uds_listen(const std::string& path, const ListenOptions& opt);
+Result<std::unique_ptr<Pipe>> uds_dial(const std::string& path, const DialOptions& opt);
+
+// Implemented in inproc_transport.cc.
+Result<std::unique_ptr<Listener>> inproc_listen(const std::string& name, const ListenOptions& opt);
+Result<std::unique_ptr<Pipe>> inproc_dial(const std::string& name, const DialOptions& opt);
+
 // Implemented in shm_transport.cc.
 Result<std::unique_ptr<Listener>> shm_listen(const std::string& name, const ListenOptions& opt);
 Result<std::unique_ptr<Pipe>> shm_dial(const std::string& name, const DialOptions& opt);
@@ -20,15 +37,23 @@ Result<std::unique_ptr<Listener>> pipe_listen(const std::string& name, const Lis
 Result<std::unique_ptr<Pipe>> pipe_dial(const std::string& name, const DialOptions& opt);
 #endif
 
-Result<std::unique_ptr<Listener>> listen(const std::string& address, const ListenOptions& opt) {
-  auto parsed = Address::parse(address);
-  if (!parsed.ok()) {
-    return parsed.status();
-  }
-  const Address& a = parsed.value();
+namespace {
+
+// Per attempt, for reconnecting dials without a timeout of their own.
+constexpr std::chrono::milliseconds kReconnectDialTimeout{5'000};
+// A reliable session's connections linger at least this long, so its close frame gets out.
+constexpr std::chrono::milliseconds kReliableLinger{200};
+
+Result<std::unique_ptr<Listener>> transport_listen(const Address& a, const ListenOptions& opt) {
   if (a.scheme == Scheme::kTcp) {
     return tcp_listen(a.tcp, opt);
   }
+  if (a.scheme == Scheme::kUds) {
+    return uds_listen(a.name, opt);
+  }
+  if (a.scheme == Scheme::kInproc) {
+    return inproc_listen(a.name, opt);
+  }
   if (a.scheme == Scheme::kShm) {
     return shm_listen(a.name, opt);
   }
@@ -40,12 +65,9 @@ Result<std::unique_ptr<Listener>> listen(const std::string& address, const Liste
   return Status::not_supported("listen scheme not supported yet: " + a.scheme_text);
 }
 
-Result<std::unique_ptr<Pipe>> dial(const std::string& address, const DialOptions& opt) {
-  auto parsed = Address::parse(address);
-  if (!parsed.ok()) {
-    return parsed.status();
-  }
-  const Address& a = parsed.value();
+// One connection attempt, QoS wrapper included.
+Result<std::unique_ptr<Pipe>> connect_once(const Address& a, const DialOptions& opt,
+                                           const std::shared_ptr<detail::PipeInstruments>& metrics) {
   std::unique_ptr<Pipe> base_pipe;
 
   if (a.scheme == Scheme::kTcp) {
@@ -54,6 +76,18 @@ Result<std::unique_ptr<Pipe>> dial(const std::string& address, const DialOptions
       return result.status();
     }
     base_pipe = std::move(result.value());
+  } else if (a.scheme == Scheme::kUds) {
+    auto result = uds_dial(a.name, opt);
+    if (!result.ok()) {
+      return result.status();
+    }
+    base_pipe = std::move(result.value());
+  } else if (a.scheme == Scheme::kInproc) {
+    auto result = inproc_dial(a.name, opt);
+    if (!result.ok()) {
+      return result.status();
+    }
+    base_pipe = std::move(result.value());
   } else if (a.scheme == Scheme::kShm) {
     auto result = shm_dial(a.name, opt);
     if (!result.ok()) {
@@ -73,12 +107,135 @@ Result<std::unique_ptr<Pipe>> dial(const std::string& address, const DialOptions
   }
 
   // Apply QoS wrapper if any QoS options are configured
-  if (opt.qos.snd_hwm_bytes != 0 || opt.qos.backpressure != BackpressurePolicy::kBlock) {
-    auto qos_pipe = std::make_unique<QosPipe>(std::move(base_pipe), opt.qos);
+  if (opt.qos.snd_hwm_bytes != 0 || opt.qos.backpressure != BackpressurePolicy::kBlock ||
+      opt.qos.flush.max_delay.count() > 0) {
+    auto qos_pipe = std::make_unique<QosPipe>(std::move(base_pipe), opt.qos, metrics);
     return std::unique_ptr<Pipe>(std::move(qos_pipe));
   }
 
   return base_pipe;
 }
 
+// "tcp://a:9000,tcp://b:9000": the comma-separated addresses, spaces around them dropped.
+std::vector<std::string> split_endpoints(const std::string& address) {
+  std::vector<std::string> out;
+  std::string_view rest = address;
+  for (;;) {
+    const auto comma = rest.find(',');
+    std::string_view part = rest.substr(0, comma);
+    while (!part.empty() && part.front() == ' ') part.remove_prefix(1);
+    while (!part.empty() && part.back() == ' ') part.remove_suffix(1);
+    out.emplace_back(part);
+    if (comma == std::string_view::npos) return out;
+    rest.remove_prefix(comma + 1);
+  }
+}
+
+// dial() without the instrumentation of the pipe it returns.
+Result<std::unique_ptr<Pipe>> dial_endpoints(const std::vector<Address>& endpoints, const DialOptions& opt,
+                                             const std::shared_ptr<detail::PipeInstruments>& metrics) {
+  DialOptions once = opt;
+  if (opt.reconnect.enabled && once.timeout.count() == 0) {
+    once.timeout = kReconnectDialTimeout;
+  }
+  if (opt.qos.reliability == Reliability::kAtLeastOnce && once.qos.linger < kReliableLinger) {
+    once.qos.linger = kReliableLinger;
+  }
+  DialOnceFn connect;
+  if (endpoints.size() == 1) {
+    connect = [a = endpoints.front(), once, metrics]() { return connect_once(a, once, metrics); };
+  } else {
+    std::vector<DialOnceFn> each;
+    for (const auto& a : endpoints) {
+      each.push_back([a, once, metrics]() { return connect_once(a, once, metrics); });
+    }
+    connect = make_endpoint_race(std::move(each), opt.race_delay);
+  }
+  ConnectionCallback on_state_change = opt.on_state_change;
+  if (metrics && opt.reconnect.enabled) {
+    on_state_change = detail::instrument_states(std::move(on_state_change), metrics);
+  }
+
+  if (opt.qos.reliability == Reliability::kAtLeastOnce) {
+    auto rel = std::make_unique<ReliablePipe>(opt.qos.at_least_once);
+    // Every connection is introduced to the peer before use, so a reconnect resumes the session.
+    ReliablePipe* session = rel.get();
+    DialOnceFn introduce = [connect, session]() -> Result<std::unique_ptr<Pipe>> {
+      auto p = connect();
+      if (!p.ok()) {
+        return p.status();
+      }
+      auto st = session->handshake(*p.value());
+      if (!st.ok()) {
+        p.value()->close();
+        return st.status();
+      }
+      return p;
+    };
+    if (opt.reconnect.enabled) {
+      rel->start(make_reconnect_pipe(std::move(introduce), opt.reconnect, on_state_change));
+    } else {
+      auto p = introduce();
+      if (!p.ok()) {
+        return p.status();
+      }
+      rel->start(make_state_callback_pipe(std::move(p.value()), on_state_change));
+    }
+    return std::unique_ptr<Pipe>(std::move(rel));
+  }
+
+  if (opt.reconnect.enabled) {
+    return make_reconnect_pipe(std::move(connect), opt.reconnect, on_state_change);
+  }
+  auto p = connect();
+  if (!p.ok()) {
+    return p.status();
+  }
+  return make_state_callback_pipe(std::move(p.value()), on_state_change);
+}
+
+}  // namespace
+
+Result<std::unique_ptr<Listener>> listen(const std::string& address, const ListenOptions& opt) {
+  auto parsed = Address::parse(address);
+  if (!parsed.ok()) {
+    return parsed.status();
+  }
+  if (!compression_supported(opt.compression.codec)) {
+    return Status::not_supported("compression codec not built in");
+  }
+  auto listener = transport_listen(parsed.value(), opt);
+  if (!listener.ok()) {
+    return listener;
+  }
+  std::unique_ptr<Listener> l = std::move(listener.value());
+  if (opt.qos.reliability == Reliability::kAtLeastOnce) {
+    l = std::make_unique<ReliableListener>(std::move(l), opt.qos.at_least_once);
+  }
+  if (auto metrics = detail::PipeInstruments::create(opt.metrics)) {
+    l = detail::instrument_listener(std::move(l), std::move(metrics));
+  }
+  return l;
+}
+
+Result<std::unique_ptr<Pipe>> dial(const std::string& address, const DialOptions& opt) {
+  std::vector<Address> endpoints;
+  for (const auto& part : split_endpoints(address)) {
+    auto parsed = Address::parse(part);
+    if (!parsed.ok()) {
+      return parsed.status();
+    }
+    endpoints.push_back(parsed.value());
+  }
+  if (!compression_supported(opt.compression.codec)) {
+    return Status::not_supported("compression codec not built in");
+  }
+  auto metrics = detail::PipeInstruments::create(opt.metrics);
+  auto p = dial_endpoints(endpoints, opt, metrics);
+  if (!p.ok() || !metrics) {
+    return p;
+  }
+  return detail::instrument_pipe(std::move(p.value()), std::move(metrics));
+}
+
 }  // namespace duct
@@ -0,0 +1,101 @@
+#include "endpoint_race.h"
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+#include "scheduler.h"
+
+namespace duct {
+namespace {
+
+// One call's attempts. Shared with the attempt jobs, which may outlive the call.
+struct Race {
+  std::mutex mu;
+  std::condition_variable cv;
+  std::size_t started = 0;
+  std::size_t finished = 0;
+  bool decided = false;
+  std::size_t winner_index = 0;
+  std::unique_ptr<Pipe> winner;
+  Status last_error = Status::io_error("no endpoints");
+};
+
+struct Endpoints {
+  std::vector<DialOnceFn> dial;
+  std::chrono::milliseconds delay;
+  std::mutex mu;
+  std::size_t next = 0;  // where the next race starts
+};
+
+Result<std::unique_ptr<Pipe>> race(Endpoints& e) {
+  const std::size_t n = e.dial.size();
+  std::size_t first = 0;
+  {
+    std::lock_guard<std::mutex> lk(e.mu);
+    first = e.next;
+  }
+
+  auto r = std::make_shared<Race>();
+  auto start_next = [&]() {
+    const std::size_t index = (first + r->started++) % n;
+    detail::Scheduler::instance().submit([r, index, dial = e.dial[index]]() {
+      auto p = dial();
+      std::unique_ptr<Pipe> late;
+      {
+        std::lock_guard<std::mutex> lk(r->mu);
+        ++r->finished;
+        if (!p.ok()) {
+          r->last_error = p.status();
+        } else if (r->decided) {
+          late = std::move(p.value());
+        } else {
+          r->decided = true;
+          r->winner_index = index;
+          r->winner = std::move(p.value());
+        }
+        r->cv.notify_all();
+      }
+      if (late) late->close();
+    });
+  };
+
+  std::unique_lock<std::mutex> lk(r->mu);
+  start_next();
+  auto next_start = std::chrono::steady_clock::now() + e.delay;
+  for (;;) {
+    if (r->decided) break;
+    if (r->finished == r->started) {
+      if (r->started == n) return r->last_error;
+      start_next();  // everything running failed: no point waiting out the delay
+      next_start = std::chrono::steady_clock::now() + e.delay;
+      continue;
+    }
+    if (r->started == n) {
+      r->cv.wait(lk);
+    } else if (r->cv.wait_until(lk, next_start) == std::cv_status::timeout) {
+      start_next();
+      next_start = std::chrono::steady_clock::now() + e.delay;
+    }
+  }
+  auto pipe = std::move(r->winner);
+  const std::size_t won = r->winner_index;
+  lk.unlock();
+  {
+    std::lock_guard<std::mutex> elk(e.mu);
+    e.next = (won + 1) % n;
+  }
+  return pipe;
+}
+
+}  // namespace
+
+DialOnceFn make_endpoint_race(std::vector<DialOnceFn> endpoints, std::chrono::milliseconds delay) {
+  auto e = std::make_shared<Endpoints>();
+  e->dial = std::move(endpoints);
+  e->delay = delay;
+  return [e]() { return race(*e); };
+}
+
+}  // namespace duct
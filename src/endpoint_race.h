@@ -0,0 +1,17 @@
+#pragma once
+
+#include <chrono>
+#include <vector>
+
+#include "reconnect_pipe.h"
+
+namespace duct {
+
+// One dial over several equivalent endpoints, raced Happy Eyeballs style (RFC 8305): attempts
+// start in order, `delay` apart or as soon as every running one has failed, on the shared worker
+// pool; the first to connect wins and later ones are closed as they finish. Each call starts with
+// the endpoint after the last winner, so after a failover the host that just went away is tried
+// last. Fails with the last error once every endpoint has.
+DialOnceFn make_endpoint_race(std::vector<DialOnceFn> endpoints, std::chrono::milliseconds delay);
+
+}  // namespace duct
@@ -0,0 +1,254 @@
+#include "duct/duct.h"
+
+#include "duct/queue.h"
+#include "duct/wire.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace duct {
+namespace {
+
+// Messages in flight per direction; a sender waits (per its timeout) while the ring is full.
+constexpr std::size_t kRingCapacity = 4096;
+
+// Both directions of one connection. Side 0 is the dialer, side 1 the accepted pipe; each
+// receives from rx[side] and sends into rx[1 - side].
+struct Link {
+  RingMessageQueue rx[2] = {
+      RingMessageQueue(kRingCapacity, 0, BackpressurePolicy::kBlock, std::chrono::milliseconds{0}),
+      RingMessageQueue(kRingCapacity, 0, BackpressurePolicy::kBlock, std::chrono::milliseconds{0}),
+  };
+
+  // Either side closing ends both directions; what is already queued is still delivered.
+  void close() {
+    rx[0].close();
+    rx[1].close();
+  }
+};
+
+// Hands the sender's Message objects to the receiving thread: the payload is never copied, a
+// message only gains a reference to its block. Safe for concurrent senders (the ring is MPSC);
+// one receiving thread.
+class InprocPipe final : public Pipe {
+ public:
+  InprocPipe(std::shared_ptr<Link> link, int side) : link_(std::move(link)), side_(side) {}
+  ~InprocPipe() override { close(); }
+
+  Result<void> send(const Message& msg, const SendOptions& opt) override {
+    return deliver(msg, opt, opt.continued, opt.more);
+  }
+
+  Result<std::size_t> send_batch(std::span<const Message> msgs, const SendOptions& opt) override {
+    std::size_t n = 0;
+    for (std::size_t i = 0; i < msgs.size(); ++i) {
+      auto st = deliver(msgs[i], opt, opt.continued && i == 0, opt.more && i + 1 == msgs.size());
+      if (!st.ok()) {
+        if (n == 0) return st.status();
+        break;
+      }
+      ++n;
+    }
+    return n;
+  }
+
+  Result<Message> recv(const RecvOptions& opt) override {
+    if (closed()) return Status::closed("pipe closed");
+    auto m = inbox().pop(opt.timeout);
+    if (!m.ok() && m.status().code() == StatusCode::kClosed) return Status::closed("peer closed");
+    return m;
+  }
+
+  Result<std::size_t> recv_batch(std::span<Message> out, const RecvOptions& opt) override {
+    if (out.empty()) return std::size_t{0};
+    auto first = recv(opt);
+    if (!first.ok()) return first.status();
+    out[0] = std::move(first.value());
+    std::size_t n = 1;
+    while (n < out.size()) {
+      auto m = inbox().try_pop();
+      if (!m) break;
+      out[n++] = std::move(*m);
+    }
+    return n;
+  }
+
+  // No poll handle: a Reactor checks inproc pipes every iteration.
+  Result<std::size_t> try_recv_batch(std::span<Message> out) override {
+    if (closed()) return Status::closed("pipe closed");
+    std::size_t n = 0;
+    while (n < out.size()) {
+      auto m = inbox().try_pop();
+      if (!m) break;
+      out[n++] = std::move(*m);
+    }
+    // Closed and drained: a push that raced with close() would have failed, so nothing follows.
+    if (n == 0 && inbox().is_closed() && inbox().size_msgs() == 0) return Status::closed("peer closed");
+    return n;
+  }
+
+  Result<std::span<std::uint8_t>> reserve(std::size_t size, const SendOptions&) override {
+    return staged_.reserve(size);
+  }
+  Result<void> commit(std::size_t len, const SendOptions& opt) override { return staged_.commit(*this, len, opt); }
+
+  // The link itself stays until the pipe is destroyed, so a receive blocked on another thread is
+  // woken (kClosed) rather than left on freed memory.
+  void close() override {
+    if (!closed_.exchange(true, std::memory_order_acq_rel)) link_->close();
+  }
+
+ private:
+  bool closed() const { return closed_.load(std::memory_order_acquire); }
+  RingMessageQueue& inbox() { return link_->rx[side_]; }
+  RingMessageQueue& outbox() { return link_->rx[1 - side_]; }
+
+  Result<void> deliver(const Message& msg, const SendOptions& opt, bool continued, bool more) {
+    if (closed()) return Status::closed("pipe closed");
+    if (!continued && !more) return push(msg, opt.channel, opt.traced, opt.timeout);
+
+    // A message sent in parts (QosPipe interleaving channels) reaches the peer whole: the parts
+    // are held here and joined, in one copy, when the last one arrives.
+    std::lock_guard<std::mutex> lock(partial_mu_);
+    Partial& p = partial_[opt.channel];
+    if (!continued) p = Partial{};
+    p.parts.push_back(msg);
+    p.traced = p.traced || opt.traced;
+    if (more) return {};
+    std::size_t total = 0;
+    for (const Message& part : p.parts) total += part.size();
+    Message whole = Message::allocate(total);
+    std::size_t at = 0;
+    for (const Message& part : p.parts) {
+      if (!part.empty()) std::memcpy(whole.data() + at, part.data(), part.size());
+      at += part.size();
+    }
+    ++wire::thread_io().copies;
+    const bool traced = p.traced;
+    partial_.erase(opt.channel);
+    return push(whole, opt.channel, traced, opt.timeout);
+  }
+
+  // The receiver sees what a transport would produce: the channel set, a trace header stripped.
+  Result<void> push(const Message& msg, std::uint16_t channel, bool traced, std::chrono::milliseconds timeout) {
+    SendOptions meta;
+    meta.channel = channel;
+    meta.traced = traced;
+    Message m = msg;
+    wire::set_frame_meta(m, wire::send_flags(meta));
+    auto st = outbox().push(m, timeout);
+    if (!st.ok() && st.status().code() == StatusCode::kClosed) return Status::closed("peer closed");
+    return st;
+  }
+
+  struct Partial {
+    std::vector<Message> parts;
+    bool traced = false;
+  };
+
+  std::shared_ptr<Link> link_;
+  int side_;
+  std::atomic<bool> closed_{false};
+  std::mutex partial_mu_;
+  std::unordered_map<std::uint16_t, Partial> partial_;  // by channel
+  detail::StagedSend staged_;
+};
+
+// Where dialed pipes wait for accept().
+struct Hub {
+  std::mutex mu;
+  std::condition_variable cv;
+  std::deque<std::unique_ptr<Pipe>> pending;
+  bool closed = false;
+};
+
+// Listening names in this process.
+struct Registry {
+  std::mutex mu;
+  std::unordered_map<std::string, std::shared_ptr<Hub>> hubs;
+};
+
+Registry& registry() {
+  static Registry* r = new Registry();  // never destroyed: listeners may outlive static teardown
+  return *r;
+}
+
+class InprocListener final : public Listener {
+ public:
+  InprocListener(std::string name, std::shared_ptr<Hub> hub) : name_(std::move(name)), hub_(std::move(hub)) {}
+  ~InprocListener() override { close(); }
+
+  Result<std::unique_ptr<Pipe>> accept() override {
+    std::unique_lock<std::mutex> lock(hub_->mu);
+    hub_->cv.wait(lock, [&] { return hub_->closed || !hub_->pending.empty(); });
+    if (hub_->closed) return Status::closed("listener closed");
+    std::unique_ptr<Pipe> p = std::move(hub_->pending.front());
+    hub_->pending.pop_front();
+    return p;
+  }
+
+  Result<std::string> local_address() const override { return "inproc://" + name_; }
+
+  // Safe while another thread is blocked in accept(). Pipes dialed but not accepted are closed.
+  void close() override {
+    std::deque<std::unique_ptr<Pipe>> dropped;
+    {
+      std::lock_guard<std::mutex> lock(hub_->mu);
+      if (hub_->closed) return;
+      hub_->closed = true;
+      dropped.swap(hub_->pending);
+    }
+    hub_->cv.notify_all();
+    Registry& r = registry();
+    std::lock_guard<std::mutex> lock(r.mu);
+    auto it = r.hubs.find(name_);
+    if (it != r.hubs.end() && it->second == hub_) r.hubs.erase(it);
+  }
+
+ private:
+  std::string name_;
+  std::shared_ptr<Hub> hub_;
+};
+
+}  // namespace
+
+Result<std::unique_ptr<Listener>> inproc_listen(const std::string& name, const ListenOptions& opt) {
+  (void)opt;
+  Registry& r = registry();
+  std::lock_guard<std::mutex> lock(r.mu);
+  auto [it, inserted] = r.hubs.try_emplace(name, nullptr);
+  if (!inserted) return Status::io_error("inproc name already in use: " + name);
+  it->second = std::make_shared<Hub>();
+  return std::unique_ptr<Listener>(new InprocListener(name, it->second));
+}
+
+Result<std::unique_ptr<Pipe>> inproc_dial(const std::string& name, const DialOptions& opt) {
+  (void)opt;
+  std::shared_ptr<Hub> hub;
+  {
+    Registry& r = registry();
+    std::lock_guard<std::mutex> lock(r.mu);
+    auto it = r.hubs.find(name);
+    if (it != r.hubs.end()) hub = it->second;
+  }
+  if (!hub) return Status::io_error("no inproc listener: " + name);
+
+  auto link = std::make_shared<Link>();
+  {
+    std::lock_guard<std::mutex> lock(hub->mu);
+    if (hub->closed) return Status::io_error("no inproc listener: " + name);
+    hub->pending.push_back(std::make_unique<InprocPipe>(link, 1));
+  }
+  hub->cv.notify_one();
+  return std::unique_ptr<Pipe>(new InprocPipe(std::move(link), 0));
+}
+
+}  // namespace duct
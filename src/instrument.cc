@@ -0,0 +1,214 @@
+#include "instrument.h"
+
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <utility>
+
+namespace duct::detail {
+namespace {
+
+class InstrumentedPipe final : public Pipe {
+ public:
+  InstrumentedPipe(std::unique_ptr<Pipe> inner, std::shared_ptr<PipeInstruments> m)
+      : inner_(std::move(inner)), m_(std::move(m)) {}
+
+  Result<void> send(const Message& msg, const SendOptions& opt) override {
+    IoScope scope(*m_);
+    auto st = inner_->send(msg, opt);
+    if (st.ok()) sent(1, msg.size());
+    return st;
+  }
+
+  Result<std::size_t> send_batch(std::span<const Message> msgs, const SendOptions& opt) override {
+    IoScope scope(*m_);
+    auto n = inner_->send_batch(msgs, opt);
+    if (n.ok()) sent(n.value(), total_bytes(msgs.first(n.value())));
+    return n;
+  }
+
+  Result<Message> recv(const RecvOptions& opt) override {
+    IoScope scope(*m_);
+    auto m = inner_->recv(opt);
+    if (m.ok()) received(std::span<Message>(&m.value(), 1));
+    return m;
+  }
+
+  Result<std::size_t> recv_batch(std::span<Message> out, const RecvOptions& opt) override {
+    IoScope scope(*m_);
+    auto n = inner_->recv_batch(out, opt);
+    if (n.ok()) received(out.first(n.value()));
+    return n;
+  }
+
+  PollHandle poll_handle() const override { return inner_->poll_handle(); }
+
+  Result<std::size_t> try_recv_batch(std::span<Message> out) override {
+    IoScope scope(*m_);
+    auto n = inner_->try_recv_batch(out);
+    if (n.ok()) received(out.first(n.value()));
+    return n;
+  }
+
+  detail::StreamEndpoint* stream_endpoint() override { return inner_->stream_endpoint(); }
+
+  Result<std::span<std::uint8_t>> reserve(std::size_t size, const SendOptions& opt) override {
+    return inner_->reserve(size, opt);
+  }
+
+  Result<void> commit(std::size_t len, const SendOptions& opt) override {
+    IoScope scope(*m_);
+    auto st = inner_->commit(len, opt);
+    if (st.ok()) sent(1, len);
+    return st;
+  }
+
+  Result<void> flush() override { return inner_->flush(); }
+
+  void close() override { inner_->close(); }
+
+ private:
+  template <class Span>
+  static std::size_t total_bytes(Span msgs) {
+    std::size_t bytes = 0;
+    for (const Message& m : msgs) bytes += m.size();
+    return bytes;
+  }
+
+  void sent(std::size_t n, std::size_t bytes) {
+    m_->send_msgs->increment(static_cast<double>(n));
+    m_->send_bytes->increment(static_cast<double>(bytes));
+  }
+
+  void received(std::span<Message> msgs) {
+    if (msgs.empty()) return;
+    std::size_t bytes = 0;
+    for (Message& m : msgs) {
+      bytes += m.size();
+      // Not read ahead by a QosPipe, which would have recorded it.
+      if (m.traced()) m_->record_trace(m, std::chrono::system_clock::now(), std::nullopt);
+    }
+    m_->recv_msgs->increment(static_cast<double>(msgs.size()));
+    m_->recv_bytes->increment(static_cast<double>(bytes));
+  }
+
+  std::unique_ptr<Pipe> inner_;
+  std::shared_ptr<PipeInstruments> m_;
+};
+
+class InstrumentedListener final : public Listener {
+ public:
+  InstrumentedListener(std::unique_ptr<Listener> inner, std::shared_ptr<PipeInstruments> m)
+      : inner_(std::move(inner)), m_(std::move(m)) {}
+
+  Result<std::unique_ptr<Pipe>> accept() override { return wrap(inner_->accept()); }
+  Result<std::string> local_address() const override { return inner_->local_address(); }
+  PollHandle poll_handle() const override { return inner_->poll_handle(); }
+  Result<std::unique_ptr<Pipe>> try_accept() override { return wrap(inner_->try_accept()); }
+  void close() override { inner_->close(); }
+
+ private:
+  Result<std::unique_ptr<Pipe>> wrap(Result<std::unique_ptr<Pipe>> p) {
+    if (!p.ok() || !p.value()) return p;
+    return instrument_pipe(std::move(p.value()), m_);
+  }
+
+  std::unique_ptr<Listener> inner_;
+  std::shared_ptr<PipeInstruments> m_;
+};
+
+}  // namespace
+
+std::shared_ptr<PipeInstruments> PipeInstruments::create(const MetricsOptions& opt) {
+  if (!opt.enabled) return nullptr;
+  MetricRegistry& r = MetricRegistry::instance();
+  auto name = [&](const char* field) { return opt.prefix + "." + field; };
+  auto m = std::make_shared<PipeInstruments>();
+  m->send_msgs = r.get_counter(name("send_msgs"));
+  m->send_bytes = r.get_counter(name("send_bytes"));
+  m->recv_msgs = r.get_counter(name("recv_msgs"));
+  m->recv_bytes = r.get_counter(name("recv_bytes"));
+  m->send_queue_msgs = r.get_gauge(name("send_queue_msgs"));
+  m->send_queue_bytes = r.get_gauge(name("send_queue_bytes"));
+  m->hwm_block = r.get_counter(name("hwm_block"));
+  m->hwm_drop_new = r.get_counter(name("hwm_drop_new"));
+  m->hwm_drop_old = r.get_counter(name("hwm_drop_old"));
+  m->hwm_fail_fast = r.get_counter(name("hwm_fail_fast"));
+  m->rate_limited = r.get_counter(name("rate_limited"));
+  m->ttl_drops = r.get_counter(name("ttl_drops"));
+  m->reconnects = r.get_counter(name("reconnects"));
+  m->downtime_ms = r.get_counter(name("downtime_ms"));
+  m->write_syscalls = r.get_counter(name("write_syscalls"));
+  m->read_syscalls = r.get_counter(name("read_syscalls"));
+  m->copies = r.get_counter(name("copies"));
+  m->send_latency_us = r.get_histogram(name("send_latency_us"));
+  m->trace_admit_us = r.get_histogram(name("trace_admit_us"));
+  m->trace_queue_us = r.get_histogram(name("trace_queue_us"));
+  m->trace_transit_us = r.get_histogram(name("trace_transit_us"));
+  m->trace_recv_queue_us = r.get_histogram(name("trace_recv_queue_us"));
+  m->trace_every = opt.trace_every;
+  m->on_trace = opt.on_trace;
+  return m;
+}
+
+void PipeInstruments::record_trace(Message& m, std::chrono::system_clock::time_point arrived,
+                                   std::optional<std::chrono::steady_clock::duration> recv_queue) {
+  using std::chrono::microseconds;
+  const wire::TraceHeader h = wire::trace_header(m);
+  m.set_traced(false);
+  TraceSample s;
+  s.id = h.id;
+  s.admit = microseconds(h.admit_us);
+  s.queue = microseconds(h.queue_us);
+  const auto sent = std::chrono::system_clock::time_point(
+      std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::nanoseconds(h.sent_at_ns)));
+  // Clocks a little apart across hosts can put the receipt first.
+  s.transit = std::max(std::chrono::duration_cast<microseconds>(arrived - sent), microseconds(0));
+  trace_admit_us->observe(static_cast<double>(s.admit.count()));
+  trace_queue_us->observe(static_cast<double>(s.queue.count()));
+  trace_transit_us->observe(static_cast<double>(s.transit.count()));
+  if (recv_queue) {
+    s.recv_queue = std::chrono::duration_cast<microseconds>(*recv_queue);
+    trace_recv_queue_us->observe(static_cast<double>(s.recv_queue.count()));
+  }
+  if (on_trace) on_trace(s);
+}
+
+std::unique_ptr<Pipe> instrument_pipe(std::unique_ptr<Pipe> p, std::shared_ptr<PipeInstruments> m) {
+  return std::make_unique<InstrumentedPipe>(std::move(p), std::move(m));
+}
+
+std::unique_ptr<Listener> instrument_listener(std::unique_ptr<Listener> l, std::shared_ptr<PipeInstruments> m) {
+  return std::make_unique<InstrumentedListener>(std::move(l), std::move(m));
+}
+
+ConnectionCallback instrument_states(ConnectionCallback cb, std::shared_ptr<PipeInstruments> m) {
+  struct Track {
+    std::mutex mu;
+    bool connected = false;
+    bool ever = false;  // connected once: a later kConnected is a reconnect
+    std::chrono::steady_clock::time_point down_since;
+  };
+  return [cb = std::move(cb), m = std::move(m), t = std::make_shared<Track>()](ConnectionState s,
+                                                                             const std::string& reason) {
+    {
+      std::lock_guard<std::mutex> lock(t->mu);
+      const auto now = std::chrono::steady_clock::now();
+      if (s == ConnectionState::kConnected) {
+        if (t->ever && !t->connected) {
+          m->reconnects->increment();
+          m->downtime_ms->increment(std::chrono::duration<double, std::milli>(now - t->down_since).count());
+        }
+        t->ever = true;
+        t->connected = true;
+      } else if (t->connected && (s == ConnectionState::kDisconnected || s == ConnectionState::kReconnecting)) {
+        t->connected = false;
+        t->down_since = now;
+      }
+    }
+    if (cb) cb(s, reason);
+  };
+}
+
+}  // namespace duct::detail
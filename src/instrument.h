@@ -0,0 +1,95 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <optional>
+
+#include "duct/duct.h"
+#include "duct/logging.h"
+#include "duct/wire.h"
+
+namespace duct::detail {
+
+// The metrics of every pipe sharing one MetricsOptions::prefix, looked up in MetricRegistry once
+// so that recording is a sharded atomic add. Names are "<prefix>.<field>", as listed here.
+struct PipeInstruments {
+  // Null unless opt.enabled.
+  static std::shared_ptr<PipeInstruments> create(const MetricsOptions& opt);
+
+  // What the application sent and received through the pipe.
+  std::shared_ptr<Counter> send_msgs;
+  std::shared_ptr<Counter> send_bytes;
+  std::shared_ptr<Counter> recv_msgs;
+  std::shared_ptr<Counter> recv_bytes;
+  // QosPipe send queue: messages waiting, and bytes queued or being written.
+  std::shared_ptr<Gauge> send_queue_msgs;
+  std::shared_ptr<Gauge> send_queue_bytes;
+  // Sends that met snd_hwm_bytes, by BackpressurePolicy outcome (hwm_drop_old counts the queued
+  // messages dropped), and sends held up or refused by a rate limit.
+  std::shared_ptr<Counter> hwm_block;
+  std::shared_ptr<Counter> hwm_drop_new;
+  std::shared_ptr<Counter> hwm_drop_old;
+  std::shared_ptr<Counter> hwm_fail_fast;
+  std::shared_ptr<Counter> rate_limited;
+  // Messages dropped by the TTL, either direction.
+  std::shared_ptr<Counter> ttl_drops;
+  // Reconnecting dials: connections re-established, and time spent without one.
+  std::shared_ptr<Counter> reconnects;
+  std::shared_ptr<Counter> downtime_ms;
+  // Socket and wakeup syscalls and payload copies (wire::thread_io()); per message: divide by
+  // send_msgs / recv_msgs.
+  std::shared_ptr<Counter> write_syscalls;
+  std::shared_ptr<Counter> read_syscalls;
+  std::shared_ptr<Counter> copies;
+  // From QosPipe enqueue until the transport took the message.
+  std::shared_ptr<Histogram> send_latency_us;
+  // Stages of received traces (TraceSample).
+  std::shared_ptr<Histogram> trace_admit_us;
+  std::shared_ptr<Histogram> trace_queue_us;
+  std::shared_ptr<Histogram> trace_transit_us;
+  std::shared_ptr<Histogram> trace_recv_queue_us;
+
+  std::uint32_t trace_every = 0;
+  std::function<void(const TraceSample&)> on_trace;
+
+  // Record the trace of a traced() message read from the transport at `arrived`, then held for
+  // `recv_queue` in a receive queue if there is one, and clear its traced() bit.
+  void record_trace(Message& m, std::chrono::system_clock::time_point arrived,
+                    std::optional<std::chrono::steady_clock::duration> recv_queue);
+
+  void queued(double msgs, double bytes) {
+    send_queue_msgs->increment(msgs);
+    send_queue_bytes->increment(bytes);
+  }
+};
+
+// Adds the syscalls and copies the calling thread makes while it lives to `m`'s counters.
+class IoScope {
+ public:
+  explicit IoScope(const PipeInstruments& m) : m_(m), start_(wire::thread_io()) {}
+  ~IoScope() {
+    const wire::IoCounts& now = wire::thread_io();
+    if (now.writes != start_.writes) m_.write_syscalls->increment(static_cast<double>(now.writes - start_.writes));
+    if (now.reads != start_.reads) m_.read_syscalls->increment(static_cast<double>(now.reads - start_.reads));
+    if (now.copies != start_.copies) m_.copies->increment(static_cast<double>(now.copies - start_.copies));
+  }
+
+  IoScope(const IoScope&) = delete;
+  IoScope& operator=(const IoScope&) = delete;
+
+ private:
+  const PipeInstruments& m_;
+  const wire::IoCounts start_;
+};
+
+// Count what goes through `p` (and the syscalls made on the calling thread meanwhile).
+std::unique_ptr<Pipe> instrument_pipe(std::unique_ptr<Pipe> p, std::shared_ptr<PipeInstruments> m);
+
+// Accepted pipes come out instrumented.
+std::unique_ptr<Listener> instrument_listener(std::unique_ptr<Listener> l, std::shared_ptr<PipeInstruments> m);
+
+// Passes states on to `cb`, counting reconnects and downtime on the way.
+ConnectionCallback instrument_states(ConnectionCallback cb, std::shared_ptr<PipeInstruments> m);
+
+}  // namespace duct::detail
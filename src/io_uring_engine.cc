@@ -0,0 +1,849 @@
+#include "io_uring_engine.h"
+
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "duct/protocol.h"
+#include "duct/wire.h"
+
+namespace duct::detail {
+namespace {
+
+constexpr unsigned kRingEntries = 1024;  // submission slots; the kernel sizes the CQ at twice that
+constexpr unsigned kBufCount = 256;      // provided receive buffers (power of two)
+constexpr std::size_t kBufSize = 16 * 1024;
+constexpr std::uint16_t kBufGroup = 1;
+constexpr unsigned kSqThreadIdleMs = 50;
+constexpr std::size_t kMaxSendFrames = 64;  // frames per SENDMSG, two iovecs each
+
+// user_data = key << 3 | op. Keys are Reactor ids (>= 1); 0 is the wakeup channel.
+enum Op : std::uint64_t { kOpRecv = 1, kOpSend, kOpPoll, kOpWake, kOpCancel };
+constexpr std::uint64_t kWakeKey = 0;
+constexpr std::uint64_t tag(std::uint64_t key, Op op) { return (key << 3) | op; }
+
+std::string errno_text(int e) { return std::string(" (errno=") + std::to_string(e) + " " + std::strerror(e) + ")"; }
+
+template <class T>
+T load_acquire(T* p) {
+  return std::atomic_ref<T>(*p).load(std::memory_order_acquire);
+}
+template <class T>
+void store_release(T* p, T v) {
+  std::atomic_ref<T>(*p).store(v, std::memory_order_release);
+}
+
+int sys_setup(unsigned entries, io_uring_params* p) {
+  return static_cast<int>(::syscall(__NR_io_uring_setup, entries, p));
+}
+int sys_register(int fd, unsigned op, void* arg, unsigned nr) {
+  return static_cast<int>(::syscall(__NR_io_uring_register, fd, op, arg, nr));
+}
+
+// The shared SQ/CQ rings, driven with raw syscalls (no liburing dependency).
+class Ring {
+ public:
+  ~Ring() {
+    if (sqes_) ::munmap(sqes_, sqes_size_);
+    if (rings_) ::munmap(rings_, rings_size_);
+    if (fd_ >= 0) ::close(fd_);
+  }
+
+  Result<void> open(unsigned entries, bool sqpoll) {
+    io_uring_params p{};
+    if (sqpoll) {
+      p.flags = IORING_SETUP_SQPOLL;
+      p.sq_thread_idle = kSqThreadIdleMs;
+    }
+    fd_ = sys_setup(entries, &p);
+    if (fd_ < 0 && sqpoll) {
+      // Unprivileged SQPOLL is refused on older kernels; run without it.
+      p = io_uring_params{};
+      fd_ = sys_setup(entries, &p);
+    }
+    if (fd_ < 0) return Status::not_supported("io_uring_setup failed" + errno_text(errno));
+    sqpoll_ = (p.flags & IORING_SETUP_SQPOLL) != 0;
+    constexpr unsigned kNeeded = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_FAST_POLL | IORING_FEAT_EXT_ARG;
+    if ((p.features & kNeeded) != kNeeded) return Status::not_supported("io_uring lacks required features");
+
+    rings_size_ = std::max<std::size_t>(p.sq_off.array + p.sq_entries * sizeof(unsigned),
+                                        p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe));
+    void* rings = ::mmap(nullptr, rings_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+    if (rings == MAP_FAILED) return Status::io_error("mmap(io_uring rings) failed" + errno_text(errno));
+    rings_ = rings;
+    sqes_size_ = p.sq_entries * sizeof(io_uring_sqe);
+    void* sqes = ::mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) return Status::io_error("mmap(io_uring sqes) failed" + errno_text(errno));
+    sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+    auto* base = static_cast<std::uint8_t*>(rings_);
+    sq_head_ = reinterpret_cast<unsigned*>(base + p.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned*>(base + p.sq_off.tail);
+    sq_flags_ = reinterpret_cast<unsigned*>(base + p.sq_off.flags);
+    sq_mask_ = *reinterpret_cast<unsigned*>(base + p.sq_off.ring_mask);
+    sq_entries_ = p.sq_entries;
+    cq_head_ = reinterpret_cast<unsigned*>(base + p.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(base + p.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned*>(base + p.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe*>(base + p.cq_off.cqes);
+    // Slot i of the indirection array always names sqe i.
+    auto* array = reinterpret_cast<unsigned*>(base + p.sq_off.array);
+    for (unsigned i = 0; i < sq_entries_; ++i) array[i] = i;
+    sqe_tail_ = *sq_tail_;
+    return {};
+  }
+
+  int fd() const { return fd_; }
+  bool sqpoll() const { return sqpoll_; }
+
+  bool supports(const std::vector<unsigned>& ops) const {
+    std::vector<std::uint8_t> buf(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op), 0);
+    auto* probe = reinterpret_cast<io_uring_probe*>(buf.data());
+    if (sys_register(fd_, IORING_REGISTER_PROBE, probe, 256) < 0) return false;
+    for (unsigned op : ops) {
+      if (op > probe->last_op || (probe->ops[op].flags & IO_URING_OP_SUPPORTED) == 0) return false;
+    }
+    return true;
+  }
+
+  // A zeroed submission slot, or nullptr if the ring stays full even after submitting.
+  io_uring_sqe* sqe() {
+    if (sqe_tail_ - load_acquire(sq_head_) >= sq_entries_) {
+      (void)enter(0, 0);
+      if (sqe_tail_ - load_acquire(sq_head_) >= sq_entries_) return nullptr;
+    }
+    io_uring_sqe* e = &sqes_[sqe_tail_ & sq_mask_];
+    ++sqe_tail_;
+    std::memset(e, 0, sizeof(*e));
+    return e;
+  }
+
+  bool cq_pending() const { return *cq_head_ != load_acquire(cq_tail_); }
+
+  // Submit everything staged; with min_complete, also wait (up to timeout_ms, -1 = forever) until
+  // that many completions are available. Interrupted or timed-out waits return normally.
+  Result<void> enter(unsigned min_complete, int timeout_ms) {
+    store_release(sq_tail_, sqe_tail_);
+    unsigned to_submit = sqe_tail_ - load_acquire(sq_head_);
+    unsigned flags = 0;
+    if (sqpoll_) {
+      // The kernel thread consumes the ring; it only needs a kick once it has gone idle.
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if ((std::atomic_ref<unsigned>(*sq_flags_).load(std::memory_order_relaxed) & IORING_SQ_NEED_WAKEUP) != 0) {
+        flags |= IORING_ENTER_SQ_WAKEUP;
+      }
+      if (flags == 0 && min_complete == 0) return {};
+    } else if (to_submit == 0 && min_complete == 0) {
+      return {};
+    }
+    if (min_complete != 0) flags |= IORING_ENTER_GETEVENTS;
+
+    io_uring_getevents_arg arg{};
+    __kernel_timespec ts{};
+    void* argp = nullptr;
+    std::size_t argsz = 0;
+    if (min_complete != 0 && timeout_ms >= 0) {
+      ts.tv_sec = timeout_ms / 1000;
+      ts.tv_nsec = static_cast<long long>(timeout_ms % 1000) * 1000000LL;
+      arg.ts = reinterpret_cast<std::uint64_t>(&ts);
+      flags |= IORING_ENTER_EXT_ARG;
+      argp = &arg;
+      argsz = sizeof(arg);
+    }
+    long rc = ::syscall(__NR_io_uring_enter, fd_, to_submit, min_complete, flags, argp, argsz);
+    if (rc >= 0 || errno == EINTR || errno == ETIME || errno == EBUSY || errno == EAGAIN) return {};
+    return Status::io_error("io_uring_enter failed" + errno_text(errno));
+  }
+
+  // Hand each available completion to `f`; the slot is released before `f` runs.
+  template <class F>
+  void reap(F&& f) {
+    unsigned head = *cq_head_;
+    for (;;) {
+      if (head == load_acquire(cq_tail_)) break;
+      io_uring_cqe cqe = cqes_[head & cq_mask_];
+      ++head;
+      store_release(cq_head_, head);
+      f(cqe);
+    }
+  }
+
+ private:
+  int fd_ = -1;
+  bool sqpoll_ = false;
+  void* rings_ = nullptr;
+  std::size_t rings_size_ = 0;
+  io_uring_sqe* sqes_ = nullptr;
+  std::size_t sqes_size_ = 0;
+  unsigned* sq_head_ = nullptr;
+  unsigned* sq_tail_ = nullptr;
+  unsigned* sq_flags_ = nullptr;
+  unsigned sq_mask_ = 0;
+  unsigned sq_entries_ = 0;
+  unsigned sqe_tail_ = 0;  // staged, published by enter()
+  unsigned* cq_head_ = nullptr;
+  unsigned* cq_tail_ = nullptr;
+  unsigned cq_mask_ = 0;
+  io_uring_cqe* cqes_ = nullptr;
+};
+
+// Provided-buffer ring: the kernel picks a buffer per receive and names it in the completion.
+class BufRing {
+ public:
+  ~BufRing() {
+    if (mem_) ::munmap(mem_, size_);
+  }
+
+  Result<void> open(int ring_fd, unsigned entries, std::uint16_t group) {
+    size_ = entries * sizeof(io_uring_buf);
+    void* mem = ::mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) return Status::io_error("mmap(buffer ring) failed" + errno_text(errno));
+    mem_ = static_cast<io_uring_buf_ring*>(mem);
+    io_uring_buf_reg reg{};
+    reg.ring_addr = reinterpret_cast<std::uint64_t>(mem_);
+    reg.ring_entries = entries;
+    reg.bgid = group;
+    if (sys_register(ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+      return Status::not_supported("io_uring provided buffer rings unavailable" + errno_text(errno));
+    }
+    mask_ = entries - 1;
+    return {};
+  }
+
+  void add(std::uint8_t* data, unsigned len, std::uint16_t bid) {
+    // Entry i sits at byte 16 * i. Not mem_->bufs[i]: in C++ the header's flexible-array wrapper
+    // shifts `bufs` off offset 0.
+    io_uring_buf& b = reinterpret_cast<io_uring_buf*>(mem_)[tail_ & mask_];
+    b.addr = reinterpret_cast<std::uint64_t>(data);
+    b.len = len;
+    b.bid = bid;
+    ++tail_;
+  }
+  void publish() { store_release(&mem_->tail, tail_); }
+
+ private:
+  io_uring_buf_ring* mem_ = nullptr;
+  std::size_t size_ = 0;
+  unsigned mask_ = 0;
+  std::uint16_t tail_ = 0;
+};
+
+struct OutFrame {
+  std::uint8_t hdr[wire::kHeaderLen];
+  std::size_t hdr_len = wire::kHeaderLen;  // compact headers are shorter
+  Message payload;
+};
+
+// One stream pipe the engine drives.
+struct Conn {
+  std::uint64_t key = 0;
+  std::shared_ptr<Pipe> pipe;  // keeps `ep` alive while the engine uses it
+  StreamEndpoint* ep = nullptr;
+  int fd = -1;  // our duplicate of the pipe's socket
+
+  // Loop thread only.
+  bool recv_armed = false;
+  bool send_in_flight = false;
+  bool removing = false;
+  std::uint64_t ready_seq = 0;
+  std::array<iovec, 2 * kMaxSendFrames> iov{};
+  msghdr msg{};
+
+  // Shared with senders. Every frame in `queue` is either on the dirty list or covered by the
+  // SENDMSG in flight (`scheduled`).
+  std::mutex mu;
+  std::condition_variable cv;
+  std::deque<OutFrame> queue;  // element addresses stay put while the kernel reads them
+  std::size_t queued_bytes = 0;  // unsent, in flight included
+  std::size_t front_sent = 0;    // bytes of queue.front() already written
+  bool scheduled = false;
+  bool detached = false;
+  Status error;
+};
+
+struct PollReg {
+  PollHandle handle = kInvalidPollHandle;
+  bool armed = false;
+  bool removing = false;
+};
+
+}  // namespace
+
+struct UringEngine::Impl {
+  Options opt;
+  Ring ring;
+  BufRing bufring;
+  std::vector<Message> buffers;  // by buffer id; pool blocks the kernel receives into
+  int wakefd = -1;
+  bool multishot_recv = true;
+  bool shut_down = false;
+  std::atomic<std::thread::id> loop_thread{};
+
+  std::mutex mu;
+  std::unordered_map<std::uint64_t, std::shared_ptr<Conn>> conns;  // lookups by senders
+  std::vector<std::shared_ptr<Conn>> new_streams;
+  std::vector<std::pair<std::uint64_t, PollHandle>> new_polls;
+  std::vector<std::uint64_t> removals;
+  std::vector<std::uint64_t> closes;
+  std::vector<std::shared_ptr<Conn>> dirty;
+
+  // Loop thread only.
+  std::unordered_map<std::uint64_t, std::shared_ptr<Conn>> active;
+  std::unordered_map<std::uint64_t, PollReg> polls;
+  std::vector<std::uint64_t> later;  // news found while pumping for a sender; reported by wait()
+  std::uint64_t seq = 0;
+  unsigned inflight = 0;  // operations whose final completion is still due
+
+  ~Impl() {
+    if (wakefd >= 0) ::close(wakefd);
+  }
+
+  bool on_loop_thread() const { return loop_thread.load(std::memory_order_relaxed) == std::this_thread::get_id(); }
+
+  void mark_ready(Conn& c, std::vector<std::uint64_t>* ready) {
+    if (c.ready_seq == seq) return;
+    c.ready_seq = seq;
+    ready->push_back(c.key);
+  }
+
+  void fail(Conn& c, Status st, std::vector<std::uint64_t>* ready) {
+    c.ep->fail(std::move(st));
+    mark_ready(c, ready);
+  }
+
+  void arm_wake() {
+    io_uring_sqe* e = ring.sqe();
+    if (!e) return;
+    e->opcode = IORING_OP_POLL_ADD;
+    e->fd = wakefd;
+    e->len = IORING_POLL_ADD_MULTI;
+    e->poll32_events = POLLIN;
+    e->user_data = tag(kWakeKey, kOpWake);
+    ++inflight;
+  }
+
+  void arm_recv(Conn& c, std::vector<std::uint64_t>* ready) {
+    io_uring_sqe* e = ring.sqe();
+    if (!e) {
+      fail(c, Status::io_error("io_uring submission queue full"), ready);
+      return;
+    }
+    e->opcode = IORING_OP_RECV;
+    e->fd = c.fd;
+    e->flags = IOSQE_BUFFER_SELECT;
+    e->buf_group = kBufGroup;
+    e->ioprio = multishot_recv ? IORING_RECV_MULTISHOT : 0;
+    e->user_data = tag(c.key, kOpRecv);
+    c.recv_armed = true;
+    ++inflight;
+  }
+
+  void arm_poll(std::uint64_t key, PollReg& reg, std::vector<std::uint64_t>* ready) {
+    io_uring_sqe* e = ring.sqe();
+    if (!e) {
+      // The pipe's own try_recv_batch() tells the reactor what to do next.
+      ready->push_back(key);
+      return;
+    }
+    e->opcode = IORING_OP_POLL_ADD;
+    e->fd = static_cast<int>(reg.handle);
+    e->len = IORING_POLL_ADD_MULTI;
+    e->poll32_events = POLLIN;
+    e->user_data = tag(key, kOpPoll);
+    reg.armed = true;
+    ++inflight;
+  }
+
+  void cancel(std::uint64_t target) {
+    io_uring_sqe* e = ring.sqe();
+    if (!e) return;
+    e->opcode = IORING_OP_ASYNC_CANCEL;
+    e->addr = target;
+    e->user_data = tag(kWakeKey, kOpCancel);
+    ++inflight;
+  }
+
+  // One SENDMSG covering the first kMaxSendFrames queued frames.
+  void start_send(Conn& c, std::vector<std::uint64_t>* ready) {
+    std::size_t cnt = 0;
+    {
+      std::lock_guard<std::mutex> lock(c.mu);
+      if (c.queue.empty() || !c.error.ok()) {
+        c.scheduled = false;
+        return;
+      }
+      std::size_t skip = c.front_sent;
+      for (std::size_t i = 0; i < c.queue.size() && i < kMaxSendFrames; ++i) {
+        OutFrame& f = c.queue[i];
+        if (skip < f.hdr_len) {
+          c.iov[cnt++] = iovec{f.hdr + skip, f.hdr_len - skip};
+          skip = 0;
+        } else {
+          skip -= f.hdr_len;
+        }
+        if (f.payload.size() > skip) {
+          c.iov[cnt++] = iovec{const_cast<std::uint8_t*>(f.payload.data()) + skip, f.payload.size() - skip};
+        }
+        skip = 0;
+      }
+    }
+    io_uring_sqe* e = ring.sqe();
+    if (!e) {
+      {
+        std::lock_guard<std::mutex> lock(c.mu);
+        c.error = Status::io_error("io_uring submission queue full");
+        c.cv.notify_all();
+      }
+      fail(c, Status::io_error("io_uring submission queue full"), ready);
+      return;
+    }
+    c.msg = msghdr{};
+    c.msg.msg_iov = c.iov.data();
+    c.msg.msg_iovlen = cnt;
+    e->opcode = IORING_OP_SENDMSG;
+    e->fd = c.fd;
+    e->addr = reinterpret_cast<std::uint64_t>(&c.msg);
+    e->len = 1;
+    e->msg_flags = MSG_NOSIGNAL;
+    e->user_data = tag(c.key, kOpSend);
+    c.send_in_flight = true;
+    ++inflight;
+  }
+
+  // A removed stream is handed back to its pipe once nothing of it is left in the kernel. Takes `c`
+  // by value: callers often pass the very entry this erases.
+  void maybe_finish(std::shared_ptr<Conn> c) {
+    if (!c->removing || c->recv_armed || c->send_in_flight) return;
+    {
+      std::lock_guard<std::mutex> lock(c->mu);
+      if (!c->queue.empty() && c->error.ok()) return;  // a SENDMSG for it is scheduled
+      c->detached = true;
+      c->queue.clear();
+      c->queued_bytes = 0;
+      c->cv.notify_all();
+    }
+    c->ep->detach();
+    ::close(c->fd);
+    c->fd = -1;
+    active.erase(c->key);
+    std::lock_guard<std::mutex> lock(mu);
+    conns.erase(c->key);
+  }
+
+  void recycle(std::uint16_t bid, Message chunk) {
+    // Reuse the block unless the pipe kept slices of it.
+    if (chunk.use_count() == 1) {
+      chunk.resize(kBufSize);
+    } else {
+      chunk = Message::allocate(kBufSize);
+    }
+    bufring.add(chunk.data(), static_cast<unsigned>(kBufSize), bid);
+    buffers[bid] = std::move(chunk);
+  }
+
+  void on_recv(const io_uring_cqe& cqe, std::vector<std::uint64_t>* ready) {
+    const bool more = (cqe.flags & IORING_CQE_F_MORE) != 0;
+    if (!more) --inflight;
+    auto it = active.find(cqe.user_data >> 3);
+    Conn* c = it == active.end() ? nullptr : it->second.get();
+    if (c && !more) c->recv_armed = false;
+
+    if (cqe.res > 0 && (cqe.flags & IORING_CQE_F_BUFFER) != 0) {
+      auto bid = static_cast<std::uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+      Message chunk = std::move(buffers[bid]);
+      chunk.resize(static_cast<std::size_t>(cqe.res));
+      if (c) {
+        auto st = c->ep->feed(chunk);
+        if (!st.ok()) c->ep->fail(st.status());
+        mark_ready(*c, ready);
+      }
+      recycle(bid, std::move(chunk));
+    }
+    if (!c || more) return;
+
+    if (cqe.res == 0) {
+      fail(*c, Status::closed("peer closed"), ready);
+    } else if (cqe.res < 0 && cqe.res != -ECANCELED && !c->removing) {
+      if (cqe.res == -ENOBUFS) {
+        arm_recv(*c, ready);  // every buffer was in use; they are back now
+      } else if (cqe.res == -EINVAL && multishot_recv) {
+        multishot_recv = false;  // pre-6.0 kernel: re-arm after every completion instead
+        arm_recv(*c, ready);
+      } else {
+        fail(*c, Status::io_error("io_uring recv failed" + errno_text(-cqe.res)), ready);
+      }
+    } else if (cqe.res > 0 && !c->removing) {
+      arm_recv(*c, ready);
+    }
+    maybe_finish(it->second);
+  }
+
+  void on_send(const io_uring_cqe& cqe, std::vector<std::uint64_t>* ready) {
+    --inflight;
+    auto it = active.find(cqe.user_data >> 3);
+    if (it == active.end()) return;
+    std::shared_ptr<Conn> c = it->second;
+    c->send_in_flight = false;
+
+    bool again = false;
+    Status failed;
+    {
+      std::lock_guard<std::mutex> lock(c->mu);
+      if (cqe.res == -EINTR || cqe.res == -EAGAIN) {
+        again = true;
+      } else if (cqe.res <= 0) {
+        failed = cqe.res == 0 ? Status::closed("peer closed")
+                              : Status::io_error("io_uring sendmsg failed" + errno_text(-cqe.res));
+        c->error = failed;
+        c->queue.clear();
+        c->queued_bytes = 0;
+        c->front_sent = 0;
+        c->scheduled = false;
+      } else {
+        auto n = static_cast<std::size_t>(cqe.res);
+        c->queued_bytes -= n;
+        while (n != 0 && !c->queue.empty()) {
+          std::size_t left = c->queue.front().hdr_len + c->queue.front().payload.size() - c->front_sent;
+          if (n < left) {
+            c->front_sent += n;
+            break;
+          }
+          n -= left;
+          c->front_sent = 0;
+          c->queue.pop_front();
+        }
+        again = !c->queue.empty();
+        if (!again) c->scheduled = false;
+      }
+      c->cv.notify_all();
+    }
+    if (!failed.ok()) fail(*c, std::move(failed), ready);
+    if (again) start_send(*c, ready);
+    maybe_finish(c);
+  }
+
+  void on_poll(const io_uring_cqe& cqe, std::vector<std::uint64_t>* ready) {
+    const bool more = (cqe.flags & IORING_CQE_F_MORE) != 0;
+    if (!more) --inflight;
+    std::uint64_t key = cqe.user_data >> 3;
+    auto it = polls.find(key);
+    if (it == polls.end()) return;
+    PollReg& reg = it->second;
+    if (!more) reg.armed = false;
+    if (reg.removing) {
+      if (!reg.armed) polls.erase(it);
+      return;
+    }
+    if (cqe.res != -ECANCELED) ready->push_back(key);
+    // An error (say the descriptor was closed) is left for the pipe's try_recv_batch() to report.
+    if (!more && cqe.res >= 0) arm_poll(key, reg, ready);
+  }
+
+  void on_cqe(const io_uring_cqe& cqe, std::vector<std::uint64_t>* ready) {
+    switch (static_cast<Op>(cqe.user_data & 7)) {
+      case kOpRecv:
+        on_recv(cqe, ready);
+        break;
+      case kOpSend:
+        on_send(cqe, ready);
+        break;
+      case kOpPoll:
+        on_poll(cqe, ready);
+        break;
+      case kOpWake: {
+        if ((cqe.flags & IORING_CQE_F_MORE) == 0) {
+          --inflight;
+          if (!shut_down) arm_wake();
+        }
+        std::uint64_t drained = 0;
+        (void)!::read(wakefd, &drained, sizeof(drained));
+        break;
+      }
+      case kOpCancel:
+        --inflight;
+        break;
+    }
+  }
+
+  void reap(std::vector<std::uint64_t>* ready) {
+    ring.reap([&](const io_uring_cqe& cqe) { on_cqe(cqe, ready); });
+    bufring.publish();
+  }
+
+  // Turn what other threads queued since the last call into submissions.
+  void apply_pending(std::vector<std::uint64_t>* ready) {
+    std::vector<std::shared_ptr<Conn>> streams;
+    std::vector<std::pair<std::uint64_t, PollHandle>> new_p;
+    std::vector<std::uint64_t> gone;
+    std::vector<std::uint64_t> closed_keys;
+    std::vector<std::shared_ptr<Conn>> sends;
+    {
+      std::lock_guard<std::mutex> lock(mu);
+      streams.swap(new_streams);
+      new_p.swap(new_polls);
+      gone.swap(removals);
+      closed_keys.swap(closes);
+      sends.swap(dirty);
+    }
+    for (auto& c : streams) {
+      active.emplace(c->key, c);
+      arm_recv(*c, ready);
+    }
+    for (auto& [key, h] : new_p) {
+      PollReg& reg = polls[key];
+      reg.handle = h;
+      arm_poll(key, reg, ready);
+    }
+    for (std::uint64_t key : gone) {
+      if (auto it = active.find(key); it != active.end()) {
+        std::shared_ptr<Conn> c = it->second;
+        if (c->removing) continue;
+        c->removing = true;
+        if (c->recv_armed) cancel(tag(key, kOpRecv));
+        maybe_finish(c);
+      } else if (auto pit = polls.find(key); pit != polls.end()) {
+        pit->second.removing = true;
+        if (pit->second.armed) {
+          cancel(tag(key, kOpPoll));
+        } else {
+          polls.erase(pit);
+        }
+      }
+    }
+    // A closed pipe reports it from try_recv_batch(), which the reactor calls for a ready key.
+    for (std::uint64_t key : closed_keys) {
+      if (auto it = active.find(key); it != active.end()) mark_ready(*it->second, ready);
+    }
+    for (auto& c : sends) {
+      if (!c->send_in_flight && c->fd >= 0) start_send(*c, ready);
+    }
+  }
+
+  // Loop thread, outside wait(): make progress for a sender that is over its high-water mark.
+  Result<void> pump(int timeout_ms) {
+    // The reactor may already have drained pipes reported by this iteration's wait(); report
+    // whatever arrives now again.
+    ++seq;
+    apply_pending(&later);
+    auto st = ring.enter(ring.cq_pending() ? 0 : 1, timeout_ms);
+    if (!st.ok()) return st;
+    reap(&later);
+    return {};
+  }
+};
+
+UringEngine::UringEngine() : impl_(std::make_unique<Impl>()) {}
+
+UringEngine::~UringEngine() { shutdown(); }
+
+Result<std::shared_ptr<UringEngine>> UringEngine::open(const Options& opt) {
+  std::shared_ptr<UringEngine> eng(new UringEngine());
+  Impl& m = *eng->impl_;
+  m.opt = opt;
+  auto st = m.ring.open(kRingEntries, opt.sqpoll);
+  if (!st.ok()) return st.status();
+  if (!m.ring.supports({IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL})) {
+    return Status::not_supported("io_uring lacks required opcodes");
+  }
+  st = m.bufring.open(m.ring.fd(), kBufCount, kBufGroup);
+  if (!st.ok()) return st.status();
+  m.buffers.resize(kBufCount);
+  for (unsigned i = 0; i < kBufCount; ++i) m.recycle(static_cast<std::uint16_t>(i), Message::allocate(kBufSize));
+  m.bufring.publish();
+
+  m.wakefd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (m.wakefd < 0) return Status::io_error("eventfd() failed" + errno_text(errno));
+  m.arm_wake();
+  return eng;
+}
+
+Result<void> UringEngine::add_stream(std::uint64_t key, std::shared_ptr<Pipe> pipe, StreamEndpoint* ep) {
+  Impl& m = *impl_;
+  int fd = ::fcntl(static_cast<int>(ep->socket()), F_DUPFD_CLOEXEC, 0);
+  if (fd < 0) return Status::io_error("fcntl(F_DUPFD_CLOEXEC) failed" + errno_text(errno));
+  auto c = std::make_shared<Conn>();
+  c->key = key;
+  c->pipe = std::move(pipe);
+  c->ep = ep;
+  c->fd = fd;
+  {
+    std::lock_guard<std::mutex> lock(m.mu);
+    m.conns.emplace(key, c);
+    m.new_streams.push_back(c);
+  }
+  ep->attach(shared_from_this(), key);
+  return {};
+}
+
+void UringEngine::add_poll(std::uint64_t key, PollHandle h) {
+  std::lock_guard<std::mutex> lock(impl_->mu);
+  impl_->new_polls.emplace_back(key, h);
+}
+
+void UringEngine::remove(std::uint64_t key) {
+  {
+    std::lock_guard<std::mutex> lock(impl_->mu);
+    impl_->removals.push_back(key);
+  }
+  if (!impl_->on_loop_thread()) wake();
+}
+
+Result<void> UringEngine::wait(int timeout_ms, std::vector<std::uint64_t>* ready) {
+  Impl& m = *impl_;
+  m.loop_thread.store(std::this_thread::get_id(), std::memory_order_relaxed);
+  ++m.seq;
+  ready->insert(ready->end(), m.later.begin(), m.later.end());
+  m.later.clear();
+  m.apply_pending(ready);
+  bool have = !ready->empty() || m.ring.cq_pending();
+  auto st = m.ring.enter(have || timeout_ms == 0 ? 0 : 1, timeout_ms);
+  if (!st.ok()) return st;
+  m.reap(ready);
+  return {};
+}
+
+void UringEngine::wake() {
+  std::uint64_t one = 1;
+  (void)!::write(impl_->wakefd, &one, sizeof(one));
+}
+
+void UringEngine::shutdown() {
+  Impl& m = *impl_;
+  if (m.shut_down) return;
+  m.shut_down = true;
+  m.loop_thread.store(std::this_thread::get_id(), std::memory_order_relaxed);
+  m.apply_pending(&m.later);
+
+  // Cancel everything still in the kernel and wait for it to let go of our buffers.
+  for (auto& [key, c] : m.active) {
+    c->removing = true;
+    {
+      std::lock_guard<std::mutex> lock(c->mu);
+      c->queue.clear();
+      c->queued_bytes = 0;
+      c->error = Status::closed("reactor destroyed");
+      c->cv.notify_all();
+    }
+    if (c->recv_armed) m.cancel(tag(key, kOpRecv));
+    if (c->send_in_flight) m.cancel(tag(key, kOpSend));
+  }
+  for (auto& [key, reg] : m.polls) {
+    reg.removing = true;
+    if (reg.armed) m.cancel(tag(key, kOpPoll));
+  }
+  m.cancel(tag(kWakeKey, kOpWake));
+  for (int i = 0; i < 100 && m.inflight != 0; ++i) {
+    if (!m.ring.enter(m.ring.cq_pending() ? 0 : 1, 50).ok()) break;
+    m.reap(&m.later);
+  }
+  std::vector<std::shared_ptr<Conn>> left;
+  for (auto& [key, c] : m.active) left.push_back(c);
+  for (auto& c : left) {
+    c->recv_armed = false;
+    c->send_in_flight = false;
+    m.maybe_finish(c);
+  }
+  m.polls.clear();
+}
+
+Result<std::size_t> UringEngine::send(std::uint64_t token, std::span<const Message> msgs, const SendOptions& opt) {
+  Impl& m = *impl_;
+  std::shared_ptr<Conn> c;
+  {
+    std::lock_guard<std::mutex> lock(m.mu);
+    auto it = m.conns.find(token);
+    if (it != m.conns.end()) c = it->second;
+  }
+  if (!c) return Status::not_supported("pipe not attached");
+
+  const bool on_loop = m.on_loop_thread();
+  const auto deadline = std::chrono::steady_clock::now() + opt.timeout;
+  std::unique_lock<std::mutex> lock(c->mu);
+  for (;;) {
+    if (c->detached) return Status::not_supported("pipe not attached");
+    if (!c->error.ok()) return c->error;
+    if (c->queued_bytes < m.opt.send_hwm_bytes) break;
+    if (opt.timeout.count() != 0 && std::chrono::steady_clock::now() >= deadline) {
+      return Status::timeout("send queue full (timeout)");
+    }
+    if (on_loop) {
+      // Nobody else will drive completions: do it here (callbacks do not run meanwhile).
+      lock.unlock();
+      auto st = m.pump(10);
+      if (!st.ok()) return st.status();
+      lock.lock();
+    } else if (opt.timeout.count() == 0) {
+      c->cv.wait(lock);
+    } else {
+      c->cv.wait_until(lock, deadline);
+    }
+  }
+  const std::uint32_t flags = wire::send_flags(opt);
+  wire::FrameEncoder& enc = c->ep->encoder();
+  std::uint8_t hello[wire::kHelloLen];
+  if (!msgs.empty() && enc.take_hello(hello)) {
+    OutFrame& f = c->queue.emplace_back();
+    std::memcpy(f.hdr, hello, wire::kHeaderLen);
+    f.payload = Message::from_bytes(hello + wire::kHeaderLen, wire::kHelloLen - wire::kHeaderLen);
+    c->queued_bytes += wire::kHelloLen;
+  }
+  for (std::size_t i = 0; i < msgs.size(); ++i) {
+    const Message& msg = msgs[i];
+    // Fragments are slices of the message, so nothing is copied (unless compressed).
+    wire::for_each_frame(msg, i == 0, i + 1 == msgs.size(), flags, [&](std::size_t off, std::size_t len, std::uint32_t ff) {
+      OutFrame& f = c->queue.emplace_back();
+      f.payload = enc.compress(std::span<const std::uint8_t>(msg.data() + off, len));
+      if (!f.payload.empty()) {
+        ff |= to_u32(FrameFlags::kCompressed);
+      } else {
+        f.payload = len == msg.size() ? msg : msg.slice(off, len);
+      }
+      f.hdr_len = enc.encode(f.payload.size(), ff, f.hdr);
+      c->queued_bytes += f.hdr_len + f.payload.size();
+    });
+  }
+  const bool schedule = !c->scheduled;
+  c->scheduled = true;
+  lock.unlock();
+
+  if (schedule) {
+    bool first = false;
+    {
+      std::lock_guard<std::mutex> g(m.mu);
+      first = m.dirty.empty();
+      m.dirty.push_back(std::move(c));
+    }
+    if (first && !on_loop) wake();
+  }
+  return msgs.size();
+}
+
+void UringEngine::closed(std::uint64_t token) {
+  {
+    std::lock_guard<std::mutex> lock(impl_->mu);
+    impl_->closes.push_back(token);
+  }
+  if (!impl_->on_loop_thread()) wake();
+}
+
+}  // namespace duct::detail
@@ -0,0 +1,62 @@
+#pragma once
+
+// io_uring backend for Reactor (ReactorOptions::io_uring). Linux only, and only built when the
+// kernel headers carry the interfaces it needs (DUCT_HAVE_IO_URING, detected by CMake).
+//
+// Stream pipes (tcp://, uds://) hand their socket to the engine: one multishot receive per
+// connection lands in a provided-buffer ring of pooled blocks, which the pipe's FrameReader adopts
+// without copying; sends are queued per connection and every connection's pending frames go out as
+// one SENDMSG each, submitted together with the next wait. Other pipes with a poll handle (shm://)
+// get a multishot poll. The kernel sees one io_uring_enter per loop iteration, however many
+// connections moved.
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <vector>
+
+#include "duct/duct.h"
+#include "stream_endpoint.h"
+
+namespace duct::detail {
+
+class UringEngine final : public StreamEngine, public std::enable_shared_from_this<UringEngine> {
+ public:
+  struct Options {
+    bool sqpoll = false;
+    std::size_t send_hwm_bytes = 4 * 1024 * 1024;
+  };
+
+  // kNotSupported when the kernel (or a seccomp policy) lacks something the engine relies on.
+  static Result<std::shared_ptr<UringEngine>> open(const Options& opt);
+  ~UringEngine() override;
+
+  UringEngine(const UringEngine&) = delete;
+  UringEngine& operator=(const UringEngine&) = delete;
+
+  // Any thread; takes effect on the loop thread's next wait(). `key` must not be reused.
+  Result<void> add_stream(std::uint64_t key, std::shared_ptr<Pipe> pipe, StreamEndpoint* ep);
+  void add_poll(std::uint64_t key, PollHandle h);
+  // A stream keeps its queued sends going and is handed back to its pipe once they are out.
+  void remove(std::uint64_t key);
+
+  // Loop thread: submit everything queued, wait up to `timeout_ms` (-1 = forever, 0 = not at all)
+  // and append the keys of pipes with news. Returns early on wake().
+  Result<void> wait(int timeout_ms, std::vector<std::uint64_t>* ready);
+  void wake();
+
+  // Stop all I/O and hand every socket back to its pipe; frames still queued are dropped.
+  void shutdown();
+
+  Result<std::size_t> send(std::uint64_t token, std::span<const Message> msgs, const SendOptions& opt) override;
+  void closed(std::uint64_t token) override;
+
+ private:
+  struct Impl;
+  UringEngine();
+
+  std::unique_ptr<Impl> impl_;
+};
+
+}  // namespace duct::detail
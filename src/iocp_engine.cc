@@ -0,0 +1,692 @@
+#include "iocp_engine.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+
+#include "duct/protocol.h"
+#include "duct/wire.h"
+
+namespace duct::detail {
+namespace {
+
+constexpr std::size_t kBufSize = 16 * 1024;        // pooled block per posted receive
+constexpr std::size_t kMaxSendFrames = 64;         // frames per WSASend, two buffers each
+constexpr std::size_t kMaxFileWrite = 256 * 1024;  // frames staged per named-pipe WriteFile
+constexpr ULONG kMaxEntries = 256;                 // completions fetched per wait
+
+// Completion key of wake(); pipes use their Reactor id (>= 1).
+constexpr ULONG_PTR kWakeKey = 0;
+
+std::string error_text(DWORD e) { return " (error=" + std::to_string(e) + ")"; }
+
+// A completion port is bound to the file object, which our duplicate shares with the pipe's own
+// handle: closing the duplicate leaves the binding, and the pipe's overlapped I/O after hand-back
+// would complete on our port. FileReplaceCompletionInformation (Windows 8.1+) with no port is the
+// one way to undo it; ntdll exports it but the SDK headers do not declare it.
+struct FileCompletionInformation {
+  HANDLE port;
+  PVOID key;
+};
+struct IoStatusBlock {
+  union {
+    LONG status;
+    PVOID pointer;
+  };
+  ULONG_PTR information;
+};
+using NtSetInformationFileFn = LONG(NTAPI*)(HANDLE, IoStatusBlock*, PVOID, ULONG, int);
+constexpr int kFileReplaceCompletionInformation = 61;
+
+NtSetInformationFileFn nt_set_information_file() {
+  static const auto fn = [] {
+    HMODULE ntdll = GetModuleHandleW(L"ntdll.dll");
+    FARPROC p = ntdll ? GetProcAddress(ntdll, "NtSetInformationFile") : nullptr;
+    return reinterpret_cast<NtSetInformationFileFn>(reinterpret_cast<void*>(p));
+  }();
+  return fn;
+}
+
+// Take `h` off whatever completion port it is bound to.
+bool dissociate(HANDLE h) {
+  NtSetInformationFileFn set = nt_set_information_file();
+  if (set == nullptr) return false;
+  IoStatusBlock iosb{};
+  FileCompletionInformation info{nullptr, nullptr};
+  return set(h, &iosb, &info, sizeof(info), kFileReplaceCompletionInformation) >= 0;
+}
+
+// Whether dissociate() works here: bind a throwaway socket to `port` and undo it.
+bool can_dissociate(HANDLE port) {
+  WSADATA wsa{};
+  if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) return false;
+  SOCKET s = WSASocketW(AF_INET, SOCK_STREAM, IPPROTO_TCP, nullptr, 0, WSA_FLAG_OVERLAPPED);
+  bool ok = false;
+  if (s != INVALID_SOCKET) {
+    ok = CreateIoCompletionPort(reinterpret_cast<HANDLE>(s), port, kWakeKey, 0) != nullptr &&
+         dissociate(reinterpret_cast<HANDLE>(s));
+    closesocket(s);
+  }
+  WSACleanup();
+  return ok;
+}
+
+// How a failed receive or send on a connection is reported: the peer going away is kClosed.
+Status io_status(DWORD e, const char* what) {
+  switch (e) {
+    case ERROR_BROKEN_PIPE:
+    case ERROR_PIPE_NOT_CONNECTED:
+    case ERROR_NO_DATA:
+    case ERROR_NETNAME_DELETED:
+    case WSAECONNRESET:
+    case WSAECONNABORTED:
+    case WSAESHUTDOWN:
+      return Status::closed("peer closed");
+    default:
+      return Status::io_error(std::string("IOCP ") + what + " failed" + error_text(e));
+  }
+}
+
+enum class OpKind : std::uint8_t { kRecv, kSend };
+
+// OVERLAPPED comes first, so the OVERLAPPED* of a completion is its IoOp.
+struct IoOp {
+  OVERLAPPED ov{};
+  OpKind kind = OpKind::kRecv;
+  bool pending = false;  // issued, completion not seen yet
+};
+
+struct OutFrame {
+  std::uint8_t hdr[wire::kHeaderLen];
+  std::size_t hdr_len = wire::kHeaderLen;  // compact headers are shorter
+  Message payload;
+};
+
+// One stream pipe the engine drives.
+struct Conn {
+  std::uint64_t key = 0;
+  std::shared_ptr<Pipe> pipe;  // keeps `ep` alive while the engine uses it
+  StreamEndpoint* ep = nullptr;
+  wire::SocketHandle h = wire::kInvalidSocket;  // our duplicate: a SOCKET, or a HANDLE if `file`
+  bool file = false;
+  bool associated = false;  // bound to the port; undone before the handle goes back
+
+  // Loop thread only.
+  IoOp recv_op;
+  IoOp send_op;
+  Message rx;        // the block the posted receive fills
+  Message tx_stage;  // named pipes: the frames of the write in flight, back to back
+  std::array<WSABUF, 2 * kMaxSendFrames> bufs{};
+  bool removing = false;
+  std::uint64_t ready_seq = 0;
+
+  // Shared with senders. Every frame in `queue` is either on the dirty list or covered by the
+  // write in flight (`scheduled`).
+  std::mutex mu;
+  std::condition_variable cv;
+  std::deque<OutFrame> queue;  // element addresses stay put while the kernel reads them
+  std::size_t queued_bytes = 0;  // unsent, in flight included
+  std::size_t front_sent = 0;    // bytes of queue.front() already written
+  bool scheduled = false;
+  bool detached = false;
+  Status error;
+
+  HANDLE file_handle() const { return reinterpret_cast<HANDLE>(h); }
+  SOCKET sock() const { return static_cast<SOCKET>(h); }
+
+  // The error a finished operation ended with; 0 for success. ERROR_MORE_DATA (a pipe message
+  // longer than the block) is success: the rest arrives with the next receive.
+  DWORD op_error(IoOp& op) {
+    DWORD n = 0;
+    if (file) {
+      if (GetOverlappedResult(file_handle(), &op.ov, &n, FALSE)) return 0;
+      DWORD e = GetLastError();
+      return e == ERROR_MORE_DATA ? 0 : e;
+    }
+    DWORD flags = 0;
+    if (WSAGetOverlappedResult(sock(), &op.ov, &n, FALSE, &flags)) return 0;
+    return static_cast<DWORD>(WSAGetLastError());
+  }
+
+  void cancel_io() {
+    if (file) {
+      (void)CancelIoEx(file_handle(), nullptr);
+    } else {
+      (void)CancelIoEx(reinterpret_cast<HANDLE>(sock()), nullptr);
+    }
+  }
+
+  void close_handle() {
+    if (h == wire::kInvalidSocket) return;
+    // Nothing is pending by now, so no completion of ours can still arrive.
+    if (associated) associated = !dissociate(reinterpret_cast<HANDLE>(h));
+    if (file) {
+      CloseHandle(file_handle());
+    } else {
+      closesocket(sock());
+    }
+    h = wire::kInvalidSocket;
+  }
+};
+
+// The engine's own handle on the pipe's socket or named pipe, so that closing the pipe never
+// leaves it operating on a handle value that could be reused.
+Result<wire::SocketHandle> duplicate(const StreamEndpoint& ep) {
+  if (ep.socket_is_file()) {
+    HANDLE dup = nullptr;
+    if (!DuplicateHandle(GetCurrentProcess(), reinterpret_cast<HANDLE>(ep.socket()), GetCurrentProcess(), &dup, 0,
+                         FALSE, DUPLICATE_SAME_ACCESS)) {
+      return Status::io_error("DuplicateHandle failed" + error_text(GetLastError()));
+    }
+    return reinterpret_cast<wire::SocketHandle>(dup);
+  }
+  WSAPROTOCOL_INFOW info{};
+  if (WSADuplicateSocketW(static_cast<SOCKET>(ep.socket()), GetCurrentProcessId(), &info) != 0) {
+    return Status::io_error("WSADuplicateSocket failed" + error_text(static_cast<DWORD>(WSAGetLastError())));
+  }
+  SOCKET s = WSASocketW(FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, &info, 0, WSA_FLAG_OVERLAPPED);
+  if (s == INVALID_SOCKET) {
+    return Status::io_error("WSASocket(FROM_PROTOCOL_INFO) failed" + error_text(static_cast<DWORD>(WSAGetLastError())));
+  }
+  return static_cast<wire::SocketHandle>(s);
+}
+
+}  // namespace
+
+struct IocpEngine::Impl {
+  Options opt;
+  HANDLE port = nullptr;
+  bool shut_down = false;
+  std::atomic<bool> wake_posted{false};  // a wake packet is queued and not yet collected
+  std::atomic<std::thread::id> loop_thread{};
+
+  std::mutex mu;
+  std::unordered_map<std::uint64_t, std::shared_ptr<Conn>> conns;  // lookups by senders
+  std::vector<std::shared_ptr<Conn>> new_streams;
+  std::vector<std::uint64_t> removals;
+  std::vector<std::uint64_t> closes;
+  std::vector<std::shared_ptr<Conn>> dirty;
+
+  // Loop thread only.
+  std::unordered_map<std::uint64_t, std::shared_ptr<Conn>> active;
+  std::vector<std::uint64_t> later;  // news found while pumping for a sender; reported by wait()
+  std::uint64_t seq = 0;
+  unsigned inflight = 0;  // operations whose completion is still due
+  std::array<OVERLAPPED_ENTRY, kMaxEntries> entries{};
+
+  ~Impl() {
+    if (port) CloseHandle(port);
+  }
+
+  bool on_loop_thread() const { return loop_thread.load(std::memory_order_relaxed) == std::this_thread::get_id(); }
+
+  void mark_ready(Conn& c, std::vector<std::uint64_t>* ready) {
+    if (c.ready_seq == seq) return;
+    c.ready_seq = seq;
+    ready->push_back(c.key);
+  }
+
+  void fail(Conn& c, Status st, std::vector<std::uint64_t>* ready) {
+    c.ep->fail(std::move(st));
+    mark_ready(c, ready);
+  }
+
+  // Keep one receive posted: the kernel fills c.rx as soon as data arrives.
+  void post_recv(Conn& c, std::vector<std::uint64_t>* ready) {
+    if (c.rx.size() != kBufSize) c.rx = Message::allocate(kBufSize);
+    c.recv_op.ov = OVERLAPPED{};
+    DWORD err = 0;
+    if (c.file) {
+      if (!ReadFile(c.file_handle(), c.rx.data(), static_cast<DWORD>(kBufSize), nullptr, &c.recv_op.ov)) {
+        err = GetLastError();
+      }
+    } else {
+      WSABUF b{static_cast<ULONG>(kBufSize), reinterpret_cast<CHAR*>(c.rx.data())};
+      DWORD flags = 0;
+      if (WSARecv(c.sock(), &b, 1, nullptr, &flags, &c.recv_op.ov, nullptr) != 0) {
+        err = static_cast<DWORD>(WSAGetLastError());
+      }
+    }
+    // Success, pending and ERROR_MORE_DATA all still post a completion.
+    if (err != 0 && err != ERROR_IO_PENDING && err != ERROR_MORE_DATA) {
+      fail(c, io_status(err, "receive"), ready);
+      return;
+    }
+    c.recv_op.pending = true;
+    ++inflight;
+  }
+
+  // One write covering the front of the queue: a gathered WSASend of up to kMaxSendFrames frames,
+  // or for a named pipe the frames copied into one message of up to kMaxFileWrite bytes.
+  void start_send(Conn& c, std::vector<std::uint64_t>* ready) {
+    std::size_t cnt = 0;
+    {
+      std::lock_guard<std::mutex> lock(c.mu);
+      if (c.queue.empty() || !c.error.ok()) {
+        c.scheduled = false;
+        return;
+      }
+      if (c.file) {
+        // Message mode writes all or nothing, so front_sent stays 0 for named pipes.
+        std::size_t total = 0;
+        std::size_t frames = 0;
+        for (const OutFrame& f : c.queue) {
+          const std::size_t len = f.hdr_len + f.payload.size();
+          if (frames != 0 && total + len > kMaxFileWrite) break;
+          total += len;
+          ++frames;
+        }
+        c.tx_stage = Message::allocate(total);
+        std::size_t at = 0;
+        for (std::size_t i = 0; i < frames; ++i) {
+          const OutFrame& f = c.queue[i];
+          std::memcpy(c.tx_stage.data() + at, f.hdr, f.hdr_len);
+          at += f.hdr_len;
+          if (!f.payload.empty()) std::memcpy(c.tx_stage.data() + at, f.payload.data(), f.payload.size());
+          at += f.payload.size();
+        }
+      } else {
+        std::size_t skip = c.front_sent;
+        for (std::size_t i = 0; i < c.queue.size() && i < kMaxSendFrames; ++i) {
+          OutFrame& f = c.queue[i];
+          if (skip < f.hdr_len) {
+            c.bufs[cnt++] = WSABUF{static_cast<ULONG>(f.hdr_len - skip), reinterpret_cast<CHAR*>(f.hdr + skip)};
+            skip = 0;
+          } else {
+            skip -= f.hdr_len;
+          }
+          if (f.payload.size() > skip) {
+            c.bufs[cnt++] = WSABUF{static_cast<ULONG>(f.payload.size() - skip),
+                                   reinterpret_cast<CHAR*>(const_cast<std::uint8_t*>(f.payload.data()) + skip)};
+          }
+          skip = 0;
+        }
+      }
+    }
+    c.send_op.ov = OVERLAPPED{};
+    DWORD err = 0;
+    if (c.file) {
+      if (!WriteFile(c.file_handle(), c.tx_stage.data(), static_cast<DWORD>(c.tx_stage.size()), nullptr,
+                     &c.send_op.ov)) {
+        err = GetLastError();
+      }
+    } else if (WSASend(c.sock(), c.bufs.data(), static_cast<DWORD>(cnt), nullptr, 0, &c.send_op.ov, nullptr) != 0) {
+      err = static_cast<DWORD>(WSAGetLastError());
+    }
+    if (err != 0 && err != ERROR_IO_PENDING) {
+      Status st = io_status(err, "send");
+      {
+        std::lock_guard<std::mutex> lock(c.mu);
+        c.error = st;
+        c.queue.clear();
+        c.queued_bytes = 0;
+        c.front_sent = 0;
+        c.scheduled = false;
+        c.cv.notify_all();
+      }
+      c.tx_stage = Message();
+      fail(c, std::move(st), ready);
+      return;
+    }
+    c.send_op.pending = true;
+    ++inflight;
+  }
+
+  // A removed stream is handed back to its pipe once nothing of it is left in the kernel. Takes `c`
+  // by value: callers often pass the very entry this erases.
+  void maybe_finish(std::shared_ptr<Conn> c) {
+    if (!c->removing || c->recv_op.pending || c->send_op.pending) return;
+    {
+      std::lock_guard<std::mutex> lock(c->mu);
+      if (!c->queue.empty() && c->error.ok()) return;  // a write for it is scheduled
+      c->detached = true;
+      c->queue.clear();
+      c->queued_bytes = 0;
+      c->cv.notify_all();
+    }
+    c->ep->detach();
+    c->close_handle();
+    active.erase(c->key);
+    std::lock_guard<std::mutex> lock(mu);
+    conns.erase(c->key);
+  }
+
+  void on_recv(Conn& c, DWORD bytes, std::vector<std::uint64_t>* ready) {
+    --inflight;
+    c.recv_op.pending = false;
+    const DWORD err = c.op_error(c.recv_op);
+    if (err == 0 && bytes > 0) {
+      // Bytes taken off the connection belong to the pipe, removed or not.
+      Message chunk = std::move(c.rx);
+      chunk.resize(bytes);
+      auto st = c.ep->feed(chunk);
+      if (!st.ok()) c.ep->fail(st.status());
+      mark_ready(c, ready);
+      // Reuse the block unless the pipe kept slices of it.
+      if (chunk.use_count() == 1) {
+        chunk.resize(kBufSize);
+        c.rx = std::move(chunk);
+      }
+      if (!c.removing) post_recv(c, ready);
+    } else if (err == 0 && !c.file) {
+      fail(c, Status::closed("peer closed"), ready);
+    } else if (err == 0) {
+      if (!c.removing) post_recv(c, ready);  // an empty pipe message
+    } else if (err != ERROR_OPERATION_ABORTED && !c.removing) {
+      fail(c, io_status(err, "receive"), ready);
+    }
+  }
+
+  void on_send(const std::shared_ptr<Conn>& c, DWORD bytes, std::vector<std::uint64_t>* ready) {
+    --inflight;
+    c->send_op.pending = false;
+    c->tx_stage = Message();
+    const DWORD err = c->op_error(c->send_op);
+
+    bool again = false;
+    Status failed;
+    {
+      std::lock_guard<std::mutex> lock(c->mu);
+      if (err != 0 || bytes == 0) {
+        failed = err == ERROR_OPERATION_ABORTED ? Status::closed("reactor destroyed")
+                 : err == 0                     ? Status::closed("peer closed")
+                                                : io_status(err, "send");
+        c->error = failed;
+        c->queue.clear();
+        c->queued_bytes = 0;
+        c->front_sent = 0;
+        c->scheduled = false;
+      } else {
+        std::size_t n = bytes;
+        c->queued_bytes -= n;
+        while (n != 0 && !c->queue.empty()) {
+          std::size_t left = c->queue.front().hdr_len + c->queue.front().payload.size() - c->front_sent;
+          if (n < left) {
+            c->front_sent += n;
+            break;
+          }
+          n -= left;
+          c->front_sent = 0;
+          c->queue.pop_front();
+        }
+        again = !c->queue.empty();
+        if (!again) c->scheduled = false;
+      }
+      c->cv.notify_all();
+    }
+    if (!failed.ok()) fail(*c, std::move(failed), ready);
+    if (again) start_send(*c, ready);
+  }
+
+  // Wait up to `timeout_ms` (INFINITE allowed) for completions and handle them all.
+  Result<void> collect(DWORD timeout_ms, std::vector<std::uint64_t>* ready) {
+    ULONG n = 0;
+    if (!GetQueuedCompletionStatusEx(port, entries.data(), kMaxEntries, &n, timeout_ms, FALSE)) {
+      DWORD e = GetLastError();
+      if (e == WAIT_TIMEOUT) return {};
+      return Status::io_error("GetQueuedCompletionStatusEx failed" + error_text(e));
+    }
+    for (ULONG i = 0; i < n; ++i) {
+      const OVERLAPPED_ENTRY& e = entries[i];
+      if (e.lpCompletionKey == kWakeKey) {
+        wake_posted.store(false, std::memory_order_release);
+        continue;
+      }
+      auto it = active.find(static_cast<std::uint64_t>(e.lpCompletionKey));
+      if (it == active.end() || e.lpOverlapped == nullptr) continue;
+      std::shared_ptr<Conn> c = it->second;
+      auto* op = reinterpret_cast<IoOp*>(e.lpOverlapped);
+      if (op->kind == OpKind::kRecv) {
+        on_recv(*c, e.dwNumberOfBytesTransferred, ready);
+      } else {
+        on_send(c, e.dwNumberOfBytesTransferred, ready);
+      }
+      maybe_finish(c);
+    }
+    return {};
+  }
+
+  // Turn what other threads queued since the last call into I/O.
+  void apply_pending(std::vector<std::uint64_t>* ready) {
+    std::vector<std::shared_ptr<Conn>> streams;
+    std::vector<std::uint64_t> gone;
+    std::vector<std::uint64_t> closed_keys;
+    std::vector<std::shared_ptr<Conn>> sends;
+    {
+      std::lock_guard<std::mutex> lock(mu);
+      streams.swap(new_streams);
+      gone.swap(removals);
+      closed_keys.swap(closes);
+      sends.swap(dirty);
+    }
+    for (auto& c : streams) {
+      active.emplace(c->key, c);
+      if (CreateIoCompletionPort(reinterpret_cast<HANDLE>(c->h), port, static_cast<ULONG_PTR>(c->key), 0) == nullptr) {
+        fail(*c, Status::io_error("CreateIoCompletionPort failed" + error_text(GetLastError())), ready);
+        continue;
+      }
+      c->associated = true;
+      post_recv(*c, ready);
+    }
+    for (std::uint64_t key : gone) {
+      auto it = active.find(key);
+      if (it == active.end()) continue;
+      std::shared_ptr<Conn> c = it->second;
+      if (c->removing) continue;
+      c->removing = true;
+      // Completes the posted receive with ERROR_OPERATION_ABORTED; a write in flight stays.
+      if (c->recv_op.pending) {
+        (void)CancelIoEx(reinterpret_cast<HANDLE>(c->h), &c->recv_op.ov);
+      }
+      maybe_finish(c);
+    }
+    // A closed pipe reports it from try_recv_batch(), which the reactor calls for a ready key.
+    for (std::uint64_t key : closed_keys) {
+      if (auto it = active.find(key); it != active.end()) mark_ready(*it->second, ready);
+    }
+    for (auto& c : sends) {
+      if (!c->send_op.pending && c->h != wire::kInvalidSocket) start_send(*c, ready);
+    }
+  }
+
+  // Loop thread, outside wait(): make progress for a sender that is over its high-water mark.
+  Result<void> pump(DWORD timeout_ms) {
+    // The reactor may already have drained pipes reported by this iteration's wait(); report
+    // whatever arrives now again.
+    ++seq;
+    apply_pending(&later);
+    return collect(timeout_ms, &later);
+  }
+};
+
+IocpEngine::IocpEngine() : impl_(std::make_unique<Impl>()) {}
+
+IocpEngine::~IocpEngine() { shutdown(); }
+
+Result<std::shared_ptr<IocpEngine>> IocpEngine::open(const Options& opt) {
+  std::shared_ptr<IocpEngine> eng(new IocpEngine());
+  Impl& m = *eng->impl_;
+  m.opt = opt;
+  // One loop thread collects; a concurrency value of 1 keeps the port from waking more.
+  m.port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, nullptr, 0, 1);
+  if (m.port == nullptr) return Status::io_error("CreateIoCompletionPort failed" + error_text(GetLastError()));
+  // Without a way to unbind a handle from the port, pipes could not be handed back safely.
+  if (!can_dissociate(m.port)) return Status::not_supported("IOCP needs Windows 8.1 or later");
+  return eng;
+}
+
+Result<void> IocpEngine::add_stream(std::uint64_t key, std::shared_ptr<Pipe> pipe, StreamEndpoint* ep) {
+  Impl& m = *impl_;
+  auto h = duplicate(*ep);
+  if (!h.ok()) return h.status();
+  auto c = std::make_shared<Conn>();
+  c->key = key;
+  c->pipe = std::move(pipe);
+  c->ep = ep;
+  c->h = h.value();
+  c->file = ep->socket_is_file();
+  c->recv_op.kind = OpKind::kRecv;
+  c->send_op.kind = OpKind::kSend;
+  {
+    std::lock_guard<std::mutex> lock(m.mu);
+    m.conns.emplace(key, c);
+    m.new_streams.push_back(c);
+  }
+  ep->attach(shared_from_this(), key);
+  return {};
+}
+
+void IocpEngine::remove(std::uint64_t key) {
+  {
+    std::lock_guard<std::mutex> lock(impl_->mu);
+    impl_->removals.push_back(key);
+  }
+  if (!impl_->on_loop_thread()) wake();
+}
+
+Result<void> IocpEngine::wait(int timeout_ms, std::vector<std::uint64_t>* ready) {
+  Impl& m = *impl_;
+  m.loop_thread.store(std::this_thread::get_id(), std::memory_order_relaxed);
+  ++m.seq;
+  ready->insert(ready->end(), m.later.begin(), m.later.end());
+  m.later.clear();
+  m.apply_pending(ready);
+  DWORD ms = INFINITE;
+  if (!ready->empty() || timeout_ms == 0) {
+    ms = 0;
+  } else if (timeout_ms > 0) {
+    ms = static_cast<DWORD>(timeout_ms);
+  }
+  return m.collect(ms, ready);
+}
+
+void IocpEngine::wake() {
+  // Collapse bursts of wakes into one packet.
+  if (impl_->wake_posted.exchange(true, std::memory_order_acq_rel)) return;
+  (void)PostQueuedCompletionStatus(impl_->port, 0, kWakeKey, nullptr);
+}
+
+void IocpEngine::shutdown() {
+  Impl& m = *impl_;
+  if (m.shut_down) return;
+  m.shut_down = true;
+  m.loop_thread.store(std::this_thread::get_id(), std::memory_order_relaxed);
+  m.apply_pending(&m.later);
+
+  // Cancel everything still in the kernel and wait for it to let go of our buffers.
+  for (auto& [key, c] : m.active) {
+    c->removing = true;
+    {
+      std::lock_guard<std::mutex> lock(c->mu);
+      c->queue.clear();
+      c->queued_bytes = 0;
+      c->error = Status::closed("reactor destroyed");
+      c->cv.notify_all();
+    }
+    if (c->recv_op.pending || c->send_op.pending) c->cancel_io();
+  }
+  for (int i = 0; i < 100 && m.inflight != 0; ++i) {
+    if (!m.collect(50, &m.later).ok()) break;
+  }
+  std::vector<std::shared_ptr<Conn>> left;
+  for (auto& [key, c] : m.active) left.push_back(c);
+  for (auto& c : left) {
+    c->recv_op.pending = false;
+    c->send_op.pending = false;
+    m.maybe_finish(c);
+  }
+}
+
+Result<std::size_t> IocpEngine::send(std::uint64_t token, std::span<const Message> msgs, const SendOptions& opt) {
+  Impl& m = *impl_;
+  std::shared_ptr<Conn> c;
+  {
+    std::lock_guard<std::mutex> lock(m.mu);
+    auto it = m.conns.find(token);
+    if (it != m.conns.end()) c = it->second;
+  }
+  if (!c) return Status::not_supported("pipe not attached");
+
+  const bool on_loop = m.on_loop_thread();
+  const auto deadline = std::chrono::steady_clock::now() + opt.timeout;
+  std::unique_lock<std::mutex> lock(c->mu);
+  for (;;) {
+    if (c->detached) return Status::not_supported("pipe not attached");
+    if (!c->error.ok()) return c->error;
+    if (c->queued_bytes < m.opt.send_hwm_bytes) break;
+    if (opt.timeout.count() != 0 && std::chrono::steady_clock::now() >= deadline) {
+      return Status::timeout("send queue full (timeout)");
+    }
+    if (on_loop) {
+      // Nobody else will collect completions: do it here (callbacks do not run meanwhile).
+      lock.unlock();
+      auto st = m.pump(10);
+      if (!st.ok()) return st.status();
+      lock.lock();
+    } else if (opt.timeout.count() == 0) {
+      c->cv.wait(lock);
+    } else {
+      c->cv.wait_until(lock, deadline);
+    }
+  }
+  const std::uint32_t flags = wire::send_flags(opt);
+  wire::FrameEncoder& enc = c->ep->encoder();
+  std::uint8_t hello[wire::kHelloLen];
+  if (!msgs.empty() && enc.take_hello(hello)) {
+    OutFrame& f = c->queue.emplace_back();
+    std::memcpy(f.hdr, hello, wire::kHeaderLen);
+    f.payload = Message::from_bytes(hello + wire::kHeaderLen, wire::kHelloLen - wire::kHeaderLen);
+    c->queued_bytes += wire::kHelloLen;
+  }
+  for (std::size_t i = 0; i < msgs.size(); ++i) {
+    const Message& msg = msgs[i];
+    // Fragments are slices of the message, so nothing is copied (unless compressed).
+    wire::for_each_frame(msg, i == 0, i + 1 == msgs.size(), flags, [&](std::size_t off, std::size_t len, std::uint32_t ff) {
+      OutFrame& f = c->queue.emplace_back();
+      f.payload = enc.compress(std::span<const std::uint8_t>(msg.data() + off, len));
+      if (!f.payload.empty()) {
+        ff |= to_u32(FrameFlags::kCompressed);
+      } else {
+        f.payload = len == msg.size() ? msg : msg.slice(off, len);
+      }
+      f.hdr_len = enc.encode(f.payload.size(), ff, f.hdr);
+      c->queued_bytes += f.hdr_len + f.payload.size();
+    });
+  }
+  const bool schedule = !c->scheduled;
+  c->scheduled = true;
+  lock.unlock();
+
+  if (schedule) {
+    bool first = false;
+    {
+      std::lock_guard<std::mutex> g(m.mu);
+      first = m.dirty.empty();
+      m.dirty.push_back(std::move(c));
+    }
+    if (first && !on_loop) wake();
+  }
+  return msgs.size();
+}
+
+void IocpEngine::closed(std::uint64_t token) {
+  {
+    std::lock_guard<std::mutex> lock(impl_->mu);
+    impl_->closes.push_back(token);
+  }
+  if (!impl_->on_loop_thread()) wake();
+}
+
+}  // namespace duct::detail
@@ -0,0 +1,59 @@
+#pragma once
+
+// IOCP backend for Reactor (ReactorOptions::iocp). Windows only.
+//
+// Stream pipes (tcp://, and pipe:// named pipes) hand their handle to the engine, which associates
+// a duplicate of it with one completion port. The binding belongs to the file object both handles
+// share, so it is undone (Windows 8.1+) before a pipe gets its handle back. Every connection keeps one overlapped receive posted
+// into a pooled block, which the pipe's FrameReader adopts without copying; sends are queued per
+// connection and go out as one overlapped WSASend of up to 64 frames (gathered, no copy) or, for a
+// named pipe, one WriteFile of the staged frames (one pipe message). The loop thread collects every
+// completion with one GetQueuedCompletionStatusEx, so no thread blocks per connection.
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <vector>
+
+#include "duct/duct.h"
+#include "stream_endpoint.h"
+
+namespace duct::detail {
+
+class IocpEngine final : public StreamEngine, public std::enable_shared_from_this<IocpEngine> {
+ public:
+  struct Options {
+    std::size_t send_hwm_bytes = 4 * 1024 * 1024;
+  };
+
+  static Result<std::shared_ptr<IocpEngine>> open(const Options& opt);
+  ~IocpEngine() override;
+
+  IocpEngine(const IocpEngine&) = delete;
+  IocpEngine& operator=(const IocpEngine&) = delete;
+
+  // Any thread; takes effect on the loop thread's next wait(). `key` must not be reused.
+  Result<void> add_stream(std::uint64_t key, std::shared_ptr<Pipe> pipe, StreamEndpoint* ep);
+  // A stream keeps its queued sends going and is handed back to its pipe once they are out.
+  void remove(std::uint64_t key);
+
+  // Loop thread: start everything queued, wait up to `timeout_ms` (-1 = forever, 0 = not at all)
+  // and append the keys of pipes with news. Returns early on wake().
+  Result<void> wait(int timeout_ms, std::vector<std::uint64_t>* ready);
+  void wake();
+
+  // Cancel all I/O and hand every handle back to its pipe; frames still queued are dropped.
+  void shutdown();
+
+  Result<std::size_t> send(std::uint64_t token, std::span<const Message> msgs, const SendOptions& opt) override;
+  void closed(std::uint64_t token) override;
+
+ private:
+  struct Impl;
+  IocpEngine();
+
+  std::unique_ptr<Impl> impl_;
+};
+
+}  // namespace duct::detail
@@ -1,7 +1,16 @@
 #include "duct/logging.h"
 
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <charconv>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
 #include <iostream>
 #include <mutex>
+#include <thread>
+#include <utility>
 
 namespace duct {
 
@@ -30,18 +39,52 @@ void ConsoleLogger::flush() {
 
 namespace detail {
 
+// Leases count their readers: a replaced logger waits in `retired` until no lease is left, and
+// whoever ends the last one (set() when there is none) destroys it. The count only reaches 0
+// between leases, and a lease taken after a replacement never sees a retired logger.
 struct LoggerHolder {
-  std::shared_ptr<Logger> logger = std::make_shared<ConsoleLogger>();
+  std::shared_ptr<Logger> owner = std::make_shared<ConsoleLogger>();
+  std::atomic<Logger*> current{owner.get()};
+  std::atomic<std::size_t> readers{0};
+  std::atomic<bool> retiring{false};
   std::mutex mutex;
+  std::vector<std::shared_ptr<Logger>> retired;
 
-  Logger& get() {
-    std::lock_guard<std::mutex> lock(mutex);
-    return *logger;
+  // For get_logger(): no lease, so valid until the next set().
+  Logger& get() { return *current.load(std::memory_order_acquire); }
+
+  Logger* acquire() {
+    readers.fetch_add(1);
+    return current.load();
+  }
+
+  void release() {
+    if (readers.fetch_sub(1) == 1 && retiring.load()) reclaim();
   }
 
   void set(std::shared_ptr<Logger> new_logger) {
+    if (!new_logger) new_logger = std::make_shared<NullLogger>();
+    std::vector<std::shared_ptr<Logger>> dead;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      current.store(new_logger.get());
+      retired.push_back(std::exchange(owner, std::move(new_logger)));
+      retiring.store(true);
+      if (readers.load() == 0) take_retired_locked(&dead);
+    }
+    // Destroyed outside the lock: an AsyncLogger joins its writer.
+  }
+
+  void reclaim() {
+    std::vector<std::shared_ptr<Logger>> dead;
     std::lock_guard<std::mutex> lock(mutex);
-    logger = std::move(new_logger);
+    // A lease taken since may hold a logger retired since; its release() comes back here.
+    if (readers.load() == 0) take_retired_locked(&dead);
+  }
+
+  void take_retired_locked(std::vector<std::shared_ptr<Logger>>* dead) {
+    dead->swap(retired);
+    retiring.store(false);
   }
 };
 
@@ -58,6 +101,348 @@ void set_default_logger(std::shared_ptr<Logger> logger) {
   get_logger_holder().set(std::move(logger));
 }
 
+LoggerLease::LoggerLease() : logger_(get_logger_holder().acquire()) {}
+
+LoggerLease::~LoggerLease() {
+  if (logger_ != nullptr) get_logger_holder().release();
+}
+
+namespace {
+
+std::uint64_t read_le(const std::uint8_t* p, int n) {
+  std::uint64_t v = 0;
+  for (int i = 0; i < n; ++i) v |= std::uint64_t{p[i]} << (8 * i);
+  return v;
+}
+
+// Append the encoded argument at args[*pos] to `out`; false once they run out.
+bool append_arg(std::span<const std::uint8_t> args, std::size_t* pos, std::string* out) {
+  if (*pos >= args.size()) return false;
+  const auto type = static_cast<LogArgType>(args[*pos]);
+  const std::uint8_t* p = args.data() + *pos + 1;
+  const std::size_t left = args.size() - *pos - 1;
+  if (type == LogArgType::kString) {
+    if (left < 4) return false;
+    const auto n = static_cast<std::size_t>(read_le(p, 4));
+    if (left - 4 < n) return false;
+    out->append(reinterpret_cast<const char*>(p + 4), n);
+    *pos += 5 + n;
+    return true;
+  }
+  if (left < 8) return false;
+  const std::uint64_t v = read_le(p, 8);
+  *pos += 9;
+  char buf[32];
+  std::to_chars_result r{buf, std::errc()};
+  switch (type) {
+    case LogArgType::kInt: r = std::to_chars(buf, buf + sizeof(buf), static_cast<std::int64_t>(v)); break;
+    case LogArgType::kUint: r = std::to_chars(buf, buf + sizeof(buf), v); break;
+    case LogArgType::kDouble: r = std::to_chars(buf, buf + sizeof(buf), std::bit_cast<double>(v)); break;
+    case LogArgType::kBool: out->append(v ? "true" : "false"); return true;
+    case LogArgType::kChar: out->push_back(static_cast<char>(v)); return true;
+    case LogArgType::kPointer:
+      out->append("0x");
+      r = std::to_chars(buf, buf + sizeof(buf), v, 16);
+      break;
+    default: return false;
+  }
+  out->append(buf, r.ptr);
+  return true;
+}
+
+}  // namespace
+
+void format_log(const char* fmt, std::span<const std::uint8_t> args, std::string* out) {
+  out->clear();
+  std::size_t pos = 0;
+  for (const char* c = fmt; *c != '\0'; ++c) {
+    if (c[0] == '{' && c[1] == '}') {
+      if (!append_arg(args, &pos, out)) out->append("{}");
+      ++c;
+    } else {
+      out->push_back(*c);
+    }
+  }
+  while (pos < args.size()) {
+    out->push_back(' ');
+    if (!append_arg(args, &pos, out)) break;
+  }
+}
+
+// ==============================================================================
+// AsyncLogger 实现
+// ==============================================================================
+
+// One producing thread's records: [RecordHeader][text or encoded arguments], wrapping around.
+struct LogRing {
+  explicit LogRing(std::size_t capacity) : buf(capacity), mask(capacity - 1) {}
+
+  alignas(64) std::atomic<std::uint64_t> head{0};  // bytes published by the producer
+  alignas(64) std::atomic<std::uint64_t> tail{0};  // bytes released by the writer thread
+  std::atomic<bool> orphaned{false};               // the producing thread exited
+  std::atomic<bool> closed{false};                 // the logger is gone
+  std::vector<std::uint8_t> buf;
+  std::uint64_t mask;
+
+  void write(std::uint64_t pos, const void* src, std::size_t n) {
+    const std::size_t at = static_cast<std::size_t>(pos & mask);
+    const std::size_t first = std::min(n, buf.size() - at);
+    std::memcpy(buf.data() + at, src, first);
+    std::memcpy(buf.data(), static_cast<const std::uint8_t*>(src) + first, n - first);
+  }
+  void read(std::uint64_t pos, void* dst, std::size_t n) const {
+    const std::size_t at = static_cast<std::size_t>(pos & mask);
+    const std::size_t first = std::min(n, buf.size() - at);
+    std::memcpy(dst, buf.data() + at, first);
+    std::memcpy(static_cast<std::uint8_t*>(dst) + first, buf.data(), n - first);
+  }
+};
+
+struct RecordHeader {
+  std::uint32_t size;  // header included
+  LogLevel level;
+  const char* fmt;     // null: the payload is log()'s text
+};
+
+struct AsyncLogState {
+  std::uint64_t id = 0;
+  std::shared_ptr<Logger> sink;
+  std::size_t ring_bytes = 0;
+  std::atomic<std::uint64_t> dropped{0};
+  std::atomic<bool> sleeping{false};  // the writer is (about to be) parked on cv
+
+  std::mutex mu;
+  std::condition_variable cv;       // wakes the writer
+  std::condition_variable done_cv;  // flush_done moved
+  std::vector<std::shared_ptr<LogRing>> added;  // rings of new producers, not yet adopted
+  std::uint64_t flush_requested = 0;
+  std::uint64_t flush_done = 0;
+  bool stop = false;
+  std::thread writer;
+
+  // Writer thread only.
+  std::vector<std::shared_ptr<LogRing>> rings;
+  std::vector<std::uint8_t> payload;
+  std::string text;
+
+  void wake() {
+    if (sleeping.load() && sleeping.exchange(false)) {
+      // Taking mu orders this after the writer's last check, so the notification is not lost.
+      std::lock_guard<std::mutex> lock(mu);
+      cv.notify_one();
+    }
+  }
+
+  bool any_queued() const {
+    for (const auto& r : rings) {
+      if (r->head.load() != r->tail.load(std::memory_order_relaxed)) return true;
+    }
+    return false;
+  }
+
+  // Pass every queued record to the sink; false if there was none.
+  bool drain() {
+    bool any = false;
+    for (auto it = rings.begin(); it != rings.end();) {
+      LogRing& r = **it;
+      const bool orphaned = r.orphaned.load(std::memory_order_acquire);
+      std::uint64_t tail = r.tail.load(std::memory_order_relaxed);
+      const std::uint64_t head = r.head.load(std::memory_order_acquire);
+      while (tail != head) {
+        RecordHeader h;
+        r.read(tail, &h, sizeof(h));
+        payload.resize(h.size - sizeof(h));
+        r.read(tail + sizeof(h), payload.data(), payload.size());
+        tail += h.size;
+        r.tail.store(tail, std::memory_order_release);
+        if (h.fmt) {
+          format_log(h.fmt, payload, &text);
+        } else {
+          text.assign(reinterpret_cast<const char*>(payload.data()), payload.size());
+        }
+        sink->log(h.level, text);
+        any = true;
+      }
+      it = orphaned ? rings.erase(it) : it + 1;
+    }
+    return any;
+  }
+
+  void run() {
+    for (;;) {
+      std::unique_lock<std::mutex> lock(mu);
+      for (auto& r : added) rings.push_back(std::move(r));
+      added.clear();
+      const std::uint64_t requested = flush_requested;
+      const bool stopping = stop;
+      lock.unlock();
+      if (drain()) continue;
+      // Nothing was queued as of the snapshot above.
+      if (requested != flush_done || stopping) {
+        sink->flush();
+        lock.lock();
+        flush_done = requested;
+        done_cv.notify_all();
+        if (stopping) return;
+        continue;
+      }
+      lock.lock();
+      sleeping.store(true);
+      if (added.empty() && flush_requested == flush_done && !stop && !any_queued()) cv.wait(lock);
+      sleeping.store(false);
+    }
+  }
+};
+
+namespace {
+
+std::atomic<std::uint64_t> g_next_async_logger{1};
+
+// This thread's ring for each AsyncLogger it has logged to.
+struct ThreadLogRings {
+  std::vector<std::pair<std::uint64_t, std::shared_ptr<LogRing>>> rings;
+
+  ~ThreadLogRings() {
+    for (auto& [id, r] : rings) r->orphaned.store(true, std::memory_order_release);
+  }
+
+  LogRing& get(AsyncLogState& st) {
+    for (auto& [id, r] : rings) {
+      if (id == st.id) return *r;
+    }
+    std::erase_if(rings, [](const auto& e) { return e.second->closed.load(std::memory_order_relaxed); });
+    auto ring = std::make_shared<LogRing>(st.ring_bytes);
+    {
+      std::lock_guard<std::mutex> lock(st.mu);
+      st.added.push_back(ring);
+    }
+    rings.emplace_back(st.id, ring);
+    return *ring;
+  }
+};
+
+thread_local ThreadLogRings t_log_rings;
+
+}  // namespace
+
+std::size_t next_metric_shard() {
+  static std::atomic<std::size_t> next{0};
+  return next.fetch_add(1, std::memory_order_relaxed) % kMetricShards;
+}
+
 }  // namespace detail
 
+AsyncLogger::AsyncLogger(std::shared_ptr<Logger> sink, AsyncLoggerOptions opt)
+    : state_(std::make_shared<detail::AsyncLogState>()) {
+  if (!sink) sink = std::make_shared<NullLogger>();
+  level_ = sink->level();
+  state_->id = detail::g_next_async_logger.fetch_add(1, std::memory_order_relaxed);
+  state_->sink = std::move(sink);
+  state_->ring_bytes = std::bit_ceil(std::max<std::size_t>(opt.ring_bytes, 256));
+  state_->writer = std::thread([st = state_.get()] { st->run(); });
+}
+
+AsyncLogger::~AsyncLogger() {
+  {
+    std::lock_guard<std::mutex> lock(state_->mu);
+    state_->stop = true;
+  }
+  state_->cv.notify_one();
+  state_->writer.join();
+  for (auto& r : state_->rings) r->closed.store(true, std::memory_order_relaxed);
+  for (auto& r : state_->added) r->closed.store(true, std::memory_order_relaxed);
+}
+
+void AsyncLogger::push(LogLevel level, const char* fmt, std::span<const std::uint8_t> bytes) {
+  detail::LogRing& r = detail::t_log_rings.get(*state_);
+  const detail::RecordHeader h{static_cast<std::uint32_t>(sizeof(detail::RecordHeader) + bytes.size()), level, fmt};
+  const std::uint64_t head = r.head.load(std::memory_order_relaxed);
+  if (r.buf.size() - (head - r.tail.load(std::memory_order_acquire)) < h.size) {
+    state_->dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  r.write(head, &h, sizeof(h));
+  r.write(head + sizeof(h), bytes.data(), bytes.size());
+  r.head.store(head + h.size);
+  state_->wake();
+  if (level == LogLevel::kFatal) flush();
+}
+
+void AsyncLogger::log(LogLevel level, std::string_view message) {
+  if (!enabled(level)) return;
+  push(level, nullptr, {reinterpret_cast<const std::uint8_t*>(message.data()), message.size()});
+}
+
+void AsyncLogger::log_record(LogLevel level, const LogFormat& fmt, std::span<const std::uint8_t> args) {
+  if (!enabled(level)) return;
+  push(level, fmt.text, args);
+}
+
+void AsyncLogger::flush() {
+  std::unique_lock<std::mutex> lock(state_->mu);
+  const std::uint64_t ticket = ++state_->flush_requested;
+  state_->cv.notify_one();
+  state_->done_cv.wait(lock, [&] { return state_->flush_done >= ticket; });
+}
+
+void AsyncLogger::set_level(LogLevel level) {
+  Logger::set_level(level);
+  state_->sink->set_level(level);
+}
+
+std::uint64_t AsyncLogger::dropped() const { return state_->dropped.load(std::memory_order_relaxed); }
+
+// ==============================================================================
+// Histogram 实现
+// ==============================================================================
+
+HistogramSnapshot Histogram::snapshot() const {
+  HistogramSnapshot s;
+  s.unit = unit_;
+  s.buckets.resize(kBuckets);
+  for (std::size_t i = 0; i < kBuckets; ++i) {
+    s.buckets[i] = buckets_[i].load(std::memory_order_relaxed);
+    s.count += s.buckets[i];
+  }
+  s.sum = sum();
+  return s;
+}
+
+void Histogram::reset() {
+  for (auto& b : buckets_) b.store(0, std::memory_order_relaxed);
+  for (auto& c : cells_) {
+    c.count.store(0, std::memory_order_relaxed);
+    c.sum.store(0.0, std::memory_order_relaxed);
+  }
+}
+
+double HistogramSnapshot::percentile(double q) const {
+  if (count == 0 || buckets.empty()) return 0.0;
+  q = q < 0.0 ? 0.0 : (q > 1.0 ? 1.0 : q);
+  // The sample of rank ceil(q * count), counting from 1.
+  const auto rank = std::max<std::uint64_t>(1, static_cast<std::uint64_t>(std::ceil(q * static_cast<double>(count))));
+  std::uint64_t seen = 0;
+  for (std::size_t i = 0; i < buckets.size(); ++i) {
+    seen += buckets[i];
+    if (seen >= rank) {
+      const std::uint64_t width = Histogram::bucket_width(i);
+      return (static_cast<double>(Histogram::bucket_lowest(i)) + static_cast<double>(width - 1) / 2.0) * unit;
+    }
+  }
+  return static_cast<double>(Histogram::bucket_lowest(buckets.size() - 1)) * unit;
+}
+
+bool HistogramSnapshot::merge(const HistogramSnapshot& other) {
+  if (other.buckets.empty()) return true;
+  if (buckets.empty()) {
+    *this = other;
+    return true;
+  }
+  if (other.unit != unit || other.buckets.size() != buckets.size()) return false;
+  for (std::size_t i = 0; i < buckets.size(); ++i) buckets[i] += other.buckets[i];
+  count += other.count;
+  sum += other.sum;
+  return true;
+}
+
 }  // namespace duct
@@ -1,17 +1,30 @@
 #include "duct/message.h"
 
 #include <cstring>
+#include <utility>
+
+#include "duct/message_pool.h"
 
 namespace duct {
+namespace {
+
+// Block for memory owned elsewhere; the caller's deleter replaces the pool's recycling.
+struct ForeignBlock : detail::MessageBlock {
+  Message::Deleter deleter;
+};
+
+void release_foreign(detail::MessageBlock* b) {
+  auto* f = static_cast<ForeignBlock*>(b);
+  if (f->deleter) f->deleter(f->bytes);
+  delete f;
+}
+
+}  // namespace
 
 Message Message::from_bytes(const void* data, size_t size) {
-  Message m;
-  m.backing_ = std::make_shared<std::vector<std::uint8_t>>(size);
-  if (size != 0) {
-    std::memcpy(m.backing_->data(), data, size);
-  }
-  m.data_ = m.backing_->data();
-  m.size_ = size;
+  if (size == 0) return Message();
+  Message m = allocate(size);
+  std::memcpy(m.data_, data, size);
   return m;
 }
 
@@ -24,13 +37,37 @@ Message Message::from_string(std::string_view s) {
 }
 
 Message Message::with_capacity(size_t capacity) {
-  Message m;
-  m.backing_ = std::make_shared<std::vector<std::uint8_t>>();
-  m.backing_->reserve(capacity);
-  m.data_ = m.backing_->data();
+  Message m = allocate(capacity);
   m.size_ = 0;
   return m;
 }
 
-}  // namespace duct
+Message Message::allocate(size_t size) {
+  Message m;
+  if (size <= kInlineCapacity) {
+    m.data_ = m.inline_;
+    m.size_ = static_cast<std::uint32_t>(size);
+    return m;
+  }
+  m.block_ = MessagePool::global().acquire(size);
+  m.data_ = m.block_->bytes;
+  m.size_ = static_cast<std::uint32_t>(size);
+  return m;
+}
 
+Message Message::adopt(void* data, size_t size, Deleter deleter) {
+  auto* b = new ForeignBlock;
+  b->size_class = MessagePool::kUnpooled;
+  b->capacity = size;
+  b->bytes = static_cast<std::uint8_t*>(data);
+  b->release = &release_foreign;
+  b->deleter = std::move(deleter);
+
+  Message m;
+  m.block_ = b;
+  m.data_ = b->bytes;
+  m.size_ = static_cast<std::uint32_t>(size);
+  return m;
+}
+
+}  // namespace duct
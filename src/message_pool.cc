@@ -0,0 +1,200 @@
+#include "duct/message_pool.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <new>
+
+namespace duct {
+namespace {
+
+using detail::MessageBlock;
+
+// Header is padded so payload bytes stay 16-byte aligned.
+constexpr std::size_t kHeaderBytes = (sizeof(MessageBlock) + 15) & ~std::size_t{15};
+
+// Per-thread cache bound per class: about 256KB worth of blocks, but always a few.
+constexpr std::size_t cache_limit(std::uint32_t cls) {
+  return std::max<std::size_t>(4, (256 * 1024) / MessagePool::class_size(cls));
+}
+
+struct FreeList {
+  MessageBlock* head = nullptr;
+  std::size_t count = 0;
+
+  void push(MessageBlock* b) {
+    b->next = head;
+    head = b;
+    ++count;
+  }
+  MessageBlock* pop() {
+    MessageBlock* b = head;
+    if (b) {
+      head = b->next;
+      b->next = nullptr;
+      --count;
+    }
+    return b;
+  }
+};
+
+struct Shared {
+  std::mutex mu;
+  std::array<FreeList, MessagePool::kClassCount> lists;
+  std::atomic<std::uint64_t> heap_allocations{0};
+  std::atomic<std::uint64_t> heap_frees{0};
+};
+
+// Leaked on purpose: messages may still be released from static destructors.
+Shared& shared() {
+  static Shared* s = new Shared;
+  return *s;
+}
+
+void release_block(MessageBlock* b);
+
+MessageBlock* new_block(std::uint32_t cls, std::size_t capacity) {
+  void* mem = ::operator new(kHeaderBytes + capacity);
+  auto* b = new (mem) MessageBlock;
+  b->size_class = cls;
+  b->capacity = capacity;
+  b->bytes = static_cast<std::uint8_t*>(mem) + kHeaderBytes;
+  b->release = &release_block;
+  shared().heap_allocations.fetch_add(1, std::memory_order_relaxed);
+  return b;
+}
+
+void delete_block(MessageBlock* b) {
+  b->~MessageBlock();
+  ::operator delete(b);
+}
+
+// Park `b` on its shared list, or on `excess` once the list is at shared_limit(); s.mu held.
+void park_locked(Shared& s, std::uint32_t cls, MessageBlock* b, FreeList& excess) {
+  FreeList& l = s.lists[cls];
+  if (l.count < MessagePool::shared_limit(cls)) {
+    l.push(b);
+  } else {
+    excess.push(b);
+  }
+}
+
+// Frees what park_locked() turned away, outside the lock.
+void free_excess(Shared& s, FreeList& excess) {
+  if (excess.count == 0) return;
+  s.heap_frees.fetch_add(excess.count, std::memory_order_relaxed);
+  while (MessageBlock* b = excess.pop()) delete_block(b);
+}
+
+// Set once this thread's cache is gone; trivially destructible so it stays readable afterwards.
+thread_local bool t_cache_dead = false;
+
+struct ThreadCache {
+  std::array<FreeList, MessagePool::kClassCount> lists;
+
+  ~ThreadCache() {
+    t_cache_dead = true;
+    Shared& s = shared();
+    FreeList excess;
+    {
+      std::lock_guard<std::mutex> lock(s.mu);
+      for (std::uint32_t c = 0; c < lists.size(); ++c) {
+        while (MessageBlock* b = lists[c].pop()) park_locked(s, c, b, excess);
+      }
+    }
+    free_excess(s, excess);
+  }
+};
+
+ThreadCache& thread_cache() {
+  thread_local ThreadCache cache;
+  return cache;
+}
+
+void release_block(MessageBlock* b) {
+  if (b->size_class == MessagePool::kUnpooled) {
+    delete_block(b);
+    return;
+  }
+  b->refs.store(1, std::memory_order_relaxed);
+  std::uint32_t cls = b->size_class;
+  Shared& s = shared();
+  FreeList excess;
+  if (t_cache_dead) {
+    {
+      std::lock_guard<std::mutex> lock(s.mu);
+      park_locked(s, cls, b, excess);
+    }
+    free_excess(s, excess);
+    return;
+  }
+  FreeList& local = thread_cache().lists[cls];
+  if (local.count >= cache_limit(cls)) {
+    // Full: hand half to the shared list so threads that mostly free can feed those that allocate.
+    {
+      std::lock_guard<std::mutex> lock(s.mu);
+      for (std::size_t i = cache_limit(cls) / 2; i != 0; --i) park_locked(s, cls, local.pop(), excess);
+    }
+    free_excess(s, excess);
+  }
+  local.push(b);
+}
+
+}  // namespace
+
+MessagePool& MessagePool::global() {
+  static MessagePool* pool = new MessagePool;
+  return *pool;
+}
+
+detail::MessageBlock* MessagePool::acquire(std::size_t size) {
+  std::uint32_t cls = size_class(size);
+  if (cls == kUnpooled) return new_block(kUnpooled, size);
+
+  Shared& s = shared();
+  if (t_cache_dead) {
+    std::unique_lock<std::mutex> lock(s.mu);
+    if (MessageBlock* b = s.lists[cls].pop()) return b;
+    lock.unlock();
+    return new_block(cls, class_size(cls));
+  }
+
+  FreeList& local = thread_cache().lists[cls];
+  if (MessageBlock* b = local.pop()) return b;
+  {
+    // Refill half a cache's worth in one lock round trip.
+    std::lock_guard<std::mutex> lock(s.mu);
+    for (std::size_t i = cache_limit(cls) / 2; i != 0; --i) {
+      MessageBlock* b = s.lists[cls].pop();
+      if (!b) break;
+      local.push(b);
+    }
+  }
+  if (MessageBlock* b = local.pop()) return b;
+  return new_block(cls, class_size(cls));
+}
+
+MessagePool::Stats MessagePool::stats() const {
+  Shared& s = shared();
+  Stats st;
+  st.heap_allocations = s.heap_allocations.load(std::memory_order_relaxed);
+  st.heap_frees = s.heap_frees.load(std::memory_order_relaxed);
+  std::lock_guard<std::mutex> lock(s.mu);
+  for (const FreeList& l : s.lists) st.shared_cached_blocks += l.count;
+  return st;
+}
+
+void MessagePool::trim() {
+  Shared& s = shared();
+  FreeList excess;
+  {
+    std::lock_guard<std::mutex> lock(s.mu);
+    for (FreeList& l : s.lists) {
+      while (MessageBlock* b = l.pop()) excess.push(b);
+    }
+  }
+  free_excess(s, excess);
+}
+
+}  // namespace duct
@@ -0,0 +1,443 @@
+#include "duct/mux.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "pipe_read.h"
+
+namespace duct {
+namespace {
+
+// Messages read per batch by the reader thread, and how long it waits for data before checking
+// whether the session is closing.
+constexpr std::size_t kRecvBatch = 64;
+constexpr std::chrono::milliseconds kRecvPollInterval{50};
+
+// Control frames travel on channel 0: kind, stream (2), value (4), big-endian.
+//   settings: stream = protocol version, value = the sender's stream window; its first frame
+//   open:     the sender opened `stream` (odd ids from the dialer, even ones from the acceptor)
+//   close:    the sender closed `stream`, or refused to open it; answered with a close unless the
+//             receiver had closed it already, after which both ends may reuse the id
+//   window:   the sender took `value` more bytes of `stream` off its window
+enum class Ctl : std::uint8_t { kSettings = 1, kOpen = 2, kClose = 3, kWindow = 4 };
+constexpr std::uint16_t kVersion = 1;
+constexpr std::size_t kCtlLen = 7;
+constexpr std::size_t kMaxWindow = 0x7fffffff;
+constexpr std::size_t kStreamIds = 0x8000;  // per end
+
+struct Control {
+  Ctl kind;
+  std::uint16_t stream;
+  std::uint32_t value;
+};
+
+Message encode_ctl(Ctl kind, std::uint16_t stream, std::uint32_t value) {
+  Message m = Message::allocate(kCtlLen);
+  std::uint8_t* p = m.data();
+  p[0] = static_cast<std::uint8_t>(kind);
+  p[1] = static_cast<std::uint8_t>(stream >> 8);
+  p[2] = static_cast<std::uint8_t>(stream);
+  for (int i = 0; i < 4; ++i) p[3 + i] = static_cast<std::uint8_t>(value >> (8 * (3 - i)));
+  return m;
+}
+
+Control decode_ctl(const Message& m) {
+  const std::uint8_t* p = m.data();
+  std::uint32_t value = 0;
+  for (int i = 0; i < 4; ++i) value = (value << 8) | p[3 + i];
+  return Control{static_cast<Ctl>(p[0]), static_cast<std::uint16_t>(p[1] << 8 | p[2]), value};
+}
+
+}  // namespace
+
+namespace detail {
+
+// One logical stream. Its lock nests inside MuxCore::mu_.
+struct MuxStream {
+  explicit MuxStream(std::uint16_t stream_id) : id(stream_id) {}
+
+  const std::uint16_t id;
+  std::mutex mu;
+  std::condition_variable cv;  // receivers: data or an end; senders: window or an end
+  std::deque<Message> inbox;
+  std::int64_t credit = 0;     // bytes we may send before the peer grants more; may go negative
+  std::size_t taken = 0;       // bytes recv() took that have not been granted back yet
+  bool closed = false;         // closed here: nothing more either way
+  bool peer_closed = false;    // closed by the peer: the inbox drains, then kClosed
+  Status failure;              // the session failed
+};
+
+class MuxCore {
+ public:
+  MuxCore(std::unique_ptr<Pipe> conn, MuxRole role, const MuxOptions& opt)
+      : opt_(opt), conn_(std::move(conn)), next_id_(role == MuxRole::kDialer ? 1 : 2) {
+    opt_.stream_window_bytes = std::clamp<std::size_t>(opt_.stream_window_bytes, 1, kMaxWindow);
+    auto st = write(encode_ctl(Ctl::kSettings, kVersion, static_cast<std::uint32_t>(opt_.stream_window_bytes)), 0, {});
+    if (!st.ok()) {
+      fail_locked(st.status());
+      return;
+    }
+    running_ = true;
+    reader_ = std::thread(&MuxCore::reader, this);
+  }
+
+  ~MuxCore() { close(); }
+
+  Result<std::shared_ptr<MuxStream>> open() {
+    std::shared_ptr<MuxStream> s;
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      if (!failure_.ok()) return failure_;
+      for (std::size_t tries = 0; tries < kStreamIds && !s; ++tries) {
+        const std::uint16_t id = next_id_;
+        next_id_ = static_cast<std::uint16_t>(next_id_ + 2);
+        if (next_id_ < 2) next_id_ = id % 2 == 1 ? 1 : 2;  // wrapped
+        if (streams_.count(id) == 0) s = add_locked(id);
+      }
+      if (!s) return Status::io_error("mux: out of stream ids");
+      ++stats_.opened;
+    }
+    auto st = write(encode_ctl(Ctl::kOpen, s->id, 0), 0, {});
+    if (!st.ok()) {
+      failed(st.status());
+      return st.status();
+    }
+    return s;
+  }
+
+  Result<std::shared_ptr<MuxStream>> accept(const RecvOptions& opt) {
+    std::unique_lock<std::mutex> lock(mu_);
+    auto ready = [this] { return !backlog_.empty() || !failure_.ok(); };
+    if (opt.timeout.count() > 0) {
+      if (!accept_cv_.wait_for(lock, opt.timeout, ready)) return Status::timeout("accept timeout");
+    } else {
+      accept_cv_.wait(lock, ready);
+    }
+    if (!failure_.ok()) return failure_;
+    std::shared_ptr<MuxStream> s = std::move(backlog_.front());
+    backlog_.pop_front();
+    ++stats_.accepted;
+    return s;
+  }
+
+  Result<void> send(MuxStream& s, const Message& msg, const SendOptions& opt) {
+    if (opt.channel != 0) return Status::invalid_argument("mux streams have no channels");
+    {
+      std::unique_lock<std::mutex> lock(s.mu);
+      auto ready = [&s] { return s.credit > 0 || s.closed || s.peer_closed || !s.failure.ok(); };
+      if (!ready()) {
+        window_waits_.fetch_add(1, std::memory_order_relaxed);
+        if (opt.timeout.count() > 0) {
+          if (!s.cv.wait_for(lock, opt.timeout, ready)) return Status::timeout("stream window full (timeout)");
+        } else {
+          s.cv.wait(lock, ready);
+        }
+      }
+      if (!s.failure.ok()) return s.failure;
+      if (s.closed) return Status::closed("stream closed");
+      if (s.peer_closed) return Status::closed("stream closed by peer");
+      s.credit -= static_cast<std::int64_t>(msg.size());
+    }
+    auto st = write(msg, s.id, opt);
+    if (!st.ok() && st.status().code() != StatusCode::kTimeout) failed(st.status());
+    return st;
+  }
+
+  Result<std::size_t> recv_batch(MuxStream& s, std::span<Message> out, const RecvOptions& opt) {
+    if (out.empty()) return std::size_t{0};
+    std::size_t n = 0;
+    std::size_t grant = 0;
+    {
+      std::unique_lock<std::mutex> lock(s.mu);
+      auto ready = [&s] { return !s.inbox.empty() || s.closed || s.peer_closed || !s.failure.ok(); };
+      if (opt.timeout.count() > 0) {
+        if (!s.cv.wait_for(lock, opt.timeout, ready)) return Status::timeout("recv timeout");
+      } else {
+        s.cv.wait(lock, ready);
+      }
+      if (s.inbox.empty()) {
+        if (s.closed) return Status::closed("stream closed");
+        if (!s.failure.ok()) return s.failure;
+        return Status::closed("stream closed by peer");
+      }
+      while (n < out.size() && !s.inbox.empty()) {
+        s.taken += s.inbox.front().size();
+        out[n++] = std::move(s.inbox.front());
+        s.inbox.pop_front();
+      }
+      // Grant the window back in halves rather than per message.
+      if (s.taken >= opt_.stream_window_bytes / 2 && !s.peer_closed && s.failure.ok()) {
+        grant = std::min(s.taken, kMaxWindow);
+        s.taken -= grant;
+      }
+    }
+    if (grant != 0) {
+      window_updates_.fetch_add(1, std::memory_order_relaxed);
+      auto st = write(encode_ctl(Ctl::kWindow, s.id, static_cast<std::uint32_t>(grant)), 0, {});
+      if (!st.ok()) failed(st.status());
+    }
+    return n;
+  }
+
+  void close_stream(MuxStream& s) {
+    bool tell = false;
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      std::lock_guard<std::mutex> slock(s.mu);
+      if (s.closed) return;
+      s.closed = true;
+      s.inbox.clear();
+      s.cv.notify_all();
+      // Still listed until the peer's close answers ours; a stream the peer closed is gone already.
+      tell = !s.peer_closed && failure_.ok();
+    }
+    if (!tell) return;
+    auto st = write(encode_ctl(Ctl::kClose, s.id, 0), 0, {});
+    if (!st.ok()) failed(st.status());
+  }
+
+  void close() {
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      running_ = false;
+      fail_locked(Status::closed("mux session closed"));
+    }
+    // The reader uses the connection; let it notice first (within kRecvPollInterval).
+    if (reader_.joinable() && reader_.get_id() != std::this_thread::get_id()) reader_.join();
+    if (conn_) conn_->close();
+  }
+
+  MuxSession::Stats stats() const {
+    std::lock_guard<std::mutex> lock(mu_);
+    MuxSession::Stats s = stats_;
+    s.streams = streams_.size();
+    s.window_updates = window_updates_.load(std::memory_order_relaxed);
+    s.window_waits = window_waits_.load(std::memory_order_relaxed);
+    return s;
+  }
+
+ private:
+  bool ours(std::uint16_t id) const { return id % 2 == next_id_ % 2; }
+
+  std::shared_ptr<MuxStream> add_locked(std::uint16_t id) {
+    auto s = std::make_shared<MuxStream>(id);
+    if (peer_window_ != 0) s->credit = static_cast<std::int64_t>(peer_window_);
+    streams_.emplace(id, s);
+    return s;
+  }
+
+  Result<void> write(const Message& m, std::uint16_t channel, const SendOptions& opt) {
+    SendOptions so = opt;
+    so.channel = channel;
+    std::lock_guard<std::mutex> lock(write_mu_);
+    return conn_->send(m, so);
+  }
+
+  // Every stream ends with `st`, and so does the session.
+  void fail_locked(Status st) {
+    if (!failure_.ok()) return;
+    failure_ = std::move(st);
+    for (auto& [id, s] : streams_) {
+      std::lock_guard<std::mutex> slock(s->mu);
+      s->failure = failure_;
+      s->cv.notify_all();
+    }
+    for (auto& s : backlog_) {
+      std::lock_guard<std::mutex> slock(s->mu);
+      s->failure = failure_;
+    }
+    accept_cv_.notify_all();
+  }
+
+  void failed(Status st) {
+    std::lock_guard<std::mutex> lock(mu_);
+    fail_locked(std::move(st));
+  }
+
+  // A frame from the peer, with replies for the reader to send once mu_ is released.
+  Result<void> dispatch_locked(Message& f, std::vector<Message>* replies) {
+    const std::uint16_t channel = f.channel();
+    if (channel != 0) {
+      auto it = streams_.find(channel);
+      if (it == streams_.end()) return {};  // closed here since, or refused
+      MuxStream& s = *it->second;
+      std::lock_guard<std::mutex> slock(s.mu);
+      if (s.closed) return {};
+      s.inbox.push_back(std::move(f));
+      s.cv.notify_all();
+      return {};
+    }
+    if (f.size() != kCtlLen) return Status::protocol_error("malformed mux control frame");
+    const Control c = decode_ctl(f);
+    switch (c.kind) {
+      case Ctl::kSettings: {
+        if (c.stream != kVersion) return Status::protocol_error("unsupported mux version");
+        if (peer_window_ != 0 || c.value == 0) return Status::protocol_error("bad mux settings");
+        peer_window_ = c.value;
+        for (auto& [id, s] : streams_) {
+          std::lock_guard<std::mutex> slock(s->mu);
+          s->credit += static_cast<std::int64_t>(peer_window_);
+          s->cv.notify_all();
+        }
+        return {};
+      }
+      case Ctl::kOpen: {
+        if (c.stream == 0 || ours(c.stream) || streams_.count(c.stream) != 0) {
+          return Status::protocol_error("bad mux stream id");
+        }
+        if (peer_streams_ >= opt_.max_streams || backlog_.size() >= opt_.accept_backlog) {
+          ++stats_.refused;
+          replies->push_back(encode_ctl(Ctl::kClose, c.stream, 0));
+          return {};
+        }
+        ++peer_streams_;
+        backlog_.push_back(add_locked(c.stream));
+        accept_cv_.notify_one();
+        return {};
+      }
+      case Ctl::kClose: {
+        auto it = streams_.find(c.stream);
+        if (it == streams_.end()) return {};  // answers our refusal
+        std::shared_ptr<MuxStream> s = std::move(it->second);
+        streams_.erase(it);
+        if (!ours(c.stream)) --peer_streams_;
+        std::lock_guard<std::mutex> slock(s->mu);
+        if (!s->closed) {
+          s->peer_closed = true;
+          s->cv.notify_all();
+          replies->push_back(encode_ctl(Ctl::kClose, c.stream, 0));
+        }
+        return {};
+      }
+      case Ctl::kWindow: {
+        auto it = streams_.find(c.stream);
+        if (it == streams_.end()) return {};
+        MuxStream& s = *it->second;
+        std::lock_guard<std::mutex> slock(s.mu);
+        s.credit += c.value;
+        s.cv.notify_all();
+        return {};
+      }
+    }
+    return Status::protocol_error("unknown mux control frame");
+  }
+
+  void reader() {
+    std::vector<Message> batch(kRecvBatch);
+    std::vector<Message> replies;
+    while (running_.load(std::memory_order_acquire)) {
+      auto n = read_some(*conn_, batch, kRecvPollInterval);
+      if (!n.ok()) {
+        failed(n.status());
+        return;
+      }
+      {
+        std::lock_guard<std::mutex> lock(mu_);
+        for (std::size_t i = 0; i < n.value(); ++i) {
+          auto st = dispatch_locked(batch[i], &replies);
+          batch[i] = Message();
+          if (!st.ok()) {
+            fail_locked(st.status());
+            return;
+          }
+        }
+      }
+      for (const Message& r : replies) {
+        auto st = write(r, 0, {});
+        if (!st.ok()) {
+          failed(st.status());
+          return;
+        }
+      }
+      replies.clear();
+    }
+  }
+
+  MuxOptions opt_;
+  std::unique_ptr<Pipe> conn_;
+
+  mutable std::mutex mu_;
+  std::condition_variable accept_cv_;  // accept(): a stream in backlog_, or failed
+  std::unordered_map<std::uint16_t, std::shared_ptr<MuxStream>> streams_;  // open or closing
+  std::deque<std::shared_ptr<MuxStream>> backlog_;  // opened by the peer, not accepted yet
+  std::size_t peer_streams_ = 0;  // streams_ opened by the peer
+  std::uint16_t next_id_;         // keeps our parity
+  std::size_t peer_window_ = 0;   // 0 until the peer's settings arrive
+  Status failure_;
+  MuxSession::Stats stats_;
+  std::atomic<std::uint64_t> window_updates_{0};
+  std::atomic<std::uint64_t> window_waits_{0};
+
+  std::atomic<bool> running_{false};
+  std::mutex write_mu_;  // one writer at a time on the connection
+  std::thread reader_;
+};
+
+}  // namespace detail
+
+namespace {
+
+class MuxPipe final : public Pipe {
+ public:
+  MuxPipe(std::shared_ptr<detail::MuxCore> core, std::shared_ptr<detail::MuxStream> stream)
+      : core_(std::move(core)), stream_(std::move(stream)) {}
+  ~MuxPipe() override { close(); }
+
+  Result<void> send(const Message& msg, const SendOptions& opt) override { return core_->send(*stream_, msg, opt); }
+
+  Result<Message> recv(const RecvOptions& opt) override {
+    Message m;
+    auto n = recv_batch(std::span<Message>(&m, 1), opt);
+    if (!n.ok()) return n.status();
+    return m;
+  }
+
+  Result<std::size_t> recv_batch(std::span<Message> out, const RecvOptions& opt) override {
+    return core_->recv_batch(*stream_, out, opt);
+  }
+
+  Result<std::span<std::uint8_t>> reserve(std::size_t size, const SendOptions&) override {
+    return staged_.reserve(size);
+  }
+  Result<void> commit(std::size_t len, const SendOptions& opt) override { return staged_.commit(*this, len, opt); }
+
+  void close() override { core_->close_stream(*stream_); }
+
+ private:
+  std::shared_ptr<detail::MuxCore> core_;
+  std::shared_ptr<detail::MuxStream> stream_;
+  detail::StagedSend staged_;
+};
+
+}  // namespace
+
+MuxSession::MuxSession(std::unique_ptr<Pipe> conn, MuxRole role, const MuxOptions& opt)
+    : core_(std::make_shared<detail::MuxCore>(std::move(conn), role, opt)) {}
+
+MuxSession::~MuxSession() { close(); }
+
+Result<std::unique_ptr<Pipe>> MuxSession::open() {
+  auto s = core_->open();
+  if (!s.ok()) return s.status();
+  return std::unique_ptr<Pipe>(new MuxPipe(core_, std::move(s.value())));
+}
+
+Result<std::unique_ptr<Pipe>> MuxSession::accept(const RecvOptions& opt) {
+  auto s = core_->accept(opt);
+  if (!s.ok()) return s.status();
+  return std::unique_ptr<Pipe>(new MuxPipe(core_, std::move(s.value())));
+}
+
+void MuxSession::close() { core_->close(); }
+
+MuxSession::Stats MuxSession::stats() const { return core_->stats(); }
+
+}  // namespace duct
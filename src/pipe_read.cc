@@ -0,0 +1,48 @@
+#include "pipe_read.h"
+
+#include <thread>
+
+#if defined(_WIN32)
+#include <winsock2.h>
+#else
+#include <poll.h>
+#endif
+
+namespace duct::detail {
+namespace {
+
+// Wait until `h` is readable or the interval passes; errors surface from the next read.
+void wait_readable(PollHandle h, std::chrono::milliseconds timeout) {
+#if defined(_WIN32)
+  WSAPOLLFD p{};
+  p.fd = static_cast<SOCKET>(h);
+  p.events = POLLRDNORM;
+  (void)WSAPoll(&p, 1, static_cast<INT>(timeout.count()));
+#else
+  pollfd p{};
+  p.fd = static_cast<int>(h);
+  p.events = POLLIN;
+  (void)::poll(&p, 1, static_cast<int>(timeout.count()));
+#endif
+}
+
+}  // namespace
+
+Result<std::size_t> read_some(Pipe& p, std::span<Message> out, std::chrono::milliseconds wait) {
+  auto n = p.try_recv_batch(out);
+  if (!n.ok() && n.status().code() == StatusCode::kNotSupported) {
+    n = p.recv_batch(out, RecvOptions{wait});
+    if (!n.ok() && n.status().code() == StatusCode::kTimeout) return std::size_t{0};
+    return n;
+  }
+  if (!n.ok() || n.value() != 0) return n;
+  const PollHandle h = p.poll_handle();
+  if (h != kInvalidPollHandle) {
+    wait_readable(h, wait);
+  } else {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));  // reconnecting, or poll-less
+  }
+  return std::size_t{0};
+}
+
+}  // namespace duct::detail
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <span>
+
+#include "duct/duct.h"
+
+namespace duct::detail {
+
+// Up to out.size() messages from `p`, waiting at most about `wait` for the first: non-blocking
+// reads with readiness waits in between where the pipe has them, a bounded recv_batch otherwise.
+// Returns 0 when nothing arrived in time. For worker threads that must notice a close.
+Result<std::size_t> read_some(Pipe& p, std::span<Message> out, std::chrono::milliseconds wait);
+
+}  // namespace duct::detail
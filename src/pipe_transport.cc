@@ -1,10 +1,13 @@
 #include "duct/duct.h"
 
 #include "duct/wire.h"
+#include "stream_endpoint.h"
 
 #include <chrono>
 #include <cstdint>
+#include <cstring>
 #include <memory>
+#include <span>
 #include <string>
 #include <vector>
 
@@ -23,6 +26,7 @@ using namespace duct::wire;
 // Named pipe constants
 constexpr DWORD kPipeBufferSize = 64 * 1024;  // 64KB buffer
 constexpr DWORD kDefaultTimeoutMs = 5000;     // 5 seconds
+constexpr std::size_t kBatchWriteBytes = 256 * 1024;  // send_batch flushes once this much is staged
 
 static std::string sanitize_name(std::string_view s) {
   std::string out;
@@ -68,57 +72,147 @@ static std::string sanitize_name(std::string_view s) {
   return &sa;
 }
 
-class NamedPipePipe final : public Pipe {
+// The handle is overlapped (FILE_FLAG_OVERLAPPED) so that a Reactor on IOCP can take it over (see
+// StreamEndpoint); until then the pipe does its own I/O and waits for each operation on an event.
+// 句柄以重叠模式打开，便于 IOCP Reactor 接管；未接管时管道自行读写，每次操作在事件上等待完成。
+class NamedPipePipe final : public Pipe, private detail::StreamEndpoint {
  public:
-  explicit NamedPipePipe(HANDLE handle, bool is_server)
-    : handle_(handle), is_server_(is_server) {}
+  NamedPipePipe(HANDLE handle, bool is_server, const FragmentOptions& fragments)
+    : handle_(handle), is_server_(is_server), reassembler_(fragments) {
+    reader_.set_fragment_options(fragments);
+    rx_event_ = CreateEventA(NULL, TRUE, FALSE, NULL);
+    tx_event_ = CreateEventA(NULL, TRUE, FALSE, NULL);
+  }
 
-  ~NamedPipePipe() override { close(); }
+  ~NamedPipePipe() override {
+    close();
+    if (rx_event_ != NULL) CloseHandle(rx_event_);
+    if (tx_event_ != NULL) CloseHandle(tx_event_);
+  }
 
   Result<void> send(const Message& msg, const SendOptions& opt) override {
-    (void)opt;
     if (handle_ == INVALID_HANDLE_VALUE) {
       return Status::closed("pipe closed");
     }
+    std::uint64_t token = 0;
+    if (auto eng = engine(&token)) {
+      auto n = eng->send(token, std::span<const Message>(&msg, 1), opt);
+      if (n.ok()) return {};
+      if (n.status().code() != StatusCode::kNotSupported) return n.status();
+    }
+
+    // Header and payload go out as one pipe message (one WriteFile), a large message as a run of
+    // fragment frames; the reader consumes it in pieces via ERROR_MORE_DATA.
+    // 帧头和负载合并为一条管道消息（一次 WriteFile），大消息则是一串分片帧；读端通过 ERROR_MORE_DATA 分段读取。
+    wbuf_.clear();
+    append_frames(msg, true, true, send_flags(opt));
+    return flush();
+  }
+
+  Result<std::size_t> send_batch(std::span<const Message> msgs, const SendOptions& opt) override {
+    if (handle_ == INVALID_HANDLE_VALUE) {
+      return Status::closed("pipe closed");
+    }
+    std::uint64_t token = 0;
+    if (auto eng = engine(&token)) {
+      auto n = eng->send(token, msgs, opt);
+      if (n.ok() || n.status().code() != StatusCode::kNotSupported) return n;
+    }
+
+    // Pack consecutive frames into one pipe message, capped so a huge batch does not balloon the
+    // staging buffer.
+    // 将连续的帧打包成一条管道消息；设置上限，避免超大批次撑大暂存缓冲区。
+    std::size_t done = 0;
+    std::size_t packed = 0;
+    wbuf_.clear();
+    const std::uint32_t flags = send_flags(opt);
+    for (std::size_t i = 0; i < msgs.size(); ++i) {
+      append_frames(msgs[i], i == 0, i + 1 == msgs.size(), flags);
+      ++packed;
+      if (wbuf_.size() >= kBatchWriteBytes || done + packed == msgs.size()) {
+        auto st = flush();
+        if (!st.ok()) {
+          if (done == 0) return st.status();
+          break;
+        }
+        done += packed;
+        packed = 0;
+        wbuf_.clear();
+      }
+    }
+    return done;
+  }
+
+  // The span is the payload part of the staging buffer, right behind the frame header.
+  // 返回的 span 位于暂存缓冲区内帧头之后，commit 时一次 WriteFile 发出。
+  Result<std::span<std::uint8_t>> reserve(std::size_t size, const SendOptions& opt) override {
+    if (handle_ == INVALID_HANDLE_VALUE) {
+      return Status::closed("pipe closed");
+    }
+    reserved_ = kNoReservation;
+    staged_.cancel();
+    // While the engine sends, the staged message goes through send() like any other.
+    if (size > kMaxFramePayload || attached()) return staged_.reserve(size);
+    wbuf_.clear();
+    wbuf_.resize(kHeaderLen + size);
+    reserved_ = size;
+    return std::span<std::uint8_t>(wbuf_.data() + kHeaderLen, size);
+  }
+
+  Result<void> commit(std::size_t len, const SendOptions& opt) override {
+    if (handle_ == INVALID_HANDLE_VALUE) {
+      return Status::closed("pipe closed");
+    }
+    if (reserved_ == kNoReservation) return staged_.commit(*this, len, opt);
+    if (len > reserved_) return Status::invalid_argument("commit exceeds reservation");
+    reserved_ = kNoReservation;
 
-    // Frame the message using duct wire protocol
     FrameHeader h;
     h.magic = kProtocolMagic;
     h.version = kProtocolVersion;
     h.header_len = kHeaderLen;
-    h.payload_len = static_cast<std::uint32_t>(msg.size());
-    h.flags = 0;
-
-    // Encode header
-    std::uint8_t hdr[kHeaderLen];
-    encode_header(h, hdr);
-
-    // Write header and payload
-    DWORD bytes_written;
+    h.payload_len = static_cast<std::uint32_t>(len);
+    h.flags = send_flags(opt);
+    encode_header(h, wbuf_.data());
+    wbuf_.resize(kHeaderLen + len);
+    return flush();
+  }
 
-    // Write header
-    BOOL result = WriteFile(handle_, hdr, kHeaderLen, &bytes_written, NULL);
-    if (!result || bytes_written != kHeaderLen) {
-      DWORD error = GetLastError();
-      if (error == ERROR_BROKEN_PIPE) {
-        return Status::closed("pipe closed");
-      }
-      return Status::io_error("WriteFile header failed with error: " + std::to_string(error));
+  // Frames are written whole, so any bytes PeekNamedPipe reports belong to complete frames and
+  // reading them does not block.
+  // 帧总是整体写入，PeekNamedPipe 报告有数据时读取不会阻塞。
+  Result<std::size_t> try_recv_batch(std::span<Message> out) override {
+    if (handle_ == INVALID_HANDLE_VALUE) {
+      return Status::closed("pipe closed");
     }
-
-    // Write payload
-    if (msg.size() > 0) {
-      result = WriteFile(handle_, msg.data(), static_cast<DWORD>(msg.size()), &bytes_written, NULL);
-      if (!result || bytes_written != static_cast<DWORD>(msg.size())) {
+    if (attached()) return pop_fed(out);
+    std::size_t n = 0;
+    // Frames an engine received before it let go come first.
+    // 引擎释放管道前已收到的帧优先返回。
+    while (n < out.size()) {
+      auto popped = pop_buffered(&out[n]);
+      if (!popped.ok() || !popped.value()) break;
+      ++n;
+    }
+    while (n < out.size()) {
+      DWORD avail = 0;
+      if (!PeekNamedPipe(handle_, NULL, 0, NULL, &avail, NULL)) {
+        if (n != 0) break;
         DWORD error = GetLastError();
         if (error == ERROR_BROKEN_PIPE) {
           return Status::closed("pipe closed");
         }
-        return Status::io_error("WriteFile payload failed with error: " + std::to_string(error));
+        return Status::io_error("PeekNamedPipe failed with error: " + std::to_string(error));
       }
+      if (avail == 0) break;
+      auto got = read_one(&out[n]);
+      if (!got.ok()) {
+        if (n != 0) break;
+        return got.status();
+      }
+      if (got.value()) ++n;
     }
-
-    return {};
+    return n;
   }
 
   Result<Message> recv(const RecvOptions& opt) override {
@@ -126,17 +220,48 @@ class NamedPipePipe final : public Pipe {
     if (handle_ == INVALID_HANDLE_VALUE) {
       return Status::closed("pipe closed");
     }
+    if (attached()) return Status::not_supported("pipe is driven by a reactor; use try_recv_batch");
+    Message m;
+    auto popped = pop_buffered(&m);
+    if (!popped.ok()) return popped.status();
+    if (popped.value()) return m;
+    for (;;) {
+      auto got = read_one(&m);
+      if (!got.ok()) return got.status();
+      if (got.value()) return m;
+    }
+  }
 
+  detail::StreamEndpoint* stream_endpoint() override { return this; }
+
+  void close() override {
+    if (handle_ != INVALID_HANDLE_VALUE) {
+      std::uint64_t token = 0;
+      if (auto eng = engine(&token)) eng->closed(token);
+      CloseHandle(handle_);
+      handle_ = INVALID_HANDLE_VALUE;
+    }
+  }
+
+ private:
+  // Read one frame. False (and `*out` untouched) for a fragment that does not complete a message.
+  // 读取一帧；分片帧未拼成完整消息时返回 false。
+  Result<bool> read_one(Message* out) {
     // Read header
     std::uint8_t hdr[kHeaderLen];
     DWORD bytes_read;
-    BOOL result = ReadFile(handle_, hdr, kHeaderLen, &bytes_read, NULL);
+    // In message mode a frame (or a batch of frames) arrives as one pipe message, so a short read
+    // reports ERROR_MORE_DATA; that just means the rest follows.
+    // 消息模式下一帧（或一批帧）是一条管道消息，分段读取会返回 ERROR_MORE_DATA，表示后续数据仍在。
+    BOOL result = transfer(false, hdr, kHeaderLen, &bytes_read);
     if (!result) {
       DWORD error = GetLastError();
       if (error == ERROR_BROKEN_PIPE) {
         return Status::closed("pipe closed");
       }
-      return Status::io_error("ReadFile header failed with error: " + std::to_string(error));
+      if (error != ERROR_MORE_DATA) {
+        return Status::io_error("ReadFile header failed with error: " + std::to_string(error));
+      }
     }
 
     if (bytes_read != kHeaderLen) {
@@ -159,13 +284,15 @@ class NamedPipePipe final : public Pipe {
     // Read payload
     std::vector<std::uint8_t> buffer(header.payload_len);
     if (header.payload_len > 0) {
-      result = ReadFile(handle_, buffer.data(), header.payload_len, &bytes_read, NULL);
+      result = transfer(false, buffer.data(), header.payload_len, &bytes_read);
       if (!result) {
         DWORD error = GetLastError();
         if (error == ERROR_BROKEN_PIPE) {
           return Status::closed("pipe closed");
         }
-        return Status::io_error("ReadFile payload failed with error: " + std::to_string(error));
+        if (error != ERROR_MORE_DATA) {
+          return Status::io_error("ReadFile payload failed with error: " + std::to_string(error));
+        }
       }
 
       if (bytes_read != header.payload_len) {
@@ -173,32 +300,96 @@ class NamedPipePipe final : public Pipe {
       }
     }
 
-    return Message::from_bytes(buffer.data(), buffer.size());
+    const std::uint16_t channel = frame_channel(header.flags);
+    if (is_fragment(header.flags)) {
+      return reassembler_.add_fragment(buffer, channel, header.flags, out);
+    }
+    reassembler_.on_whole(channel);
+    *out = Message::from_bytes(buffer.data(), buffer.size());
+    ++thread_io().copies;
+    set_frame_meta(*out, header.flags);
+    return true;
   }
 
-  void close() override {
-    if (handle_ != INVALID_HANDLE_VALUE) {
-      CloseHandle(handle_);
-      handle_ = INVALID_HANDLE_VALUE;
+  // `first` / `last`: whether msg starts / ends the send (see for_each_frame).
+  void append_frames(const Message& msg, bool first, bool last, std::uint32_t flags) {
+    for_each_frame(msg, first, last, flags, [&](std::size_t off, std::size_t len, std::uint32_t frame_flags) {
+      FrameHeader h;
+      h.magic = kProtocolMagic;
+      h.version = kProtocolVersion;
+      h.header_len = kHeaderLen;
+      h.payload_len = static_cast<std::uint32_t>(len);
+      h.flags = frame_flags;
+
+      std::size_t at = wbuf_.size();
+      wbuf_.resize(at + kHeaderLen + len);
+      encode_header(h, wbuf_.data() + at);
+      if (len > 0) {
+        std::memcpy(wbuf_.data() + at + kHeaderLen, msg.data() + off, len);
+      }
+    });
+  }
+
+  Result<void> flush() {
+    DWORD bytes_written = 0;
+    BOOL result = transfer(true, wbuf_.data(), static_cast<DWORD>(wbuf_.size()), &bytes_written);
+    if (!result || bytes_written != static_cast<DWORD>(wbuf_.size())) {
+      DWORD error = GetLastError();
+      if (error == ERROR_BROKEN_PIPE || error == ERROR_NO_DATA) {
+        return Status::closed("pipe closed");
+      }
+      return Status::io_error("WriteFile failed with error: " + std::to_string(error));
     }
+    return {};
   }
 
- private:
+  // One ReadFile / WriteFile on the overlapped handle, waited for; returns and sets GetLastError()
+  // like the synchronous call. The low bit of hEvent keeps the completion off any port the handle
+  // is associated with.
+  // 在重叠句柄上执行一次读写并等待完成，返回值与 GetLastError() 同同步调用；hEvent 最低位置 1，
+  // 完成通知不会投递到已关联的完成端口。
+  BOOL transfer(bool write, void* buf, DWORD len, DWORD* done) {
+    HANDLE event = write ? tx_event_ : rx_event_;
+    OVERLAPPED ov{};
+    ov.hEvent = reinterpret_cast<HANDLE>(reinterpret_cast<std::uintptr_t>(event) | 1);
+    BOOL result = write ? WriteFile(handle_, buf, len, NULL, &ov) : ReadFile(handle_, buf, len, NULL, &ov);
+    if (!result) {
+      DWORD error = GetLastError();
+      if (error != ERROR_IO_PENDING && error != ERROR_MORE_DATA) {
+        *done = 0;
+        return FALSE;
+      }
+      if (error == ERROR_IO_PENDING) WaitForSingleObject(event, INFINITE);
+    }
+    return GetOverlappedResult(handle_, &ov, done, FALSE);
+  }
+
+  wire::SocketHandle socket() const override { return reinterpret_cast<wire::SocketHandle>(handle_); }
+  bool socket_is_file() const override { return true; }
+
+  static constexpr std::size_t kNoReservation = ~std::size_t{0};
+
   HANDLE handle_;
+  HANDLE rx_event_ = NULL;  // signalled by transfer()'s reads
+  HANDLE tx_event_ = NULL;  // and writes, which may run on another thread
   bool is_server_;
+  std::vector<std::uint8_t> wbuf_;  // staging for one pipe message; reused across sends
+  std::size_t reserved_ = kNoReservation;  // payload bytes reserved in wbuf_ by reserve()
+  detail::StagedSend staged_;  // reservations wbuf_ does not take (oversize, engine attached)
+  Reassembler reassembler_;
 };
 
 class NamedPipeListener final : public Listener {
  public:
-  explicit NamedPipeListener(const std::string& pipe_path, int backlog)
-    : pipe_path_(pipe_path), backlog_(backlog) {}
+  NamedPipeListener(const std::string& pipe_path, int backlog, const FragmentOptions& fragments)
+    : pipe_path_(pipe_path), backlog_(backlog), fragments_(fragments) {}
 
   ~NamedPipeListener() override { close(); }
 
   Result<std::unique_ptr<Pipe>> accept() override {
     HANDLE pipe = CreateNamedPipeA(
       pipe_path_.c_str(),
-      PIPE_ACCESS_DUPLEX,
+      PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED,
       PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT,
       PIPE_UNLIMITED_INSTANCES,  // Allow unlimited instances
       kPipeBufferSize,           // Output buffer size
@@ -212,17 +403,21 @@ class NamedPipeListener final : public Listener {
       return Status::io_error("CreateNamedPipe failed with error: " + std::to_string(error));
     }
 
-    // Wait for client connection
-    BOOL connected = ConnectNamedPipe(pipe, NULL);
-    if (!connected) {
-      DWORD error = GetLastError();
-      if (error != ERROR_PIPE_CONNECTED) {
-        CloseHandle(pipe);
-        return Status::io_error("ConnectNamedPipe failed with error: " + std::to_string(error));
-      }
+    // Wait for client connection (the handle is overlapped, so on an event)
+    OVERLAPPED ov{};
+    ov.hEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+    DWORD error = ConnectNamedPipe(pipe, &ov) ? 0 : GetLastError();
+    if (error == ERROR_IO_PENDING) {
+      DWORD unused = 0;
+      error = GetOverlappedResult(pipe, &ov, &unused, TRUE) ? 0 : GetLastError();
+    }
+    if (ov.hEvent != NULL) CloseHandle(ov.hEvent);
+    if (error != 0 && error != ERROR_PIPE_CONNECTED) {
+      CloseHandle(pipe);
+      return Status::io_error("ConnectNamedPipe failed with error: " + std::to_string(error));
     }
 
-    auto pipe_ptr = std::make_unique<NamedPipePipe>(pipe, true);
+    auto pipe_ptr = std::make_unique<NamedPipePipe>(pipe, true, fragments_);
   return std::unique_ptr<Pipe>(std::move(pipe_ptr));
   }
 
@@ -242,6 +437,7 @@ class NamedPipeListener final : public Listener {
  private:
   std::string pipe_path_;
   int backlog_;
+  FragmentOptions fragments_;
 };
 
 }  // namespace
@@ -249,7 +445,7 @@ class NamedPipeListener final : public Listener {
 // Named pipe transport functions
 Result<std::unique_ptr<Listener>> pipe_listen(const std::string& name, const ListenOptions& opt) {
   std::string pipe_path = make_pipe_path(name);
-  auto listener = std::make_unique<NamedPipeListener>(pipe_path, opt.backlog);
+  auto listener = std::make_unique<NamedPipeListener>(pipe_path, opt.backlog, opt.fragments);
   return std::unique_ptr<Listener>(std::move(listener));
 }
 
@@ -280,7 +476,7 @@ Result<std::unique_ptr<Pipe>> pipe_dial(const std::string& name, const DialOptio
     0,
     NULL,
     OPEN_EXISTING,
-    FILE_ATTRIBUTE_NORMAL,
+    FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED,
     NULL
   );
 
@@ -298,7 +494,7 @@ Result<std::unique_ptr<Pipe>> pipe_dial(const std::string& name, const DialOptio
     return Status::io_error("SetNamedPipeHandleState failed with error: " + std::to_string(error));
   }
 
-  auto pipe_ptr = std::make_unique<NamedPipePipe>(pipe, false);
+  auto pipe_ptr = std::make_unique<NamedPipePipe>(pipe, false, opt.fragments);
   return std::unique_ptr<Pipe>(std::move(pipe_ptr));
 }
 
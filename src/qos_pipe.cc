@@ -1,170 +1,661 @@
 #include "duct/qos_pipe.h"
 
 #include <algorithm>
+#include <optional>
+#include <random>
+
+#include "instrument.h"
+#include "scheduler.h"
+
+#if defined(_WIN32)
+#include <winsock2.h>
+#else
+#include <poll.h>
+#endif
 
 namespace duct {
+namespace {
+
+// Messages read per batch by the receive thread, and how long it waits for data before checking
+// whether the pipe is closing.
+constexpr std::size_t kRecvBatch = 64;
+constexpr std::chrono::milliseconds kRecvPollInterval{50};
+// How long close() lets a write already under way finish before it closes the socket beneath it.
+constexpr std::chrono::milliseconds kCloseWriteWait{1'000};
 
-QosPipe::QosPipe(std::unique_ptr<Pipe> underlying, const QosOptions& qos)
-    : underlying_(std::move(underlying)), qos_(qos) {
+// Turns one drain job writes before handing its worker to other pipes.
+constexpr int kTurnsPerJob = 16;
+
+// Wait until `h` is readable or the interval passes; errors surface from the next read.
+void wait_readable(PollHandle h, std::chrono::milliseconds timeout) {
+#if defined(_WIN32)
+  WSAPOLLFD p{};
+  p.fd = static_cast<SOCKET>(h);
+  p.events = POLLRDNORM;
+  (void)WSAPoll(&p, 1, static_cast<INT>(timeout.count()));
+#else
+  pollfd p{};
+  p.fd = static_cast<int>(h);
+  p.events = POLLIN;
+  (void)::poll(&p, 1, static_cast<int>(timeout.count()));
+#endif
+}
+
+}  // namespace
+
+QosPipe::QosPipe(std::unique_ptr<Pipe> underlying, const QosOptions& qos,
+                 std::shared_ptr<detail::PipeInstruments> metrics)
+    : underlying_(std::move(underlying)), qos_(qos), metrics_(std::move(metrics)), pipe_rate_(qos.rate) {
+  for (const ChannelRateLimit& c : qos_.channel_rates) {
+    if (c.limit.enabled()) channel_rates_.try_emplace(c.channel, c.limit);
+  }
+  rate_limited_ = !pipe_rate_.unlimited() || !channel_rates_.empty();
+  if (metrics_ && metrics_->trace_every != 0) trace_salt_ = std::uint64_t{std::random_device{}()} << 32;
   running_ = true;
-  send_thread_ = std::thread(&QosPipe::send_worker, this);
 }
 
 QosPipe::~QosPipe() {
   close();
-  if (send_thread_.joinable()) {
-    send_thread_.join();
+  {
+    // Jobs already queued or running still use the pipe; they exit at their next check.
+    std::unique_lock<std::mutex> lock(send_mutex_);
+    if (ttl_scheduled_ && detail::Scheduler::instance().cancel(ttl_timer_)) ttl_scheduled_ = false;
+    idle_cv_.wait(lock, [this] { return !drain_scheduled_ && !ttl_scheduled_; });
+    // What is still queued is never written.
+    channels_.clear();
+    active_.clear();
+    send_bytes_ = 0;
+    report_queue();
+  }
+  if (recv_thread_.joinable()) {
+    recv_thread_.join();
   }
 }
 
-bool QosPipe::can_send_message(const QueuedMessage& queued_msg) const {
-  // Check TTL
-  if (qos_.ttl.count() > 0) {
-    auto now = std::chrono::steady_clock::now();
-    auto age = now - queued_msg.timestamp;
-    if (age > qos_.ttl) {
-      return false;  // Message expired
+void QosPipe::release_bytes(std::size_t n) {
+  if (n == 0) return;
+  bool wake = false;
+  {
+    std::lock_guard<std::mutex> lock(send_mutex_);
+    wake = send_bytes_ >= qos_.snd_hwm_bytes && send_bytes_ - n < qos_.snd_hwm_bytes;
+    send_bytes_ -= n;
+    report_queue();
+  }
+  if (wake) space_cv_.notify_all();
+}
+
+void QosPipe::report_queue() {
+  if (!metrics_) return;
+  std::size_t msgs = 0;
+  for (std::uint16_t id : active_) msgs += channels_.at(id).queue.size();
+  metrics_->queued(static_cast<double>(msgs) - static_cast<double>(reported_msgs_),
+                   static_cast<double>(send_bytes_) - static_cast<double>(reported_bytes_));
+  reported_msgs_ = msgs;
+  reported_bytes_ = send_bytes_;
+}
+
+bool QosPipe::retry_write(const Status& st) const {
+  return st.code() == StatusCode::kTimeout && running_.load();
+}
+
+Result<void> QosPipe::write_all(std::span<const Message> msgs, SendOptions opt) {
+  while (!msgs.empty()) {
+    auto n = underlying_->send_batch(msgs, opt);
+    if (!n.ok()) {
+      if (retry_write(n.status())) continue;
+      return n.status();
     }
+    if (n.value() != 0) opt.continued = false;
+    std::size_t bytes = 0;
+    for (std::size_t i = 0; i < n.value(); ++i) bytes += msgs[i].size();
+    release_bytes(bytes);
+    msgs = msgs.subspan(n.value());
   }
+  return {};
+}
 
-  // Check queue limits
-  if (send_bytes_.load() >= qos_.snd_hwm_bytes) {
-    return false;
+Result<void> QosPipe::write_turn(const SendOptions& opt) {
+  std::size_t begin = 0;
+  for (std::size_t i = 0; i <= draining_.size(); ++i) {
+    const bool traced = i < draining_.size() && draining_[i].traced_since != std::chrono::steady_clock::time_point{};
+    if (i < draining_.size() && !traced) continue;
+    if (i > begin) {
+      // The fragment bits belong to the ends of the turn.
+      SendOptions run = opt;
+      run.continued = opt.continued && begin == 0;
+      run.more = opt.more && i == draining_.size();
+      batch_.clear();
+      for (std::size_t k = begin; k < i; ++k) batch_.push_back(std::move(draining_[k].message));
+      auto st = write_all(batch_, run);
+      batch_.clear();
+      if (!st.ok()) return st;
+    }
+    if (traced) {
+      const Pending& p = draining_[i];
+      const auto now = std::chrono::steady_clock::now();
+      wire::TraceHeader h;
+      h.id = trace_salt_ | ++traces_sent_;
+      h.sent_at_ns = static_cast<std::uint64_t>(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch())
+              .count());
+      h.admit_us = static_cast<std::uint32_t>(
+          std::chrono::duration_cast<std::chrono::microseconds>(p.enqueued - p.traced_since).count());
+      h.queue_us = static_cast<std::uint32_t>(std::chrono::duration_cast<std::chrono::microseconds>(now - p.enqueued).count());
+      SendOptions one;
+      one.channel = opt.channel;
+      one.traced = true;
+      const Message m = wire::add_trace(p.message, h);
+      Result<void> st;
+      do {
+        st = underlying_->send(m, one);
+      } while (!st.ok() && retry_write(st.status()));
+      if (!st.ok()) return st;
+      release_bytes(p.message.size());
+    }
+    begin = i + 1;
   }
+  return {};
+}
 
-  return true;
+QosPipe::Channel& QosPipe::channel(std::uint16_t id) {
+  auto [it, inserted] = channels_.try_emplace(id);
+  if (inserted) {
+    std::uint32_t weight = 1;
+    for (const ChannelWeight& w : qos_.channel_weights) {
+      if (w.channel == id) weight = std::max<std::uint32_t>(w.weight, 1);
+    }
+    it->second.quantum = std::max<std::size_t>(qos_.channel_quantum_bytes, 1) * weight;
+  }
+  return it->second;
 }
 
-void QosPipe::send_worker() {
-  while (running_) {
-    std::unique_lock<std::mutex> lock(send_mutex_);
+SendOptions QosPipe::take_turn() {
+  const std::uint16_t id = active_.front();
+  active_.pop_front();
+  Channel& ch = channels_.at(id);
+  SendOptions opt;
+  opt.channel = id;
+  // A message bigger than the credit waits for later turns to add up while the other channels get
+  // theirs; a channel alone on the link has nobody to wait for.
+  ch.deficit += ch.quantum;
+  if (active_.empty()) ch.deficit = std::max(ch.deficit, ch.queue.front().message.size() - ch.sent);
+  while (!ch.queue.empty()) {
+    Pending& front = ch.queue.front();
+    const std::size_t left = front.message.size() - ch.sent;
+    if (left > ch.deficit) {
+      // One larger than a whole quantum would hold the link for several turns: when it starts the
+      // turn, write as much as the credit covers now and the rest in later turns, as fragments.
+      // A sampled one goes out whole behind its TraceHeader, so it waits for the credit instead.
+      const bool traced = front.traced_since != std::chrono::steady_clock::time_point{};
+      if (!draining_.empty() || front.message.size() <= ch.quantum || traced) break;
+      draining_.push_back({front.message.slice(ch.sent, ch.deficit), front.enqueued});
+      opt.continued = ch.sent != 0;
+      opt.more = true;
+      ch.sent += ch.deficit;
+      ch.deficit = 0;
+      break;
+    }
+    ch.deficit -= left;
+    if (ch.sent != 0) {
+      draining_.push_back({front.message.slice(ch.sent, left), front.enqueued});
+      opt.continued = true;
+      ch.sent = 0;
+    } else {
+      draining_.push_back(std::move(front));
+    }
+    ch.queue.pop_front();
+  }
+  if (ch.queue.empty()) {
+    ch.deficit = 0;
+  } else {
+    active_.push_back(id);
+  }
+  report_queue();
+  return opt;
+}
 
-    // Wait for messages or shutdown
-    send_cv_.wait(lock, [this] { return !send_queue_.empty() || !running_; });
-
-    if (!running_) break;
-
-    // Process expired messages (TTL)
-    if (qos_.ttl.count() > 0) {
-      auto now = std::chrono::steady_clock::now();
-
-      send_queue_.erase(
-        std::remove_if(send_queue_.begin(), send_queue_.end(),
-          [&](const QueuedMessage& queued_msg) {
-            auto age = now - queued_msg.timestamp;
-            if (age > qos_.ttl) {
-              send_bytes_ -= queued_msg.message.size();
-              send_count_ -= 1;
-              return true;  // Remove expired message
-            }
-            return false;
-          }),
-        send_queue_.end());
-    }
-
-    // Try to send the front message
-    if (!send_queue_.empty()) {
-      auto& queued_msg = send_queue_.front();
-
-      // Check if we can send (respecting HWM limits)
-      if (can_send_message(queued_msg)) {
-        SendOptions opt;
-        auto result = underlying_->send(queued_msg.message, opt);
-
-        if (result.ok()) {
-          // Message sent successfully
-          send_bytes_ -= queued_msg.message.size();
-          send_count_ -= 1;
-          send_queue_.pop_front();
-        } else {
-          // Send failed - if it's a temporary issue, keep the message
-          // If it's a permanent failure, we should close the pipe
-          if (result.status().code() == StatusCode::kClosed ||
-              result.status().code() == StatusCode::kIoError) {
-            running_ = false;
-            break;
-          }
-        }
-      } else {
-        // Hit HWM limits - check backpressure policy
-        if (qos_.backpressure == BackpressurePolicy::kFailFast) {
-          // Don't block, just let the next send() fail
-          lock.unlock();
-          std::this_thread::sleep_for(std::chrono::milliseconds(1));
-        } else {
-          // For kBlock, kDropNew, kDropOld, we handle them in send()
-          lock.unlock();
-          std::this_thread::sleep_for(std::chrono::milliseconds(1));
-        }
+void QosPipe::coalesce(std::unique_lock<std::mutex>& lock) {
+  if (qos_.flush.max_delay.count() <= 0 || flush_now_ || closing_ || send_bytes_ >= qos_.flush.min_bytes) return;
+  // The budget runs from when the oldest message was queued; a partly written one is not waiting.
+  auto oldest = std::chrono::steady_clock::time_point::max();
+  for (std::uint16_t id : active_) {
+    const Channel& ch = channels_.at(id);
+    if (ch.sent != 0) return;
+    oldest = std::min(oldest, ch.queue.front().enqueued);
+  }
+  flush_cv_.wait_until(lock, oldest + qos_.flush.max_delay, [this] {
+    return !running_ || closing_ || flush_now_ || send_bytes_ >= qos_.flush.min_bytes;
+  });
+  // Whatever woke us, what is queued now goes out in full rather than a turn at a time.
+  flush_now_ = true;
+}
+
+void QosPipe::drain() {
+  for (int turn = 0; turn < kTurnsPerJob; ++turn) {
+    SendOptions opt;
+    {
+      std::unique_lock<std::mutex> lock(send_mutex_);
+      if (!active_.empty() && running_) coalesce(lock);
+      if (active_.empty() || !running_) {
+        flush_now_ = false;
+        drain_scheduled_ = false;
+        idle_cv_.notify_all();
+        return;
+      }
+      opt = take_turn();
+    }
+
+    // One TTL for every message and FIFO order within a channel: the expired ones are a prefix. A
+    // turn carrying part of a fragmented message goes out as is, since dropping a piece would
+    // leave the peer with a message it cannot complete.
+    std::size_t expired_bytes = 0;
+    if (qos_.ttl.count() > 0 && !opt.more && !opt.continued) {
+      auto cutoff = std::chrono::steady_clock::now() - qos_.ttl;
+      while (!draining_.empty() && draining_.front().enqueued < cutoff) {
+        expired_bytes += draining_.front().message.size();
+        draining_.pop_front();
+        if (metrics_) metrics_->ttl_drops->increment();
+      }
+    }
+    release_bytes(expired_bytes);
+
+    Result<void> st;
+    {
+      std::optional<detail::IoScope> scope;
+      if (metrics_) scope.emplace(*metrics_);
+      st = write_turn(opt);
+    }
+    if (metrics_ && st.ok()) {
+      // A message is sent once its last piece is; a turn ending inside one has not finished it.
+      const auto now = std::chrono::steady_clock::now();
+      const std::size_t done = draining_.size() - (opt.more ? 1 : 0);
+      for (std::size_t i = 0; i < done; ++i) {
+        metrics_->send_latency_us->observe(
+            std::chrono::duration<double, std::micro>(now - draining_[i].enqueued).count());
       }
     }
+    draining_.clear();
+    if (!st.ok()) {
+      // The connection is gone: fail queued and future sends with the reason.
+      std::lock_guard<std::mutex> lock(send_mutex_);
+      failure_ = st.status();
+      running_ = false;
+      channels_.clear();
+      active_.clear();
+      send_bytes_ = 0;
+      report_queue();
+      space_cv_.notify_all();
+      drain_scheduled_ = false;
+      idle_cv_.notify_all();
+      return;
+    }
   }
+  // Still busy: queue behind the other pipes' jobs rather than holding the worker.
+  detail::Scheduler::instance().submit([this] { drain(); });
 }
 
-Result<void> QosPipe::send(const Message& msg, const SendOptions& opt) {
-  if (!running_) {
-    return Status::closed("pipe closed");
+void QosPipe::expire_queued() {
+  std::lock_guard<std::mutex> lock(send_mutex_);
+  ttl_timer_ = 0;
+  const auto now = std::chrono::steady_clock::now();
+  const auto cutoff = now - qos_.ttl;
+  const bool was_full = send_bytes_ >= qos_.snd_hwm_bytes;
+  auto next = std::chrono::steady_clock::time_point::max();
+  for (auto it = active_.begin(); running_ && it != active_.end();) {
+    Channel& ch = channels_.at(*it);
+    // A message partly written already has to go out whole.
+    while (!ch.queue.empty() && ch.sent == 0 && ch.queue.front().enqueued < cutoff) {
+      send_bytes_ -= ch.queue.front().message.size();
+      ch.queue.pop_front();
+      if (metrics_) metrics_->ttl_drops->increment();
+    }
+    if (ch.queue.empty()) {
+      ch.deficit = 0;
+      it = active_.erase(it);
+      continue;
+    }
+    next = std::min(next, ch.queue.front().enqueued);
+    ++it;
+  }
+  report_queue();
+  if (was_full && send_bytes_ < qos_.snd_hwm_bytes) space_cv_.notify_all();
+  if (running_ && next != std::chrono::steady_clock::time_point::max()) {
+    auto wait = std::chrono::ceil<std::chrono::milliseconds>(next + qos_.ttl - now);
+    ttl_timer_ = detail::Scheduler::instance().after(wait, [this] { expire_queued(); });
+    return;
   }
+  ttl_scheduled_ = false;
+  idle_cv_.notify_all();
+}
 
+std::chrono::steady_clock::time_point QosPipe::sample() {
+  if (!metrics_ || metrics_->trace_every == 0 ||
+      trace_seq_.fetch_add(1, std::memory_order_relaxed) % metrics_->trace_every != 0) {
+    return {};
+  }
+  return std::chrono::steady_clock::now();
+}
+
+Result<bool> QosPipe::take_tokens(const Message& msg, const SendOptions& opt) {
+  auto channel = channel_rates_.find(opt.channel);
+  RateLimiter* channel_rate = channel != channel_rates_.end() ? &channel->second : nullptr;
+  const auto start = std::chrono::steady_clock::now();
+  for (bool first = true;; first = false) {
+    const auto now = std::chrono::steady_clock::now();
+    auto wait = pipe_rate_.try_acquire(msg.size(), now);
+    if (wait.count() == 0 && channel_rate) {
+      wait = channel_rate->try_acquire(msg.size(), now);
+      if (wait.count() != 0) pipe_rate_.refund(msg.size());
+    }
+    if (wait.count() == 0) return true;
+    if (first && metrics_) metrics_->rate_limited->increment();
+
+    switch (qos_.backpressure) {
+      case BackpressurePolicy::kFailFast:
+        return Status::io_error("send rate limit exceeded (fail fast)");
+      case BackpressurePolicy::kDropNew:
+      case BackpressurePolicy::kDropOld:
+        return false;
+      case BackpressurePolicy::kBlock:
+        break;
+    }
+    if (opt.timeout.count() > 0 && now + wait > start + opt.timeout) {
+      return Status::timeout("send rate limit (timeout)");
+    }
+    // Sleep on the producers' condition so close() cuts the wait short.
+    std::unique_lock<std::mutex> lock(send_mutex_);
+    if (space_cv_.wait_for(lock, wait, [this] { return !running_.load(); })) {
+      if (!failure_.ok()) return failure_;
+      return Status::closed("pipe closed");
+    }
+  }
+}
+
+void QosPipe::return_tokens(const Message& msg, std::uint16_t channel) {
+  pipe_rate_.refund(msg.size());
+  auto it = channel_rates_.find(channel);
+  if (it != channel_rates_.end()) it->second.refund(msg.size());
+}
+
+Result<void> QosPipe::send(const Message& msg, const SendOptions& opt) {
   // Check message size against limits
   if (msg.size() > qos_.snd_hwm_bytes) {
     return Status::invalid_argument("message too large for queue limits");
   }
 
+  const auto traced_since = sample();
+  if (rate_limited_) {
+    auto admitted = take_tokens(msg, opt);
+    if (!admitted.ok()) return admitted.status();
+    if (!admitted.value()) return Status::Ok();
+  }
+  std::unique_lock<std::mutex> lock(send_mutex_);
+  auto queued = enqueue(lock, msg, opt, traced_since);
+  lock.unlock();
+  if (rate_limited_ && !(queued.ok() && queued.value())) return_tokens(msg, opt.channel);
+  if (!queued.ok()) return queued.status();
+  return Status::Ok();
+}
+
+Result<std::size_t> QosPipe::send_batch(std::span<const Message> msgs, const SendOptions& opt) {
+  if (rate_limited_) return Pipe::send_batch(msgs, opt);
+  std::size_t n = 0;
   std::unique_lock<std::mutex> lock(send_mutex_);
+  for (const Message& m : msgs) {
+    if (m.size() > qos_.snd_hwm_bytes) {
+      if (n == 0) return Status::invalid_argument("message too large for queue limits");
+      break;
+    }
+    auto queued = enqueue(lock, m, opt, sample());
+    if (!queued.ok()) {
+      if (n == 0) return queued.status();
+      break;
+    }
+    ++n;  // dropped by the backpressure policy counts as sent, as with send()
+  }
+  return n;
+}
+
+Result<bool> QosPipe::enqueue(std::unique_lock<std::mutex>& lock, const Message& msg, const SendOptions& opt,
+                              std::chrono::steady_clock::time_point traced_since) {
+  if (!running_ || closing_) {
+    if (!failure_.ok()) return failure_;
+    return Status::closed("pipe closed");
+  }
 
   // Handle backpressure policies
-  if (send_bytes_.load() >= qos_.snd_hwm_bytes) {
+  if (send_bytes_ >= qos_.snd_hwm_bytes) {
     switch (qos_.backpressure) {
       case BackpressurePolicy::kFailFast:
+        if (metrics_) metrics_->hwm_fail_fast->increment();
         return Status::io_error("send queue at high water mark (fail fast)");
 
       case BackpressurePolicy::kDropNew:
         // Drop the new message
-        return Status::Ok();
+        if (metrics_) metrics_->hwm_drop_new->increment();
+        return false;
 
       case BackpressurePolicy::kDropOld:
-        // Drop the oldest message if queue is not empty
-        if (!send_queue_.empty()) {
-          send_bytes_ -= send_queue_.front().message.size();
-          send_count_ -= 1;
-          send_queue_.pop_front();
+        // Drop queued messages, oldest first across channels, until there is room (what the
+        // worker is already writing cannot be dropped).
+        while (send_bytes_ >= qos_.snd_hwm_bytes && !active_.empty()) {
+          auto oldest = std::min_element(active_.begin(), active_.end(), [this](std::uint16_t a, std::uint16_t b) {
+            return channels_.at(a).queue.front().enqueued < channels_.at(b).queue.front().enqueued;
+          });
+          Channel& ch = channels_.at(*oldest);
+          // Of a message partly written already, the rest goes; the peer discards what it has.
+          send_bytes_ -= ch.queue.front().message.size() - ch.sent;
+          ch.sent = 0;
+          ch.queue.pop_front();
+          if (ch.queue.empty()) {
+            ch.deficit = 0;
+            active_.erase(oldest);
+          }
+          if (metrics_) metrics_->hwm_drop_old->increment();
         }
         break;
 
-      case BackpressurePolicy::kBlock:
-        // Wait for space in queue
-        send_cv_.wait_for(lock, opt.timeout, [this] {
-          return send_bytes_.load() < qos_.snd_hwm_bytes || !running_;
-        });
-        if (send_bytes_.load() >= qos_.snd_hwm_bytes) {
-          return Status::timeout("send queue full (timeout)");
+      case BackpressurePolicy::kBlock: {
+        // Wait for the worker to drain below the HWM; a zero timeout waits as long as it takes.
+        if (metrics_) metrics_->hwm_block->increment();
+        auto room = [this] { return send_bytes_ < qos_.snd_hwm_bytes || !running_; };
+        if (opt.timeout.count() > 0) {
+          if (!space_cv_.wait_for(lock, opt.timeout, room)) return Status::timeout("send queue full (timeout)");
+        } else {
+          space_cv_.wait(lock, room);
+        }
+        if (!running_) {
+          if (!failure_.ok()) return failure_;
+          return Status::closed("pipe closed");
         }
         break;
+      }
     }
   }
 
-  // Add message to send queue
-  send_queue_.emplace_back(msg);
+  // Add message to its channel's queue
+  Channel& ch = channel(opt.channel);
+  if (ch.queue.empty()) active_.push_back(opt.channel);
+  ch.queue.push_back(Pending{msg, std::chrono::steady_clock::now(), traced_since});
   send_bytes_ += msg.size();
-  send_count_ += 1;
+  report_queue();
+  if (send_bytes_ >= qos_.flush.min_bytes && qos_.flush.max_delay.count() > 0) flush_cv_.notify_one();
+  if (qos_.ttl.count() > 0 && !ttl_scheduled_) {
+    ttl_scheduled_ = true;
+    ttl_timer_ = detail::Scheduler::instance().after(qos_.ttl, [this] { expire_queued(); });
+  }
+  // A drain job runs until nothing is queued, so one is started only after the last has finished.
+  if (!drain_scheduled_) {
+    drain_scheduled_ = true;
+    detail::Scheduler::instance().submit([this] { drain(); });
+  }
+  return true;
+}
 
-  lock.unlock();
-  send_cv_.notify_one();
+bool QosPipe::use_recv_queue() {
+  if (qos_.rcv_hwm_bytes == 0) return false;
+  if (rcv_started_.load(std::memory_order_acquire)) return true;
+  std::lock_guard<std::mutex> lock(rcv_mutex_);
+  if (!rcv_started_.load(std::memory_order_relaxed) && running_) {
+    recv_thread_ = std::thread(&QosPipe::recv_worker, this);
+    rcv_started_.store(true, std::memory_order_release);
+  }
+  return rcv_started_.load(std::memory_order_relaxed);
+}
 
-  return Status::Ok();
+void QosPipe::recv_worker() {
+  std::vector<Message> batch(kRecvBatch);
+  const PollHandle h = underlying_->poll_handle();
+  while (running_) {
+    {
+      std::unique_lock<std::mutex> lock(rcv_mutex_);
+      rcv_space_cv_.wait(lock, [this] { return rcv_bytes_ < qos_.rcv_hwm_bytes || !running_; });
+      if (!running_) break;
+    }
+
+    // With a poll handle: non-blocking reads, waiting for readability in between (a shm handle is
+    // only armed by a read that comes up short). Otherwise a bounded blocking read.
+    std::optional<detail::IoScope> scope;
+    if (metrics_) scope.emplace(*metrics_);
+    Result<std::size_t> n = h != kInvalidPollHandle ? underlying_->try_recv_batch(batch)
+                                                    : underlying_->recv_batch(batch, RecvOptions{kRecvPollInterval});
+    if (!n.ok()) {
+      if (h == kInvalidPollHandle && n.status().code() == StatusCode::kTimeout) continue;
+      {
+        std::lock_guard<std::mutex> lock(rcv_mutex_);
+        rcv_failure_ = n.status();
+      }
+      rcv_cv_.notify_all();
+      break;
+    }
+    if (n.value() == 0) {
+      if (h != kInvalidPollHandle) wait_readable(h, kRecvPollInterval);
+      continue;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    {
+      std::lock_guard<std::mutex> lock(rcv_mutex_);
+      for (std::size_t i = 0; i < n.value(); ++i) {
+        rcv_bytes_ += batch[i].size();
+        rcv_queue_.push_back(Pending{std::move(batch[i]), now});
+        batch[i] = Message();
+      }
+    }
+    rcv_cv_.notify_all();
+  }
+}
+
+std::size_t QosPipe::pop_received(std::span<Message> out) {
+  const bool was_full = rcv_bytes_ >= qos_.rcv_hwm_bytes;
+  auto cutoff = std::chrono::steady_clock::time_point::min();
+  if (qos_.ttl.count() > 0) cutoff = std::chrono::steady_clock::now() - qos_.ttl;
+  std::size_t n = 0;
+  while (n < out.size() && !rcv_queue_.empty()) {
+    Pending& p = rcv_queue_.front();
+    rcv_bytes_ -= p.message.size();
+    if (p.enqueued >= cutoff) {
+      out[n] = std::move(p.message);
+      if (metrics_ && out[n].traced()) {
+        const auto held = std::chrono::steady_clock::now() - p.enqueued;
+        const auto arrived = std::chrono::system_clock::now() -
+                             std::chrono::duration_cast<std::chrono::system_clock::duration>(held);
+        metrics_->record_trace(out[n], arrived, held);
+      }
+      ++n;
+    } else if (metrics_) {
+      metrics_->ttl_drops->increment();
+    }
+    rcv_queue_.pop_front();
+  }
+  if (was_full && rcv_bytes_ < qos_.rcv_hwm_bytes) rcv_space_cv_.notify_one();
+  return n;
 }
 
 Result<Message> QosPipe::recv(const RecvOptions& opt) {
-  return underlying_->recv(opt);
+  Message m;
+  auto n = recv_batch(std::span<Message>(&m, 1), opt);
+  if (!n.ok()) return n.status();
+  return m;
+}
+
+Result<std::size_t> QosPipe::recv_batch(std::span<Message> out, const RecvOptions& opt) {
+  if (!use_recv_queue()) return underlying_->recv_batch(out, opt);
+  if (out.empty()) return std::size_t{0};
+  auto deadline = std::chrono::steady_clock::now() + opt.timeout;
+  std::unique_lock<std::mutex> lock(rcv_mutex_);
+  for (;;) {
+    std::size_t n = pop_received(out);
+    if (n != 0) return n;
+    // Everything read before a failure is delivered first.
+    if (!rcv_failure_.ok()) return rcv_failure_;
+    if (!running_) return Status::closed("pipe closed");
+    auto ready = [this] { return !rcv_queue_.empty() || !rcv_failure_.ok() || !running_; };
+    if (opt.timeout.count() > 0) {
+      if (!rcv_cv_.wait_until(lock, deadline, ready)) return Status::timeout("recv timeout");
+    } else {
+      rcv_cv_.wait(lock, ready);
+    }
+  }
+}
+
+PollHandle QosPipe::poll_handle() const {
+  return underlying_->poll_handle();
+}
+
+Result<std::size_t> QosPipe::try_recv_batch(std::span<Message> out) {
+  if (!rcv_started_.load(std::memory_order_acquire)) return underlying_->try_recv_batch(out);
+  std::lock_guard<std::mutex> lock(rcv_mutex_);
+  std::size_t n = pop_received(out);
+  if (n == 0 && !rcv_failure_.ok()) return rcv_failure_;
+  return n;
+}
+
+detail::StreamEndpoint* QosPipe::stream_endpoint() {
+  // The receive thread owns the underlying reads once started.
+  if (rcv_started_.load(std::memory_order_acquire)) return nullptr;
+  return underlying_->stream_endpoint();
+}
+
+Result<std::span<std::uint8_t>> QosPipe::reserve(std::size_t size, const SendOptions&) {
+  return staged_.reserve(size);
+}
+
+Result<void> QosPipe::commit(std::size_t len, const SendOptions& opt) { return staged_.commit(*this, len, opt); }
+
+Result<void> QosPipe::flush() {
+  std::lock_guard<std::mutex> lock(send_mutex_);
+  if (!active_.empty()) {
+    flush_now_ = true;
+    flush_cv_.notify_one();
+  }
+  return {};
 }
 
 void QosPipe::close() {
   {
-    std::lock_guard<std::mutex> lock(send_mutex_);
+    std::unique_lock<std::mutex> lock(send_mutex_);
+    if (qos_.linger.count() > 0 && running_ && !closing_) {
+      // Writes stop at a failure, and the drain job only finishes once nothing is queued.
+      closing_ = true;
+      flush_cv_.notify_all();
+      idle_cv_.wait_for(lock, qos_.linger, [this] { return !drain_scheduled_ || !running_; });
+    }
     running_ = false;
+    flush_cv_.notify_all();
+    // The drain job stops at its next turn; only a write that is stuck outlasts the wait.
+    idle_cv_.wait_for(lock, kCloseWriteWait, [this] { return !drain_scheduled_; });
+  }
+  space_cv_.notify_all();
+  flush_cv_.notify_all();
+  {
+    // Lock so a consumer between its checks and its wait cannot miss the notification.
+    std::lock_guard<std::mutex> lock(rcv_mutex_);
   }
-  send_cv_.notify_all();
+  rcv_cv_.notify_all();
+  rcv_space_cv_.notify_all();
+  // The receive thread reads the underlying pipe; let it notice first (within kRecvPollInterval).
+  if (recv_thread_.joinable() && recv_thread_.get_id() != std::this_thread::get_id()) recv_thread_.join();
   underlying_->close();
 }
 
@@ -2,7 +2,32 @@
 
 #include <algorithm>
 
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#endif
+
 namespace duct {
+namespace {
+
+constexpr int kSpinIterations = 256;
+
+inline void cpu_relax() {
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+  _mm_pause();
+#elif defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  __asm__ __volatile__("yield");
+#endif
+}
+
+std::size_t round_up_pow2(std::size_t n) {
+  std::size_t p = 2;
+  while (p < n) p <<= 1;
+  return p;
+}
+
+}  // namespace
 
 MessageQueue::MessageQueue(std::size_t hwm_bytes, BackpressurePolicy policy, std::chrono::milliseconds ttl)
     : hwm_bytes_(hwm_bytes),
@@ -193,15 +218,12 @@ std::size_t MessageQueue::purge_expired() {
   auto now = std::chrono::steady_clock::now();
   std::size_t purged = 0;
 
-  auto it = queue_.begin();
-  while (it != queue_.end()) {
-    if (it->deadline != std::chrono::steady_clock::time_point{} && now > it->deadline) {
-      total_bytes_ -= it->msg.size();
-      it = queue_.erase(it);
-      ++purged;
-    } else {
-      ++it;
-    }
+  // Deadlines are stamped under the lock from one TTL, so they run in queue order: the expired
+  // messages are a prefix and the scan stops at the first live one.
+  while (!queue_.empty() && now > queue_.front().deadline) {
+    total_bytes_ -= queue_.front().msg.size();
+    queue_.pop_front();
+    ++purged;
   }
 
   if (purged > 0) {
@@ -222,4 +244,224 @@ bool MessageQueue::has_space_unlocked() const {
   return total_bytes_ < hwm_bytes_;
 }
 
+// Vyukov's bounded queue: slot i is free for the push of ticket t when seq == t, and holds that
+// message once seq == t + 1; the pop of ticket t hands it back at seq == t + capacity.
+struct RingMessageQueue::Cell {
+  std::atomic<std::size_t> seq{0};
+  // item.deadline, readable before the slot is claimed (purge_expired); 0 = no TTL.
+  std::atomic<std::int64_t> deadline{0};
+  QueuedMessage item;
+};
+
+RingMessageQueue::RingMessageQueue(std::size_t capacity, std::size_t hwm_bytes, BackpressurePolicy policy,
+                                   std::chrono::milliseconds ttl, QueueProducers producers)
+    : mask_(round_up_pow2(capacity) - 1),
+      multi_producer_(producers == QueueProducers::kMulti),
+      multi_consumer_(policy == BackpressurePolicy::kDropOld),
+      hwm_bytes_(hwm_bytes),
+      policy_(policy),
+      ttl_(ttl) {
+  cells_ = std::make_unique<Cell[]>(mask_ + 1);
+  for (std::size_t i = 0; i <= mask_; ++i) cells_[i].seq.store(i, std::memory_order_relaxed);
+}
+
+RingMessageQueue::~RingMessageQueue() = default;
+
+bool RingMessageQueue::can_admit(std::size_t n) const {
+  std::size_t bytes = total_bytes_.load(std::memory_order_relaxed);
+  bool bytes_ok = hwm_bytes_ == 0 || bytes == 0 || bytes + n <= hwm_bytes_;
+  return bytes_ok && size_msgs() <= mask_;
+}
+
+bool RingMessageQueue::try_reserve_bytes(std::size_t n) {
+  std::size_t bytes = total_bytes_.load(std::memory_order_relaxed);
+  for (;;) {
+    if (hwm_bytes_ != 0 && bytes != 0 && bytes + n > hwm_bytes_) return false;
+    if (total_bytes_.compare_exchange_weak(bytes, bytes + n, std::memory_order_relaxed)) return true;
+  }
+}
+
+bool RingMessageQueue::try_enqueue(QueuedMessage& qm) {
+  std::size_t pos = tail_.load(std::memory_order_relaxed);
+  for (;;) {
+    Cell& c = cells_[pos & mask_];
+    std::size_t seq = c.seq.load(std::memory_order_acquire);
+    auto dif = static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos);
+    if (dif < 0) return false;  // full: the consumer has not freed this slot yet
+    if (dif > 0) {
+      pos = tail_.load(std::memory_order_relaxed);  // another producer took it
+      continue;
+    }
+    if (!multi_producer_) {
+      tail_.store(pos + 1, std::memory_order_relaxed);
+    } else if (!tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+      continue;
+    }
+    c.deadline.store(qm.deadline.time_since_epoch().count(), std::memory_order_relaxed);
+    c.item = std::move(qm);
+    c.seq.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+}
+
+bool RingMessageQueue::try_dequeue(QueuedMessage* out, const std::chrono::steady_clock::time_point* expired_by) {
+  std::size_t pos = head_.load(std::memory_order_relaxed);
+  for (;;) {
+    Cell& c = cells_[pos & mask_];
+    std::size_t seq = c.seq.load(std::memory_order_acquire);
+    auto dif = static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos + 1);
+    if (dif < 0) return false;  // empty (or the push of this ticket is still being written)
+    if (dif > 0) {
+      pos = head_.load(std::memory_order_relaxed);
+      continue;
+    }
+    if (expired_by) {
+      // If the slot was recycled meanwhile, claiming `pos` below fails and we look again.
+      std::int64_t d = c.deadline.load(std::memory_order_relaxed);
+      if (d == 0 || expired_by->time_since_epoch().count() <= d) return false;
+    }
+    if (!multi_consumer_) {
+      head_.store(pos + 1, std::memory_order_relaxed);
+    } else if (!head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+      continue;
+    }
+    *out = std::move(c.item);
+    c.item.msg = Message();  // do not keep the payload alive in the slot
+    c.seq.store(pos + mask_ + 1, std::memory_order_release);
+    total_bytes_.fetch_sub(out->msg.size(), std::memory_order_relaxed);
+    notify(not_full_);
+    return true;
+  }
+}
+
+bool RingMessageQueue::expired(const QueuedMessage& qm, std::chrono::steady_clock::time_point now) const {
+  return qm.deadline != std::chrono::steady_clock::time_point{} && now > qm.deadline;
+}
+
+// Spin, then park until `ready()` holds; a zero timeout waits forever. False on timeout.
+template <class Ready>
+bool RingMessageQueue::await(Waiters& w, std::chrono::milliseconds timeout, Ready&& ready) {
+  for (int i = 0; i < kSpinIterations; ++i) {
+    if (ready()) return true;
+    cpu_relax();
+  }
+  // Pairs with the fence in notify(): either the notifier sees us parked, or we see its update.
+  w.parked.fetch_add(1, std::memory_order_seq_cst);
+  bool ok = true;
+  {
+    std::unique_lock<std::mutex> lock(w.mu);
+    if (timeout.count() > 0) {
+      ok = w.cv.wait_for(lock, timeout, ready);
+    } else {
+      w.cv.wait(lock, ready);
+    }
+  }
+  w.parked.fetch_sub(1, std::memory_order_relaxed);
+  return ok;
+}
+
+void RingMessageQueue::notify(Waiters& w) {
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (w.parked.load(std::memory_order_relaxed) == 0) return;
+  // Taking the lock orders this after a waiter's check of its condition, or wakes it.
+  { std::lock_guard<std::mutex> lock(w.mu); }
+  w.cv.notify_all();
+}
+
+Result<void> RingMessageQueue::push(const Message& msg, std::chrono::milliseconds timeout) {
+  QueuedMessage qm;
+  qm.msg = msg;
+  qm.enqueue_time = std::chrono::steady_clock::now();
+  if (ttl_.count() > 0) qm.deadline = qm.enqueue_time + ttl_;
+  const std::size_t msg_size = msg.size();
+
+  for (;;) {
+    if (closed_.load(std::memory_order_acquire)) return Status::closed("queue closed");
+    if (try_reserve_bytes(msg_size)) {
+      if (try_enqueue(qm)) {
+        notify(not_empty_);
+        return Result<void>();
+      }
+      total_bytes_.fetch_sub(msg_size, std::memory_order_relaxed);
+    }
+
+    switch (policy_) {
+      case BackpressurePolicy::kBlock: {
+        bool ok = await(not_full_, timeout, [this, msg_size] {
+          return closed_.load(std::memory_order_acquire) || can_admit(msg_size);
+        });
+        if (!ok) return Status::timeout("push timed out waiting for queue space");
+        break;
+      }
+
+      case BackpressurePolicy::kDropNew:
+        return Result<void>();
+
+      case BackpressurePolicy::kDropOld: {
+        QueuedMessage old;
+        if (!try_dequeue(&old)) cpu_relax();  // a push in progress is about to land
+        break;
+      }
+
+      case BackpressurePolicy::kFailFast:
+        return Status::io_error("queue at high water mark (EAGAIN)");
+    }
+  }
+}
+
+Result<Message> RingMessageQueue::pop(std::chrono::milliseconds timeout) {
+  QueuedMessage qm;
+  for (;;) {
+    if (try_dequeue(&qm)) {
+      if (expired(qm, std::chrono::steady_clock::now())) continue;
+      return std::move(qm.msg);
+    }
+    if (closed_.load(std::memory_order_acquire)) return Status::closed("queue closed");
+    bool ok = await(not_empty_, timeout, [this] {
+      return closed_.load(std::memory_order_acquire) || size_msgs() != 0;
+    });
+    if (!ok) return Status::timeout("pop timed out waiting for message");
+  }
+}
+
+std::optional<Message> RingMessageQueue::try_pop() {
+  QueuedMessage qm;
+  auto now = std::chrono::steady_clock::now();
+  while (try_dequeue(&qm)) {
+    if (!expired(qm, now)) return std::move(qm.msg);
+  }
+  return std::nullopt;
+}
+
+std::size_t RingMessageQueue::size_bytes() const { return total_bytes_.load(std::memory_order_relaxed); }
+
+std::size_t RingMessageQueue::size_msgs() const {
+  // Head first: a later tail can only be larger, so the difference never underflows.
+  std::size_t head = head_.load(std::memory_order_acquire);
+  std::size_t tail = tail_.load(std::memory_order_acquire);
+  return tail - head;
+}
+
+bool RingMessageQueue::at_hwm() const {
+  if (size_msgs() > mask_) return true;
+  return hwm_bytes_ > 0 && size_bytes() >= hwm_bytes_;
+}
+
+void RingMessageQueue::close() {
+  closed_.store(true, std::memory_order_release);
+  notify(not_full_);
+  notify(not_empty_);
+}
+
+bool RingMessageQueue::is_closed() const { return closed_.load(std::memory_order_acquire); }
+
+std::size_t RingMessageQueue::purge_expired() {
+  if (ttl_.count() == 0) return 0;
+  auto now = std::chrono::steady_clock::now();
+  std::size_t purged = 0;
+  QueuedMessage qm;
+  while (try_dequeue(&qm, &now)) ++purged;
+  return purged;
+}
+
 }  // namespace duct
@@ -0,0 +1,53 @@
+#include "duct/rate_limiter.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace duct {
+
+TokenBucket::TokenBucket(std::uint64_t rate_per_sec, std::uint64_t burst) {
+  if (rate_per_sec == 0) return;
+  ns_per_token_ = 1e9 / static_cast<double>(rate_per_sec);
+  tolerance_ns_ = cost_ns(burst != 0 ? burst : rate_per_sec);
+}
+
+std::int64_t TokenBucket::cost_ns(std::uint64_t cost) const {
+  return static_cast<std::int64_t>(std::llround(static_cast<double>(cost) * ns_per_token_));
+}
+
+std::chrono::nanoseconds TokenBucket::try_acquire(std::uint64_t cost, Clock::time_point now) {
+  if (unlimited()) return std::chrono::nanoseconds{0};
+  const std::int64_t now_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch()).count();
+  const std::int64_t inc = cost_ns(cost);
+  std::int64_t tat = tat_ns_.load(std::memory_order_relaxed);
+  for (;;) {
+    const std::int64_t next = std::max(tat, now_ns) + inc;
+    if (next - now_ns > tolerance_ns_ && tat > now_ns) {
+      return std::chrono::nanoseconds{next - now_ns - tolerance_ns_};
+    }
+    if (tat_ns_.compare_exchange_weak(tat, next, std::memory_order_relaxed)) return std::chrono::nanoseconds{0};
+  }
+}
+
+void TokenBucket::refund(std::uint64_t cost) {
+  if (unlimited()) return;
+  tat_ns_.fetch_sub(cost_ns(cost), std::memory_order_relaxed);
+}
+
+RateLimiter::RateLimiter(const RateLimit& limit)
+    : bytes_(limit.bytes_per_sec, limit.burst_bytes), msgs_(limit.msgs_per_sec, limit.burst_msgs) {}
+
+std::chrono::nanoseconds RateLimiter::try_acquire(std::size_t bytes, TokenBucket::Clock::time_point now) {
+  auto wait = bytes_.try_acquire(bytes, now);
+  if (wait.count() != 0) return wait;
+  wait = msgs_.try_acquire(1, now);
+  if (wait.count() != 0) bytes_.refund(bytes);
+  return wait;
+}
+
+void RateLimiter::refund(std::size_t bytes) {
+  bytes_.refund(bytes);
+  msgs_.refund(1);
+}
+
+}  // namespace duct
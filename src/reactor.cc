@@ -0,0 +1,628 @@
+#include "duct/reactor.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#if defined(_WIN32)
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+#elif defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#else
+#include <sys/event.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
+#if defined(DUCT_HAVE_IO_URING)
+#include "io_uring_engine.h"
+#endif
+#if defined(DUCT_HAVE_IOCP)
+#include "iocp_engine.h"
+#endif
+
+namespace duct {
+namespace {
+
+// Messages taken from a pipe per try_recv_batch() call, and calls per pipe per iteration. A pipe
+// that still has data after that goes to the back of the line and is revisited without waiting.
+constexpr std::size_t kRecvBatch = 64;
+constexpr int kMaxBatchesPerTurn = 16;
+
+// Readiness events fetched per wait.
+constexpr int kMaxEvents = 256;
+
+// Poller key reserved for the wakeup channel; pipe ids start at 1.
+constexpr std::uint64_t kWakeKey = 0;
+
+#if !defined(_WIN32)
+static std::string errno_suffix() {
+  int e = errno;
+  return std::string(" (errno=") + std::to_string(e) + " " + std::strerror(e) + ")";
+}
+#endif
+
+// Level-triggered read interest on OS handles plus a wake() usable from any thread. add/remove
+// may race with a wait in progress.
+#if defined(__linux__)
+class Poller {
+ public:
+  ~Poller() {
+    if (wakefd_ >= 0) ::close(wakefd_);
+    if (epfd_ >= 0) ::close(epfd_);
+  }
+
+  Result<void> open() {
+    epfd_ = ::epoll_create1(EPOLL_CLOEXEC);
+    if (epfd_ < 0) return Status::io_error("epoll_create1() failed" + errno_suffix());
+    wakefd_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakefd_ < 0) return Status::io_error("eventfd() failed" + errno_suffix());
+    return add(wakefd_, kWakeKey);
+  }
+
+  Result<void> add(PollHandle h, std::uint64_t key) {
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.u64 = key;
+    if (::epoll_ctl(epfd_, EPOLL_CTL_ADD, static_cast<int>(h), &ev) != 0) {
+      return Status::io_error("epoll_ctl(ADD) failed" + errno_suffix());
+    }
+    return {};
+  }
+
+  // Best effort: a descriptor that is already closed has left the epoll set by itself.
+  void remove(PollHandle h) { (void)::epoll_ctl(epfd_, EPOLL_CTL_DEL, static_cast<int>(h), nullptr); }
+
+  // Append the keys of readable handles; -1 waits forever. Returns early on wake().
+  Result<void> wait(int timeout_ms, std::vector<std::uint64_t>* ready) {
+    epoll_event evs[kMaxEvents];
+    int n = ::epoll_wait(epfd_, evs, kMaxEvents, timeout_ms);
+    if (n < 0) {
+      if (errno == EINTR) return {};
+      return Status::io_error("epoll_wait() failed" + errno_suffix());
+    }
+    for (int i = 0; i < n; ++i) {
+      if (evs[i].data.u64 == kWakeKey) {
+        std::uint64_t drained = 0;
+        (void)::read(wakefd_, &drained, sizeof(drained));
+        continue;
+      }
+      ready->push_back(evs[i].data.u64);
+    }
+    return {};
+  }
+
+  void wake() {
+    std::uint64_t one = 1;
+    (void)::write(wakefd_, &one, sizeof(one));
+  }
+
+ private:
+  int epfd_ = -1;
+  int wakefd_ = -1;
+};
+#elif defined(_WIN32)
+// WSAPoll works on sockets only; a loopback UDP socket connected to itself serves as the wakeup.
+// WSAPoll 只支持 socket；用一个连接到自身的回环 UDP socket 作为唤醒通道。
+class Poller {
+ public:
+  ~Poller() {
+    if (wake_ != INVALID_SOCKET) closesocket(wake_);
+  }
+
+  Result<void> open() {
+    static int wsa_rc = [] {
+      WSADATA wsaData{};
+      return WSAStartup(MAKEWORD(2, 2), &wsaData);
+    }();
+    if (wsa_rc != 0) {
+      return Status::io_error("WSAStartup failed with error: " + std::to_string(wsa_rc));
+    }
+    wake_ = ::socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (wake_ == INVALID_SOCKET) return Status::io_error("socket(wakeup) failed");
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int len = static_cast<int>(sizeof(addr));
+    if (::bind(wake_, reinterpret_cast<sockaddr*>(&addr), len) != 0 ||
+        ::getsockname(wake_, reinterpret_cast<sockaddr*>(&addr), &len) != 0 ||
+        ::connect(wake_, reinterpret_cast<sockaddr*>(&addr), len) != 0) {
+      return Status::io_error("wakeup socket setup failed with error: " + std::to_string(WSAGetLastError()));
+    }
+    u_long nonblocking = 1;
+    (void)ioctlsocket(wake_, FIONBIO, &nonblocking);
+    return add(static_cast<PollHandle>(wake_), kWakeKey);
+  }
+
+  Result<void> add(PollHandle h, std::uint64_t key) {
+    std::lock_guard<std::mutex> lock(mu_);
+    WSAPOLLFD p{};
+    p.fd = static_cast<SOCKET>(h);
+    p.events = POLLRDNORM;
+    fds_.push_back(p);
+    keys_.push_back(key);
+    return {};
+  }
+
+  void remove(PollHandle h) {
+    std::lock_guard<std::mutex> lock(mu_);
+    for (std::size_t i = 1; i < fds_.size(); ++i) {
+      if (fds_[i].fd == static_cast<SOCKET>(h)) {
+        fds_[i] = fds_.back();
+        keys_[i] = keys_.back();
+        fds_.pop_back();
+        keys_.pop_back();
+        return;
+      }
+    }
+  }
+
+  Result<void> wait(int timeout_ms, std::vector<std::uint64_t>* ready) {
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      snapshot_ = fds_;
+      snapshot_keys_ = keys_;
+    }
+    int n = WSAPoll(snapshot_.data(), static_cast<ULONG>(snapshot_.size()), timeout_ms);
+    if (n == SOCKET_ERROR) {
+      return Status::io_error("WSAPoll failed with error: " + std::to_string(WSAGetLastError()));
+    }
+    for (std::size_t i = 0; i < snapshot_.size() && n > 0; ++i) {
+      if (snapshot_[i].revents == 0) continue;
+      --n;
+      if (snapshot_keys_[i] == kWakeKey) {
+        char drain[64];
+        while (::recv(wake_, drain, static_cast<int>(sizeof(drain)), 0) > 0) {
+        }
+        continue;
+      }
+      ready->push_back(snapshot_keys_[i]);
+    }
+    return {};
+  }
+
+  void wake() {
+    char one = 1;
+    (void)::send(wake_, &one, 1, 0);
+  }
+
+ private:
+  SOCKET wake_ = INVALID_SOCKET;
+  std::mutex mu_;
+  std::vector<WSAPOLLFD> fds_;  // [0] is the wakeup socket
+  std::vector<std::uint64_t> keys_;
+  std::vector<WSAPOLLFD> snapshot_;  // what the current wait polls; only touched by the loop thread
+  std::vector<std::uint64_t> snapshot_keys_;
+};
+#else
+class Poller {
+ public:
+  ~Poller() {
+    if (kq_ >= 0) ::close(kq_);
+  }
+
+  Result<void> open() {
+    kq_ = ::kqueue();
+    if (kq_ < 0) return Status::io_error("kqueue() failed" + errno_suffix());
+    struct kevent ev;
+    EV_SET(&ev, 0, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, nullptr);
+    if (::kevent(kq_, &ev, 1, nullptr, 0, nullptr) != 0) {
+      return Status::io_error("kevent(EVFILT_USER) failed" + errno_suffix());
+    }
+    return {};
+  }
+
+  Result<void> add(PollHandle h, std::uint64_t key) {
+    struct kevent ev;
+    EV_SET(&ev, static_cast<uintptr_t>(h), EVFILT_READ, EV_ADD, 0, 0,
+           reinterpret_cast<void*>(static_cast<std::uintptr_t>(key)));
+    if (::kevent(kq_, &ev, 1, nullptr, 0, nullptr) != 0) {
+      return Status::io_error("kevent(EV_ADD) failed" + errno_suffix());
+    }
+    return {};
+  }
+
+  void remove(PollHandle h) {
+    struct kevent ev;
+    EV_SET(&ev, static_cast<uintptr_t>(h), EVFILT_READ, EV_DELETE, 0, 0, nullptr);
+    (void)::kevent(kq_, &ev, 1, nullptr, 0, nullptr);
+  }
+
+  Result<void> wait(int timeout_ms, std::vector<std::uint64_t>* ready) {
+    struct kevent evs[kMaxEvents];
+    timespec ts{};
+    timespec* tsp = nullptr;
+    if (timeout_ms >= 0) {
+      ts.tv_sec = timeout_ms / 1000;
+      ts.tv_nsec = static_cast<long>(timeout_ms % 1000) * 1000000L;
+      tsp = &ts;
+    }
+    int n = ::kevent(kq_, nullptr, 0, evs, kMaxEvents, tsp);
+    if (n < 0) {
+      if (errno == EINTR) return {};
+      return Status::io_error("kevent(wait) failed" + errno_suffix());
+    }
+    for (int i = 0; i < n; ++i) {
+      if (evs[i].filter == EVFILT_USER) continue;
+      ready->push_back(static_cast<std::uint64_t>(reinterpret_cast<std::uintptr_t>(evs[i].udata)));
+    }
+    return {};
+  }
+
+  void wake() {
+    struct kevent ev;
+    EV_SET(&ev, 0, EVFILT_USER, 0, NOTE_TRIGGER, 0, nullptr);
+    (void)::kevent(kq_, &ev, 1, nullptr, 0, nullptr);
+  }
+
+ private:
+  int kq_ = -1;
+};
+#endif
+
+struct Entry {
+  Reactor::Id id = 0;
+  std::shared_ptr<Pipe> pipe;
+  Reactor::MessageHandler on_message;
+  Reactor::ErrorHandler on_error;
+  PollHandle handle = kInvalidPollHandle;
+  bool in_engine = false;  // watched by the io_uring / IOCP engine rather than the poller
+  std::atomic<bool> removed{false};
+};
+
+}  // namespace
+
+struct Reactor::State {
+  Poller poller;  // unused while an engine is set
+#if defined(DUCT_HAVE_IO_URING)
+  std::shared_ptr<detail::UringEngine> uring;
+#endif
+#if defined(DUCT_HAVE_IOCP)
+  std::shared_ptr<detail::IocpEngine> iocp;
+#endif
+  mutable std::mutex mu;
+  std::unordered_map<Id, std::shared_ptr<Entry>> entries;
+  std::vector<Id> polled;  // pipes without a poll handle
+  std::vector<Id> fresh;   // added since the last iteration; drained once before their first wait
+  std::vector<std::function<void()>> posted;
+  // Pending timers by deadline; `timer_at` finds one by id for cancel().
+  std::map<std::pair<std::chrono::steady_clock::time_point, TimerId>, std::function<void()>> timers;
+  std::unordered_map<TimerId, std::chrono::steady_clock::time_point> timer_at;
+  TimerId next_timer = 1;
+  Id next_id = 1;
+  std::atomic<bool> stopped{false};
+
+  // Loop-thread scratch.
+  std::vector<Id> ready;
+  std::vector<Id> due;
+  std::vector<Id> backlog;  // hit the per-turn cap last iteration
+  std::vector<std::function<void()>> tasks;
+  std::vector<Message> batch = std::vector<Message>(kRecvBatch);
+
+  bool use_engine() const {
+#if defined(DUCT_HAVE_IO_URING)
+    return uring != nullptr;
+#elif defined(DUCT_HAVE_IOCP)
+    return iocp != nullptr;
+#else
+    return false;
+#endif
+  }
+
+  void wake() {
+#if defined(DUCT_HAVE_IO_URING)
+    if (uring) return uring->wake();
+#endif
+#if defined(DUCT_HAVE_IOCP)
+    if (iocp) return iocp->wake();
+#endif
+    poller.wake();
+  }
+
+  Result<void> wait(int timeout_ms, std::vector<Id>* out) {
+#if defined(DUCT_HAVE_IO_URING)
+    if (uring) return uring->wait(timeout_ms, out);
+#endif
+#if defined(DUCT_HAVE_IOCP)
+    if (iocp) return iocp->wait(timeout_ms, out);
+#endif
+    return poller.wait(timeout_ms, out);
+  }
+
+  // Hand `e` to the io_uring engine: stream pipes for their socket I/O, others for a poll on their
+  // handle. IOCP only takes stream pipes; the rest are checked every iteration. False when it stays
+  // with the readiness path.
+  Result<bool> engine_add(Entry& e) {
+#if defined(DUCT_HAVE_IOCP)
+    if (!iocp) return false;
+    if (detail::StreamEndpoint* ep = e.pipe->stream_endpoint()) {
+      auto st = iocp->add_stream(e.id, e.pipe, ep);
+      if (!st.ok()) return st.status();
+      return true;
+    }
+#elif defined(DUCT_HAVE_IO_URING)
+    if (!uring) return false;
+    if (detail::StreamEndpoint* ep = e.pipe->stream_endpoint()) {
+      auto st = uring->add_stream(e.id, e.pipe, ep);
+      if (!st.ok()) return st.status();
+      return true;
+    }
+    if (e.handle != kInvalidPollHandle) {
+      uring->add_poll(e.id, e.handle);
+      return true;
+    }
+#else
+    (void)e;
+#endif
+    return false;
+  }
+
+  void engine_remove(Id id) {
+#if defined(DUCT_HAVE_IO_URING)
+    if (uring) uring->remove(id);
+#elif defined(DUCT_HAVE_IOCP)
+    if (iocp) iocp->remove(id);
+#else
+    (void)id;
+#endif
+  }
+};
+
+Reactor::Reactor(std::unique_ptr<State> state) : state_(std::move(state)) {}
+
+Reactor::~Reactor() {
+#if defined(DUCT_HAVE_IO_URING)
+  // Hands every stream pipe back to its own I/O (and breaks the pipe <-> engine references).
+  if (state_->uring) state_->uring->shutdown();
+#endif
+#if defined(DUCT_HAVE_IOCP)
+  if (state_->iocp) state_->iocp->shutdown();
+#endif
+}
+
+Result<std::unique_ptr<Reactor>> Reactor::create(const ReactorOptions& opt) {
+  auto state = std::make_unique<State>();
+#if defined(DUCT_HAVE_IO_URING)
+  if (opt.io_uring) {
+    detail::UringEngine::Options eopt;
+    eopt.sqpoll = opt.sqpoll;
+    eopt.send_hwm_bytes = opt.send_hwm_bytes;
+    auto eng = detail::UringEngine::open(eopt);
+    // Not available (old kernel, seccomp, container policy): use the readiness backend.
+    if (eng.ok()) state->uring = std::move(eng.value());
+  }
+#elif defined(DUCT_HAVE_IOCP)
+  if (opt.iocp) {
+    detail::IocpEngine::Options eopt;
+    eopt.send_hwm_bytes = opt.send_hwm_bytes;
+    auto eng = detail::IocpEngine::open(eopt);
+    if (eng.ok()) state->iocp = std::move(eng.value());
+  }
+#else
+  (void)opt;
+#endif
+  if (!state->use_engine()) {
+    auto st = state->poller.open();
+    if (!st.ok()) return st.status();
+  }
+  return std::unique_ptr<Reactor>(new Reactor(std::move(state)));
+}
+
+Result<Reactor::Id> Reactor::add(std::shared_ptr<Pipe> pipe, MessageHandler on_message, ErrorHandler on_error) {
+  if (!pipe) return Status::invalid_argument("null pipe");
+  // An empty batch only checks that the pipe can receive without blocking.
+  auto probe = pipe->try_recv_batch({});
+  if (!probe.ok()) return probe.status();
+
+  auto e = std::make_shared<Entry>();
+  e->pipe = std::move(pipe);
+  e->on_message = std::move(on_message);
+  e->on_error = std::move(on_error);
+  e->handle = e->pipe->poll_handle();
+
+  State& s = *state_;
+  {
+    std::lock_guard<std::mutex> lock(s.mu);
+    e->id = s.next_id++;
+    auto routed = s.engine_add(*e);
+    if (!routed.ok()) return routed.status();
+    e->in_engine = routed.value();
+    if (!e->in_engine && e->handle != kInvalidPollHandle && !s.use_engine()) {
+      auto st = s.poller.add(e->handle, e->id);
+      if (!st.ok()) return st.status();
+    } else if (!e->in_engine) {
+      s.polled.push_back(e->id);
+    }
+    s.entries.emplace(e->id, e);
+    // Buffered data would never make the handle readable, and an edge-triggered handle (shm) only
+    // arms once drained, so every pipe starts with one drain.
+    s.fresh.push_back(e->id);
+  }
+  // A loop parked in a long wait picks up the new pipe (and the shorter poll interval) right away.
+  s.wake();
+  return e->id;
+}
+
+void Reactor::remove(Id id) {
+  State& s = *state_;
+  std::lock_guard<std::mutex> lock(s.mu);
+  auto it = s.entries.find(id);
+  if (it == s.entries.end()) return;
+  Entry& e = *it->second;
+  e.removed.store(true, std::memory_order_relaxed);
+  if (e.in_engine) {
+    s.engine_remove(id);
+  } else if (e.handle != kInvalidPollHandle && !s.use_engine()) {
+    s.poller.remove(e.handle);
+  } else {
+    s.polled.erase(std::remove(s.polled.begin(), s.polled.end(), id), s.polled.end());
+  }
+  s.fresh.erase(std::remove(s.fresh.begin(), s.fresh.end(), id), s.fresh.end());
+  s.entries.erase(it);
+}
+
+void Reactor::post(std::function<void()> task) {
+  State& s = *state_;
+  {
+    std::lock_guard<std::mutex> lock(s.mu);
+    s.posted.push_back(std::move(task));
+  }
+  s.wake();
+}
+
+Reactor::TimerId Reactor::post_after(std::chrono::milliseconds delay, std::function<void()> task) {
+  State& s = *state_;
+  const auto at = std::chrono::steady_clock::now() + std::max(delay, std::chrono::milliseconds(0));
+  TimerId id = 0;
+  bool earliest = false;
+  {
+    std::lock_guard<std::mutex> lock(s.mu);
+    id = s.next_timer++;
+    auto it = s.timers.emplace(std::make_pair(at, id), std::move(task)).first;
+    s.timer_at.emplace(id, at);
+    earliest = it == s.timers.begin();
+  }
+  // A loop already waiting only needs to wake when its wait would overshoot the new deadline.
+  if (earliest) s.wake();
+  return id;
+}
+
+bool Reactor::cancel(TimerId id) {
+  State& s = *state_;
+  std::lock_guard<std::mutex> lock(s.mu);
+  auto it = s.timer_at.find(id);
+  if (it == s.timer_at.end()) return false;
+  s.timers.erase(std::make_pair(it->second, id));
+  s.timer_at.erase(it);
+  return true;
+}
+
+Result<std::size_t> Reactor::run_once(std::chrono::milliseconds max_wait) {
+  auto ms = std::max<std::chrono::milliseconds::rep>(max_wait.count(), 0);
+  return iterate(static_cast<int>(std::min<std::chrono::milliseconds::rep>(ms, 0x7fffffff)));
+}
+
+Result<void> Reactor::run() {
+  while (!state_->stopped.load(std::memory_order_acquire)) {
+    auto n = iterate(-1);
+    if (!n.ok()) return n.status();
+  }
+  return {};
+}
+
+void Reactor::stop() {
+  state_->stopped.store(true, std::memory_order_release);
+  state_->wake();
+}
+
+std::size_t Reactor::size() const {
+  std::lock_guard<std::mutex> lock(state_->mu);
+  return state_->entries.size();
+}
+
+ReactorBackend Reactor::backend() const {
+  if (!state_->use_engine()) return ReactorBackend::kReadiness;
+#if defined(_WIN32)
+  return ReactorBackend::kIocp;
+#else
+  return ReactorBackend::kIoUring;
+#endif
+}
+
+Result<std::size_t> Reactor::iterate(int timeout_ms) {
+  State& s = *state_;
+  {
+    std::lock_guard<std::mutex> lock(s.mu);
+    std::swap(s.tasks, s.posted);
+    const auto now = std::chrono::steady_clock::now();
+    while (!s.timers.empty() && s.timers.begin()->first.first <= now) {
+      auto node = s.timers.extract(s.timers.begin());
+      s.timer_at.erase(node.key().second);
+      s.tasks.push_back(std::move(node.mapped()));
+    }
+  }
+  for (auto& task : s.tasks) task();
+  s.tasks.clear();
+
+  s.due.clear();
+  std::swap(s.due, s.backlog);
+
+  bool has_polled = false;
+  {
+    std::lock_guard<std::mutex> lock(s.mu);
+    has_polled = !s.polled.empty();
+    if (!s.posted.empty()) timeout_ms = 0;  // posted by a task
+    if (!s.timers.empty()) {
+      // Round up, so the loop does not wake just short of the deadline and spin.
+      const auto left = std::chrono::ceil<std::chrono::milliseconds>(s.timers.begin()->first.first -
+                                                                     std::chrono::steady_clock::now());
+      const int cap = static_cast<int>(std::clamp<std::chrono::milliseconds::rep>(left.count(), 0, 0x7fffffff));
+      timeout_ms = timeout_ms < 0 ? cap : std::min(timeout_ms, cap);
+    }
+    s.due.insert(s.due.end(), s.fresh.begin(), s.fresh.end());
+    s.fresh.clear();
+  }
+  if (!s.due.empty()) {
+    timeout_ms = 0;
+  } else if (has_polled) {
+    auto cap = static_cast<int>(kPollInterval.count());
+    timeout_ms = timeout_ms < 0 ? cap : std::min(timeout_ms, cap);
+  }
+
+  s.ready.clear();
+  auto st = s.wait(timeout_ms, &s.ready);
+  if (!st.ok()) return st.status();
+  s.due.insert(s.due.end(), s.ready.begin(), s.ready.end());
+  {
+    std::lock_guard<std::mutex> lock(s.mu);
+    s.due.insert(s.due.end(), s.polled.begin(), s.polled.end());
+  }
+
+  std::size_t delivered = 0;
+  for (Id id : s.due) {
+    std::shared_ptr<Entry> e;
+    {
+      std::lock_guard<std::mutex> lock(s.mu);
+      auto it = s.entries.find(id);
+      if (it == s.entries.end()) continue;
+      e = it->second;
+    }
+
+    bool drained = false;
+    for (int turn = 0; turn < kMaxBatchesPerTurn && !drained; ++turn) {
+      auto n = e->pipe->try_recv_batch(s.batch);
+      if (!n.ok()) {
+        bool was_registered = !e->removed.load(std::memory_order_relaxed);
+        remove(id);
+        if (was_registered && e->on_error) e->on_error(n.status());
+        drained = true;
+        break;
+      }
+      for (std::size_t i = 0; i < n.value(); ++i) {
+        if (!e->removed.load(std::memory_order_relaxed) && e->on_message) {
+          e->on_message(s.batch[i]);
+          ++delivered;
+        }
+        s.batch[i] = Message();  // drop our reference (shm leases go back to the sender)
+      }
+      drained = n.value() < s.batch.size() || e->removed.load(std::memory_order_relaxed);
+    }
+    if (!drained) s.backlog.push_back(id);
+  }
+  return delivered;
+}
+
+}  // namespace duct
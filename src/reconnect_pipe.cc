@@ -2,31 +2,62 @@
 
 #include <algorithm>
 #include <chrono>
+#include <atomic>
 #include <condition_variable>
+#include <deque>
+#include <iterator>
 #include <memory>
 #include <mutex>
 #include <random>
 #include <string>
 #include <thread>
 #include <utility>
+#include <vector>
+
+#include "duct/logging.h"
+#include "scheduler.h"
 
 namespace duct {
 namespace {
 
+// Connection attempts run as jobs on the shared detail::Scheduler, with the backoff between them
+// as its timers, so a pipe waiting to reconnect holds no thread. At most one attempt is scheduled
+// or running at a time (scheduled_); close() cancels a pending one and waits out a running one.
+//
+// While connected, send(), send_batch() and try_recv_batch() take neither mu_ nor a reference:
+// live_ mirrors inner_, and callers using it are counted in readers_ (see Reading). Everything
+// else, including blocking recv(), goes through mu_.
 class ReconnectPipe final : public Pipe {
  public:
   ReconnectPipe(DialOnceFn dial_once, ReconnectPolicy policy, ConnectionCallback on_state_change)
       : dial_once_(std::move(dial_once)),
         policy_(policy),
-        on_state_change_(std::move(on_state_change)) {
+        on_state_change_(std::move(on_state_change)),
+        rng_(std::random_device{}()),
+        delay_(policy_.initial_delay) {
     set_state(ConnectionState::kConnecting, "initial connect");
-    worker_ = std::thread([this]() { worker_loop(); });
+    scheduled_ = true;
+    detail::Scheduler::instance().submit([this]() { attempt(); });
   }
 
-  ~ReconnectPipe() override { close(); }
+  ~ReconnectPipe() override {
+    close();
+    // No calls may still be running, so nothing reads the retired connections.
+    std::lock_guard<std::mutex> lk(mu_);
+    retired_.clear();
+  }
 
   Result<void> send(const Message& msg, const SendOptions& opt) override {
+    {
+      Reading reading(*this);
+      if (Pipe* p = live_.load()) {
+        auto st = p->send(msg, opt);
+        if (st.ok() || !is_disconnect_error(st.status())) return st;
+        mark_disconnected(p, "send: " + st.status().message());
+      }
+    }
     for (;;) {
+      if (try_buffer(msg, opt)) return {};
       auto st = wait_connected(opt.timeout);
       if (!st.ok()) return st;
 
@@ -37,13 +68,27 @@ class ReconnectPipe final : public Pipe {
       if (st.ok()) return st;
       if (st.status().code() == StatusCode::kTimeout) return st;
       if (is_disconnect_error(st.status())) {
-        mark_disconnected(inner_snapshot, "send: " + st.status().message());
+        mark_disconnected(inner_snapshot.get(), "send: " + st.status().message());
         continue;
       }
       return st;
     }
   }
 
+  // Connected: one call into the connection. Otherwise one message at a time through send(), which
+  // buffers or waits for the connection.
+  Result<std::size_t> send_batch(std::span<const Message> msgs, const SendOptions& opt) override {
+    {
+      Reading reading(*this);
+      if (Pipe* p = live_.load()) {
+        auto n = p->send_batch(msgs, opt);
+        if (n.ok() || !is_disconnect_error(n.status())) return n;
+        mark_disconnected(p, "send: " + n.status().message());
+      }
+    }
+    return Pipe::send_batch(msgs, opt);
+  }
+
   Result<Message> recv(const RecvOptions& opt) override {
     for (;;) {
       auto st = wait_connected(opt.timeout);
@@ -56,26 +101,70 @@ class ReconnectPipe final : public Pipe {
       if (r.ok()) return r;
       if (r.status().code() == StatusCode::kTimeout) return r;
       if (is_disconnect_error(r.status())) {
-        mark_disconnected(inner_snapshot, "recv: " + r.status().message());
+        mark_disconnected(inner_snapshot.get(), "recv: " + r.status().message());
         continue;
       }
       return r;
     }
   }
 
+  // Between connections there is nothing to read and nothing to wait on.
+  PollHandle poll_handle() const override {
+    Reading reading(*this);
+    Pipe* p = live_.load();
+    return p ? p->poll_handle() : kInvalidPollHandle;
+  }
+
+  Result<std::size_t> try_recv_batch(std::span<Message> out) override {
+    Reading reading(*this);
+    Pipe* p = live_.load();
+    if (!p) {
+      std::lock_guard<std::mutex> lk(mu_);
+      if (closed_) return Status::closed("pipe closed");
+      if (permanently_failed_) return Status::io_error("reconnect attempts exhausted: " + last_error_);
+      return std::size_t{0};
+    }
+    auto r = p->try_recv_batch(out);
+    if (!r.ok() && is_disconnect_error(r.status())) {
+      mark_disconnected(p, "recv: " + r.status().message());
+      return std::size_t{0};
+    }
+    return r;
+  }
+
+  // Staged here: the connection may change between reserve() and commit().
+  Result<std::span<std::uint8_t>> reserve(std::size_t size, const SendOptions&) override {
+    return staged_.reserve(size);
+  }
+  Result<void> commit(std::size_t len, const SendOptions& opt) override { return staged_.commit(*this, len, opt); }
+
+  // Only the current connection holds anything back; what is buffered goes out on reconnect.
+  Result<void> flush() override {
+    Reading reading(*this);
+    Pipe* p = live_.load();
+    return p ? p->flush() : Result<void>{};
+  }
+
   void close() override {
     std::shared_ptr<Pipe> inner_to_close;
+    std::vector<std::shared_ptr<Pipe>> freed;
     {
       std::lock_guard<std::mutex> lk(mu_);
       if (closed_) return;
       closed_ = true;
-      inner_to_close = std::move(inner_);
+      buffered_.clear();
+      buffered_bytes_ = 0;
+      inner_to_close = retire_locked(&freed);
       cv_.notify_all();
     }
 
     set_state(ConnectionState::kClosed, "closed");
     if (inner_to_close) inner_to_close->close();
-    if (worker_.joinable()) worker_.join();
+
+    std::unique_lock<std::mutex> lk(mu_);
+    if (scheduled_ && timer_ != 0 && detail::Scheduler::instance().cancel(timer_)) scheduled_ = false;
+    // An attempt closing its own pipe (from on_state_change) cannot wait for itself.
+    if (attempt_thread_ != std::this_thread::get_id()) cv_.wait(lk, [&] { return !scheduled_; });
   }
 
  private:
@@ -87,14 +176,15 @@ class ReconnectPipe final : public Pipe {
     ConnectionCallback cb;
     {
       std::lock_guard<std::mutex> lk(mu_);
-      if (state_ == next) return;
+      // kClosed is final: an attempt finishing after close() does not report.
+      if (state_ == next || state_ == ConnectionState::kClosed) return;
       state_ = next;
       cb = on_state_change_;
     }
     if (cb) cb(next, reason);
   }
 
-  std::shared_ptr<Pipe> snapshot_inner() {
+  std::shared_ptr<Pipe> snapshot_inner() const {
     std::lock_guard<std::mutex> lk(mu_);
     return inner_;
   }
@@ -114,87 +204,206 @@ class ReconnectPipe final : public Pipe {
     return {};
   }
 
-  void mark_disconnected(const std::shared_ptr<Pipe>& which, const std::string& reason) {
+  // After a fast-path caller took live_, a connection stays allocated until readers_ has been
+  // seen at zero: callers arriving after that load the newer live_, since the store precedes the
+  // check (both seq_cst). Whichever sees it, this or the last caller to leave (reclaim()), frees
+  // the retired ones. Returns the connection that was current, and moves those now free to
+  // `freed`, for the caller to drop after releasing mu_; mu_ held.
+  std::shared_ptr<Pipe> retire_locked(std::vector<std::shared_ptr<Pipe>>* freed) {
+    std::shared_ptr<Pipe> old = std::move(inner_);
+    live_.store(nullptr);
+    if (old) {
+      retired_.push_back(old);
+      retiring_.store(true);
+    }
+    if (readers_.load() == 0) take_retired_locked(freed);
+    return old;
+  }
+
+  void take_retired_locked(std::vector<std::shared_ptr<Pipe>>* freed) const {
+    freed->swap(retired_);
+    retiring_.store(false);
+  }
+
+  // The last fast-path caller left while connections were retired.
+  void reclaim() const {
+    std::vector<std::shared_ptr<Pipe>> freed;
+    std::lock_guard<std::mutex> lk(mu_);
+    // Another caller may have arrived since; then its leaving comes back here.
+    if (readers_.load() == 0) take_retired_locked(&freed);
+  }
+
+  void mark_disconnected(Pipe* which, const std::string& reason) {
     std::shared_ptr<Pipe> inner_to_close;
+    std::vector<std::shared_ptr<Pipe>> freed;
     {
       std::lock_guard<std::mutex> lk(mu_);
       if (closed_) return;
       if (!inner_) return;
-      if (inner_ != which) return;  // Stale error from a prior connection.
-      inner_to_close = std::move(inner_);
+      if (inner_.get() != which) return;  // Stale error from a prior connection.
+      inner_to_close = retire_locked(&freed);
       last_error_ = reason;
       cv_.notify_all();
     }
+    DUCT_LOGF(kDebug, "reconnect pipe {}: connection lost: {}", static_cast<const void*>(this), reason);
     set_state(ConnectionState::kDisconnected, reason);
     if (inner_to_close) inner_to_close->close();
+
+    // The first attempt of a new round goes out at once.
+    {
+      std::lock_guard<std::mutex> lk(mu_);
+      if (closed_ || scheduled_ || permanently_failed_) return;
+      scheduled_ = true;
+      attempts_ = 0;
+      delay_ = policy_.initial_delay;
+    }
+    detail::Scheduler::instance().submit([this]() { attempt(); });
   }
 
-  void worker_loop() {
-    std::minstd_rand rng{std::random_device{}()};
-    for (;;) {
-      if (is_closed()) return;
-
-      // If already connected, wait until disconnected or closed.
-      {
-        std::unique_lock<std::mutex> lk(mu_);
-        if (inner_) {
-          cv_.wait(lk, [&] { return closed_ || !inner_; });
-          continue;
-        }
-        if (permanently_failed_) return;
+  // One connection attempt, on a scheduler worker; scheduled_ is set.
+  void attempt() {
+    bool first = false;
+    bool exhausted = false;
+    {
+      std::lock_guard<std::mutex> lk(mu_);
+      timer_ = 0;
+      if (closed_) return finish_locked();
+      first = attempts_ == 0;
+      exhausted = policy_.max_attempts != 0 && attempts_ >= policy_.max_attempts;
+      if (exhausted) {
+        permanently_failed_ = true;
+        buffered_.clear();
+        buffered_bytes_ = 0;
+        cv_.notify_all();
       }
-
+      attempt_thread_ = std::this_thread::get_id();
+    }
+    if (exhausted) {
+      DUCT_LOGF(kDebug, "reconnect pipe {}: giving up after {} attempts", static_cast<const void*>(this),
+                policy_.max_attempts);
+      set_state(ConnectionState::kDisconnected, last_error_or("reconnect attempts exhausted"));
+      return finish();
+    }
+    if (first) {
       set_state(ever_connected() ? ConnectionState::kReconnecting : ConnectionState::kConnecting,
-                last_error_.empty() ? "connecting" : last_error_);
-
-      int attempts = 0;
-      auto delay = policy_.initial_delay;
-      for (;;) {
-        if (is_closed()) return;
-        if (policy_.max_attempts != 0 && attempts >= policy_.max_attempts) {
-          {
-            std::lock_guard<std::mutex> lk(mu_);
-            permanently_failed_ = true;
-            cv_.notify_all();
-          }
-          set_state(ConnectionState::kDisconnected, last_error_.empty() ? "reconnect attempts exhausted" : last_error_);
-          return;
-        }
-
-        auto r = dial_once_();
-        if (r.ok()) {
-          {
-            std::lock_guard<std::mutex> lk(mu_);
-            inner_ = std::shared_ptr<Pipe>(std::move(r.value()));
-            ever_connected_ = true;
-            last_error_.clear();
-            cv_.notify_all();
-          }
-          set_state(ConnectionState::kConnected, "connected");
-          break;
-        }
-
-        ++attempts;
-        {
-          std::lock_guard<std::mutex> lk(mu_);
-          last_error_ = r.status().message();
-        }
-
-        // Backoff with jitter in [0, delay/2].
-        auto jitter = std::chrono::milliseconds(0);
-        if (delay.count() > 0) {
-          std::uniform_int_distribution<long long> dist(0, std::max<long long>(0, delay.count() / 2));
-          jitter = std::chrono::milliseconds(dist(rng));
-        }
-        auto sleep_for = delay + jitter;
-
-        std::unique_lock<std::mutex> lk(mu_);
-        cv_.wait_for(lk, sleep_for, [&] { return closed_ || inner_ != nullptr; });
-
-        auto next_ms = static_cast<long long>(static_cast<double>(delay.count()) * policy_.backoff_multiplier);
-        delay = std::chrono::milliseconds(std::min<long long>(policy_.max_delay.count(), std::max<long long>(0, next_ms)));
+                last_error_or("connecting"));
+    }
+
+    auto r = dial_once_();
+    Status failure;
+    if (r.ok()) {
+      std::shared_ptr<Pipe> fresh(std::move(r.value()));
+      std::vector<std::shared_ptr<Pipe>> freed;
+      std::unique_lock<std::mutex> lk(mu_);
+      auto flushed = flush_buffered(*fresh, lk);
+      const bool adopted = !closed_ && flushed.ok();
+      if (adopted) {
+        inner_ = fresh;
+        live_.store(fresh.get());
+        if (readers_.load() == 0) take_retired_locked(&freed);
+        ever_connected_ = true;
+        last_error_.clear();
+        cv_.notify_all();
+      }
+      lk.unlock();
+      if (adopted) {
+        DUCT_LOGF(kDebug, "reconnect pipe {}: connected", static_cast<const void*>(this));
+        set_state(ConnectionState::kConnected, "connected");
+        return finish();
+      }
+      fresh->close();  // closed while dialing, or lost while writing the buffer
+      if (flushed.ok()) return finish();
+      failure = flushed.status();
+    } else {
+      failure = r.status();
+    }
+
+    std::unique_lock<std::mutex> lk(mu_);
+    ++attempts_;
+    last_error_ = failure.message();
+    attempt_thread_ = {};
+    if (closed_) return finish_locked();
+
+    // Backoff with jitter in [0, delay/2].
+    auto jitter = std::chrono::milliseconds(0);
+    if (delay_.count() > 0) {
+      std::uniform_int_distribution<long long> dist(0, std::max<long long>(0, delay_.count() / 2));
+      jitter = std::chrono::milliseconds(dist(rng_));
+    }
+    const auto wait = delay_ + jitter;
+    const int attempts = attempts_;
+    timer_ = detail::Scheduler::instance().after(wait, [this]() { attempt(); });
+    auto next_ms = static_cast<long long>(static_cast<double>(delay_.count()) * policy_.backoff_multiplier);
+    delay_ = std::chrono::milliseconds(std::min<long long>(policy_.max_delay.count(), std::max<long long>(0, next_ms)));
+    lk.unlock();
+    // The attempt may already be running again; only locals from here on.
+    DUCT_LOGF(kDebug, "reconnect pipe {}: attempt {} failed: {}; retrying in {} ms", static_cast<const void*>(this),
+              attempts, failure.message(), static_cast<long long>(wait.count()));
+  }
+
+  // Queue `msg` while disconnected, if it fits in ReconnectPolicy::buffer_bytes; attempt() writes it
+  // out before publishing the next connection.
+  bool try_buffer(const Message& msg, const SendOptions& opt) {
+    if (policy_.buffer_bytes == 0) return false;
+    std::lock_guard<std::mutex> lk(mu_);
+    if (closed_ || permanently_failed_ || inner_ || buffered_bytes_ + msg.size() > policy_.buffer_bytes) {
+      return false;
+    }
+    buffered_.push_back(Buffered{msg, opt});
+    buffered_bytes_ += msg.size();
+    return true;
+  }
+
+  // Write what send() buffered while disconnected to `fresh`, oldest first, including whatever is
+  // buffered meanwhile: inner_ is still null, so newer sends keep queueing behind. On failure the
+  // unsent messages stay buffered for the next connection. lk holds mu_, released while writing.
+  Result<void> flush_buffered(Pipe& fresh, std::unique_lock<std::mutex>& lk) {
+    while (!closed_ && !buffered_.empty()) {
+      std::deque<Buffered> pending;
+      pending.swap(buffered_);
+      buffered_bytes_ = 0;
+      lk.unlock();
+      Result<void> st;
+      std::size_t sent = 0;
+      for (; sent < pending.size(); ++sent) {
+        st = fresh.send(pending[sent].msg, pending[sent].opt);
+        if (!st.ok()) break;
+      }
+      lk.lock();
+      if (!st.ok()) {
+        pending.erase(pending.begin(), pending.begin() + static_cast<std::ptrdiff_t>(sent));
+        for (auto& b : pending) buffered_bytes_ += b.msg.size();
+        buffered_.insert(buffered_.begin(), std::make_move_iterator(pending.begin()),
+                         std::make_move_iterator(pending.end()));
+        return st;
       }
     }
+    return {};
+  }
+
+  // The attempt is over and nothing else is scheduled; close() may return (and the pipe go away)
+  // as soon as mu_ is released, so this is the last use of `this`.
+  void finish() {
+    std::lock_guard<std::mutex> lk(mu_);
+    finish_locked();
+  }
+  void finish_locked() {
+    attempt_thread_ = {};
+    // The connection this attempt made was lost before it got here: mark_disconnected() saw it
+    // scheduled, and left the next round to it.
+    if (!closed_ && !permanently_failed_ && !inner_) {
+      attempts_ = 0;
+      delay_ = policy_.initial_delay;
+      detail::Scheduler::instance().submit([this]() { attempt(); });
+      return;
+    }
+    scheduled_ = false;
+    cv_.notify_all();
+  }
+
+  std::string last_error_or(const char* fallback) const {
+    std::lock_guard<std::mutex> lk(mu_);
+    return last_error_.empty() ? fallback : last_error_;
   }
 
   bool is_closed() const {
@@ -220,7 +429,38 @@ class ReconnectPipe final : public Pipe {
   bool ever_connected_ = false;
   std::string last_error_;
   std::shared_ptr<Pipe> inner_;
-  std::thread worker_;
+
+  // Attempt state; mu_ held, except that attempt() owns rng_ and delay_ while scheduled_.
+  bool scheduled_ = false;
+  detail::Scheduler::TimerId timer_ = 0;  // backoff until the next attempt
+  std::thread::id attempt_thread_;        // running an attempt
+  int attempts_ = 0;                      // in this round
+  std::minstd_rand rng_;
+  std::chrono::milliseconds delay_;
+
+  // Sends taken while disconnected (ReconnectPolicy::buffer_bytes); mu_ held.
+  struct Buffered {
+    Message msg;
+    SendOptions opt;
+  };
+  std::deque<Buffered> buffered_;
+  std::size_t buffered_bytes_ = 0;
+
+  // Counts a fast-path caller for as long as it may use the connection it loaded from live_; the
+  // last one out frees what was retired meanwhile.
+  struct Reading {
+    explicit Reading(const ReconnectPipe& p) : p_(p) { p_.readers_.fetch_add(1); }
+    ~Reading() {
+      if (p_.readers_.fetch_sub(1) == 1 && p_.retiring_.load()) p_.reclaim();
+    }
+    const ReconnectPipe& p_;
+  };
+  std::atomic<Pipe*> live_{nullptr};           // inner_.get(); written under mu_
+  mutable std::atomic<std::size_t> readers_{0};
+  // Replaced while readers_ was nonzero, and whether there are any; mu_ held to change.
+  mutable std::vector<std::shared_ptr<Pipe>> retired_;
+  mutable std::atomic<bool> retiring_{false};
+  detail::StagedSend staged_;
 };
 
 }  // namespace
@@ -0,0 +1,738 @@
+#include "duct/reliable_pipe.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "pipe_read.h"
+
+namespace duct {
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// Messages read per batch by the receive thread, and how long it waits for data before checking
+// whether the pipe is closing.
+constexpr std::size_t kRecvBatch = 64;
+constexpr std::chrono::milliseconds kRecvPollInterval{50};
+// Acks and retransmits sent by the timer thread give up after this, so close() is not held up.
+constexpr std::chrono::milliseconds kControlSendTimeout{50};
+constexpr int kMaxBackoffShift = 6;
+
+// Every frame of a reliable pipe starts with its kind; integers are big-endian.
+//   hello:     kind, version, session id (8), next (8), first (8)
+//   hello ack: kind, version, flags (1), next (8), first (8)
+//   data:      kind, seq (8), ack (8), payload
+//   ack:       kind, ack (8), sack bitmap (8)
+//   close:     kind (the sender closed its pipe; nothing follows)
+// `next` is the sequence number the sender of the frame expects next (everything below has
+// arrived), `first` the oldest one it still holds for sending. Bit i of the SACK bitmap reports
+// ack + 1 + i as received.
+enum class Kind : std::uint8_t { kHello = 1, kHelloAck = 2, kData = 3, kAck = 4, kClose = 5 };
+constexpr std::uint8_t kVersion = 1;
+constexpr std::uint8_t kNewSession = 1;  // hello ack flags: the accepting side had no such session
+constexpr std::size_t kHelloLen = 26;
+constexpr std::size_t kHelloAckLen = 19;
+constexpr std::size_t kDataHeader = 17;
+constexpr std::size_t kAckLen = 17;
+constexpr int kSackBits = 64;
+
+void put_u64(std::uint8_t* p, std::uint64_t v) {
+  for (int i = 7; i >= 0; --i) {
+    p[i] = static_cast<std::uint8_t>(v);
+    v >>= 8;
+  }
+}
+
+std::uint64_t get_u64(const std::uint8_t* p) {
+  std::uint64_t v = 0;
+  for (int i = 0; i < 8; ++i) v = (v << 8) | p[i];
+  return v;
+}
+
+struct Hello {
+  std::uint64_t session = 0;
+  std::uint64_t next = 0;
+  std::uint64_t first = 0;
+};
+
+Message encode_hello(const Hello& h) {
+  Message m = Message::allocate(kHelloLen);
+  m.data()[0] = static_cast<std::uint8_t>(Kind::kHello);
+  m.data()[1] = kVersion;
+  put_u64(m.data() + 2, h.session);
+  put_u64(m.data() + 10, h.next);
+  put_u64(m.data() + 18, h.first);
+  return m;
+}
+
+Result<Hello> decode_hello(const Message& m) {
+  if (m.size() != kHelloLen || m.data()[0] != static_cast<std::uint8_t>(Kind::kHello)) {
+    return Status::protocol_error("expected reliable hello");
+  }
+  if (m.data()[1] != kVersion) return Status::protocol_error("unsupported reliable version");
+  return Hello{get_u64(m.data() + 2), get_u64(m.data() + 10), get_u64(m.data() + 18)};
+}
+
+// The handshake's reply from a fresh pipe nobody else reads yet. Gives up early once `*stop` is set.
+Result<Message> read_one(Pipe& p, Clock::time_point deadline, const std::atomic<bool>* stop = nullptr) {
+  for (;;) {
+    Message m;
+    auto n = detail::read_some(p, std::span<Message>(&m, 1), kRecvPollInterval);
+    if (!n.ok()) return n.status();
+    if (n.value() != 0) return m;
+    if (stop != nullptr && stop->load(std::memory_order_acquire)) return Status::closed("listener closed");
+    if (Clock::now() >= deadline) return Status::timeout("reliable handshake timeout");
+  }
+}
+
+bool is_disconnect(const Status& st) {
+  return st.code() == StatusCode::kClosed || st.code() == StatusCode::kIoError;
+}
+
+std::uint64_t random_session_id() {
+  std::random_device rd;
+  return (static_cast<std::uint64_t>(rd()) << 32) ^ static_cast<std::uint64_t>(rd());
+}
+
+}  // namespace
+
+namespace detail {
+
+class ReliableCore {
+ public:
+  ReliableCore(const AtLeastOnceOptions& opt, std::uint64_t session_id, bool accepting)
+      : opt_(opt), session_id_(session_id), accepting_(accepting) {
+    opt_.window_msgs = std::max<std::size_t>(opt_.window_msgs, 1);
+    opt_.ack_every = std::max<std::size_t>(opt_.ack_every, 1);
+    running_ = true;
+    recv_thread_ = std::thread(&ReliableCore::recv_worker, this);
+    timer_thread_ = std::thread(&ReliableCore::timer_worker, this);
+  }
+
+  ~ReliableCore() { close(); }
+
+  Result<void> handshake(Pipe& fresh) {
+    Hello h;
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      h = Hello{session_id_, recv_next_, first_unacked_locked()};
+    }
+    const auto deadline = Clock::now() + opt_.handshake_timeout;
+    SendOptions so;
+    so.timeout = opt_.handshake_timeout;
+    auto st = fresh.send(encode_hello(h), so);
+    if (!st.ok()) return st;
+    auto m = read_one(fresh, deadline);
+    if (!m.ok()) return m.status();
+    const Message& r = m.value();
+    if (r.size() != kHelloAckLen || r.data()[0] != static_cast<std::uint8_t>(Kind::kHelloAck) ||
+        r.data()[1] != kVersion) {
+      return Status::protocol_error("expected reliable hello ack");
+    }
+    std::lock_guard<std::mutex> lock(mu_);
+    if ((r.data()[2] & kNewSession) != 0) {
+      // The peer lost our session (it restarted): what it sends starts over.
+      recv_next_ = get_u64(r.data() + 11);
+      ack_sent_ = recv_next_;
+      ahead_.clear();
+    }
+    return resumed_locked(get_u64(r.data() + 3));
+  }
+
+  void start(std::unique_ptr<Pipe> inner) {
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      inner_ = std::shared_ptr<Pipe>(std::move(inner));
+    }
+    attach_cv_.notify_all();
+    timer_cv_.notify_all();
+  }
+
+  // Accepting side: `fresh` said `h`; answer it and carry on over it. A new session starts
+  // receiving at the dialer's oldest message.
+  Result<void> attach(std::unique_ptr<Pipe> fresh, const Hello& h, bool is_new) {
+    Message reply = Message::allocate(kHelloAckLen);
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      if (!running_ || !failure_.ok()) return Status::closed("session closed");
+      if (is_new) {
+        recv_next_ = h.first;
+        ack_sent_ = h.first;
+      }
+      reply.data()[0] = static_cast<std::uint8_t>(Kind::kHelloAck);
+      reply.data()[1] = kVersion;
+      reply.data()[2] = is_new ? kNewSession : 0;
+      put_u64(reply.data() + 3, recv_next_);
+      put_u64(reply.data() + 11, first_unacked_locked());
+    }
+    SendOptions so;
+    so.timeout = opt_.handshake_timeout;
+    auto st = fresh->send(reply, so);
+    if (!st.ok()) return st;
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      auto resumed = resumed_locked(h.next);
+      if (!resumed.ok()) return resumed;
+      inner_ = std::shared_ptr<Pipe>(std::move(fresh));
+    }
+    attach_cv_.notify_all();
+    timer_cv_.notify_all();
+    return {};
+  }
+
+  Result<void> send(const Message& msg, const SendOptions& opt) {
+    Message frame = Message::allocate(kDataHeader + msg.size());
+    frame.data()[0] = static_cast<std::uint8_t>(Kind::kData);
+    if (!msg.empty()) std::memcpy(frame.data() + kDataHeader, msg.data(), msg.size());
+
+    std::shared_ptr<Pipe> inner;
+    {
+      std::unique_lock<std::mutex> lock(mu_);
+      auto room = [this] { return unacked_.size() < opt_.window_msgs || !running_ || !failure_.ok(); };
+      if (opt.timeout.count() > 0) {
+        if (!send_cv_.wait_for(lock, opt.timeout, room)) return Status::timeout("send window full (timeout)");
+      } else {
+        send_cv_.wait(lock, room);
+      }
+      if (!failure_.ok()) return failure_;
+      if (!running_) return Status::closed("pipe closed");
+
+      const std::uint64_t seq = next_seq_++;
+      put_u64(frame.data() + 1, seq);
+      put_u64(frame.data() + 9, recv_next_);
+      piggybacked_locked();
+      const auto now = Clock::now();
+      unacked_.push_back(Unacked{seq, frame, opt.channel, now});
+      if (now + opt_.rto < next_rto_) {
+        next_rto_ = now + opt_.rto;
+        timer_cv_.notify_one();
+      }
+      inner = inner_;
+    }
+    // Not connected (yet, or again): it goes out with the resend after the handshake. The write is
+    // bounded by the RTO so close() never waits on it for long; what does not make it is resent.
+    if (!inner) return {};
+    const auto timeout = opt.timeout.count() > 0 ? std::min(opt.timeout, opt_.rto) : opt_.rto;
+    auto st = write(*inner, frame, opt.channel, timeout);
+    if (st.ok() || st.status().code() == StatusCode::kTimeout) return {};
+    lost(inner, st.status());
+    std::lock_guard<std::mutex> lock(mu_);
+    return failure_;
+  }
+
+  Result<std::size_t> recv_batch(std::span<Message> out, const RecvOptions& opt) {
+    if (out.empty()) return std::size_t{0};
+    std::unique_lock<std::mutex> lock(mu_);
+    auto ready = [this] { return !ready_.empty() || !running_ || !failure_.ok(); };
+    if (opt.timeout.count() > 0) {
+      if (!recv_cv_.wait_for(lock, opt.timeout, ready)) return Status::timeout("recv timeout");
+    } else {
+      recv_cv_.wait(lock, ready);
+    }
+    if (ready_.empty()) {
+      if (!failure_.ok()) return failure_;
+      return Status::closed("pipe closed");
+    }
+    const bool was_full = ready_.size() >= opt_.window_msgs;
+    std::size_t n = 0;
+    while (n < out.size() && !ready_.empty()) {
+      out[n++] = std::move(ready_.front());
+      ready_.pop_front();
+    }
+    if (was_full) recv_space_cv_.notify_one();
+    return n;
+  }
+
+  ReliablePipe::Stats stats() const {
+    std::lock_guard<std::mutex> lock(mu_);
+    ReliablePipe::Stats s = stats_;
+    s.inflight = unacked_.size();
+    return s;
+  }
+
+  void close() {
+    std::shared_ptr<Pipe> inner;
+    bool goodbye = false;
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      goodbye = running_ && failure_.ok();
+      running_ = false;
+      inner = std::move(inner_);
+    }
+    send_cv_.notify_all();
+    recv_cv_.notify_all();
+    recv_space_cv_.notify_all();
+    attach_cv_.notify_all();
+    timer_cv_.notify_all();
+    // The threads use the inner pipe; let them notice first (within kRecvPollInterval).
+    if (recv_thread_.joinable() && recv_thread_.get_id() != std::this_thread::get_id()) recv_thread_.join();
+    if (timer_thread_.joinable() && timer_thread_.get_id() != std::this_thread::get_id()) timer_thread_.join();
+    if (!inner) return;
+    // Tell the peer, so it ends the session now instead of taking this for a dropped link (the
+    // accepting side would wait resume_timeout for us).
+    if (goodbye) {
+      Message bye = Message::allocate(1);
+      bye.data()[0] = static_cast<std::uint8_t>(Kind::kClose);
+      (void)write(*inner, bye, 0, kControlSendTimeout);
+    }
+    inner->close();
+  }
+
+ private:
+  struct Unacked {
+    std::uint64_t seq = 0;
+    Message frame;
+    std::uint16_t channel = 0;
+    Clock::time_point sent;
+    int retransmits = 0;
+    bool sacked = false;
+  };
+
+  std::uint64_t first_unacked_locked() const { return unacked_.empty() ? next_seq_ : unacked_.front().seq; }
+
+  // The cumulative ack just rode on a data frame.
+  void piggybacked_locked() {
+    ack_sent_ = recv_next_;
+    if (ahead_.empty()) {
+      ack_now_ = false;
+      ack_due_ = Clock::time_point::max();
+    }
+  }
+
+  // A handshake said the peer has everything below `peer_next`: drop that, resend the rest now.
+  Result<void> resumed_locked(std::uint64_t peer_next) {
+    if (peer_next > next_seq_) return Status::protocol_error("peer acknowledges messages never sent");
+    while (!unacked_.empty() && unacked_.front().seq < peer_next) unacked_.pop_front();
+    for (Unacked& u : unacked_) {
+      if (!u.sacked) u.sent = Clock::time_point::min();
+    }
+    next_rto_ = Clock::time_point::min();
+    ack_now_ = true;  // and tell it where we are, should the hello have been our only word
+    send_cv_.notify_all();
+    timer_cv_.notify_one();
+    return {};
+  }
+
+  void on_ack_locked(std::uint64_t ack, std::uint64_t sack) {
+    bool freed = false;
+    while (!unacked_.empty() && unacked_.front().seq < ack) {
+      unacked_.pop_front();
+      freed = true;
+    }
+    if (sack != 0 && !unacked_.empty()) {
+      const std::uint64_t base = unacked_.front().seq;
+      std::uint64_t highest = 0;
+      for (int i = 0; i < kSackBits; ++i) {
+        if (((sack >> i) & 1) == 0) continue;
+        const std::uint64_t seq = ack + 1 + static_cast<std::uint64_t>(i);
+        if (seq < base || seq - base >= unacked_.size()) continue;
+        unacked_[seq - base].sacked = true;
+        highest = seq;
+      }
+      // The link keeps order, so holes below the highest SACKed message were lost on the way:
+      // send them again at once rather than after the RTO, but only once.
+      for (Unacked& u : unacked_) {
+        if (u.seq >= highest) break;
+        if (!u.sacked && u.retransmits == 0) {
+          u.sent = Clock::time_point::min();
+          next_rto_ = Clock::time_point::min();
+        }
+      }
+      timer_cv_.notify_one();
+    }
+    if (freed) send_cv_.notify_all();
+  }
+
+  void on_data_locked(std::uint64_t seq, Message payload) {
+    const std::uint64_t before = recv_next_;
+    if (seq < recv_next_ || ahead_.count(seq) != 0) {
+      ++stats_.duplicates;
+      ack_now_ = true;  // the peer missed our ack
+    } else if (seq == recv_next_) {
+      ready_.push_back(std::move(payload));
+      ++recv_next_;
+      while (!ahead_.empty() && ahead_.begin()->first == recv_next_) {
+        ready_.push_back(std::move(ahead_.begin()->second));
+        ahead_.erase(ahead_.begin());
+        ++recv_next_;
+      }
+    } else if (seq - recv_next_ < opt_.window_msgs) {
+      ahead_.emplace(seq, std::move(payload));
+      ack_now_ = true;  // report the gap
+    }
+    if (recv_next_ == before) return;
+    if (recv_next_ - ack_sent_ >= opt_.ack_every) {
+      ack_now_ = true;
+    } else if (ack_due_ == Clock::time_point::max()) {
+      ack_due_ = Clock::now() + opt_.ack_delay;
+    }
+  }
+
+  Message ack_frame_locked() {
+    std::uint64_t sack = 0;
+    if (opt_.sack) {
+      for (const auto& [seq, m] : ahead_) {
+        if (seq - recv_next_ - 1 >= static_cast<std::uint64_t>(kSackBits)) break;
+        sack |= std::uint64_t{1} << (seq - recv_next_ - 1);
+      }
+    }
+    Message m = Message::allocate(kAckLen);
+    m.data()[0] = static_cast<std::uint8_t>(Kind::kAck);
+    put_u64(m.data() + 1, recv_next_);
+    put_u64(m.data() + 9, sack);
+    ack_sent_ = recv_next_;
+    ack_now_ = false;
+    ack_due_ = Clock::time_point::max();
+    ++stats_.acks_sent;
+    return m;
+  }
+
+  Result<void> write(Pipe& inner, const Message& frame, std::uint16_t channel, std::chrono::milliseconds timeout) {
+    SendOptions so;
+    so.channel = channel;
+    so.timeout = timeout;
+    std::lock_guard<std::mutex> lock(write_mu_);
+    return inner.send(frame, so);
+  }
+
+  void fail_locked(Status st) {
+    if (failure_.ok()) failure_ = std::move(st);
+    send_cv_.notify_all();
+    recv_cv_.notify_all();
+    timer_cv_.notify_all();
+  }
+
+  // `inner` failed with `why`. An accepted session waits for its dialer to come back; on the
+  // dialing side the pipe underneath does any reconnecting, so its errors are final.
+  void lost(const std::shared_ptr<Pipe>& inner, Status why) {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (inner_ != inner) return;  // already replaced
+    if (!is_disconnect(why) || !accepting_) {
+      fail_locked(std::move(why));
+      return;
+    }
+    // Dropped rather than closed: another thread may still be using it.
+    inner_.reset();
+    lost_at_ = Clock::now();
+  }
+
+  void recv_worker() {
+    std::vector<Message> batch(kRecvBatch);
+    for (;;) {
+      std::shared_ptr<Pipe> inner;
+      {
+        std::unique_lock<std::mutex> lock(mu_);
+        // What the application has not taken yet bounds how far ahead we read.
+        recv_space_cv_.wait(lock, [this] { return ready_.size() < opt_.window_msgs || !running_; });
+        if (!running_ || !failure_.ok()) return;
+        if (!inner_) {
+          auto attached = [this] { return inner_ != nullptr || !running_; };
+          if (lost_at_ == Clock::time_point::min()) {
+            attach_cv_.wait(lock, attached);
+          } else if (!attach_cv_.wait_until(lock, lost_at_ + opt_.resume_timeout, attached)) {
+            fail_locked(Status::closed("peer did not resume the session"));
+            return;
+          }
+          if (!running_) return;
+        }
+        inner = inner_;
+      }
+
+      auto n = read_some(*inner, batch, kRecvPollInterval);
+      if (!n.ok()) {
+        lost(inner, n.status());
+        continue;
+      }
+      if (n.value() == 0) continue;
+
+      bool arrived = false;
+      bool ack = false;
+      {
+        std::lock_guard<std::mutex> lock(mu_);
+        for (std::size_t i = 0; i < n.value(); ++i) {
+          Message& f = batch[i];
+          const auto kind = f.empty() ? 0 : f.data()[0];
+          if (kind == static_cast<std::uint8_t>(Kind::kData) && f.size() >= kDataHeader) {
+            on_ack_locked(get_u64(f.data() + 9), 0);
+            const std::size_t before = ready_.size();
+            on_data_locked(get_u64(f.data() + 1), f.slice(kDataHeader, f.size() - kDataHeader));
+            arrived |= ready_.size() != before;
+          } else if (kind == static_cast<std::uint8_t>(Kind::kAck) && f.size() == kAckLen) {
+            on_ack_locked(get_u64(f.data() + 1), get_u64(f.data() + 9));
+          } else if (kind == static_cast<std::uint8_t>(Kind::kClose)) {
+            // What arrived before it is still delivered; then recv() reports kClosed.
+            fail_locked(Status::closed("peer closed"));
+            return;
+          } else if (kind != static_cast<std::uint8_t>(Kind::kHello) &&
+                     kind != static_cast<std::uint8_t>(Kind::kHelloAck)) {
+            fail_locked(Status::protocol_error("malformed reliable frame"));
+            return;
+          }
+          f = Message();
+        }
+        ack = ack_now_ || ack_due_ != Clock::time_point::max();
+      }
+      if (arrived) recv_cv_.notify_all();
+      if (ack) timer_cv_.notify_one();
+    }
+  }
+
+  // Sends acks once due and retransmits once the RTO passes.
+  void timer_worker() {
+    struct Resend {
+      Message frame;
+      std::uint16_t channel;
+    };
+    std::vector<Resend> resend;
+    std::unique_lock<std::mutex> lock(mu_);
+    while (running_ && failure_.ok()) {
+      const auto now = Clock::now();
+      std::shared_ptr<Pipe> inner = inner_;
+      Message ack;
+      resend.clear();
+      if (inner) {
+        if (ack_now_ || ack_due_ <= now) ack = ack_frame_locked();
+        if (next_rto_ <= now) {
+          next_rto_ = Clock::time_point::max();
+          for (Unacked& u : unacked_) {
+            if (u.sacked) continue;
+            auto due = u.sent == Clock::time_point::min()
+                           ? now
+                           : u.sent + opt_.rto * (1 << std::min(u.retransmits, kMaxBackoffShift));
+            if (due <= now) {
+              if (opt_.max_retransmits != 0 && u.retransmits >= opt_.max_retransmits) {
+                fail_locked(Status::io_error("peer stopped acknowledging"));
+                return;
+              }
+              resend.push_back(Resend{u.frame, u.channel});
+              ++u.retransmits;
+              ++stats_.retransmits;
+              u.sent = now;
+              due = now + opt_.rto * (1 << std::min(u.retransmits, kMaxBackoffShift));
+            }
+            next_rto_ = std::min(next_rto_, due);
+          }
+        }
+      }
+
+      if (!ack.empty() || !resend.empty()) {
+        lock.unlock();
+        Status failed;
+        if (!ack.empty()) {
+          auto st = write(*inner, ack, 0, kControlSendTimeout);
+          if (!st.ok() && st.status().code() != StatusCode::kTimeout) failed = st.status();
+        }
+        for (const Resend& r : resend) {
+          if (!failed.ok()) break;
+          auto st = write(*inner, r.frame, r.channel, kControlSendTimeout);
+          if (!st.ok() && st.status().code() != StatusCode::kTimeout) failed = st.status();
+        }
+        if (!failed.ok()) lost(inner, failed);
+        lock.lock();
+        continue;
+      }
+
+      // Whoever makes something due sooner notifies; every wakeup re-evaluates from the top.
+      const auto wake = inner ? std::min(ack_due_, next_rto_) : Clock::time_point::max();
+      if (wake == Clock::time_point::max()) {
+        timer_cv_.wait(lock);
+      } else {
+        timer_cv_.wait_until(lock, wake);
+      }
+    }
+  }
+
+  AtLeastOnceOptions opt_;
+  const std::uint64_t session_id_;
+  const bool accepting_;
+
+  mutable std::mutex mu_;
+  std::condition_variable send_cv_;        // senders: room in the window, or failed / closing
+  std::condition_variable recv_cv_;        // receivers: something ready, or failed / closing
+  std::condition_variable recv_space_cv_;  // receive thread: below the window, or closing
+  std::condition_variable attach_cv_;      // receive thread: connected, or closing
+  std::condition_variable timer_cv_;       // timer thread: an ack or resend is due, or closing
+  std::shared_ptr<Pipe> inner_;            // null until connected, and while an accepted session waits
+  Clock::time_point lost_at_ = Clock::time_point::min();  // accepting side: when inner_ dropped
+  bool running_ = false;
+  Status failure_;
+
+  // Send direction.
+  std::uint64_t next_seq_ = 0;
+  std::deque<Unacked> unacked_;  // in sequence order, without gaps
+  Clock::time_point next_rto_ = Clock::time_point::max();  // earliest retransmit; min(): now
+
+  // Receive direction.
+  std::uint64_t recv_next_ = 0;                // everything below has arrived
+  std::map<std::uint64_t, Message> ahead_;     // arrived past a gap
+  std::deque<Message> ready_;                  // in order, for recv()
+  std::uint64_t ack_sent_ = 0;                 // last cumulative ack sent, alone or piggybacked
+  bool ack_now_ = false;
+  Clock::time_point ack_due_ = Clock::time_point::max();
+
+  ReliablePipe::Stats stats_;
+  std::mutex write_mu_;  // one writer at a time on the pipe underneath
+  std::thread recv_thread_;
+  std::thread timer_thread_;
+};
+
+}  // namespace detail
+
+ReliablePipe::ReliablePipe(const AtLeastOnceOptions& opt)
+    : core_(std::make_shared<detail::ReliableCore>(opt, random_session_id(), /*accepting=*/false)) {}
+
+ReliablePipe::ReliablePipe(std::shared_ptr<detail::ReliableCore> core) : core_(std::move(core)) {}
+
+ReliablePipe::~ReliablePipe() { close(); }
+
+Result<void> ReliablePipe::handshake(Pipe& fresh) { return core_->handshake(fresh); }
+
+void ReliablePipe::start(std::unique_ptr<Pipe> inner) { core_->start(std::move(inner)); }
+
+Result<void> ReliablePipe::send(const Message& msg, const SendOptions& opt) { return core_->send(msg, opt); }
+
+Result<Message> ReliablePipe::recv(const RecvOptions& opt) {
+  Message m;
+  auto n = recv_batch(std::span<Message>(&m, 1), opt);
+  if (!n.ok()) return n.status();
+  return m;
+}
+
+Result<std::size_t> ReliablePipe::recv_batch(std::span<Message> out, const RecvOptions& opt) {
+  return core_->recv_batch(out, opt);
+}
+
+Result<std::span<std::uint8_t>> ReliablePipe::reserve(std::size_t size, const SendOptions&) {
+  return staged_.reserve(size);
+}
+
+Result<void> ReliablePipe::commit(std::size_t len, const SendOptions& opt) { return staged_.commit(*this, len, opt); }
+
+void ReliablePipe::close() { core_->close(); }
+
+ReliablePipe::Stats ReliablePipe::stats() const { return core_->stats(); }
+
+ReliableListener::ReliableListener(std::unique_ptr<Listener> inner, const AtLeastOnceOptions& opt)
+    : inner_(std::move(inner)), opt_(opt) {}
+
+ReliableListener::~ReliableListener() { close(); }
+
+Result<std::unique_ptr<Pipe>> ReliableListener::accept() {
+  std::unique_lock<std::mutex> lock(mu_);
+  if (!accepting_ && !closed_) {
+    accepting_ = true;
+    acceptor_ = std::thread(&ReliableListener::accept_loop, this);
+  }
+  ready_cv_.wait(lock, [this] { return !ready_.empty() || !accept_failure_.ok() || closed_; });
+  if (!ready_.empty()) {
+    std::unique_ptr<Pipe> p = std::move(ready_.front());
+    ready_.pop_front();
+    return p;
+  }
+  if (closed_) return Status::closed("listener closed");
+  return accept_failure_;
+}
+
+void ReliableListener::accept_loop() {
+  for (;;) {
+    auto p = inner_->accept();
+    std::lock_guard<std::mutex> lock(mu_);
+    if (!p.ok()) {
+      accept_failure_ = p.status();
+      ready_cv_.notify_all();
+      return;
+    }
+    if (closed_) {
+      p.value()->close();
+      return;
+    }
+    // Each connection says hello on a thread of its own, so a silent one holds up nobody else;
+    // past the cap new connections are turned away until some handshakes finish.
+    if (handshakes_ >= kMaxHandshakes) {
+      p.value()->close();
+      continue;
+    }
+    ++handshakes_;
+    std::thread(&ReliableListener::introduce, this, std::move(p.value())).detach();
+  }
+}
+
+void ReliableListener::introduce(std::unique_ptr<Pipe> p) {
+  std::unique_ptr<Pipe> session = handshake(std::move(p));
+  std::lock_guard<std::mutex> lock(mu_);
+  if (session) {
+    if (closed_) {
+      session->close();
+    } else {
+      ready_.push_back(std::move(session));
+    }
+  }
+  --handshakes_;
+  // Under the lock: once close() sees no handshake left, this thread no longer touches `this`.
+  ready_cv_.notify_all();
+}
+
+std::unique_ptr<Pipe> ReliableListener::handshake(std::unique_ptr<Pipe> p) {
+  // A connection that does not introduce itself in time is not ours.
+  auto m = read_one(*p, Clock::now() + opt_.handshake_timeout, &closing_);
+  auto hello = m.ok() ? decode_hello(m.value()) : Result<Hello>(m.status());
+  if (!hello.ok()) {
+    p->close();
+    return nullptr;
+  }
+
+  std::shared_ptr<detail::ReliableCore> core;
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    auto it = sessions_.find(hello.value().session);
+    if (it != sessions_.end()) core = it->second.lock();
+  }
+  if (core) {
+    // A reconnect: the session's pipe carries on over it.
+    (void)core->attach(std::move(p), hello.value(), /*is_new=*/false);
+    return nullptr;
+  }
+
+  core = std::make_shared<detail::ReliableCore>(opt_, hello.value().session, /*accepting=*/true);
+  if (!core->attach(std::move(p), hello.value(), /*is_new=*/true).ok()) return nullptr;
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    for (auto it = sessions_.begin(); it != sessions_.end();) {
+      it = it->second.expired() ? sessions_.erase(it) : std::next(it);
+    }
+    sessions_[hello.value().session] = core;
+  }
+  return std::unique_ptr<Pipe>(new ReliablePipe(std::move(core)));
+}
+
+Result<std::string> ReliableListener::local_address() const { return inner_->local_address(); }
+
+// Sessions accepted but never taken by accept() are closed.
+void ReliableListener::close() {
+  std::deque<std::unique_ptr<Pipe>> dropped;
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (closed_) return;
+    closed_ = true;
+  }
+  closing_.store(true, std::memory_order_release);
+  ready_cv_.notify_all();
+  inner_->close();
+  if (acceptor_.joinable()) acceptor_.join();
+  {
+    std::unique_lock<std::mutex> lock(mu_);
+    ready_cv_.wait(lock, [this] { return handshakes_ == 0; });
+    dropped.swap(ready_);
+  }
+  for (auto& p : dropped) p->close();
+}
+
+}  // namespace duct
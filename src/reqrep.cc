@@ -0,0 +1,414 @@
+#include "duct/reqrep.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "pipe_read.h"
+#include "scheduler.h"
+
+namespace duct {
+namespace {
+
+// Messages read per batch by the reader threads, and how long they wait for data before checking
+// whether they are closing.
+constexpr std::size_t kRecvBatch = 64;
+constexpr std::chrono::milliseconds kRecvPollInterval{50};
+
+// Headers, big-endian:
+//   request: kind, id (8), deadline in ms from arrival (4; 0 = none), then the body
+//   reply:   kind, id (8), StatusCode (1), then the body, or the error message
+enum class Kind : std::uint8_t { kRequest = 1, kReply = 2 };
+constexpr std::size_t kRequestLen = 13;
+constexpr std::size_t kReplyLen = 10;
+
+void put_be(std::uint8_t* p, std::uint64_t v, int bytes) {
+  for (int i = 0; i < bytes; ++i) p[i] = static_cast<std::uint8_t>(v >> (8 * (bytes - 1 - i)));
+}
+
+std::uint64_t get_be(const std::uint8_t* p, int bytes) {
+  std::uint64_t v = 0;
+  for (int i = 0; i < bytes; ++i) v = (v << 8) | p[i];
+  return v;
+}
+
+Message encode(std::size_t header_len, const std::uint8_t* header, const void* body, std::size_t len) {
+  Message m = Message::allocate(header_len + len);
+  std::memcpy(m.data(), header, header_len);
+  if (len != 0) std::memcpy(m.data() + header_len, body, len);
+  return m;
+}
+
+Message encode_request(std::uint64_t id, std::chrono::milliseconds timeout, const Message& body) {
+  std::uint8_t h[kRequestLen];
+  h[0] = static_cast<std::uint8_t>(Kind::kRequest);
+  put_be(h + 1, id, 8);
+  put_be(h + 9, static_cast<std::uint32_t>(std::clamp<std::int64_t>(timeout.count(), 0, 0xffffffff)), 4);
+  return encode(kRequestLen, h, body.data(), body.size());
+}
+
+Message encode_reply(std::uint64_t id, const Result<Message>& r) {
+  std::uint8_t h[kReplyLen];
+  h[0] = static_cast<std::uint8_t>(Kind::kReply);
+  put_be(h + 1, id, 8);
+  h[9] = static_cast<std::uint8_t>(r.ok() ? StatusCode::kOk : r.status().code());
+  if (r.ok()) return encode(kReplyLen, h, r.value().data(), r.value().size());
+  const std::string_view text = r.status().message_view();
+  return encode(kReplyLen, h, text.data(), text.size());
+}
+
+bool valid_code(std::uint8_t c) { return c <= static_cast<std::uint8_t>(StatusCode::kCancelled); }
+
+}  // namespace
+
+namespace detail {
+
+class RequesterCore : public std::enable_shared_from_this<RequesterCore> {
+ public:
+  explicit RequesterCore(std::unique_ptr<Pipe> conn) : conn_(std::move(conn)) {}
+  ~RequesterCore() { close(); }
+
+  void start() {
+    running_ = true;
+    reader_ = std::thread(&RequesterCore::reader, this);
+  }
+
+  void call(const Message& request, Requester::Callback done, const RequestOptions& opt) {
+    std::uint64_t id = 0;
+    {
+      std::unique_lock<std::mutex> lock(mu_);
+      if (!failure_.ok()) {
+        Status st = failure_;
+        lock.unlock();
+        done(std::move(st));
+        return;
+      }
+      id = next_id_++;
+      Pending& p = pending_[id];
+      p.done = std::move(done);
+      // The timer cannot complete the request before we let go of the lock.
+      if (opt.timeout.count() > 0) {
+        p.timer = Scheduler::instance().after(opt.timeout, [weak = weak_from_this(), id]() {
+          if (auto self = weak.lock()) self->expire(id);
+        });
+      }
+    }
+    SendOptions so;
+    so.timeout = opt.timeout;
+    so.channel = opt.channel;
+    Result<void> st;
+    {
+      std::lock_guard<std::mutex> lock(write_mu_);
+      st = conn_->send(encode_request(id, opt.timeout, request), so);
+    }
+    if (st.ok()) {
+      sent_.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    complete(id, st.status());
+    if (st.status().code() != StatusCode::kTimeout) fail(st.status());
+  }
+
+  void close() {
+    running_ = false;
+    fail(Status::closed("requester closed"));
+    // The reader uses the connection; let it notice first (within kRecvPollInterval).
+    if (reader_.joinable() && reader_.get_id() != std::this_thread::get_id()) reader_.join();
+    if (conn_) conn_->close();
+  }
+
+  Requester::Stats stats() const {
+    Requester::Stats s;
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      s.in_flight = pending_.size();
+    }
+    s.sent = sent_.load(std::memory_order_relaxed);
+    s.replied = replied_.load(std::memory_order_relaxed);
+    s.timed_out = timed_out_.load(std::memory_order_relaxed);
+    s.unmatched = unmatched_.load(std::memory_order_relaxed);
+    return s;
+  }
+
+ private:
+  struct Pending {
+    Requester::Callback done;
+    Scheduler::TimerId timer = 0;
+  };
+
+  // Finish `id` with `r`, unless it finished already; false then.
+  bool complete(std::uint64_t id, Result<Message> r) {
+    Requester::Callback done;
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      auto it = pending_.find(id);
+      if (it == pending_.end()) return false;
+      done = std::move(it->second.done);
+      if (it->second.timer != 0) Scheduler::instance().cancel(it->second.timer);
+      pending_.erase(it);
+    }
+    done(std::move(r));
+    return true;
+  }
+
+  void expire(std::uint64_t id) {
+    if (complete(id, Status::timeout("request timed out"))) timed_out_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // Every outstanding request ends with `st`, and so do later calls.
+  void fail(Status st) {
+    std::unordered_map<std::uint64_t, Pending> failed;
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      if (failure_.ok()) failure_ = std::move(st);
+      failed.swap(pending_);
+      for (auto& [id, p] : failed) {
+        if (p.timer != 0) Scheduler::instance().cancel(p.timer);
+      }
+      st = failure_;
+    }
+    for (auto& [id, p] : failed) p.done(st);
+  }
+
+  Result<void> dispatch(const Message& m) {
+    if (m.size() < kReplyLen || m.data()[0] != static_cast<std::uint8_t>(Kind::kReply) || !valid_code(m.data()[9])) {
+      return Status::protocol_error("malformed reply");
+    }
+    const std::uint64_t id = get_be(m.data() + 1, 8);
+    const auto code = static_cast<StatusCode>(m.data()[9]);
+    Message body = m.slice(kReplyLen, m.size() - kReplyLen);
+    Result<Message> r = code == StatusCode::kOk ? Result<Message>(std::move(body))
+                                                : Result<Message>(Status(code, std::string(body.as_string_view())));
+    if (complete(id, std::move(r))) {
+      replied_.fetch_add(1, std::memory_order_relaxed);
+    } else {
+      unmatched_.fetch_add(1, std::memory_order_relaxed);
+    }
+    return {};
+  }
+
+  void reader() {
+    std::vector<Message> batch(kRecvBatch);
+    while (running_.load(std::memory_order_acquire)) {
+      auto n = read_some(*conn_, batch, kRecvPollInterval);
+      if (!n.ok()) {
+        fail(n.status());
+        return;
+      }
+      for (std::size_t i = 0; i < n.value(); ++i) {
+        auto st = dispatch(batch[i]);
+        batch[i] = Message();
+        if (!st.ok()) {
+          fail(st.status());
+          return;
+        }
+      }
+    }
+  }
+
+  std::unique_ptr<Pipe> conn_;
+
+  mutable std::mutex mu_;
+  std::unordered_map<std::uint64_t, Pending> pending_;
+  std::uint64_t next_id_ = 1;
+  Status failure_;
+  std::atomic<std::uint64_t> sent_{0};
+  std::atomic<std::uint64_t> replied_{0};
+  std::atomic<std::uint64_t> timed_out_{0};
+  std::atomic<std::uint64_t> unmatched_{0};
+
+  std::atomic<bool> running_{false};
+  std::mutex write_mu_;  // one writer at a time on the connection
+  std::thread reader_;
+};
+
+class ResponderCore {
+ public:
+  ResponderCore(std::unique_ptr<Pipe> conn, Responder::Handler handler, const ResponderOptions& opt)
+      : conn_(std::move(conn)), handler_(std::move(handler)), max_in_flight_(std::max<std::size_t>(opt.max_in_flight, 1)) {
+    running_ = true;
+    const std::size_t threads = std::min(std::max<std::size_t>(opt.threads, 1), max_in_flight_);
+    for (std::size_t i = 0; i < threads; ++i) workers_.emplace_back(&ResponderCore::work, this);
+    reader_ = std::thread(&ResponderCore::reader, this);
+  }
+
+  ~ResponderCore() { close(); }
+
+  void close() {
+    running_ = false;
+    {
+      // Lock so the reader between its check and its wait cannot miss the notification.
+      std::lock_guard<std::mutex> lock(mu_);
+    }
+    cv_.notify_all();
+    if (reader_.joinable() && reader_.get_id() != std::this_thread::get_id()) reader_.join();
+    // Handlers write their replies on the connection, and hold `this`: the workers answer what is
+    // queued, then leave.
+    {
+      std::unique_lock<std::mutex> lock(mu_);
+      cv_.wait(lock, [this] { return in_flight_ == 0; });
+      stopping_ = true;
+    }
+    work_cv_.notify_all();
+    for (std::thread& t : workers_) {
+      if (t.joinable() && t.get_id() != std::this_thread::get_id()) t.join();
+    }
+    if (conn_) conn_->close();
+  }
+
+  Responder::Stats stats() const {
+    Responder::Stats s;
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      s.in_flight = in_flight_;
+    }
+    s.requests = requests_.load(std::memory_order_relaxed);
+    s.replied = replied_.load(std::memory_order_relaxed);
+    s.failed = failed_.load(std::memory_order_relaxed);
+    s.expired = expired_.load(std::memory_order_relaxed);
+    return s;
+  }
+
+ private:
+  using Clock = std::chrono::steady_clock;
+
+  struct Job {
+    std::uint64_t id;
+    Clock::time_point deadline;
+    Message body;
+  };
+
+  // A handler thread: answer queued requests until close().
+  void work() {
+    for (;;) {
+      Job job;
+      {
+        std::unique_lock<std::mutex> lock(mu_);
+        work_cv_.wait(lock, [this] { return stopping_ || !jobs_.empty(); });
+        if (jobs_.empty()) return;
+        job = std::move(jobs_.front());
+        jobs_.pop_front();
+      }
+      serve(job.id, job.deadline, std::move(job.body));
+    }
+  }
+
+  // Answer one request.
+  void serve(std::uint64_t id, Clock::time_point deadline, Message body) {
+    if (Clock::now() > deadline) {
+      expired_.fetch_add(1, std::memory_order_relaxed);
+    } else {
+      Result<Message> r = handler_(body);
+      if (!r.ok()) failed_.fetch_add(1, std::memory_order_relaxed);
+      SendOptions so;
+      so.channel = body.channel();
+      Result<void> st;
+      {
+        std::lock_guard<std::mutex> lock(write_mu_);
+        st = conn_->send(encode_reply(id, r), so);
+      }
+      if (st.ok()) {
+        replied_.fetch_add(1, std::memory_order_relaxed);
+      } else {
+        running_ = false;  // the reader stops; the requester sees the connection fail
+      }
+    }
+    std::lock_guard<std::mutex> lock(mu_);
+    --in_flight_;
+    cv_.notify_all();
+  }
+
+  void reader() {
+    std::vector<Message> batch(kRecvBatch);
+    while (running_.load(std::memory_order_acquire)) {
+      std::size_t room = 0;
+      {
+        std::unique_lock<std::mutex> lock(mu_);
+        cv_.wait_for(lock, kRecvPollInterval, [this] { return in_flight_ < max_in_flight_ || !running_; });
+        room = std::min(max_in_flight_ - std::min(in_flight_, max_in_flight_), kRecvBatch);
+      }
+      if (room == 0) continue;
+      auto n = read_some(*conn_, std::span<Message>(batch.data(), room), kRecvPollInterval);
+      if (!n.ok()) return;  // the requester went away
+      const Clock::time_point now = Clock::now();
+      for (std::size_t i = 0; i < n.value(); ++i) {
+        Message m = std::move(batch[i]);
+        if (m.size() < kRequestLen || m.data()[0] != static_cast<std::uint8_t>(Kind::kRequest)) {
+          running_ = false;  // not a requester: stop serving the connection
+          return;
+        }
+        const std::uint64_t id = get_be(m.data() + 1, 8);
+        const auto budget = std::chrono::milliseconds(get_be(m.data() + 9, 4));
+        const Clock::time_point deadline = budget.count() > 0 ? now + budget : Clock::time_point::max();
+        requests_.fetch_add(1, std::memory_order_relaxed);
+        {
+          std::lock_guard<std::mutex> lock(mu_);
+          ++in_flight_;
+          jobs_.push_back(Job{id, deadline, m.slice(kRequestLen, m.size() - kRequestLen)});
+        }
+        work_cv_.notify_one();
+      }
+    }
+  }
+
+  std::unique_ptr<Pipe> conn_;
+  Responder::Handler handler_;
+  const std::size_t max_in_flight_;
+
+  mutable std::mutex mu_;
+  std::condition_variable cv_;  // reader: room under max_in_flight_; close(): no handler left
+  std::size_t in_flight_ = 0;   // queued in jobs_ or being served
+  std::deque<Job> jobs_;
+  std::condition_variable work_cv_;  // workers: a job, or stopping_
+  bool stopping_ = false;
+  std::vector<std::thread> workers_;
+  std::atomic<std::uint64_t> requests_{0};
+  std::atomic<std::uint64_t> replied_{0};
+  std::atomic<std::uint64_t> failed_{0};
+  std::atomic<std::uint64_t> expired_{0};
+
+  std::atomic<bool> running_{false};
+  std::mutex write_mu_;  // one writer at a time on the connection
+  std::thread reader_;
+};
+
+}  // namespace detail
+
+Requester::Requester(std::unique_ptr<Pipe> conn) : core_(std::make_shared<detail::RequesterCore>(std::move(conn))) {
+  core_->start();
+}
+
+Requester::~Requester() { close(); }
+
+void Requester::call(const Message& request, Callback done, const RequestOptions& opt) {
+  core_->call(request, std::move(done), opt);
+}
+
+std::future<Result<Message>> Requester::call(const Message& request, const RequestOptions& opt) {
+  auto promise = std::make_shared<std::promise<Result<Message>>>();
+  auto fut = promise->get_future();
+  core_->call(request, [promise](Result<Message> r) { promise->set_value(std::move(r)); }, opt);
+  return fut;
+}
+
+void Requester::close() { core_->close(); }
+
+Requester::Stats Requester::stats() const { return core_->stats(); }
+
+Responder::Responder(std::unique_ptr<Pipe> conn, Handler handler, const ResponderOptions& opt)
+    : core_(std::make_shared<detail::ResponderCore>(std::move(conn), std::move(handler), opt)) {}
+
+Responder::~Responder() { close(); }
+
+void Responder::close() { core_->close(); }
+
+Responder::Stats Responder::stats() const { return core_->stats(); }
+
+}  // namespace duct
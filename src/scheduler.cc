@@ -0,0 +1,214 @@
+#include "scheduler.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace duct::detail {
+namespace {
+
+// Four levels of 64 slots: level l holds timers due in [64^l, 64^(l+1)) ticks, and a slot of
+// level l + 1 is spread over level l (cascades) when level l wraps. Timers further out than the
+// top level's range wait in its last slot and are placed again each time it comes around.
+constexpr int kLevelBits = 6;
+constexpr std::uint64_t kSlots = 1u << kLevelBits;
+constexpr int kLevels = 4;
+constexpr std::uint64_t kMaxDelta = (std::uint64_t{1} << (kLevelBits * kLevels)) - 1;
+
+// Idle workers exit after this.
+constexpr std::chrono::seconds kIdleExit{10};
+
+}  // namespace
+
+struct Scheduler::State {
+  struct Timer {
+    TimerId id;
+    std::uint64_t expires;  // tick
+    std::function<void()> fn;
+  };
+  using Slot = std::list<Timer>;
+  struct Where {
+    int level;
+    std::uint64_t slot;
+    Slot::iterator it;
+  };
+
+  // Timer wheel.
+  std::mutex mu;
+  std::condition_variable timer_cv;  // timer thread: first timer, or one due before its wake-up
+  const std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+  Slot wheel[kLevels][kSlots];
+  std::unordered_map<TimerId, Where> index;
+  std::uint64_t current = 0;  // last tick processed
+  std::uint64_t wake = 0;     // tick the timer thread sleeps until
+  std::size_t upper = 0;      // timers above level 0
+  TimerId next_id = 1;
+  bool timer_started = false;
+
+  // Worker pool.
+  std::mutex pool_mu;
+  std::condition_variable pool_cv;
+  std::deque<std::function<void()>> jobs;
+  std::size_t workers = 0;
+  std::size_t idle = 0;
+
+  std::uint64_t tick_now() const {
+    auto since = std::chrono::steady_clock::now() - epoch;
+    return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(since).count());
+  }
+
+  // Move `it` (in `from`) into its slot; false when it is due already. mu held.
+  bool place(Slot& from, Slot::iterator it) {
+    if (it->expires <= current) return false;
+    const std::uint64_t delta = it->expires - current;
+    const std::uint64_t at = delta > kMaxDelta ? current + kMaxDelta : it->expires;
+    int level = 0;
+    while (level + 1 < kLevels && (delta >> (kLevelBits * (level + 1))) != 0) ++level;
+    const std::uint64_t slot = (at >> (kLevelBits * level)) & (kSlots - 1);
+    Slot& to = wheel[level][slot];
+    to.splice(to.end(), from, it);
+    index[it->id] = Where{level, slot, it};
+    if (level > 0) ++upper;
+    return true;
+  }
+
+  // Spread the slot of `level` that comes up at `current` over the levels below. mu held.
+  void cascade(int level, Slot& due) {
+    const std::uint64_t slot = (current >> (kLevelBits * level)) & (kSlots - 1);
+    if (slot == 0 && level + 1 < kLevels) cascade(level + 1, due);
+    Slot moving;
+    moving.splice(moving.end(), wheel[level][slot]);
+    upper -= moving.size();
+    while (!moving.empty()) {
+      auto it = moving.begin();
+      if (!place(moving, it)) {
+        index.erase(it->id);
+        due.splice(due.end(), moving, it);
+      }
+    }
+  }
+
+  // Process ticks up to `now`, collecting what fires. mu held.
+  void advance(std::uint64_t now, Slot& due) {
+    while (current < now) {
+      ++current;
+      const std::uint64_t slot = current & (kSlots - 1);
+      if (slot == 0) cascade(1, due);
+      for (auto& t : wheel[0][slot]) index.erase(t.id);
+      due.splice(due.end(), wheel[0][slot]);
+    }
+  }
+
+  // The next tick worth waking for: a level 0 timer, or the next cascade. mu held, timers pending.
+  std::uint64_t next_wake() const {
+    for (std::uint64_t t = current + 1; t <= current + kSlots; ++t) {
+      if (!wheel[0][t & (kSlots - 1)].empty()) return t;
+      if (upper != 0 && (t & (kSlots - 1)) == 0) return t;
+    }
+    return current + kSlots;
+  }
+
+  void timer_loop() {
+    std::unique_lock<std::mutex> lock(mu);
+    Slot due;
+    for (;;) {
+      if (index.empty()) {
+        wake = 0;
+        timer_cv.wait(lock, [this] { return !index.empty(); });
+      }
+      advance(tick_now(), due);
+      if (!due.empty()) {
+        Slot firing;
+        firing.swap(due);
+        lock.unlock();
+        for (auto& t : firing) submit(std::move(t.fn));
+        lock.lock();
+        continue;
+      }
+      if (index.empty()) continue;
+      wake = next_wake();
+      timer_cv.wait_until(lock, epoch + std::chrono::milliseconds(static_cast<std::int64_t>(wake)));
+    }
+  }
+
+  void submit(std::function<void()> fn) {
+    std::lock_guard<std::mutex> lock(pool_mu);
+    jobs.push_back(std::move(fn));
+    if (idle == 0 && workers < kMaxWorkers) {
+      ++workers;
+      std::thread([this]() { work(); }).detach();
+    } else {
+      pool_cv.notify_one();
+    }
+  }
+
+  void work() {
+    std::unique_lock<std::mutex> lock(pool_mu);
+    for (;;) {
+      while (jobs.empty()) {
+        ++idle;
+        const bool got = pool_cv.wait_for(lock, kIdleExit, [this] { return !jobs.empty(); });
+        --idle;
+        if (!got) {
+          --workers;
+          return;
+        }
+      }
+      auto job = std::move(jobs.front());
+      jobs.pop_front();
+      lock.unlock();
+      job();
+      job = nullptr;  // destroy captures before parking
+      lock.lock();
+    }
+  }
+};
+
+Scheduler::Scheduler() : state_(new State()) {}
+
+Scheduler& Scheduler::instance() {
+  static Scheduler* scheduler = new Scheduler();
+  return *scheduler;
+}
+
+void Scheduler::submit(std::function<void()> fn) { state_->submit(std::move(fn)); }
+
+Scheduler::TimerId Scheduler::after(std::chrono::milliseconds delay, std::function<void()> fn) {
+  State& s = *state_;
+  const auto ticks = static_cast<std::uint64_t>(std::max<std::chrono::milliseconds::rep>(delay.count(), 0));
+  std::lock_guard<std::mutex> lock(s.mu);
+  if (!s.timer_started) {
+    s.timer_started = true;
+    std::thread([&s]() { s.timer_loop(); }).detach();
+  }
+  // An empty wheel skips straight to now instead of having the thread catch up tick by tick.
+  if (s.index.empty()) s.current = std::max(s.current, s.tick_now());
+  const TimerId id = s.next_id++;
+  // The tick now is partly over, so the delay starts at the next one; and the timer thread has
+  // already processed the current one.
+  const std::uint64_t expires = std::max(s.tick_now() + ticks + 1, s.current + 1);
+  State::Slot staging;
+  staging.push_back(State::Timer{id, expires, std::move(fn)});
+  s.place(staging, staging.begin());
+  if (s.wake == 0 || expires < s.wake) s.timer_cv.notify_one();
+  return id;
+}
+
+bool Scheduler::cancel(TimerId id) {
+  State& s = *state_;
+  std::lock_guard<std::mutex> lock(s.mu);
+  auto it = s.index.find(id);
+  if (it == s.index.end()) return false;
+  if (it->second.level > 0) --s.upper;
+  s.wheel[it->second.level][it->second.slot].erase(it->second.it);
+  s.index.erase(it);
+  return true;
+}
+
+}  // namespace duct::detail
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+
+namespace duct::detail {
+
+// Process-wide timers and worker threads for the background work of pipes (reconnect backoff, TTL
+// deadlines, queued writes), so an idle pipe costs no thread. Timers live in a hierarchical wheel
+// of 1 ms ticks, served by one thread; work runs on a pool that grows while every worker is busy
+// (up to kMaxWorkers) and shrinks again when idle.
+//
+// Jobs may block (a dial, a write to a full socket), but each one holds a worker for as long, so
+// long-running work should give its worker back and resubmit itself. Never destroyed: pipes may
+// use it from static destructors.
+class Scheduler {
+ public:
+  using TimerId = std::uint64_t;
+
+  static constexpr std::size_t kMaxWorkers = 64;
+
+  static Scheduler& instance();
+
+  // Run `fn` on a worker.
+  void submit(std::function<void()> fn);
+
+  // Run `fn` on a worker once `delay` has passed (rounded up to the tick). Never returns 0.
+  TimerId after(std::chrono::milliseconds delay, std::function<void()> fn);
+
+  // Drop a timer that has not fired; false once it has (its job may be queued or running).
+  bool cancel(TimerId id);
+
+  Scheduler(const Scheduler&) = delete;
+  Scheduler& operator=(const Scheduler&) = delete;
+
+ private:
+  struct State;
+  Scheduler();
+
+  State* state_;
+};
+
+}  // namespace duct::detail
@@ -0,0 +1,275 @@
+#include "duct/server.h"
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "duct/address.h"
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace duct {
+namespace {
+
+thread_local std::size_t t_shard = Server::kNoShard;
+
+// A listener dressed as a pipe, so a reactor watches its handle: each drain accepts what is
+// pending and hands it to `on_accept`. Delivers no messages.
+class AcceptPipe final : public Pipe {
+ public:
+  AcceptPipe(Listener* listener, std::function<void(std::unique_ptr<Pipe>)> on_accept)
+      : listener_(listener), on_accept_(std::move(on_accept)) {}
+
+  Result<void> send(const Message&, const SendOptions&) override {
+    return Status::not_supported("accept pipe cannot send");
+  }
+  Result<Message> recv(const RecvOptions&) override { return Status::not_supported("accept pipe cannot recv"); }
+
+  PollHandle poll_handle() const override { return listener_->poll_handle(); }
+
+  Result<std::size_t> try_recv_batch(std::span<Message> out) override {
+    std::size_t n = 0;
+    while (n < out.size()) {
+      auto p = listener_->try_accept();
+      if (!p.ok()) {
+        if (p.status().code() == StatusCode::kClosed) return p.status();
+        break;  // the connection went away before we took it, or we are out of descriptors
+      }
+      if (!p.value()) break;
+      on_accept_(std::move(p.value()));
+      ++n;
+    }
+    return n;
+  }
+
+  void close() override {}
+
+ private:
+  Listener* listener_;
+  std::function<void(std::unique_ptr<Pipe>)> on_accept_;
+};
+
+void pin_to_cpu(std::thread& t, std::size_t index) {
+#if defined(__linux__)
+  const unsigned cpus = std::max(1u, std::thread::hardware_concurrency());
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(static_cast<int>(index % cpus), &set);
+  (void)::pthread_setaffinity_np(t.native_handle(), sizeof(set), &set);
+#else
+  (void)t;
+  (void)index;
+#endif
+}
+
+}  // namespace
+
+struct Server::Impl {
+  struct Shard {
+    std::size_t index = 0;
+    std::unique_ptr<Reactor> reactor;
+    std::unique_ptr<Listener> listener;  // reuse_port: every shard; otherwise shard 0 (pollable listeners)
+    struct Conn {
+      Reactor::Id id = 0;
+      std::shared_ptr<Pipe> pipe;
+    };
+    std::unordered_map<Pipe*, Conn> pipes;  // loop thread only
+    std::atomic<std::size_t> connections{0};
+    std::thread thread;
+  };
+
+  Handlers handlers;
+  std::string address;
+  std::vector<std::unique_ptr<Shard>> shards;
+  std::unique_ptr<Listener> blocking_listener;  // not pollable: accepted on `acceptor`
+  std::thread acceptor;
+  std::atomic<std::size_t> next_shard{0};
+  std::atomic<bool> stopping{false};
+  bool stopped = false;
+
+  // Hand `pipe` to the next shard round-robin. Any thread.
+  void distribute(std::unique_ptr<Pipe> pipe) {
+    const std::size_t i = next_shard.fetch_add(1, std::memory_order_relaxed) % shards.size();
+    hand_off(*shards[i], std::move(pipe));
+  }
+
+  // Register `pipe` on `shard`, from its own thread. Any thread.
+  void hand_off(Shard& shard, std::unique_ptr<Pipe> pipe) {
+    std::shared_ptr<Pipe> p(std::move(pipe));
+    shard.reactor->post([this, &shard, p]() { adopt(shard, p); });
+  }
+
+  // Loop thread of `shard`.
+  void adopt(Shard& shard, const std::shared_ptr<Pipe>& pipe) {
+    if (stopping.load(std::memory_order_acquire)) {
+      pipe->close();
+      return;
+    }
+    // Counted and announced before registering: the reactor may fail it on the first drain.
+    shard.connections.fetch_add(1, std::memory_order_relaxed);
+    if (handlers.on_open) handlers.on_open(pipe);
+    auto on_message = [this, pipe](const Message& m) {
+      if (handlers.on_message) handlers.on_message(pipe, m);
+    };
+    // The id is only known once add() returns, so the error path looks the pipe up by address.
+    auto on_error = [this, &shard, raw = pipe.get()](const Status& st) { drop(shard, raw, st); };
+    auto id = shard.reactor->add(pipe, std::move(on_message), std::move(on_error));
+    if (!id.ok()) {
+      shard.connections.fetch_sub(1, std::memory_order_relaxed);
+      if (handlers.on_close) handlers.on_close(pipe, id.status());
+      pipe->close();
+      return;
+    }
+    shard.pipes.emplace(pipe.get(), Shard::Conn{id.value(), pipe});
+  }
+
+  // Loop thread of `shard`: the reactor already unregistered the pipe.
+  void drop(Shard& shard, Pipe* raw, const Status& st) {
+    auto it = shard.pipes.find(raw);
+    if (it == shard.pipes.end()) return;
+    std::shared_ptr<Pipe> pipe = std::move(it->second.pipe);
+    shard.pipes.erase(it);
+    shard.connections.fetch_sub(1, std::memory_order_relaxed);
+    if (handlers.on_close) handlers.on_close(pipe, st);
+    pipe->close();
+  }
+
+  // Loop thread of `shard` (or any thread once it has exited): close every connection.
+  void close_all(Shard& shard) {
+    auto pipes = std::move(shard.pipes);
+    shard.pipes.clear();
+    for (auto& [raw, conn] : pipes) {
+      shard.reactor->remove(conn.id);
+      shard.connections.fetch_sub(1, std::memory_order_relaxed);
+      if (handlers.on_close) handlers.on_close(conn.pipe, Status::closed("server stopped"));
+      conn.pipe->close();
+    }
+  }
+};
+
+Server::Server(std::unique_ptr<Impl> impl) : impl_(std::move(impl)) {}
+
+Server::~Server() { stop(); }
+
+Result<std::unique_ptr<Server>> Server::start(const std::string& address, Handlers handlers,
+                                              const ServerOptions& opt) {
+  auto parsed = Address::parse(address);
+  if (!parsed.ok()) return parsed.status();
+  if (opt.reuse_port && parsed.value().scheme != Scheme::kTcp) {
+    return Status::not_supported("reuse_port needs a tcp:// address");
+  }
+
+  auto impl = std::make_unique<Impl>();
+  impl->handlers = std::move(handlers);
+  const std::size_t n = opt.shards != 0 ? opt.shards : std::max(1u, std::thread::hardware_concurrency());
+  for (std::size_t i = 0; i < n; ++i) {
+    auto reactor = Reactor::create(opt.reactor);
+    if (!reactor.ok()) return reactor.status();
+    auto shard = std::make_unique<Impl::Shard>();
+    shard->index = i;
+    shard->reactor = std::move(reactor.value());
+    impl->shards.push_back(std::move(shard));
+  }
+
+  ListenOptions lopt = opt.listen;
+  lopt.reuse_port = opt.reuse_port;
+  auto first = listen(address, lopt);
+  if (!first.ok()) return first.status();
+  auto local = first.value()->local_address();
+  impl->address = local.ok() ? local.value() : address;
+
+  Impl* self = impl.get();
+  if (opt.reuse_port) {
+    // The first listener resolved port 0; the others join it on the effective port.
+    impl->shards[0]->listener = std::move(first.value());
+    for (std::size_t i = 1; i < n; ++i) {
+      auto l = listen(impl->address, lopt);
+      if (!l.ok()) return l.status();
+      impl->shards[i]->listener = std::move(l.value());
+    }
+    for (auto& shard : impl->shards) {
+      Impl::Shard* s = shard.get();
+      auto accept = std::make_shared<AcceptPipe>(s->listener.get(), [self, s](std::unique_ptr<Pipe> p) {
+        self->hand_off(*s, std::move(p));
+      });
+      auto id = s->reactor->add(std::move(accept), nullptr);
+      if (!id.ok()) return id.status();
+    }
+  } else if (first.value()->poll_handle() != kInvalidPollHandle) {
+    impl->shards[0]->listener = std::move(first.value());
+    auto accept = std::make_shared<AcceptPipe>(impl->shards[0]->listener.get(),
+                                               [self](std::unique_ptr<Pipe> p) { self->distribute(std::move(p)); });
+    auto id = impl->shards[0]->reactor->add(std::move(accept), nullptr);
+    if (!id.ok()) return id.status();
+  } else {
+    impl->blocking_listener = std::move(first.value());
+  }
+
+  for (auto& shard : impl->shards) {
+    Impl::Shard* s = shard.get();
+    s->thread = std::thread([s]() {
+      t_shard = s->index;
+      (void)s->reactor->run();
+    });
+    if (opt.pin_shards) pin_to_cpu(s->thread, s->index);
+  }
+  if (impl->blocking_listener) {
+    impl->acceptor = std::thread([self]() {
+      for (;;) {
+        auto p = self->blocking_listener->accept();
+        if (!p.ok()) {
+          if (p.status().code() == StatusCode::kClosed || self->stopping.load(std::memory_order_acquire)) break;
+          continue;
+        }
+        self->distribute(std::move(p.value()));
+      }
+    });
+  }
+  return std::unique_ptr<Server>(new Server(std::move(impl)));
+}
+
+void Server::stop() {
+  Impl& s = *impl_;
+  if (s.stopped) return;
+  s.stopped = true;
+  s.stopping.store(true, std::memory_order_release);
+
+  if (s.blocking_listener) s.blocking_listener->close();
+  if (s.acceptor.joinable()) s.acceptor.join();
+
+  // Each shard closes its own connections, so on_close runs on the shard like every other handler.
+  for (auto& shard : s.shards) {
+    Impl::Shard* sh = shard.get();
+    sh->reactor->post([&s, sh]() {
+      s.close_all(*sh);
+      sh->reactor->stop();
+    });
+  }
+  for (auto& shard : s.shards) {
+    if (shard->thread.joinable()) shard->thread.join();
+  }
+  // A shard whose loop failed never ran its task.
+  for (auto& shard : s.shards) {
+    s.close_all(*shard);
+    if (shard->listener) shard->listener->close();
+  }
+}
+
+const std::string& Server::address() const { return impl_->address; }
+
+std::size_t Server::shard_count() const { return impl_->shards.size(); }
+
+std::size_t Server::connections(std::size_t shard) const {
+  if (shard >= impl_->shards.size()) return 0;
+  return impl_->shards[shard]->connections.load(std::memory_order_relaxed);
+}
+
+std::size_t Server::current_shard() { return t_shard; }
+
+}  // namespace duct
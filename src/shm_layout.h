@@ -0,0 +1,992 @@
+#pragma once
+
+// Shared-memory segment layout shared by the POSIX (shm_transport.cc) and Windows (win_shm.cc)
+// shm:// transports. Everything in here is plain data placed in the mapped segment, plus small
+// process-local helpers that operate on it without blocking; OS primitives (mapping, waiting) stay
+// in the transports.
+//
+// A segment holds two single-producer/single-consumer directions (c2s / s2c) in one of two layouts:
+// - slab: a ring of small descriptors, each pointing at a block in that direction's size-classed
+//   payload slab. The ring stride is 16 bytes and memory is only touched for blocks actually used.
+// - byte ring: length-prefixed records packed back-to-back in one contiguous byte ring, so in-flight
+//   capacity is bounded by bytes rather than by a message count.
+// An entry carries at most kSlotPayloadMax bytes; larger messages are published as runs of
+// fragment entries (FrameFlags::kFrag / kFragCont in the entry flags) and reassembled by the reader.
+//
+// A broadcast segment (ShmBroadcastOptions) is a third layout with a single direction: one writer,
+// any number of readers, and no flow control (see BroadcastLayout).
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
+#include "duct/duct.h"
+#include "duct/protocol.h"
+#include "duct/wire.h"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace duct::shm {
+
+constexpr std::size_t kSlotPayloadMax = 64 * 1024;
+constexpr std::uint16_t kLayoutVersion = 5;
+
+enum class RingKind : std::uint16_t {
+  kSlab = 0,
+  kBytes = 1,
+  kBroadcast = 2,
+};
+
+inline RingKind to_ring_kind(ShmRingLayout layout) {
+  return layout == ShmRingLayout::kByteRing ? RingKind::kBytes : RingKind::kSlab;
+}
+
+// Descriptor ring capacity per direction (messages in flight).
+constexpr std::uint32_t kDescCount = 1024;
+
+// Payload slab size classes, per direction. Most traffic is a few hundred bytes, so the small
+// classes get the most blocks; a send falls through to the next larger class when one runs dry.
+struct SlabClass {
+  std::uint32_t block_size;
+  std::uint32_t block_count;
+};
+
+constexpr std::array<SlabClass, 5> kSlabClasses{{
+    {256, 1024},
+    {1024, 256},
+    {4 * 1024, 64},
+    {16 * 1024, 16},
+    {64 * 1024, 8},
+}};
+
+constexpr std::size_t slab_class_offset(std::size_t cls) {
+  std::size_t off = 0;
+  for (std::size_t i = 0; i < cls; ++i) {
+    off += static_cast<std::size_t>(kSlabClasses[i].block_size) * kSlabClasses[i].block_count;
+  }
+  return off;
+}
+
+constexpr std::size_t kSlabBytes = slab_class_offset(kSlabClasses.size());
+static_assert(kSlabClasses.back().block_size >= kSlotPayloadMax, "largest class must fit max payload");
+
+// Byte ring capacity per direction. Must be a power of two so monotonic 32-bit positions wrap cleanly.
+constexpr std::uint32_t kByteRingBytes = 1024 * 1024;
+static_assert((kByteRingBytes & (kByteRingBytes - 1)) == 0, "byte ring size must be a power of two");
+
+// Byte ring records are a 4-byte length and 4-byte flags (FrameFlags, channel included) followed by
+// the payload, padded to 8 bytes. A length of kWrapMarker means "skip to the start of the ring".
+constexpr std::uint32_t kRecordAlign = 8;
+constexpr std::uint32_t kRecordLen = 4;
+constexpr std::uint32_t kRecordHeader = kRecordLen + 4;
+constexpr std::uint32_t kWrapMarker = 0xffffffffu;
+// Upper bound on records in flight, used to size item counters.
+constexpr std::uint32_t kByteRingMaxRecords = kByteRingBytes / kRecordAlign;
+
+constexpr std::uint32_t record_size(std::size_t len) {
+  return static_cast<std::uint32_t>((kRecordHeader + len + kRecordAlign - 1) & ~std::size_t{kRecordAlign - 1});
+}
+
+// Block ids carry the class in the top byte and the block index in the low 24 bits.
+constexpr std::uint32_t make_block_id(std::uint32_t cls, std::uint32_t index) { return (cls << 24) | index; }
+constexpr std::uint32_t block_class(std::uint32_t id) { return id >> 24; }
+constexpr std::uint32_t block_index(std::uint32_t id) { return id & 0x00ffffffu; }
+
+struct ShmHeader {
+  std::uint32_t magic = kProtocolMagic;
+  std::uint16_t version = kLayoutVersion;
+  RingKind kind = RingKind::kSlab;
+  std::uint64_t size = 0;  // total mapped size, checked by the accepting side
+  // Pooled segments (ShmOptions::from_listener_pool): ends still using it. Each end decrements it
+  // as the last thing it does to the segment, so the listener may reuse it once it reads 0.
+  std::atomic_uint32_t attached{0};
+};
+
+// head and tail live on separate cache lines. Each side's waiting flag sits next to the word the
+// *other* side writes, so a publish touches only the line it already owns.
+struct RingMeta {
+  alignas(64) std::atomic_uint32_t head{0};  // producer increments
+  std::atomic_uint32_t consumer_waiting{0};  // kParked / kArmed: consumer is parked on head or polling
+  alignas(64) std::atomic_uint32_t tail{0};  // consumer increments
+  std::atomic_uint32_t producer_waiting{0};  // kParked: producer is parked on tail
+};
+
+// Bits of a waiting word. kParked: the side is blocked in the OS on the peer's ring word. kArmed
+// (consumer only): the side sleeps in a poller on its notification descriptor; the first publish
+// that sees the bit clears it and signals the descriptor once, so wakeups are edge-triggered and
+// a consumer that is busy draining (disarmed) costs the producer nothing.
+constexpr std::uint32_t kParked = 1u << 0;
+constexpr std::uint32_t kArmed = 1u << 1;
+
+// Parking uses the ring words themselves as futex/ulock addresses.
+static_assert(sizeof(std::atomic_uint32_t) == sizeof(std::uint32_t), "ring words must be plain 32-bit");
+static_assert(std::atomic_uint32_t::is_always_lock_free, "ring words must be lock-free");
+
+struct Desc {
+  std::uint32_t offset = 0;  // payload offset from the start of the direction's slab
+  std::uint32_t len = 0;
+  std::uint32_t block = 0;   // slab block id; handed back to the producer once tail passes it
+  std::uint32_t flags = 0;   // FrameFlags, channel included
+};
+
+struct Ring {
+  RingMeta meta;
+  Desc descs[kDescCount];
+};
+
+struct alignas(64) Slab {
+  // Deliberately no initializer: a fresh segment is zero-filled by the OS, and leaving the slab
+  // alone keeps untouched blocks out of RSS.
+  std::uint8_t bytes[kSlabBytes];
+};
+
+struct SlabLayout {
+  ShmHeader hdr;
+  Ring c2s;  // client to server
+  Ring s2c;  // server to client
+  Slab c2s_slab;
+  Slab s2c_slab;
+};
+
+struct ByteRing {
+  RingMeta meta;  // head/tail are byte positions
+  alignas(64) std::uint8_t bytes[kByteRingBytes];
+};
+
+struct ByteRingLayout {
+  ShmHeader hdr;
+  ByteRing c2s;
+  ByteRing s2c;
+};
+
+constexpr std::size_t segment_size(RingKind kind) {
+  return kind == RingKind::kBytes ? sizeof(ByteRingLayout) : sizeof(SlabLayout);
+}
+
+// Construct a fresh segment in place. The mapping is already zero-filled, so only the header and
+// ring metadata are written.
+inline ShmHeader* init_segment(void* base, RingKind kind) {
+  ShmHeader* hdr = nullptr;
+  if (kind == RingKind::kBytes) {
+    hdr = &(new (base) ByteRingLayout)->hdr;
+  } else {
+    hdr = &(new (base) SlabLayout)->hdr;
+  }
+  hdr->kind = kind;
+  hdr->size = segment_size(kind);
+  return hdr;
+}
+
+// Make a pooled segment that both ends have let go of look fresh. Payload bytes stay as they are:
+// consumers only read what is published after this.
+inline void reset_segment(ShmHeader* hdr) { init_segment(hdr, hdr->kind); }
+
+// Validate the header of a segment mapped by the accepting side.
+inline bool segment_valid(const ShmHeader* hdr, std::size_t mapped) {
+  if (mapped < sizeof(ShmHeader)) return false;
+  if (hdr->magic != kProtocolMagic || hdr->version != kLayoutVersion) return false;
+  if (hdr->kind != RingKind::kSlab && hdr->kind != RingKind::kBytes) return false;
+  return hdr->size == segment_size(hdr->kind) && mapped >= hdr->size;
+}
+
+// Process-local block allocator for the producer side of one direction. Only the producer hands
+// out blocks; they come back when the consumer advances `tail` past the descriptor that used them,
+// so no cross-process free list is needed.
+class SlabAllocator {
+ public:
+  SlabAllocator() {
+    for (std::size_t c = 0; c < kSlabClasses.size(); ++c) {
+      auto& list = free_[c];
+      list.reserve(kSlabClasses[c].block_count);
+      // Push in reverse so low indices are handed out first.
+      for (std::uint32_t i = kSlabClasses[c].block_count; i != 0; --i) {
+        list.push_back(make_block_id(static_cast<std::uint32_t>(c), i - 1));
+      }
+    }
+  }
+
+  // Return blocks of every descriptor the consumer has released since the last call.
+  void reclaim(const Ring& ring) {
+    std::uint32_t tail = ring.meta.tail.load(std::memory_order_acquire);
+    while (reclaimed_ != tail) {
+      std::uint32_t id = ring.descs[reclaimed_ % kDescCount].block;
+      std::uint32_t cls = block_class(id);
+      if (cls < kSlabClasses.size()) free_[cls].push_back(id);
+      ++reclaimed_;
+    }
+  }
+
+  // Hand back a block that was allocated but never published.
+  void put_back(std::uint32_t id) {
+    std::uint32_t cls = block_class(id);
+    if (cls < kSlabClasses.size()) free_[cls].push_back(id);
+  }
+
+  // Smallest free block that fits `len`; false if every fitting class is exhausted.
+  bool alloc(std::size_t len, std::uint32_t* id) {
+    for (std::size_t c = 0; c < kSlabClasses.size(); ++c) {
+      if (kSlabClasses[c].block_size < len) continue;
+      if (free_[c].empty()) continue;
+      *id = free_[c].back();
+      free_[c].pop_back();
+      return true;
+    }
+    return false;
+  }
+
+ private:
+  std::array<std::vector<std::uint32_t>, kSlabClasses.size()> free_;
+  std::uint32_t reclaimed_ = 0;
+};
+
+inline std::uint32_t block_offset(std::uint32_t id) {
+  std::uint32_t cls = block_class(id);
+  return static_cast<std::uint32_t>(slab_class_offset(cls) +
+                                    static_cast<std::size_t>(block_index(id)) * kSlabClasses[cls].block_size);
+}
+
+// Validate a descriptor read from shared memory before touching the payload it points at.
+inline bool desc_in_bounds(const Desc& d) {
+  return d.len <= kSlotPayloadMax && d.offset <= kSlabBytes && d.len <= kSlabBytes - d.offset;
+}
+
+// Spin-then-park notification. A side that runs out of work spins briefly on the peer's ring word,
+// then raises its waiting flag, re-checks and parks in the OS. The peer only issues a wake when the
+// flag is up, so while both sides keep up the path stays free of syscalls.
+constexpr int kSpinIterations = 256;
+
+inline void cpu_relax() {
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+  _mm_pause();
+#elif defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  __asm__ __volatile__("yield");
+#endif
+}
+
+// Wait until `word` moves away from `seen`. `park(seen, timeout)` blocks in the OS until woken,
+// timed out or spuriously released; callers re-check their condition and loop.
+template <class Park>
+Result<void> wait_change(std::atomic_uint32_t& word, std::uint32_t seen, std::atomic_uint32_t& waiting,
+                         std::chrono::milliseconds timeout, Park&& park) {
+  for (int i = 0; i < kSpinIterations; ++i) {
+    if (word.load(std::memory_order_acquire) != seen) return {};
+    cpu_relax();
+  }
+  // Pairs with the fence in notify_change: either the peer sees our flag, or we see its update.
+  waiting.fetch_or(kParked, std::memory_order_seq_cst);
+  Result<void> st;
+  if (word.load(std::memory_order_seq_cst) == seen) st = park(seen, timeout);
+  waiting.fetch_and(~kParked, std::memory_order_relaxed);
+  return st;
+}
+
+// Call after publishing a ring word; wakes the peer only if it announced that it is parked.
+template <class Wake>
+void notify_change(const std::atomic_uint32_t& waiting, Wake&& wake) {
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if ((waiting.load(std::memory_order_relaxed) & kParked) != 0) wake();
+}
+
+// Producer-side notify for a consumer that may also be armed on a notification descriptor:
+// `wake` for a parked consumer, `signal` at most once per arming.
+template <class Wake, class Signal>
+void notify_consumer(std::atomic_uint32_t& waiting, Wake&& wake, Signal&& signal) {
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  std::uint32_t w = waiting.load(std::memory_order_relaxed);
+  if ((w & kParked) != 0) wake();
+  if ((w & kArmed) != 0 && (waiting.fetch_and(~kArmed, std::memory_order_acq_rel) & kArmed) != 0) signal();
+}
+
+// Producer side of one direction. Pushes never block; callers wait on their notification primitive
+// and retry when they make no progress. Writes are staged at a private head and become visible to
+// the consumer with a single release store, so a batch costs one publish.
+class TxRing {
+ public:
+  TxRing() = default;
+  TxRing(ShmHeader* seg, bool c2s) : kind_(seg->kind) {
+    if (kind_ == RingKind::kBytes) {
+      auto* l = reinterpret_cast<ByteRingLayout*>(seg);
+      ByteRing& r = c2s ? l->c2s : l->s2c;
+      meta_ = &r.meta;
+      bytes_ = r.bytes;
+    } else {
+      auto* l = reinterpret_cast<SlabLayout*>(seg);
+      ring_ = c2s ? &l->c2s : &l->s2c;
+      meta_ = &ring_->meta;
+      bytes_ = c2s ? l->c2s_slab.bytes : l->s2c_slab.bytes;
+    }
+    head_ = meta_->head.load(std::memory_order_relaxed);
+  }
+
+  RingMeta& meta() { return *meta_; }
+
+  // Copy up to `count` messages into the ring, in order, and publish them together, each entry
+  // carrying `flags`. Returns how many fit right now (0 if the first one does not).
+  std::size_t try_push_batch(const Message* msgs, std::size_t count, std::uint32_t flags) {
+    cancel_reservation();
+    std::size_t n = 0;
+    while (n < count && stage(msgs[n].data(), msgs[n].size(), flags)) ++n;
+    if (n != 0) meta_->head.store(head_, std::memory_order_release);
+    return n;
+  }
+
+  // One entry of `n` bytes (a fragment, when a message is split), published on its own. False if
+  // it does not fit right now.
+  bool try_push(const std::uint8_t* p, std::size_t n, std::uint32_t flags) {
+    cancel_reservation();
+    if (!stage(p, n, flags)) return false;
+    meta_->head.store(head_, std::memory_order_release);
+    return true;
+  }
+
+  // In-place send: room for one message of up to `n` bytes, to be written directly where the
+  // consumer will read it. Returns nullptr if it does not fit right now. Nothing is visible until
+  // commit(); another reserve() or push drops an uncommitted reservation.
+  std::uint8_t* try_reserve(std::size_t n) {
+    cancel_reservation();
+    std::uint8_t* p = kind_ == RingKind::kBytes ? reserve_bytes(n) : reserve_slab(n);
+    if (p) reserved_len_ = static_cast<std::uint32_t>(n);
+    return p;
+  }
+
+  bool reserved() const { return reserved_len_ != kNoReservation; }
+
+  // Drop an uncommitted reservation, if any.
+  void cancel_reservation() {
+    if (!reserved()) return;
+    if (kind_ == RingKind::kSlab) slab_.put_back(reserved_block_);
+    reserved_len_ = kNoReservation;
+  }
+  std::size_t reserved_len() const { return reserved_len_; }
+
+  // Publish the first `len` (<= reserved_len()) bytes of the reservation as one message.
+  void commit(std::size_t len, std::uint32_t flags) {
+    std::uint32_t n = static_cast<std::uint32_t>(len);
+    if (kind_ == RingKind::kBytes) {
+      std::uint32_t head = head_;
+      if (reserved_pos_ != (head & (kByteRingBytes - 1))) {
+        std::memcpy(bytes_ + (head & (kByteRingBytes - 1)), &kWrapMarker, kRecordLen);
+        head += kByteRingBytes - (head & (kByteRingBytes - 1));
+      }
+      write_record_header(reserved_pos_, n, flags);
+      head_ = head + record_size(n);
+    } else {
+      Desc& d = ring_->descs[head_ % kDescCount];
+      d.offset = block_offset(reserved_block_);
+      d.len = n;
+      d.block = reserved_block_;
+      d.flags = flags;
+      head_ += 1;
+    }
+    reserved_len_ = kNoReservation;
+    meta_->head.store(head_, std::memory_order_release);
+  }
+
+ private:
+  static constexpr std::uint32_t kNoReservation = 0xffffffffu;
+
+  std::uint8_t* reserve_slab(std::size_t n) {
+    slab_.reclaim(*ring_);
+    if (head_ - meta_->tail.load(std::memory_order_acquire) >= kDescCount) return nullptr;
+    if (!slab_.alloc(n, &reserved_block_)) return nullptr;
+    return bytes_ + block_offset(reserved_block_);
+  }
+
+  // The wrap marker (if any) is only written on commit, once the record is known to be used.
+  std::uint8_t* reserve_bytes(std::size_t n) {
+    std::uint32_t rec = record_size(n);
+    std::uint32_t used = head_ - meta_->tail.load(std::memory_order_acquire);
+    std::uint32_t pos = head_ & (kByteRingBytes - 1);
+    std::uint32_t to_end = kByteRingBytes - pos;
+    std::uint32_t need = rec <= to_end ? rec : to_end + rec;
+    if (need > kByteRingBytes - used) return nullptr;
+    reserved_pos_ = rec <= to_end ? pos : 0;
+    return bytes_ + reserved_pos_ + kRecordHeader;
+  }
+
+  bool stage(const std::uint8_t* p, std::size_t n, std::uint32_t flags) {
+    return kind_ == RingKind::kBytes ? stage_bytes(p, n, flags) : stage_slab(p, n, flags);
+  }
+
+  void write_record_header(std::uint32_t pos, std::uint32_t len, std::uint32_t flags) {
+    std::memcpy(bytes_ + pos, &len, kRecordLen);
+    std::memcpy(bytes_ + pos + kRecordLen, &flags, kRecordHeader - kRecordLen);
+  }
+
+  bool stage_slab(const std::uint8_t* p, std::size_t n, std::uint32_t flags) {
+    slab_.reclaim(*ring_);
+    std::uint32_t head = head_;
+    if (head - meta_->tail.load(std::memory_order_acquire) >= kDescCount) return false;
+    std::uint32_t block = 0;
+    if (!slab_.alloc(n, &block)) return false;
+
+    Desc& d = ring_->descs[head % kDescCount];
+    d.offset = block_offset(block);
+    d.len = static_cast<std::uint32_t>(n);
+    d.block = block;
+    d.flags = flags;
+    if (n != 0) std::memcpy(bytes_ + d.offset, p, n);
+    ++wire::thread_io().copies;
+    head_ = head + 1;
+    return true;
+  }
+
+  bool stage_bytes(const std::uint8_t* p, std::size_t n, std::uint32_t flags) {
+    std::uint32_t rec = record_size(n);
+    std::uint32_t head = head_;
+    std::uint32_t used = head - meta_->tail.load(std::memory_order_acquire);
+    std::uint32_t pos = head & (kByteRingBytes - 1);
+    std::uint32_t to_end = kByteRingBytes - pos;
+    // A record never straddles the end: if it does not fit, the tail of the ring is skipped.
+    std::uint32_t need = rec <= to_end ? rec : to_end + rec;
+    if (need > kByteRingBytes - used) return false;
+
+    if (rec > to_end) {
+      std::memcpy(bytes_ + pos, &kWrapMarker, kRecordLen);
+      head += to_end;
+      pos = 0;
+    }
+    write_record_header(pos, static_cast<std::uint32_t>(n), flags);
+    if (n != 0) std::memcpy(bytes_ + pos + kRecordHeader, p, n);
+    ++wire::thread_io().copies;
+    head_ = head + rec;
+    return true;
+  }
+
+  RingKind kind_ = RingKind::kSlab;
+  RingMeta* meta_ = nullptr;
+  std::uint32_t head_ = 0;  // staged position; meta_->head trails it until the batch is published
+  std::uint32_t reserved_len_ = kNoReservation;
+  std::uint32_t reserved_block_ = 0;  // slab: block backing the reservation
+  std::uint32_t reserved_pos_ = 0;    // byte ring: record offset (0 when the record wraps)
+  Ring* ring_ = nullptr;
+  std::uint8_t* bytes_ = nullptr;
+  SlabAllocator slab_;
+};
+
+// Consumer side of one direction. Entries are consumed at a private cursor; `tail`, which hands
+// space back to the producer, trails it while entries are still leased out (see LeaseTable).
+class RxRing {
+ public:
+  // A consumed entry whose payload is still in the ring. `end` is the tail position just past it.
+  struct Slot {
+    const std::uint8_t* data = nullptr;
+    std::uint32_t len = 0;
+    std::uint32_t end = 0;
+    std::uint32_t flags = 0;
+  };
+
+  RxRing() = default;
+  RxRing(ShmHeader* seg, bool c2s) : kind_(seg->kind) {
+    if (kind_ == RingKind::kBytes) {
+      auto* l = reinterpret_cast<ByteRingLayout*>(seg);
+      ByteRing& r = c2s ? l->c2s : l->s2c;
+      meta_ = &r.meta;
+      bytes_ = r.bytes;
+    } else {
+      auto* l = reinterpret_cast<SlabLayout*>(seg);
+      ring_ = c2s ? &l->c2s : &l->s2c;
+      meta_ = &ring_->meta;
+      bytes_ = c2s ? l->c2s_slab.bytes : l->s2c_slab.bytes;
+    }
+    cursor_ = meta_->tail.load(std::memory_order_relaxed);
+  }
+
+  RingMeta& meta() { return *meta_; }
+
+  // Position of the next unconsumed entry; the ring is empty while head equals it.
+  std::uint32_t cursor() const { return cursor_; }
+
+  // Pop up to `max` already-published messages into `out` and hand their space back to the producer
+  // with a single tail store. Fragments go through `ra` and count once their message completes, so
+  // the space may move on (cursor() changes) with nothing popped. Returns the number popped (0 if
+  // empty). A malformed entry written by the peer is an error only when nothing precedes it;
+  // otherwise the good prefix is returned first.
+  Result<std::size_t> try_pop_batch(Message* out, std::size_t max, wire::Reassembler& ra) {
+    const std::uint32_t start = cursor_;
+    auto n = consume(max, [&](std::size_t i, const Slot& s) {
+      const std::uint16_t channel = frame_channel(s.flags);
+      if (wire::is_fragment(s.flags)) return ra.add_fragment({s.data, s.len}, channel, s.flags, &out[i]);
+      ra.on_whole(channel);
+      out[i] = Message::from_bytes(s.data, s.len);
+      ++wire::thread_io().copies;
+      wire::set_frame_meta(out[i], s.flags);
+      return true;
+    });
+    if (cursor_ != start) meta_->tail.store(cursor_, std::memory_order_release);
+    return n;
+  }
+
+  // Like try_pop_batch, but leaves the payloads in place (and fragments unassembled): nothing is
+  // handed back until the caller stores a later tail itself.
+  Result<std::size_t> try_take_batch(Slot* out, std::size_t max) {
+    return consume(max, [&](std::size_t i, const Slot& s) {
+      out[i] = s;
+      return true;
+    });
+  }
+
+ private:
+  // `sink(i, slot)` returns whether it filled output `i`.
+  template <class Sink>
+  Result<std::size_t> consume(std::size_t max, Sink&& sink) {
+    std::uint32_t head = meta_->head.load(std::memory_order_acquire);
+    std::size_t n = 0;
+    Status err;
+    while (n < max && cursor_ != head) {
+      Slot s;
+      auto st = kind_ == RingKind::kBytes ? take_bytes(head, &s) : take_slab(&s);
+      if (!st.ok()) {
+        err = st.status();
+        break;
+      }
+      cursor_ = s.end;
+      if (sink(n, s)) ++n;
+    }
+    if (n == 0 && !err.ok()) return err;
+    return n;
+  }
+
+  Result<void> take_slab(Slot* out) {
+    Desc d = ring_->descs[cursor_ % kDescCount];
+    if (!desc_in_bounds(d)) {
+      return Status::protocol_error("shm descriptor out of bounds");
+    }
+    out->data = bytes_ + d.offset;
+    out->len = d.len;
+    out->end = cursor_ + 1;
+    out->flags = d.flags;
+    return {};
+  }
+
+  Result<void> take_bytes(std::uint32_t head, Slot* out) {
+    std::uint32_t tail = cursor_;
+
+    std::uint32_t pos = tail & (kByteRingBytes - 1);
+    std::uint32_t len = 0;
+    std::memcpy(&len, bytes_ + pos, kRecordLen);
+    if (len == kWrapMarker) {
+      tail += kByteRingBytes - pos;
+      pos = 0;
+      if (tail == head) return Status::protocol_error("shm byte ring wrap without record");
+      std::memcpy(&len, bytes_, kRecordLen);
+    }
+    if (len > kSlotPayloadMax || record_size(len) > kByteRingBytes - pos || record_size(len) > head - tail) {
+      return Status::protocol_error("shm byte ring record out of bounds");
+    }
+    out->data = bytes_ + pos + kRecordHeader;
+    out->len = len;
+    out->end = tail + record_size(len);
+    std::memcpy(&out->flags, bytes_ + pos + kRecordLen, kRecordHeader - kRecordLen);
+    return {};
+  }
+
+  RingKind kind_ = RingKind::kSlab;
+  RingMeta* meta_ = nullptr;
+  std::uint32_t cursor_ = 0;  // consumed position; meta_->tail trails it while entries are leased
+  Ring* ring_ = nullptr;
+  const std::uint8_t* bytes_ = nullptr;
+};
+
+// Zero-copy receive for one RX direction: payloads larger than Message::kInlineCapacity are handed
+// out as Messages pointing straight into the ring, and an entry's space goes back to the producer
+// only when the last reference to its Message drops. Leases may be dropped in any order and on any
+// thread; tail advances across the released prefix. Entries copied out meanwhile (small payloads,
+// or every lease slot in use) ride along with the lease before them.
+//
+// Lives on the heap and is owned jointly by the pipe and its outstanding leases, so Messages may
+// outlive the pipe: on close the pipe detaches and leaves unmapping the segment to the last lease.
+class LeaseTable {
+ public:
+  // Wakes a producer parked on tail; only called after notify_change saw its flag.
+  using Wake = std::function<void()>;
+
+  LeaseTable(RingMeta* meta, Wake wake) : meta_(meta), wake_(std::move(wake)) {}
+  LeaseTable(const LeaseTable&) = delete;
+  LeaseTable& operator=(const LeaseTable&) = delete;
+
+  // Turn consumed slots into messages, in order; returns how many were written to `out`. Fragments
+  // are copied into `ra` and never leased.
+  std::size_t hand_out(const RxRing::Slot* slots, std::size_t n, Message* out, wire::Reassembler& ra) {
+    bool copied = false;
+    std::uint32_t copied_end = 0;
+    std::size_t k = 0;
+    for (std::size_t i = 0; i < n; ++i) {
+      const RxRing::Slot& s = slots[i];
+      const std::uint16_t channel = frame_channel(s.flags);
+      if (wire::is_fragment(s.flags)) {
+        if (ra.add_fragment({s.data, s.len}, channel, s.flags, &out[k])) ++k;
+        copied = true;
+        copied_end = s.end;
+        continue;
+      }
+      ra.on_whole(channel);
+      if (s.len > Message::kInlineCapacity) {
+        if (copied) consumed(copied_end);
+        copied = false;
+        if (Entry* e = reserve(s.end)) {
+          e->bytes = const_cast<std::uint8_t*>(s.data);
+          e->capacity = s.len;
+          out[k] = Message::from_block(e, e->bytes, s.len);
+          wire::set_frame_meta(out[k++], s.flags);
+          continue;
+        }
+      }
+      out[k] = Message::from_bytes(s.data, s.len);
+      ++wire::thread_io().copies;
+      wire::set_frame_meta(out[k++], s.flags);
+      copied = true;
+      copied_end = s.end;
+    }
+    if (copied) consumed(copied_end);
+    return k;
+  }
+
+  // Called by the pipe on close instead of unmapping. `unmap` runs once no lease is left (maybe now).
+  void detach(std::function<void()> unmap) {
+    bool last = false;
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      detached_ = true;
+      unmap_ = std::move(unmap);
+      last = --refs_ == 0;
+    }
+    if (last) destroy();
+  }
+
+ private:
+  struct Entry : detail::MessageBlock {
+    LeaseTable* owner = nullptr;
+    std::uint32_t end = 0;  // tail position this entry (and copies riding on it) releases up to
+    bool released = false;
+  };
+
+  static void release_entry(detail::MessageBlock* b) {
+    auto* e = static_cast<Entry*>(b);
+    e->owner->release(e);
+  }
+
+  Entry* reserve(std::uint32_t end) {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (count_ == kDescCount) return nullptr;
+    Entry& e = entries_[(first_ + count_) % kDescCount];
+    ++count_;
+    ++refs_;
+    e.refs.store(1, std::memory_order_relaxed);
+    e.size_class = 0;
+    e.release = &release_entry;
+    e.owner = this;
+    e.end = end;
+    e.released = false;
+    return &e;
+  }
+
+  // An entry that was copied out. With nothing leased before it, its space goes back right away.
+  void consumed(std::uint32_t end) {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (count_ == 0) {
+      publish_locked(end);
+    } else {
+      entries_[(first_ + count_ - 1) % kDescCount].end = end;
+    }
+  }
+
+  void release(Entry* e) {
+    bool last = false;
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      e->released = true;
+      bool moved = false;
+      std::uint32_t end = 0;
+      while (count_ != 0 && entries_[first_].released) {
+        end = entries_[first_].end;
+        first_ = (first_ + 1) % kDescCount;
+        --count_;
+        moved = true;
+      }
+      if (moved) publish_locked(end);
+      last = --refs_ == 0;
+    }
+    if (last) destroy();
+  }
+
+  void publish_locked(std::uint32_t end) {
+    meta_->tail.store(end, std::memory_order_release);
+    // After detach the pipe's wake handles are gone; the peer notices the space on its next retry.
+    if (!detached_) notify_change(meta_->producer_waiting, wake_);
+  }
+
+  void destroy() {
+    if (unmap_) unmap_();
+    delete this;
+  }
+
+  std::mutex mu_;
+  RingMeta* meta_ = nullptr;
+  Wake wake_;
+  std::function<void()> unmap_;
+  bool detached_ = false;
+  std::size_t refs_ = 1;  // the pipe plus one per outstanding lease
+  std::uint32_t first_ = 0;  // oldest unreleased lease
+  std::uint32_t count_ = 0;
+  std::array<Entry, kDescCount> entries_;
+};
+
+// Broadcast bus. Records are packed back-to-back in a power-of-two byte ring at monotonic 64-bit
+// positions, as in the byte ring, with a 16-byte header: length, flags (FrameFlags, channel
+// included) and the message's sequence number. The writer never waits: before overwriting it moves
+// `tail` past the records it is about to destroy, and a reader validates each record it copied by
+// checking afterwards that `tail` has not passed it (a seqlock, with `tail` as the sequence).
+// Readers keep their cursors to themselves, so any number of them can follow.
+constexpr std::uint32_t kBroadcastRecordHeader = 16;
+constexpr std::size_t kBroadcastMinRing = 4096;
+
+constexpr std::uint64_t broadcast_record_size(std::size_t len) {
+  return (kBroadcastRecordHeader + len + kRecordAlign - 1) & ~std::uint64_t{kRecordAlign - 1};
+}
+
+struct BroadcastMeta {
+  ShmHeader hdr;
+  std::uint64_t ring_bytes = 0;
+  std::uint64_t writer_pid = 0;  // lets a new publisher tell a crashed one's segment from a live one
+  // Even while (head, next_seq) are consistent, odd while the writer updates them. Readers park on
+  // it: it also moves when the writer closes.
+  alignas(64) std::atomic_uint32_t version{0};
+  std::atomic_uint32_t waiters{0};  // readers parked on version
+  std::atomic_uint32_t closed{0};
+  std::atomic_uint64_t head{0};      // end of the last published record
+  std::atomic_uint64_t next_seq{0};  // sequence number of the record that will start at head
+  alignas(64) std::atomic_uint64_t tail{0};  // oldest record that is still intact
+};
+
+static_assert(std::atomic_uint64_t::is_always_lock_free, "broadcast positions must be lock-free");
+
+// The segment is the metadata followed by the ring.
+struct BroadcastLayout {
+  BroadcastMeta meta;
+  alignas(64) std::uint8_t bytes[1];  // ring_bytes long
+
+  static constexpr std::size_t size(std::size_t ring_bytes) { return offsetof(BroadcastLayout, bytes) + ring_bytes; }
+};
+
+inline BroadcastLayout* init_broadcast(void* base, std::size_t ring_bytes, std::uint64_t writer_pid) {
+  auto* l = new (base) BroadcastLayout;
+  l->meta.hdr.kind = RingKind::kBroadcast;
+  l->meta.hdr.size = BroadcastLayout::size(ring_bytes);
+  l->meta.ring_bytes = ring_bytes;
+  l->meta.writer_pid = writer_pid;
+  return l;
+}
+
+inline bool broadcast_valid(const BroadcastLayout* l, std::size_t mapped) {
+  if (mapped < BroadcastLayout::size(0)) return false;
+  const BroadcastMeta& m = l->meta;
+  if (m.hdr.magic != kProtocolMagic || m.hdr.version != kLayoutVersion || m.hdr.kind != RingKind::kBroadcast) {
+    return false;
+  }
+  const std::uint64_t r = m.ring_bytes;
+  return r >= kBroadcastMinRing && (r & (r - 1)) == 0 && m.hdr.size == BroadcastLayout::size(r) && mapped >= m.hdr.size;
+}
+
+// Wait until `version` moves away from `seen`. Like wait_change, but for many waiters: each one
+// counts itself in `waiters` while parked.
+template <class Park>
+Result<void> wait_version(std::atomic_uint32_t& version, std::uint32_t seen, std::atomic_uint32_t& waiters,
+                          std::chrono::milliseconds timeout, Park&& park) {
+  for (int i = 0; i < kSpinIterations; ++i) {
+    if (version.load(std::memory_order_acquire) != seen) return {};
+    cpu_relax();
+  }
+  // Pairs with the fence in BroadcastTx::publish: either the writer sees us, or we see its update.
+  waiters.fetch_add(1, std::memory_order_seq_cst);
+  Result<void> st;
+  if (version.load(std::memory_order_seq_cst) == seen) st = park(seen, timeout);
+  waiters.fetch_sub(1, std::memory_order_relaxed);
+  return st;
+}
+
+// The writer. Records are staged at a private head and published together; publish() returns
+// whether readers are parked and need a wake.
+class BroadcastTx {
+ public:
+  explicit BroadcastTx(BroadcastLayout* seg)
+      : meta_(&seg->meta), bytes_(seg->bytes), ring_(seg->meta.ring_bytes) {}
+
+  // Largest message one record takes.
+  std::size_t max_payload() const { return ring_ / 4 - kBroadcastRecordHeader; }
+
+  // Stage one record holding `parts` back to back (`len` bytes in all, at most max_payload()).
+  void stage(std::span<const Message> parts, std::size_t len, std::uint32_t flags) {
+    const std::uint64_t rec = broadcast_record_size(len);
+    std::uint64_t pos = head_ & (ring_ - 1);
+    const std::uint64_t to_end = ring_ - pos;
+    // A record never straddles the end: if it does not fit, the rest of the ring is skipped.
+    const std::uint64_t start = rec <= to_end ? head_ : head_ + to_end;
+    // What has to go may reach into records staged since the last publish, which readers cannot
+    // skip to yet: publish those first. A record is at most a quarter of the ring, so that is enough.
+    if (start + rec > ring_ && start + rec - ring_ > published_) publish();
+    make_room(start + rec);
+
+    if (start != head_) {
+      std::memcpy(bytes_ + pos, &kWrapMarker, kRecordLen);
+      pos = 0;
+    }
+    const std::uint32_t n = static_cast<std::uint32_t>(len);
+    std::memcpy(bytes_ + pos, &n, kRecordLen);
+    std::memcpy(bytes_ + pos + kRecordLen, &flags, sizeof(flags));
+    std::memcpy(bytes_ + pos + 8, &seq_, sizeof(seq_));
+    std::uint8_t* p = bytes_ + pos + kBroadcastRecordHeader;
+    for (const Message& m : parts) {
+      if (!m.empty()) std::memcpy(p, m.data(), m.size());
+      p += m.size();
+    }
+    ++wire::thread_io().copies;
+    ++seq_;
+    head_ = start + rec;
+  }
+
+  // Make everything staged visible. True if readers are parked on `version`.
+  bool publish() {
+    if (head_ == published_) return false;
+    const std::uint32_t v = meta_->version.load(std::memory_order_relaxed);
+    meta_->version.store(v + 1, std::memory_order_relaxed);
+    // Orders the records (and the odd version) before the new head.
+    std::atomic_thread_fence(std::memory_order_release);
+    meta_->head.store(head_, std::memory_order_relaxed);
+    meta_->next_seq.store(seq_, std::memory_order_relaxed);
+    meta_->version.store(v + 2, std::memory_order_release);
+    published_ = head_;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return meta_->waiters.load(std::memory_order_relaxed) != 0;
+  }
+
+  // Readers drain what is published, then see kClosed. True if readers are parked.
+  bool close() {
+    publish();
+    meta_->closed.store(1, std::memory_order_release);
+    meta_->version.fetch_add(2, std::memory_order_acq_rel);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return meta_->waiters.load(std::memory_order_relaxed) != 0;
+  }
+
+ private:
+  // Move tail past every record that writing up to `end` overwrites. Readers must see the new tail
+  // before any byte it covers changes, hence the fence.
+  void make_room(std::uint64_t end) {
+    if (end <= ring_ || end - ring_ <= tail_) return;
+    while (tail_ < end - ring_) {
+      const std::uint64_t pos = tail_ & (ring_ - 1);
+      std::uint32_t len = 0;
+      std::memcpy(&len, bytes_ + pos, kRecordLen);
+      tail_ += len == kWrapMarker ? ring_ - pos : broadcast_record_size(len);
+    }
+    meta_->tail.store(tail_, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+  }
+
+  BroadcastMeta* meta_;
+  std::uint8_t* bytes_;
+  std::uint64_t ring_;
+  std::uint64_t head_ = 0;       // staged
+  std::uint64_t published_ = 0;  // meta_->head
+  std::uint64_t tail_ = 0;
+  std::uint64_t seq_ = 0;
+};
+
+// One reader. Sees only what is published after it was created.
+class BroadcastRx {
+ public:
+  explicit BroadcastRx(BroadcastLayout* seg)
+      : meta_(&seg->meta), bytes_(seg->bytes), ring_(seg->meta.ring_bytes) {
+    // A consistent (head, next_seq) pair, so that the first gap in sequence numbers is counted right.
+    for (;;) {
+      const std::uint32_t v = meta_->version.load(std::memory_order_acquire);
+      cursor_ = meta_->head.load(std::memory_order_relaxed);
+      expected_ = meta_->next_seq.load(std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if ((v & 1) == 0 && meta_->version.load(std::memory_order_relaxed) == v) break;
+      cpu_relax();
+    }
+  }
+
+  BroadcastMeta& meta() { return *meta_; }
+
+  // True once the writer has lapped this reader; try_pop_batch() then returns what it read before.
+  bool lapped() const { return lapped_; }
+
+  // Continue from the oldest record still intact. What was skipped shows up as a gap in sequence
+  // numbers on the next read (take_lost()).
+  void skip_to_tail() {
+    cursor_ = meta_->tail.load(std::memory_order_acquire);
+    lapped_ = false;
+  }
+
+  // Messages lost to laps since the last call.
+  std::uint64_t take_lost() { return std::exchange(lost_, 0); }
+
+  // Copy up to `max` published messages into `out`. Stops early when lapped.
+  Result<std::size_t> try_pop_batch(Message* out, std::size_t max) {
+    const std::uint64_t head = meta_->head.load(std::memory_order_acquire);
+    std::size_t n = 0;
+    while (n < max && cursor_ != head && !lapped_) {
+      std::uint64_t pos = cursor_ & (ring_ - 1);
+      std::uint32_t len = 0;
+      std::memcpy(&len, bytes_ + pos, kRecordLen);
+      if (len == kWrapMarker) {
+        if (overwritten(cursor_)) break;
+        cursor_ += ring_ - pos;
+        continue;
+      }
+      std::uint32_t flags = 0;
+      std::uint64_t seq = 0;
+      std::memcpy(&flags, bytes_ + pos + kRecordLen, sizeof(flags));
+      std::memcpy(&seq, bytes_ + pos + 8, sizeof(seq));
+      const std::uint64_t rec = broadcast_record_size(len);
+      if (len > ring_ / 4 || rec > ring_ - pos || rec > head - cursor_) {
+        if (overwritten(cursor_)) break;
+        if (n != 0) break;
+        return Status::protocol_error("shm broadcast record out of bounds");
+      }
+      Message m = Message::from_bytes(bytes_ + pos + kBroadcastRecordHeader, len);
+      if (overwritten(cursor_)) break;
+      ++wire::thread_io().copies;
+      wire::set_frame_meta(m, flags);
+      if (seq != expected_) lost_ += seq - expected_;
+      expected_ = seq + 1;
+      out[n++] = std::move(m);
+      cursor_ += rec;
+    }
+    return n;
+  }
+
+ private:
+  // After reading the record at `pos`: whether the writer may have overwritten it meanwhile.
+  bool overwritten(std::uint64_t pos) {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (pos >= meta_->tail.load(std::memory_order_relaxed)) return false;
+    lapped_ = true;
+    return true;
+  }
+
+  BroadcastMeta* meta_;
+  const std::uint8_t* bytes_;
+  std::uint64_t ring_;
+  std::uint64_t cursor_ = 0;
+  std::uint64_t expected_ = 0;  // sequence number of the record at cursor_
+  std::uint64_t lost_ = 0;
+  bool lapped_ = false;
+};
+
+}  // namespace duct::shm
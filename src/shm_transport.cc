@@ -12,6 +12,8 @@ Result<std::unique_ptr<Pipe>> shm_dial(const std::string& name, const DialOption
 }  // namespace duct
 
 #else
+#include <algorithm>
+#include <array>
 #include <atomic>
 #include <cerrno>
 #include <chrono>
@@ -20,14 +22,21 @@ Result<std::unique_ptr<Pipe>> shm_dial(const std::string& name, const DialOption
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
+#include <limits>
 #include <memory>
+#include <mutex>
+#include <new>
 #include <random>
+#include <span>
 #include <string>
 #include <string_view>
+#include <unordered_map>
 #include <vector>
 
 #include <fcntl.h>
-#include <semaphore.h>
+#include <poll.h>
+#include <signal.h>
 #include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
@@ -35,13 +44,45 @@ Result<std::unique_ptr<Pipe>> shm_dial(const std::string& name, const DialOption
 #include <time.h>
 #include <unistd.h>
 
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#endif
+
+#include "scheduler.h"
+#include "shm_layout.h"
+
+#if defined(MSG_CMSG_CLOEXEC)
+#define MSG_CMSG_CLOEXEC_IF_AVAILABLE MSG_CMSG_CLOEXEC
+#else
+#define MSG_CMSG_CLOEXEC_IF_AVAILABLE 0
+#endif
+
+// A pooled-segment answer can go to a dialer that already gave up; that must not raise SIGPIPE.
+#if defined(MSG_NOSIGNAL)
+#define MSG_NOSIGNAL_IF_AVAILABLE MSG_NOSIGNAL
+#else
+#define MSG_NOSIGNAL_IF_AVAILABLE 0
+#endif
+
+#if defined(__APPLE__)
+// Private but stable libSystem entry points (used by libc++'s atomic wait); the shared variant
+// works across processes mapping the same page.
+extern "C" int __ulock_wait(std::uint32_t operation, void* addr, std::uint64_t value, std::uint32_t timeout_us);
+extern "C" int __ulock_wake(std::uint32_t operation, void* addr, std::uint64_t wake_value);
+#ifndef UL_COMPARE_AND_WAIT_SHARED
+#define UL_COMPARE_AND_WAIT_SHARED 3
+#endif
+#ifndef ULF_WAKE_ALL
+#define ULF_WAKE_ALL 0x00000100
+#endif
+#endif
+
 namespace duct {
 namespace {
 
 #if !defined(_WIN32)
-constexpr std::size_t kSlotPayloadMax = 64 * 1024;
-constexpr std::uint32_t kSlotCount = 64;  // 64 * 64KB = 4MB per ring
-
 static std::string sanitize_name(std::string_view s) {
   std::string out;
   out.reserve(s.size());
@@ -84,96 +125,174 @@ static std::string hex8(std::uint32_t v) {
   return std::string(buf);
 }
 
-#if !defined(__APPLE__)
-static timespec to_abs_timespec(std::chrono::milliseconds dur) {
-  using namespace std::chrono;
+// Time left until `deadline`, clamped to at least 1ms so it is never mistaken for "no timeout".
+static std::chrono::milliseconds remaining_ms(std::chrono::steady_clock::time_point deadline) {
+  auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+  return std::max(left, std::chrono::milliseconds(1));
+}
+
+// Park until `*word` is no longer `seen` (or timeout; 0 = wait forever). Spurious returns are fine.
+static Result<void> park_on(std::atomic_uint32_t* word, std::uint32_t seen, std::chrono::milliseconds timeout) {
+#if defined(__linux__)
   timespec ts{};
-#if defined(CLOCK_REALTIME)
-  ::clock_gettime(CLOCK_REALTIME, &ts);
+  timespec* tsp = nullptr;
+  if (timeout.count() != 0) {
+    ts.tv_sec = static_cast<time_t>(timeout.count() / 1000);
+    ts.tv_nsec = static_cast<long>((timeout.count() % 1000) * 1000000L);
+    tsp = &ts;
+  }
+  // Not FUTEX_PRIVATE_FLAG: the word lives in a mapping shared with the peer process.
+  long rc = ::syscall(SYS_futex, reinterpret_cast<std::uint32_t*>(word), FUTEX_WAIT, seen, tsp, nullptr, 0);
+  if (rc == 0 || errno == EAGAIN || errno == EINTR) return {};
+  if (errno == ETIMEDOUT) return Status::timeout("shm wait timeout");
+  return Status::io_error("futex(FUTEX_WAIT) failed" + errno_suffix());
+#elif defined(__APPLE__)
+  auto us = std::chrono::duration_cast<std::chrono::microseconds>(timeout).count();
+  std::uint32_t timeout_us = us > 0xffffffffLL ? 0xffffffffu : static_cast<std::uint32_t>(us);
+  if (::__ulock_wait(UL_COMPARE_AND_WAIT_SHARED, word, seen, timeout_us) >= 0) return {};
+  if (errno == EINTR || errno == EFAULT) return {};
+  if (errno == ETIMEDOUT) return Status::timeout("shm wait timeout");
+  return Status::io_error("__ulock_wait failed" + errno_suffix());
 #else
-  timeval tv{};
-  ::gettimeofday(&tv, nullptr);
-  ts.tv_sec = tv.tv_sec;
-  ts.tv_nsec = tv.tv_usec * 1000;
+  // No cross-process address wait on this platform; nap-poll.
+  (void)word;
+  (void)seen;
+  (void)timeout;
+  timespec nap{};
+  nap.tv_nsec = 1000 * 1000;  // 1ms
+  (void)::nanosleep(&nap, nullptr);
+  return {};
 #endif
-  auto ns = duration_cast<nanoseconds>(dur).count();
-  ts.tv_sec += static_cast<time_t>(ns / 1000000000LL);
-  ts.tv_nsec += static_cast<long>(ns % 1000000000LL);
-  if (ts.tv_nsec >= 1000000000L) {
-    ts.tv_sec += 1;
-    ts.tv_nsec -= 1000000000L;
-  }
-  return ts;
 }
+
+static void wake_on(std::atomic_uint32_t* word) {
+#if defined(__linux__)
+  (void)::syscall(SYS_futex, reinterpret_cast<std::uint32_t*>(word), FUTEX_WAKE, 1, nullptr, nullptr, 0);
+#elif defined(__APPLE__)
+  (void)::__ulock_wake(UL_COMPARE_AND_WAIT_SHARED, word, 0);
+#else
+  (void)word;
 #endif
+}
 
-static Result<void> sem_wait_opt(sem_t* sem, std::chrono::milliseconds timeout) {
-  if (timeout.count() == 0) {
-    while (::sem_wait(sem) != 0) {
-      if (errno == EINTR) continue;
-      return Status::io_error("sem_wait failed");
+// Every waiter parked on `word` (broadcast readers).
+static void wake_all_on(std::atomic_uint32_t* word) {
+  ++wire::thread_io().writes;
+#if defined(__linux__)
+  (void)::syscall(SYS_futex, reinterpret_cast<std::uint32_t*>(word), FUTEX_WAKE, std::numeric_limits<int>::max(),
+                  nullptr, nullptr, 0);
+#elif defined(__APPLE__)
+  (void)::__ulock_wake(UL_COMPARE_AND_WAIT_SHARED | ULF_WAKE_ALL, word, 0);
+#else
+  (void)word;
+#endif
+}
+
+// Pollable side channel for one pipe: `rx` turns readable when the peer publishes to our RX ring
+// while we are armed, `tx` is how we do the same for the peer. Linux uses one eventfd per
+// direction (both ends write/read the same object); elsewhere a non-blocking pipe per direction.
+// The dialer creates both directions and passes the listener's pair over the bootstrap socket.
+struct Notifier {
+  int rx = -1;
+  int tx = -1;
+
+  void signal() const {
+    ++wire::thread_io().writes;
+#if defined(__linux__)
+    std::uint64_t one = 1;
+    (void)!::write(tx, &one, sizeof(one));
+#else
+    // A full pipe is already readable, so EAGAIN loses nothing.
+    char one = 1;
+    (void)!::write(tx, &one, 1);
+#endif
+  }
+
+  // Reset readability after a wakeup.
+  void drain() const {
+    ++wire::thread_io().reads;
+#if defined(__linux__)
+    std::uint64_t count;
+    (void)!::read(rx, &count, sizeof(count));
+#else
+    char buf[64];
+    while (::read(rx, buf, sizeof(buf)) == static_cast<ssize_t>(sizeof(buf))) {
     }
-    return {};
+#endif
   }
+};
 
-  // macOS historically does not provide sem_timedwait; fall back to trywait loop.
-#if defined(__APPLE__)
-  auto deadline = std::chrono::steady_clock::now() + timeout;
-  for (;;) {
-    if (::sem_trywait(sem) == 0) return {};
-    if (errno == EINTR) continue;
-    if (errno != EAGAIN) return Status::io_error("sem_trywait failed");
+static void close_fd(int* fd) {
+  if (*fd >= 0) {
+    ::close(*fd);
+    *fd = -1;
+  }
+}
 
-    if (std::chrono::steady_clock::now() >= deadline) {
-      return Status::timeout("semaphore wait timeout");
-    }
-    timespec nap{};
-    nap.tv_sec = 0;
-    nap.tv_nsec = 1000 * 1000;  // 1ms
-    (void)::nanosleep(&nap, nullptr);
+static void close_notifier(Notifier* n) {
+  // With eventfd both pairs share objects but never descriptors, so each side closes its own two.
+  close_fd(&n->rx);
+  close_fd(&n->tx);
+}
+
+#if !defined(__linux__)
+static bool set_nonblock_cloexec(int fd) {
+  int fl = ::fcntl(fd, F_GETFL, 0);
+  return fl >= 0 && ::fcntl(fd, F_SETFL, fl | O_NONBLOCK) == 0 && ::fcntl(fd, F_SETFD, FD_CLOEXEC) == 0;
+}
+#endif
+
+// One-way channel: [0] is read (polled) by the consumer, [1] written by the producer.
+static Result<void> make_channel(int fds[2]) {
+#if defined(__linux__)
+  int efd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (efd < 0) return Status::io_error("eventfd() failed" + errno_suffix());
+  int dup = ::fcntl(efd, F_DUPFD_CLOEXEC, 0);
+  if (dup < 0) {
+    ::close(efd);
+    return Status::io_error("fcntl(F_DUPFD_CLOEXEC) failed" + errno_suffix());
   }
+  fds[0] = efd;
+  fds[1] = dup;
 #else
-  timespec ts = to_abs_timespec(timeout);
-  for (;;) {
-    if (::sem_timedwait(sem, &ts) == 0) return {};
-    if (errno == EINTR) continue;
-    if (errno == ETIMEDOUT) return Status::timeout("sem_timedwait timeout");
-    return Status::io_error("sem_timedwait failed");
+  if (::pipe(fds) != 0) return Status::io_error("pipe() failed" + errno_suffix());
+  if (!set_nonblock_cloexec(fds[0]) || !set_nonblock_cloexec(fds[1])) {
+    ::close(fds[0]);
+    ::close(fds[1]);
+    return Status::io_error("fcntl(pipe) failed" + errno_suffix());
   }
 #endif
+  return {};
 }
 
-struct alignas(64) RingMeta {
-  std::atomic_uint32_t head{0};  // producer increments
-  std::atomic_uint32_t tail{0};  // consumer increments
-};
-
-struct Slot {
-  std::uint32_t len = 0;
-  std::uint32_t _pad = 0;
-  std::uint8_t data[kSlotPayloadMax];
-};
-
-struct Ring {
-  RingMeta meta;
-  Slot slots[kSlotCount];
-};
+// Both directions: `client` is kept by the dialer, `server` is sent to the listener.
+static Result<void> make_notifiers(Notifier* client, Notifier* server) {
+  int c2s[2];
+  int s2c[2];
+  auto st = make_channel(c2s);
+  if (!st.ok()) return st;
+  st = make_channel(s2c);
+  if (!st.ok()) {
+    ::close(c2s[0]);
+    ::close(c2s[1]);
+    return st;
+  }
+  *client = Notifier{s2c[0], c2s[1]};
+  *server = Notifier{c2s[0], s2c[1]};
+  return {};
+}
 
-struct ShmLayout {
-  Ring c2s;
-  Ring s2c;
-};
+using shm::kSlotPayloadMax;
+using shm::ShmHeader;
 
-static constexpr std::size_t kShmSize = sizeof(ShmLayout);
+// First byte of a bootstrap message asking the listener for a pooled segment (the second names the
+// layout); connection ids are hex, so they never start with it.
+constexpr char kPoolRequest = '!';
 
 struct ShmNames {
   std::string base;  // already sanitized
   std::string connid;
-  std::string shm;            // shm_open name (must start with '/')
-  std::string c2s_items_sem;  // sem_open names (must start with '/')
-  std::string c2s_spaces_sem;
-  std::string s2c_items_sem;
-  std::string s2c_spaces_sem;
+  std::string shm;    // shm_open name (must start with '/')
   std::string bootstrap_path;  // filesystem path for AF_UNIX
 };
 
@@ -182,7 +301,7 @@ static ShmNames make_names(std::string_view bus_name, std::string connid) {
   n.base = sanitize_name(bus_name);
   n.connid = std::move(connid);
 
-  // macOS/POSIX have tight limits on shm/sem name length. Keep identifiers short:
+  // macOS/POSIX have tight limits on shm name length. Keep identifiers short:
   // - hash8: stable per bus name
   // - conn8: random per connection (32-bit entropy; good enough for local IPC)
   std::string hash8 = hex8(fnv1a_32(n.base));
@@ -190,10 +309,6 @@ static ShmNames make_names(std::string_view bus_name, std::string connid) {
   std::string prefix = "d" + hash8 + conn8;
 
   n.shm = "/" + prefix + "m";
-  n.c2s_items_sem = "/" + prefix + "a";
-  n.c2s_spaces_sem = "/" + prefix + "b";
-  n.s2c_items_sem = "/" + prefix + "c";
-  n.s2c_spaces_sem = "/" + prefix + "d";
 
   // Bootstrap rendezvous is via a filesystem unix socket path.
   n.bootstrap_path = "/tmp/duct_shm_" + hash8 + ".sock";
@@ -246,7 +361,7 @@ static Result<int> uds_connect(std::string_view path) {
 static Result<void> write_all(int fd, const void* p, std::size_t n) {
   const std::uint8_t* cur = static_cast<const std::uint8_t*>(p);
   while (n != 0) {
-    ssize_t w = ::send(fd, cur, n, 0);
+    ssize_t w = ::send(fd, cur, n, MSG_NOSIGNAL_IF_AVAILABLE);
     if (w < 0) {
       if (errno == EINTR) continue;
       return Status::io_error("send() failed" + errno_suffix());
@@ -273,182 +388,616 @@ static Result<void> read_exact(int fd, void* p, std::size_t n) {
   return {};
 }
 
+// Bootstrap message: the connection id, with the listener's two notification descriptors attached
+// as SCM_RIGHTS (and, for a pooled segment, the listener's answer with the segment's). They ride on
+// the first byte, so the receiver collects them from its first recvmsg.
+template <std::size_t N>
+static Result<void> send_with_fds(int sock, const void* p, std::size_t n, const int (&fds)[N]) {
+  alignas(cmsghdr) char ctrl[CMSG_SPACE(sizeof(fds))];
+  std::memset(ctrl, 0, sizeof(ctrl));
+  iovec iov{const_cast<void*>(p), n};
+  msghdr msg{};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctrl;
+  msg.msg_controllen = sizeof(ctrl);
+  cmsghdr* c = CMSG_FIRSTHDR(&msg);
+  c->cmsg_level = SOL_SOCKET;
+  c->cmsg_type = SCM_RIGHTS;
+  c->cmsg_len = CMSG_LEN(sizeof(fds));
+  std::memcpy(CMSG_DATA(c), fds, sizeof(fds));
+
+  ssize_t w;
+  do {
+    w = ::sendmsg(sock, &msg, MSG_NOSIGNAL_IF_AVAILABLE);
+  } while (w < 0 && errno == EINTR);
+  if (w < 0) return Status::io_error("sendmsg(SCM_RIGHTS) failed" + errno_suffix());
+  const std::size_t sent = static_cast<std::size_t>(w);
+  return write_all(sock, static_cast<const std::uint8_t*>(p) + sent, n - sent);
+}
+
+template <std::size_t N>
+static Result<void> recv_with_fds(int sock, void* p, std::size_t n, int (&fds)[N]) {
+  std::fill(std::begin(fds), std::end(fds), -1);
+  alignas(cmsghdr) char ctrl[CMSG_SPACE(sizeof(fds))];
+  iovec iov{p, n};
+  msghdr msg{};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctrl;
+  msg.msg_controllen = sizeof(ctrl);
+
+  ssize_t r;
+  do {
+    r = ::recvmsg(sock, &msg, MSG_CMSG_CLOEXEC_IF_AVAILABLE);
+  } while (r < 0 && errno == EINTR);
+  if (r < 0) return Status::io_error("recvmsg() failed" + errno_suffix());
+  if (r == 0) return Status::closed("peer closed");
+  for (cmsghdr* c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+    if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS && c->cmsg_len == CMSG_LEN(sizeof(fds))) {
+      std::memcpy(fds, CMSG_DATA(c), sizeof(fds));
+    }
+  }
+  auto drop = [&] {
+    for (int& fd : fds) close_fd(&fd);
+  };
+  if (std::find(std::begin(fds), std::end(fds), -1) != std::end(fds) || (msg.msg_flags & MSG_CTRUNC) != 0) {
+    drop();
+    return Status::protocol_error("shm bootstrap message carried no descriptors");
+  }
+#if !defined(MSG_CMSG_CLOEXEC)
+  for (int fd : fds) (void)::fcntl(fd, F_SETFD, FD_CLOEXEC);
+#endif
+  const std::size_t got = static_cast<std::size_t>(r);
+  auto st = read_exact(sock, static_cast<std::uint8_t*>(p) + got, n - got);
+  if (!st.ok()) drop();
+  return st;
+}
+
 struct ShmHandles {
   int shm_fd = -1;
-  ShmLayout* mem = nullptr;
-  sem_t* c2s_items = SEM_FAILED;
-  sem_t* c2s_spaces = SEM_FAILED;
-  sem_t* s2c_items = SEM_FAILED;
-  sem_t* s2c_spaces = SEM_FAILED;
+  ShmHeader* mem = nullptr;
+  std::size_t size = 0;
 };
 
 static void close_handles(ShmHandles* h) {
   if (!h) return;
   if (h->mem) {
-    ::munmap(h->mem, kShmSize);
+    ::munmap(h->mem, h->size);
     h->mem = nullptr;
   }
   if (h->shm_fd >= 0) {
     ::close(h->shm_fd);
     h->shm_fd = -1;
   }
-  if (h->c2s_items != SEM_FAILED) ::sem_close(h->c2s_items);
-  if (h->c2s_spaces != SEM_FAILED) ::sem_close(h->c2s_spaces);
-  if (h->s2c_items != SEM_FAILED) ::sem_close(h->s2c_items);
-  if (h->s2c_spaces != SEM_FAILED) ::sem_close(h->s2c_spaces);
-  h->c2s_items = SEM_FAILED;
-  h->c2s_spaces = SEM_FAILED;
-  h->s2c_items = SEM_FAILED;
-  h->s2c_spaces = SEM_FAILED;
 }
 
-static Result<ShmHandles> create_resources(const ShmNames& n) {
+// Map all of `fd` (ShmOptions::populate / huge_pages). Transparent huge pages have to be asked for
+// before the pages are faulted, so with them the mapping is populated separately.
+static void* map_segment(int fd, std::size_t size, bool populate, bool huge_pages) {
+  int flags = MAP_SHARED;
+#if defined(MAP_POPULATE)
+  if (populate && !huge_pages) flags |= MAP_POPULATE;
+#endif
+  void* p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, flags, fd, 0);
+  if (p == MAP_FAILED || !huge_pages) return p;
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+  (void)::madvise(p, size, MADV_HUGEPAGE);
+#if defined(MADV_POPULATE_WRITE)
+  // Faults as a write would, without writing: safe on a segment the peer is already using.
+  if (populate) (void)::madvise(p, size, MADV_POPULATE_WRITE);
+#endif
+#endif
+  return p;
+}
+
+static Result<ShmHandles> create_resources(const ShmNames& n, shm::RingKind kind, const ShmOptions& opt) {
   ShmHandles h;
+  h.size = shm::segment_size(kind);
 
   h.shm_fd = ::shm_open(n.shm.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
   if (h.shm_fd < 0) {
     return Status::io_error("shm_open(create) failed: " + n.shm + errno_suffix());
   }
-  if (::ftruncate(h.shm_fd, static_cast<off_t>(kShmSize)) != 0) {
+  if (::ftruncate(h.shm_fd, static_cast<off_t>(h.size)) != 0) {
     close_handles(&h);
     ::shm_unlink(n.shm.c_str());
     return Status::io_error("ftruncate(shm) failed" + errno_suffix());
   }
-  void* p = ::mmap(nullptr, kShmSize, PROT_READ | PROT_WRITE, MAP_SHARED, h.shm_fd, 0);
+  void* p = map_segment(h.shm_fd, h.size, opt.populate, opt.huge_pages);
   if (p == MAP_FAILED) {
     close_handles(&h);
     ::shm_unlink(n.shm.c_str());
     return Status::io_error("mmap(shm) failed" + errno_suffix());
   }
-  h.mem = static_cast<ShmLayout*>(p);
-  std::memset(h.mem, 0, kShmSize);
+  // The fresh object is already zero-filled; constructing the layout only writes the header and
+  // ring metadata, so payload pages stay untouched until a message lands in them.
+  h.mem = shm::init_segment(p, kind);
 
-  // Semaphores:
-  // - items start at 0
-  // - spaces start at slot count
-  h.c2s_items = ::sem_open(n.c2s_items_sem.c_str(), O_CREAT | O_EXCL, 0600, 0);
-  h.c2s_spaces = ::sem_open(n.c2s_spaces_sem.c_str(), O_CREAT | O_EXCL, 0600, kSlotCount);
-  h.s2c_items = ::sem_open(n.s2c_items_sem.c_str(), O_CREAT | O_EXCL, 0600, 0);
-  h.s2c_spaces = ::sem_open(n.s2c_spaces_sem.c_str(), O_CREAT | O_EXCL, 0600, kSlotCount);
+  return h;
+}
 
-  if (h.c2s_items == SEM_FAILED || h.c2s_spaces == SEM_FAILED || h.s2c_items == SEM_FAILED ||
-      h.s2c_spaces == SEM_FAILED) {
+// A segment made by the peer, open as `fd` (taken over, closed on failure). The creator picks the
+// layout, so the size comes from the object itself.
+static Result<ShmHandles> map_existing(int fd, bool populate, std::string_view what) {
+  ShmHandles h;
+  h.shm_fd = fd;
+  struct stat sb {};
+  if (::fstat(h.shm_fd, &sb) != 0) {
     close_handles(&h);
-    ::sem_unlink(n.c2s_items_sem.c_str());
-    ::sem_unlink(n.c2s_spaces_sem.c_str());
-    ::sem_unlink(n.s2c_items_sem.c_str());
-    ::sem_unlink(n.s2c_spaces_sem.c_str());
-    ::shm_unlink(n.shm.c_str());
-    return Status::io_error("sem_open(create) failed" + errno_suffix());
+    return Status::io_error("fstat(shm) failed" + errno_suffix());
+  }
+  h.size = static_cast<std::size_t>(sb.st_size);
+  if (h.size < sizeof(ShmHeader)) {
+    close_handles(&h);
+    return Status::protocol_error("shm segment too small: " + std::string(what));
+  }
+  void* p = map_segment(h.shm_fd, h.size, populate, false);
+  if (p == MAP_FAILED) {
+    close_handles(&h);
+    return Status::io_error("mmap(shm) failed" + errno_suffix());
+  }
+  h.mem = static_cast<ShmHeader*>(p);
+  if (!shm::segment_valid(h.mem, h.size)) {
+    close_handles(&h);
+    return Status::protocol_error("shm segment layout mismatch: " + std::string(what));
   }
-
   return h;
 }
 
-static Result<ShmHandles> open_resources(const ShmNames& n) {
-  ShmHandles h;
-  h.shm_fd = ::shm_open(n.shm.c_str(), O_RDWR, 0600);
-  if (h.shm_fd < 0) {
+static Result<ShmHandles> open_resources(const ShmNames& n, const ShmOptions& opt) {
+  int fd = ::shm_open(n.shm.c_str(), O_RDWR, 0600);
+  if (fd < 0) {
     return Status::io_error("shm_open(open) failed: " + n.shm + errno_suffix());
   }
-  void* p = ::mmap(nullptr, kShmSize, PROT_READ | PROT_WRITE, MAP_SHARED, h.shm_fd, 0);
+  return map_existing(fd, opt.populate, n.shm);
+}
+
+// A pooled segment: no name, shared by passing its descriptor. memfd on Linux (hugetlb-backed when
+// asked and available); elsewhere a shm object unlinked as soon as it exists. Pre-faulted.
+static Result<ShmHandles> create_anonymous(shm::RingKind kind, bool huge_pages) {
+  ShmHandles h;
+  const std::size_t size = shm::segment_size(kind);
+  void* p = MAP_FAILED;
+#if defined(__linux__)
+#if defined(MFD_HUGETLB)
+  if (huge_pages) {
+    // hugetlb files come in whole huge pages, and mmap fails when none are reserved.
+    constexpr std::size_t kHugePage = std::size_t{2} << 20;
+    const std::size_t rounded = (size + kHugePage - 1) & ~(kHugePage - 1);
+    int fd = ::memfd_create("duct-shm", MFD_CLOEXEC | MFD_HUGETLB);
+    if (fd >= 0 && ::ftruncate(fd, static_cast<off_t>(rounded)) == 0) {
+      p = map_segment(fd, rounded, true, false);
+    }
+    if (p != MAP_FAILED) {
+      h.shm_fd = fd;
+      h.size = rounded;
+    } else if (fd >= 0) {
+      ::close(fd);
+    }
+  }
+#endif
   if (p == MAP_FAILED) {
-    close_handles(&h);
-    return Status::io_error("mmap(shm) failed" + errno_suffix());
+    h.shm_fd = ::memfd_create("duct-shm", MFD_CLOEXEC);
+    if (h.shm_fd < 0) return Status::io_error("memfd_create() failed" + errno_suffix());
+  }
+#else
+  (void)huge_pages;
+  const std::string name = "/d" + random_conn_id_hex16().substr(0, 12) + "p";
+  h.shm_fd = ::shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+  if (h.shm_fd < 0) return Status::io_error("shm_open(create) failed: " + name + errno_suffix());
+  ::shm_unlink(name.c_str());
+#endif
+  if (p == MAP_FAILED) {
+    h.size = size;
+    if (::ftruncate(h.shm_fd, static_cast<off_t>(h.size)) != 0) {
+      close_handles(&h);
+      return Status::io_error("ftruncate(shm) failed" + errno_suffix());
+    }
+    p = map_segment(h.shm_fd, h.size, true, huge_pages);
+    if (p == MAP_FAILED) {
+      close_handles(&h);
+      return Status::io_error("mmap(shm) failed" + errno_suffix());
+    }
+#if !defined(MAP_POPULATE)
+    // Write faults allocate the pages; the object is still all zeros, so writing zeros is harmless.
+    const std::size_t page = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+    for (std::size_t off = 0; off < h.size; off += page) static_cast<volatile std::uint8_t*>(p)[off] = 0;
+#endif
+  }
+  h.mem = shm::init_segment(p, kind);
+  return h;
+}
+
+// Segments a listener makes ahead of time (ShmOptions::pool_segments) for dialers that ask for one
+// (from_listener_pool), and takes back for reuse once both ends have let go. Shared by the listener
+// and the pipes it accepted, so a pipe closed after the listener still hands its segment back (and
+// it is then dropped).
+class SegmentPool : public std::enable_shared_from_this<SegmentPool> {
+ public:
+  explicit SegmentPool(const ShmOptions& opt)
+      : kind_(shm::to_ring_kind(opt.layout)), target_(opt.pool_segments), huge_pages_(opt.huge_pages) {}
+  ~SegmentPool() { close(); }
+
+  // Top the pool up on a scheduler worker, so neither listen() nor accept() pays for it. Only once
+  // half of it is gone: connections that come and go one at a time are served by the segments
+  // they hand back, rather than by a new one made (and a surplus one dropped) per connection.
+  void fill_later() {
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      if (closed_ || filling_ || target_ == 0 || ready_.size() + returned_.size() > target_ / 2) return;
+      filling_ = true;
+    }
+    detail::Scheduler::instance().submit([self = shared_from_this()] { self->fill(); });
   }
-  h.mem = static_cast<ShmLayout*>(p);
 
-  h.c2s_items = ::sem_open(n.c2s_items_sem.c_str(), 0);
-  h.c2s_spaces = ::sem_open(n.c2s_spaces_sem.c_str(), 0);
-  h.s2c_items = ::sem_open(n.s2c_items_sem.c_str(), 0);
-  h.s2c_spaces = ::sem_open(n.s2c_spaces_sem.c_str(), 0);
+  // A segment of `kind` for one connection, marked as used by both of its ends.
+  Result<ShmHandles> take(shm::RingKind kind) {
+    ShmHandles h;
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      reclaim_locked();
+      if (kind == kind_ && !ready_.empty()) {
+        h = ready_.back();
+        ready_.pop_back();
+      }
+    }
+    if (!h.mem) {
+      auto made = create_anonymous(kind, huge_pages_);
+      if (!made.ok()) return made.status();
+      h = made.value();
+    }
+    h.mem->attached.store(2, std::memory_order_relaxed);
+    fill_later();
+    return h;
+  }
 
-  if (h.c2s_items == SEM_FAILED || h.c2s_spaces == SEM_FAILED || h.s2c_items == SEM_FAILED ||
-      h.s2c_spaces == SEM_FAILED) {
-    close_handles(&h);
-    return Status::io_error("sem_open(open) failed" + errno_suffix());
+  // From an accepted pipe that is done with `h`. Reused once the dialer has let go as well; kept
+  // (with the ready ones) up to pool_segments, oldest dropped first.
+  void give_back(ShmHandles h) {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (closed_ || target_ == 0 || h.mem->kind != kind_) {
+      close_handles(&h);
+      return;
+    }
+    returned_.push_back(h);
+    while (!returned_.empty() && ready_.size() + returned_.size() > target_) {
+      close_handles(&returned_.front());
+      returned_.pop_front();
+    }
   }
 
-  return h;
+  void close() {
+    std::lock_guard<std::mutex> lock(mu_);
+    closed_ = true;
+    for (ShmHandles& h : ready_) close_handles(&h);
+    for (ShmHandles& h : returned_) close_handles(&h);
+    ready_.clear();
+    returned_.clear();
+  }
+
+ private:
+  void fill() {
+    for (;;) {
+      {
+        std::lock_guard<std::mutex> lock(mu_);
+        reclaim_locked();
+        if (closed_ || ready_.size() >= target_) {
+          filling_ = false;
+          return;
+        }
+      }
+      auto made = create_anonymous(kind_, huge_pages_);
+      std::lock_guard<std::mutex> lock(mu_);
+      if (!made.ok() || closed_) {
+        if (made.ok()) close_handles(&made.value());
+        filling_ = false;
+        return;
+      }
+      ready_.push_back(made.value());
+    }
+  }
+
+  // The dialer decrements attached as its last access, so 0 means nobody touches the segment.
+  void reclaim_locked() {
+    for (auto it = returned_.begin(); it != returned_.end();) {
+      if (it->mem->attached.load(std::memory_order_acquire) != 0) {
+        ++it;
+        continue;
+      }
+      shm::reset_segment(it->mem);
+      ready_.push_back(*it);
+      it = returned_.erase(it);
+    }
+  }
+
+  const shm::RingKind kind_;
+  const std::size_t target_;
+  const bool huge_pages_;
+  std::mutex mu_;
+  std::vector<ShmHandles> ready_;
+  std::deque<ShmHandles> returned_;  // waiting for the dialer to let go
+  bool filling_ = false;
+  bool closed_ = false;
+};
+
+// What a pipe does with its segment once nothing uses it any more (after its last lease).
+static void release_segment(ShmHandles h, bool pooled, const std::shared_ptr<SegmentPool>& pool) {
+  if (pooled) h.mem->attached.fetch_sub(1, std::memory_order_release);
+  if (pool) {
+    pool->give_back(h);
+  } else {
+    close_handles(&h);
+  }
 }
 
 class ShmPipe final : public Pipe {
  public:
   // is_client determines which ring is TX vs RX.
-  ShmPipe(ShmHandles h, ShmNames n, bool owner, bool is_client)
-      : h_(h), names_(std::move(n)), owner_(owner), is_client_(is_client) {}
+  // `pooled`: the segment came from a listener's SegmentPool; `pool` is that pool on the listener's
+  // side (null on the dialer's).
+  ShmPipe(ShmHandles h, ShmNames n, Notifier notifier, bool owner, bool is_client, bool zero_copy_recv,
+          const FragmentOptions& fragments, bool pooled = false, std::shared_ptr<SegmentPool> pool = nullptr)
+      : h_(h),
+        names_(std::move(n)),
+        notifier_(notifier),
+        owner_(owner),
+        is_client_(is_client),
+        pooled_(pooled),
+        pool_(std::move(pool)),
+        tx_(h_.mem, /*c2s=*/is_client),
+        rx_(h_.mem, /*c2s=*/!is_client),
+        reassembler_(fragments) {
+    if (zero_copy_recv) {
+      shm::RingMeta* meta = &rx_.meta();
+      leases_ = new shm::LeaseTable(meta, [meta] { wake_on(&meta->tail); });
+    }
+  }
 
   ~ShmPipe() override { close(); }
 
   Result<void> send(const Message& msg, const SendOptions& opt) override {
-    if (!h_.mem) return Status::closed("pipe closed");
-    if (msg.size() > kSlotPayloadMax) {
-      return Status::invalid_argument("message too large; fragmentation TODO");
-    }
+    auto n = send_batch(std::span<const Message>(&msg, 1), opt);
+    if (!n.ok()) return n.status();
+    return {};
+  }
+
+  Result<Message> recv(const RecvOptions& opt) override {
+    Message m;
+    auto n = recv_batch(std::span<Message>(&m, 1), opt);
+    if (!n.ok()) return n.status();
+    return m;
+  }
 
-    Ring* tx = is_client_ ? &h_.mem->c2s : &h_.mem->s2c;
-    sem_t* spaces = is_client_ ? h_.c2s_spaces : h_.s2c_spaces;
-    sem_t* items = is_client_ ? h_.c2s_items : h_.s2c_items;
+  // Everything that fits is published with one head store and at most one wakeup; the ring only
+  // overflows into a second round when the consumer is behind. A message larger than an entry goes
+  // out as a run of fragments, one publish each, so the consumer can free space while it arrives.
+  Result<std::size_t> send_batch(std::span<const Message> msgs, const SendOptions& opt) override {
+    if (!h_.mem) return Status::closed("pipe closed");
 
-    auto st = sem_wait_opt(spaces, opt.timeout);
-    if (!st.ok()) return st;
+    const std::uint32_t flags = wire::send_flags(opt);
+    auto deadline = std::chrono::steady_clock::now() + opt.timeout;
+    std::size_t sent = 0;
+    while (sent < msgs.size()) {
+      auto whole = [&](std::size_t i) {
+        return wire::is_whole_frame(msgs[i], i == 0, i + 1 == msgs.size(), flags, kSlotPayloadMax);
+      };
+      Result<void> st;
+      if (whole(sent)) {
+        std::size_t end = sent + 1;
+        while (end < msgs.size() && whole(end)) ++end;
+        st = push([&] {
+          std::size_t k = tx_.try_push_batch(msgs.data() + sent, end - sent, flags & ~wire::kFragmentFlags);
+          sent += k;
+          return k != 0;
+        }, deadline, opt);
+      } else {
+        const Message& m = msgs[sent];
+        wire::for_each_frame(m, sent == 0, sent + 1 == msgs.size(), flags, [&](std::size_t off, std::size_t len, std::uint32_t ff) {
+          if (st.ok()) st = push([&] { return tx_.try_push(m.data() + off, len, ff); }, deadline, opt);
+        }, kSlotPayloadMax);
+        if (st.ok()) ++sent;
+      }
+      if (!st.ok()) {
+        if (sent == 0) return st.status();
+        break;
+      }
+    }
+    return sent;
+  }
 
-    std::uint32_t head = tx->meta.head.load(std::memory_order_relaxed);
-    std::uint32_t idx = head % kSlotCount;
-    tx->slots[idx].len = static_cast<std::uint32_t>(msg.size());
-    if (msg.size() != 0) {
-      std::memcpy(tx->slots[idx].data, msg.data(), msg.size());
+  // The span is the slab block (or byte-ring record) the consumer will read from.
+  Result<std::span<std::uint8_t>> reserve(std::size_t size, const SendOptions& opt) override {
+    if (!h_.mem) return Status::closed("pipe closed");
+    tx_.cancel_reservation();
+    staged_.cancel();
+    // Too big for one entry: the fallback buffer, sent as fragments on commit.
+    if (size > kSlotPayloadMax) return staged_.reserve(size);
+
+    shm::RingMeta& meta = tx_.meta();
+    auto deadline = std::chrono::steady_clock::now() + opt.timeout;
+    for (;;) {
+      std::uint8_t* p = tx_.try_reserve(size);
+      if (!p) {
+        std::uint32_t seen = meta.tail.load(std::memory_order_acquire);
+        p = tx_.try_reserve(size);
+        if (!p) {
+          auto st = wait_space(seen, deadline, opt);
+          if (!st.ok()) return st.status();
+          continue;
+        }
+      }
+      return std::span<std::uint8_t>(p, size);
     }
-    tx->meta.head.store(head + 1, std::memory_order_release);
-    ::sem_post(items);
-    return {};
   }
 
-  Result<Message> recv(const RecvOptions& opt) override {
+  Result<void> commit(std::size_t len, const SendOptions& opt) override {
     if (!h_.mem) return Status::closed("pipe closed");
+    if (!tx_.reserved()) return staged_.commit(*this, len, opt);
+    if (len > tx_.reserved_len()) return Status::invalid_argument("commit exceeds reservation");
+    shm::RingMeta& meta = tx_.meta();
+    tx_.commit(len, wire::send_flags(opt));
+    notify_consumer(meta);
+    return {};
+  }
 
-    Ring* rx = is_client_ ? &h_.mem->s2c : &h_.mem->c2s;
-    sem_t* items = is_client_ ? h_.s2c_items : h_.c2s_items;
-    sem_t* spaces = is_client_ ? h_.s2c_spaces : h_.c2s_spaces;
+  // Drains everything published past our cursor (up to out.size()) and releases it with one tail
+  // store, or hands it out as leases in zero-copy mode.
+  Result<std::size_t> recv_batch(std::span<Message> out, const RecvOptions& opt) override {
+    if (!h_.mem) return Status::closed("pipe closed");
+    if (out.empty()) return std::size_t{0};
+
+    shm::RingMeta& meta = rx_.meta();
+    auto deadline = std::chrono::steady_clock::now() + opt.timeout;
+    for (;;) {
+      auto popped = drain(out);
+      if (!popped.ok()) return popped.status();
+      if (popped.value() != 0) return popped.value();
+      if (opt.timeout.count() != 0 && std::chrono::steady_clock::now() >= deadline) {
+        return Status::timeout("shm recv timeout");
+      }
+      // Empty means head == our cursor; wait for head to move past it.
+      std::uint32_t seen = rx_.cursor();
+      auto st = shm::wait_change(meta.head, seen, meta.consumer_waiting,
+                                 opt.timeout.count() == 0 ? opt.timeout : remaining_ms(deadline),
+                                 [&](std::uint32_t v, std::chrono::milliseconds t) { return park_on(&meta.head, v, t); });
+      if (!st.ok()) return st.status();
+    }
+  }
 
-    auto st = sem_wait_opt(items, opt.timeout);
-    if (!st.ok()) return st.status();
+  // Readable once the peer publishes after try_recv_batch() came up short.
+  PollHandle poll_handle() const override { return notifier_.rx; }
 
-    std::uint32_t tail = rx->meta.tail.load(std::memory_order_relaxed);
-    std::uint32_t idx = tail % kSlotCount;
-    std::uint32_t len = rx->slots[idx].len;
-    if (len > kSlotPayloadMax) {
-      return Status::protocol_error("shm slot len too large");
+  // Drains until `out` is full or the ring is empty; in the latter case arms the notifier before
+  // returning, so the next publish signals poll_handle() exactly once. While the reactor keeps
+  // calling (full batches) the pipe stays disarmed and the producer issues no wakeups at all.
+  Result<std::size_t> try_recv_batch(std::span<Message> out) override {
+    if (!h_.mem) return Status::closed("pipe closed");
+    if (out.empty()) return std::size_t{0};
+
+    shm::RingMeta& meta = rx_.meta();
+    if (armed_) {
+      // Disarm, and reset the descriptor: whether or not this wakeup came from it, a signal from a
+      // producer that won the bit may be pending there.
+      meta.consumer_waiting.fetch_and(~shm::kArmed, std::memory_order_relaxed);
+      armed_ = false;
+      notifier_.drain();
+    }
+    std::size_t n = 0;
+    for (;;) {
+      auto got = drain(out.subspan(n));
+      if (!got.ok()) {
+        if (n == 0) return got.status();
+        return n;
+      }
+      n += got.value();
+      if (n == out.size()) return n;
+      // Pairs with the fence in notify_consumer: either the producer sees the bit, or we see its
+      // head and keep draining.
+      if (!armed_) {
+        meta.consumer_waiting.fetch_or(shm::kArmed, std::memory_order_seq_cst);
+        armed_ = true;
+      }
+      if (meta.head.load(std::memory_order_seq_cst) == rx_.cursor()) return n;
     }
-
-    Message m = Message::from_bytes(rx->slots[idx].data, len);
-    rx->meta.tail.store(tail + 1, std::memory_order_release);
-    ::sem_post(spaces);
-    return m;
   }
 
   void close() override {
     if (!h_.mem && h_.shm_fd < 0) return;
-    close_handles(&h_);
+    auto release = [h = h_, pooled = pooled_, pool = pool_] { release_segment(h, pooled, pool); };
+    h_ = ShmHandles{};
+    if (leases_) {
+      // Outstanding leases still point into the mapping; the last one to go releases it.
+      leases_->detach(release);
+      leases_ = nullptr;
+    } else {
+      release();
+    }
+    close_notifier(&notifier_);
     if (owner_) {
-      ::sem_unlink(names_.c2s_items_sem.c_str());
-      ::sem_unlink(names_.c2s_spaces_sem.c_str());
-      ::sem_unlink(names_.s2c_items_sem.c_str());
-      ::sem_unlink(names_.s2c_spaces_sem.c_str());
       ::shm_unlink(names_.shm.c_str());
     }
   }
 
  private:
+  // After publishing: futex wake for a parked consumer, descriptor signal for an armed one.
+  void notify_consumer(shm::RingMeta& meta) {
+    shm::notify_consumer(meta.consumer_waiting, [&] { wake_on(&meta.head); }, [&] { notifier_.signal(); });
+  }
+
+  // Retry `try_push` (true once something was published) until it succeeds, waiting for room
+  // within opt.timeout, then wake the consumer.
+  template <class TryPush>
+  Result<void> push(TryPush&& try_push, std::chrono::steady_clock::time_point deadline, const SendOptions& opt) {
+    shm::RingMeta& meta = tx_.meta();
+    for (;;) {
+      if (!try_push()) {
+        // Out of room: snapshot tail, re-check (the consumer may have released in between), then
+        // wait for tail to move.
+        std::uint32_t seen = meta.tail.load(std::memory_order_acquire);
+        if (!try_push()) {
+          auto st = wait_space(seen, deadline, opt);
+          if (!st.ok()) return st;
+          continue;
+        }
+      }
+      notify_consumer(meta);
+      return {};
+    }
+  }
+
+  // Out of room: wait (within opt.timeout) for the consumer to move tail away from `seen`.
+  Result<void> wait_space(std::uint32_t seen, std::chrono::steady_clock::time_point deadline, const SendOptions& opt) {
+    if (opt.timeout.count() != 0 && std::chrono::steady_clock::now() >= deadline) {
+      return Status::timeout("shm ring full (timeout)");
+    }
+    shm::RingMeta& meta = tx_.meta();
+    return shm::wait_change(meta.tail, seen, meta.producer_waiting,
+                            opt.timeout.count() == 0 ? opt.timeout : remaining_ms(deadline),
+                            [&](std::uint32_t v, std::chrono::milliseconds t) { return park_on(&meta.tail, v, t); });
+  }
+
+  Result<std::size_t> drain(std::span<Message> out) {
+    shm::RingMeta& meta = rx_.meta();
+    if (!leases_) {
+      const std::uint32_t start = rx_.cursor();
+      auto popped = rx_.try_pop_batch(out.data(), out.size(), reassembler_);
+      if (rx_.cursor() != start) {
+        shm::notify_change(meta.producer_waiting, [&] { wake_on(&meta.tail); });
+      }
+      return popped;
+    }
+    std::array<shm::RxRing::Slot, 64> slots;
+    auto taken = rx_.try_take_batch(slots.data(), std::min(out.size(), slots.size()));
+    if (!taken.ok()) return taken;
+    return leases_->hand_out(slots.data(), taken.value(), out.data(), reassembler_);
+  }
+
   ShmHandles h_{};
   ShmNames names_{};
+  Notifier notifier_{};
+  bool armed_ = false;  // we set kArmed in the RX ring's waiting word
   bool owner_ = false;
   bool is_client_ = false;
+  bool pooled_ = false;
+  std::shared_ptr<SegmentPool> pool_;
+  shm::TxRing tx_;
+  detail::StagedSend staged_;  // reservations too big for a ring entry
+  shm::RxRing rx_;
+  shm::LeaseTable* leases_ = nullptr;  // zero-copy mode only; detached (not deleted) on close
+  wire::Reassembler reassembler_;
 };
 
 class ShmListener final : public Listener {
  public:
-  explicit ShmListener(ShmNames names, int fd) : names_(std::move(names)), fd_(fd) {}
+  ShmListener(ShmNames names, int fd, const ShmOptions& shm, const FragmentOptions& fragments)
+      : names_(std::move(names)),
+        fd_(fd),
+        shm_(shm),
+        fragments_(fragments),
+        pool_(std::make_shared<SegmentPool>(shm)) {
+    pool_->fill_later();
+  }
   ~ShmListener() override { close(); }
 
   Result<std::unique_ptr<Pipe>> accept() override {
@@ -457,14 +1006,32 @@ class ShmListener final : public Listener {
     if (cfd < 0) return Status::io_error("accept(uds bootstrap) failed" + errno_suffix());
 
     char connid[16];
-    auto st = read_exact(cfd, connid, sizeof(connid));
+    int fds[2];
+    auto st = recv_with_fds(cfd, connid, sizeof(connid), fds);
+    if (!st.ok()) {
+      ::close(cfd);
+      return st.status();
+    }
+    Notifier notifier{fds[0], fds[1]};
+    if (connid[0] == kPoolRequest) {
+#if defined(__APPLE__)
+      int one = 1;
+      (void)::setsockopt(cfd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+      auto p = hand_out(cfd, connid[1], notifier);
+      ::close(cfd);
+      return p;
+    }
     ::close(cfd);
-    if (!st.ok()) return st.status();
 
     ShmNames n = make_names(names_.base, std::string(connid, sizeof(connid)));
-    auto h = open_resources(n);
-    if (!h.ok()) return h.status();
-    return std::unique_ptr<Pipe>(new ShmPipe(h.value(), std::move(n), /*owner=*/false, /*is_client=*/false));
+    auto h = open_resources(n, shm_);
+    if (!h.ok()) {
+      close_notifier(&notifier);
+      return h.status();
+    }
+    return std::unique_ptr<Pipe>(new ShmPipe(h.value(), std::move(n), notifier, /*owner=*/false,
+                                         /*is_client=*/false, shm_.zero_copy_recv, fragments_));
   }
 
   Result<std::string> local_address() const override { return std::string("shm://") + names_.base; }
@@ -475,55 +1042,425 @@ class ShmListener final : public Listener {
       fd_ = -1;
       // Keep path cleanup best-effort.
       ::unlink(names_.bootstrap_path.c_str());
+      pool_->close();
     }
   }
 
  private:
+  // Answer a from_listener_pool dialer with a segment of the layout it asked for.
+  Result<std::unique_ptr<Pipe>> hand_out(int cfd, char layout, Notifier notifier) {
+    auto h = pool_->take(layout == '1' ? shm::RingKind::kBytes : shm::RingKind::kSlab);
+    if (!h.ok()) {
+      close_notifier(&notifier);
+      return h.status();
+    }
+    const int seg[1] = {h.value().shm_fd};
+    const char ok = 1;
+    auto st = send_with_fds(cfd, &ok, 1, seg);
+    if (!st.ok()) {
+      // The dialer is gone, so the segment is ours alone.
+      h.value().mem->attached.store(1, std::memory_order_relaxed);
+      release_segment(h.value(), /*pooled=*/true, pool_);
+      close_notifier(&notifier);
+      return st.status();
+    }
+    return std::unique_ptr<Pipe>(new ShmPipe(h.value(), names_, notifier, /*owner=*/false, /*is_client=*/false,
+                                             shm_.zero_copy_recv, fragments_, /*pooled=*/true, pool_));
+  }
+
   ShmNames names_;
   int fd_ = -1;
+  ShmOptions shm_;
+  FragmentOptions fragments_;
+  std::shared_ptr<SegmentPool> pool_;
+};
+
+// Dial without creating a segment: the listener's accept() answers with one of its pool's.
+static Result<std::unique_ptr<Pipe>> dial_from_pool(ShmNames n, const DialOptions& opt) {
+  Notifier mine;
+  Notifier theirs;
+  auto st = make_notifiers(&mine, &theirs);
+  if (!st.ok()) return st.status();
+  auto cfd = uds_connect(n.bootstrap_path);
+  if (!cfd.ok()) {
+    close_notifier(&mine);
+    close_notifier(&theirs);
+    return cfd.status();
+  }
+
+  char hello[16];
+  std::memset(hello, '0', sizeof(hello));
+  hello[0] = kPoolRequest;
+  hello[1] = static_cast<char>('0' + static_cast<int>(shm::to_ring_kind(opt.shm.layout)));
+  const int fds[2] = {theirs.rx, theirs.tx};
+  st = send_with_fds(cfd.value(), hello, sizeof(hello), fds);
+  close_notifier(&theirs);
+
+  int seg[1] = {-1};
+  if (st.ok()) {
+    pollfd pfd{cfd.value(), POLLIN, 0};
+    const int wait_ms = opt.timeout.count() == 0 ? -1 : static_cast<int>(opt.timeout.count());
+    int rc;
+    do {
+      rc = ::poll(&pfd, 1, wait_ms);
+    } while (rc < 0 && errno == EINTR);
+    if (rc == 0) {
+      st = Status::timeout("shm dial: listener did not accept in time");
+    } else if (rc < 0) {
+      st = Status::io_error("poll() failed" + errno_suffix());
+    } else {
+      char ok = 0;
+      st = recv_with_fds(cfd.value(), &ok, 1, seg);
+    }
+  }
+  ::close(cfd.value());
+  if (!st.ok()) {
+    close_notifier(&mine);
+    return st.status();
+  }
+  auto h = map_existing(seg[0], opt.shm.populate, "pooled segment");
+  if (!h.ok()) {
+    close_notifier(&mine);
+    return h.status();
+  }
+  return std::unique_ptr<Pipe>(new ShmPipe(h.value(), std::move(n), mine, /*owner=*/false, /*is_client=*/true,
+                                           opt.shm.zero_copy_recv, opt.fragments, /*pooled=*/true));
+}
+
+// Broadcast bus (ShmBroadcastOptions): one segment per bus name, no bootstrap socket. Subscribers
+// find it by name and leave the publisher no trace, so any number can come and go.
+static std::string broadcast_shm_name(std::string_view bus_name) {
+  return "/d" + hex8(fnv1a_32(sanitize_name(bus_name))) + "bcast";
+}
+
+struct BroadcastMapping {
+  int fd = -1;
+  shm::BroadcastLayout* seg = nullptr;
+  std::size_t size = 0;
+};
+
+static void unmap_broadcast(BroadcastMapping* m) {
+  if (m->seg) {
+    ::munmap(m->seg, m->size);
+    m->seg = nullptr;
+  }
+  close_fd(&m->fd);
+}
+
+static Result<BroadcastMapping> map_broadcast(int fd) {
+  BroadcastMapping m;
+  m.fd = fd;
+  struct stat sb {};
+  if (::fstat(fd, &sb) != 0) {
+    unmap_broadcast(&m);
+    return Status::io_error("fstat(shm) failed" + errno_suffix());
+  }
+  m.size = static_cast<std::size_t>(sb.st_size);
+  if (m.size < shm::BroadcastLayout::size(0)) {
+    unmap_broadcast(&m);
+    return Status::protocol_error("shm broadcast segment too small");
+  }
+  void* p = ::mmap(nullptr, m.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED) {
+    unmap_broadcast(&m);
+    return Status::io_error("mmap(shm) failed" + errno_suffix());
+  }
+  m.seg = static_cast<shm::BroadcastLayout*>(p);
+  if (!shm::broadcast_valid(m.seg, m.size)) {
+    unmap_broadcast(&m);
+    return Status::protocol_error("shm broadcast segment layout mismatch");
+  }
+  return m;
+}
+
+// A bus left behind by a publisher that exited without closing it.
+static bool broadcast_abandoned(const shm::BroadcastLayout* seg) {
+  if (seg->meta.closed.load(std::memory_order_acquire) != 0) return true;
+  const auto pid = static_cast<pid_t>(seg->meta.writer_pid);
+  return ::kill(pid, 0) != 0 && errno == ESRCH;
+}
+
+// Send-only end of a bus. Not for concurrent senders (like ShmPipe).
+class ShmBroadcastPublisher final : public Pipe {
+ public:
+  ShmBroadcastPublisher(BroadcastMapping m, std::string shm_name)
+      : m_(m), shm_name_(std::move(shm_name)), tx_(m_.seg) {}
+  ~ShmBroadcastPublisher() override { close(); }
+
+  Result<void> send(const Message& msg, const SendOptions& opt) override {
+    auto n = send_batch(std::span<const Message>(&msg, 1), opt);
+    if (!n.ok()) return n.status();
+    return {};
+  }
+
+  // Everything is staged, then published with one head store and at most one wake for all
+  // subscribers. A message sent in parts (opt.more / opt.continued) is held until its last part
+  // and copied in as one record.
+  Result<std::size_t> send_batch(std::span<const Message> msgs, const SendOptions& opt) override {
+    if (!m_.seg) return Status::closed("pipe closed");
+    const std::uint32_t flags = wire::send_flags(opt) & ~wire::kFragmentFlags;
+    std::size_t n = 0;
+    Status err;
+    for (; n < msgs.size(); ++n) {
+      const bool continued = opt.continued && n == 0;
+      const bool more = opt.more && n + 1 == msgs.size();
+      if (!continued && !more) {
+        if (msgs[n].size() > tx_.max_payload()) {
+          err = too_large();
+          break;
+        }
+        tx_.stage(std::span<const Message>(&msgs[n], 1), msgs[n].size(), flags);
+        continue;
+      }
+      Partial& p = partial_[opt.channel];
+      if (!continued) p = Partial{};
+      p.parts.push_back(msgs[n]);
+      p.bytes += msgs[n].size();
+      if (p.bytes > tx_.max_payload()) {
+        partial_.erase(opt.channel);
+        err = too_large();
+        break;
+      }
+      if (more) continue;
+      tx_.stage(p.parts, p.bytes, flags);
+      partial_.erase(opt.channel);
+    }
+    if (tx_.publish()) wake_all_on(&m_.seg->meta.version);
+    if (n == 0 && !err.ok()) return err;
+    return n;
+  }
+
+  Result<Message> recv(const RecvOptions& opt) override {
+    (void)opt;
+    return Status::not_supported("shm broadcast publisher is send-only");
+  }
+
+  Result<std::span<std::uint8_t>> reserve(std::size_t size, const SendOptions&) override {
+    return staged_.reserve(size);
+  }
+  Result<void> commit(std::size_t len, const SendOptions& opt) override { return staged_.commit(*this, len, opt); }
+
+  // Subscribers read what is published, then see kClosed. The name is free for a new publisher
+  // right away; subscribers keep their mappings.
+  void close() override {
+    if (!m_.seg) return;
+    if (tx_.close()) wake_all_on(&m_.seg->meta.version);
+    unmap_broadcast(&m_);
+    ::shm_unlink(shm_name_.c_str());
+  }
+
+ private:
+  struct Partial {
+    std::vector<Message> parts;
+    std::size_t bytes = 0;
+  };
+
+  Status too_large() const {
+    return Status::invalid_argument("message larger than a quarter of the shm broadcast ring (" +
+                                    std::to_string(tx_.max_payload()) + " bytes)");
+  }
+
+  BroadcastMapping m_;
+  std::string shm_name_;
+  shm::BroadcastTx tx_;
+  std::unordered_map<std::uint16_t, Partial> partial_;  // by channel
+  detail::StagedSend staged_;
+};
+
+// Receive-only end of a bus, following it with a cursor of its own.
+class ShmBroadcastSubscriber final : public Pipe {
+ public:
+  ShmBroadcastSubscriber(BroadcastMapping m, const ShmBroadcastOptions& opt)
+      : m_(m), rx_(m_.seg), on_lap_(opt.on_lap), on_lapped_(opt.on_lapped) {}
+  ~ShmBroadcastSubscriber() override { close(); }
+
+  Result<void> send(const Message& msg, const SendOptions& opt) override {
+    (void)msg;
+    (void)opt;
+    return Status::not_supported("shm broadcast subscriber is receive-only");
+  }
+
+  Result<Message> recv(const RecvOptions& opt) override {
+    Message m;
+    auto n = recv_batch(std::span<Message>(&m, 1), opt);
+    if (!n.ok()) return n.status();
+    return m;
+  }
+
+  Result<std::size_t> recv_batch(std::span<Message> out, const RecvOptions& opt) override {
+    if (!m_.seg) return Status::closed("pipe closed");
+    if (out.empty()) return std::size_t{0};
+
+    shm::BroadcastMeta& meta = rx_.meta();
+    auto deadline = std::chrono::steady_clock::now() + opt.timeout;
+    for (;;) {
+      // Taken before looking at head, so a publish in between moves it.
+      const std::uint32_t seen = meta.version.load(std::memory_order_acquire);
+      auto n = drain(out);
+      if (!n.ok() || n.value() != 0) return n;
+      if (opt.timeout.count() != 0 && std::chrono::steady_clock::now() >= deadline) {
+        return Status::timeout("shm recv timeout");
+      }
+      auto st = shm::wait_version(meta.version, seen, meta.waiters,
+                                  opt.timeout.count() == 0 ? opt.timeout : remaining_ms(deadline),
+                                  [&](std::uint32_t v, std::chrono::milliseconds t) { return park_on(&meta.version, v, t); });
+      if (!st.ok()) return st.status();
+    }
+  }
+
+  // No poll handle: the publisher cannot know whom to signal.
+  Result<std::size_t> try_recv_batch(std::span<Message> out) override {
+    if (!m_.seg) return Status::closed("pipe closed");
+    if (out.empty()) return failure_.ok() ? Result<std::size_t>(std::size_t{0}) : Result<std::size_t>(failure_);
+    return drain(out);
+  }
+
+  void close() override { unmap_broadcast(&m_); }
+
+ private:
+  Result<std::size_t> drain(std::span<Message> out) {
+    if (!failure_.ok()) return failure_;
+    for (;;) {
+      // Before popping: the publisher publishes everything before it closes, so once closed is
+      // seen, an empty ring means there is nothing left.
+      const bool closed = rx_.meta().closed.load(std::memory_order_acquire) != 0;
+      auto n = rx_.try_pop_batch(out.data(), out.size());
+      if (!n.ok()) return n.status();
+      if (std::uint64_t lost = rx_.take_lost(); lost != 0 && on_lapped_) on_lapped_(lost);
+      if (rx_.lapped()) {
+        if (on_lap_ == ShmLapPolicy::kDrop) {
+          failure_ = Status::io_error("shm broadcast subscriber lapped by the publisher");
+          if (n.value() == 0) return failure_;
+          return n;
+        }
+        rx_.skip_to_tail();
+        if (n.value() == 0) continue;
+      }
+      if (n.value() != 0 || !closed) return n;
+      return Status::closed("shm broadcast publisher closed");
+    }
+  }
+
+  BroadcastMapping m_;
+  shm::BroadcastRx rx_;
+  ShmLapPolicy on_lap_;
+  std::function<void(std::uint64_t)> on_lapped_;
+  Status failure_;  // sticky once dropped
 };
+
+static Result<std::unique_ptr<Pipe>> broadcast_publish(const std::string& name, const ShmBroadcastOptions& opt) {
+  const std::size_t ring = opt.ring_bytes;
+  if (ring < shm::kBroadcastMinRing || (ring & (ring - 1)) != 0 || ring > (std::size_t{1} << 40)) {
+    return Status::invalid_argument("shm broadcast ring_bytes must be a power of two of at least 4096");
+  }
+  const std::string shm_name = broadcast_shm_name(name);
+  int fd = -1;
+  for (int attempt = 0; fd < 0; ++attempt) {
+    fd = ::shm_open(shm_name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd >= 0 || errno != EEXIST || attempt != 0) break;
+    // Taken: by a live publisher, or by one that went away without closing.
+    int old = ::shm_open(shm_name.c_str(), O_RDWR, 0600);
+    if (old < 0) continue;
+    auto m = map_broadcast(old);
+    if (m.ok()) {
+      const bool abandoned = broadcast_abandoned(m.value().seg);
+      unmap_broadcast(&m.value());
+      if (!abandoned) return Status::io_error("shm broadcast bus already has a publisher: " + name);
+    }
+    ::shm_unlink(shm_name.c_str());
+  }
+  if (fd < 0) return Status::io_error("shm_open(create) failed: " + shm_name + errno_suffix());
+
+  BroadcastMapping m;
+  m.fd = fd;
+  m.size = shm::BroadcastLayout::size(ring);
+  if (::ftruncate(fd, static_cast<off_t>(m.size)) != 0) {
+    unmap_broadcast(&m);
+    ::shm_unlink(shm_name.c_str());
+    return Status::io_error("ftruncate(shm) failed" + errno_suffix());
+  }
+  void* p = ::mmap(nullptr, m.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED) {
+    unmap_broadcast(&m);
+    ::shm_unlink(shm_name.c_str());
+    return Status::io_error("mmap(shm) failed" + errno_suffix());
+  }
+  m.seg = shm::init_broadcast(p, ring, static_cast<std::uint64_t>(::getpid()));
+  return std::unique_ptr<Pipe>(new ShmBroadcastPublisher(m, shm_name));
+}
+
+static Result<std::unique_ptr<Pipe>> broadcast_subscribe(const std::string& name, const ShmBroadcastOptions& opt) {
+  int fd = ::shm_open(broadcast_shm_name(name).c_str(), O_RDWR, 0600);
+  if (fd < 0) {
+    if (errno == ENOENT) return Status::io_error("no shm broadcast publisher: " + name);
+    return Status::io_error("shm_open(open) failed" + errno_suffix());
+  }
+  auto m = map_broadcast(fd);
+  if (!m.ok()) return m.status();
+  if (broadcast_abandoned(m.value().seg)) {
+    unmap_broadcast(&m.value());
+    return Status::io_error("no shm broadcast publisher: " + name);
+  }
+  return std::unique_ptr<Pipe>(new ShmBroadcastSubscriber(m.value(), opt));
+}
 #endif  // !_WIN32
 
+}  // namespace
+
 // Linux/Unix implementation functions
 Result<std::unique_ptr<Listener>> shm_listen(const std::string& name, const ListenOptions& opt) {
+  if (opt.shm.broadcast.role != ShmBroadcastRole::kNone) {
+    return Status::invalid_argument("shm broadcast buses are dialed by the publisher and subscribers alike");
+  }
   ShmNames n = make_names(name, "0000000000000000");
   auto fd = uds_listen(n.bootstrap_path, opt.backlog);
   if (!fd.ok()) return fd.status();
-  return std::unique_ptr<Listener>(new ShmListener(std::move(n), fd.value()));
+  return std::unique_ptr<Listener>(new ShmListener(std::move(n), fd.value(), opt.shm, opt.fragments));
 }
 
 Result<std::unique_ptr<Pipe>> shm_dial(const std::string& name, const DialOptions& opt) {
-  (void)opt;
+  if (opt.shm.broadcast.role == ShmBroadcastRole::kPublish) return broadcast_publish(name, opt.shm.broadcast);
+  if (opt.shm.broadcast.role == ShmBroadcastRole::kSubscribe) return broadcast_subscribe(name, opt.shm.broadcast);
+
   std::string connid = random_conn_id_hex16();
   ShmNames n = make_names(name, connid);
+  if (opt.shm.from_listener_pool) return dial_from_pool(std::move(n), opt);
 
-  auto created = create_resources(n);
+  auto created = create_resources(n, shm::to_ring_kind(opt.shm.layout), opt.shm);
   if (!created.ok()) return created.status();
 
+  Notifier mine;
+  Notifier theirs;
+  auto st = make_notifiers(&mine, &theirs);
+  if (!st.ok()) {
+    close_handles(&created.value());
+    ::shm_unlink(n.shm.c_str());
+    return st.status();
+  }
+
   auto cfd = uds_connect(n.bootstrap_path);
   if (!cfd.ok()) {
+    close_notifier(&mine);
+    close_notifier(&theirs);
     close_handles(&created.value());
-    ::sem_unlink(n.c2s_items_sem.c_str());
-    ::sem_unlink(n.c2s_spaces_sem.c_str());
-    ::sem_unlink(n.s2c_items_sem.c_str());
-    ::sem_unlink(n.s2c_spaces_sem.c_str());
     ::shm_unlink(n.shm.c_str());
     return cfd.status();
   }
 
-  auto st = write_all(cfd.value(), connid.data(), connid.size());
+  // The listener owns its copies once they are in flight; ours are closed either way.
+  const int fds[2] = {theirs.rx, theirs.tx};
+  st = send_with_fds(cfd.value(), connid.data(), connid.size(), fds);
   ::close(cfd.value());
+  close_notifier(&theirs);
   if (!st.ok()) {
+    close_notifier(&mine);
     close_handles(&created.value());
-    ::sem_unlink(n.c2s_items_sem.c_str());
-    ::sem_unlink(n.c2s_spaces_sem.c_str());
-    ::sem_unlink(n.s2c_items_sem.c_str());
-    ::sem_unlink(n.s2c_spaces_sem.c_str());
     ::shm_unlink(n.shm.c_str());
     return st.status();
   }
 
-  return std::unique_ptr<Pipe>(new ShmPipe(created.value(), std::move(n), /*owner=*/true, /*is_client=*/true));
+  return std::unique_ptr<Pipe>(new ShmPipe(created.value(), std::move(n), mine, /*owner=*/true,
+                                         /*is_client=*/true, opt.shm.zero_copy_recv, opt.fragments));
 }
 
 }  // namespace duct
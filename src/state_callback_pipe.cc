@@ -23,6 +23,15 @@ class StateCallbackPipe final : public Pipe {
     return st;
   }
 
+  Result<std::size_t> send_batch(std::span<const Message> msgs, const SendOptions& opt) override {
+    if (!inner_) return Status::closed("pipe closed");
+    auto n = inner_->send_batch(msgs, opt);
+    if (!n.ok() && is_disconnect(n.status())) {
+      emit_disconnected("send: " + n.status().message());
+    }
+    return n;
+  }
+
   Result<Message> recv(const RecvOptions& opt) override {
     if (!inner_) return Status::closed("pipe closed");
     auto r = inner_->recv(opt);
@@ -32,6 +41,44 @@ class StateCallbackPipe final : public Pipe {
     return r;
   }
 
+  Result<std::size_t> recv_batch(std::span<Message> out, const RecvOptions& opt) override {
+    if (!inner_) return Status::closed("pipe closed");
+    auto r = inner_->recv_batch(out, opt);
+    if (!r.ok() && is_disconnect(r.status())) {
+      emit_disconnected("recv: " + r.status().message());
+    }
+    return r;
+  }
+
+  PollHandle poll_handle() const override { return inner_ ? inner_->poll_handle() : kInvalidPollHandle; }
+
+  Result<std::size_t> try_recv_batch(std::span<Message> out) override {
+    if (!inner_) return Status::closed("pipe closed");
+    auto r = inner_->try_recv_batch(out);
+    if (!r.ok() && is_disconnect(r.status())) {
+      emit_disconnected("recv: " + r.status().message());
+    }
+    return r;
+  }
+
+  detail::StreamEndpoint* stream_endpoint() override { return inner_ ? inner_->stream_endpoint() : nullptr; }
+
+  Result<std::span<std::uint8_t>> reserve(std::size_t size, const SendOptions& opt) override {
+    if (!inner_) return Status::closed("pipe closed");
+    return inner_->reserve(size, opt);
+  }
+
+  Result<void> commit(std::size_t len, const SendOptions& opt) override {
+    if (!inner_) return Status::closed("pipe closed");
+    auto st = inner_->commit(len, opt);
+    if (!st.ok() && is_disconnect(st.status())) {
+      emit_disconnected("send: " + st.status().message());
+    }
+    return st;
+  }
+
+  Result<void> flush() override { return inner_ ? inner_->flush() : Result<void>{}; }
+
   void close() override {
     bool expected = false;
     if (!closed_.compare_exchange_strong(expected, true, std::memory_order_acq_rel)) return;
@@ -0,0 +1,75 @@
+#include "stream_endpoint.h"
+
+#include <utility>
+
+namespace duct::detail {
+
+void StreamEndpoint::attach(std::shared_ptr<StreamEngine> engine, std::uint64_t token) {
+  std::lock_guard<std::mutex> lock(mu_);
+  engine_ = std::move(engine);
+  token_ = token;
+  attached_.store(true, std::memory_order_release);
+}
+
+void StreamEndpoint::detach() {
+  std::lock_guard<std::mutex> lock(mu_);
+  engine_.reset();
+  token_ = 0;
+  attached_.store(false, std::memory_order_release);
+}
+
+std::shared_ptr<StreamEngine> StreamEndpoint::engine(std::uint64_t* token) const {
+  if (!attached()) return nullptr;
+  std::lock_guard<std::mutex> lock(mu_);
+  *token = token_;
+  return engine_;
+}
+
+Result<void> StreamEndpoint::feed(const Message& chunk) {
+  std::size_t off = 0;
+  while (off < chunk.size()) {
+    auto n = reader_.append(chunk.slice(off, chunk.size() - off));
+    if (!n.ok()) return n.status();
+    off += n.value();
+    if (off == chunk.size()) break;
+    // The reader is full of complete frames; park them so it can compact.
+    for (;;) {
+      Message m;
+      auto popped = reader_.try_pop(&m);
+      if (!popped.ok()) return popped.status();
+      if (!popped.value()) break;
+      inbox_.push_back(std::move(m));
+    }
+  }
+  return {};
+}
+
+void StreamEndpoint::fail(Status st) {
+  if (failure_.ok()) failure_ = std::move(st);
+}
+
+Result<bool> StreamEndpoint::pop_buffered(Message* out) {
+  if (!inbox_.empty()) {
+    *out = std::move(inbox_.front());
+    inbox_.pop_front();
+    return true;
+  }
+  return reader_.try_pop(out);
+}
+
+Result<std::size_t> StreamEndpoint::pop_fed(std::span<Message> out) {
+  std::size_t n = 0;
+  while (n < out.size()) {
+    auto popped = pop_buffered(&out[n]);
+    if (!popped.ok()) {
+      fail(popped.status());
+      break;
+    }
+    if (!popped.value()) break;
+    ++n;
+  }
+  if (n == 0 && !failure_.ok()) return failure_;
+  return n;
+}
+
+}  // namespace duct::detail
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <span>
+
+#include "compression.h"
+#include "duct/duct.h"
+#include "duct/wire.h"
+
+namespace duct::detail {
+
+// Implemented by completion engines that take over a stream pipe's socket I/O (io_uring_engine.h,
+// iocp_engine.h).
+class StreamEngine {
+ public:
+  virtual ~StreamEngine() = default;
+
+  // Queue `msgs` as frames behind everything already queued for `token`; may block (per
+  // opt.timeout) while the connection is over its send high-water mark. kNotSupported means the
+  // engine has let go of the pipe and the caller writes to the socket itself.
+  virtual Result<std::size_t> send(std::uint64_t token, std::span<const Message> msgs, const SendOptions& opt) = 0;
+
+  // The pipe was closed by its owner.
+  virtual void closed(std::uint64_t token) = 0;
+};
+
+// The part of a byte-stream pipe that a completion engine drives. While attached the pipe never
+// reads its socket: the engine feeds it the received bytes in order (on the loop thread) and
+// try_recv_batch() parses frames out of them. Sends go through the engine, so a single writer
+// orders them. The engine works on its own duplicate of the socket, so closing the pipe never
+// leaves the engine holding a descriptor number that could be reused.
+class StreamEndpoint {
+ public:
+  virtual ~StreamEndpoint() = default;
+
+  virtual wire::SocketHandle socket() const = 0;
+  // Windows named pipes put their file HANDLE in socket(); an engine then reads and writes it with
+  // ReadFile / WriteFile, and each write is one pipe message.
+  virtual bool socket_is_file() const { return false; }
+
+  // Engine side.
+  void attach(std::shared_ptr<StreamEngine> engine, std::uint64_t token);
+  void detach();
+  Result<void> feed(const Message& chunk);
+  // Headers for the frames the engine sends.
+  wire::FrameEncoder& encoder() { return encoder_; }
+  // A receive or send failure (kClosed for EOF). try_recv_batch() reports it once the frames
+  // received before it are delivered; the first one sticks.
+  void fail(Status st);
+
+ protected:
+  bool attached() const { return attached_.load(std::memory_order_acquire); }
+  // The engine to send through, or null when the pipe does its own I/O.
+  std::shared_ptr<StreamEngine> engine(std::uint64_t* token) const;
+  // Next frame already buffered in this endpoint; no I/O.
+  Result<bool> pop_buffered(Message* out);
+  // try_recv_batch() while attached.
+  Result<std::size_t> pop_fed(std::span<Message> out);
+
+  wire::FrameReader reader_;
+  wire::FrameEncoder encoder_;
+  // Wire reader_ and encoder_ up for `mode` and `compression` (before the connection is used).
+  // Compressed frames are accepted whatever this side sends, and our hello says which.
+  void set_framing(wire::CompactFraming mode, const CompressionOptions& compression) {
+    encoder_.configure(mode);
+    encoder_.advertise(decodable_codecs(), dictionary_id(compression));
+    reader_.set_encoder(&encoder_);
+    if (compression.codec != Compression::kNone) {
+      compressor_ = std::make_unique<FrameCompressor>(compression);
+      encoder_.set_compressor(compressor_.get(), codec_capability(compression.codec),
+                              compression.codec == Compression::kZstd);
+    }
+    decompressor_ = std::make_unique<FrameDecompressor>(compression);
+    reader_.set_decompressor(decompressor_.get());
+  }
+
+ private:
+  mutable std::mutex mu_;  // engine_ and token_
+  std::shared_ptr<StreamEngine> engine_;
+  std::uint64_t token_ = 0;
+  std::atomic<bool> attached_{false};
+  std::deque<Message> inbox_;  // frames parsed early to make room in reader_; they come first
+  Status failure_;
+  std::unique_ptr<FrameCompressor> compressor_;
+  std::unique_ptr<FrameDecompressor> decompressor_;
+};
+
+// A dialer sends a hello for compact headers, and to learn whether the peer takes compressed frames.
+inline wire::CompactFraming dial_framing(const DialOptions& opt) {
+  return opt.compact_frames || opt.compression.codec != Compression::kNone ? wire::CompactFraming::kInitiate
+                                                                            : wire::CompactFraming::kOff;
+}
+
+}  // namespace duct::detail
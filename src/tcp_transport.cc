@@ -1,12 +1,19 @@
 #include "duct/duct.h"
 
 #include "duct/protocol.h"
+#include "duct/socket_utils.h"
 #include "duct/wire.h"
+#include "stream_endpoint.h"
 
+#include <atomic>
+#include <cerrno>
+#include <chrono>
 #include <cstdint>
 #include <cstring>
 #include <memory>
+#include <span>
 #include <string>
+#include <thread>
 
 #if defined(_WIN32)
 #include <winsock2.h>
@@ -14,8 +21,10 @@
 #pragma comment(lib, "ws2_32.lib")
 #else
 #include <arpa/inet.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/tcp.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -49,67 +58,274 @@ static void close_socket(wire::SocketHandle fd) {
 #endif
 }
 
-class TcpPipe final : public Pipe {
+// Does its own blocking socket I/O, unless a Reactor running on io_uring has taken the socket over
+// (see StreamEndpoint); then receives are fed by the engine and sends are queued to it.
+class TcpPipe final : public Pipe, private detail::StreamEndpoint {
  public:
-  explicit TcpPipe(wire::SocketHandle fd) : fd_(fd) {}
+  TcpPipe(wire::SocketHandle fd, const FragmentOptions& fragments, wire::CompactFraming framing,
+          const CompressionOptions& compression)
+      : fd_(fd) {
+    reader_.set_fragment_options(fragments);
+    set_framing(framing, compression);
+  }
   ~TcpPipe() override { close(); }
 
-  Result<void> send(const Message& msg, const SendOptions&) override {
+  Result<void> send(const Message& msg, const SendOptions& opt) override {
+    if (fd_ == wire::kInvalidSocket) return Status::closed("pipe closed");
+    std::uint64_t token = 0;
+    if (auto eng = engine(&token)) {
+      auto n = eng->send(token, std::span<const Message>(&msg, 1), opt);
+      if (n.ok()) return {};
+      if (n.status().code() != StatusCode::kNotSupported) return n.status();
+    }
+    return wire::write_frame(fd_, msg, wire::send_flags(opt), &encoder_);
+  }
+
+  Result<std::size_t> send_batch(std::span<const Message> msgs, const SendOptions& opt) override {
     if (fd_ == wire::kInvalidSocket) return Status::closed("pipe closed");
-    return wire::write_frame(fd_, msg, /*flags=*/0);
+    std::uint64_t token = 0;
+    if (auto eng = engine(&token)) {
+      auto n = eng->send(token, msgs, opt);
+      if (n.ok() || n.status().code() != StatusCode::kNotSupported) return n;
+    }
+    return wire::write_frames(fd_, msgs, wire::send_flags(opt), &encoder_);
   }
 
   Result<Message> recv(const RecvOptions&) override {
     if (fd_ == wire::kInvalidSocket) return Status::closed("pipe closed");
-    return wire::read_frame(fd_);
+    if (attached()) return Status::not_supported("pipe is driven by a reactor; use try_recv_batch");
+    Message m;
+    auto popped = pop_buffered(&m);
+    if (!popped.ok()) return popped.status();
+    if (popped.value()) return m;
+    return reader_.read(fd_);
+  }
+
+  PollHandle poll_handle() const override { return static_cast<PollHandle>(fd_); }
+
+  // Buffered frames first; one non-blocking recv() only if they do not fill `out`.
+  Result<std::size_t> try_recv_batch(std::span<Message> out) override {
+    if (fd_ == wire::kInvalidSocket) return Status::closed("pipe closed");
+    if (attached()) return pop_fed(out);
+    std::size_t n = 0;
+    auto pop = [&]() -> Result<void> {
+      while (n < out.size()) {
+        auto popped = pop_buffered(&out[n]);
+        if (!popped.ok()) return popped.status();
+        if (!popped.value()) break;
+        ++n;
+      }
+      return {};
+    };
+    auto st = pop();
+    if (st.ok() && n < out.size()) {
+      auto filled = reader_.fill_nonblocking(fd_);
+      if (!filled.ok()) st = filled.status();
+      else if (filled.value()) st = pop();
+    }
+    if (!st.ok() && n == 0) return st.status();
+    return n;
+  }
+
+  detail::StreamEndpoint* stream_endpoint() override { return this; }
+
+  // The span sits right behind header room in a per-pipe frame buffer, so commit is one write.
+  // Anything larger than a frame is staged in a pooled message and sent in fragments.
+  Result<std::span<std::uint8_t>> reserve(std::size_t size, const SendOptions&) override {
+    if (fd_ == wire::kInvalidSocket) return Status::closed("pipe closed");
+    reserved_ = kNoReservation;
+    staged_.cancel();
+    if (size > wire::kMaxFramePayload) return staged_.reserve(size);
+    if (tx_buf_.empty()) tx_buf_ = Message::allocate(wire::kHeaderLen + wire::kMaxFramePayload);
+    reserved_ = size;
+    return std::span<std::uint8_t>(tx_buf_.data() + wire::kHeaderLen, size);
+  }
+
+  Result<void> commit(std::size_t len, const SendOptions& opt) override {
+    if (fd_ == wire::kInvalidSocket) return Status::closed("pipe closed");
+    if (reserved_ == kNoReservation) return staged_.commit(*this, len, opt);
+    if (len > reserved_) return Status::invalid_argument("commit exceeds reservation");
+    reserved_ = kNoReservation;
+    std::uint64_t token = 0;
+    if (auto eng = engine(&token)) {
+      // The engine keeps the payload until the kernel is done with it; the next reserve() starts
+      // on a fresh buffer.
+      Message m = tx_buf_.slice(wire::kHeaderLen, len);
+      tx_buf_ = Message();
+      auto n = eng->send(token, std::span<const Message>(&m, 1), opt);
+      if (n.ok()) return {};
+      if (n.status().code() != StatusCode::kNotSupported) return n.status();
+      return wire::write_frame(fd_, m, wire::send_flags(opt), &encoder_);
+    }
+    return wire::write_prefixed_frame(fd_, tx_buf_.data(), len, wire::send_flags(opt), &encoder_);
+  }
+
+  // The first frame may block; the rest are whatever that receive already buffered.
+  Result<std::size_t> recv_batch(std::span<Message> out, const RecvOptions& opt) override {
+    if (fd_ == wire::kInvalidSocket) return Status::closed("pipe closed");
+    if (out.empty()) return std::size_t{0};
+    auto first = recv(opt);
+    if (!first.ok()) return first.status();
+    out[0] = std::move(first.value());
+    std::size_t n = 1;
+    while (n < out.size()) {
+      auto popped = pop_buffered(&out[n]);
+      if (!popped.ok() || !popped.value()) break;
+      ++n;
+    }
+    return n;
   }
 
   void close() override {
     if (fd_ != wire::kInvalidSocket) {
+      std::uint64_t token = 0;
+      if (auto eng = engine(&token)) eng->closed(token);
       close_socket(fd_);
       fd_ = wire::kInvalidSocket;
     }
   }
 
  private:
+  static constexpr std::size_t kNoReservation = ~std::size_t{0};
+
+  wire::SocketHandle socket() const override { return fd_; }
+
   wire::SocketHandle fd_ = wire::kInvalidSocket;
+  Message tx_buf_;  // frame header room + reserved payload, allocated on first reserve()
+  std::size_t reserved_ = kNoReservation;
+  detail::StagedSend staged_;  // reservations too big for tx_buf_
 };
 
 class TcpListener final : public Listener {
  public:
-  TcpListener(wire::SocketHandle fd, std::string host, std::uint16_t port)
-      : fd_(fd), host_(std::move(host)), port_(port) {}
-  ~TcpListener() override { close(); }
-
-  Result<std::unique_ptr<Pipe>> accept() override {
-    if (fd_ == wire::kInvalidSocket) return Status::closed("listener closed");
-#if defined(_WIN32)
-    auto cfd = static_cast<wire::SocketHandle>(::accept(static_cast<SOCKET>(fd_), nullptr, nullptr));
-#else
-    auto cfd = static_cast<wire::SocketHandle>(::accept(fd_, nullptr, nullptr));
+  TcpListener(wire::SocketHandle fd, std::string host, std::uint16_t port, const FragmentOptions& fragments,
+              wire::CompactFraming framing, const CompressionOptions& compression)
+      : fd_(fd),
+        host_(std::move(host)),
+        port_(port),
+        fragments_(fragments),
+        framing_(framing),
+        compression_(compression) {}
+  ~TcpListener() override {
+    close();
+#if !defined(_WIN32)
+    if (spare_ >= 0) ::close(spare_);
 #endif
-    if (cfd == wire::kInvalidSocket) {
-      return Status::io_error("accept() failed");
+  }
+
+  Result<std::unique_ptr<Pipe>> accept() override { return take(/*wait=*/true); }
+
+  PollHandle poll_handle() const override { return static_cast<PollHandle>(fd_.load(std::memory_order_acquire)); }
+
+  // The listening socket turns non-blocking here for good: a connection that another shard (or
+  // SO_REUSEPORT sibling) took between readiness and accept() must not leave us asleep in accept().
+  Result<std::unique_ptr<Pipe>> try_accept() override {
+    const wire::SocketHandle fd = fd_.load(std::memory_order_acquire);
+    if (fd == wire::kInvalidSocket) return Status::closed("listener closed");
+    if (!nonblocking_.exchange(true, std::memory_order_acq_rel)) {
+      auto st = socket_utils::set_nonblocking(static_cast<socket_utils::socket_t>(fd), true);
+      if (!st.ok()) {
+        nonblocking_.store(false, std::memory_order_release);
+        return st.status();
+      }
     }
-    return std::unique_ptr<Pipe>(new TcpPipe(cfd));
+    return take(/*wait=*/false);
   }
 
   Result<std::string> local_address() const override {
-    if (fd_ == wire::kInvalidSocket) return Status::closed("listener closed");
+    if (fd_.load(std::memory_order_acquire) == wire::kInvalidSocket) return Status::closed("listener closed");
     return std::string("tcp://") + (host_.empty() ? "127.0.0.1" : host_) + ":" + std::to_string(port_);
   }
 
+  // Safe while another thread is blocked in accept(), which then returns kClosed.
   void close() override {
-    if (fd_ != wire::kInvalidSocket) {
-      close_socket(fd_);
-      fd_ = wire::kInvalidSocket;
+    const wire::SocketHandle fd = fd_.exchange(wire::kInvalidSocket, std::memory_order_acq_rel);
+    if (fd != wire::kInvalidSocket) {
+#if defined(_WIN32)
+      ::shutdown(static_cast<SOCKET>(fd), SD_BOTH);
+#else
+      ::shutdown(fd, SHUT_RDWR);  // closing alone does not wake accept() on Linux
+#endif
+      close_socket(fd);
     }
   }
 
  private:
-  wire::SocketHandle fd_ = wire::kInvalidSocket;
+  // One connection, or null when none is pending and not `wait`ing. Once try_accept() has made
+  // the socket non-blocking, a waiting accept() sleeps in poll() between attempts.
+  Result<std::unique_ptr<Pipe>> take(bool wait) {
+    for (;;) {
+      const wire::SocketHandle fd = fd_.load(std::memory_order_acquire);
+      if (fd == wire::kInvalidSocket) return Status::closed("listener closed");
+#if defined(_WIN32)
+      auto cfd = static_cast<wire::SocketHandle>(::accept(static_cast<SOCKET>(fd), nullptr, nullptr));
+      const int error = cfd == wire::kInvalidSocket ? ::WSAGetLastError() : 0;
+      const bool again = error == WSAEWOULDBLOCK;
+      const bool exhausted = error == WSAEMFILE || error == WSAENOBUFS;
+      const bool retry = error == WSAEINTR || error == WSAECONNRESET;
+#else
+      auto cfd = static_cast<wire::SocketHandle>(::accept(fd, nullptr, nullptr));
+      const int error = cfd == wire::kInvalidSocket ? errno : 0;
+      const bool again = error == EAGAIN || error == EWOULDBLOCK;
+      const bool exhausted = error == EMFILE || error == ENFILE;
+      const bool retry = error == EINTR || error == ECONNABORTED;
+#endif
+      if (cfd != wire::kInvalidSocket) {
+        // BSD and Winsock hand the listener's non-blocking mode down; pipes do blocking I/O.
+        if (nonblocking_.load(std::memory_order_acquire)) {
+          (void)socket_utils::set_nonblocking(static_cast<socket_utils::socket_t>(cfd), false);
+        }
+        return std::unique_ptr<Pipe>(new TcpPipe(cfd, fragments_, framing_, compression_));
+      }
+      if (fd_.load(std::memory_order_acquire) == wire::kInvalidSocket) return Status::closed("listener closed");
+      if (retry) continue;
+      if (again) {
+        if (!wait) return std::unique_ptr<Pipe>();
+        // Bounded, so a close() that does not wake poll() is still noticed.
+        (void)socket_utils::wait_readable(static_cast<socket_utils::socket_t>(fd), kAcceptPollInterval);
+        continue;
+      }
+      if (exhausted && !wait) {
+        // The pending connection would keep the listener readable, and a reactor spinning on it:
+        // refuse it with the descriptor held in reserve for this, or at least slow the spin.
+        if (!shed(fd)) std::this_thread::sleep_for(kExhaustedBackoff);
+        return Status::io_error("accept() failed: out of descriptors, connection refused");
+      }
+      return Status::io_error("accept() failed");
+    }
+  }
+
+  // Accept and drop one connection on the reserve descriptor (POSIX), then set a new one aside.
+  // False when there was no reserve to spend.
+  bool shed(wire::SocketHandle fd) {
+#if defined(_WIN32)
+    (void)fd;
+    return false;
+#else
+    const bool had = spare_ >= 0;
+    if (had) {
+      ::close(spare_);
+      const int c = ::accept(fd, nullptr, nullptr);
+      if (c >= 0) ::close(c);
+    }
+    spare_ = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+    return had;
+#endif
+  }
+
+  static constexpr std::chrono::milliseconds kAcceptPollInterval{100};
+  static constexpr std::chrono::milliseconds kExhaustedBackoff{10};
+
+  std::atomic<wire::SocketHandle> fd_{wire::kInvalidSocket};
+  std::atomic<bool> nonblocking_{false};
+#if !defined(_WIN32)
+  int spare_ = ::open("/dev/null", O_RDONLY | O_CLOEXEC);  // given up to refuse a connection at EMFILE
+#endif
   std::string host_;
   std::uint16_t port_ = 0;
+  FragmentOptions fragments_;
+  wire::CompactFraming framing_;
+  CompressionOptions compression_;
 };
 
 static Result<wire::SocketHandle> connect_tcp(const std::string& host, std::uint16_t port) {
@@ -159,10 +375,14 @@ static Result<wire::SocketHandle> connect_tcp(const std::string& host, std::uint
   return fd;
 }
 
-static Result<wire::SocketHandle> listen_tcp(const std::string& host, std::uint16_t port, int backlog) {
+static Result<wire::SocketHandle> listen_tcp(const std::string& host, std::uint16_t port, int backlog,
+                                             bool reuse_port) {
 #if defined(_WIN32)
   auto wsa = ensure_winsock();
   if (!wsa.ok()) return wsa.status();
+#endif
+#if !defined(SO_REUSEPORT)
+  if (reuse_port) return Status::not_supported("SO_REUSEPORT not available on this platform");
 #endif
   struct addrinfo hints {};
   hints.ai_family = AF_UNSPEC;
@@ -189,6 +409,13 @@ static Result<wire::SocketHandle> listen_tcp(const std::string& host, std::uint1
 #else
     (void)::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
 #endif
+#if defined(SO_REUSEPORT)
+    if (reuse_port && ::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0) {
+      close_socket(fd);
+      fd = wire::kInvalidSocket;
+      continue;
+    }
+#endif
 
 #if defined(_WIN32)
     if (::bind(static_cast<SOCKET>(fd), p->ai_addr, static_cast<int>(p->ai_addrlen)) == 0 &&
@@ -212,7 +439,7 @@ static Result<wire::SocketHandle> listen_tcp(const std::string& host, std::uint1
 }  // namespace
 
 Result<std::unique_ptr<Listener>> tcp_listen(const TcpAddress& addr, const ListenOptions& opt) {
-  auto fd = listen_tcp(addr.host, addr.port, opt.backlog);
+  auto fd = listen_tcp(addr.host, addr.port, opt.backlog, opt.reuse_port);
   if (!fd.ok()) return fd.status();
 
   // Determine effective port (supports binding to port 0).
@@ -235,14 +462,18 @@ Result<std::unique_ptr<Listener>> tcp_listen(const TcpAddress& addr, const Liste
     }
   }
 
-  return std::unique_ptr<Listener>(new TcpListener(fd.value(), addr.host, effective_port));
+  return std::unique_ptr<Listener>(new TcpListener(fd.value(), addr.host, effective_port, opt.fragments,
+                                                   opt.compact_frames ? wire::CompactFraming::kAnswer
+                                                                      : wire::CompactFraming::kOff,
+                                                   opt.compression));
 }
 
 Result<std::unique_ptr<Pipe>> tcp_dial(const TcpAddress& addr, const DialOptions& opt) {
-  (void)opt;
   auto fd = connect_tcp(addr.host, addr.port);
   if (!fd.ok()) return fd.status();
-  return std::unique_ptr<Pipe>(new TcpPipe(fd.value()));
+  return std::unique_ptr<Pipe>(new TcpPipe(fd.value(), opt.fragments,
+                                           detail::dial_framing(opt),
+                                           opt.compression));
 }
 
 }  // namespace duct
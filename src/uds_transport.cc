@@ -3,9 +3,14 @@
 #include "duct/protocol.h"
 #include "duct/socket_utils.h"
 #include "duct/wire.h"
+#include "stream_endpoint.h"
 
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
 #include <cstring>
 #include <memory>
+#include <span>
 #include <string>
 
 #if defined(_WIN32)
@@ -22,13 +27,33 @@ namespace {
 
 #if !defined(_WIN32)
 
-class UdsPipe final : public Pipe {
+// Like TcpPipe: an io_uring Reactor may take over the socket I/O (see StreamEndpoint), unless large
+// payloads are passed as memfds (UdsOptions::memfd_threshold). Descriptors passed by the peer are
+// always taken off the socket, for the kFdPayload frames they belong to.
+class UdsPipe final : public Pipe, private detail::StreamEndpoint {
  public:
-  explicit UdsPipe(int fd) : fd_(fd) {}
+  UdsPipe(int fd, const FragmentOptions& fragments, wire::CompactFraming framing,
+          const CompressionOptions& compression, const UdsOptions& uds)
+      : fd_(fd) {
+    reader_.set_fragment_options(fragments);
+    reader_.set_descriptor_passing(true);
+    set_framing(framing, compression);
+#if defined(__linux__)
+    memfd_threshold_ = uds.memfd_threshold;
+#else
+    (void)uds;
+#endif
+  }
   ~UdsPipe() override { close(); }
 
   Result<void> send(const Message& msg, const SendOptions& opt) override {
     if (fd_ < 0) return Status::closed("pipe closed");
+    std::uint64_t token = 0;
+    if (auto eng = engine(&token)) {
+      auto n = eng->send(token, std::span<const Message>(&msg, 1), opt);
+      if (n.ok()) return {};
+      if (n.status().code() != StatusCode::kNotSupported) return n.status();
+    }
 
     // Wait for writable if timeout is specified.
     if (opt.timeout.count() > 0) {
@@ -36,11 +61,137 @@ class UdsPipe final : public Pipe {
       if (!st.ok()) return st;
     }
 
-    return wire::write_frame(fd_, msg, /*flags=*/0);
+    const std::uint32_t flags = wire::send_flags(opt);
+    if (by_memfd(msg, true, true, flags)) return wire::write_fd_frame(fd_, msg, flags, &encoder_);
+    return wire::write_frame(fd_, msg, flags, &encoder_);
+  }
+
+  Result<std::size_t> send_batch(std::span<const Message> msgs, const SendOptions& opt) override {
+    if (fd_ < 0) return Status::closed("pipe closed");
+    std::uint64_t token = 0;
+    if (auto eng = engine(&token)) {
+      auto n = eng->send(token, msgs, opt);
+      if (n.ok() || n.status().code() != StatusCode::kNotSupported) return n;
+    }
+
+    if (opt.timeout.count() > 0) {
+      auto st = socket_utils::wait_writable(fd_, opt.timeout);
+      if (!st.ok()) return st.status();
+    }
+
+    const std::uint32_t flags = wire::send_flags(opt);
+    if (memfd_threshold_ == 0) return wire::write_frames(fd_, msgs, flags, &encoder_);
+    // Runs of ordinary messages go out gathered as usual, each large one as its own memfd frame.
+    std::size_t done = 0;
+    while (done < msgs.size()) {
+      const bool last = done + 1 == msgs.size();
+      if (by_memfd(msgs[done], done == 0, last, flags)) {
+        auto st = wire::write_fd_frame(fd_, msgs[done], flags, &encoder_);
+        if (!st.ok()) {
+          if (done == 0) return st.status();
+          break;
+        }
+        ++done;
+        continue;
+      }
+      std::size_t end = done + 1;
+      while (end < msgs.size() && !by_memfd(msgs[end], false, end + 1 == msgs.size(), flags)) ++end;
+      // Fragment bits of the whole send apply to the first / last message of this run only where
+      // those are the send's own.
+      std::uint32_t run_flags = flags & ~wire::kFragmentFlags;
+      if (done == 0) run_flags |= flags & to_u32(FrameFlags::kFragCont);
+      if (end == msgs.size()) run_flags |= flags & to_u32(FrameFlags::kFrag);
+      const std::size_t run = end - done;
+      auto n = wire::write_frames(fd_, msgs.subspan(done, run), run_flags, &encoder_);
+      if (!n.ok()) {
+        if (done == 0) return n.status();
+        break;
+      }
+      done += n.value();
+      if (n.value() != run) break;
+    }
+    return done;
+  }
+
+  PollHandle poll_handle() const override { return static_cast<PollHandle>(fd_); }
+
+  // Buffered frames first; one non-blocking recv() only if they do not fill `out`.
+  Result<std::size_t> try_recv_batch(std::span<Message> out) override {
+    if (fd_ < 0) return Status::closed("pipe closed");
+    if (attached()) return pop_fed(out);
+    std::size_t n = 0;
+    auto pop = [&]() -> Result<void> {
+      while (n < out.size()) {
+        auto popped = pop_buffered(&out[n]);
+        if (!popped.ok()) return popped.status();
+        if (!popped.value()) break;
+        ++n;
+      }
+      return {};
+    };
+    auto st = pop();
+    if (st.ok() && n < out.size()) {
+      auto filled = reader_.fill_nonblocking(fd_);
+      if (!filled.ok()) st = filled.status();
+      else if (filled.value()) st = pop();
+    }
+    if (!st.ok() && n == 0) return st.status();
+    return n;
+  }
+
+  // Engines receive into their own buffers and cannot take passed descriptors off the socket.
+  detail::StreamEndpoint* stream_endpoint() override { return memfd_threshold_ != 0 ? nullptr : this; }
+
+  // The span sits right behind header room in a per-pipe frame buffer, so commit is one write.
+  // Anything larger than a frame is staged in a pooled message and sent in fragments.
+  Result<std::span<std::uint8_t>> reserve(std::size_t size, const SendOptions&) override {
+    if (fd_ < 0) return Status::closed("pipe closed");
+    reserved_ = kNoReservation;
+    staged_.cancel();
+    if (size > wire::kMaxFramePayload) return staged_.reserve(size);
+    if (tx_buf_.empty()) tx_buf_ = Message::allocate(wire::kHeaderLen + wire::kMaxFramePayload);
+    reserved_ = size;
+    return std::span<std::uint8_t>(tx_buf_.data() + wire::kHeaderLen, size);
+  }
+
+  Result<void> commit(std::size_t len, const SendOptions& opt) override {
+    if (fd_ < 0) return Status::closed("pipe closed");
+    if (reserved_ == kNoReservation) return staged_.commit(*this, len, opt);
+    if (len > reserved_) return Status::invalid_argument("commit exceeds reservation");
+    reserved_ = kNoReservation;
+    std::uint64_t token = 0;
+    if (auto eng = engine(&token)) {
+      // The engine keeps the payload until the kernel is done with it; the next reserve() starts
+      // on a fresh buffer.
+      Message m = tx_buf_.slice(wire::kHeaderLen, len);
+      tx_buf_ = Message();
+      auto n = eng->send(token, std::span<const Message>(&m, 1), opt);
+      if (n.ok()) return {};
+      if (n.status().code() != StatusCode::kNotSupported) return n.status();
+      return wire::write_frame(fd_, m, wire::send_flags(opt), &encoder_);
+    }
+
+    if (opt.timeout.count() > 0) {
+      auto st = socket_utils::wait_writable(fd_, opt.timeout);
+      if (!st.ok()) return st;
+    }
+
+    const std::uint32_t flags = wire::send_flags(opt);
+    if (memfd_threshold_ != 0 && len >= memfd_threshold_ && !wire::is_fragment(flags)) {
+      return wire::write_fd_frame(fd_, tx_buf_.slice(wire::kHeaderLen, len), flags, &encoder_);
+    }
+    return wire::write_prefixed_frame(fd_, tx_buf_.data(), len, flags, &encoder_);
   }
 
   Result<Message> recv(const RecvOptions& opt) override {
     if (fd_ < 0) return Status::closed("pipe closed");
+    if (attached()) return Status::not_supported("pipe is driven by a reactor; use try_recv_batch");
+
+    // Frames left over from an earlier receive need no waiting.
+    Message m;
+    auto popped = pop_buffered(&m);
+    if (!popped.ok()) return popped.status();
+    if (popped.value()) return m;
 
     // Wait for readable if timeout is specified.
     if (opt.timeout.count() > 0) {
@@ -48,57 +199,104 @@ class UdsPipe final : public Pipe {
       if (!st.ok()) return st.status();
     }
 
-    return wire::read_frame(fd_);
+    return reader_.read(fd_);
+  }
+
+  // The first frame may block; the rest are whatever that receive already buffered.
+  Result<std::size_t> recv_batch(std::span<Message> out, const RecvOptions& opt) override {
+    if (out.empty()) return std::size_t{0};
+    auto first = recv(opt);
+    if (!first.ok()) return first.status();
+    out[0] = std::move(first.value());
+    std::size_t n = 1;
+    while (n < out.size()) {
+      auto popped = pop_buffered(&out[n]);
+      if (!popped.ok() || !popped.value()) break;
+      ++n;
+    }
+    return n;
   }
 
   void close() override {
     if (fd_ >= 0) {
+      std::uint64_t token = 0;
+      if (auto eng = engine(&token)) eng->closed(token);
       ::close(fd_);
       fd_ = -1;
     }
   }
 
  private:
+  static constexpr std::size_t kNoReservation = ~std::size_t{0};
+
+  wire::SocketHandle socket() const override { return fd_; }
+
+  // Whether message `m` (first / last of its send) goes out as a memfd: large enough, and whole
+  // (descriptor frames are never fragments).
+  bool by_memfd(const Message& m, bool first, bool last, std::uint32_t flags) const {
+    return memfd_threshold_ != 0 && m.size() >= memfd_threshold_ &&
+           wire::is_whole_frame(m, first, last, flags, Message::kMaxSize);
+  }
+
   int fd_ = -1;
+  std::size_t memfd_threshold_ = 0;  // 0: everything goes through the socket
+  Message tx_buf_;  // frame header room + reserved payload, allocated on first reserve()
+  std::size_t reserved_ = kNoReservation;
+  detail::StagedSend staged_;  // reservations too big for tx_buf_
 };
 
 class UdsListener final : public Listener {
  public:
-  UdsListener(int fd, std::string path) : fd_(fd), path_(std::move(path)) {}
+  UdsListener(int fd, std::string path, const FragmentOptions& fragments, wire::CompactFraming framing,
+              const CompressionOptions& compression, const UdsOptions& uds)
+      : fd_(fd),
+        path_(std::move(path)),
+        fragments_(fragments),
+        framing_(framing),
+        compression_(compression),
+        uds_(uds) {}
 
   ~UdsListener() override { close(); }
 
   Result<std::unique_ptr<Pipe>> accept() override {
-    if (fd_ < 0) return Status::closed("listener closed");
+    const int fd = fd_.load(std::memory_order_acquire);
+    if (fd < 0) return Status::closed("listener closed");
 
-    int cfd = ::accept(fd_, nullptr, nullptr);
+    int cfd = ::accept(fd, nullptr, nullptr);
     if (cfd < 0) {
+      if (fd_.load(std::memory_order_acquire) < 0) return Status::closed("listener closed");
       return Status::io_error("accept() failed");
     }
 #if defined(__APPLE__)
     int one = 1;
     (void)::setsockopt(cfd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
 #endif
-    return std::unique_ptr<Pipe>(new UdsPipe(cfd));
+    return std::unique_ptr<Pipe>(new UdsPipe(cfd, fragments_, framing_, compression_, uds_));
   }
 
   Result<std::string> local_address() const override {
-    if (fd_ < 0) return Status::closed("listener closed");
+    if (fd_.load(std::memory_order_acquire) < 0) return Status::closed("listener closed");
     return std::string("uds://") + path_;
   }
 
+  // Safe while another thread is blocked in accept(), which then returns kClosed.
   void close() override {
-    if (fd_ >= 0) {
-      ::close(fd_);
-      fd_ = -1;
+    const int fd = fd_.exchange(-1, std::memory_order_acq_rel);
+    if (fd >= 0) {
+      ::shutdown(fd, SHUT_RDWR);  // closing alone does not wake accept() on Linux
+      ::close(fd);
       // Remove the socket file to allow rebinding.
       ::unlink(path_.c_str());
     }
   }
 
  private:
-  int fd_ = -1;
+  std::atomic<int> fd_{-1};
   std::string path_;
+  FragmentOptions fragments_;
+  wire::CompactFraming framing_;
+  CompressionOptions compression_;
+  UdsOptions uds_;
 };
 
 static Result<int> connect_uds(const std::string& path, std::chrono::milliseconds timeout) {
@@ -218,7 +416,10 @@ Result<std::unique_ptr<Listener>> uds_listen(const std::string& path, const List
 #else
   auto fd = listen_uds(path, opt.backlog);
   if (!fd.ok()) return fd.status();
-  return std::unique_ptr<Listener>(new UdsListener(fd.value(), path));
+  return std::unique_ptr<Listener>(new UdsListener(fd.value(), path, opt.fragments,
+                                                   opt.compact_frames ? wire::CompactFraming::kAnswer
+                                                                      : wire::CompactFraming::kOff,
+                                                   opt.compression, opt.uds));
 #endif
 }
 
@@ -230,7 +431,9 @@ Result<std::unique_ptr<Pipe>> uds_dial(const std::string& path, const DialOption
 #else
   auto fd = connect_uds(path, opt.timeout);
   if (!fd.ok()) return fd.status();
-  return std::unique_ptr<Pipe>(new UdsPipe(fd.value()));
+  return std::unique_ptr<Pipe>(new UdsPipe(fd.value(), opt.fragments,
+                                           detail::dial_framing(opt),
+                                           opt.compression, opt.uds));
 #endif
 }
 
@@ -1,5 +1,7 @@
 #include "duct/duct.h"
 
+#include <algorithm>
+#include <array>
 #include <atomic>
 #include <cerrno>
 #include <chrono>
@@ -9,7 +11,9 @@
 #include <cstdlib>
 #include <cstring>
 #include <memory>
+#include <new>
 #include <random>
+#include <span>
 #include <string>
 #include <string_view>
 #include <vector>
@@ -21,12 +25,13 @@
 #error "This file should only be compiled on Windows"
 #endif
 
+#include "shm_layout.h"
+
 namespace duct {
 namespace {
 
-// Windows shared memory constants
-constexpr std::size_t kSlotPayloadMax = 64 * 1024;
-constexpr std::uint32_t kSlotCount = 64;  // 64 * 64KB = 4MB per ring
+using shm::kSlotPayloadMax;
+using shm::ShmHeader;
 
 static std::string sanitize_name(std::string_view s) {
   std::string out;
@@ -70,29 +75,6 @@ static std::string make_win_name(const std::string& prefix, const std::string& s
   return "Duct_" + prefix + "_" + suffix;
 }
 
-struct alignas(64) RingMeta {
-  std::atomic_uint32_t head{0};  // producer increments
-  std::atomic_uint32_t tail{0};  // consumer increments
-};
-
-struct Slot {
-  std::uint32_t len = 0;
-  std::uint32_t _pad = 0;
-  std::uint8_t data[kSlotPayloadMax];
-};
-
-struct Ring {
-  RingMeta meta;
-  Slot slots[kSlotCount];
-};
-
-struct ShmLayout {
-  Ring c2s;  // client to server
-  Ring s2c;  // server to client
-};
-
-static constexpr std::size_t kShmSize = sizeof(ShmLayout);
-
 struct ShmNames {
   std::string base;  // already sanitized
   std::string connid;
@@ -149,7 +131,8 @@ static SECURITY_ATTRIBUTES* get_global_security_attributes() {
 
 struct ShmHandles {
   HANDLE shm_handle = INVALID_HANDLE_VALUE;
-  ShmLayout* mem = nullptr;
+  ShmHeader* mem = nullptr;
+  std::size_t size = 0;
   HANDLE c2s_items = INVALID_HANDLE_VALUE;
   HANDLE c2s_spaces = INVALID_HANDLE_VALUE;
   HANDLE s2c_items = INVALID_HANDLE_VALUE;
@@ -205,8 +188,9 @@ static Result<void> wait_handle_opt(HANDLE handle, std::chrono::milliseconds tim
   }
 }
 
-static Result<ShmHandles> create_resources(const ShmNames& n) {
+static Result<ShmHandles> create_resources(const ShmNames& n, shm::RingKind kind) {
   ShmHandles h;
+  h.size = shm::segment_size(kind);
 
   // Create shared memory with default security (current user session)
   h.shm_handle = CreateFileMappingA(
@@ -214,7 +198,7 @@ static Result<ShmHandles> create_resources(const ShmNames& n) {
     NULL,  // Use default security attributes
     PAGE_READWRITE,
     0,
-    static_cast<DWORD>(kShmSize),
+    static_cast<DWORD>(h.size),
     n.shm.c_str()
   );
   if (h.shm_handle == NULL) {
@@ -222,37 +206,38 @@ static Result<ShmHandles> create_resources(const ShmNames& n) {
     return Status::io_error("CreateFileMapping failed with error: " + std::to_string(error));
   }
 
-  h.mem = static_cast<ShmLayout*>(MapViewOfFile(
+  void* view = MapViewOfFile(
     h.shm_handle,
     FILE_MAP_ALL_ACCESS,
     0, 0,
-    kShmSize
-  ));
-  if (h.mem == nullptr) {
+    h.size
+  );
+  if (view == nullptr) {
     close_handles(&h);
     return Status::io_error("MapViewOfFile failed");
   }
 
-  std::memset(h.mem, 0, kShmSize);
-
-  // IMPORTANT: use counting semaphores (not Events). Auto-reset Events behave like capacity=1 and
-  // break ring-buffer backpressure. Semaphores correctly model item/space counts.
-  // 重要：这里必须用计数信号量（而不是 Event）。自动重置 Event 本质是 0/1，等价于容量=1，会破坏环形队列的背压语义。
-  // Named semaphores mirror POSIX semaphores:
-  // - items starts at 0 (ring empty)
-  // - spaces starts at kSlotCount (ring has capacity)
-  // 命名信号量语义与 POSIX sem_t 对齐：items 初始为 0（空），spaces 初始为 kSlotCount（满容量）。
-  const LONG max_count = static_cast<LONG>(kSlotCount);
-  h.c2s_items = CreateSemaphoreA(NULL, /*lInitialCount=*/0, max_count, n.c2s_items.c_str());
-  h.c2s_spaces = CreateSemaphoreA(NULL, /*lInitialCount=*/max_count, max_count, n.c2s_spaces.c_str());
-  h.s2c_items = CreateSemaphoreA(NULL, /*lInitialCount=*/0, max_count, n.s2c_items.c_str());
-  h.s2c_spaces = CreateSemaphoreA(NULL, /*lInitialCount=*/max_count, max_count, n.s2c_spaces.c_str());
+  // Pagefile-backed mappings start zero-filled; only construct the header and ring metadata so the
+  // payload area stays untouched until used.
+  // 新建的映射已清零；这里只构造头部和环形元数据，负载区在真正使用前不触碰。
+  h.mem = shm::init_segment(view, kind);
+
+  // Ring state lives in the shared atomics; these auto-reset Events are only parking spots.
+  // WaitOnAddress does not work across processes, so a side that announced itself via its
+  // *_waiting flag parks on the Event and the peer signals it only while the flag is up.
+  // A stale signal just causes a spurious wake-up, which the callers re-check.
+  // 环形队列状态全部在共享原子变量中；这些自动重置 Event 只用于挂起。WaitOnAddress 不能跨进程，
+  // 因此等待方先设置 *_waiting 标志再等待 Event，对端仅在标志置位时 SetEvent；多余的信号只会导致一次虚假唤醒。
+  h.c2s_items = CreateEventA(NULL, /*bManualReset=*/FALSE, /*bInitialState=*/FALSE, n.c2s_items.c_str());
+  h.c2s_spaces = CreateEventA(NULL, /*bManualReset=*/FALSE, /*bInitialState=*/FALSE, n.c2s_spaces.c_str());
+  h.s2c_items = CreateEventA(NULL, /*bManualReset=*/FALSE, /*bInitialState=*/FALSE, n.s2c_items.c_str());
+  h.s2c_spaces = CreateEventA(NULL, /*bManualReset=*/FALSE, /*bInitialState=*/FALSE, n.s2c_spaces.c_str());
 
   if (h.c2s_items == NULL || h.c2s_spaces == NULL ||
       h.s2c_items == NULL || h.s2c_spaces == NULL) {
     DWORD error = GetLastError();
     close_handles(&h);
-    return Status::io_error("CreateSemaphore failed with error: " + std::to_string(error));
+    return Status::io_error("CreateEvent failed with error: " + std::to_string(error));
   }
 
   return h;
@@ -268,30 +253,38 @@ static Result<ShmHandles> open_resources(const ShmNames& n) {
     return Status::io_error("OpenFileMapping failed with error: " + std::to_string(error));
   }
 
-  h.mem = static_cast<ShmLayout*>(MapViewOfFile(
-    h.shm_handle,
-    FILE_MAP_ALL_ACCESS,
-    0, 0,
-    kShmSize
-  ));
-  if (h.mem == nullptr) {
+  // The dialer picks the layout: map the whole section and size it from the view.
+  // 布局由拨号方决定：映射整个 section，再通过 VirtualQuery 得到大小。
+  void* view = MapViewOfFile(h.shm_handle, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+  if (view == nullptr) {
     close_handles(&h);
     return Status::io_error("MapViewOfFile failed");
   }
+  h.mem = static_cast<ShmHeader*>(view);
+  MEMORY_BASIC_INFORMATION mbi{};
+  if (VirtualQuery(view, &mbi, sizeof(mbi)) == 0) {
+    close_handles(&h);
+    return Status::io_error("VirtualQuery failed");
+  }
+  h.size = static_cast<std::size_t>(mbi.RegionSize);
+  if (!shm::segment_valid(h.mem, h.size)) {
+    close_handles(&h);
+    return Status::protocol_error("shm segment layout mismatch: " + n.shm);
+  }
 
-  // Open semaphores. Need SYNCHRONIZE for waits and SEMAPHORE_MODIFY_STATE for release.
-  // 打开信号量：等待需要 SYNCHRONIZE；ReleaseSemaphore 需要 SEMAPHORE_MODIFY_STATE。
-  DWORD access = SYNCHRONIZE | SEMAPHORE_MODIFY_STATE;
-  h.c2s_items = OpenSemaphoreA(access, FALSE, n.c2s_items.c_str());
-  h.c2s_spaces = OpenSemaphoreA(access, FALSE, n.c2s_spaces.c_str());
-  h.s2c_items = OpenSemaphoreA(access, FALSE, n.s2c_items.c_str());
-  h.s2c_spaces = OpenSemaphoreA(access, FALSE, n.s2c_spaces.c_str());
+  // Open events. Need SYNCHRONIZE for waits and EVENT_MODIFY_STATE for SetEvent.
+  // 打开 Event：等待需要 SYNCHRONIZE；SetEvent 需要 EVENT_MODIFY_STATE。
+  DWORD access = SYNCHRONIZE | EVENT_MODIFY_STATE;
+  h.c2s_items = OpenEventA(access, FALSE, n.c2s_items.c_str());
+  h.c2s_spaces = OpenEventA(access, FALSE, n.c2s_spaces.c_str());
+  h.s2c_items = OpenEventA(access, FALSE, n.s2c_items.c_str());
+  h.s2c_spaces = OpenEventA(access, FALSE, n.s2c_spaces.c_str());
 
   if (h.c2s_items == NULL || h.c2s_spaces == NULL ||
       h.s2c_items == NULL || h.s2c_spaces == NULL) {
     DWORD error = GetLastError();
     close_handles(&h);
-    return Status::io_error("OpenSemaphore failed with error: " + std::to_string(error));
+    return Status::io_error("OpenEvent failed with error: " + std::to_string(error));
   }
 
   return h;
@@ -320,68 +313,158 @@ static Result<HANDLE> create_bootstrap_pipe(const std::string& path) {
 
 class ShmPipe final : public Pipe {
  public:
-  ShmPipe(ShmHandles h, ShmNames n, bool owner, bool is_client)
-      : h_(h), names_(std::move(n)), owner_(owner), is_client_(is_client) {}
+  ShmPipe(ShmHandles h, ShmNames n, bool owner, bool is_client, bool zero_copy_recv,
+          const FragmentOptions& fragments)
+      : h_(h),
+        names_(std::move(n)),
+        owner_(owner),
+        is_client_(is_client),
+        tx_(h_.mem, /*c2s=*/is_client),
+        rx_(h_.mem, /*c2s=*/!is_client),
+        reassembler_(fragments) {
+    if (zero_copy_recv) {
+      HANDLE spaces = is_client_ ? h_.s2c_spaces : h_.c2s_spaces;
+      leases_ = new shm::LeaseTable(&rx_.meta(), [spaces] { (void)SetEvent(spaces); });
+    }
+  }
 
   ~ShmPipe() override { close(); }
 
   Result<void> send(const Message& msg, const SendOptions& opt) override {
-    if (!h_.mem) return Status::closed("pipe closed");
-    if (msg.size() > kSlotPayloadMax) {
-      return Status::invalid_argument("message too large; fragmentation TODO");
-    }
+    auto n = send_batch(std::span<const Message>(&msg, 1), opt);
+    if (!n.ok()) return n.status();
+    return {};
+  }
 
-    Ring* tx = is_client_ ? &h_.mem->c2s : &h_.mem->s2c;
-    HANDLE spaces = is_client_ ? h_.c2s_spaces : h_.s2c_spaces;
-    HANDLE items = is_client_ ? h_.c2s_items : h_.s2c_items;
+  Result<Message> recv(const RecvOptions& opt) override {
+    Message m;
+    auto n = recv_batch(std::span<Message>(&m, 1), opt);
+    if (!n.ok()) return n.status();
+    return m;
+  }
 
-    auto st = wait_handle_opt(spaces, opt.timeout);
-    if (!st.ok()) return st;
+  // Everything that fits is published with one head store and at most one SetEvent. A message
+  // larger than an entry goes out as a run of fragments, one publish each.
+  // 能放下的消息一次性发布：一次 head 写入，最多一次 SetEvent。超过单个条目的消息拆成分片逐个发布。
+  Result<std::size_t> send_batch(std::span<const Message> msgs, const SendOptions& opt) override {
+    if (!h_.mem) return Status::closed("pipe closed");
 
-    std::uint32_t head = tx->meta.head.load(std::memory_order_relaxed);
-    std::uint32_t idx = head % kSlotCount;
-    tx->slots[idx].len = static_cast<std::uint32_t>(msg.size());
-    if (msg.size() != 0) {
-      std::memcpy(tx->slots[idx].data, msg.data(), msg.size());
+    const std::uint32_t flags = wire::send_flags(opt);
+    auto deadline = std::chrono::steady_clock::now() + opt.timeout;
+    std::size_t sent = 0;
+    while (sent < msgs.size()) {
+      auto whole = [&](std::size_t i) {
+        return wire::is_whole_frame(msgs[i], i == 0, i + 1 == msgs.size(), flags, kSlotPayloadMax);
+      };
+      Result<void> st;
+      if (whole(sent)) {
+        std::size_t end = sent + 1;
+        while (end < msgs.size() && whole(end)) ++end;
+        st = push([&] {
+          std::size_t k = tx_.try_push_batch(msgs.data() + sent, end - sent, flags & ~wire::kFragmentFlags);
+          sent += k;
+          return k != 0;
+        }, deadline, opt);
+      } else {
+        const Message& m = msgs[sent];
+        wire::for_each_frame(m, sent == 0, sent + 1 == msgs.size(), flags, [&](std::size_t off, std::size_t len, std::uint32_t ff) {
+          if (st.ok()) st = push([&] { return tx_.try_push(m.data() + off, len, ff); }, deadline, opt);
+        }, kSlotPayloadMax);
+        if (st.ok()) ++sent;
+      }
+      if (!st.ok()) {
+        if (sent == 0) return st.status();
+        break;
+      }
     }
-    tx->meta.head.store(head + 1, std::memory_order_release);
+    return sent;
+  }
 
-    if (!ReleaseSemaphore(items, /*lReleaseCount=*/1, NULL)) {
-      DWORD error = GetLastError();
-      return Status::io_error("ReleaseSemaphore(items) failed with error: " + std::to_string(error));
+  // The span is the slab block (or byte-ring record) the consumer will read from.
+  // 返回的 span 即消费者将读取的 slab 块（或字节环记录）。
+  Result<std::span<std::uint8_t>> reserve(std::size_t size, const SendOptions& opt) override {
+    if (!h_.mem) return Status::closed("pipe closed");
+    tx_.cancel_reservation();
+    staged_.cancel();
+    // Too big for one entry: the fallback buffer, sent as fragments on commit.
+    // 超过单个条目：使用后备缓冲区，提交时分片发送。
+    if (size > kSlotPayloadMax) return staged_.reserve(size);
+
+    shm::RingMeta& meta = tx_.meta();
+    auto deadline = std::chrono::steady_clock::now() + opt.timeout;
+    for (;;) {
+      std::uint8_t* p = tx_.try_reserve(size);
+      if (!p) {
+        std::uint32_t seen = meta.tail.load(std::memory_order_acquire);
+        p = tx_.try_reserve(size);
+        if (!p) {
+          auto st = wait_space(seen, deadline, opt);
+          if (!st.ok()) return st.status();
+          continue;
+        }
+      }
+      return std::span<std::uint8_t>(p, size);
     }
+  }
+
+  Result<void> commit(std::size_t len, const SendOptions& opt) override {
+    if (!h_.mem) return Status::closed("pipe closed");
+    if (!tx_.reserved()) return staged_.commit(*this, len, opt);
+    if (len > tx_.reserved_len()) return Status::invalid_argument("commit exceeds reservation");
+    HANDLE items = is_client_ ? h_.c2s_items : h_.s2c_items;
+    shm::RingMeta& meta = tx_.meta();
+    tx_.commit(len, wire::send_flags(opt));
+    shm::notify_change(meta.consumer_waiting, [&] { (void)SetEvent(items); });
     return {};
   }
 
-  Result<Message> recv(const RecvOptions& opt) override {
+  // Drains everything published past our cursor (up to out.size()) with one tail store, or hands
+  // it out as leases in zero-copy mode.
+  // 一次取出游标之后所有已发布的消息（最多 out.size() 条），只写一次 tail；零拷贝模式下以租约形式交出。
+  Result<std::size_t> recv_batch(std::span<Message> out, const RecvOptions& opt) override {
     if (!h_.mem) return Status::closed("pipe closed");
+    if (out.empty()) return std::size_t{0};
 
-    Ring* rx = is_client_ ? &h_.mem->s2c : &h_.mem->c2s;
     HANDLE items = is_client_ ? h_.s2c_items : h_.c2s_items;
-    HANDLE spaces = is_client_ ? h_.s2c_spaces : h_.c2s_spaces;
-
-    auto st = wait_handle_opt(items, opt.timeout);
-    if (!st.ok()) return st.status();
-
-    std::uint32_t tail = rx->meta.tail.load(std::memory_order_relaxed);
-    std::uint32_t idx = tail % kSlotCount;
-    std::uint32_t len = rx->slots[idx].len;
-    if (len > kSlotPayloadMax) {
-      return Status::protocol_error("shm slot len too large");
+    shm::RingMeta& meta = rx_.meta();
+
+    auto deadline = std::chrono::steady_clock::now() + opt.timeout;
+    for (;;) {
+      auto popped = drain(out);
+      if (!popped.ok()) return popped.status();
+      if (popped.value() != 0) return popped.value();
+      std::chrono::milliseconds wait = opt.timeout;
+      if (opt.timeout.count() != 0) {
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+        if (left.count() <= 0) return Status::timeout("shm recv timeout");
+        wait = left;
+      }
+      // Empty means head == our cursor; wait for head to move past it.
+      // 队列为空即 head == 游标；等待 head 前进。
+      std::uint32_t seen = rx_.cursor();
+      auto st = shm::wait_change(meta.head, seen, meta.consumer_waiting, wait,
+                                 [&](std::uint32_t, std::chrono::milliseconds t) { return wait_handle_opt(items, t); });
+      if (!st.ok()) return st.status();
     }
+  }
 
-    Message m = Message::from_bytes(rx->slots[idx].data, len);
-    rx->meta.tail.store(tail + 1, std::memory_order_release);
-
-    if (!ReleaseSemaphore(spaces, /*lReleaseCount=*/1, NULL)) {
-      DWORD error = GetLastError();
-      return Status::io_error("ReleaseSemaphore(spaces) failed with error: " + std::to_string(error));
-    }
-    return m;
+  // No readiness handle yet; reactors poll shm pipes through this.
+  // 非阻塞接收：只取出当前已发布的消息。
+  Result<std::size_t> try_recv_batch(std::span<Message> out) override {
+    if (!h_.mem) return Status::closed("pipe closed");
+    if (out.empty()) return std::size_t{0};
+    return drain(out);
   }
 
   void close() override {
     if (!h_.mem && h_.shm_handle == INVALID_HANDLE_VALUE) return;
+    if (leases_) {
+      // Outstanding leases still point into the view; the last one to go unmaps it.
+      // 仍有租约指向映射视图，由最后一个释放的租约负责解除映射。
+      leases_->detach([mem = h_.mem] { UnmapViewOfFile(mem); });
+      leases_ = nullptr;
+      h_.mem = nullptr;
+    }
     close_handles(&h_);
 
     if (owner_) {
@@ -391,15 +474,79 @@ class ShmPipe final : public Pipe {
   }
 
  private:
+  // Retry `try_push` (true once something was published) until it succeeds, waiting for room
+  // within opt.timeout, then wake the consumer.
+  // 反复尝试 `try_push`（有内容发布即返回 true），空间不足时在超时范围内等待，成功后唤醒消费者。
+  template <class TryPush>
+  Result<void> push(TryPush&& try_push, std::chrono::steady_clock::time_point deadline, const SendOptions& opt) {
+    HANDLE items = is_client_ ? h_.c2s_items : h_.s2c_items;
+    shm::RingMeta& meta = tx_.meta();
+    for (;;) {
+      if (!try_push()) {
+        // Out of room: snapshot tail, re-check, then wait for the consumer to move it.
+        // 空间不足：记录 tail，再检查一次，然后等待消费者推进 tail。
+        std::uint32_t seen = meta.tail.load(std::memory_order_acquire);
+        if (!try_push()) {
+          auto st = wait_space(seen, deadline, opt);
+          if (!st.ok()) return st;
+          continue;
+        }
+      }
+      shm::notify_change(meta.consumer_waiting, [&] { (void)SetEvent(items); });
+      return {};
+    }
+  }
+
+  // Out of room: wait (within opt.timeout) for the consumer to move tail away from `seen`.
+  // 空间不足：在超时范围内等待消费者把 tail 从 `seen` 推进。
+  Result<void> wait_space(std::uint32_t seen, std::chrono::steady_clock::time_point deadline, const SendOptions& opt) {
+    std::chrono::milliseconds wait = opt.timeout;
+    if (opt.timeout.count() != 0) {
+      auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+      if (left.count() <= 0) return Status::timeout("shm ring full (timeout)");
+      wait = left;
+    }
+    HANDLE spaces = is_client_ ? h_.c2s_spaces : h_.s2c_spaces;
+    shm::RingMeta& meta = tx_.meta();
+    return shm::wait_change(meta.tail, seen, meta.producer_waiting, wait,
+                            [&](std::uint32_t, std::chrono::milliseconds t) { return wait_handle_opt(spaces, t); });
+  }
+
+  Result<std::size_t> drain(std::span<Message> out) {
+    if (!leases_) {
+      HANDLE spaces = is_client_ ? h_.s2c_spaces : h_.c2s_spaces;
+      shm::RingMeta& meta = rx_.meta();
+      const std::uint32_t start = rx_.cursor();
+      auto popped = rx_.try_pop_batch(out.data(), out.size(), reassembler_);
+      if (rx_.cursor() != start) {
+        shm::notify_change(meta.producer_waiting, [&] { (void)SetEvent(spaces); });
+      }
+      return popped;
+    }
+    std::array<shm::RxRing::Slot, 64> slots;
+    auto taken = rx_.try_take_batch(slots.data(), std::min(out.size(), slots.size()));
+    if (!taken.ok()) return taken;
+    return leases_->hand_out(slots.data(), taken.value(), out.data(), reassembler_);
+  }
+
   ShmHandles h_{};
   ShmNames names_{};
   bool owner_ = false;
   bool is_client_ = false;
+  shm::TxRing tx_;
+  detail::StagedSend staged_;  // reservations too big for a ring entry
+  shm::RxRing rx_;
+  shm::LeaseTable* leases_ = nullptr;  // zero-copy mode only; detached (not deleted) on close
+  wire::Reassembler reassembler_;
 };
 
 class ShmListener final : public Listener {
  public:
-  ShmListener(ShmNames names, HANDLE bootstrap_pipe) : names_(std::move(names)), bootstrap_pipe_(bootstrap_pipe) {}
+  ShmListener(ShmNames names, HANDLE bootstrap_pipe, bool zero_copy_recv, const FragmentOptions& fragments)
+      : names_(std::move(names)),
+        bootstrap_pipe_(bootstrap_pipe),
+        zero_copy_recv_(zero_copy_recv),
+        fragments_(fragments) {}
   ~ShmListener() override { close(); }
 
   Result<std::unique_ptr<Pipe>> accept() override {
@@ -445,7 +592,7 @@ class ShmListener final : public Listener {
     if (!h.ok()) return h.status();
 
     return std::unique_ptr<Pipe>(new ShmPipe(h.value(), std::move(n),
-                                           /*owner=*/false, /*is_client=*/false));
+                                           /*owner=*/false, /*is_client=*/false, zero_copy_recv_, fragments_));
   }
 
   Result<std::string> local_address() const override {
@@ -462,23 +609,30 @@ class ShmListener final : public Listener {
  private:
   ShmNames names_;
   HANDLE bootstrap_pipe_ = INVALID_HANDLE_VALUE;
+  bool zero_copy_recv_ = false;
+  FragmentOptions fragments_;
 };
 
 }  // namespace
 
 Result<std::unique_ptr<Listener>> shm_listen(const std::string& name, const ListenOptions& opt) {
-  (void)opt;
+  if (opt.shm.broadcast.role != ShmBroadcastRole::kNone) {
+    return Status::invalid_argument("shm broadcast buses are dialed by the publisher and subscribers alike");
+  }
   ShmNames n = make_names(name, "0000000000000000");
   auto pipe = create_bootstrap_pipe(n.bootstrap_pipe);
   if (!pipe.ok()) return pipe.status();
-  return std::unique_ptr<Listener>(new ShmListener(std::move(n), pipe.value()));
+  return std::unique_ptr<Listener>(new ShmListener(std::move(n), pipe.value(), opt.shm.zero_copy_recv, opt.fragments));
 }
 
 Result<std::unique_ptr<Pipe>> shm_dial(const std::string& name, const DialOptions& opt) {
+  if (opt.shm.broadcast.role != ShmBroadcastRole::kNone) {
+    return Status::not_supported("shm broadcast is not supported on Windows yet");
+  }
   std::string connid = random_conn_id_hex16();
   ShmNames n = make_names(name, connid);
 
-  auto created = create_resources(n);
+  auto created = create_resources(n, shm::to_ring_kind(opt.shm.layout));
   if (!created.ok()) return created.status();
 
   // Connect to bootstrap pipe with retry + timeout:
@@ -539,7 +693,8 @@ Result<std::unique_ptr<Pipe>> shm_dial(const std::string& name, const DialOption
   }
 
   return std::unique_ptr<Pipe>(new ShmPipe(created.value(), std::move(n),
-                                          /*owner=*/true, /*is_client=*/true));
+                                          /*owner=*/true, /*is_client=*/true, opt.shm.zero_copy_recv,
+                                          opt.fragments));
 }
 
 }  // namespace duct
@@ -1,9 +1,11 @@
 #include "duct/wire.h"
 
+#include <algorithm>
 #include <cerrno>
 #include <cstdint>
 #include <cstring>
 
+#include "compression.h"
 #include "duct/protocol.h"
 
 #if defined(_WIN32)
@@ -12,8 +14,12 @@
 #pragma comment(lib, "ws2_32.lib")
 #else
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #endif
 
@@ -70,6 +76,87 @@ Result<FrameHeader> decode_header(const std::uint8_t in[kHeaderLen]) {
 
 namespace {
 
+constexpr std::uint32_t kCompactFrag = 1u << 0;
+constexpr std::uint32_t kCompactFragCont = 1u << 1;
+constexpr std::uint32_t kCompactChannel = 1u << 2;
+constexpr std::uint32_t kCompactCompressed = 1u << 3;
+constexpr unsigned kCompactBits = 4;
+// In the channel varint.
+constexpr std::uint32_t kCompactTraced = 1u << 16;
+}  // namespace
+
+std::size_t put_varint(std::uint32_t v, std::uint8_t* out) {
+  std::size_t n = 0;
+  while (v >= 0x80) {
+    out[n++] = static_cast<std::uint8_t>(v | 0x80);
+    v >>= 7;
+  }
+  out[n++] = static_cast<std::uint8_t>(v);
+  return n;
+}
+
+Result<std::size_t> get_varint(const std::uint8_t* in, std::size_t avail, std::uint32_t* v) {
+  std::uint32_t x = 0;
+  for (std::size_t i = 0; i < kMaxVarintLen; ++i) {
+    if (i == avail) return std::size_t{0};
+    x |= static_cast<std::uint32_t>(in[i] & 0x7f) << (7 * i);
+    if ((in[i] & 0x80) == 0) {
+      *v = x;
+      return i + 1;
+    }
+  }
+  return Status::protocol_error("bad compact header");
+}
+
+std::size_t encode_compact_header(std::size_t payload_len, std::uint32_t flags, std::uint8_t out[kMaxCompactHeaderLen]) {
+  std::uint32_t channel = frame_channel(flags);
+  if ((flags & to_u32(FrameFlags::kTraced)) != 0) channel |= kCompactTraced;
+  std::uint32_t v = static_cast<std::uint32_t>(payload_len) << kCompactBits;
+  if ((flags & to_u32(FrameFlags::kFrag)) != 0) v |= kCompactFrag;
+  if ((flags & to_u32(FrameFlags::kFragCont)) != 0) v |= kCompactFragCont;
+  if (channel != 0) v |= kCompactChannel;
+  if ((flags & to_u32(FrameFlags::kCompressed)) != 0) v |= kCompactCompressed;
+  std::size_t n = put_varint(v, out);
+  if (channel != 0) n += put_varint(channel, out + n);
+  return n;
+}
+
+Result<std::size_t> decode_compact_header(const std::uint8_t* in, std::size_t avail, FrameHeader* out) {
+  std::uint32_t v = 0;
+  auto n = get_varint(in, avail, &v);
+  if (!n.ok() || n.value() == 0) return n;
+  std::size_t len = n.value();
+  std::uint32_t flags = 0;
+  if ((v & kCompactFrag) != 0) flags |= to_u32(FrameFlags::kFrag);
+  if ((v & kCompactFragCont) != 0) flags |= to_u32(FrameFlags::kFragCont);
+  if ((v & kCompactCompressed) != 0) flags |= to_u32(FrameFlags::kCompressed);
+  if ((v & kCompactChannel) != 0) {
+    std::uint32_t channel = 0;
+    auto c = get_varint(in + len, avail - len, &channel);
+    if (!c.ok() || c.value() == 0) return c;
+    if ((channel & kCompactTraced) != 0) {
+      flags |= to_u32(FrameFlags::kTraced);
+      channel &= ~kCompactTraced;
+    } else if (channel == 0) {
+      return Status::protocol_error("bad compact header");
+    }
+    if (channel > 0xffff) return Status::protocol_error("bad compact header");
+    len += c.value();
+    flags |= channel_flags(static_cast<std::uint16_t>(channel));
+  }
+  out->magic = kProtocolMagic;
+  out->version = kProtocolVersionCompact;
+  out->header_len = static_cast<std::uint16_t>(len);
+  out->payload_len = v >> kCompactBits;
+  out->flags = flags;
+  if (out->payload_len > kMaxFramePayload) {
+    return Status::protocol_error("payload too large (frame)");
+  }
+  return len;
+}
+
+namespace {
+
 #if defined(_WIN32)
 // Windows socket error handling
 inline Result<void> ensure_winsock() {
@@ -101,7 +188,36 @@ inline bool interrupted(int error) {
 }
 #endif
 
-Result<void> write_all(SocketHandle fd, const std::uint8_t* p, std::size_t n) {
+// Frames per gathered write; two buffers each, well under IOV_MAX (1024 on Linux/macOS).
+constexpr std::size_t kMaxGatherFrames = 64;
+
+#if defined(_WIN32)
+using IoVec = WSABUF;
+inline void set_iov(IoVec* v, const void* p, std::size_t n) {
+  v->buf = static_cast<CHAR*>(const_cast<void*>(p));
+  v->len = static_cast<ULONG>(n);
+}
+inline std::size_t iov_len(const IoVec& v) { return v.len; }
+inline void iov_consume(IoVec* v, std::size_t n) {
+  v->buf += n;
+  v->len -= static_cast<ULONG>(n);
+}
+#else
+using IoVec = iovec;
+inline void set_iov(IoVec* v, const void* p, std::size_t n) {
+  v->iov_base = const_cast<void*>(p);
+  v->iov_len = n;
+}
+inline std::size_t iov_len(const IoVec& v) { return v.iov_len; }
+inline void iov_consume(IoVec* v, std::size_t n) {
+  v->iov_base = static_cast<std::uint8_t*>(v->iov_base) + n;
+  v->iov_len -= n;
+}
+#endif
+
+// Write every byte described by iov[0, cnt) with as few syscalls as the kernel allows, resuming
+// after partial writes. Entries must be non-empty.
+Result<void> write_iov(SocketHandle fd, IoVec* iov, std::size_t cnt) {
 #if defined(_WIN32)
   auto wsa = ensure_winsock();
   if (!wsa.ok()) return wsa;
@@ -111,36 +227,124 @@ Result<void> write_all(SocketHandle fd, const std::uint8_t* p, std::size_t n) {
   int one = 1;
   (void)::setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
 #endif
-  while (n != 0) {
+  while (cnt != 0) {
+    ++thread_io().writes;
 #if defined(_WIN32)
-    SOCKET sock = static_cast<SOCKET>(fd);
-    int w = ::send(sock, reinterpret_cast<const char*>(p), static_cast<int>(n), 0);
+    DWORD sent = 0;
+    if (::WSASend(static_cast<SOCKET>(fd), iov, static_cast<DWORD>(cnt), &sent, 0, nullptr, nullptr) != 0) {
+      int error = get_last_error();
+      if (interrupted(error)) continue;
+      return Status::io_error("WSASend() failed");
+    }
+    std::size_t w = sent;
+#else
+    msghdr mh{};
+    mh.msg_iov = iov;
+    mh.msg_iovlen = static_cast<decltype(mh.msg_iovlen)>(cnt);
+#if defined(MSG_NOSIGNAL)
+    ssize_t rc = ::sendmsg(fd, &mh, MSG_NOSIGNAL);
 #else
-    ssize_t w = ::send(fd, p, n, 0);
+    ssize_t rc = ::sendmsg(fd, &mh, 0);
 #endif
-    if (w < 0) {
+    if (rc < 0) {
       int error = get_last_error();
       if (interrupted(error)) continue;
-      return Status::io_error("send() failed");
+      return Status::io_error("sendmsg() failed");
     }
+    std::size_t w = static_cast<std::size_t>(rc);
+#endif
     if (w == 0) return Status::closed("peer closed");
-    p += static_cast<std::size_t>(w);
-    n -= static_cast<std::size_t>(w);
+    while (cnt != 0 && w >= iov_len(*iov)) {
+      w -= iov_len(*iov);
+      ++iov;
+      --cnt;
+    }
+    if (cnt != 0) iov_consume(iov, w);
   }
   return {};
 }
 
-Result<void> read_exact(SocketHandle fd, std::uint8_t* p, std::size_t n) {
+FrameHeader make_header(std::size_t payload_len, std::uint32_t flags) {
+  FrameHeader h;
+  h.magic = kProtocolMagic;
+  h.version = kProtocolVersion;
+  h.header_len = static_cast<std::uint16_t>(kHeaderLen);
+  h.payload_len = static_cast<std::uint32_t>(payload_len);
+  h.flags = flags;
+  return h;
+}
+
+std::uint32_t load_be32(const std::uint8_t* p) {
+  std::uint32_t v = 0;
+  std::memcpy(&v, p, 4);
+  return ntohl(v);
+}
+
+void store_be(std::uint64_t v, std::size_t n, std::uint8_t* out) {
+  for (std::size_t i = 0; i < n; ++i) out[i] = static_cast<std::uint8_t>(v >> (8 * (n - 1 - i)));
+}
+
+std::uint64_t load_be(const std::uint8_t* p, std::size_t n) {
+  std::uint64_t v = 0;
+  for (std::size_t i = 0; i < n; ++i) v = v << 8 | p[i];
+  return v;
+}
+
+#if !defined(_WIN32)
+// Descriptors one receive can take. A stream socket hands over at most one sendmsg()'s worth per
+// recvmsg(), and write_fd_frame() passes one.
+constexpr std::size_t kMaxPassedFds = 8;
+// Descriptors a reader holds for frames it has not parsed yet. Each one stands for a payload of at
+// least UdsOptions::memfd_threshold bytes still in the receive buffer, so a peer legitimately
+// keeps only a handful in flight; past this it is passing descriptors it sends no frames for.
+constexpr std::size_t kMaxQueuedFds = 64;
+
+// recv(), or with `fds` a recvmsg() that appends the descriptors passed with the bytes (SCM_RIGHTS)
+// in arrival order.
+ssize_t recv_with_fds(int fd, std::uint8_t* p, std::size_t n, int flags, std::deque<int>* fds) {
+  if (fds == nullptr) return ::recv(fd, p, n, flags);
+  iovec iov{p, n};
+  alignas(cmsghdr) char ctrl[CMSG_SPACE(kMaxPassedFds * sizeof(int))];
+  msghdr mh{};
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  mh.msg_control = ctrl;
+  mh.msg_controllen = sizeof(ctrl);
+#if defined(MSG_CMSG_CLOEXEC)
+  flags |= MSG_CMSG_CLOEXEC;
+#endif
+  ssize_t r = ::recvmsg(fd, &mh, flags);
+  if (r < 0) return r;
+  for (cmsghdr* c = CMSG_FIRSTHDR(&mh); c != nullptr; c = CMSG_NXTHDR(&mh, c)) {
+    if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) continue;
+    const std::size_t count = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for (std::size_t i = 0; i < count; ++i) {
+      int passed = -1;
+      std::memcpy(&passed, CMSG_DATA(c) + i * sizeof(int), sizeof(int));
+      fds->push_back(passed);
+    }
+  }
+  if ((mh.msg_flags & MSG_CTRUNC) != 0) {
+    errno = EMSGSIZE;  // descriptors were dropped: the frames they belong to cannot be read
+    return -1;
+  }
+  return r;
+}
+#endif
+
+// One recv() of up to `n` bytes; returns how many arrived (never 0: EOF is kClosed).
+Result<std::size_t> read_some(SocketHandle fd, std::uint8_t* p, std::size_t n, std::deque<int>* fds = nullptr) {
 #if defined(_WIN32)
   auto wsa = ensure_winsock();
-  if (!wsa.ok()) return wsa;
+  if (!wsa.ok()) return wsa.status();
 #endif
-  while (n != 0) {
+  for (;;) {
+    ++thread_io().reads;
 #if defined(_WIN32)
     SOCKET sock = static_cast<SOCKET>(fd);
     int r = ::recv(sock, reinterpret_cast<char*>(p), static_cast<int>(n), 0);
 #else
-    ssize_t r = ::recv(fd, p, n, 0);
+    ssize_t r = recv_with_fds(fd, p, n, 0, fds);
 #endif
     if (r < 0) {
       int error = get_last_error();
@@ -148,31 +352,295 @@ Result<void> read_exact(SocketHandle fd, std::uint8_t* p, std::size_t n) {
       return Status::io_error("recv() failed");
     }
     if (r == 0) return Status::closed("peer closed");
-    p += static_cast<std::size_t>(r);
-    n -= static_cast<std::size_t>(r);
+    return static_cast<std::size_t>(r);
+  }
+}
+
+// Like read_some, but returns 0 instead of blocking when nothing is available.
+Result<std::size_t> read_available(SocketHandle fd, std::uint8_t* p, std::size_t n, std::deque<int>* fds = nullptr) {
+#if defined(_WIN32)
+  (void)fds;
+  auto wsa = ensure_winsock();
+  if (!wsa.ok()) return wsa.status();
+  // No per-call MSG_DONTWAIT on Winsock; a zero-timeout select() keeps the socket's mode untouched.
+  SOCKET sock = static_cast<SOCKET>(fd);
+  fd_set rs;
+  FD_ZERO(&rs);
+  FD_SET(sock, &rs);
+  timeval tv{};
+  int ready = ::select(0, &rs, nullptr, nullptr, &tv);
+  if (ready < 0) return Status::io_error("select() failed");
+  if (ready == 0) return std::size_t{0};
+  return read_some(fd, p, n);
+#else
+  for (;;) {
+    ++thread_io().reads;
+    ssize_t r = recv_with_fds(fd, p, n, MSG_DONTWAIT, fds);
+    if (r < 0) {
+      int error = get_last_error();
+      if (interrupted(error)) continue;
+      if (error == EAGAIN || error == EWOULDBLOCK) return std::size_t{0};
+      return Status::io_error("recv() failed");
+    }
+    if (r == 0) return Status::closed("peer closed");
+    return static_cast<std::size_t>(r);
+  }
+#endif
+}
+
+Result<void> read_exact(SocketHandle fd, std::uint8_t* p, std::size_t n) {
+  while (n != 0) {
+    auto r = read_some(fd, p, n);
+    if (!r.ok()) return r.status();
+    p += r.value();
+    n -= r.value();
   }
   return {};
 }
 
+#if !defined(_WIN32)
+// Nobody can shrink or write `fd` any more. F_GET_SEALS fails (-1) for anything but a memfd, which
+// counts as unsealed; without file seals (non-Linux) nothing passed can be trusted.
+bool sealed(int fd) {
+#if defined(__linux__)
+  const int seals = ::fcntl(fd, F_GET_SEALS);
+  return seals >= 0 && (seals & (F_SEAL_SHRINK | F_SEAL_WRITE)) == (F_SEAL_SHRINK | F_SEAL_WRITE);
+#else
+  (void)fd;
+  return false;
+#endif
+}
+#endif
+
+// A passed kFdPayload descriptor as a read-only message of `size` bytes. Takes `fd` over.
+Result<Message> map_passed(int fd, std::uint64_t size) {
+#if defined(_WIN32)
+  (void)fd;
+  (void)size;
+  return Status::not_supported("passed descriptors need uds://");
+#else
+  Status bad;
+  struct stat st {};
+  if (size == 0 || size > Message::kMaxSize) {
+    bad = Status::protocol_error("bad passed payload size: " + std::to_string(size));
+  } else if (::fstat(fd, &st) != 0 || static_cast<std::uint64_t>(st.st_size) < size) {
+    bad = Status::protocol_error("passed payload shorter than its frame");
+  } else if (!sealed(fd)) {
+    // Unsealed, the sender could shrink the file under our mapping (SIGBUS) or rewrite it.
+    bad = Status::protocol_error("passed payload is not sealed");
+  }
+  if (!bad.ok()) {
+    ::close(fd);
+    return bad;
+  }
+  void* p = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (p == MAP_FAILED) return Status::io_error("mmap() of a passed payload failed");
+  const std::size_t len = static_cast<std::size_t>(size);
+  return Message::adopt(p, len, [len](void* data) { ::munmap(data, len); });
+#endif
+}
+
 }  // namespace
 
-Result<void> write_frame(SocketHandle fd, const Message& msg, std::uint32_t flags) {
-  if (msg.size() > kMaxFramePayload) {
-    return Status::invalid_argument("message too large; enable fragmentation (todo)");
+bool FrameEncoder::take_hello(std::uint8_t out[kHelloLen]) {
+  if (state_.load(std::memory_order_acquire) != kHelloDue) return false;
+  FrameHeader h = make_header(kHelloLen - kHeaderLen, 0);
+  h.version = kProtocolVersionCompact;
+  encode_header(h, out);
+  const std::uint32_t caps = htonl(kCapabilities | codecs_);
+  const std::uint32_t dictionary = htonl(dictionary_id_);
+  std::memcpy(out + kHeaderLen, &caps, 4);
+  std::memcpy(out + kHeaderLen + 4, &dictionary, 4);
+  state_.store(kCompact, std::memory_order_relaxed);
+  return true;
+}
+
+std::size_t FrameEncoder::encode(std::size_t payload_len, std::uint32_t flags, std::uint8_t out[kHeaderLen]) const {
+  if (state_.load(std::memory_order_relaxed) == kCompact) return encode_compact_header(payload_len, flags, out);
+  encode_header(make_header(payload_len, flags), out);
+  return kHeaderLen;
+}
+
+Message FrameEncoder::compress(std::span<const std::uint8_t> payload) const {
+  if (compressor_ == nullptr) return Message();
+  // Raw until the peer's hello says it can decode this codec (with the same dictionary).
+  const std::uint64_t peer = peer_.load(std::memory_order_acquire);
+  if ((peer & codec_) == 0) return Message();
+  if (uses_dictionary_ && static_cast<std::uint32_t>(peer >> 32) != dictionary_id_) return Message();
+  Message packed = compressor_->compress(payload);
+  if (!packed.empty()) ++thread_io().copies;
+  return packed;
+}
+
+Result<void> write_frame(SocketHandle fd, const Message& msg, std::uint32_t flags, FrameEncoder* enc) {
+  auto n = write_frames(fd, std::span<const Message>(&msg, 1), flags, enc);
+  if (!n.ok()) return n.status();
+  return {};
+}
+
+// Header and payload of each frame go out in one gathered write: a separate header segment costs a
+// syscall and can leave a 16-byte packet waiting on the peer's delayed ACK. A large message's
+// fragments simply take several iovec slots, pointing into it. Compressed payloads are held in
+// `packed` until their chunk has been written.
+Result<std::size_t> write_frames(SocketHandle fd, std::span<const Message> msgs, std::uint32_t flags,
+                                 FrameEncoder* enc) {
+  std::uint8_t hdrs[kMaxGatherFrames][kHeaderLen];
+  Message packed[kMaxGatherFrames];
+  std::uint8_t hello[kHelloLen];
+  IoVec iov[2 * kMaxGatherFrames + 1];
+  std::size_t cnt = 0;
+  if (enc != nullptr && !msgs.empty() && enc->take_hello(hello)) set_iov(&iov[cnt++], hello, kHelloLen);
+  std::size_t frames = 0;
+  std::size_t done = 0;      // messages fully written
+  std::size_t gathered = 0;  // further messages whose last frame is in iov
+  Status failed;
+  auto flush = [&] {
+    if (frames == 0) return;
+    auto st = write_iov(fd, iov, cnt);
+    cnt = frames = 0;
+    if (!st.ok()) {
+      failed = st.status();
+      return;
+    }
+    done += gathered;
+    gathered = 0;
+  };
+  for (std::size_t i = 0; i < msgs.size() && failed.ok(); ++i) {
+    const Message& m = msgs[i];
+    for_each_frame(m, i == 0, i + 1 == msgs.size(), flags, [&](std::size_t off, std::size_t len, std::uint32_t ff) {
+      if (frames == kMaxGatherFrames) flush();
+      if (!failed.ok()) return;
+      const std::uint8_t* payload = m.data() + off;
+      std::size_t hdr_len = kHeaderLen;
+      if (enc != nullptr) {
+        packed[frames] = enc->compress(std::span<const std::uint8_t>(payload, len));
+        if (!packed[frames].empty()) {
+          payload = packed[frames].data();
+          len = packed[frames].size();
+          ff |= to_u32(FrameFlags::kCompressed);
+        }
+        hdr_len = enc->encode(len, ff, hdrs[frames]);
+      } else {
+        encode_header(make_header(len, ff), hdrs[frames]);
+      }
+      set_iov(&iov[cnt++], hdrs[frames], hdr_len);
+      if (len != 0) set_iov(&iov[cnt++], payload, len);
+      ++frames;
+    });
+    ++gathered;
   }
+  if (failed.ok()) flush();
+  if (!failed.ok() && done == 0) return failed;
+  return done;
+}
 
-  FrameHeader h;
-  h.magic = kProtocolMagic;
-  h.version = kProtocolVersion;
-  h.header_len = static_cast<std::uint16_t>(kHeaderLen);
-  h.payload_len = static_cast<std::uint32_t>(msg.size());
-  h.flags = flags;
+Result<void> write_fd_frame(SocketHandle fd, const Message& msg, std::uint32_t flags, FrameEncoder* enc) {
+#if !defined(__linux__)
+  (void)fd;
+  (void)msg;
+  (void)flags;
+  (void)enc;
+  return Status::not_supported("memfd payloads need Linux");
+#else
+  int mfd = ::memfd_create("duct-payload", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (mfd < 0) return Status::io_error("memfd_create() failed");
+  Status st;
+  if (::ftruncate(mfd, static_cast<off_t>(msg.size())) != 0) st = Status::io_error("ftruncate() of a memfd failed");
+  for (std::size_t done = 0; st.ok() && done < msg.size();) {
+    ssize_t w = ::pwrite(mfd, msg.data() + done, msg.size() - done, static_cast<off_t>(done));
+    if (w < 0 && interrupted(get_last_error())) continue;
+    if (w <= 0) st = Status::io_error("write() to a memfd failed");
+    else done += static_cast<std::size_t>(w);
+  }
+  ++thread_io().copies;
+  // Sealed, the receiver can map it without trusting us not to truncate or change it.
+  if (st.ok() && ::fcntl(mfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) != 0) {
+    st = Status::io_error("sealing a memfd failed");
+  }
+  if (!st.ok()) {
+    ::close(mfd);
+    return st;
+  }
 
+  std::uint8_t hello[kHelloLen];
   std::uint8_t hdr[kHeaderLen];
-  encode_header(h, hdr);
-  auto st = write_all(fd, hdr, sizeof(hdr));
-  if (!st.ok()) return st;
-  return write_all(fd, msg.data(), msg.size());
+  std::uint8_t body[8];
+  store_be(msg.size(), 8, body);
+  IoVec iov[3];
+  std::size_t cnt = 0;
+  if (enc != nullptr && enc->take_hello(hello)) set_iov(&iov[cnt++], hello, kHelloLen);
+  const std::uint32_t ff = (flags & ~kFragmentFlags) | to_u32(FrameFlags::kFdPayload);
+  std::size_t hdr_len = kHeaderLen;
+  if (enc != nullptr) {
+    hdr_len = enc->encode(sizeof(body), ff, hdr);
+  } else {
+    encode_header(make_header(sizeof(body), ff), hdr);
+  }
+  set_iov(&iov[cnt++], hdr, hdr_len);
+  set_iov(&iov[cnt++], body, sizeof(body));
+
+  // The descriptor rides on the first byte; whatever a short write leaves goes out plain.
+  alignas(cmsghdr) char ctrl[CMSG_SPACE(sizeof(int))] = {};
+  msghdr mh{};
+  mh.msg_iov = iov;
+  mh.msg_iovlen = cnt;
+  mh.msg_control = ctrl;
+  mh.msg_controllen = sizeof(ctrl);
+  cmsghdr* c = CMSG_FIRSTHDR(&mh);
+  c->cmsg_level = SOL_SOCKET;
+  c->cmsg_type = SCM_RIGHTS;
+  c->cmsg_len = CMSG_LEN(sizeof(int));
+  std::memcpy(CMSG_DATA(c), &mfd, sizeof(int));
+  ssize_t rc;
+  do {
+    ++thread_io().writes;
+    rc = ::sendmsg(fd, &mh, MSG_NOSIGNAL);
+  } while (rc < 0 && interrupted(get_last_error()));
+  ::close(mfd);  // the socket holds its own reference until the peer takes it
+  if (rc < 0) return Status::io_error("sendmsg() failed");
+  if (rc == 0) return Status::closed("peer closed");
+  IoVec* rest = iov;
+  std::size_t w = static_cast<std::size_t>(rc);
+  while (cnt != 0 && w >= iov_len(*rest)) {
+    w -= iov_len(*rest);
+    ++rest;
+    --cnt;
+  }
+  if (cnt == 0) return {};
+  iov_consume(rest, w);
+  return write_iov(fd, rest, cnt);
+#endif
+}
+
+// The reservation is one frame at most, so `flags` apply to it as they are.
+Result<void> write_prefixed_frame(SocketHandle fd, std::uint8_t* buf, std::size_t payload_len, std::uint32_t flags,
+                                  FrameEncoder* enc) {
+  if (payload_len > kMaxFramePayload) {
+    return Status::invalid_argument("prefixed frame larger than kMaxFramePayload");
+  }
+  std::uint8_t hello[kHelloLen];
+  IoVec iov[3];
+  std::size_t cnt = 0;
+  std::size_t hdr_len = kHeaderLen;
+  if (enc == nullptr) {
+    encode_header(make_header(payload_len, flags), buf);
+  } else {
+    if (enc->take_hello(hello)) set_iov(&iov[cnt++], hello, kHelloLen);
+    std::uint8_t hdr[kHeaderLen];
+    // A compressed payload goes out from its own buffer, after the header encoded here.
+    const Message packed = enc->compress(std::span<const std::uint8_t>(buf + kHeaderLen, payload_len));
+    if (!packed.empty()) {
+      hdr_len = enc->encode(packed.size(), flags | to_u32(FrameFlags::kCompressed), hdr);
+      set_iov(&iov[cnt++], hdr, hdr_len);
+      set_iov(&iov[cnt++], packed.data(), packed.size());
+      return write_iov(fd, iov, cnt);
+    }
+    hdr_len = enc->encode(payload_len, flags, hdr);
+    std::memcpy(buf + kHeaderLen - hdr_len, hdr, hdr_len);
+  }
+  set_iov(&iov[cnt++], buf + kHeaderLen - hdr_len, hdr_len + payload_len);
+  return write_iov(fd, iov, cnt);
 }
 
 Result<Message> read_frame(SocketHandle fd) {
@@ -183,12 +651,296 @@ Result<Message> read_frame(SocketHandle fd) {
   if (!decoded.ok()) return decoded.status();
 
   FrameHeader h = decoded.value();
-  std::vector<std::uint8_t> buf(h.payload_len);
+  Message m;
   if (h.payload_len != 0) {
-    st = read_exact(fd, buf.data(), buf.size());
+    // Receive straight into pooled message storage.
+    m = Message::allocate(h.payload_len);
+    st = read_exact(fd, m.data(), m.size());
     if (!st.ok()) return st.status();
   }
-  return Message::from_bytes(buf.data(), buf.size());
+  set_frame_meta(m, h.flags);
+  return m;
+}
+
+FrameReader::FrameReader(std::size_t capacity) : capacity_(std::max(capacity, kHeaderLen + kMaxFramePayload)) {}
+
+FrameReader::~FrameReader() {
+#if !defined(_WIN32)
+  for (int fd : fds_) ::close(fd);
+#endif
+}
+
+Result<Message> FrameReader::take_passed(const std::uint8_t* payload, std::size_t len) {
+  if (len != 8) return Status::protocol_error("bad descriptor frame");
+  // The descriptor arrives with the first byte of the write that carries its frame, so by the time
+  // the frame is complete it is queued, behind those of earlier frames.
+  if (fds_.empty()) return Status::protocol_error("descriptor frame without a descriptor");
+  const int fd = fds_.front();
+  fds_.pop_front();
+  return map_passed(fd, load_be(payload, 8));
+}
+
+Result<FrameReader::Pending> FrameReader::peek() const {
+  Pending p;
+  const std::size_t avail = end_ - begin_;
+  const std::uint8_t* at = buf_.data() + begin_;
+  if (compact_) {
+    auto n = decode_compact_header(at, avail, &p.h);
+    if (!n.ok()) return n.status();
+    p.header = n.value();
+    return p;
+  }
+  if (avail < kHeaderLen) return p;
+  if (load_be32(at) == kProtocolMagic && at[4] == 0 && at[5] == kProtocolVersionCompact) {
+    // The peer's hello; compact headers follow it.
+    p.h.payload_len = load_be32(at + 8);
+    if (p.h.payload_len < 4 || p.h.payload_len > kMaxHelloPayload) {
+      return Status::protocol_error("bad hello");
+    }
+    p.header = kHeaderLen;
+    p.hello = true;
+    return p;
+  }
+  auto decoded = decode_header(at);
+  if (!decoded.ok()) return decoded.status();
+  p.h = decoded.value();
+  p.header = kHeaderLen;
+  return p;
+}
+
+Result<bool> FrameReader::try_pop(Message* out) {
+  for (;;) {
+    if (begin_ == end_) return false;
+    auto peeked = peek();
+    if (!peeked.ok()) return peeked.status();
+    const Pending& p = peeked.value();
+    const std::size_t frame = p.header + p.h.payload_len;
+    if (p.header == 0 || end_ - begin_ < frame) return false;
+
+    const std::uint8_t* payload = buf_.data() + begin_ + p.header;
+    const std::size_t len = p.h.payload_len;
+    if (p.hello) {
+      peer_caps_ = load_be32(payload);
+      peer_dictionary_id_ = len >= 8 ? load_be32(payload + 4) : 0;
+      compact_ = true;
+      if (encoder_ != nullptr) encoder_->on_peer_hello(peer_caps_, peer_dictionary_id_);
+      begin_ += frame;
+      continue;
+    }
+    const std::uint16_t channel = frame_channel(p.h.flags);
+    if ((p.h.flags & to_u32(FrameFlags::kFdPayload)) != 0) {
+      auto passed = take_passed(payload, len);
+      if (!passed.ok()) return passed.status();
+      begin_ += frame;
+      reassembler_.on_whole(channel);
+      *out = std::move(passed.value());
+      set_frame_meta(*out, p.h.flags);
+      return true;
+    }
+    if ((p.h.flags & to_u32(FrameFlags::kCompressed)) != 0) {
+      if (decompressor_ == nullptr) return Status::protocol_error("compressed frame without a decompressor");
+      auto raw = decompressor_->decompress(std::span<const std::uint8_t>(payload, len));
+      if (!raw.ok()) return raw.status();
+      ++thread_io().copies;
+      begin_ += frame;
+      Message& m = raw.value();
+      if (is_fragment(p.h.flags)) {
+        if (reassembler_.add_fragment(std::span<const std::uint8_t>(m.data(), m.size()), channel, p.h.flags, out)) {
+          return true;
+        }
+        continue;
+      }
+      reassembler_.on_whole(channel);
+      *out = std::move(m);
+      set_frame_meta(*out, p.h.flags);
+      return true;
+    }
+    if (is_fragment(p.h.flags)) {
+      begin_ += frame;
+      if (reassembler_.add_fragment(std::span<const std::uint8_t>(payload, len), channel, p.h.flags, out)) return true;
+      continue;
+    }
+    reassembler_.on_whole(channel);
+
+    // Tiny payloads are copied inline rather than pinning the whole receive buffer.
+    if (len <= Message::kInlineCapacity) {
+      *out = Message::from_bytes(payload, len);
+      ++thread_io().copies;
+    } else {
+      *out = buf_.slice(begin_ + p.header, len);
+    }
+    set_frame_meta(*out, p.h.flags);
+    begin_ += frame;
+    return true;
+  }
+}
+
+void FrameReader::make_room(std::size_t need) {
+  if (buf_.data() == nullptr) {
+    buf_ = Message::allocate(capacity_);
+    begin_ = end_ = 0;
+    return;
+  }
+  // Fast path: the pending frame fits behind begin_ and there is still space to receive into.
+  const std::size_t cap = buf_.size();
+  if (cap - begin_ >= need && end_ < cap) return;
+
+  std::size_t pending = end_ - begin_;
+  if (cap == capacity_ && buf_.use_count() == 1) {
+    // Our own buffer and nobody else references it: slide the partial frame to the front.
+    if (pending != 0) std::memmove(buf_.data(), buf_.data() + begin_, pending);
+  } else {
+    // Messages still point into the old buffer (or it is an adopted chunk); carry the partial
+    // frame over to a fresh one.
+    Message fresh = Message::allocate(capacity_);
+    if (pending != 0) std::memcpy(fresh.data(), buf_.data() + begin_, pending);
+    buf_ = std::move(fresh);
+  }
+  begin_ = 0;
+  end_ = pending;
+}
+
+Result<void> FrameReader::prepare_fill() {
+  // Bytes needed for the frame at begin_: room for a header, or the whole frame once it is in.
+  std::size_t need = kHeaderLen;
+  if (begin_ != end_) {
+    auto peeked = peek();
+    if (!peeked.ok()) return peeked.status();
+    if (peeked.value().header != 0) need = peeked.value().header + peeked.value().h.payload_len;
+  }
+  if (begin_ == end_ && buf_.use_count() == 1) begin_ = end_ = 0;
+  make_room(need);
+  return {};
+}
+
+Result<Message> FrameReader::read(SocketHandle fd) {
+  for (;;) {
+    Message m;
+    auto popped = try_pop(&m);
+    if (!popped.ok()) return popped.status();
+    if (popped.value()) return m;
+
+    auto st = prepare_fill();
+    if (!st.ok()) return st.status();
+    auto r = read_some(fd, buf_.data() + end_, buf_.size() - end_, pass_fds_ ? &fds_ : nullptr);
+    auto queued = check_passed();
+    if (!queued.ok()) return queued.status();
+    if (!r.ok()) return r.status();
+    end_ += r.value();
+  }
+}
+
+Result<bool> FrameReader::fill_nonblocking(SocketHandle fd) {
+  auto st = prepare_fill();
+  if (!st.ok()) return st.status();
+  auto r = read_available(fd, buf_.data() + end_, buf_.size() - end_, pass_fds_ ? &fds_ : nullptr);
+  auto queued = check_passed();
+  if (!queued.ok()) return queued.status();
+  if (!r.ok()) return r.status();
+  end_ += r.value();
+  return r.value() != 0;
+}
+
+Result<void> FrameReader::check_passed() {
+#if !defined(_WIN32)
+  if (fds_.size() > kMaxQueuedFds) {
+    for (int fd : fds_) ::close(fd);
+    fds_.clear();
+    return Status::protocol_error("peer passed descriptors without frames for them");
+  }
+#endif
+  return {};
+}
+
+Message add_trace(const Message& m, const TraceHeader& h) {
+  Message out = Message::allocate(kTraceHeaderLen + m.size());
+  store_be(h.id, 8, out.data());
+  store_be(h.sent_at_ns, 8, out.data() + 8);
+  store_be(h.admit_us, 4, out.data() + 16);
+  store_be(h.queue_us, 4, out.data() + 20);
+  if (!m.empty()) std::memcpy(out.data() + kTraceHeaderLen, m.data(), m.size());
+  ++thread_io().copies;
+  return out;
+}
+
+TraceHeader trace_header(const Message& m) {
+  const std::uint8_t* p = m.data() - kTraceHeaderLen;
+  TraceHeader h;
+  h.id = load_be(p, 8);
+  h.sent_at_ns = load_be(p + 8, 8);
+  h.admit_us = static_cast<std::uint32_t>(load_be(p + 16, 4));
+  h.queue_us = static_cast<std::uint32_t>(load_be(p + 20, 4));
+  return h;
+}
+
+void Reassembler::abandon(std::uint16_t channel) {
+  auto it = partials_.find(channel);
+  if (it == partials_.end()) return;
+  bytes_ -= it->second.bytes.size();
+  partials_.erase(it);
+}
+
+void Reassembler::drop_stale(std::chrono::steady_clock::time_point now) {
+  for (auto it = partials_.begin(); it != partials_.end();) {
+    if (now - it->second.last > opt_.reassembly_timeout) {
+      bytes_ -= it->second.bytes.size();
+      it = partials_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+bool Reassembler::add_fragment(std::span<const std::uint8_t> payload, std::uint16_t channel, std::uint32_t flags,
+                               Message* out) {
+  const auto now = std::chrono::steady_clock::now();
+  if (!partials_.empty()) drop_stale(now);
+  auto it = partials_.find(channel);
+  if ((flags & to_u32(FrameFlags::kFragCont)) == 0) {
+    // A new message; one still in progress on this channel was abandoned by the sender.
+    if (it != partials_.end()) {
+      bytes_ -= it->second.bytes.size();
+      partials_.erase(it);
+    }
+    it = partials_.try_emplace(channel).first;
+  } else if (it == partials_.end()) {
+    return false;
+  }
+  Partial& p = it->second;
+  if (bytes_ + payload.size() > opt_.reassembly_max_bytes) {
+    // The rest of this message now continues nothing and is dropped as it arrives.
+    bytes_ -= p.bytes.size();
+    partials_.erase(it);
+    return false;
+  }
+  p.bytes.insert(p.bytes.end(), payload.begin(), payload.end());
+  p.last = now;
+  bytes_ += payload.size();
+  if ((flags & to_u32(FrameFlags::kFrag)) != 0) return false;
+
+  bytes_ -= p.bytes.size();
+  auto* whole = new std::vector<std::uint8_t>(std::move(p.bytes));
+  partials_.erase(it);
+  *out = Message::adopt(whole->data(), whole->size(), [whole](void*) { delete whole; });
+  ++thread_io().copies;
+  set_frame_meta(*out, flags);
+  return true;
+}
+
+Result<std::size_t> FrameReader::append(const Message& chunk) {
+  if (chunk.empty()) return std::size_t{0};
+  if (begin_ == end_) {
+    buf_ = chunk;
+    begin_ = 0;
+    end_ = chunk.size();
+    return chunk.size();
+  }
+  auto st = prepare_fill();
+  if (!st.ok()) return st.status();
+  std::size_t n = std::min(buf_.size() - end_, chunk.size());
+  std::memcpy(buf_.data() + end_, chunk.data(), n);
+  end_ += n;
+  return n;
 }
 
 }  // namespace duct::wire
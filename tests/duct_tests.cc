@@ -1,15 +1,39 @@
+#include "duct/coro.h"
 #include "duct/duct.h"
+#include "duct/logging.h"
+#include "duct/message_pool.h"
+#include "duct/mux.h"
+#include "duct/qos_pipe.h"
+#include "duct/queue.h"
+#include "duct/rate_limiter.h"
+#include "duct/reactor.h"
+#include "duct/reliable_pipe.h"
+#include "duct/reqrep.h"
+#include "duct/server.h"
 #include "duct/wire.h"
 
+#include <algorithm>
+#include <array>
 #include <atomic>
 #include <csignal>
+#include <cstdio>
+#include <cstring>
 #include <chrono>
+#include <condition_variable>
 #include <future>
 #include <iostream>
+#include <mutex>
+#include <span>
+#include <stop_token>
 #include <string>
 #include <thread>
+#include <unordered_map>
+#include <vector>
 
 #if !defined(_WIN32)
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -73,6 +97,385 @@ static void test_address_parse() {
     EXPECT_EQ(a.value().scheme, duct::Scheme::kPipe);
     EXPECT_EQ(a.value().name, "mypipe");
   }
+  {
+    auto a = duct::Address::parse("inproc://bus");
+    EXPECT_TRUE(a.ok());
+    EXPECT_EQ(a.value().scheme, duct::Scheme::kInproc);
+    EXPECT_EQ(a.value().name, "bus");
+  }
+}
+
+static void test_status_literal_messages() {
+  // A literal message is referenced, not copied, and stays so through copies and Result.
+  static constexpr char kText[] = "pop timed out waiting for message";
+  auto st = duct::Status::timeout(kText);
+  EXPECT_TRUE(st.message_view().data() == kText);
+  duct::Result<int> r = st;
+  duct::Status copy = r.status();
+  EXPECT_TRUE(copy.message_view().data() == kText);
+  EXPECT_EQ(copy.code(), duct::StatusCode::kTimeout);
+  EXPECT_EQ(copy.message(), std::string(kText));
+  EXPECT_EQ(copy.to_string(), std::string("[Timeout] ") + kText);
+
+  // message() hands out one std::string per Status, however many threads ask at once.
+  const std::string* first[4] = {};
+  {
+    std::vector<std::thread> askers;
+    for (auto& p : first) askers.emplace_back([&st, &p] { p = &st.message(); });
+    for (auto& t : askers) t.join();
+  }
+  for (const std::string* p : first) EXPECT_TRUE(p == &st.message());
+  EXPECT_EQ(st.message(), std::string(kText));
+
+  // Writable buffers are copied, and a literal ends at its first NUL.
+  char buf[] = "scratch";
+  auto from_buf = duct::Status::io_error(buf);
+  buf[0] = 'X';
+  EXPECT_EQ(from_buf.message(), std::string("scratch"));
+  EXPECT_EQ(duct::Status::closed("ab\0cd").message(), std::string("ab"));
+
+  // Built at runtime: owned.
+  const std::string name = "bus";
+  auto dyn = duct::Status::io_error("no listener: " + name);
+  duct::Status moved = std::move(dyn);
+  EXPECT_EQ(moved.message(), std::string("no listener: bus"));
+  auto owned = duct::Status::closed(std::string("peer closed"));
+  EXPECT_EQ(owned.message_view(), std::string_view("peer closed"));
+  EXPECT_TRUE(duct::Status().message_view().empty());
+}
+
+static void test_message_pool_recycles() {
+  auto& pool = duct::MessagePool::global();
+  const std::size_t sizes[] = {1, 64, 65, 1000, 4096, 70000};
+
+  // Warm the classes, then steady-state churn must not touch the heap.
+  for (int round = 0; round < 2; ++round) {
+    std::vector<duct::Message> held;
+    for (std::size_t n : sizes) held.push_back(duct::Message::from_bytes(std::string(n, 'p').data(), n));
+  }
+  auto before = pool.stats().heap_allocations;
+  for (int i = 0; i < 1000; ++i) {
+    for (std::size_t n : sizes) {
+      auto m = duct::Message::allocate(n);
+      EXPECT_EQ(m.size(), n);
+      m.data()[n - 1] = 1;
+    }
+  }
+  EXPECT_EQ(pool.stats().heap_allocations, before);
+
+  // Copies share one block; the block is recycled only after the last reference drops.
+  const std::string text(100, 's');
+  auto a = duct::Message::from_string(text);
+  auto b = a;
+  EXPECT_TRUE(a.shares_storage_with(b));
+  EXPECT_EQ(a.use_count(), 2L);
+  a = duct::Message();
+  EXPECT_EQ(b.use_count(), 1L);
+  EXPECT_EQ(std::string(b.as_string_view()), text);
+
+  // Released on another thread: goes back to that thread's cache, then the shared lists.
+  std::vector<duct::Message> moved;
+  for (int i = 0; i < 64; ++i) moved.push_back(duct::Message::allocate(128));
+  std::thread([m = std::move(moved)]() mutable { m.clear(); }).join();
+  EXPECT_TRUE(pool.stats().shared_cached_blocks > 0);
+
+  // A burst released elsewhere keeps only shared_limit() blocks; the rest go back to the heap.
+  const std::uint32_t cls = duct::MessagePool::size_class(4096);
+  const std::size_t limit = duct::MessagePool::shared_limit(cls);
+  std::vector<duct::Message> burst;
+  for (std::size_t i = 0; i < limit * 3; ++i) burst.push_back(duct::Message::allocate(4096));
+  auto frees = pool.stats().heap_frees;
+  std::thread([m = std::move(burst)]() mutable { m.clear(); }).join();
+  EXPECT_TRUE(pool.stats().heap_frees >= frees + limit);
+  EXPECT_TRUE(pool.stats().shared_cached_blocks <= limit * duct::MessagePool::kClassCount);
+
+  // Larger than the biggest class: served from the heap, not cached.
+  auto huge = duct::Message::allocate((std::size_t{1} << duct::MessagePool::kMaxClassShift) + 1);
+  EXPECT_TRUE(huge.data() != nullptr);
+}
+
+static void test_metrics() {
+  // Counters and gauges updated from many threads add up once read.
+  duct::Counter counter("c");
+  duct::Gauge gauge("g");
+  gauge.set(100);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 8; ++t) {
+    threads.emplace_back([&] {
+      for (int i = 0; i < 10000; ++i) {
+        counter.increment();
+        gauge.increment(2);
+        gauge.decrement();
+      }
+    });
+  }
+  for (auto& t : threads) t.join();
+  EXPECT_EQ(counter.value(), 80000.0);
+  EXPECT_EQ(gauge.value(), 80100.0);
+  gauge.set(5);
+  EXPECT_EQ(gauge.value(), 5.0);
+
+  // Percentiles within 1%; snapshots merge.
+  duct::Histogram a("a", 1.0);
+  duct::Histogram b("b", 1.0);
+  for (int v = 1; v <= 10000; ++v) (v % 2 == 0 ? a : b).observe(v);
+  EXPECT_EQ(a.count(), std::size_t{5000});
+  auto s = a.snapshot();
+  EXPECT_TRUE(s.merge(b.snapshot()));
+  EXPECT_EQ(s.count, std::uint64_t{10000});
+  auto near = [](double got, double want) { return got >= want * 0.99 && got <= want * 1.01; };
+  EXPECT_TRUE(near(s.percentile(0.5), 5000));
+  EXPECT_TRUE(near(s.percentile(0.99), 9900));
+  EXPECT_TRUE(near(s.percentile(0.999), 9990));
+  EXPECT_EQ(s.min(), 1.0);
+  EXPECT_TRUE(near(s.max(), 10000));
+  EXPECT_TRUE(near(s.mean(), 5000.5));
+  duct::Histogram other_unit("ms");
+  EXPECT_TRUE(!s.merge(other_unit.snapshot()));
+  // Out-of-range values saturate instead of growing the histogram.
+  a.observe(1e300);
+  a.observe(-5);
+  EXPECT_EQ(a.count(), std::size_t{5002});
+  EXPECT_EQ(a.snapshot().min(), 0.0);
+  a.reset();
+  EXPECT_EQ(a.count(), std::size_t{0});
+  EXPECT_EQ(a.percentile(0.5), 0.0);
+}
+
+static void test_async_logger() {
+  struct Sink {
+    std::vector<std::pair<duct::LogLevel, std::string>> lines;
+  };
+  auto sink = std::make_shared<Sink>();
+  auto async = std::make_shared<duct::AsyncLogger>(std::make_shared<duct::CallbackLogger>(
+      [sink](duct::LogLevel level, std::string_view text) { sink->lines.emplace_back(level, std::string(text)); }));
+  async->set_level(duct::LogLevel::kTrace);
+  duct::set_logger(async);
+
+  // Each thread's records arrive in order, formatted on the logger's thread.
+  constexpr int kThreads = 4;
+  constexpr int kPerThread = 1000;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; ++t) {
+    threads.emplace_back([t] {
+      for (int i = 0; i < kPerThread; ++i) duct::logf(duct::LogLevel::kInfo, "t{} n={} x={} s={}", t, i, 1.5, "str");
+    });
+  }
+  for (auto& t : threads) t.join();
+  async->flush();
+  EXPECT_EQ(sink->lines.size(), static_cast<std::size_t>(kThreads * kPerThread));
+  std::vector<int> next(kThreads, 0);
+  bool ordered = true;
+  for (const auto& [level, text] : sink->lines) {
+    int t = 0;
+    int n = 0;
+    if (std::sscanf(text.c_str(), "t%d n=%d", &t, &n) != 2 || t < 0 || t >= kThreads || n != next[t]++) ordered = false;
+  }
+  EXPECT_TRUE(ordered);
+  EXPECT_EQ(sink->lines.front().second.substr(sink->lines.front().second.find(" x=")), std::string(" x=1.5 s=str"));
+
+  sink->lines.clear();
+  int nothing = 0;
+  duct::logf(duct::LogLevel::kWarning, "{} of {}", -3, 7u, true, 'c');
+  duct::logf(duct::LogLevel::kWarning, "missing {} {}", 1);
+  async->log(duct::LogLevel::kError, "plain text");
+  // A level the logger drops builds nothing: the macro's message is not even evaluated.
+  async->set_level(duct::LogLevel::kWarning);
+  DUCT_INFO((++nothing, "unseen"));
+  DUCT_LOG_STREAM(kDebug) << (++nothing);
+  duct::logf(duct::LogLevel::kInfo, "unseen {}", 1);
+  DUCT_LOGF(kError, "kept {}", 2);
+  async->flush();
+  EXPECT_EQ(nothing, 0);
+  EXPECT_EQ(sink->lines.size(), std::size_t{4});
+  if (sink->lines.size() == 4) {
+    EXPECT_EQ(sink->lines[0].second, std::string("-3 of 7 true c"));
+    EXPECT_EQ(sink->lines[1].second, std::string("missing 1 {}"));
+    EXPECT_EQ(sink->lines[2].second, std::string("plain text"));
+    EXPECT_TRUE(sink->lines[2].first == duct::LogLevel::kError);
+    EXPECT_EQ(sink->lines[3].second, std::string("kept 2"));
+  }
+
+  // A record larger than the ring is dropped and counted, not waited for.
+  duct::AsyncLogger small(std::make_shared<duct::NullLogger>(), duct::AsyncLoggerOptions{256});
+  small.log(duct::LogLevel::kError, std::string(1000, 'x'));
+  small.flush();
+  EXPECT_EQ(small.dropped(), std::uint64_t{1});
+
+  // A replaced logger goes once nothing logs through it any more, its writer thread with it.
+  std::weak_ptr<duct::AsyncLogger> gone = async;
+  async.reset();
+  {
+    duct::detail::LoggerLease held;
+    duct::set_logger(std::make_shared<duct::NullLogger>());
+    EXPECT_TRUE(!gone.expired());
+    DUCT_ERROR("to the null logger");
+  }
+  EXPECT_TRUE(gone.expired());
+
+  // Loggers replaced while other threads log are freed too.
+  std::vector<std::weak_ptr<duct::Logger>> replaced;
+  std::atomic<bool> stop{false};
+  std::thread busy([&] {
+    while (!stop.load()) DUCT_ERROR("busy");
+  });
+  for (int i = 0; i < 100; ++i) {
+    auto next = std::make_shared<duct::NullLogger>();
+    replaced.push_back(next);
+    duct::set_logger(std::move(next));
+  }
+  stop = true;
+  busy.join();
+  duct::info("one more lease");
+  int alive = 0;
+  for (const auto& w : replaced) alive += w.expired() ? 0 : 1;
+  EXPECT_EQ(alive, 1);  // the current one
+
+  duct::set_logger(std::make_shared<duct::ConsoleLogger>());
+}
+
+static void test_ring_message_queue() {
+  using duct::BackpressurePolicy;
+  using duct::QueueProducers;
+  using duct::RingMessageQueue;
+  using namespace std::chrono_literals;
+
+  // SPSC through a ring much smaller than the stream: order survives blocking on both sides.
+  {
+    RingMessageQueue q(64, 0, BackpressurePolicy::kBlock, 0ms, QueueProducers::kSingle);
+    constexpr int kCount = 50000;
+    std::thread producer([&] {
+      for (int i = 0; i < kCount; ++i) EXPECT_TRUE(q.push(duct::Message::from_string(std::to_string(i))).ok());
+    });
+    for (int i = 0; i < kCount; ++i) {
+      auto m = q.pop();
+      EXPECT_TRUE(m.ok());
+      if (!m.ok() || m.value().as_string_view() != std::to_string(i)) {
+        EXPECT_TRUE(false);
+        break;
+      }
+    }
+    producer.join();
+    EXPECT_EQ(q.size_msgs(), static_cast<std::size_t>(0));
+  }
+
+  // MPSC: every producer's messages arrive once and in its own order.
+  {
+    RingMessageQueue q(128, 4096, BackpressurePolicy::kBlock, 0ms, QueueProducers::kMulti);
+    constexpr int kProducers = 4;
+    constexpr int kEach = 20000;
+    std::vector<std::thread> producers;
+    for (int p = 0; p < kProducers; ++p) {
+      producers.emplace_back([&, p] {
+        for (int i = 0; i < kEach; ++i) {
+          EXPECT_TRUE(q.push(duct::Message::from_string(std::to_string(p) + ":" + std::to_string(i))).ok());
+        }
+      });
+    }
+    std::vector<int> next(kProducers, 0);
+    for (int n = 0; n < kProducers * kEach; ++n) {
+      auto m = q.pop();
+      EXPECT_TRUE(m.ok());
+      if (!m.ok()) break;
+      std::string s(m.value().as_string_view());
+      int p = std::stoi(s.substr(0, s.find(':')));
+      EXPECT_EQ(std::stoi(s.substr(s.find(':') + 1)), next[p]);
+      ++next[p];
+    }
+    for (auto& t : producers) t.join();
+    for (int p = 0; p < kProducers; ++p) EXPECT_EQ(next[p], kEach);
+  }
+
+  // Byte HWM and the non-blocking policies.
+  {
+    RingMessageQueue q(16, 10, BackpressurePolicy::kFailFast, 0ms);
+    EXPECT_TRUE(q.push(duct::Message::from_string("123456")).ok());
+    EXPECT_TRUE(!q.push(duct::Message::from_string("12345")).ok());
+    EXPECT_TRUE(q.push(duct::Message::from_string("1234")).ok());
+    EXPECT_TRUE(q.at_hwm());
+    EXPECT_EQ(q.size_bytes(), static_cast<std::size_t>(10));
+  }
+  {
+    RingMessageQueue q(4, 0, BackpressurePolicy::kDropNew, 0ms);
+    for (int i = 0; i < 6; ++i) EXPECT_TRUE(q.push(duct::Message::from_string(std::to_string(i))).ok());
+    EXPECT_EQ(q.size_msgs(), static_cast<std::size_t>(4));
+    EXPECT_EQ(std::string(q.try_pop()->as_string_view()), "0");
+  }
+  {
+    RingMessageQueue q(4, 0, BackpressurePolicy::kDropOld, 0ms);
+    for (int i = 0; i < 6; ++i) EXPECT_TRUE(q.push(duct::Message::from_string(std::to_string(i))).ok());
+    EXPECT_EQ(q.size_msgs(), static_cast<std::size_t>(4));
+    EXPECT_EQ(std::string(q.try_pop()->as_string_view()), "2");
+  }
+
+  // Timeouts, TTL and close.
+  {
+    RingMessageQueue q(2, 0, BackpressurePolicy::kBlock, 20ms);
+    EXPECT_EQ(q.pop(5ms).status().code(), duct::StatusCode::kTimeout);
+    EXPECT_TRUE(q.push(duct::Message::from_string("a")).ok());
+    EXPECT_TRUE(q.push(duct::Message::from_string("b")).ok());
+    EXPECT_EQ(q.push(duct::Message::from_string("c"), 5ms).status().code(), duct::StatusCode::kTimeout);
+    std::this_thread::sleep_for(30ms);
+    EXPECT_EQ(q.purge_expired(), static_cast<std::size_t>(2));
+    EXPECT_TRUE(!q.try_pop().has_value());
+
+    std::thread closer([&] {
+      std::this_thread::sleep_for(10ms);
+      q.close();
+    });
+    EXPECT_EQ(q.pop().status().code(), duct::StatusCode::kClosed);
+    closer.join();
+    EXPECT_EQ(q.push(duct::Message::from_string("d")).status().code(), duct::StatusCode::kClosed);
+  }
+}
+
+static void test_message_slice_adopt_inline() {
+  // Small payloads are inline: no block, and copies are independent.
+  auto small = duct::Message::from_string("tiny");
+  EXPECT_EQ(small.use_count(), 0L);
+  EXPECT_TRUE(small.capacity() >= duct::Message::kInlineCapacity - 4);
+  auto small_copy = small;
+  small_copy.data()[0] = 'T';
+  EXPECT_EQ(std::string(small.as_string_view()), "tiny");
+  EXPECT_EQ(std::string(small_copy.as_string_view()), "Tiny");
+  auto moved = std::move(small_copy);
+  EXPECT_EQ(std::string(moved.as_string_view()), "Tiny");
+  EXPECT_EQ(std::string(moved.slice(1, 2).as_string_view()), "in");
+
+  // Slices share pooled storage and keep it alive.
+  duct::Message tail;
+  {
+    auto big = duct::Message::from_string(std::string(64, 'a') + std::string(64, 'b'));
+    tail = big.slice(64, 1000);
+    EXPECT_TRUE(tail.shares_storage_with(big));
+  }
+  EXPECT_EQ(tail.size(), static_cast<std::size_t>(64));
+  EXPECT_EQ(std::string(tail.as_string_view()), std::string(64, 'b'));
+  EXPECT_TRUE(tail.slice(100, 1).empty());
+
+  // with_capacity can grow into its reservation.
+  auto grow = duct::Message::with_capacity(256);
+  EXPECT_TRUE(grow.empty());
+  EXPECT_TRUE(grow.resize(200));
+  EXPECT_EQ(grow.size(), static_cast<std::size_t>(200));
+  EXPECT_TRUE(!grow.resize(grow.capacity() + 1));
+
+  // Adopted memory is used in place and handed back once the last reference drops.
+  auto* raw = new std::uint8_t[300];
+  std::memset(raw, 'z', 300);
+  int freed = 0;
+  {
+    auto adopted = duct::Message::adopt(raw, 300, [&](void* p) {
+      delete[] static_cast<std::uint8_t*>(p);
+      ++freed;
+    });
+    EXPECT_TRUE(adopted.data() == raw);
+    auto part = adopted.slice(10, 20);
+    adopted = duct::Message();
+    EXPECT_EQ(freed, 0);
+    EXPECT_EQ(std::string(part.as_string_view()), std::string(20, 'z'));
+  }
+  EXPECT_EQ(freed, 1);
 }
 
 static void test_shm_echo_one() {
@@ -207,8 +610,9 @@ static void test_shm_backpressure_timeout() {
   duct::SendOptions opt;
   opt.timeout = std::chrono::milliseconds(50);
 
+  // Ring capacity is bounded by descriptor count (1024); go well past it.
   bool saw_timeout = false;
-  for (int i = 0; i < 256; ++i) {
+  for (int i = 0; i < 4096; ++i) {
     auto st = c.value()->send(duct::Message::from_string("x"), opt);
     if (!st.ok()) {
       EXPECT_EQ(st.status().code(), duct::StatusCode::kTimeout);
@@ -295,171 +699,3513 @@ static void test_shm_burst_without_receiver() {
   t.join();
 }
 
-static void test_wire_decode_rejects_bad_magic() {
-  std::uint8_t hdr[duct::wire::kHeaderLen]{};
-  auto decoded = duct::wire::decode_header(hdr);
-  EXPECT_TRUE(!decoded.ok());
-  if (!decoded.ok()) {
-    EXPECT_EQ(decoded.status().code(), duct::StatusCode::kProtocolError);
-  }
-}
+static void check_shm_mixed_sizes(const std::string& addr, duct::ShmRingLayout layout) {
+  auto lis_r = duct::listen(addr);
+  EXPECT_TRUE(lis_r.ok());
+  if (!lis_r.ok()) return;
 
-static void test_wire_socketpair_frames() {
-#if defined(_WIN32)
-  WSADATA wsaData{};
-  int wsa_rc = WSAStartup(MAKEWORD(2, 2), &wsaData);
-  EXPECT_TRUE(wsa_rc == 0);
-  if (wsa_rc != 0) return;
+  constexpr int kCount = 3000;
+  auto size_for = [](int i) -> std::size_t {
+    // Cycle through every slab class, including the max payload, and fragmented sizes past it.
+    static const std::size_t sizes[] = {0, 1, 100, 256, 257, 1000, 4096, 9000, 16384, 40000, 65536, 65537, 200000};
+    return sizes[i % (sizeof(sizes) / sizeof(sizes[0]))];
+  };
 
-  SOCKET listener = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-  EXPECT_TRUE(listener != INVALID_SOCKET);
-  if (listener == INVALID_SOCKET) {
-    WSACleanup();
-    return;
-  }
+  auto server = std::async(std::launch::async, [&]() -> bool {
+    auto p = lis_r.value()->accept();
+    if (!p.ok()) return false;
+    for (int i = 0; i < kCount; ++i) {
+      auto m = p.value()->recv({});
+      if (!m.ok() || m.value().size() != size_for(i)) return false;
+      if (m.value().channel() != i % 3) return false;
+      for (std::size_t j = 0; j < m.value().size(); ++j) {
+        if (m.value().data()[j] != static_cast<std::uint8_t>(i + j)) return false;
+      }
+    }
+    return true;
+  });
 
-  sockaddr_in addr{};
-  addr.sin_family = AF_INET;
-  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
-  addr.sin_port = 0;
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
 
-  int bind_rc = ::bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
-  EXPECT_TRUE(bind_rc == 0);
-  int listen_rc = ::listen(listener, 1);
-  EXPECT_TRUE(listen_rc == 0);
-  if (bind_rc != 0 || listen_rc != 0) {
-    closesocket(listener);
-    WSACleanup();
-    return;
-  }
+  duct::DialOptions dial_opt;
+  dial_opt.qos.snd_hwm_bytes = 0;
+  dial_opt.qos.rcv_hwm_bytes = 0;
+  dial_opt.shm.layout = layout;
+  auto c = duct::dial(addr, dial_opt);
+  EXPECT_TRUE(c.ok());
+  if (!c.ok()) return;
 
-  sockaddr_in bound{};
-  int bound_len = sizeof(bound);
-  int getsock_rc = ::getsockname(listener, reinterpret_cast<sockaddr*>(&bound), &bound_len);
-  EXPECT_TRUE(getsock_rc == 0);
-  if (getsock_rc != 0) {
-    closesocket(listener);
-    WSACleanup();
-    return;
+  std::vector<std::uint8_t> buf;
+  for (int i = 0; i < kCount; ++i) {
+    buf.resize(size_for(i));
+    for (std::size_t j = 0; j < buf.size(); ++j) buf[j] = static_cast<std::uint8_t>(i + j);
+    duct::SendOptions opt;
+    opt.channel = static_cast<std::uint16_t>(i % 3);
+    auto st = c.value()->send(duct::Message::from_bytes(buf.data(), buf.size()), opt);
+    EXPECT_TRUE(st.ok());
+    if (!st.ok()) break;
   }
 
-  SOCKET client = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-  EXPECT_TRUE(client != INVALID_SOCKET);
-  if (client == INVALID_SOCKET) {
-    closesocket(listener);
-    WSACleanup();
-    return;
+  auto sst = server.wait_for(std::chrono::seconds(10));
+  EXPECT_TRUE(sst == std::future_status::ready);
+  if (sst == std::future_status::ready) {
+    EXPECT_TRUE(server.get());
   }
 
-  sockaddr_in connect_addr{};
-  connect_addr.sin_family = AF_INET;
-  connect_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
-  connect_addr.sin_port = bound.sin_port;
+  lis_r.value()->close();
+}
 
-  int conn_rc = ::connect(client, reinterpret_cast<sockaddr*>(&connect_addr), sizeof(connect_addr));
-  EXPECT_TRUE(conn_rc == 0);
-  if (conn_rc != 0) {
-    closesocket(client);
-    closesocket(listener);
-    WSACleanup();
-    return;
-  }
+static void test_shm_slab_mixed_sizes() {
+  check_shm_mixed_sizes("shm://duct_testslab", duct::ShmRingLayout::kSlab);
+}
 
-  SOCKET server = ::accept(listener, nullptr, nullptr);
-  EXPECT_TRUE(server != INVALID_SOCKET);
-  closesocket(listener);
-  if (server == INVALID_SOCKET) {
-    closesocket(client);
-    WSACleanup();
-    return;
-  }
+static void test_shm_byte_ring_mixed_sizes() {
+  // Enough traffic to wrap the byte ring several times with records of every size.
+  check_shm_mixed_sizes("shm://duct_testbytes", duct::ShmRingLayout::kByteRing);
+}
 
-  auto writer = std::thread([&] {
-    (void)duct::wire::write_frame(static_cast<duct::wire::SocketHandle>(client),
-                                 duct::Message::from_string("one"));
-    (void)duct::wire::write_frame(static_cast<duct::wire::SocketHandle>(client),
-                                 duct::Message::from_string("two"));
+static void test_shm_byte_ring_tiny_burst() {
+  auto lis_r = duct::listen("shm://duct_testtiny");
+  EXPECT_TRUE(lis_r.ok());
+  if (!lis_r.ok()) return;
 
-    std::string big(duct::wire::kMaxFramePayload, 'x');
-    (void)duct::wire::write_frame(static_cast<duct::wire::SocketHandle>(client),
-                                 duct::Message::from_string(big));
-    closesocket(client);
-  });
+  auto accepted = std::promise<duct::Result<std::unique_ptr<duct::Pipe>>>();
+  auto fut = accepted.get_future();
+  std::thread t([&] { accepted.set_value(lis_r.value()->accept()); });
 
-  auto r1 = duct::wire::read_frame(static_cast<duct::wire::SocketHandle>(server));
-  EXPECT_TRUE(r1.ok());
-  if (r1.ok()) {
-    std::string s(reinterpret_cast<const char*>(r1.value().data()), r1.value().size());
-    EXPECT_EQ(s, "one");
-  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
 
-  auto r2 = duct::wire::read_frame(static_cast<duct::wire::SocketHandle>(server));
-  EXPECT_TRUE(r2.ok());
-  if (r2.ok()) {
-    std::string s(reinterpret_cast<const char*>(r2.value().data()), r2.value().size());
-    EXPECT_EQ(s, "two");
+  duct::DialOptions dial_opt;
+  dial_opt.qos.snd_hwm_bytes = 0;
+  dial_opt.qos.rcv_hwm_bytes = 0;
+  dial_opt.shm.layout = duct::ShmRingLayout::kByteRing;
+  auto c = duct::dial("shm://duct_testtiny", dial_opt);
+  EXPECT_TRUE(c.ok());
+  auto sr = fut.get();
+  t.join();
+  EXPECT_TRUE(sr.ok());
+  if (!c.ok() || !sr.ok()) return;
+
+  // Nobody is receiving yet: tiny records must queue far beyond a per-message slot count.
+  constexpr int kBurst = 20000;
+  duct::SendOptions opt;
+  opt.timeout = std::chrono::milliseconds(100);
+  for (int i = 0; i < kBurst; ++i) {
+    auto st = c.value()->send(duct::Message::from_string(std::to_string(i)), opt);
+    EXPECT_TRUE(st.ok());
+    if (!st.ok()) break;
   }
 
-  auto r3 = duct::wire::read_frame(static_cast<duct::wire::SocketHandle>(server));
-  EXPECT_TRUE(r3.ok());
-  if (r3.ok()) {
-    EXPECT_EQ(r3.value().size(), duct::wire::kMaxFramePayload);
+  for (int i = 0; i < kBurst; ++i) {
+    auto m = sr.value()->recv({});
+    EXPECT_TRUE(m.ok());
+    if (!m.ok()) break;
+    EXPECT_EQ(std::string(m.value().as_string_view()), std::to_string(i));
   }
 
-  closesocket(server);
-  writer.join();
-  WSACleanup();
-#else
-  int fds[2]{-1, -1};
-  int rc = ::socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
-  EXPECT_TRUE(rc == 0);
-  if (rc != 0) return;
+  lis_r.value()->close();
+}
 
-  auto writer = std::thread([&] {
-    (void)duct::wire::write_frame(fds[0], duct::Message::from_string("one"));
-    (void)duct::wire::write_frame(fds[0], duct::Message::from_string("two"));
+static void test_shm_park_and_wake() {
+  auto lis_r = duct::listen("shm://duct_testpark");
+  EXPECT_TRUE(lis_r.ok());
+  if (!lis_r.ok()) return;
 
-    // Max payload frame.
-    std::string big(duct::wire::kMaxFramePayload, 'x');
-    (void)duct::wire::write_frame(fds[0], duct::Message::from_string(big));
-    ::close(fds[0]);
-  });
+  auto accepted = std::promise<duct::Result<std::unique_ptr<duct::Pipe>>>();
+  auto fut = accepted.get_future();
+  std::thread t([&] { accepted.set_value(lis_r.value()->accept()); });
 
-  auto r1 = duct::wire::read_frame(fds[1]);
-  EXPECT_TRUE(r1.ok());
-  if (r1.ok()) {
-    std::string s(reinterpret_cast<const char*>(r1.value().data()), r1.value().size());
-    EXPECT_EQ(s, "one");
-  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
 
-  auto r2 = duct::wire::read_frame(fds[1]);
-  EXPECT_TRUE(r2.ok());
-  if (r2.ok()) {
-    std::string s(reinterpret_cast<const char*>(r2.value().data()), r2.value().size());
-    EXPECT_EQ(s, "two");
-  }
+  duct::DialOptions dial_opt;
+  dial_opt.qos.snd_hwm_bytes = 0;
+  dial_opt.qos.rcv_hwm_bytes = 0;
+  auto c = duct::dial("shm://duct_testpark", dial_opt);
+  EXPECT_TRUE(c.ok());
+  auto sr = fut.get();
+  t.join();
+  EXPECT_TRUE(sr.ok());
+  if (!c.ok() || !sr.ok()) return;
 
-  auto r3 = duct::wire::read_frame(fds[1]);
-  EXPECT_TRUE(r3.ok());
-  if (r3.ok()) {
-    EXPECT_EQ(r3.value().size(), duct::wire::kMaxFramePayload);
+  // Empty ring: recv parks and times out.
+  duct::RecvOptions ropt;
+  ropt.timeout = std::chrono::milliseconds(30);
+  auto none = c.value()->recv(ropt);
+  EXPECT_TRUE(!none.ok());
+  if (!none.ok()) EXPECT_EQ(none.status().code(), duct::StatusCode::kTimeout);
+
+  // Ping-pong with an idle gap every so often so both sides go through park/wake.
+  constexpr int kRounds = 200;
+  std::thread echo([&] {
+    for (int i = 0; i < kRounds; ++i) {
+      auto m = sr.value()->recv({});
+      if (!m.ok()) return;
+      if (!sr.value()->send(m.value(), {}).ok()) return;
+    }
+  });
+  for (int i = 0; i < kRounds; ++i) {
+    if (i % 50 == 0) std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    auto st = c.value()->send(duct::Message::from_string(std::to_string(i)), {});
+    EXPECT_TRUE(st.ok());
+    auto m = c.value()->recv({});
+    EXPECT_TRUE(m.ok());
+    if (!st.ok() || !m.ok()) break;
+    EXPECT_EQ(std::string(m.value().as_string_view()), std::to_string(i));
   }
+  echo.join();
 
-  ::close(fds[1]);
-  writer.join();
-#endif
+  lis_r.value()->close();
 }
 
-}  // namespace
-
+static void test_shm_batch() {
+  auto lis_r = duct::listen("shm://duct_testbatch");
+  EXPECT_TRUE(lis_r.ok());
+  if (!lis_r.ok()) return;
+
+  auto accepted = std::promise<duct::Result<std::unique_ptr<duct::Pipe>>>();
+  auto fut = accepted.get_future();
+  std::thread t([&] { accepted.set_value(lis_r.value()->accept()); });
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+  duct::DialOptions dial_opt;
+  dial_opt.qos.snd_hwm_bytes = 0;
+  dial_opt.qos.rcv_hwm_bytes = 0;
+  auto c = duct::dial("shm://duct_testbatch", dial_opt);
+  EXPECT_TRUE(c.ok());
+  auto sr = fut.get();
+  t.join();
+  EXPECT_TRUE(sr.ok());
+  if (!c.ok() || !sr.ok()) return;
+
+  // Larger than the descriptor ring, so the batch is published in several runs.
+  constexpr int kCount = 3000;
+  std::vector<duct::Message> out;
+  for (int i = 0; i < kCount; ++i) out.push_back(duct::Message::from_string(std::to_string(i)));
+
+  std::vector<std::string> got;
+  std::thread rx([&] {
+    std::vector<duct::Message> buf(256);
+    while (got.size() < static_cast<std::size_t>(kCount)) {
+      auto n = sr.value()->recv_batch(buf, {});
+      if (!n.ok()) return;
+      for (std::size_t i = 0; i < n.value(); ++i) got.emplace_back(buf[i].as_string_view());
+    }
+  });
+  std::size_t sent = 0;
+  while (sent < out.size()) {
+    auto n = c.value()->send_batch(std::span<const duct::Message>(out).subspan(sent), {});
+    EXPECT_TRUE(n.ok());
+    if (!n.ok()) break;
+    sent += n.value();
+  }
+  rx.join();
+
+  EXPECT_EQ(got.size(), static_cast<std::size_t>(kCount));
+  for (std::size_t i = 0; i < got.size(); ++i) EXPECT_EQ(got[i], std::to_string(i));
+
+  lis_r.value()->close();
+}
+
+static void test_shm_zero_copy_leases() {
+  duct::ListenOptions lopt;
+  lopt.shm.zero_copy_recv = true;
+  auto lis_r = duct::listen("shm://duct_testlease", lopt);
+  EXPECT_TRUE(lis_r.ok());
+  if (!lis_r.ok()) return;
+
+  auto accepted = std::promise<duct::Result<std::unique_ptr<duct::Pipe>>>();
+  auto fut = accepted.get_future();
+  std::thread t([&] { accepted.set_value(lis_r.value()->accept()); });
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+  duct::DialOptions dial_opt;
+  dial_opt.qos.snd_hwm_bytes = 0;
+  dial_opt.qos.rcv_hwm_bytes = 0;
+  auto c = duct::dial("shm://duct_testlease", dial_opt);
+  EXPECT_TRUE(c.ok());
+  auto sr = fut.get();
+  t.join();
+  EXPECT_TRUE(sr.ok());
+  if (!c.ok() || !sr.ok()) return;
+
+  // 64KB-class payloads: the slab only has 8 such blocks, so held leases fill it quickly.
+  constexpr int kHeld = 8;
+  constexpr std::size_t kSize = 60000;
+  auto payload = [](int i) { return duct::Message::from_string(std::string(kSize, static_cast<char>('a' + i))); };
+
+  std::vector<duct::Message> held;
+  for (int i = 0; i < kHeld; ++i) {
+    EXPECT_TRUE(c.value()->send(payload(i), {}).ok());
+    auto m = sr.value()->recv({});
+    EXPECT_TRUE(m.ok());
+    if (!m.ok()) return;
+    held.push_back(std::move(m.value()));
+  }
+  for (int i = 0; i < kHeld; ++i) {
+    EXPECT_TRUE(held[i] == payload(i));
+    EXPECT_EQ(held[i].use_count(), 1);
+  }
+  // Small payloads are still copied (inline) and never hold ring space.
+  EXPECT_TRUE(c.value()->send(duct::Message::from_string("tiny"), {}).ok());
+  auto tiny = sr.value()->recv({});
+  EXPECT_TRUE(tiny.ok());
+  if (tiny.ok()) EXPECT_EQ(tiny.value().use_count(), 0);
+
+  duct::SendOptions sopt;
+  sopt.timeout = std::chrono::milliseconds(30);
+  auto blocked = c.value()->send(payload(kHeld), sopt);
+  EXPECT_TRUE(!blocked.ok());
+  if (!blocked.ok()) EXPECT_EQ(blocked.status().code(), duct::StatusCode::kTimeout);
+
+  // Releasing out of order frees nothing until the oldest lease goes; copies keep a slice alive.
+  duct::Message tail_slice = held[kHeld - 1].slice(100, 10);
+  for (int i = kHeld - 1; i >= 1; --i) held[i] = duct::Message();
+  EXPECT_TRUE(!c.value()->send(payload(kHeld), sopt).ok());
+
+  // The sender is parked on the full ring; dropping the oldest lease must wake it.
+  std::thread release([&] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    held[0] = duct::Message();
+  });
+  EXPECT_TRUE(c.value()->send(payload(kHeld), {}).ok());
+  release.join();
+  auto next = sr.value()->recv({});
+  EXPECT_TRUE(next.ok());
+  if (next.ok()) EXPECT_TRUE(next.value() == payload(kHeld));
+
+  // A lease may outlive its pipe.
+  sr.value()->close();
+  sr.value().reset();
+  EXPECT_EQ(tail_slice.as_string_view(), std::string(10, static_cast<char>('a' + kHeld - 1)));
+  if (next.ok()) EXPECT_EQ(next.value().size(), kSize);
+
+  c.value()->close();
+  lis_r.value()->close();
+}
+
+// Encode straight into each transport's TX buffer and publish only part of the reservation.
+#if !defined(_WIN32)
+static void test_shm_segment_pool() {
+  duct::ListenOptions lopt;
+  lopt.shm.pool_segments = 2;
+  lopt.shm.huge_pages = true;  // best effort
+  auto lis_r = duct::listen("shm://duct_testpool", lopt);
+  EXPECT_TRUE(lis_r.ok());
+  if (!lis_r.ok()) return;
+
+  duct::DialOptions dial_opt;
+  dial_opt.qos.snd_hwm_bytes = 0;
+  dial_opt.qos.rcv_hwm_bytes = 0;
+  dial_opt.shm.from_listener_pool = true;
+  dial_opt.shm.populate = true;
+  dial_opt.timeout = std::chrono::milliseconds(5'000);
+
+  // Segments go back to the pool once both ends closed and are handed out again; a layout other
+  // than the pool's is made on the spot.
+  for (int round = 0; round < 6; ++round) {
+    duct::DialOptions opt = dial_opt;
+    opt.shm.layout = round % 3 == 2 ? duct::ShmRingLayout::kByteRing : duct::ShmRingLayout::kSlab;
+    auto server = std::async(std::launch::async, [&] { return lis_r.value()->accept(); });
+    auto c = duct::dial("shm://duct_testpool", opt);
+    auto s = server.get();
+    EXPECT_TRUE(c.ok() && s.ok());
+    if (!c.ok() || !s.ok()) return;
+
+    const std::string ping = "ping" + std::to_string(round);
+    EXPECT_TRUE(c.value()->send(duct::Message::from_string(ping), {}).ok());
+    auto got = s.value()->recv({});
+    EXPECT_TRUE(got.ok());
+    if (got.ok()) EXPECT_EQ(std::string(got.value().as_string_view()), ping);
+    EXPECT_TRUE(s.value()->send(duct::Message::from_string("pong"), {}).ok());
+    auto back = c.value()->recv({});
+    EXPECT_TRUE(back.ok());
+    if (back.ok()) EXPECT_EQ(std::string(back.value().as_string_view()), "pong");
+    c.value()->close();
+    s.value()->close();
+  }
+
+  // The segment comes with accept(), so with nobody accepting the dial times out.
+  dial_opt.timeout = std::chrono::milliseconds(50);
+  auto lonely = duct::dial("shm://duct_testpool", dial_opt);
+  EXPECT_TRUE(!lonely.ok() && lonely.status().code() == duct::StatusCode::kTimeout);
+  lis_r.value()->close();
+}
+#endif
+
+static void check_reserve_commit(const std::string& listen_addr, const duct::DialOptions& dial_base) {
+  auto lis_r = duct::listen(listen_addr);
+  EXPECT_TRUE(lis_r.ok());
+  if (!lis_r.ok()) return;
+  auto addr = lis_r.value()->local_address();
+  EXPECT_TRUE(addr.ok());
+  if (!addr.ok()) return;
+
+  auto accepted = std::promise<duct::Result<std::unique_ptr<duct::Pipe>>>();
+  auto fut = accepted.get_future();
+  std::thread t([&] { accepted.set_value(lis_r.value()->accept()); });
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+  duct::DialOptions dial_opt = dial_base;
+  dial_opt.qos.snd_hwm_bytes = 0;
+  dial_opt.qos.rcv_hwm_bytes = 0;
+  auto c = duct::dial(addr.value(), dial_opt);
+  EXPECT_TRUE(c.ok());
+  auto sr = fut.get();
+  t.join();
+  EXPECT_TRUE(sr.ok());
+  if (!c.ok() || !sr.ok()) return;
+
+  EXPECT_TRUE(!c.value()->commit(1, {}).ok());
+
+  // Enough traffic to wrap the shm rings several times.
+  constexpr int kCount = 2000;
+  std::vector<std::string> got;
+  std::thread rx([&] {
+    for (int i = 0; i < kCount; ++i) {
+      auto m = sr.value()->recv({});
+      if (!m.ok()) return;
+      got.emplace_back(m.value().as_string_view());
+    }
+  });
+  for (int i = 0; i < kCount; ++i) {
+    std::string body = std::to_string(i) + std::string(static_cast<std::size_t>(i % 3000), 'x');
+    auto span = c.value()->reserve(body.size() + 64, {});
+    EXPECT_TRUE(span.ok());
+    if (!span.ok()) break;
+    EXPECT_EQ(span.value().size(), body.size() + 64);
+    std::memcpy(span.value().data(), body.data(), body.size());
+    EXPECT_TRUE(!c.value()->commit(body.size() + 65, {}).ok());
+    EXPECT_TRUE(c.value()->commit(body.size(), {}).ok());
+  }
+  rx.join();
+  EXPECT_EQ(got.size(), static_cast<std::size_t>(kCount));
+  for (std::size_t i = 0; i < got.size(); ++i) {
+    EXPECT_EQ(got[i], std::to_string(i) + std::string(i % 3000, 'x'));
+  }
+
+  c.value()->close();
+  sr.value()->close();
+  lis_r.value()->close();
+}
+
+static void test_reserve_commit() {
+  check_reserve_commit("tcp://127.0.0.1:0", {});
+  check_reserve_commit("shm://duct_testreserve", {});
+  duct::DialOptions bytes;
+  bytes.shm.layout = duct::ShmRingLayout::kByteRing;
+  check_reserve_commit("shm://duct_testreserve", bytes);
+}
+
+// Messages past one frame go out as fragments and come back whole, in order with the small ones
+// around them, on the channel they were sent on; reserve() past one frame falls back to a copy.
+static void check_large_messages(const std::string& listen_addr, const duct::ListenOptions& lopt,
+                                 const duct::DialOptions& dial_base) {
+  auto lis_r = duct::listen(listen_addr, lopt);
+  EXPECT_TRUE(lis_r.ok());
+  if (!lis_r.ok()) return;
+  auto addr = lis_r.value()->local_address();
+  EXPECT_TRUE(addr.ok());
+  if (!addr.ok()) return;
+
+  static const std::size_t sizes[] = {65537, 10, (1u << 20) + 3, 0, 3u << 20, 200000, 300000};
+  constexpr int kCount = sizeof(sizes) / sizeof(sizes[0]);
+  auto fill = [](int i, std::uint8_t* p, std::size_t n) {
+    for (std::size_t j = 0; j < n; ++j) p[j] = static_cast<std::uint8_t>(i * 31 + j / 7);
+  };
+
+  auto server = std::async(std::launch::async, [&]() -> bool {
+    auto p = lis_r.value()->accept();
+    if (!p.ok()) return false;
+    std::vector<std::uint8_t> want;
+    for (int i = 0; i < kCount; ++i) {
+      auto m = p.value()->recv({});
+      if (!m.ok() || m.value().size() != sizes[i] || m.value().channel() != i % 2) return false;
+      want.resize(sizes[i]);
+      fill(i, want.data(), want.size());
+      if (!want.empty() && std::memcmp(m.value().data(), want.data(), want.size()) != 0) return false;
+    }
+    return true;
+  });
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  duct::DialOptions dial_opt = dial_base;
+  dial_opt.qos.snd_hwm_bytes = 0;
+  dial_opt.qos.rcv_hwm_bytes = 0;
+  auto c = duct::dial(addr.value(), dial_opt);
+  EXPECT_TRUE(c.ok());
+  if (!c.ok()) return;
+
+  for (int i = 0; i + 1 < kCount; ++i) {
+    std::vector<std::uint8_t> buf(sizes[i]);
+    fill(i, buf.data(), buf.size());
+    duct::SendOptions opt;
+    opt.channel = static_cast<std::uint16_t>(i % 2);
+    EXPECT_TRUE(c.value()->send(duct::Message::from_bytes(buf.data(), buf.size()), opt).ok());
+  }
+  duct::SendOptions opt;
+  opt.channel = (kCount - 1) % 2;
+  auto span = c.value()->reserve(sizes[kCount - 1] + 100, opt);
+  EXPECT_TRUE(span.ok());
+  if (span.ok()) {
+    fill(kCount - 1, span.value().data(), sizes[kCount - 1]);
+    EXPECT_TRUE(c.value()->commit(sizes[kCount - 1], opt).ok());
+  }
+
+  auto sst = server.wait_for(std::chrono::seconds(10));
+  EXPECT_TRUE(sst == std::future_status::ready);
+  if (sst == std::future_status::ready) EXPECT_TRUE(server.get());
+  c.value()->close();
+  lis_r.value()->close();
+}
+
+static void test_large_messages() {
+  check_large_messages("tcp://127.0.0.1:0", {}, {});
+  check_large_messages("shm://duct_testlarge", {}, {});
+  duct::ListenOptions leases;
+  leases.shm.zero_copy_recv = true;
+  duct::DialOptions bytes;
+  bytes.shm.layout = duct::ShmRingLayout::kByteRing;
+  check_large_messages("shm://duct_testlarge", leases, bytes);
+}
+
+#if !defined(_WIN32)
+static void test_shm_broadcast() {
+  duct::DialOptions pub_opt;
+  pub_opt.qos.snd_hwm_bytes = 0;
+  pub_opt.shm.broadcast.role = duct::ShmBroadcastRole::kPublish;
+  pub_opt.shm.broadcast.ring_bytes = 64 * 1024;
+  duct::DialOptions sub_opt;
+  sub_opt.qos.snd_hwm_bytes = 0;
+  sub_opt.qos.rcv_hwm_bytes = 0;
+  sub_opt.shm.broadcast.role = duct::ShmBroadcastRole::kSubscribe;
+
+  EXPECT_TRUE(!duct::dial("shm://duct_testbcast", sub_opt).ok());
+  auto pub = duct::dial("shm://duct_testbcast", pub_opt);
+  EXPECT_TRUE(pub.ok());
+  if (!pub.ok()) return;
+  EXPECT_TRUE(!duct::dial("shm://duct_testbcast", pub_opt).ok());
+  duct::ListenOptions lopt;
+  lopt.shm.broadcast.role = duct::ShmBroadcastRole::kPublish;
+  EXPECT_TRUE(!duct::listen("shm://duct_testbcast", lopt).ok());
+
+  auto a = duct::dial("shm://duct_testbcast", sub_opt);
+  std::uint64_t lost = 0;
+  duct::DialOptions skip_opt = sub_opt;
+  skip_opt.shm.broadcast.on_lap = duct::ShmLapPolicy::kSkip;
+  skip_opt.shm.broadcast.on_lapped = [&](std::uint64_t n) { lost += n; };
+  auto b = duct::dial("shm://duct_testbcast", skip_opt);
+  EXPECT_TRUE(a.ok() && b.ok());
+  if (!a.ok() || !b.ok()) return;
+
+  // One copy per message on the publishing side, whatever the number of subscribers.
+  std::vector<duct::Message> batch = {duct::Message::from_string("one"), duct::Message::from_string("two"),
+                                      duct::Message::from_string("three")};
+  duct::SendOptions on2;
+  on2.channel = 2;
+  const std::uint64_t copies = duct::wire::thread_io().copies;
+  auto sent = pub.value()->send_batch(batch, on2);
+  EXPECT_TRUE(sent.ok() && sent.value() == 3);
+  EXPECT_EQ(duct::wire::thread_io().copies, copies + 3);
+  for (auto* sub : {&a.value(), &b.value()}) {
+    for (const char* want : {"one", "two", "three"}) {
+      auto m = (*sub)->recv({});
+      EXPECT_TRUE(m.ok());
+      if (!m.ok()) break;
+      EXPECT_EQ(std::string(m.value().as_string_view()), want);
+      EXPECT_EQ(m.value().channel(), 2);
+    }
+  }
+
+  // Parts are published as one message; oversized messages are refused.
+  duct::SendOptions first;
+  first.more = true;
+  duct::SendOptions rest;
+  rest.continued = true;
+  EXPECT_TRUE(pub.value()->send(duct::Message::from_string("par"), first).ok());
+  EXPECT_TRUE(pub.value()->send(duct::Message::from_string("ts"), rest).ok());
+  for (auto* sub : {&a.value(), &b.value()}) {
+    auto m = (*sub)->recv({});
+    EXPECT_TRUE(m.ok());
+    if (m.ok()) EXPECT_EQ(std::string(m.value().as_string_view()), "parts");
+  }
+  auto huge = pub.value()->send(duct::Message::allocate(16 * 1024), {});
+  EXPECT_TRUE(!huge.ok() && huge.status().code() == duct::StatusCode::kInvalidArgument);
+
+  // Lap both subscribers: the dropping one fails for good, the skipping one resumes at the oldest
+  // message left and accounts for the rest.
+  constexpr int kLap = 200;
+  for (int i = 0; i < kLap; ++i) {
+    duct::Message m = duct::Message::allocate(1000);
+    std::memset(m.data(), 0, m.size());
+    std::memcpy(m.data(), &i, sizeof(i));
+    EXPECT_TRUE(pub.value()->send(m, {}).ok());
+  }
+  auto dropped = a.value()->try_recv_batch(std::span<duct::Message>(batch));
+  EXPECT_TRUE(!dropped.ok() && dropped.status().code() == duct::StatusCode::kIoError);
+  EXPECT_TRUE(!a.value()->recv({}).ok());
+  int got = 0;
+  int next = 0;
+  for (;;) {
+    auto n = b.value()->try_recv_batch(std::span<duct::Message>(batch));
+    EXPECT_TRUE(n.ok());
+    if (!n.ok() || n.value() == 0) break;
+    for (std::size_t k = 0; k < n.value(); ++k) {
+      int i = 0;
+      std::memcpy(&i, batch[k].data(), sizeof(i));
+      EXPECT_TRUE(i >= next);
+      next = i + 1;
+      ++got;
+    }
+  }
+  EXPECT_TRUE(lost != 0);
+  EXPECT_EQ(static_cast<std::uint64_t>(got) + lost, static_cast<std::uint64_t>(kLap));
+  EXPECT_EQ(next, kLap);
+
+  // A parked subscriber is woken, and sees kClosed once it has read what was published.
+  auto c = duct::dial("shm://duct_testbcast", sub_opt);
+  EXPECT_TRUE(c.ok());
+  if (!c.ok()) return;
+  std::thread rx([&] {
+    auto m = c.value()->recv({});
+    EXPECT_TRUE(m.ok());
+    if (m.ok()) EXPECT_EQ(std::string(m.value().as_string_view()), "wake");
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  EXPECT_TRUE(pub.value()->send(duct::Message::from_string("wake"), {}).ok());
+  rx.join();
+  EXPECT_TRUE(pub.value()->send(duct::Message::from_string("last"), {}).ok());
+  pub.value()->close();
+  auto last = c.value()->recv({});
+  EXPECT_TRUE(last.ok());
+  auto end = c.value()->recv({});
+  EXPECT_TRUE(!end.ok() && end.status().code() == duct::StatusCode::kClosed);
+  EXPECT_TRUE(!duct::dial("shm://duct_testbcast", sub_opt).ok());
+}
+#endif
+
+static void test_reassembly_limit() {
+  duct::ListenOptions lopt;
+  lopt.fragments.reassembly_max_bytes = 256 * 1024;
+  auto lis_r = duct::listen("tcp://127.0.0.1:0", lopt);
+  EXPECT_TRUE(lis_r.ok());
+  if (!lis_r.ok()) return;
+  auto addr = lis_r.value()->local_address();
+  EXPECT_TRUE(addr.ok());
+  if (!addr.ok()) return;
+
+  auto accepted = std::promise<duct::Result<std::unique_ptr<duct::Pipe>>>();
+  auto fut = accepted.get_future();
+  std::thread t([&] { accepted.set_value(lis_r.value()->accept()); });
+  duct::DialOptions dial_opt;
+  dial_opt.qos.snd_hwm_bytes = 0;
+  dial_opt.qos.rcv_hwm_bytes = 0;
+  auto c = duct::dial(addr.value(), dial_opt);
+  EXPECT_TRUE(c.ok());
+  auto sr = fut.get();
+  t.join();
+  EXPECT_TRUE(sr.ok());
+  if (!c.ok() || !sr.ok()) return;
+
+  // The receiver gives up on a message over its bound and carries on with the next ones.
+  std::thread writer([&] {
+    EXPECT_TRUE(c.value()->send(duct::Message::from_string(std::string(1 << 20, 'x')), {}).ok());
+    EXPECT_TRUE(c.value()->send(duct::Message::from_string(std::string(100000, 'y')), {}).ok());
+    EXPECT_TRUE(c.value()->send(duct::Message::from_string("after"), {}).ok());
+  });
+  auto m = sr.value()->recv({});
+  EXPECT_TRUE(m.ok() && m.value().as_string_view() == std::string(100000, 'y'));
+  m = sr.value()->recv({});
+  EXPECT_TRUE(m.ok() && m.value().as_string_view() == "after");
+  writer.join();
+
+  c.value()->close();
+  lis_r.value()->close();
+}
+
+#if !defined(_WIN32)
+static bool handle_readable(duct::PollHandle h, int timeout_ms) {
+  pollfd p{static_cast<int>(h), POLLIN, 0};
+  return ::poll(&p, 1, timeout_ms) == 1 && (p.revents & POLLIN) != 0;
+}
+
+static void test_shm_poll_handle() {
+  auto lis_r = duct::listen("shm://duct_testpollfd");
+  EXPECT_TRUE(lis_r.ok());
+  if (!lis_r.ok()) return;
+  auto accepted = std::promise<duct::Result<std::unique_ptr<duct::Pipe>>>();
+  auto fut = accepted.get_future();
+  std::thread t([&] { accepted.set_value(lis_r.value()->accept()); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  duct::DialOptions dial_opt;
+  dial_opt.qos.snd_hwm_bytes = 0;
+  dial_opt.qos.rcv_hwm_bytes = 0;
+  auto c = duct::dial("shm://duct_testpollfd", dial_opt);
+  EXPECT_TRUE(c.ok());
+  auto sr = fut.get();
+  t.join();
+  EXPECT_TRUE(sr.ok());
+  if (!c.ok() || !sr.ok()) return;
+  duct::Pipe& s = *sr.value();
+
+  const duct::PollHandle h = s.poll_handle();
+  EXPECT_TRUE(h != duct::kInvalidPollHandle);
+  if (h == duct::kInvalidPollHandle) return;
+
+  // Not armed yet: sends while nobody polls leave the descriptor quiet.
+  EXPECT_TRUE(c.value()->send(duct::Message::from_string("early"), {}).ok());
+  EXPECT_TRUE(!handle_readable(h, 0));
+
+  std::array<duct::Message, 4> out;
+  auto n = s.try_recv_batch(out);
+  EXPECT_TRUE(n.ok() && n.value() == 1);
+  EXPECT_EQ(out[0].as_string_view(), "early");
+
+  // Drained and armed: the next publish signals once, whatever follows it.
+  EXPECT_TRUE(!handle_readable(h, 0));
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_TRUE(c.value()->send(duct::Message::from_string(std::to_string(i)), {}).ok());
+  }
+  EXPECT_TRUE(handle_readable(h, 1000));
+  n = s.try_recv_batch(out);
+  EXPECT_TRUE(n.ok() && n.value() == 3);
+  EXPECT_TRUE(!handle_readable(h, 0));
+
+  // A batch that fills `out` leaves the pipe disarmed until a short one.
+  for (int i = 0; i < 6; ++i) {
+    EXPECT_TRUE(c.value()->send(duct::Message::from_string("b"), {}).ok());
+  }
+  EXPECT_TRUE(handle_readable(h, 1000));
+  n = s.try_recv_batch(out);
+  EXPECT_TRUE(n.ok() && n.value() == 4);
+  EXPECT_TRUE(!handle_readable(h, 0));
+  n = s.try_recv_batch(out);
+  EXPECT_TRUE(n.ok() && n.value() == 2);
+
+  // The client's direction works the same way.
+  EXPECT_TRUE(c.value()->poll_handle() != duct::kInvalidPollHandle);
+  auto cn = c.value()->try_recv_batch(out);
+  EXPECT_TRUE(cn.ok() && cn.value() == 0);
+  EXPECT_TRUE(s.send(duct::Message::from_string("back"), {}).ok());
+  EXPECT_TRUE(handle_readable(c.value()->poll_handle(), 1000));
+
+  c.value()->close();
+  s.close();
+  lis_r.value()->close();
+}
+#endif
+
+static void test_reactor_dispatches_ready_pipes() {
+  auto reactor_r = duct::Reactor::create();
+  EXPECT_TRUE(reactor_r.ok());
+  if (!reactor_r.ok()) return;
+  duct::Reactor& reactor = *reactor_r.value();
+
+  auto lis_r = duct::listen("tcp://127.0.0.1:0");
+  EXPECT_TRUE(lis_r.ok());
+  if (!lis_r.ok()) return;
+  auto addr = lis_r.value()->local_address();
+  EXPECT_TRUE(addr.ok());
+  if (!addr.ok()) return;
+
+  // Many idle pipes must not delay a ready one. Clients go through dial()'s default QosPipe.
+  constexpr int kPipes = 200;
+  std::mutex mu;
+  std::vector<int> counts(kPipes, 0);
+  std::vector<duct::StatusCode> errors;
+  std::vector<std::unique_ptr<duct::Pipe>> clients;
+  for (int i = 0; i < kPipes; ++i) {
+    auto c = duct::dial(addr.value());
+    EXPECT_TRUE(c.ok());
+    auto server = lis_r.value()->accept();
+    EXPECT_TRUE(server.ok());
+    if (!c.ok() || !server.ok()) return;
+    clients.push_back(std::move(c.value()));
+    auto id = reactor.add(
+        std::shared_ptr<duct::Pipe>(std::move(server.value())),
+        [&, i](const duct::Message&) {
+          std::lock_guard<std::mutex> lock(mu);
+          ++counts[i];
+        },
+        [&](const duct::Status& st) {
+          std::lock_guard<std::mutex> lock(mu);
+          errors.push_back(st.code());
+        });
+    EXPECT_TRUE(id.ok());
+  }
+
+  // shm:// wakes the reactor through its notification descriptor (polled on Windows).
+  auto shm_lis = duct::listen("shm://duct_testreactor");
+  EXPECT_TRUE(shm_lis.ok());
+  if (!shm_lis.ok()) return;
+  auto accepted = std::promise<duct::Result<std::unique_ptr<duct::Pipe>>>();
+  auto fut = accepted.get_future();
+  std::thread t([&] { accepted.set_value(shm_lis.value()->accept()); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  duct::DialOptions shm_opt;
+  shm_opt.qos.snd_hwm_bytes = 0;
+  auto shm_c = duct::dial("shm://duct_testreactor", shm_opt);
+  EXPECT_TRUE(shm_c.ok());
+  auto shm_s = fut.get();
+  t.join();
+  EXPECT_TRUE(shm_s.ok());
+  if (!shm_c.ok() || !shm_s.ok()) return;
+  std::atomic<int> shm_count{0};
+  EXPECT_TRUE(reactor.add(std::shared_ptr<duct::Pipe>(std::move(shm_s.value())),
+                          [&](const duct::Message&) { ++shm_count; }).ok());
+  EXPECT_EQ(reactor.size(), static_cast<std::size_t>(kPipes + 1));
+
+  std::thread loop([&] { EXPECT_TRUE(reactor.run().ok()); });
+
+  auto wait_for = [&](auto&& done) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (!done() && std::chrono::steady_clock::now() < deadline) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return done();
+  };
+
+  auto start = std::chrono::steady_clock::now();
+  EXPECT_TRUE(clients.back()->send(duct::Message::from_string("last"), {}).ok());
+  EXPECT_TRUE(wait_for([&] {
+    std::lock_guard<std::mutex> lock(mu);
+    return counts.back() == 1;
+  }));
+  EXPECT_TRUE(std::chrono::steady_clock::now() - start < std::chrono::seconds(1));
+
+  for (int i = 0; i < kPipes - 1; ++i) {
+    for (int k = 0; k <= i % 3; ++k) EXPECT_TRUE(clients[i]->send(duct::Message::from_string("x"), {}).ok());
+  }
+  EXPECT_TRUE(shm_c.value()->send(duct::Message::from_string("local"), {}).ok());
+  EXPECT_TRUE(wait_for([&] {
+    std::lock_guard<std::mutex> lock(mu);
+    for (int i = 0; i < kPipes - 1; ++i) {
+      if (counts[i] != i % 3 + 1) return false;
+    }
+    return true;
+  }));
+  EXPECT_TRUE(wait_for([&] { return shm_count.load() == 1; }));
+
+  // A peer closing is reported once and the pipe leaves the reactor.
+  clients[0]->close();
+  EXPECT_TRUE(wait_for([&] { return reactor.size() == static_cast<std::size_t>(kPipes); }));
+  {
+    std::lock_guard<std::mutex> lock(mu);
+    EXPECT_EQ(errors.size(), static_cast<std::size_t>(1));
+    if (!errors.empty()) EXPECT_EQ(errors[0], duct::StatusCode::kClosed);
+  }
+
+  reactor.stop();
+  loop.join();
+  for (auto& c : clients) c->close();
+  shm_c.value()->close();
+  shm_lis.value()->close();
+  lis_r.value()->close();
+}
+
+// io_uring (Linux) or IOCP (Windows): the engine does the pipe's I/O until it is removed.
+static void test_reactor_engine_echo(duct::ReactorBackend backend) {
+  duct::ReactorOptions ropt;
+  ropt.io_uring = backend == duct::ReactorBackend::kIoUring;
+  ropt.iocp = backend == duct::ReactorBackend::kIocp;
+  ropt.send_hwm_bytes = 256 * 1024;  // small enough for the burst below to hit it
+  auto reactor_r = duct::Reactor::create(ropt);
+  EXPECT_TRUE(reactor_r.ok());
+  if (!reactor_r.ok()) return;
+  duct::Reactor& reactor = *reactor_r.value();
+  // Other platforms, and kernels (or sandboxes) without io_uring, fall back; the readiness test
+  // covers that path.
+  if (reactor.backend() != backend) return;
+
+  auto lis_r = duct::listen("tcp://127.0.0.1:0");
+  EXPECT_TRUE(lis_r.ok());
+  if (!lis_r.ok()) return;
+  auto addr = lis_r.value()->local_address();
+  EXPECT_TRUE(addr.ok());
+  if (!addr.ok()) return;
+  duct::DialOptions dopt;
+  dopt.qos.snd_hwm_bytes = 0;  // the raw pipe: its sends block instead of queueing
+  dopt.qos.rcv_hwm_bytes = 0;
+  dopt.compact_frames = true;  // the engine queues the server's hello and compact headers
+  auto c = duct::dial(addr.value(), dopt);
+  EXPECT_TRUE(c.ok());
+  auto accepted = lis_r.value()->accept();
+  EXPECT_TRUE(accepted.ok());
+  if (!c.ok() || !accepted.ok()) return;
+  duct::Pipe& client = *c.value();
+  std::shared_ptr<duct::Pipe> server(std::move(accepted.value()));
+
+  // Echo from the callback: the reply is queued and goes out with the loop's next submission.
+  std::atomic<int> echoed{0};
+  std::atomic<int> errors{0};
+  auto id = reactor.add(
+      server,
+      [&](const duct::Message& m) {
+        EXPECT_TRUE(server->send(m, {}).ok());
+        ++echoed;
+      },
+      [&](const duct::Status&) { ++errors; });
+  EXPECT_TRUE(id.ok());
+  if (!id.ok()) return;
+  std::thread loop([&] { EXPECT_TRUE(reactor.run().ok()); });
+
+  // Sizes straddle the engine's receive buffers, so frames arrive split across completions.
+  constexpr int kMsgs = 200;
+  auto payload = [](int i) {
+    std::string s(static_cast<std::size_t>((i * 7919) % (duct::wire::kMaxFramePayload + 1)), 'a');
+    for (std::size_t k = 0; k < s.size(); k += 97) s[k] = static_cast<char>('a' + i % 26);
+    return s;
+  };
+  std::thread writer([&] {
+    for (int i = 0; i < kMsgs; ++i) EXPECT_TRUE(client.send(duct::Message::from_string(payload(i)), {}).ok());
+  });
+  for (int i = 0; i < kMsgs; ++i) {
+    auto m = client.recv({});
+    EXPECT_TRUE(m.ok());
+    if (!m.ok()) break;
+    std::string want = payload(i);
+    EXPECT_EQ(m.value().size(), want.size());
+    EXPECT_TRUE(m.value().as_string_view() == want);
+  }
+  writer.join();
+  EXPECT_EQ(echoed.load(), kMsgs);
+
+  // Sends from another thread wake the loop; reserve/commit goes through the engine as well.
+  auto span = server->reserve(5, {});
+  EXPECT_TRUE(span.ok());
+  if (span.ok()) {
+    std::memcpy(span.value().data(), "hello", 5);
+    EXPECT_TRUE(server->commit(5, {}).ok());
+    auto m = client.recv({});
+    EXPECT_TRUE(m.ok() && m.value().size() == 5 && std::memcmp(m.value().data(), "hello", 5) == 0);
+  }
+  EXPECT_EQ(server->recv({}).status().code(), duct::StatusCode::kNotSupported);
+
+  // Once removed (and the loop has flushed it) the pipe does its own I/O again.
+  reactor.remove(id.value());
+  EXPECT_TRUE(server->send(duct::Message::from_string("direct"), {}).ok());
+  EXPECT_TRUE(client.send(duct::Message::from_string("back"), {}).ok());
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  auto direct = server->recv({});
+  while (!direct.ok() && direct.status().code() == duct::StatusCode::kNotSupported &&
+         std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    direct = server->recv({});
+  }
+  EXPECT_TRUE(direct.ok() && direct.value().as_string_view() == "back");
+  auto reply = client.recv({});
+  EXPECT_TRUE(reply.ok() && reply.value().as_string_view() == "direct");
+
+  // A peer closing is reported through on_error.
+  EXPECT_TRUE(reactor.add(server, nullptr, [&](const duct::Status& st) {
+    EXPECT_EQ(st.code(), duct::StatusCode::kClosed);
+    ++errors;
+  }).ok());
+  client.close();
+  deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  while (errors.load() == 0 && std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  EXPECT_EQ(errors.load(), 1);
+  EXPECT_EQ(reactor.size(), static_cast<std::size_t>(0));
+
+  reactor.stop();
+  loop.join();
+  server->close();
+  lis_r.value()->close();
+}
+
+static void test_reactor_post() {
+  auto reactor_r = duct::Reactor::create();
+  EXPECT_TRUE(reactor_r.ok());
+  if (!reactor_r.ok()) return;
+  duct::Reactor& reactor = *reactor_r.value();
+  std::thread loop([&] { EXPECT_TRUE(reactor.run().ok()); });
+
+  // Tasks run on the loop thread, in order, and may post more.
+  std::promise<std::thread::id> ran_on;
+  std::vector<int> order;
+  reactor.post([&] { order.push_back(1); });
+  reactor.post([&] {
+    order.push_back(2);
+    reactor.post([&] {
+      order.push_back(3);
+      ran_on.set_value(std::this_thread::get_id());
+    });
+  });
+  auto fut = ran_on.get_future();
+  EXPECT_TRUE(fut.wait_for(std::chrono::seconds(5)) == std::future_status::ready);
+  EXPECT_TRUE(fut.get() == loop.get_id());
+  EXPECT_EQ(order.size(), static_cast<std::size_t>(3));
+  EXPECT_TRUE(order == std::vector<int>({1, 2, 3}));
+
+  // Timers run by deadline, not by posting order; a cancelled one never runs.
+  std::promise<void> timers_done;
+  std::vector<int> fired;
+  auto start = std::chrono::steady_clock::now();
+  reactor.post_after(std::chrono::milliseconds(30), [&] {
+    fired.push_back(30);
+    timers_done.set_value();
+  });
+  reactor.post_after(std::chrono::milliseconds(10), [&] { fired.push_back(10); });
+  auto dropped = reactor.post_after(std::chrono::milliseconds(20), [&] { fired.push_back(20); });
+  EXPECT_TRUE(reactor.cancel(dropped));
+  EXPECT_TRUE(!reactor.cancel(dropped));
+  auto timers_f = timers_done.get_future();
+  EXPECT_TRUE(timers_f.wait_for(std::chrono::seconds(5)) == std::future_status::ready);
+  EXPECT_TRUE(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(30));
+  EXPECT_TRUE(fired == std::vector<int>({10, 30}));
+
+  reactor.stop();
+  loop.join();
+}
+
+static duct::Task<int> coro_add(duct::Reactor& reactor, int a, int b) {
+  co_await duct::sleep_for(reactor, std::chrono::milliseconds(1));
+  co_return a + b;
+}
+
+// Echo each message twice, then stop at the peer's close.
+static duct::Task<void> coro_echo_twice(std::shared_ptr<duct::AsyncPipe> p, std::thread::id loop,
+                                        std::atomic<int>* off_loop, std::promise<duct::StatusCode>* done) {
+  for (;;) {
+    auto m = co_await p->recv();
+    if (std::this_thread::get_id() != loop) ++*off_loop;
+    if (!m.ok()) {
+      done->set_value(m.status().code());
+      co_return;
+    }
+    for (int i = 0; i < 2; ++i) EXPECT_TRUE((co_await p->send(m.value())).ok());
+  }
+}
+
+static void test_coroutines() {
+  auto reactor_r = duct::Reactor::create();
+  EXPECT_TRUE(reactor_r.ok());
+  if (!reactor_r.ok()) return;
+  duct::Reactor& reactor = *reactor_r.value();
+  std::thread loop([&] { EXPECT_TRUE(reactor.run().ok()); });
+
+  auto lis_r = duct::listen("tcp://127.0.0.1:0");
+  EXPECT_TRUE(lis_r.ok());
+  if (!lis_r.ok()) return;
+  auto addr = lis_r.value()->local_address();
+  EXPECT_TRUE(addr.ok());
+  if (!addr.ok()) return;
+  duct::DialOptions dopt;
+  dopt.qos.snd_hwm_bytes = 0;
+  dopt.qos.rcv_hwm_bytes = 0;
+
+  // Nested tasks hand back values; a dial from a coroutine resumes on the loop.
+  std::promise<int> sum;
+  std::promise<duct::Result<std::unique_ptr<duct::Pipe>>> dialed;
+  std::atomic<int> off_loop{0};
+  duct::spawn(reactor, [](duct::Reactor& r, std::string address, duct::DialOptions opt, std::thread::id loop_id,
+                          std::atomic<int>* off, std::promise<int>* out,
+                          std::promise<duct::Result<std::unique_ptr<duct::Pipe>>>* pipe_out) -> duct::Task<void> {
+    int v = co_await coro_add(r, 2, 3);
+    v += co_await coro_add(r, v, 10);
+    if (std::this_thread::get_id() != loop_id) ++*off;
+    out->set_value(v);
+    auto c = co_await duct::dial_async(r, address, opt);
+    if (std::this_thread::get_id() != loop_id) ++*off;
+    pipe_out->set_value(std::move(c));
+  }(reactor, addr.value(), dopt, loop.get_id(), &off_loop, &sum, &dialed));
+  auto sum_f = sum.get_future();
+  EXPECT_TRUE(sum_f.wait_for(std::chrono::seconds(5)) == std::future_status::ready);
+  EXPECT_EQ(sum_f.get(), 20);
+  auto dialed_f = dialed.get_future();
+  EXPECT_TRUE(dialed_f.wait_for(std::chrono::seconds(5)) == std::future_status::ready);
+  auto c = dialed_f.get();
+  EXPECT_TRUE(c.ok());
+  auto accepted = lis_r.value()->accept();
+  EXPECT_TRUE(accepted.ok());
+  if (!c.ok() || !accepted.ok()) return;
+  duct::Pipe& client = *c.value();
+
+  // A handler doing several operations per request needs no thread of its own.
+  auto ap = duct::AsyncPipe::open(reactor, std::shared_ptr<duct::Pipe>(std::move(accepted.value())));
+  EXPECT_TRUE(ap.ok());
+  if (!ap.ok()) return;
+  std::promise<duct::StatusCode> echo_done;
+  duct::spawn(reactor, coro_echo_twice(ap.value(), loop.get_id(), &off_loop, &echo_done));
+  duct::RecvOptions ropt;
+  ropt.timeout = std::chrono::seconds(5);
+  for (int i = 0; i < 20; ++i) {
+    const std::string text = "m" + std::to_string(i);
+    EXPECT_TRUE(client.send(duct::Message::from_string(text), {}).ok());
+    for (int k = 0; k < 2; ++k) {
+      auto back = client.recv(ropt);
+      EXPECT_TRUE(back.ok() && back.value().as_string_view() == text);
+    }
+  }
+  client.close();
+  auto echo_f = echo_done.get_future();
+  EXPECT_TRUE(echo_f.wait_for(std::chrono::seconds(5)) == std::future_status::ready);
+  EXPECT_EQ(echo_f.get(), duct::StatusCode::kClosed);
+  ap.value()->close();
+
+  // Timeouts and stop requests end one wait; the pipe stays usable.
+  auto c2 = duct::dial(addr.value(), dopt);
+  auto accepted2 = lis_r.value()->accept();
+  EXPECT_TRUE(c2.ok() && accepted2.ok());
+  if (!c2.ok() || !accepted2.ok()) return;
+  auto ap2 = duct::AsyncPipe::open(reactor, std::shared_ptr<duct::Pipe>(std::move(accepted2.value())));
+  EXPECT_TRUE(ap2.ok());
+  if (!ap2.ok()) return;
+  std::stop_source cancel;
+  std::promise<std::vector<duct::StatusCode>> waits;
+  duct::spawn(reactor, [](std::shared_ptr<duct::AsyncPipe> p, std::stop_token stop,
+                          std::promise<std::vector<duct::StatusCode>>* out) -> duct::Task<void> {
+    std::vector<duct::StatusCode> codes;
+    duct::RecvOptions short_wait;
+    short_wait.timeout = std::chrono::milliseconds(20);
+    codes.push_back((co_await p->recv(short_wait)).status().code());
+    codes.push_back((co_await p->recv({}, stop)).status().code());
+    auto m = co_await p->recv();
+    codes.push_back(m.ok() && m.value().as_string_view() == "late" ? duct::StatusCode::kOk
+                                                                    : duct::StatusCode::kProtocolError);
+    out->set_value(std::move(codes));
+  }(ap2.value(), cancel.get_token(), &waits));
+  std::this_thread::sleep_for(std::chrono::milliseconds(60));
+  cancel.request_stop();
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  EXPECT_TRUE(c2.value()->send(duct::Message::from_string("late"), {}).ok());
+  auto waits_f = waits.get_future();
+  EXPECT_TRUE(waits_f.wait_for(std::chrono::seconds(5)) == std::future_status::ready);
+  EXPECT_TRUE(waits_f.get() == std::vector<duct::StatusCode>(
+                                   {duct::StatusCode::kTimeout, duct::StatusCode::kCancelled, duct::StatusCode::kOk}));
+  EXPECT_EQ(off_loop.load(), 0);
+
+  // Closing wakes a pending recv with kClosed.
+  std::promise<duct::StatusCode> closed;
+  duct::spawn(reactor, [](std::shared_ptr<duct::AsyncPipe> p, std::promise<duct::StatusCode>* out) -> duct::Task<void> {
+    out->set_value((co_await p->recv()).status().code());
+  }(ap2.value(), &closed));
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  ap2.value()->close();
+  auto closed_f = closed.get_future();
+  EXPECT_TRUE(closed_f.wait_for(std::chrono::seconds(5)) == std::future_status::ready);
+  EXPECT_EQ(closed_f.get(), duct::StatusCode::kClosed);
+
+  reactor.stop();
+  loop.join();
+  lis_r.value()->close();
+}
+
+static void test_server_shards(bool reuse_port) {
+  constexpr std::size_t kShards = 2;
+  constexpr int kClients = 16;
+  std::mutex mu;
+  std::unordered_map<duct::Pipe*, std::size_t> owner;  // shard that opened each pipe
+  int wrong_shard = 0;
+  std::vector<duct::StatusCode> closes;
+
+  duct::Server::Handlers h;
+  h.on_open = [&](const std::shared_ptr<duct::Pipe>& p) {
+    std::lock_guard<std::mutex> lock(mu);
+    owner[p.get()] = duct::Server::current_shard();
+    if (duct::Server::current_shard() >= kShards) ++wrong_shard;
+  };
+  h.on_message = [&](const std::shared_ptr<duct::Pipe>& p, const duct::Message& m) {
+    {
+      std::lock_guard<std::mutex> lock(mu);
+      if (owner[p.get()] != duct::Server::current_shard()) ++wrong_shard;
+    }
+    EXPECT_TRUE(p->send(m, {}).ok());
+  };
+  h.on_close = [&](const std::shared_ptr<duct::Pipe>& p, const duct::Status& st) {
+    std::lock_guard<std::mutex> lock(mu);
+    if (owner[p.get()] != duct::Server::current_shard()) ++wrong_shard;
+    closes.push_back(st.code());
+  };
+  duct::ServerOptions opt;
+  opt.shards = kShards;
+  opt.reuse_port = reuse_port;
+  auto server_r = duct::Server::start("tcp://127.0.0.1:0", std::move(h), opt);
+#if !defined(SO_REUSEPORT)
+  if (reuse_port) {
+    EXPECT_EQ(server_r.status().code(), duct::StatusCode::kNotSupported);
+    return;
+  }
+#endif
+  EXPECT_TRUE(server_r.ok());
+  if (!server_r.ok()) return;
+  duct::Server& server = *server_r.value();
+  EXPECT_EQ(server.shard_count(), kShards);
+  EXPECT_EQ(duct::Server::current_shard(), duct::Server::kNoShard);
+
+  duct::DialOptions dopt;
+  dopt.qos.snd_hwm_bytes = 0;
+  dopt.qos.rcv_hwm_bytes = 0;
+  std::vector<std::unique_ptr<duct::Pipe>> clients;
+  for (int i = 0; i < kClients; ++i) {
+    auto c = duct::dial(server.address(), dopt);
+    EXPECT_TRUE(c.ok());
+    if (!c.ok()) return;
+    clients.push_back(std::move(c.value()));
+  }
+  duct::RecvOptions ropt;
+  ropt.timeout = std::chrono::seconds(5);
+  for (int round = 0; round < 3; ++round) {
+    for (int i = 0; i < kClients; ++i) {
+      const std::string text = "c" + std::to_string(i) + "r" + std::to_string(round);
+      EXPECT_TRUE(clients[i]->send(duct::Message::from_string(text), {}).ok());
+    }
+    for (int i = 0; i < kClients; ++i) {
+      auto back = clients[i]->recv(ropt);
+      EXPECT_TRUE(back.ok() && back.value().as_string_view() ==
+                                   "c" + std::to_string(i) + "r" + std::to_string(round));
+    }
+  }
+  EXPECT_EQ(server.connections(0) + server.connections(1), static_cast<std::size_t>(kClients));
+  if (!reuse_port) {
+    // The single acceptor deals connections out round-robin; with SO_REUSEPORT the kernel hashes.
+    EXPECT_EQ(server.connections(0), static_cast<std::size_t>(kClients / 2));
+    EXPECT_EQ(server.connections(1), static_cast<std::size_t>(kClients / 2));
+  }
+
+  // Peers closing are reported on the owning shard; stop() closes the rest.
+  for (int i = 0; i < kClients / 2; ++i) clients[i]->close();
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  while (server.connections(0) + server.connections(1) > static_cast<std::size_t>(kClients / 2) &&
+         std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  EXPECT_EQ(server.connections(0) + server.connections(1), static_cast<std::size_t>(kClients / 2));
+  server.stop();
+  EXPECT_EQ(server.connections(0) + server.connections(1), static_cast<std::size_t>(0));
+  for (int i = kClients / 2; i < kClients; ++i) {
+    auto r = clients[i]->recv(ropt);
+    EXPECT_EQ(r.status().code(), duct::StatusCode::kClosed);
+  }
+
+  std::lock_guard<std::mutex> lock(mu);
+  EXPECT_EQ(owner.size(), static_cast<std::size_t>(kClients));
+  EXPECT_EQ(wrong_shard, 0);
+  EXPECT_EQ(closes.size(), static_cast<std::size_t>(kClients));
+  for (auto code : closes) EXPECT_EQ(code, duct::StatusCode::kClosed);
+}
+
+// Two shards woken for one connection: one takes it, the other comes back empty instead of
+// sleeping in accept(), and a blocking accept() still works on the now non-blocking socket.
+static void test_tcp_try_accept() {
+  auto lis_r = duct::listen("tcp://127.0.0.1:0");
+  EXPECT_TRUE(lis_r.ok());
+  if (!lis_r.ok()) return;
+  auto& lis = *lis_r.value();
+  auto addr = lis.local_address();
+  EXPECT_TRUE(addr.ok());
+  if (!addr.ok()) return;
+
+  auto none = lis.try_accept();
+  EXPECT_TRUE(none.ok() && !none.value());
+  auto c = duct::dial(addr.value());
+  EXPECT_TRUE(c.ok());
+  std::unique_ptr<duct::Pipe> first;
+  const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  while (!first && std::chrono::steady_clock::now() < deadline) {
+    auto p = lis.try_accept();
+    EXPECT_TRUE(p.ok());
+    if (!p.ok()) return;
+    first = std::move(p.value());
+    if (!first) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  EXPECT_TRUE(first != nullptr);
+  const auto start = std::chrono::steady_clock::now();
+  auto second = lis.try_accept();
+  EXPECT_TRUE(second.ok() && !second.value());
+  EXPECT_TRUE(std::chrono::steady_clock::now() - start < std::chrono::seconds(1));
+
+  // The accepted pipe does blocking I/O as before.
+  if (c.ok() && first) {
+    EXPECT_TRUE(c.value()->send(duct::Message::from_string("hi"), {}).ok());
+    auto m = first->recv(duct::RecvOptions{std::chrono::milliseconds(5'000)});
+    EXPECT_TRUE(m.ok() && m.value().as_string_view() == "hi");
+  }
+
+  auto accepted = std::promise<duct::Result<std::unique_ptr<duct::Pipe>>>();
+  auto fut = accepted.get_future();
+  std::thread t([&] { accepted.set_value(lis.accept()); });
+  auto c2 = duct::dial(addr.value());
+  EXPECT_TRUE(c2.ok());
+  auto sr = fut.get();
+  t.join();
+  EXPECT_TRUE(sr.ok() && sr.value());
+
+  // accept() blocked on the non-blocking socket still wakes for close().
+  std::thread waiter([&] {
+    auto r = lis.accept();
+    EXPECT_EQ(r.status().code(), duct::StatusCode::kClosed);
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  lis.close();
+  waiter.join();
+}
+
+static void test_tcp_send_batch() {
+  auto lis_r = duct::listen("tcp://127.0.0.1:0");
+  EXPECT_TRUE(lis_r.ok());
+  if (!lis_r.ok()) return;
+  auto addr = lis_r.value()->local_address();
+  EXPECT_TRUE(addr.ok());
+  if (!addr.ok()) return;
+
+  auto accepted = std::promise<duct::Result<std::unique_ptr<duct::Pipe>>>();
+  auto fut = accepted.get_future();
+  std::thread t([&] { accepted.set_value(lis_r.value()->accept()); });
+
+  duct::DialOptions dial_opt;
+  dial_opt.qos.snd_hwm_bytes = 0;
+  dial_opt.qos.rcv_hwm_bytes = 0;
+  auto c = duct::dial(addr.value(), dial_opt);
+  EXPECT_TRUE(c.ok());
+  auto sr = fut.get();
+  t.join();
+  EXPECT_TRUE(sr.ok());
+  if (!c.ok() || !sr.ok()) return;
+
+  // More than one gathered write's worth of frames, including empty payloads.
+  constexpr int kCount = 300;
+  std::vector<duct::Message> out;
+  for (int i = 0; i < kCount; ++i) {
+    out.push_back(i % 7 == 0 ? duct::Message() : duct::Message::from_string(std::to_string(i)));
+  }
+
+  std::thread tx([&] {
+    auto n = c.value()->send_batch(out, {});
+    EXPECT_TRUE(n.ok());
+    if (n.ok()) EXPECT_EQ(n.value(), static_cast<std::size_t>(kCount));
+  });
+  for (int i = 0; i < kCount; ++i) {
+    auto m = sr.value()->recv({});
+    EXPECT_TRUE(m.ok());
+    if (!m.ok()) break;
+    EXPECT_EQ(std::string(m.value().as_string_view()), i % 7 == 0 ? std::string() : std::to_string(i));
+  }
+  tx.join();
+
+  lis_r.value()->close();
+}
+
+#if !defined(_WIN32)
+// Large messages go out as passed memfds (on Linux), in order with the small ones around them.
+static void test_uds_memfd_payloads() {
+  const std::string path = "/tmp/duct_test_uds_" + std::to_string(::getpid()) + ".sock";
+  duct::ListenOptions lopt;
+  lopt.uds.memfd_threshold = 64 * 1024;
+  auto lis_r = duct::listen("uds://" + path, lopt);
+  EXPECT_TRUE(lis_r.ok());
+  if (!lis_r.ok()) return;
+
+  auto accepted = std::promise<duct::Result<std::unique_ptr<duct::Pipe>>>();
+  auto fut = accepted.get_future();
+  std::thread t([&] { accepted.set_value(lis_r.value()->accept()); });
+
+  duct::DialOptions dial_opt;
+  dial_opt.qos.snd_hwm_bytes = 0;
+  dial_opt.qos.rcv_hwm_bytes = 0;
+  dial_opt.uds.memfd_threshold = 64 * 1024;
+  auto c = duct::dial("uds://" + path, dial_opt);
+  EXPECT_TRUE(c.ok());
+  auto sr = fut.get();
+  t.join();
+  EXPECT_TRUE(sr.ok());
+  if (!c.ok() || !sr.ok()) return;
+
+  auto pattern = [](std::size_t size, std::uint8_t seed) {
+    duct::Message m = duct::Message::allocate(size);
+    for (std::size_t i = 0; i < size; ++i) m.data()[i] = static_cast<std::uint8_t>(seed + i * 7);
+    return m;
+  };
+  std::vector<duct::Message> out;
+  out.push_back(duct::Message::from_string("head"));
+  out.push_back(pattern(3 * 1024 * 1024, 1));
+  out.push_back(pattern(64 * 1024, 2));
+  out.push_back(duct::Message::from_string("tail"));
+  out.push_back(pattern(100 * 1024, 3));
+
+  std::thread tx([&] {
+    auto n = c.value()->send_batch(out, {});
+    EXPECT_TRUE(n.ok());
+    if (n.ok()) EXPECT_EQ(n.value(), out.size());
+    // And back the other way, through send().
+    EXPECT_TRUE(sr.value()->send(out[1], {}).ok());
+  });
+  for (const duct::Message& want : out) {
+    const std::uint64_t copies = duct::wire::thread_io().copies;
+    auto m = sr.value()->recv({});
+    EXPECT_TRUE(m.ok());
+    if (!m.ok()) break;
+    EXPECT_EQ(m.value().size(), want.size());
+    EXPECT_TRUE(std::memcmp(m.value().data(), want.data(), want.size()) == 0);
+#if defined(__linux__)
+    // Mapped, not reassembled out of the socket.
+    if (want.size() >= lopt.uds.memfd_threshold) EXPECT_EQ(duct::wire::thread_io().copies, copies);
+#else
+    (void)copies;
+#endif
+  }
+  auto back = c.value()->recv({});
+  tx.join();
+  EXPECT_TRUE(back.ok());
+  if (back.ok()) {
+    EXPECT_EQ(back.value().size(), out[1].size());
+    EXPECT_TRUE(std::memcmp(back.value().data(), out[1].data(), out[1].size()) == 0);
+  }
+
+  lis_r.value()->close();
+}
+#endif
+
+// inproc:// hands the sender's message over as it is: same bytes, no copy.
+static void test_inproc_pipes() {
+  auto lis_r = duct::listen("inproc://test_bus");
+  EXPECT_TRUE(lis_r.ok());
+  if (!lis_r.ok()) return;
+  EXPECT_TRUE(!duct::listen("inproc://test_bus").ok());
+  EXPECT_TRUE(!duct::dial("inproc://nobody").ok());
+
+  duct::DialOptions raw;
+  raw.qos.snd_hwm_bytes = 0;
+  raw.qos.rcv_hwm_bytes = 0;
+  auto c = duct::dial("inproc://test_bus", raw);
+  EXPECT_TRUE(c.ok());
+  auto s = lis_r.value()->accept();
+  EXPECT_TRUE(s.ok());
+  if (!c.ok() || !s.ok()) return;
+
+  duct::Message big = duct::Message::allocate(256 * 1024);
+  std::memset(big.data(), 0x5a, big.size());
+  const std::uint64_t copies = duct::wire::thread_io().copies;
+  duct::SendOptions on3;
+  on3.channel = 3;
+  EXPECT_TRUE(c.value()->send(big, on3).ok());
+  auto got = s.value()->recv({});
+  EXPECT_TRUE(got.ok());
+  if (got.ok()) {
+    EXPECT_TRUE(got.value().data() == big.data());
+    EXPECT_EQ(got.value().channel(), 3);
+  }
+  EXPECT_EQ(duct::wire::thread_io().copies, copies);
+
+  // A message sent in parts arrives whole.
+  duct::SendOptions first;
+  first.more = true;
+  duct::SendOptions rest;
+  rest.continued = true;
+  EXPECT_TRUE(s.value()->send(duct::Message::from_string("par"), first).ok());
+  EXPECT_TRUE(s.value()->send(duct::Message::from_string("ts"), rest).ok());
+  auto joined = c.value()->recv({});
+  EXPECT_TRUE(joined.ok());
+  if (joined.ok()) EXPECT_EQ(std::string(joined.value().as_string_view()), "parts");
+
+  // Through the default QosPipe, from another thread.
+  auto q = duct::dial("inproc://test_bus");
+  EXPECT_TRUE(q.ok());
+  auto qs = lis_r.value()->accept();
+  EXPECT_TRUE(qs.ok());
+  if (!q.ok() || !qs.ok()) return;
+  constexpr int kCount = 1000;
+  std::thread tx([&] {
+    for (int i = 0; i < kCount; ++i) EXPECT_TRUE(q.value()->send(duct::Message::from_string(std::to_string(i)), {}).ok());
+  });
+  for (int i = 0; i < kCount; ++i) {
+    auto m = qs.value()->recv({});
+    EXPECT_TRUE(m.ok());
+    if (!m.ok()) break;
+    EXPECT_EQ(std::string(m.value().as_string_view()), std::to_string(i));
+  }
+  tx.join();
+
+  // Queued messages are still delivered after the sender closes, then kClosed.
+  EXPECT_TRUE(c.value()->send(duct::Message::from_string("last"), {}).ok());
+  c.value()->close();
+  auto last = s.value()->recv({});
+  EXPECT_TRUE(last.ok());
+  auto end = s.value()->recv({});
+  EXPECT_TRUE(!end.ok() && end.status().code() == duct::StatusCode::kClosed);
+  lis_r.value()->close();
+}
+
+static void test_qos_pipe_send_queue() {
+  auto lis_r = duct::listen("tcp://127.0.0.1:0");
+  EXPECT_TRUE(lis_r.ok());
+  if (!lis_r.ok()) return;
+  auto addr = lis_r.value()->local_address();
+  EXPECT_TRUE(addr.ok());
+  if (!addr.ok()) return;
+
+  auto accepted = std::promise<duct::Result<std::unique_ptr<duct::Pipe>>>();
+  auto fut = accepted.get_future();
+  std::thread t([&] { accepted.set_value(lis_r.value()->accept()); });
+  duct::DialOptions dial_opt;
+  dial_opt.qos.snd_hwm_bytes = 64 * 1024;
+  auto c = duct::dial(addr.value(), dial_opt);
+  EXPECT_TRUE(c.ok());
+  auto sr = fut.get();
+  t.join();
+  EXPECT_TRUE(sr.ok());
+  if (!c.ok() || !sr.ok()) return;
+
+  const std::string pad(1024, 'q');
+  auto msg = [&](int i) { return duct::Message::from_string(std::to_string(i) + ":" + pad); };
+
+  // The peer does not read: once the socket and then the queue fill, a timed send gives up.
+  duct::SendOptions timed;
+  timed.timeout = std::chrono::milliseconds(50);
+  int queued = 0;
+  auto last = duct::StatusCode::kOk;
+  for (; queued < 64 * 1024; ++queued) {
+    auto st = c.value()->send(msg(queued), timed);
+    if (!st.ok()) {
+      last = st.status().code();
+      break;
+    }
+  }
+  EXPECT_EQ(last, duct::StatusCode::kTimeout);
+
+  // A send without a timeout waits for the worker to drain below the HWM instead of failing.
+  constexpr int kMore = 1000;
+  std::thread tx([&] {
+    for (int i = queued; i < queued + kMore; ++i) EXPECT_TRUE(c.value()->send(msg(i), {}).ok());
+  });
+  for (int i = 0; i < queued + kMore; ++i) {
+    auto m = sr.value()->recv({});
+    EXPECT_TRUE(m.ok());
+    if (!m.ok()) break;
+    std::string_view v = m.value().as_string_view();
+    if (v.substr(0, v.find(':')) != std::to_string(i)) {
+      EXPECT_TRUE(false);
+      break;
+    }
+  }
+  tx.join();
+
+  c.value()->close();
+  lis_r.value()->close();
+}
+
+static void test_qos_pipe_channels() {
+  auto lis_r = duct::listen("tcp://127.0.0.1:0");
+  EXPECT_TRUE(lis_r.ok());
+  if (!lis_r.ok()) return;
+  auto addr = lis_r.value()->local_address();
+  EXPECT_TRUE(addr.ok());
+  if (!addr.ok()) return;
+
+  auto accepted = std::promise<duct::Result<std::unique_ptr<duct::Pipe>>>();
+  auto fut = accepted.get_future();
+  std::thread t([&] { accepted.set_value(lis_r.value()->accept()); });
+  duct::DialOptions dial_opt;
+  dial_opt.qos.snd_hwm_bytes = 64 * 1024 * 1024;
+  dial_opt.qos.channel_weights = {{2, 4}};
+  auto c = duct::dial(addr.value(), dial_opt);
+  EXPECT_TRUE(c.ok());
+  auto sr = fut.get();
+  t.join();
+  EXPECT_TRUE(sr.ok());
+  if (!c.ok() || !sr.ok()) return;
+
+  // A bulk transfer is queued on channel 1 while the peer is not reading; what is queued next on
+  // channel 2 goes out on the following turn instead of behind the whole transfer.
+  constexpr int kBulk = 512;
+  const std::string chunk(64 * 1024, 'b');
+  duct::SendOptions bulk;
+  bulk.channel = 1;
+  for (int i = 0; i < kBulk; ++i) EXPECT_TRUE(c.value()->send(duct::Message::from_string(chunk), bulk).ok());
+  duct::SendOptions urgent;
+  urgent.channel = 2;
+  for (int i = 0; i < 3; ++i) EXPECT_TRUE(c.value()->send(duct::Message::from_string("u" + std::to_string(i)), urgent).ok());
+
+  int bulk_seen = 0;
+  int urgent_seen = 0;
+  int bulk_before_urgent = -1;
+  while (bulk_seen < kBulk || urgent_seen < 3) {
+    auto m = sr.value()->recv({});
+    EXPECT_TRUE(m.ok());
+    if (!m.ok()) break;
+    if (m.value().channel() == 1) {
+      EXPECT_EQ(m.value().size(), chunk.size());
+      ++bulk_seen;
+      continue;
+    }
+    EXPECT_EQ(m.value().channel(), 2);
+    EXPECT_EQ(std::string(m.value().as_string_view()), "u" + std::to_string(urgent_seen));
+    if (urgent_seen++ == 0) bulk_before_urgent = bulk_seen;
+  }
+  EXPECT_TRUE(bulk_before_urgent >= 0 && bulk_before_urgent < kBulk);
+
+  c.value()->close();
+  lis_r.value()->close();
+}
+
+static void test_qos_pipe_fragment_interleave() {
+  auto lis_r = duct::listen("tcp://127.0.0.1:0");
+  EXPECT_TRUE(lis_r.ok());
+  if (!lis_r.ok()) return;
+  auto addr = lis_r.value()->local_address();
+  EXPECT_TRUE(addr.ok());
+  if (!addr.ok()) return;
+
+  auto accepted = std::promise<duct::Result<std::unique_ptr<duct::Pipe>>>();
+  auto fut = accepted.get_future();
+  std::thread t([&] { accepted.set_value(lis_r.value()->accept()); });
+  duct::DialOptions dial_opt;
+  dial_opt.qos.snd_hwm_bytes = 64 * 1024 * 1024;
+  auto c = duct::dial(addr.value(), dial_opt);
+  EXPECT_TRUE(c.ok());
+  auto sr = fut.get();
+  t.join();
+  EXPECT_TRUE(sr.ok());
+  if (!c.ok() || !sr.ok()) return;
+
+  // Multi-megabyte messages on channel 1 are written a quantum at a time, so a small message on
+  // channel 2 overtakes the ones queued ahead of it and each large one still arrives whole.
+  constexpr int kBulk = 8;
+  auto big = [](int i) { return std::string(4 << 20, static_cast<char>('A' + i)); };
+  duct::SendOptions bulk;
+  bulk.channel = 1;
+  for (int i = 0; i < kBulk; ++i) EXPECT_TRUE(c.value()->send(duct::Message::from_string(big(i)), bulk).ok());
+  duct::SendOptions urgent;
+  urgent.channel = 2;
+  EXPECT_TRUE(c.value()->send(duct::Message::from_string("urgent"), urgent).ok());
+
+  int bulk_seen = 0;
+  int bulk_before_urgent = -1;
+  while (bulk_seen < kBulk || bulk_before_urgent < 0) {
+    auto m = sr.value()->recv({});
+    EXPECT_TRUE(m.ok());
+    if (!m.ok()) break;
+    if (m.value().channel() == 2) {
+      EXPECT_EQ(std::string(m.value().as_string_view()), "urgent");
+      bulk_before_urgent = bulk_seen;
+      continue;
+    }
+    EXPECT_EQ(m.value().channel(), 1);
+    EXPECT_TRUE(m.value().as_string_view() == big(bulk_seen));
+    ++bulk_seen;
+  }
+  EXPECT_TRUE(bulk_before_urgent >= 0 && bulk_before_urgent < kBulk - 1);
+
+  c.value()->close();
+  lis_r.value()->close();
+}
+
+static void test_token_bucket() {
+  using namespace std::chrono_literals;
+  const auto t0 = duct::TokenBucket::Clock::now();
+
+  // Starts full; once the burst is spent, tokens come back at the rate.
+  duct::TokenBucket b(1000, 100);
+  EXPECT_EQ(b.try_acquire(100, t0).count(), 0);
+  EXPECT_EQ(b.try_acquire(1, t0), std::chrono::nanoseconds(1ms));
+  EXPECT_EQ(b.try_acquire(1, t0 + 1ms).count(), 0);
+  b.refund(1);
+  EXPECT_EQ(b.try_acquire(1, t0 + 1ms).count(), 0);
+
+  // More than the burst passes on a full bucket and the debt delays the next caller.
+  duct::TokenBucket big(1000, 10);
+  EXPECT_EQ(big.try_acquire(50, t0).count(), 0);
+  EXPECT_EQ(big.try_acquire(1, t0), std::chrono::nanoseconds(41ms));
+
+  EXPECT_TRUE(duct::TokenBucket(0, 0).unlimited());
+  EXPECT_EQ(duct::TokenBucket(0, 0).try_acquire(1 << 30, t0).count(), 0);
+
+  // Both dimensions must admit a message; a refused one takes nothing from either.
+  duct::RateLimit limit;
+  limit.bytes_per_sec = 1000;
+  limit.msgs_per_sec = 10;
+  limit.burst_msgs = 2;
+  duct::RateLimiter r(limit);
+  EXPECT_EQ(r.try_acquire(10, t0).count(), 0);
+  EXPECT_EQ(r.try_acquire(10, t0).count(), 0);
+  EXPECT_EQ(r.try_acquire(10, t0), std::chrono::nanoseconds(100ms));
+  EXPECT_EQ(r.try_acquire(980, t0 + 100ms).count(), 0);
+}
+
+static void test_qos_pipe_rate_limit() {
+  auto lis_r = duct::listen("tcp://127.0.0.1:0");
+  EXPECT_TRUE(lis_r.ok());
+  if (!lis_r.ok()) return;
+  auto addr = lis_r.value()->local_address();
+  EXPECT_TRUE(addr.ok());
+  if (!addr.ok()) return;
+  auto connect = [&](const duct::QosOptions& qos) {
+    auto accepted = std::promise<duct::Result<std::unique_ptr<duct::Pipe>>>();
+    auto fut = accepted.get_future();
+    std::thread t([&] { accepted.set_value(lis_r.value()->accept()); });
+    duct::DialOptions opt;
+    opt.qos = qos;
+    auto c = duct::dial(addr.value(), opt);
+    auto s = fut.get();
+    t.join();
+    EXPECT_TRUE(c.ok() && s.ok());
+    std::pair<std::unique_ptr<duct::Pipe>, std::unique_ptr<duct::Pipe>> out;
+    if (c.ok() && s.ok()) out = {std::move(c.value()), std::move(s.value())};
+    return out;
+  };
+  const auto msg = duct::Message::from_string(std::string(1000, 'r'));
+
+  // Over a channel's rate, kFailFast fails like a full queue; other channels are not affected.
+  {
+    duct::QosOptions qos;
+    qos.backpressure = duct::BackpressurePolicy::kFailFast;
+    qos.channel_rates = {{1, duct::RateLimit{0, 0, 1, 5}}};
+    auto [c, s] = connect(qos);
+    if (!c) return;
+    duct::SendOptions limited;
+    limited.channel = 1;
+    for (int i = 0; i < 5; ++i) EXPECT_TRUE(c->send(msg, limited).ok());
+    auto st = c->send(msg, limited);
+    EXPECT_EQ(st.status().code(), duct::StatusCode::kIoError);
+    for (int i = 0; i < 20; ++i) EXPECT_TRUE(c->send(msg, {}).ok());
+    for (int i = 0; i < 25; ++i) EXPECT_TRUE(s->recv({}).ok());
+    c->close();
+  }
+
+  // kBlock paces the sender at the byte rate once the burst is spent, and a timeout shorter than
+  // the refill gives up at once.
+  {
+    duct::QosOptions qos;
+    qos.rate.bytes_per_sec = 100 * 1000;
+    qos.rate.burst_bytes = 10 * 1000;
+    auto [c, s] = connect(qos);
+    if (!c) return;
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < 30; ++i) EXPECT_TRUE(c->send(msg, {}).ok());
+    EXPECT_TRUE(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(150));
+    duct::SendOptions timed;
+    timed.timeout = std::chrono::milliseconds(1);
+    for (int i = 0; i < 3; ++i) (void)c->send(msg, timed);
+    EXPECT_EQ(c->send(msg, timed).status().code(), duct::StatusCode::kTimeout);
+    c->close();
+  }
+
+  lis_r.value()->close();
+}
+
+static void test_qos_pipe_recv_queue() {
+  auto lis_r = duct::listen("tcp://127.0.0.1:0");
+  EXPECT_TRUE(lis_r.ok());
+  if (!lis_r.ok()) return;
+  auto addr = lis_r.value()->local_address();
+  EXPECT_TRUE(addr.ok());
+  if (!addr.ok()) return;
+  auto connect = [&](const duct::QosOptions& qos) {
+    auto accepted = std::promise<duct::Result<std::unique_ptr<duct::Pipe>>>();
+    auto fut = accepted.get_future();
+    std::thread t([&] { accepted.set_value(lis_r.value()->accept()); });
+    duct::DialOptions opt;
+    opt.qos = qos;
+    auto c = duct::dial(addr.value(), opt);
+    auto s = fut.get();
+    t.join();
+    EXPECT_TRUE(c.ok() && s.ok());
+    std::pair<std::unique_ptr<duct::Pipe>, std::unique_ptr<duct::Pipe>> out;
+    if (c.ok() && s.ok()) out = {std::move(c.value()), std::move(s.value())};
+    return out;
+  };
+
+  // Read-ahead is bounded by rcv_hwm_bytes, yet a long stream arrives complete and in order.
+  {
+    duct::QosOptions qos;
+    qos.rcv_hwm_bytes = 16 * 1024;
+    auto [c, s] = connect(qos);
+    if (!c || !s) return;
+    constexpr int kCount = 2000;
+    const std::string pad(1000, 'r');
+    std::thread tx([&] {
+      for (int i = 0; i < kCount; ++i) EXPECT_TRUE(s->send(duct::Message::from_string(std::to_string(i) + pad), {}).ok());
+    });
+    std::vector<duct::Message> batch(16);
+    int got = 0;
+    while (got < kCount) {
+      auto n = c->recv_batch(batch, {});
+      EXPECT_TRUE(n.ok());
+      if (!n.ok()) break;
+      for (std::size_t i = 0; i < n.value(); ++i, ++got) {
+        EXPECT_TRUE(batch[i].as_string_view() == std::to_string(got) + pad);
+      }
+    }
+    tx.join();
+
+    // The peer's close is reported after what it sent before.
+    EXPECT_TRUE(s->send(duct::Message::from_string("last"), {}).ok());
+    s->close();
+    auto last = c->recv({});
+    EXPECT_TRUE(last.ok() && last.value().as_string_view() == "last");
+    EXPECT_EQ(c->recv({}).status().code(), duct::StatusCode::kClosed);
+  }
+
+  // Messages that sat in the receive queue longer than the TTL are dropped on dequeue.
+  {
+    duct::QosOptions qos;
+    qos.ttl = std::chrono::milliseconds(50);
+    auto [c, s] = connect(qos);
+    if (!c || !s) return;
+    duct::RecvOptions quick;
+    quick.timeout = std::chrono::milliseconds(20);
+    EXPECT_EQ(c->recv(quick).status().code(), duct::StatusCode::kTimeout);  // starts the read-ahead
+    for (int i = 0; i < 5; ++i) EXPECT_TRUE(s->send(duct::Message::from_string("stale"), {}).ok());
+    std::this_thread::sleep_for(std::chrono::milliseconds(150));
+    EXPECT_TRUE(s->send(duct::Message::from_string("fresh"), {}).ok());
+    auto m = c->recv({});
+    EXPECT_TRUE(m.ok() && m.value().as_string_view() == "fresh");
+
+    // Closing wakes a blocked receiver.
+    std::thread closer([&] {
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+      c->close();
+    });
+    EXPECT_EQ(c->recv({}).status().code(), duct::StatusCode::kClosed);
+    closer.join();
+  }
+
+  lis_r.value()->close();
+}
+
+// A link whose every write times out, as one to a peer that stopped reading would.
+class TimingOutPipe final : public duct::Pipe {
+ public:
+  duct::Result<void> send(const duct::Message&, const duct::SendOptions&) override {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    return duct::Status::timeout("write timed out");
+  }
+  duct::Result<duct::Message> recv(const duct::RecvOptions&) override {
+    return duct::Status::timeout("recv timeout");
+  }
+  void close() override {}
+};
+
+static void test_qos_pipe_background() {
+  auto lis_r = duct::listen("tcp://127.0.0.1:0");
+  EXPECT_TRUE(lis_r.ok());
+  if (!lis_r.ok()) return;
+  auto addr = lis_r.value()->local_address();
+  EXPECT_TRUE(addr.ok());
+  if (!addr.ok()) return;
+  auto connect = [&](const duct::QosOptions& qos) {
+    auto accepted = std::promise<duct::Result<std::unique_ptr<duct::Pipe>>>();
+    auto fut = accepted.get_future();
+    std::thread t([&] { accepted.set_value(lis_r.value()->accept()); });
+    duct::DialOptions opt;
+    opt.qos = qos;
+    auto c = duct::dial(addr.value(), opt);
+    auto s = fut.get();
+    t.join();
+    EXPECT_TRUE(c.ok() && s.ok());
+    std::pair<std::unique_ptr<duct::Pipe>, std::unique_ptr<duct::Pipe>> out;
+    if (c.ok() && s.ok()) out = {std::move(c.value()), std::move(s.value())};
+    return out;
+  };
+
+  // Many pipes share the scheduler's workers, and each still delivers everything in order.
+  {
+    constexpr int kPipes = 100;
+    constexpr int kCount = 200;
+    std::vector<std::pair<std::unique_ptr<duct::Pipe>, std::unique_ptr<duct::Pipe>>> pairs;
+    for (int i = 0; i < kPipes; ++i) {
+      pairs.push_back(connect({}));
+      if (!pairs.back().first) return;
+    }
+    for (int n = 0; n < kCount; ++n) {
+      for (auto& [c, s] : pairs) EXPECT_TRUE(c->send(duct::Message::from_string(std::to_string(n)), {}).ok());
+    }
+    for (auto& [c, s] : pairs) {
+      for (int n = 0; n < kCount; ++n) {
+        auto m = s->recv({});
+        EXPECT_TRUE(m.ok() && m.value().as_string_view() == std::to_string(n));
+        if (!m.ok()) break;
+      }
+    }
+  }
+
+  // Queued messages expire on the TTL timer even while the write is stuck on a peer that does
+  // not read, freeing room under the HWM. A small quantum keeps most of them queued rather than in
+  // the stuck write.
+  {
+    duct::QosOptions qos;
+    qos.snd_hwm_bytes = 64 * 1024;
+    qos.channel_quantum_bytes = 4 * 1024;
+    qos.ttl = std::chrono::milliseconds(50);
+    auto [c, s] = connect(qos);
+    if (!c || !s) return;
+    const auto pad = duct::Message::from_string(std::string(1024, 't'));
+    duct::SendOptions timed;
+    timed.timeout = std::chrono::milliseconds(20);
+    auto last = duct::StatusCode::kOk;
+    for (int i = 0; i < 64 * 1024; ++i) {
+      auto st = c->send(pad, timed);
+      if (!st.ok()) {
+        last = st.status().code();
+        break;
+      }
+    }
+    EXPECT_EQ(last, duct::StatusCode::kTimeout);
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    for (int i = 0; i < 16; ++i) EXPECT_TRUE(c->send(pad, timed).ok());
+
+    // The peer going away fails the stuck write, which later sends report.
+    s.reset();
+    auto code = duct::StatusCode::kOk;
+    for (int i = 0; i < 500 && (code == duct::StatusCode::kOk || code == duct::StatusCode::kTimeout); ++i) {
+      auto st = c->send(pad, timed);
+      code = st.ok() ? duct::StatusCode::kOk : st.status().code();
+    }
+    EXPECT_TRUE(code != duct::StatusCode::kOk && code != duct::StatusCode::kTimeout);
+  }
+
+  // With a linger time, close() writes out what is queued first; sends after it fail.
+  {
+    duct::QosOptions qos;
+    qos.linger = std::chrono::seconds(5);
+    auto [c, s] = connect(qos);
+    if (!c || !s) return;
+    constexpr int kCount = 500;
+    for (int n = 0; n < kCount; ++n) EXPECT_TRUE(c->send(duct::Message::from_string(std::to_string(n)), {}).ok());
+    c->close();
+    EXPECT_EQ(c->send(duct::Message::from_string("late"), {}).status().code(), duct::StatusCode::kClosed);
+    for (int n = 0; n < kCount; ++n) {
+      auto m = s->recv({});
+      EXPECT_TRUE(m.ok() && m.value().as_string_view() == std::to_string(n));
+      if (!m.ok()) break;
+    }
+    EXPECT_EQ(s->recv({}).status().code(), duct::StatusCode::kClosed);
+  }
+
+  // Writes that keep timing out are retried only until close(): with or without a linger time it
+  // returns, and the drain job lets go of its worker.
+  for (auto linger : {std::chrono::milliseconds(0), std::chrono::milliseconds(100)}) {
+    duct::QosOptions qos;
+    qos.linger = linger;
+    auto q = std::make_unique<duct::QosPipe>(std::make_unique<TimingOutPipe>(), qos);
+    EXPECT_TRUE(q->send(duct::Message::from_string("stuck"), {}).ok());
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    const auto start = std::chrono::steady_clock::now();
+    q->close();
+    q.reset();
+    EXPECT_TRUE(std::chrono::steady_clock::now() - start < std::chrono::seconds(2));
+  }
+
+  lis_r.value()->close();
+}
+
+static void test_qos_pipe_flush_policy() {
+  auto lis_r = duct::listen("tcp://127.0.0.1:0");
+  EXPECT_TRUE(lis_r.ok());
+  if (!lis_r.ok()) return;
+  auto addr = lis_r.value()->local_address();
+  EXPECT_TRUE(addr.ok());
+  if (!addr.ok()) return;
+
+  auto connect = [&](std::chrono::microseconds delay) {
+    auto accepted = std::promise<duct::Result<std::unique_ptr<duct::Pipe>>>();
+    auto fut = accepted.get_future();
+    std::thread t([&] { accepted.set_value(lis_r.value()->accept()); });
+    duct::DialOptions dial_opt;
+    dial_opt.qos.flush.min_bytes = 4 * 1024;
+    dial_opt.qos.flush.max_delay = delay;
+    auto c = duct::dial(addr.value(), dial_opt);
+    auto s = fut.get();
+    t.join();
+    return std::make_pair(std::move(c), std::move(s));
+  };
+  duct::RecvOptions ropt;
+  ropt.timeout = std::chrono::seconds(2);
+
+  {
+    // A lone small message waits out the delay.
+    auto [c, s] = connect(std::chrono::milliseconds(20));
+    EXPECT_TRUE(c.ok() && s.ok());
+    if (!c.ok() || !s.ok()) return;
+    const auto start = std::chrono::steady_clock::now();
+    EXPECT_TRUE(c.value()->send(duct::Message::from_string("small"), {}).ok());
+    auto m = s.value()->recv(ropt);
+    EXPECT_TRUE(m.ok());
+    EXPECT_TRUE(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(15));
+    c.value()->close();
+  }
+  {
+    // flush() and the byte threshold both cut a long delay short.
+    auto [c, s] = connect(std::chrono::seconds(5));
+    EXPECT_TRUE(c.ok() && s.ok());
+    if (!c.ok() || !s.ok()) return;
+    auto start = std::chrono::steady_clock::now();
+    EXPECT_TRUE(c.value()->send(duct::Message::from_string("flushed"), {}).ok());
+    EXPECT_TRUE(c.value()->flush().ok());
+    auto m = s.value()->recv(ropt);
+    EXPECT_TRUE(m.ok());
+    if (m.ok()) EXPECT_EQ(m.value().as_string_view(), std::string_view("flushed"));
+    EXPECT_TRUE(std::chrono::steady_clock::now() - start < std::chrono::seconds(1));
+
+    start = std::chrono::steady_clock::now();
+    const std::string pad(1024, 'f');
+    for (int i = 0; i < 8; ++i) EXPECT_TRUE(c.value()->send(duct::Message::from_string(pad), {}).ok());
+    for (int i = 0; i < 8; ++i) EXPECT_TRUE(s.value()->recv(ropt).ok());
+    EXPECT_TRUE(std::chrono::steady_clock::now() - start < std::chrono::seconds(1));
+    c.value()->close();
+  }
+  lis_r.value()->close();
+}
+
+static void test_pipe_metrics() {
+  duct::ListenOptions lopt;
+  lopt.metrics.enabled = true;
+  lopt.metrics.prefix = "test.accepted";
+  auto lis_r = duct::listen("tcp://127.0.0.1:0", lopt);
+  EXPECT_TRUE(lis_r.ok());
+  if (!lis_r.ok()) return;
+  auto addr = lis_r.value()->local_address();
+  EXPECT_TRUE(addr.ok());
+  if (!addr.ok()) return;
+
+  auto& registry = duct::MetricRegistry::instance();
+  auto value = [&](const char* name) { return registry.get_counter(name)->value(); };
+  duct::RecvOptions ropt;
+  ropt.timeout = std::chrono::seconds(2);
+
+  {
+    auto accepted = std::promise<duct::Result<std::unique_ptr<duct::Pipe>>>();
+    auto fut = accepted.get_future();
+    std::thread t([&] { accepted.set_value(lis_r.value()->accept()); });
+    duct::DialOptions dial_opt;
+    dial_opt.metrics.enabled = true;
+    dial_opt.metrics.prefix = "test.dialed";
+    auto c = duct::dial(addr.value(), dial_opt);
+    auto s = fut.get();
+    t.join();
+    EXPECT_TRUE(c.ok() && s.ok());
+    if (!c.ok() || !s.ok()) return;
+
+    constexpr int kN = 50;
+    for (int i = 0; i < kN; ++i) EXPECT_TRUE(c.value()->send(duct::Message::from_string("0123456789"), {}).ok());
+    for (int i = 0; i < kN; ++i) EXPECT_TRUE(s.value()->recv(ropt).ok());
+    // The drain records a batch just after writing it, so possibly after the peer has it.
+    auto latency = registry.get_histogram("test.dialed.send_latency_us");
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+    while (latency->count() < std::size_t{kN} && std::chrono::steady_clock::now() < deadline) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    EXPECT_EQ(value("test.dialed.send_msgs"), double(kN));
+    EXPECT_EQ(value("test.dialed.send_bytes"), double(kN * 10));
+    EXPECT_EQ(value("test.accepted.recv_msgs"), double(kN));
+    EXPECT_EQ(value("test.accepted.recv_bytes"), double(kN * 10));
+    EXPECT_TRUE(value("test.dialed.write_syscalls") > 0);
+    EXPECT_TRUE(value("test.accepted.read_syscalls") > 0);
+    // Every message was written, so the queue is empty and each has a latency.
+    EXPECT_EQ(latency->count(), std::size_t{kN});
+    EXPECT_EQ(registry.get_gauge("test.dialed.send_queue_msgs")->value(), 0.0);
+    EXPECT_EQ(registry.get_gauge("test.dialed.send_queue_bytes")->value(), 0.0);
+    c.value()->close();
+  }
+  {
+    // Refused sends count by policy; nothing is left queued once the pipe goes away.
+    auto accepted = std::promise<duct::Result<std::unique_ptr<duct::Pipe>>>();
+    auto fut = accepted.get_future();
+    std::thread t([&] { accepted.set_value(lis_r.value()->accept()); });
+    duct::DialOptions dial_opt;
+    dial_opt.metrics.enabled = true;
+    dial_opt.metrics.prefix = "test.fail_fast";
+    dial_opt.qos.snd_hwm_bytes = 64;
+    dial_opt.qos.backpressure = duct::BackpressurePolicy::kFailFast;
+    dial_opt.qos.flush.max_delay = std::chrono::seconds(5);  // hold the queue
+    dial_opt.qos.flush.min_bytes = 1024;
+    auto c = duct::dial(addr.value(), dial_opt);
+    auto s = fut.get();
+    t.join();
+    EXPECT_TRUE(c.ok() && s.ok());
+    if (!c.ok() || !s.ok()) return;
+    int refused = 0;
+    for (int i = 0; i < 10; ++i) {
+      if (!c.value()->send(duct::Message::from_string("0123456789abcdef"), {}).ok()) ++refused;
+    }
+    EXPECT_TRUE(refused > 0);
+    EXPECT_EQ(value("test.fail_fast.hwm_fail_fast"), double(refused));
+    EXPECT_EQ(registry.get_gauge("test.fail_fast.send_queue_msgs")->value(), double(10 - refused));
+    c.value().reset();
+    EXPECT_EQ(registry.get_gauge("test.fail_fast.send_queue_msgs")->value(), 0.0);
+    EXPECT_EQ(registry.get_gauge("test.fail_fast.send_queue_bytes")->value(), 0.0);
+  }
+  lis_r.value()->close();
+}
+
+static void test_pipe_tracing() {
+  for (const char* address : {"tcp://127.0.0.1:0", "shm://duct_testtrace"}) {
+    std::mutex mu;
+    std::vector<duct::TraceSample> samples;
+    duct::ListenOptions lopt;
+    lopt.metrics.enabled = true;
+    lopt.metrics.prefix = std::string("test.trace_rx.") + address;
+    lopt.metrics.on_trace = [&](const duct::TraceSample& t) {
+      std::lock_guard<std::mutex> lock(mu);
+      samples.push_back(t);
+    };
+    auto lis_r = duct::listen(address, lopt);
+    EXPECT_TRUE(lis_r.ok());
+    if (!lis_r.ok()) return;
+    auto addr = lis_r.value()->local_address();
+    EXPECT_TRUE(addr.ok());
+    if (!addr.ok()) return;
+
+    auto accepted = std::promise<duct::Result<std::unique_ptr<duct::Pipe>>>();
+    auto fut = accepted.get_future();
+    std::thread t([&] { accepted.set_value(lis_r.value()->accept()); });
+    duct::DialOptions dial_opt;
+    dial_opt.compact_frames = true;
+    dial_opt.metrics.enabled = true;
+    dial_opt.metrics.prefix = "test.trace_tx";
+    dial_opt.metrics.trace_every = 4;
+    auto c = duct::dial(addr.value(), dial_opt);
+    auto s = fut.get();
+    t.join();
+    EXPECT_TRUE(c.ok() && s.ok());
+    if (!c.ok() || !s.ok()) return;
+
+    // Inline-sized, pooled and fragmented messages on two channels, every fourth one traced: the
+    // receiver gets them all unchanged.
+    constexpr int kN = 24;
+    auto body = [](int i) { return std::string(i == 8 ? 100000 : (i * 37) % 200, static_cast<char>('a' + i)); };
+    for (int i = 0; i < kN; ++i) {
+      duct::SendOptions sopt;
+      sopt.channel = static_cast<std::uint16_t>(i % 2);
+      EXPECT_TRUE(c.value()->send(duct::Message::from_string(body(i)), sopt).ok());
+    }
+    duct::RecvOptions ropt;
+    ropt.timeout = std::chrono::seconds(2);
+    std::vector<std::string> got[2];
+    for (int i = 0; i < kN; ++i) {
+      auto m = s.value()->recv(ropt);
+      EXPECT_TRUE(m.ok());
+      if (!m.ok()) break;
+      EXPECT_TRUE(!m.value().traced());
+      got[m.value().channel()].emplace_back(m.value().as_string_view());
+    }
+    for (int i = 0; i < kN; ++i) {
+      const auto& on = got[i % 2];
+      if (static_cast<std::size_t>(i / 2) < on.size()) EXPECT_TRUE(on[i / 2] == body(i));
+    }
+    {
+      std::lock_guard<std::mutex> lock(mu);
+      EXPECT_EQ(samples.size(), std::size_t{kN / 4});
+      for (std::size_t i = 1; i < samples.size(); ++i) EXPECT_TRUE(samples[i].id != samples[0].id);
+    }
+    auto& registry = duct::MetricRegistry::instance();
+    EXPECT_EQ(registry.get_histogram(lopt.metrics.prefix + ".trace_transit_us")->count(), std::size_t{kN / 4});
+    EXPECT_EQ(registry.get_histogram(lopt.metrics.prefix + ".trace_queue_us")->count(), std::size_t{kN / 4});
+    c.value()->close();
+    s.value()->close();
+    lis_r.value()->close();
+  }
+
+  // A sampled message larger than the quantum, queued while another channel is backlogged, still
+  // goes out whole with its trace rather than as untraced fragments. Coalescing holds everything
+  // queued until flush(), so both channels are active when the drain starts.
+  {
+    std::atomic<int> traces{0};
+    duct::ListenOptions lopt;
+    lopt.metrics.enabled = true;
+    lopt.metrics.prefix = "test.trace_rx.quantum";
+    lopt.metrics.on_trace = [&](const duct::TraceSample&) { traces.fetch_add(1); };
+    auto lis_r = duct::listen("tcp://127.0.0.1:0", lopt);
+    EXPECT_TRUE(lis_r.ok());
+    if (!lis_r.ok()) return;
+    auto addr = lis_r.value()->local_address();
+    EXPECT_TRUE(addr.ok());
+    if (!addr.ok()) return;
+    auto accepted = std::promise<duct::Result<std::unique_ptr<duct::Pipe>>>();
+    auto fut = accepted.get_future();
+    std::thread t([&] { accepted.set_value(lis_r.value()->accept()); });
+    duct::DialOptions dial_opt;
+    dial_opt.qos.channel_quantum_bytes = 4 * 1024;
+    dial_opt.qos.flush.min_bytes = std::size_t{1} << 30;
+    dial_opt.qos.flush.max_delay = std::chrono::seconds(10);
+    dial_opt.metrics.enabled = true;
+    dial_opt.metrics.prefix = "test.trace_tx.quantum";
+    dial_opt.metrics.trace_every = 1000;  // only the first message
+    auto c = duct::dial(addr.value(), dial_opt);
+    auto s = fut.get();
+    t.join();
+    EXPECT_TRUE(c.ok() && s.ok());
+    if (!c.ok() || !s.ok()) return;
+
+    const std::string big(20000, 'q');
+    EXPECT_TRUE(c.value()->send(duct::Message::from_string(big), {}).ok());
+    duct::SendOptions busy;
+    busy.channel = 1;
+    constexpr int kBacklog = 16;
+    for (int i = 0; i < kBacklog; ++i) {
+      EXPECT_TRUE(c.value()->send(duct::Message::from_string(std::string(4096, 'b')), busy).ok());
+    }
+    EXPECT_TRUE(c.value()->flush().ok());
+    duct::RecvOptions ropt;
+    ropt.timeout = std::chrono::seconds(5);
+    int backlog = 0;
+    for (int i = 0; i < kBacklog + 1; ++i) {
+      auto m = s.value()->recv(ropt);
+      EXPECT_TRUE(m.ok());
+      if (!m.ok()) break;
+      if (m.value().channel() == 0) {
+        EXPECT_TRUE(m.value().as_string_view() == big);
+      } else {
+        ++backlog;
+      }
+    }
+    EXPECT_EQ(backlog, kBacklog);
+    EXPECT_EQ(traces.load(), 1);
+    auto& registry = duct::MetricRegistry::instance();
+    EXPECT_EQ(registry.get_histogram(lopt.metrics.prefix + ".trace_queue_us")->count(), std::size_t{1});
+    c.value()->close();
+    s.value()->close();
+    lis_r.value()->close();
+  }
+}
+
+// Drops every `every`-th message sent through it, as a link losing frames would.
+class LossyPipe final : public duct::Pipe {
+ public:
+  LossyPipe(std::unique_ptr<duct::Pipe> inner, int every) : inner_(std::move(inner)), every_(every) {}
+
+  duct::Result<void> send(const duct::Message& msg, const duct::SendOptions& opt) override {
+    if (++sent_ % every_ == 0) return {};
+    return inner_->send(msg, opt);
+  }
+  duct::Result<duct::Message> recv(const duct::RecvOptions& opt) override { return inner_->recv(opt); }
+  duct::PollHandle poll_handle() const override { return inner_->poll_handle(); }
+  duct::Result<std::size_t> try_recv_batch(std::span<duct::Message> out) override {
+    return inner_->try_recv_batch(out);
+  }
+  void close() override { inner_->close(); }
+
+ private:
+  std::unique_ptr<duct::Pipe> inner_;
+  int every_;
+  std::atomic<int> sent_{0};
+};
+
+// Remembers the handle of every pipe it accepts, so a test can cut connections under a wrapper.
+class TapListener final : public duct::Listener {
+ public:
+  explicit TapListener(std::unique_ptr<duct::Listener> inner) : inner_(std::move(inner)) {}
+
+  duct::Result<std::unique_ptr<duct::Pipe>> accept() override {
+    auto p = inner_->accept();
+    if (p.ok()) {
+      std::lock_guard<std::mutex> lock(mu_);
+      handles_.push_back(p.value()->poll_handle());
+    }
+    return p;
+  }
+  duct::Result<std::string> local_address() const override { return inner_->local_address(); }
+  void close() override { inner_->close(); }
+
+  std::vector<duct::PollHandle> handles() {
+    std::lock_guard<std::mutex> lock(mu_);
+    return handles_;
+  }
+
+ private:
+  std::unique_ptr<duct::Listener> inner_;
+  std::mutex mu_;
+  std::vector<duct::PollHandle> handles_;
+};
+
+// One budget for the whole run rather than per message: retransmits back off, and sanitizer
+// builds stall for seconds at a time.
+static void expect_in_order(duct::Pipe& p, int from, int to) {
+  const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(60);
+  for (int i = from; i < to; ++i) {
+    const auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+    auto m = p.recv(duct::RecvOptions{std::max(left, std::chrono::milliseconds(1))});
+    EXPECT_TRUE(m.ok());
+    if (!m.ok()) return;
+    if (m.value().as_string_view() != std::to_string(i)) {
+      fail(__FILE__, __LINE__, "expected " + std::to_string(i) + ", got " + std::string(m.value().as_string_view()));
+      return;
+    }
+  }
+}
+
+static void test_reliable_pipe() {
+  duct::ListenOptions lis_opt;
+  lis_opt.qos.reliability = duct::Reliability::kAtLeastOnce;
+  auto lis_r = duct::listen("tcp://127.0.0.1:0", lis_opt);
+  EXPECT_TRUE(lis_r.ok());
+  if (!lis_r.ok()) return;
+  auto addr = lis_r.value()->local_address();
+  EXPECT_TRUE(addr.ok());
+  if (!addr.ok()) return;
+
+  // A connection that never says hello does not hold up the dialer behind it (the handshake
+  // timeout is 5 s).
+  auto silent = duct::dial(addr.value());
+  EXPECT_TRUE(silent.ok());
+  const auto accept_start = std::chrono::steady_clock::now();
+  auto accepted = std::promise<duct::Result<std::unique_ptr<duct::Pipe>>>();
+  auto fut = accepted.get_future();
+  std::thread t([&] { accepted.set_value(lis_r.value()->accept()); });
+  duct::DialOptions dial_opt;
+  dial_opt.qos.reliability = duct::Reliability::kAtLeastOnce;
+  auto c = duct::dial(addr.value(), dial_opt);
+  EXPECT_TRUE(c.ok());
+  auto sr = fut.get();
+  t.join();
+  EXPECT_TRUE(sr.ok());
+  if (!c.ok() || !sr.ok()) return;
+  EXPECT_TRUE(std::chrono::steady_clock::now() - accept_start < std::chrono::seconds(3));
+  auto* rel = dynamic_cast<duct::ReliablePipe*>(c.value().get());
+  EXPECT_TRUE(rel != nullptr);
+  if (rel == nullptr) return;
+
+  // Acks are coalesced: far fewer ack frames than messages, and everything ends up acknowledged.
+  constexpr int kCount = 20'000;
+  std::thread sender([&] {
+    for (int i = 0; i < kCount; ++i) EXPECT_TRUE(c.value()->send(duct::Message::from_string(std::to_string(i)), {}).ok());
+  });
+  expect_in_order(*sr.value(), 0, kCount);
+  sender.join();
+  auto* srel = dynamic_cast<duct::ReliablePipe*>(sr.value().get());
+  EXPECT_TRUE(srel != nullptr && srel->stats().acks_sent < kCount / 16);
+  const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  while (rel->stats().inflight != 0 && std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  }
+  EXPECT_EQ(rel->stats().inflight, std::size_t{0});
+  EXPECT_EQ(rel->stats().retransmits, std::uint64_t{0});
+
+  // Both directions.
+  EXPECT_TRUE(sr.value()->send(duct::Message::from_string("back"), {}).ok());
+  auto m = c.value()->recv(duct::RecvOptions{std::chrono::milliseconds(5'000)});
+  EXPECT_TRUE(m.ok() && m.value().as_string_view() == "back");
+
+  // A clean close ends the accepted session at once, not after resume_timeout (30 s).
+  EXPECT_TRUE(c.value()->send(duct::Message::from_string("last"), {}).ok());
+  c.value()->close();
+  auto last = sr.value()->recv(duct::RecvOptions{std::chrono::milliseconds(5'000)});
+  EXPECT_TRUE(last.ok() && last.value().as_string_view() == "last");
+  auto end = sr.value()->recv(duct::RecvOptions{std::chrono::milliseconds(5'000)});
+  EXPECT_EQ(end.status().code(), duct::StatusCode::kClosed);
+  sr.value()->close();
+  if (silent.ok()) silent.value()->close();
+  lis_r.value()->close();
+}
+
+static void test_reliable_pipe_loss() {
+  duct::AtLeastOnceOptions rel_opt;
+  rel_opt.rto = std::chrono::milliseconds(50);
+  duct::ListenOptions lis_opt;
+  lis_opt.qos.reliability = duct::Reliability::kAtLeastOnce;
+  lis_opt.qos.at_least_once = rel_opt;
+  auto lis_r = duct::listen("tcp://127.0.0.1:0", lis_opt);
+  EXPECT_TRUE(lis_r.ok());
+  if (!lis_r.ok()) return;
+  auto addr = lis_r.value()->local_address();
+  EXPECT_TRUE(addr.ok());
+  if (!addr.ok()) return;
+
+  auto accepted = std::promise<duct::Result<std::unique_ptr<duct::Pipe>>>();
+  auto fut = accepted.get_future();
+  std::thread t([&] { accepted.set_value(lis_r.value()->accept()); });
+  auto raw = duct::dial(addr.value());
+  EXPECT_TRUE(raw.ok());
+  if (!raw.ok()) {
+    lis_r.value()->close();
+    t.join();
+    return;
+  }
+  duct::ReliablePipe c(rel_opt);
+  EXPECT_TRUE(c.handshake(*raw.value()).ok());
+  c.start(std::make_unique<LossyPipe>(std::move(raw.value()), 7));
+  auto sr = fut.get();
+  t.join();
+  EXPECT_TRUE(sr.ok());
+  if (!sr.ok()) return;
+
+  // Every 7th frame (data or resend) never arrives; each message is still delivered once, in order.
+  constexpr int kCount = 2'000;
+  for (int i = 0; i < kCount; ++i) EXPECT_TRUE(c.send(duct::Message::from_string(std::to_string(i)), {}).ok());
+  expect_in_order(*sr.value(), 0, kCount);
+  EXPECT_TRUE(c.stats().retransmits > 0);
+  duct::RecvOptions quick;
+  quick.timeout = std::chrono::milliseconds(200);
+  EXPECT_EQ(sr.value()->recv(quick).status().code(), duct::StatusCode::kTimeout);
+
+  c.close();
+  sr.value()->close();
+  lis_r.value()->close();
+}
+
+static void test_reliable_pipe_reconnect() {
+  auto raw_lis = duct::listen("tcp://127.0.0.1:0");
+  EXPECT_TRUE(raw_lis.ok());
+  if (!raw_lis.ok()) return;
+  auto addr = raw_lis.value()->local_address();
+  EXPECT_TRUE(addr.ok());
+  if (!addr.ok()) return;
+  auto tap_owner = std::make_unique<TapListener>(std::move(raw_lis.value()));
+  TapListener* tap = tap_owner.get();
+  duct::AtLeastOnceOptions rel_opt;
+  rel_opt.rto = std::chrono::milliseconds(50);
+  duct::ReliableListener lis(std::move(tap_owner), rel_opt);
+
+  // The first accept() returns the session; later ones hand reconnections back to it.
+  auto accepted = std::promise<duct::Result<std::unique_ptr<duct::Pipe>>>();
+  auto fut = accepted.get_future();
+  std::thread acceptor([&] {
+    accepted.set_value(lis.accept());
+    while (lis.accept().ok()) {
+    }
+  });
+
+  duct::DialOptions dial_opt;
+  dial_opt.qos.reliability = duct::Reliability::kAtLeastOnce;
+  dial_opt.qos.at_least_once = rel_opt;
+  dial_opt.reconnect.enabled = true;
+  dial_opt.reconnect.initial_delay = std::chrono::milliseconds(10);
+  std::atomic<int> connects{0};
+  dial_opt.on_state_change = [&](duct::ConnectionState st, const std::string&) {
+    if (st == duct::ConnectionState::kConnected) ++connects;
+  };
+  auto c = duct::dial(addr.value(), dial_opt);
+  EXPECT_TRUE(c.ok());
+  auto sr = fut.get();
+  EXPECT_TRUE(sr.ok());
+  if (!c.ok() || !sr.ok()) {
+    lis.close();
+    acceptor.join();
+    return;
+  }
+
+  // Cut the connection twice while both directions are busy; nothing is lost or repeated.
+  constexpr int kRound = 500;
+  int next = 0;
+  for (int round = 0; round < 3; ++round) {
+    for (int i = 0; i < kRound; ++i) {
+      EXPECT_TRUE(c.value()->send(duct::Message::from_string(std::to_string(next + i)), {}).ok());
+      EXPECT_TRUE(sr.value()->send(duct::Message::from_string(std::to_string(next + i)), {}).ok());
+    }
+    expect_in_order(*sr.value(), next, next + kRound / 2);
+    expect_in_order(*c.value(), next, next + kRound / 2);
+    if (round < 2) {
+      const auto h = tap->handles().back();
+#if defined(_WIN32)
+      ::shutdown(static_cast<SOCKET>(h), SD_BOTH);
+#else
+      ::shutdown(static_cast<int>(h), SHUT_RDWR);
+#endif
+    }
+    expect_in_order(*sr.value(), next + kRound / 2, next + kRound);
+    expect_in_order(*c.value(), next + kRound / 2, next + kRound);
+    next += kRound;
+  }
+  EXPECT_EQ(connects.load(), 3);
+  EXPECT_EQ(tap->handles().size(), std::size_t{3});
+
+  c.value()->close();
+  sr.value()->close();
+  lis.close();
+  acceptor.join();
+}
+
+static void test_reconnect_fast_path() {
+  auto lis = duct::listen("tcp://127.0.0.1:0");
+  EXPECT_TRUE(lis.ok());
+  if (!lis.ok()) return;
+  auto addr = lis.value()->local_address();
+  EXPECT_TRUE(addr.ok());
+  if (!addr.ok()) return;
+
+  // Each cut makes the readers of the connections accepted before it close them; with unread data
+  // behind, that resets the connection and the dialer's writes fail.
+  std::atomic<int> cuts{0};
+  std::atomic<bool> saw_final{false};
+  std::vector<std::thread> readers;  // acceptor thread only, until it is joined
+  std::thread acceptor([&] {
+    for (;;) {
+      auto p = lis.value()->accept();
+      if (!p.ok()) return;
+      std::shared_ptr<duct::Pipe> sp(std::move(p.value()));
+      readers.emplace_back([sp, &cuts, &saw_final, gen = cuts.load()] {
+        for (auto m = sp->recv({}); m.ok() && cuts.load() == gen; m = sp->recv({})) {
+          if (m.value().as_string_view() == "final") saw_final = true;
+        }
+        sp->close();
+      });
+    }
+  });
+
+  duct::DialOptions opt;
+  opt.reconnect.enabled = true;
+  opt.reconnect.initial_delay = std::chrono::milliseconds(5);
+  std::atomic<int> connects{0};
+  opt.on_state_change = [&](duct::ConnectionState st, const std::string&) {
+    if (st == duct::ConnectionState::kConnected) ++connects;
+  };
+  auto c = duct::dial(addr.value(), opt);
+  EXPECT_TRUE(c.ok());
+  if (c.ok()) {
+    // Senders on the lock-free path while connections are swapped out under them.
+    std::atomic<int> sent{0};
+    std::atomic<bool> stop{false};
+    std::vector<std::thread> senders;
+    for (int t = 0; t < 4; ++t) {
+      senders.emplace_back([&, t] {
+        std::vector<duct::Message> batch(8, duct::Message::from_string("b" + std::to_string(t)));
+        for (int i = 0; !stop.load(); ++i) {
+          if (i % 2 == 0) {
+            if (c.value()->send(duct::Message::from_string("s"), {}).ok()) ++sent;
+          } else {
+            auto n = c.value()->send_batch(batch, {});
+            if (n.ok()) sent += static_cast<int>(n.value());
+          }
+        }
+      });
+    }
+    for (int i = 0; i < 3; ++i) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+      ++cuts;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    stop = true;
+    for (auto& t : senders) t.join();
+    EXPECT_TRUE(sent.load() > 0);
+    // Sends keep working once the last cut has been noticed (what went into it is lost).
+    for (int i = 0; i < 1000 && !saw_final.load(); ++i) {
+      (void)c.value()->send(duct::Message::from_string("final"), {});
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    EXPECT_TRUE(saw_final.load());
+    EXPECT_TRUE(connects.load() >= 2);
+    c.value()->close();
+  }
+  lis.value()->close();
+  acceptor.join();
+  for (auto& t : readers) t.join();
+}
+
+static void test_dial_endpoint_list() {
+  // A port nobody listens on any more refuses at once.
+  std::string dead;
+  {
+    auto l = duct::listen("tcp://127.0.0.1:0");
+    EXPECT_TRUE(l.ok());
+    if (!l.ok()) return;
+    dead = l.value()->local_address().value();
+  }
+  auto lis_a = duct::listen("tcp://127.0.0.1:0");
+  auto lis_b = duct::listen("tcp://127.0.0.1:0");
+  EXPECT_TRUE(lis_a.ok() && lis_b.ok());
+  if (!lis_a.ok() || !lis_b.ok()) return;
+  const std::string a = lis_a.value()->local_address().value();
+  const std::string b = lis_b.value()->local_address().value();
+
+  EXPECT_EQ(duct::dial(dead + ",tcp://127.0.0.1:").status().code(), duct::StatusCode::kInvalidArgument);
+
+  // The refused endpoint does not hold up the next one.
+  {
+    auto c = duct::dial(dead + ", " + a);
+    EXPECT_TRUE(c.ok());
+    auto s = lis_a.value()->accept();
+    EXPECT_TRUE(c.ok() && s.ok());
+    if (!c.ok() || !s.ok()) return;
+    EXPECT_TRUE(c.value()->send(duct::Message::from_string("0"), {}).ok());
+    expect_in_order(*s.value(), 0, 1);
+  }
+  {
+    duct::DialOptions opt;
+    opt.timeout = std::chrono::milliseconds(500);
+    EXPECT_TRUE(!duct::dial(dead + "," + dead, opt).ok());
+  }
+
+  // Losing the connection fails over to the other endpoint; sends in between are buffered rather
+  // than blocked, and arrive there first.
+  duct::DialOptions opt;
+  opt.reconnect.enabled = true;
+  opt.reconnect.initial_delay = std::chrono::milliseconds(10);
+  opt.reconnect.buffer_bytes = 64 * 1024;
+  opt.race_delay = std::chrono::seconds(5);  // a slow first connect must not let b win it
+  std::mutex mu;
+  std::condition_variable cv;
+  std::vector<duct::ConnectionState> states;
+  opt.on_state_change = [&](duct::ConnectionState st, const std::string&) {
+    std::lock_guard<std::mutex> lk(mu);
+    states.push_back(st);
+    cv.notify_all();
+  };
+  auto c = duct::dial(a + "," + b, opt);
+  EXPECT_TRUE(c.ok());
+  auto sa = lis_a.value()->accept();
+  EXPECT_TRUE(c.ok() && sa.ok());
+  if (!c.ok() || !sa.ok()) return;
+  EXPECT_TRUE(c.value()->send(duct::Message::from_string("0"), {}).ok());
+  expect_in_order(*sa.value(), 0, 1);
+
+  lis_a.value()->close();
+  sa.value()->close();
+  std::thread rx([&] {
+    // Notices the close and reconnects, then reads from the new connection.
+    auto m = c.value()->recv({});
+    EXPECT_TRUE(m.ok() && m.value().as_string_view() == "pong");
+  });
+  {
+    std::unique_lock<std::mutex> lk(mu);
+    EXPECT_TRUE(cv.wait_for(lk, std::chrono::seconds(5), [&] {
+      return std::count(states.begin(), states.end(), duct::ConnectionState::kDisconnected) != 0;
+    }));
+  }
+  duct::SendOptions quick;
+  quick.timeout = std::chrono::milliseconds(10);
+  for (int i = 0; i < 100; ++i) EXPECT_TRUE(c.value()->send(duct::Message::from_string(std::to_string(i)), quick).ok());
+  auto sb = lis_b.value()->accept();
+  EXPECT_TRUE(sb.ok());
+  if (sb.ok()) {
+    expect_in_order(*sb.value(), 0, 100);
+    EXPECT_TRUE(sb.value()->send(duct::Message::from_string("pong"), {}).ok());
+  }
+  rx.join();
+  {
+    // Reported once the new connection is in use, so possibly after the traffic above.
+    std::unique_lock<std::mutex> lk(mu);
+    EXPECT_TRUE(cv.wait_for(lk, std::chrono::seconds(5), [&] {
+      return std::count(states.begin(), states.end(), duct::ConnectionState::kConnected) == 2;
+    }));
+  }
+
+  // The buffer is bounded: past it, a send waits for the connection like any other.
+  {
+    duct::DialOptions small;
+    small.reconnect.enabled = true;
+    small.reconnect.buffer_bytes = 16;
+    auto d = duct::dial(dead, small);
+    EXPECT_TRUE(d.ok());
+    if (d.ok()) {
+      EXPECT_TRUE(d.value()->send(duct::Message::from_string("12345678"), quick).ok());
+      EXPECT_TRUE(d.value()->send(duct::Message::from_string("12345678"), quick).ok());
+      EXPECT_EQ(d.value()->send(duct::Message::from_string("1"), quick).status().code(), duct::StatusCode::kTimeout);
+    }
+  }
+
+  c.value()->close();
+  lis_b.value()->close();
+}
+
+// Two MuxSessions over one loopback TCP connection (the default QosPipe on the dialing side).
+struct MuxPair {
+  std::unique_ptr<duct::Listener> lis;
+  std::unique_ptr<duct::MuxSession> dialer;
+  std::unique_ptr<duct::MuxSession> acceptor;
+};
+
+static bool make_mux_pair(MuxPair* p, const duct::MuxOptions& opt) {
+  auto lis_r = duct::listen("tcp://127.0.0.1:0");
+  EXPECT_TRUE(lis_r.ok());
+  if (!lis_r.ok()) return false;
+  p->lis = std::move(lis_r.value());
+  auto addr = p->lis->local_address();
+  EXPECT_TRUE(addr.ok());
+  if (!addr.ok()) return false;
+  auto c = duct::dial(addr.value());
+  auto s = p->lis->accept();
+  EXPECT_TRUE(c.ok() && s.ok());
+  if (!c.ok() || !s.ok()) return false;
+  p->dialer = std::make_unique<duct::MuxSession>(std::move(c.value()), duct::MuxRole::kDialer, opt);
+  p->acceptor = std::make_unique<duct::MuxSession>(std::move(s.value()), duct::MuxRole::kAcceptor, opt);
+  return true;
+}
+
+static void test_mux_streams() {
+  MuxPair mp;
+  if (!make_mux_pair(&mp, {})) return;
+
+  // Streams from both ends, each with its own traffic, including a fragmented message.
+  std::vector<std::unique_ptr<duct::Pipe>> ours;
+  std::vector<std::unique_ptr<duct::Pipe>> theirs;
+  for (int i = 0; i < 3; ++i) {
+    auto o = mp.dialer->open();
+    EXPECT_TRUE(o.ok());
+    if (!o.ok()) return;
+    EXPECT_TRUE(o.value()->send(duct::Message::from_string("hello " + std::to_string(i)), {}).ok());
+    ours.push_back(std::move(o.value()));
+  }
+  for (int i = 0; i < 3; ++i) {
+    auto a = mp.acceptor->accept({std::chrono::milliseconds(2000)});
+    EXPECT_TRUE(a.ok());
+    if (!a.ok()) return;
+    auto m = a.value()->recv({});
+    EXPECT_TRUE(m.ok() && m.value().as_string_view() == "hello " + std::to_string(i));
+    theirs.push_back(std::move(a.value()));
+  }
+  const std::string big(200'000, 'm');
+  EXPECT_TRUE(theirs[1]->send(duct::Message::from_string(big), {}).ok());
+  EXPECT_TRUE(theirs[2]->send(duct::Message::from_string("two"), {}).ok());
+  auto m = ours[2]->recv({});
+  EXPECT_TRUE(m.ok() && m.value().as_string_view() == "two");
+  m = ours[1]->recv({});
+  EXPECT_TRUE(m.ok() && m.value().as_string_view() == big);
+  duct::SendOptions on1;
+  on1.channel = 1;
+  EXPECT_EQ(ours[0]->send(duct::Message::from_string("x"), on1).status().code(), duct::StatusCode::kInvalidArgument);
+
+  auto back = mp.acceptor->open();
+  EXPECT_TRUE(back.ok());
+  if (!back.ok()) return;
+  EXPECT_TRUE(back.value()->send(duct::Message::from_string("reverse"), {}).ok());
+  auto rev = mp.dialer->accept({std::chrono::milliseconds(2000)});
+  EXPECT_TRUE(rev.ok());
+  if (!rev.ok()) return;
+  m = rev.value()->recv({});
+  EXPECT_TRUE(m.ok() && m.value().as_string_view() == "reverse");
+
+  // Closing delivers what was sent first, then kClosed, and frees the id on both ends.
+  EXPECT_TRUE(ours[0]->send(duct::Message::from_string("last"), {}).ok());
+  ours[0]->close();
+  m = theirs[0]->recv({});
+  EXPECT_TRUE(m.ok() && m.value().as_string_view() == "last");
+  EXPECT_EQ(theirs[0]->recv({}).status().code(), duct::StatusCode::kClosed);
+  EXPECT_EQ(theirs[0]->send(duct::Message::from_string("late"), {}).status().code(), duct::StatusCode::kClosed);
+  for (int i = 0; i < 200; ++i) {
+    auto o = mp.dialer->open();
+    EXPECT_TRUE(o.ok());
+    if (!o.ok()) return;
+    o.value()->close();
+    auto a = mp.acceptor->accept({std::chrono::milliseconds(2000)});
+    EXPECT_TRUE(a.ok());
+  }
+  const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  while (mp.dialer->stats().streams != 3 && std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  }
+  EXPECT_EQ(mp.dialer->stats().streams, std::size_t{3});  // ours[1], ours[2] and rev
+  EXPECT_EQ(mp.dialer->stats().opened, std::uint64_t{203});
+
+  // Losing the connection ends every stream.
+  mp.acceptor->close();
+  EXPECT_TRUE(!ours[1]->recv({}).ok());
+  EXPECT_TRUE(!rev.value()->recv({}).ok());
+  EXPECT_TRUE(!mp.dialer->open().ok());
+  mp.dialer->close();
+  mp.lis->close();
+}
+
+static void test_mux_flow_control() {
+  duct::MuxOptions opt;
+  opt.stream_window_bytes = 4096;
+  opt.max_streams = 2;
+  MuxPair mp;
+  if (!make_mux_pair(&mp, opt)) return;
+  auto slow = mp.dialer->open();
+  auto fast = mp.dialer->open();
+  EXPECT_TRUE(slow.ok() && fast.ok());
+  if (!slow.ok() || !fast.ok()) return;
+  auto slow_in = mp.acceptor->accept({std::chrono::milliseconds(2000)});
+  auto fast_in = mp.acceptor->accept({std::chrono::milliseconds(2000)});
+  EXPECT_TRUE(slow_in.ok() && fast_in.ok());
+  if (!slow_in.ok() || !fast_in.ok()) return;
+
+  // Nobody reads `slow`: its sender stops at the window while `fast` keeps going.
+  duct::SendOptions brief;
+  brief.timeout = std::chrono::milliseconds(100);
+  const std::string kb(1024, 'w');
+  int sent = 0;
+  while (sent < 100 && slow.value()->send(duct::Message::from_string(kb), brief).ok()) ++sent;
+  EXPECT_EQ(sent, 4);
+  EXPECT_EQ(slow.value()->send(duct::Message::from_string(kb), brief).status().code(), duct::StatusCode::kTimeout);
+  std::thread reader([&] {
+    for (int i = 0; i < 50; ++i) {
+      auto m = fast_in.value()->recv({std::chrono::milliseconds(2000)});
+      EXPECT_TRUE(m.ok() && m.value().size() == kb.size());
+    }
+  });
+  duct::SendOptions patient;
+  patient.timeout = std::chrono::milliseconds(2000);
+  for (int i = 0; i < 50; ++i) EXPECT_TRUE(fast.value()->send(duct::Message::from_string(kb), patient).ok());
+  reader.join();
+  // Reading `slow` grants its window back.
+  for (int i = 0; i < 4; ++i) EXPECT_TRUE(slow_in.value()->recv({std::chrono::milliseconds(2000)}).ok());
+  EXPECT_TRUE(slow.value()->send(duct::Message::from_string(kb), patient).ok());
+  EXPECT_TRUE(mp.acceptor->stats().window_updates >= 2);
+  EXPECT_TRUE(mp.dialer->stats().window_waits >= 1);
+
+  // A message larger than the window still goes through, once the window has room.
+  const std::string large(20'000, 'L');
+  EXPECT_TRUE(fast.value()->send(duct::Message::from_string(large), patient).ok());
+  auto m = fast_in.value()->recv({std::chrono::milliseconds(2000)});
+  EXPECT_TRUE(m.ok() && m.value().as_string_view() == large);
+
+  // A third stream is over the acceptor's max_streams: it is refused and closed.
+  auto third = mp.dialer->open();
+  EXPECT_TRUE(third.ok());
+  if (!third.ok()) return;
+  EXPECT_EQ(third.value()->recv({std::chrono::milliseconds(2000)}).status().code(), duct::StatusCode::kClosed);
+  EXPECT_EQ(mp.acceptor->stats().refused, std::uint64_t{1});
+  mp.dialer->close();
+  mp.acceptor->close();
+  mp.lis->close();
+}
+
+static void test_request_reply() {
+  auto lis_r = duct::listen("tcp://127.0.0.1:0");
+  EXPECT_TRUE(lis_r.ok());
+  if (!lis_r.ok()) return;
+  auto addr = lis_r.value()->local_address();
+  EXPECT_TRUE(addr.ok());
+  if (!addr.ok()) return;
+  auto c = duct::dial(addr.value());
+  auto s = lis_r.value()->accept();
+  EXPECT_TRUE(c.ok() && s.ok());
+  if (!c.ok() || !s.ok()) return;
+
+  // Earlier requests take longer, so replies come back out of order.
+  std::mutex ids_mu;
+  std::vector<std::thread::id> handler_threads;
+  auto handler = [&](const duct::Message& req) -> duct::Result<duct::Message> {
+    {
+      std::lock_guard<std::mutex> lock(ids_mu);
+      if (std::find(handler_threads.begin(), handler_threads.end(), std::this_thread::get_id()) == handler_threads.end()) {
+        handler_threads.push_back(std::this_thread::get_id());
+      }
+    }
+    std::string_view v = req.as_string_view();
+    if (v == "bad") return duct::Status::invalid_argument("no such method");
+    if (v == "slow") {
+      std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    } else {
+      std::this_thread::sleep_for(std::chrono::milliseconds(20 - std::stoi(std::string(v)) % 20));
+    }
+    return duct::Message::from_string("re:" + std::string(v));
+  };
+  duct::ResponderOptions ropt;
+  ropt.max_in_flight = 32;
+  ropt.threads = 16;
+  duct::Responder responder(std::move(s.value()), handler, ropt);
+  duct::Requester requester(std::move(c.value()));
+
+  constexpr int kCalls = 200;
+  std::vector<std::future<duct::Result<duct::Message>>> calls;
+  const auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kCalls; ++i) calls.push_back(requester.call(duct::Message::from_string(std::to_string(i))));
+  std::vector<int> order;
+  std::mutex order_mu;
+  std::atomic<int> callbacks{0};
+  for (int i = 0; i < 20; ++i) {
+    requester.call(duct::Message::from_string(std::to_string(i)), [&, i](duct::Result<duct::Message> r) {
+      EXPECT_TRUE(r.ok());
+      std::lock_guard<std::mutex> lock(order_mu);
+      order.push_back(i);
+      ++callbacks;
+    });
+  }
+  for (int i = 0; i < kCalls; ++i) {
+    auto r = calls[i].get();
+    EXPECT_TRUE(r.ok());
+    if (r.ok()) EXPECT_EQ(std::string(r.value().as_string_view()), "re:" + std::to_string(i));
+  }
+  // Lock-step would take the sum of the handler times (about 2 s); pipelined, a fraction.
+  EXPECT_TRUE(std::chrono::steady_clock::now() - start < std::chrono::seconds(1));
+  for (int tries = 0; tries < 200 && callbacks.load() < 20; ++tries) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  }
+  {
+    std::lock_guard<std::mutex> lock(order_mu);
+    EXPECT_EQ(order.size(), std::size_t{20});
+    EXPECT_TRUE(!std::is_sorted(order.begin(), order.end()));
+  }
+
+  // The handler's error reaches the caller; a deadline ends a slow call and its late reply is dropped.
+  auto bad = requester.call(duct::Message::from_string("bad")).get();
+  EXPECT_EQ(bad.status().code(), duct::StatusCode::kInvalidArgument);
+  EXPECT_EQ(bad.status().message(), std::string("no such method"));
+  duct::RequestOptions deadline;
+  deadline.timeout = std::chrono::milliseconds(30);
+  auto slow = requester.call(duct::Message::from_string("slow"), deadline).get();
+  EXPECT_EQ(slow.status().code(), duct::StatusCode::kTimeout);
+  for (int tries = 0; tries < 100 && requester.stats().unmatched == 0; ++tries) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  auto rs = requester.stats();
+  EXPECT_EQ(rs.timed_out, std::uint64_t{1});
+  EXPECT_EQ(rs.unmatched, std::uint64_t{1});
+  EXPECT_EQ(rs.in_flight, std::size_t{0});
+  EXPECT_EQ(responder.stats().failed, std::uint64_t{1});
+  {
+    // On the Responder's own threads, not the shared workers.
+    std::lock_guard<std::mutex> lock(ids_mu);
+    EXPECT_TRUE(!handler_threads.empty() && handler_threads.size() <= ropt.threads);
+  }
+
+  // A coroutine awaits its replies on the loop thread.
+  auto reactor_r = duct::Reactor::create();
+  EXPECT_TRUE(reactor_r.ok());
+  if (!reactor_r.ok()) return;
+  duct::Reactor& reactor = *reactor_r.value();
+  std::thread loop([&] { EXPECT_TRUE(reactor.run().ok()); });
+  std::promise<std::string> co_result;
+  duct::spawn(reactor, [](duct::Reactor& r, duct::Requester& req, std::thread::id loop_id,
+                          std::promise<std::string>* out) -> duct::Task<void> {
+    std::string got;
+    for (const char* body : {"3", "bad"}) {
+      auto reply = co_await duct::request_async(r, req, duct::Message::from_string(body));
+      if (std::this_thread::get_id() != loop_id) got += "off-loop;";
+      got += reply.ok() ? std::string(reply.value().as_string_view()) : reply.status().message();
+      got += ";";
+    }
+    out->set_value(got);
+  }(reactor, requester, loop.get_id(), &co_result));
+  auto co_f = co_result.get_future();
+  EXPECT_TRUE(co_f.wait_for(std::chrono::seconds(5)) == std::future_status::ready);
+  EXPECT_EQ(co_f.get(), std::string("re:3;no such method;"));
+  reactor.stop();
+  loop.join();
+
+  // Closing the responder lets a running handler reply first; later calls fail.
+  auto pending = requester.call(duct::Message::from_string("slow"));
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  responder.close();
+  EXPECT_TRUE(pending.get().ok());
+  duct::RequestOptions bounded;
+  bounded.timeout = std::chrono::seconds(2);
+  EXPECT_TRUE(!requester.call(duct::Message::from_string("1"), bounded).get().ok());
+  requester.close();
+  lis_r.value()->close();
+}
+
+static void test_wire_decode_rejects_bad_magic() {
+  std::uint8_t hdr[duct::wire::kHeaderLen]{};
+  auto decoded = duct::wire::decode_header(hdr);
+  EXPECT_TRUE(!decoded.ok());
+  if (!decoded.ok()) {
+    EXPECT_EQ(decoded.status().code(), duct::StatusCode::kProtocolError);
+  }
+}
+
+static void test_wire_socketpair_frames() {
+#if defined(_WIN32)
+  WSADATA wsaData{};
+  int wsa_rc = WSAStartup(MAKEWORD(2, 2), &wsaData);
+  EXPECT_TRUE(wsa_rc == 0);
+  if (wsa_rc != 0) return;
+
+  SOCKET listener = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  EXPECT_TRUE(listener != INVALID_SOCKET);
+  if (listener == INVALID_SOCKET) {
+    WSACleanup();
+    return;
+  }
+
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = 0;
+
+  int bind_rc = ::bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+  EXPECT_TRUE(bind_rc == 0);
+  int listen_rc = ::listen(listener, 1);
+  EXPECT_TRUE(listen_rc == 0);
+  if (bind_rc != 0 || listen_rc != 0) {
+    closesocket(listener);
+    WSACleanup();
+    return;
+  }
+
+  sockaddr_in bound{};
+  int bound_len = sizeof(bound);
+  int getsock_rc = ::getsockname(listener, reinterpret_cast<sockaddr*>(&bound), &bound_len);
+  EXPECT_TRUE(getsock_rc == 0);
+  if (getsock_rc != 0) {
+    closesocket(listener);
+    WSACleanup();
+    return;
+  }
+
+  SOCKET client = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  EXPECT_TRUE(client != INVALID_SOCKET);
+  if (client == INVALID_SOCKET) {
+    closesocket(listener);
+    WSACleanup();
+    return;
+  }
+
+  sockaddr_in connect_addr{};
+  connect_addr.sin_family = AF_INET;
+  connect_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  connect_addr.sin_port = bound.sin_port;
+
+  int conn_rc = ::connect(client, reinterpret_cast<sockaddr*>(&connect_addr), sizeof(connect_addr));
+  EXPECT_TRUE(conn_rc == 0);
+  if (conn_rc != 0) {
+    closesocket(client);
+    closesocket(listener);
+    WSACleanup();
+    return;
+  }
+
+  SOCKET server = ::accept(listener, nullptr, nullptr);
+  EXPECT_TRUE(server != INVALID_SOCKET);
+  closesocket(listener);
+  if (server == INVALID_SOCKET) {
+    closesocket(client);
+    WSACleanup();
+    return;
+  }
+
+  auto writer = std::thread([&] {
+    (void)duct::wire::write_frame(static_cast<duct::wire::SocketHandle>(client),
+                                 duct::Message::from_string("one"));
+    (void)duct::wire::write_frame(static_cast<duct::wire::SocketHandle>(client),
+                                 duct::Message::from_string("two"));
+
+    std::string big(duct::wire::kMaxFramePayload, 'x');
+    (void)duct::wire::write_frame(static_cast<duct::wire::SocketHandle>(client),
+                                 duct::Message::from_string(big));
+    closesocket(client);
+  });
+
+  auto r1 = duct::wire::read_frame(static_cast<duct::wire::SocketHandle>(server));
+  EXPECT_TRUE(r1.ok());
+  if (r1.ok()) {
+    std::string s(reinterpret_cast<const char*>(r1.value().data()), r1.value().size());
+    EXPECT_EQ(s, "one");
+  }
+
+  auto r2 = duct::wire::read_frame(static_cast<duct::wire::SocketHandle>(server));
+  EXPECT_TRUE(r2.ok());
+  if (r2.ok()) {
+    std::string s(reinterpret_cast<const char*>(r2.value().data()), r2.value().size());
+    EXPECT_EQ(s, "two");
+  }
+
+  auto r3 = duct::wire::read_frame(static_cast<duct::wire::SocketHandle>(server));
+  EXPECT_TRUE(r3.ok());
+  if (r3.ok()) {
+    EXPECT_EQ(r3.value().size(), duct::wire::kMaxFramePayload);
+  }
+
+  closesocket(server);
+  writer.join();
+  WSACleanup();
+#else
+  int fds[2]{-1, -1};
+  int rc = ::socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+  EXPECT_TRUE(rc == 0);
+  if (rc != 0) return;
+
+  auto writer = std::thread([&] {
+    (void)duct::wire::write_frame(fds[0], duct::Message::from_string("one"));
+    (void)duct::wire::write_frame(fds[0], duct::Message::from_string("two"));
+
+    // Max payload frame.
+    std::string big(duct::wire::kMaxFramePayload, 'x');
+    (void)duct::wire::write_frame(fds[0], duct::Message::from_string(big));
+    ::close(fds[0]);
+  });
+
+  auto r1 = duct::wire::read_frame(fds[1]);
+  EXPECT_TRUE(r1.ok());
+  if (r1.ok()) {
+    std::string s(reinterpret_cast<const char*>(r1.value().data()), r1.value().size());
+    EXPECT_EQ(s, "one");
+  }
+
+  auto r2 = duct::wire::read_frame(fds[1]);
+  EXPECT_TRUE(r2.ok());
+  if (r2.ok()) {
+    std::string s(reinterpret_cast<const char*>(r2.value().data()), r2.value().size());
+    EXPECT_EQ(s, "two");
+  }
+
+  auto r3 = duct::wire::read_frame(fds[1]);
+  EXPECT_TRUE(r3.ok());
+  if (r3.ok()) {
+    EXPECT_EQ(r3.value().size(), duct::wire::kMaxFramePayload);
+  }
+
+  ::close(fds[1]);
+  writer.join();
+#endif
+}
+
+
+static void test_wire_compact_header() {
+  using duct::wire::FrameHeader;
+  std::uint8_t buf[duct::wire::kMaxCompactHeaderLen];
+  auto roundtrip = [&](std::size_t len, std::uint32_t flags, std::size_t want) {
+    const std::size_t n = duct::wire::encode_compact_header(len, flags, buf);
+    EXPECT_EQ(n, want);
+    FrameHeader h;
+    EXPECT_EQ(duct::wire::decode_compact_header(buf, n - 1, &h).value(), std::size_t{0});  // incomplete
+    auto d = duct::wire::decode_compact_header(buf, n, &h);
+    EXPECT_TRUE(d.ok() && d.value() == n);
+    EXPECT_EQ(h.payload_len, static_cast<std::uint32_t>(len));
+    EXPECT_EQ(h.flags, flags);
+  };
+  roundtrip(0, 0, 1);
+  roundtrip(7, 0, 1);
+  roundtrip(40, 0, 2);
+  roundtrip(40, duct::channel_flags(3), 3);
+  roundtrip(40, duct::to_u32(duct::FrameFlags::kCompressed), 2);
+  roundtrip(duct::wire::kMaxFramePayload, duct::channel_flags(0xffff) | duct::wire::kFragmentFlags, 6);
+  roundtrip(40, duct::to_u32(duct::FrameFlags::kTraced), 5);
+  roundtrip(40, duct::channel_flags(0xffff) | duct::to_u32(duct::FrameFlags::kTraced), 5);
+
+  FrameHeader h;
+  const std::uint8_t runaway[] = {0x80, 0x80, 0x80, 0x01};
+  EXPECT_EQ(duct::wire::decode_compact_header(runaway, sizeof(runaway), &h).status().code(),
+            duct::StatusCode::kProtocolError);
+  const std::size_t n = duct::wire::encode_compact_header(duct::wire::kMaxFramePayload + 1, 0, buf);
+  EXPECT_EQ(duct::wire::decode_compact_header(buf, n, &h).status().code(), duct::StatusCode::kProtocolError);
+}
+
+static void test_wire_compact_frames() {
+#if !defined(_WIN32)
+  int fds[2]{-1, -1};
+  int rc = ::socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+  EXPECT_TRUE(rc == 0);
+  if (rc != 0) return;
+
+  // One hello, then 2-byte headers for 40-byte messages.
+  constexpr int kCount = 100;
+  duct::wire::FrameEncoder dialer;
+  dialer.configure(duct::wire::CompactFraming::kInitiate);
+  std::vector<duct::Message> batch;
+  for (int i = 0; i < kCount; ++i) batch.push_back(duct::Message::from_string(std::string(40, 'a' + i % 26)));
+  auto w = duct::wire::write_frames(fds[0], batch, 0, &dialer);
+  EXPECT_TRUE(w.ok() && w.value() == static_cast<std::size_t>(kCount));
+  EXPECT_TRUE(duct::wire::write_frame(fds[0], duct::Message::from_string("ch"), duct::channel_flags(7), &dialer).ok());
+  const std::string big(2 * duct::wire::kMaxFramePayload + 5, 'z');  // 3-byte headers, then 1
+  EXPECT_TRUE(duct::wire::write_frame(fds[0], duct::Message::from_string(big), 0, &dialer).ok());
+  int queued = 0;
+  EXPECT_TRUE(::ioctl(fds[1], FIONREAD, &queued) == 0);
+  EXPECT_EQ(static_cast<std::size_t>(queued), duct::wire::kHelloLen + kCount * 42 + 4 + (3 + 3 + 1) + big.size());
+
+  duct::wire::FrameEncoder acceptor;
+  acceptor.configure(duct::wire::CompactFraming::kAnswer);
+  duct::wire::FrameReader reader;
+  reader.set_encoder(&acceptor);
+  for (int i = 0; i < kCount; ++i) {
+    auto m = reader.read(fds[1]);
+    EXPECT_TRUE(m.ok() && m.value().as_string_view() == std::string(40, 'a' + i % 26));
+  }
+  auto ch = reader.read(fds[1]);
+  EXPECT_TRUE(ch.ok() && ch.value().as_string_view() == "ch" && ch.value().channel() == 7);
+  auto whole = reader.read(fds[1]);
+  EXPECT_TRUE(whole.ok() && whole.value().as_string_view() == big);
+  EXPECT_EQ(reader.peer_capabilities(), duct::wire::kCapabilities);
+
+  // The accepting side answers with its own hello ahead of its first frame. A reserved frame's
+  // header is packed against its payload.
+  std::vector<std::uint8_t> prefixed(duct::wire::kHeaderLen + 3);
+  std::memcpy(prefixed.data() + duct::wire::kHeaderLen, "abc", 3);
+  EXPECT_TRUE(duct::wire::write_prefixed_frame(fds[1], prefixed.data(), 3, 0, &acceptor).ok());
+  EXPECT_TRUE(::ioctl(fds[0], FIONREAD, &queued) == 0);
+  EXPECT_EQ(static_cast<std::size_t>(queued), duct::wire::kHelloLen + 1 + 3);
+  duct::wire::FrameReader back;
+  auto m = back.read(fds[0]);
+  EXPECT_TRUE(m.ok() && m.value().as_string_view() == "abc");
+  ::close(fds[0]);
+  ::close(fds[1]);
+#endif
+}
+
+// Compact headers on one or both directions, or none, depending on what each end allows.
+static void test_compact_frames_negotiation() {
+  for (int mode = 0; mode < 3; ++mode) {
+    duct::ListenOptions lopt;
+    lopt.compact_frames = mode != 1;
+    auto lis_r = duct::listen("tcp://127.0.0.1:0", lopt);
+    EXPECT_TRUE(lis_r.ok());
+    if (!lis_r.ok()) return;
+    auto addr = lis_r.value()->local_address();
+    EXPECT_TRUE(addr.ok());
+    if (!addr.ok()) return;
+    duct::DialOptions dopt;
+    dopt.qos.snd_hwm_bytes = 0;
+    dopt.qos.rcv_hwm_bytes = 0;
+    dopt.compact_frames = mode != 2;
+    auto c = duct::dial(addr.value(), dopt);
+    EXPECT_TRUE(c.ok());
+    auto s = lis_r.value()->accept();
+    EXPECT_TRUE(s.ok());
+    if (!c.ok() || !s.ok()) return;
+
+    duct::SendOptions on5;
+    on5.channel = 5;
+    const std::string big(200'000, 'q');
+    for (int round = 0; round < 2; ++round) {
+      EXPECT_TRUE(c.value()->send(duct::Message::from_string("ping"), on5).ok());
+      EXPECT_TRUE(c.value()->send(duct::Message::from_string(big), {}).ok());
+      auto m = s.value()->recv({});
+      EXPECT_TRUE(m.ok() && m.value().as_string_view() == "ping" && m.value().channel() == 5);
+      m = s.value()->recv({});
+      EXPECT_TRUE(m.ok() && m.value().as_string_view() == big);
+
+      auto buf = s.value()->reserve(4, {});
+      EXPECT_TRUE(buf.ok());
+      if (!buf.ok()) return;
+      std::memcpy(buf.value().data(), "pong", 4);
+      EXPECT_TRUE(s.value()->commit(4, on5).ok());
+      EXPECT_TRUE(s.value()->send(duct::Message::from_string(big), {}).ok());
+      m = c.value()->recv({});
+      EXPECT_TRUE(m.ok() && m.value().as_string_view() == "pong" && m.value().channel() == 5);
+      m = c.value()->recv({});
+      EXPECT_TRUE(m.ok() && m.value().as_string_view() == big);
+    }
+    c.value()->close();
+    s.value()->close();
+    lis_r.value()->close();
+  }
+}
+
+#if !defined(_WIN32)
+// Bytes the kernel holds for reading on `p`, once a sender has stopped writing.
+static std::size_t wire_bytes_queued(duct::Pipe& p) {
+  int queued = -1;
+  for (int prev = -2; queued != prev;) {
+    prev = queued;
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    if (::ioctl(p.poll_handle(), FIONREAD, &queued) != 0) return 0;
+  }
+  return static_cast<std::size_t>(queued);
+}
+#endif
+
+static void test_compressed_pipes() {
+  std::string text;
+  for (int i = 0; text.size() < 50'000; ++i) text += "{\"id\":" + std::to_string(i) + ",\"state\":\"ready\"}\n";
+  const std::string big = text + text + text + text;  // fragmented: 200 KB
+  const std::string small(64, 'x');                   // below min_bytes: raw
+  for (auto codec : {duct::Compression::kLz4, duct::Compression::kZstd}) {
+    if (!duct::compression_supported(codec)) {
+      duct::DialOptions dopt;
+      dopt.compression.codec = codec;
+      EXPECT_EQ(duct::dial("tcp://127.0.0.1:1", dopt).status().code(), duct::StatusCode::kNotSupported);
+      continue;
+    }
+    duct::ListenOptions lopt;
+    lopt.compression.codec = codec;
+    auto lis_r = duct::listen("tcp://127.0.0.1:0", lopt);
+    EXPECT_TRUE(lis_r.ok());
+    if (!lis_r.ok()) return;
+    auto addr = lis_r.value()->local_address();
+    EXPECT_TRUE(addr.ok());
+    if (!addr.ok()) return;
+    duct::DialOptions dopt;
+    dopt.qos.snd_hwm_bytes = 0;
+    dopt.qos.rcv_hwm_bytes = 0;
+    dopt.compact_frames = true;
+    dopt.compression.codec = codec;
+    auto c = duct::dial(addr.value(), dopt);
+    EXPECT_TRUE(c.ok());
+    auto s = lis_r.value()->accept();
+    EXPECT_TRUE(s.ok());
+    if (!c.ok() || !s.ok()) return;
+
+    // The dialer sends raw until the listener's hello says it decompresses the codec.
+    EXPECT_TRUE(c.value()->send(duct::Message::from_string(small + small), {}).ok());
+#if !defined(_WIN32)
+    EXPECT_TRUE(wire_bytes_queued(*s.value()) >= 2 * small.size());
+#endif
+    auto first = s.value()->recv({});
+    EXPECT_TRUE(first.ok() && first.value().as_string_view() == small + small);
+    EXPECT_TRUE(s.value()->send(duct::Message::from_string("ready"), {}).ok());
+    first = c.value()->recv({});
+    EXPECT_TRUE(first.ok() && first.value().as_string_view() == "ready");
+
+    duct::SendOptions on3;
+    on3.channel = 3;
+    EXPECT_TRUE(c.value()->send(duct::Message::from_string(text), on3).ok());
+#if !defined(_WIN32)
+    EXPECT_TRUE(wire_bytes_queued(*s.value()) < text.size() / 3);
+#endif
+    auto m = s.value()->recv({});
+    EXPECT_TRUE(m.ok() && m.value().as_string_view() == text && m.value().channel() == 3);
+
+    EXPECT_TRUE(c.value()->send(duct::Message::from_string(small), {}).ok());
+    EXPECT_TRUE(c.value()->send(duct::Message::from_string(big), {}).ok());
+    m = s.value()->recv({});
+    EXPECT_TRUE(m.ok() && m.value().as_string_view() == small);
+    m = s.value()->recv({});
+    EXPECT_TRUE(m.ok() && m.value().as_string_view() == big);
+
+    // The accepted side compresses too, including reserve()/commit() frames.
+    auto buf = s.value()->reserve(text.size() / 4, {});
+    EXPECT_TRUE(buf.ok());
+    if (!buf.ok()) return;
+    std::memcpy(buf.value().data(), text.data(), text.size() / 4);
+    EXPECT_TRUE(s.value()->commit(text.size() / 4, on3).ok());
+    EXPECT_TRUE(s.value()->send(duct::Message::from_string(big), {}).ok());
+#if !defined(_WIN32)
+    EXPECT_TRUE(wire_bytes_queued(*c.value()) < (text.size() / 4 + big.size()) / 3);
+#endif
+    m = c.value()->recv({});
+    EXPECT_TRUE(m.ok() && m.value().as_string_view() == std::string_view(text).substr(0, text.size() / 4) &&
+                m.value().channel() == 3);
+    m = c.value()->recv({});
+    EXPECT_TRUE(m.ok() && m.value().as_string_view() == big);
+    c.value()->close();
+    s.value()->close();
+    lis_r.value()->close();
+  }
+}
+
+static void test_compression_dictionary() {
+  if (!duct::compression_supported(duct::Compression::kZstd)) return;
+  // Small messages that share most of their bytes with the dictionary but little with each other.
+  const std::string sample = "{\"type\":\"order\",\"status\":\"accepted\",\"venue\":\"primary\",\"currency\":\"EUR\"}";
+  auto dict = std::make_shared<const std::vector<std::uint8_t>>(sample.begin(), sample.end());
+  auto message = [&](int i) {
+    std::string m = sample;
+    m.insert(1, "\"seq\":" + std::to_string(i) + ",");
+    return m;
+  };
+  auto run = [&](const std::shared_ptr<const std::vector<std::uint8_t>>& ours,
+                 const std::shared_ptr<const std::vector<std::uint8_t>>& theirs, std::size_t* wire) {
+    duct::ListenOptions lopt;
+    lopt.compression.codec = duct::Compression::kZstd;
+    lopt.compression.dictionary = theirs;
+    auto lis_r = duct::listen("tcp://127.0.0.1:0", lopt);
+    EXPECT_TRUE(lis_r.ok());
+    if (!lis_r.ok()) return false;
+    auto addr = lis_r.value()->local_address();
+    duct::DialOptions dopt;
+    dopt.qos.snd_hwm_bytes = 0;
+    dopt.qos.rcv_hwm_bytes = 0;
+    dopt.compression.codec = duct::Compression::kZstd;
+    dopt.compression.min_bytes = 0;
+    dopt.compression.dictionary = ours;
+    auto c = duct::dial(addr.value(), dopt);
+    auto s = lis_r.value()->accept();
+    EXPECT_TRUE(c.ok() && s.ok());
+    if (!c.ok() || !s.ok()) return false;
+    // Hellos both ways first: the dialer learns the listener's dictionary from its answer.
+    EXPECT_TRUE(c.value()->send(duct::Message::from_string("hi"), {}).ok());
+    auto hi = s.value()->recv({});
+    EXPECT_TRUE(s.value()->send(duct::Message::from_string("hi"), {}).ok());
+    hi = c.value()->recv({});
+    EXPECT_TRUE(hi.ok() && hi.value().as_string_view() == "hi");
+    bool delivered = true;
+    for (int i = 0; i < 10; ++i) EXPECT_TRUE(c.value()->send(duct::Message::from_string(message(i)), {}).ok());
+#if !defined(_WIN32)
+    *wire = wire_bytes_queued(*s.value());
+#else
+    (void)wire;
+#endif
+    for (int i = 0; i < 10 && delivered; ++i) {
+      auto m = s.value()->recv({});
+      delivered = m.ok() && m.value().as_string_view() == message(i);
+    }
+    c.value()->close();
+    s.value()->close();
+    lis_r.value()->close();
+    return delivered;
+  };
+  std::size_t with_dict = 0;
+  std::size_t without = 0;
+  EXPECT_TRUE(run(dict, dict, &with_dict));
+  EXPECT_TRUE(run(nullptr, nullptr, &without));
+#if !defined(_WIN32)
+  EXPECT_TRUE(with_dict < without * 2 / 3);
+#endif
+  // A listener without our dictionary gets raw frames instead of ones it cannot decode.
+  std::size_t raw = 0;
+  EXPECT_TRUE(run(dict, nullptr, &raw));
+#if !defined(_WIN32)
+  EXPECT_TRUE(raw >= 10 * sample.size());
+#endif
+}
+
+static void test_wire_frame_reader() {
+#if !defined(_WIN32)
+  int fds[2]{-1, -1};
+  int rc = ::socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+  EXPECT_TRUE(rc == 0);
+  if (rc != 0) return;
+
+  // Enough traffic to span several receive buffers while every message is still held.
+  constexpr int kCount = 2000;
+  std::thread writer([&] {
+    std::vector<duct::Message> batch;
+    for (int i = 0; i < kCount; ++i) {
+      batch.push_back(duct::Message::from_string(std::string(static_cast<std::size_t>(i % 700), 'a' + i % 26)));
+    }
+    (void)duct::wire::write_frames(fds[0], batch);
+    ::close(fds[0]);
+  });
+
+  duct::wire::FrameReader reader;
+  std::vector<duct::Message> got;
+  bool shared = false;
+  for (int i = 0; i < kCount; ++i) {
+    auto m = reader.read(fds[1]);
+    EXPECT_TRUE(m.ok());
+    if (!m.ok()) break;
+    if (!got.empty() && got.back().shares_storage_with(m.value())) shared = true;
+    got.push_back(std::move(m.value()));
+  }
+  writer.join();
+
+  // Frames parsed from one receive share its storage instead of getting their own copies.
+  EXPECT_TRUE(shared);
+  EXPECT_EQ(got.size(), static_cast<std::size_t>(kCount));
+  for (std::size_t i = 0; i < got.size(); ++i) {
+    EXPECT_EQ(std::string(got[i].as_string_view()), std::string(i % 700, static_cast<char>('a' + i % 26)));
+  }
+
+  auto eof = reader.read(fds[1]);
+  EXPECT_TRUE(!eof.ok());
+  if (!eof.ok()) EXPECT_EQ(eof.status().code(), duct::StatusCode::kClosed);
+  ::close(fds[1]);
+#endif
+}
+
+#if defined(__linux__)
+// Passes `fd` (SCM_RIGHTS) with `bytes`, the way write_fd_frame() does.
+static bool send_with_fd(int sock, const std::uint8_t* bytes, std::size_t n, int fd) {
+  iovec iov{const_cast<std::uint8_t*>(bytes), n};
+  alignas(cmsghdr) char ctrl[CMSG_SPACE(sizeof(int))];
+  msghdr mh{};
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  mh.msg_control = ctrl;
+  mh.msg_controllen = sizeof(ctrl);
+  cmsghdr* c = CMSG_FIRSTHDR(&mh);
+  c->cmsg_level = SOL_SOCKET;
+  c->cmsg_type = SCM_RIGHTS;
+  c->cmsg_len = CMSG_LEN(sizeof(int));
+  std::memcpy(CMSG_DATA(c), &fd, sizeof(int));
+  return ::sendmsg(sock, &mh, 0) == static_cast<ssize_t>(n);
+}
+
+// A descriptor frame must carry a sealed memfd, and descriptors without frames are not hoarded.
+static void test_wire_passed_descriptors() {
+  {
+    int fds[2]{-1, -1};
+    EXPECT_TRUE(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    // A plain file: F_GET_SEALS fails on it, so it must not pass as sealed.
+    FILE* f = std::tmpfile();
+    EXPECT_TRUE(f != nullptr);
+    if (f == nullptr) return;
+    const std::string body(4096, 'x');
+    std::fwrite(body.data(), 1, body.size(), f);
+    std::fflush(f);
+
+    duct::wire::FrameHeader h;
+    h.magic = duct::kProtocolMagic;
+    h.version = duct::kProtocolVersion;
+    h.header_len = static_cast<std::uint16_t>(duct::wire::kHeaderLen);
+    h.payload_len = 8;
+    h.flags = static_cast<std::uint32_t>(duct::FrameFlags::kFdPayload);
+    std::uint8_t frame[duct::wire::kHeaderLen + 8] = {};
+    duct::wire::encode_header(h, frame);
+    frame[duct::wire::kHeaderLen + 6] = static_cast<std::uint8_t>(body.size() >> 8);  // big-endian size
+    EXPECT_TRUE(send_with_fd(fds[0], frame, sizeof(frame), ::fileno(f)));
+    std::fclose(f);
+
+    duct::wire::FrameReader reader;
+    reader.set_descriptor_passing(true);
+    auto m = reader.read(fds[1]);
+    EXPECT_TRUE(!m.ok());
+    if (!m.ok()) EXPECT_EQ(m.status().code(), duct::StatusCode::kProtocolError);
+    ::close(fds[0]);
+    ::close(fds[1]);
+  }
+  {
+    int fds[2]{-1, -1};
+    EXPECT_TRUE(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    const int null_fd = ::open("/dev/null", O_RDONLY);
+    EXPECT_TRUE(null_fd >= 0);
+    // One byte of a frame header per descriptor: the frame never completes.
+    const std::uint8_t b = 0;
+    bool sent = true;
+    for (int i = 0; i < 100 && sent; ++i) sent = send_with_fd(fds[0], &b, 1, null_fd);
+    EXPECT_TRUE(sent);
+    ::close(null_fd);
+    ::close(fds[0]);
+
+    duct::wire::FrameReader reader;
+    reader.set_descriptor_passing(true);
+    auto m = reader.read(fds[1]);
+    EXPECT_TRUE(!m.ok());
+    if (!m.ok()) EXPECT_EQ(m.status().code(), duct::StatusCode::kProtocolError);
+    ::close(fds[1]);
+  }
+}
+#endif
+}  // namespace
+
 int main() {
   test_address_parse();
+  test_status_literal_messages();
+  test_message_pool_recycles();
+  test_message_slice_adopt_inline();
+  test_metrics();
+  test_async_logger();
+  test_ring_message_queue();
   test_shm_echo_one();
   test_pipe_echo_one();
   test_shm_backpressure_timeout();
   test_shm_burst_without_receiver();
+  test_shm_slab_mixed_sizes();
+  test_shm_byte_ring_mixed_sizes();
+  test_shm_byte_ring_tiny_burst();
+  test_shm_park_and_wake();
+  test_shm_batch();
+  test_shm_zero_copy_leases();
+#if !defined(_WIN32)
+  test_shm_segment_pool();
+#endif
+  test_reserve_commit();
+  test_large_messages();
+#if !defined(_WIN32)
+  test_shm_broadcast();
+#endif
+  test_reassembly_limit();
+#if !defined(_WIN32)
+  test_shm_poll_handle();
+#endif
+  test_reactor_dispatches_ready_pipes();
+  test_reactor_engine_echo(duct::ReactorBackend::kIoUring);
+  test_reactor_engine_echo(duct::ReactorBackend::kIocp);
+  test_reactor_post();
+  test_coroutines();
+  test_server_shards(false);
+  test_server_shards(true);
+  test_tcp_try_accept();
+  test_tcp_send_batch();
+#if !defined(_WIN32)
+  test_uds_memfd_payloads();
+#endif
+  test_inproc_pipes();
+  test_qos_pipe_send_queue();
+  test_qos_pipe_channels();
+  test_qos_pipe_fragment_interleave();
+  test_token_bucket();
+  test_qos_pipe_rate_limit();
+  test_qos_pipe_recv_queue();
+  test_qos_pipe_background();
+  test_qos_pipe_flush_policy();
+  test_pipe_metrics();
+  test_pipe_tracing();
+  test_reliable_pipe();
+  test_reliable_pipe_loss();
+  test_reliable_pipe_reconnect();
+  test_reconnect_fast_path();
+  test_dial_endpoint_list();
+  test_mux_streams();
+  test_mux_flow_control();
+  test_request_reply();
   test_wire_decode_rejects_bad_magic();
   test_wire_socketpair_frames();
+  test_wire_frame_reader();
+#if defined(__linux__)
+  test_wire_passed_descriptors();
+#endif
+  test_wire_compact_header();
+  test_wire_compact_frames();
+  test_compact_frames_negotiation();
+  test_compressed_pipes();
+  test_compression_dictionary();
   test_wire_write_no_sigpipe_on_macos();
 
   if (g_failures != 0) {